@@ -0,0 +1,98 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <fstream>
+#include <ibmisc/fortranio.hpp>
+#include <ibmisc/endian.hpp>
+
+using namespace ibmisc;
+
+int const NREC = 20;
+
+/** Writes NREC records of n*n floats, as gfortran would (4-byte
+record markers), in the given byte order.
+@return Name of the file */
+static std::string write_sample(int n, Endian endian)
+{
+    std::string fname("__bench_fortranio_" + std::to_string(n)
+        + (endian == Endian::BIG ? "_be" : "_le"));
+    std::vector<float> vals(n*n);
+    for (int i=0; i<n*n; ++i) vals[i] = 270. + .001*i;
+    int32_t marker = vals.size() * sizeof(float);
+
+    endian_to_native((char *)&vals[0], sizeof(float), vals.size(), endian);
+    endian_to_native((char *)&marker, sizeof(marker), 1, endian);    // (Swapping is symmetric)
+
+    std::ofstream fout(fname, std::ios::binary);
+    for (int rec=0; rec<NREC; ++rec) {
+        fout.write((char *)&marker, sizeof(marker));
+        fout.write((char *)&vals[0], vals.size()*sizeof(float));
+        fout.write((char *)&marker, sizeof(marker));
+    }
+    return fname;
+}
+
+/** Args: {n, use_mmap} */
+static void BM_fortran_read(benchmark::State &state, Endian endian)
+{
+    int const n = state.range(0);
+    bool const use_mmap = state.range(1);
+    std::string const fname(write_sample(n, endian));
+
+    blitz::Array<float,2> buf(n, n, blitz::fortranArray);
+    for (auto _ : state) {
+        fortran::UnformattedInput fin(fname, endian, use_mmap);
+        for (int rec=0; rec<NREC; ++rec) {
+            fortran::read(fin) >> buf >> fortran::endr;
+        }
+        benchmark::DoNotOptimize(buf.data());
+    }
+    state.SetBytesProcessed(state.iterations() * NREC * n * n * sizeof(float));
+    ::remove(fname.c_str());
+}
+
+/** Zero-copy reads, where possible (mmap and native byte order) */
+static void BM_fortran_view(benchmark::State &state, Endian endian)
+{
+    int const n = state.range(0);
+    std::string const fname(write_sample(n, endian));
+
+    blitz::Array<float,2> buf;
+    for (auto _ : state) {
+        fortran::UnformattedInput fin(fname, endian, true);
+        double sum = 0;
+        for (int rec=0; rec<NREC; ++rec) {
+            fortran::read(fin) >> fortran::view(buf, blitz::shape(n,n)) >> fortran::endr;
+            sum += buf(1,1);
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetBytesProcessed(state.iterations() * NREC * n * n * sizeof(float));
+    ::remove(fname.c_str());
+}
+
+#define FORTRAN_ARGS ->ArgsProduct({{144, 720}, {0, 1}})->Unit(benchmark::kMillisecond)
+
+BENCHMARK_CAPTURE(BM_fortran_read, le, Endian::LITTLE) FORTRAN_ARGS;
+BENCHMARK_CAPTURE(BM_fortran_read, be, Endian::BIG) FORTRAN_ARGS;
+BENCHMARK_CAPTURE(BM_fortran_view, le, Endian::LITTLE)->Arg(144)->Arg(720)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_fortran_view, be, Endian::BIG)->Arg(144)->Arg(720)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,139 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <vector>
+#include <ibmisc/indexing.hpp>
+
+using namespace ibmisc;
+
+/** A 3-D ice model grid: (nhc, nj, ni) */
+static Indexing make_indexing(long n)
+{
+    return Indexing(
+        {"nhc", "nj", "ni"},
+        {0,0,0},
+        {10, n, 2*n},
+        {0,1,2});    // Row major
+}
+
+/** Args: {n} */
+static void BM_Indexing_index_to_tuple(benchmark::State &state)
+{
+    Indexing const ind(make_indexing(state.range(0)));
+    long const nix = ind.extent();
+    for (auto _ : state) {
+        long sum = 0;
+        for (long ix=0; ix<nix; ++ix) {
+            auto tuple(ind.index_to_tuple<int,3>(ix));
+            sum += tuple[2];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * nix);
+}
+
+static void BM_Indexing_tuple_to_index(benchmark::State &state)
+{
+    Indexing const ind(make_indexing(state.range(0)));
+    long const nix = ind.extent();
+    for (auto _ : state) {
+        long sum = 0;
+        std::array<int,3> tuple;
+        for (tuple[0]=0; tuple[0]<ind[0].extent; ++tuple[0])
+        for (tuple[1]=0; tuple[1]<ind[1].extent; ++tuple[1])
+        for (tuple[2]=0; tuple[2]<ind[2].extent; ++tuple[2])
+            sum += ind.tuple_to_index(tuple);
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * nix);
+}
+
+static void BM_CompiledIndexing_index_to_tuple(benchmark::State &state)
+{
+    Indexing const ind(make_indexing(state.range(0)));
+    CompiledIndexing<3> const cind(ind);
+    long const nix = ind.extent();
+
+    std::vector<long> ixs(nix);
+    for (long ix=0; ix<nix; ++ix) ixs[ix] = ix;
+    std::vector<int> tuples(nix*3);
+    for (auto _ : state) {
+        cind.index_to_tuple(nix, &ixs[0], &tuples[0]);
+        benchmark::DoNotOptimize(tuples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * nix);
+}
+
+static void BM_CompiledIndexing_tuple_to_index(benchmark::State &state)
+{
+    Indexing const ind(make_indexing(state.range(0)));
+    CompiledIndexing<3> const cind(ind);
+    long const nix = ind.extent();
+
+    std::vector<int> tuples(nix*3);
+    for (long ix=0; ix<nix; ++ix) cind.index_to_tuple(&tuples[ix*3], ix);
+    std::vector<long> ixs(nix);
+    for (auto _ : state) {
+        cind.tuple_to_index(nix, &tuples[0], &ixs[0]);
+        benchmark::DoNotOptimize(ixs.data());
+    }
+    state.SetItemsProcessed(state.iterations() * nix);
+}
+
+/** The same grid in ModelE order, (im,jm,ihc) Fortran-order, into C
+order.  Args: {n, nthreads} */
+static void BM_reorder_f_to_c(benchmark::State &state)
+{
+    long const n = state.range(0);
+    Indexing const ic(make_indexing(n));
+    Indexing const ifo({"nhc", "nj", "ni"}, {0,0,0}, {10, n, 2*n}, {2,1,0});
+    std::vector<double> src(ic.extent(), 1.), dst(ic.extent());
+
+    for (auto _ : state) {
+        reorder(ic, &dst[0], ifo, (double const *)&src[0], state.range(1));
+        benchmark::DoNotOptimize(dst.data());
+    }
+    state.SetBytesProcessed(state.iterations() * ic.extent() * 2 * sizeof(double));
+}
+
+/** Same, through Blitz assignment */
+static void BM_blitz_assign_f_to_c(benchmark::State &state)
+{
+    long const n = state.range(0);
+    blitz::Array<double,3> src(10, n, 2*n, blitz::fortranArray);
+    blitz::Array<double,3> dst(10, n, 2*n);
+    src = 1.;
+
+    for (auto _ : state) {
+        dst = src;
+        benchmark::DoNotOptimize(dst.data());
+    }
+    state.SetBytesProcessed(state.iterations() * src.size() * 2 * sizeof(double));
+}
+
+#define INDEXING_ARGS ->Arg(90)->Arg(180)->Arg(360)->Unit(benchmark::kMicrosecond)
+
+BENCHMARK(BM_Indexing_index_to_tuple) INDEXING_ARGS;
+BENCHMARK(BM_Indexing_tuple_to_index) INDEXING_ARGS;
+BENCHMARK(BM_CompiledIndexing_index_to_tuple) INDEXING_ARGS;
+BENCHMARK(BM_CompiledIndexing_tuple_to_index) INDEXING_ARGS;
+BENCHMARK(BM_reorder_f_to_c)->ArgsProduct({{180, 720}, {1, 4}})->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_blitz_assign_f_to_c) INDEXING_ARGS;
+
+BENCHMARK_MAIN();
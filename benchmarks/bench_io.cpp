@@ -0,0 +1,460 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// End-to-end I/O benchmarks: whole synthetic files, written and read
+// through the library's I/O paths, on the filesystem being measured.
+//
+//    bench_io --dir=/lustre/scratch/$USER --size_mb=256,2048
+//        --benchmark_format=json --benchmark_out=lustre.json
+//
+// Our own options (the rest go to Google Benchmark):
+//    --dir=DIR         Where to put the files (default .)
+//    --size_mb=N,...   File sizes to try (default 16,256)
+//    --iterations=N    Iterations of each benchmark (default 3)
+//    --warm            Leave files in the page cache before each read
+//
+// Besides time and bytes_per_second (of the data, before compression),
+// each benchmark reports: calls (library I/O calls per iteration),
+// file_MB, fs_reads / fs_writes (filesystem block operations per
+// iteration, from getrusage()) and peak_rss_MB.
+
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <ibmisc/netcdf.hpp>
+#include <ibmisc/bundle.hpp>
+#include <ibmisc/zarray.hpp>
+#include <ibmisc/ncbulk.hpp>
+#include <ibmisc/filesystem.hpp>
+#include <ibmisc/fortranio.hpp>
+#include <ibmisc/endian.hpp>
+#include <ibmisc/string.hpp>
+
+using namespace ibmisc;
+
+namespace {
+
+struct Options {
+    std::string dir = ".";
+    std::vector<long> sizes_mb = {16, 256};
+    int iterations = 3;
+    bool cold = true;
+} opt;
+
+/** Fields are nj x ni doubles (4 MiB) */
+int const nj = 512;
+int const ni = 1024;
+long const field_bytes = (long)nj * ni * sizeof(double);
+
+long nfields(long size_mb)
+    { return std::max(1L, (size_mb << 20) / field_bytes); }
+
+std::string bench_file(std::string const &name)
+{
+    return opt.dir + "/__bench_io_" + name + "_"
+        + std::to_string(getpid());
+}
+
+/** A smooth field plus noise, so it compresses about like model output */
+void fill_field(double *data, int seed)
+{
+    uint32_t x = 2463534242u + seed;
+    for (int j=0; j<nj; ++j)
+    for (int i=0; i<ni; ++i) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;    // xorshift32
+        data[(long)j*ni + i] = 270. + 30.*sin(.01*j + .1*seed) * cos(.005*i)
+            + 1e-3*(x >> 8) / (1 << 24);
+    }
+}
+
+/** Evicts a file from the page cache, so the next read comes from
+the filesystem (best effort: only clean pages are dropped). */
+void drop_cache(std::string const &fname)
+{
+    if (!opt.cold) return;
+    int const fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+long file_size(std::string const &fname)
+{
+    struct stat st;
+    return ::stat(fname.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+/** Resets the peak RSS (VmHWM) where Linux allows it */
+void reset_peak_rss()
+{
+    std::ofstream fout("/proc/self/clear_refs");
+    if (fout) fout << "5";
+}
+
+double peak_rss_mb()
+{
+    std::ifstream fin("/proc/self/status");
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return atol(line.c_str() + 6) / 1024.;    // kB
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024.;    // Since the process started
+}
+
+/** Filesystem activity and memory over one benchmark */
+class IOCounters {
+    struct rusage ru0;
+public:
+    IOCounters() { reset_peak_rss(); getrusage(RUSAGE_SELF, &ru0); }
+
+    /** @param data_bytes Bytes read or written per iteration
+    @param calls Library I/O calls per iteration
+    @param file_bytes Size of the file(s) on disk */
+    void report(benchmark::State &state, long data_bytes, long calls,
+        long file_bytes)
+    {
+        struct rusage ru1;
+        getrusage(RUSAGE_SELF, &ru1);
+        auto const avg(benchmark::Counter::kAvgIterations);
+        state.SetBytesProcessed(state.iterations() * data_bytes);
+        state.counters["calls"] = calls;
+        state.counters["file_MB"] = file_bytes / 1048576.;
+        state.counters["fs_reads"] = benchmark::Counter(ru1.ru_inblock - ru0.ru_inblock, avg);
+        state.counters["fs_writes"] = benchmark::Counter(ru1.ru_oublock - ru0.ru_oublock, avg);
+        state.counters["peak_rss_MB"] = peak_rss_mb();
+    }
+};
+
+// ------------------------------------------------------------
+/** Compression and chunking configurations for NcIO */
+struct NamedConfig {
+    char const *name;
+    NcVarConfig config;
+};
+
+std::vector<NamedConfig> const &nc_configs()
+{
+    static std::vector<NamedConfig> ret;
+    if (ret.empty()) {
+        ret.push_back({"raw", NcVarConfig::fast_write()});
+        ret.push_back({"deflate1", NcVarConfig::fast_read()});
+        ret.push_back({"deflate4", NcVarConfig()});
+
+        NcVarConfig tiles;    // Small chunks, as for reading subdomains
+        tiles.dim_chunks = {{"nj", 128}, {"ni", 128}};
+        ret.push_back({"deflate4_tiles", tiles});
+
+        NcVarConfig quant;
+        quant.quantize = NcVarConfig::Quantize(3);
+        ret.push_back({"quantize3", quant});
+    }
+    return ret;
+}
+
+/** Data for one file: nrec records of an (nj, ni) field */
+blitz::Array<double,3> make_records(long nrec)
+{
+    blitz::Array<double,3> arr(nrec, nj, ni);
+    for (long rec=0; rec<nrec; ++rec) fill_field(&arr(rec,0,0), rec);
+    return arr;
+}
+
+void write_records(std::string const &fname, NcVarConfig const &config,
+    blitz::Array<double,3> &arr)
+{
+    NcIO ncio(fname, 'w', "nc4", config);
+    auto dims(get_or_add_dims(ncio, arr, {"rec", "nj", "ni"}));
+    ncio_blitz(ncio, arr, "T", "double", dims);
+}
+
+/** Args: {size_mb} */
+void BM_NcIO_write(benchmark::State &state, int iconfig)
+{
+    auto const &config(nc_configs()[iconfig]);
+    std::string const fname(bench_file(std::string("ncio_") + config.name) + ".nc");
+    auto arr(make_records(nfields(state.range(0))));
+
+    IOCounters counters;
+    for (auto _ : state) {
+        write_records(fname, config.config, arr);
+    }
+    counters.report(state, arr.size() * sizeof(double), 1, file_size(fname));
+    ::remove(fname.c_str());
+}
+
+void BM_NcIO_read(benchmark::State &state, int iconfig)
+{
+    auto const &config(nc_configs()[iconfig]);
+    std::string const fname(bench_file(std::string("ncio_") + config.name) + ".nc");
+    auto arr(make_records(nfields(state.range(0))));
+    write_records(fname, config.config, arr);
+
+    IOCounters counters;
+    for (auto _ : state) {
+        state.PauseTiming();
+        drop_cache(fname);
+        state.ResumeTiming();
+
+        NcIO ncio(fname, 'r');
+        ncio.configure_read_var = std::bind(&NcVarConfig::configure_read,
+            &config.config, std::placeholders::_1);
+        ncio_blitz(ncio, arr, "T", "double", {});
+        ncio.close();
+        benchmark::DoNotOptimize(arr.data());
+    }
+    counters.report(state, arr.size() * sizeof(double), 1, file_size(fname));
+    ::remove(fname.c_str());
+}
+
+// ------------------------------------------------------------
+/** One (nj, ni) variable per field */
+struct FieldBundle : public ArrayBundle<double,2> {
+    FieldBundle(long nvar)
+    {
+        for (long i=0; i<nvar; ++i) {
+            add("v" + std::to_string(i), {nj, ni}, {"nj", "ni"}, {
+                "units", "K"
+            });
+        }
+        allocate(true);
+        for (long i=0; i<nvar; ++i) fill_field(data[i].arr->data(), i);
+    }
+};
+
+/** Args: {size_mb} */
+void BM_ArrayBundle_ncio(benchmark::State &state, char rw)
+{
+    std::string const fname(bench_file("bundle") + ".nc");
+    long const nvar = nfields(state.range(0));
+    FieldBundle bundle(nvar);
+    if (rw == 'r') {
+        NcIO ncio(fname, 'w');
+        bundle.ncio(ncio, {}, "", "double");
+    }
+
+    IOCounters counters;
+    for (auto _ : state) {
+        if (rw == 'r') {
+            state.PauseTiming();
+            drop_cache(fname);
+            state.ResumeTiming();
+        }
+        NcIO ncio(fname, rw);
+        bundle.ncio(ncio, {}, "", "double");
+        ncio.close();
+    }
+    counters.report(state, nvar * field_bytes, nvar, file_size(fname));
+    ::remove(fname.c_str());
+}
+
+// ------------------------------------------------------------
+/** A banded sparse matrix of about size_mb of (int, int, double)
+triplets, repeating the sparsity pattern of a regrid matrix */
+ZArray<int,double,2> make_zarray(long size_mb, long &nnz)
+{
+    long const n = std::max(1L, (size_mb << 20) / 16 / 8);
+    ZArray<int,double,2> za({n, 4*n + 24});
+    {auto accum(za.accum(1 << 16));
+        for (int i=0; i<n; ++i) {
+            for (int k=0; k<8; ++k) accum.add({i, 4*i + 3*k}, 1. + .01*(i % 97) + .1*k);
+        }
+    }
+    nnz = za.nnz();
+    return za;
+}
+
+/** Args: {size_mb} */
+void BM_ZArray_ncio(benchmark::State &state, char rw)
+{
+    std::string const fname(bench_file("zarray") + ".nc");
+    long nnz;
+    auto za(make_zarray(state.range(0), nnz));
+    if (rw == 'r') {
+        NcIO ncio(fname, 'w');
+        za.ncio(ncio, "M");
+    }
+
+    IOCounters counters;
+    for (auto _ : state) {
+        if (rw == 'r') {
+            state.PauseTiming();
+            drop_cache(fname);
+            state.ResumeTiming();
+
+            ZArray<int,double,2> za2;
+            NcIO ncio(fname, 'r');
+            za2.ncio(ncio, "M");
+            ncio.close();
+            benchmark::DoNotOptimize(za2.nnz());
+        } else {
+            NcIO ncio(fname, 'w');
+            za.ncio(ncio, "M");
+            ncio.close();
+        }
+    }
+    counters.report(state, nnz * (2*sizeof(int) + sizeof(double)), 1, file_size(fname));
+    ::remove(fname.c_str());
+}
+
+// ------------------------------------------------------------
+/** Reads one field from each of the files, the way model inputs
+are gathered from many files.  Args: {size_mb, nthreads} */
+void BM_NcBulkReader(benchmark::State &state)
+{
+    long const nfile = nfields(state.range(0));
+    std::vector<std::string> fnames, vars;
+    std::vector<blitz::Array<double,2>> arrs(nfile);
+    for (long i=0; i<nfile; ++i) {
+        std::string const leaf("__bench_io_bulk_" + std::to_string(getpid())
+            + "_" + std::to_string(i) + ".nc");
+        fnames.push_back(opt.dir + "/" + leaf);
+        vars.insert(vars.end(), {"v" + std::to_string(i), leaf, "T"});
+
+        arrs[i].reference(blitz::Array<double,2>(nj, ni));
+        fill_field(arrs[i].data(), i);
+        NcIO ncio(fnames.back(), 'w');
+        auto dims(get_or_add_dims(ncio, arrs[i], {"nj", "ni"}));
+        ncio_blitz(ncio, arrs[i], "T", "double", dims);
+    }
+    CachedSearchPath locator("bench_io", {opt.dir});
+
+    IOCounters counters;
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (auto const &fname : fnames) drop_cache(fname);
+        state.ResumeTiming();
+
+        NcBulkReader bulk(&locator, vars);
+        bulk.nthreads = state.range(1);
+        for (long i=0; i<nfile; ++i) bulk("v" + std::to_string(i), arrs[i]);
+        bulk();
+    }
+    long file_bytes = 0;
+    for (auto const &fname : fnames) file_bytes += file_size(fname);
+    counters.report(state, nfile * field_bytes, nfile, file_bytes);
+    for (auto const &fname : fnames) ::remove(fname.c_str());
+}
+
+// ------------------------------------------------------------
+/** Args: {size_mb, use_mmap} */
+void BM_fortran_read(benchmark::State &state)
+{
+    std::string const fname(bench_file("fortran") + ".dat");
+    long const nrec = nfields(state.range(0));
+    bool const use_mmap = state.range(1);
+
+    // Big-endian float records, as gfortran -fconvert=big-endian writes
+    blitz::Array<float,2> buf(nj, ni);
+    {std::vector<double> field(nj*ni);
+        std::vector<float> vals(nj*ni);
+        int32_t marker = vals.size() * sizeof(float);
+        endian_to_native((char *)&marker, sizeof(marker), 1, Endian::BIG);
+        std::ofstream fout(fname, std::ios::binary);
+        for (long rec=0; rec<nrec; ++rec) {
+            fill_field(&field[0], rec);
+            std::copy(field.begin(), field.end(), vals.begin());
+            endian_to_native((char *)&vals[0], sizeof(float), vals.size(), Endian::BIG);
+            fout.write((char *)&marker, sizeof(marker));
+            fout.write((char *)&vals[0], vals.size()*sizeof(float));
+            fout.write((char *)&marker, sizeof(marker));
+        }
+    }
+
+    IOCounters counters;
+    for (auto _ : state) {
+        state.PauseTiming();
+        drop_cache(fname);
+        state.ResumeTiming();
+
+        fortran::UnformattedInput fin(fname, Endian::BIG, use_mmap);
+        for (long rec=0; rec<nrec; ++rec) {
+            fortran::read(fin) >> buf >> fortran::endr;
+        }
+        benchmark::DoNotOptimize(buf.data());
+    }
+    counters.report(state, nrec * nj * ni * sizeof(float), nrec, file_size(fname));
+    ::remove(fname.c_str());
+}
+
+// ------------------------------------------------------------
+/** Removes our options from argv, leaving the rest for Google Benchmark */
+void parse_options(int &argc, char **argv)
+{
+    int j = 1;
+    for (int i=1; i<argc; ++i) {
+        std::string const arg(argv[i]);
+        auto const eq(arg.find('='));
+        std::string const name(arg.substr(0, eq));
+        std::string const val(eq == std::string::npos ? "" : arg.substr(eq+1));
+
+        if (name == "--dir") opt.dir = val;
+        else if (name == "--size_mb") {
+            opt.sizes_mb.clear();
+            for (auto const &s : split<std::string>(val, ",")) opt.sizes_mb.push_back(atol(s.c_str()));
+        }
+        else if (name == "--iterations") opt.iterations = atoi(val.c_str());
+        else if (name == "--warm") opt.cold = false;
+        else argv[j++] = argv[i];
+    }
+    argc = j;
+}
+
+template<class BenchT>
+void configure(BenchT *bench, std::vector<long> const &extra = {0})
+{
+    for (long mb : opt.sizes_mb) {
+        for (long x : extra) bench->Args({mb, x});
+    }
+    bench->Iterations(opt.iterations)->UseRealTime()->Unit(benchmark::kMillisecond);
+}
+
+}    // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    parse_options(argc, argv);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+
+    auto const &configs(nc_configs());
+    for (int i=0; i<(int)configs.size(); ++i) {
+        configure(benchmark::RegisterBenchmark(
+            (std::string("NcIO_write/") + configs[i].name).c_str(), BM_NcIO_write, i));
+        configure(benchmark::RegisterBenchmark(
+            (std::string("NcIO_read/") + configs[i].name).c_str(), BM_NcIO_read, i));
+    }
+    configure(benchmark::RegisterBenchmark("ArrayBundle_ncio/write", BM_ArrayBundle_ncio, 'w'));
+    configure(benchmark::RegisterBenchmark("ArrayBundle_ncio/read", BM_ArrayBundle_ncio, 'r'));
+    configure(benchmark::RegisterBenchmark("ZArray_ncio/write", BM_ZArray_ncio, 'w'));
+    configure(benchmark::RegisterBenchmark("ZArray_ncio/read", BM_ZArray_ncio, 'r'));
+    configure(benchmark::RegisterBenchmark("NcBulkReader", BM_NcBulkReader), {1, 4});
+    configure(benchmark::RegisterBenchmark("fortran_read", BM_fortran_read), {0, 1});
+
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
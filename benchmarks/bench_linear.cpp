@@ -0,0 +1,105 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <map>
+#include <memory>
+#include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/compressed.hpp>
+#include <ibmisc/linear/runlength.hpp>
+#include <ibmisc/linear/tuple.hpp>
+#include "synthetic.hpp"
+
+using namespace ibmisc;
+
+/** Regrid matrices at each size, in each format; built once. */
+static linear::Weighted const &get_matrix(linear::LinearType type, int nA_side)
+{
+    static std::map<std::pair<int,int>, std::unique_ptr<linear::Weighted>> cache;
+    auto key(std::make_pair(type.index(), nA_side));
+    auto ii(cache.find(key));
+    if (ii != cache.end()) return *ii->second;
+
+    auto tuple(bench::regrid_matrix(nA_side, 4));
+    std::unique_ptr<linear::Weighted> ret;
+    switch(type.index()) {
+        case linear::LinearType::TUPLE :
+            ret.reset(new linear::Weighted_Tuple(std::move(tuple)));
+        break;
+        case linear::LinearType::EIGEN :
+            ret = to_eigen(tuple);
+        break;
+        case linear::LinearType::COMPRESSED :
+            ret.reset(new linear::Weighted_Compressed(compress(*to_eigen(tuple))));
+        break;
+        case linear::LinearType::RUNLENGTH :
+            ret.reset(new linear::Weighted_RL(to_runlength(*to_eigen(tuple))));
+        break;
+    }
+    auto &ref(*ret);
+    cache[key] = std::move(ret);
+    return ref;
+}
+
+/** Args: {nA_side, nvec} */
+static void BM_apply_M(benchmark::State &state, linear::LinearType type)
+{
+    int const nA_side = state.range(0);
+    int const nvec = state.range(1);
+    auto const &BvA(get_matrix(type, nA_side));
+    auto shape(BvA.shape());
+
+    auto As(bench::random_vectors(nvec, shape[1]));
+    blitz::Array<double,2> Bs(nvec, shape[0]);
+    for (auto _ : state) {
+        BvA.apply_M(As, Bs, linear::AccumType::REPLACE, false);
+        benchmark::DoNotOptimize(Bs.data());
+    }
+    state.SetItemsProcessed(state.iterations() * BvA.nnz() * nvec);
+    state.counters["nnz"] = BvA.nnz();
+}
+
+static void BM_apply_weight(benchmark::State &state, linear::LinearType type)
+{
+    int const nA_side = state.range(0);
+    int const nvec = state.range(1);
+    auto const &BvA(get_matrix(type, nA_side));
+    auto shape(BvA.shape());
+
+    auto As(bench::random_vectors(nvec, shape[1]));
+    blitz::Array<double,1> out(nvec);
+    for (auto _ : state) {
+        BvA.apply_weight(1, As, out, true);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * shape[1] * nvec);
+}
+
+// Sizes: A grid of 360x360 .. 1440x1440 cells; 1 .. 16 vectors at once
+#define LINEAR_ARGS ->ArgsProduct({{360, 720, 1440}, {1, 4, 16}})->Unit(benchmark::kMillisecond)
+
+BENCHMARK_CAPTURE(BM_apply_M, eigen, linear::LinearType::EIGEN) LINEAR_ARGS;
+BENCHMARK_CAPTURE(BM_apply_M, compressed, linear::LinearType::COMPRESSED) LINEAR_ARGS;
+BENCHMARK_CAPTURE(BM_apply_M, runlength, linear::LinearType::RUNLENGTH) LINEAR_ARGS;
+BENCHMARK_CAPTURE(BM_apply_M, tuple, linear::LinearType::TUPLE) LINEAR_ARGS;
+
+BENCHMARK_CAPTURE(BM_apply_weight, eigen, linear::LinearType::EIGEN) LINEAR_ARGS;
+BENCHMARK_CAPTURE(BM_apply_weight, compressed, linear::LinearType::COMPRESSED) LINEAR_ARGS;
+BENCHMARK_CAPTURE(BM_apply_weight, runlength, linear::LinearType::RUNLENGTH) LINEAR_ARGS;
+
+BENCHMARK_MAIN();
@@ -0,0 +1,106 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <ibmisc/RTree.hpp>
+#include <random>
+#include <vector>
+#include <array>
+
+using namespace ibmisc;
+
+typedef RTree<long, double, 2, double> RTreeT;
+
+/** Random boxes in [0,100)^2, as {xmin, ymin, xmax, ymax} */
+static std::vector<std::array<double,4>> random_boxes(int n, double max_size=3.)
+{
+    std::mt19937 gen(29);
+    std::uniform_real_distribution<double> pos(0., 100.);
+    std::uniform_real_distribution<double> size(0., max_size);
+    std::vector<std::array<double,4>> boxes;
+    boxes.reserve(n);
+    for (int i=0; i<n; ++i) {
+        double x = pos(gen), y = pos(gen);
+        boxes.push_back({x, y, x + size(gen), y + size(gen)});
+    }
+    return boxes;
+}
+
+/** Args: {nboxes} */
+static void BM_RTree_Insert(benchmark::State &state)
+{
+    auto boxes(random_boxes(state.range(0)));
+    RTreeT tree;
+    for (auto _ : state) {
+        for (long i=0; i<(long)boxes.size(); ++i) {
+            tree.Insert(&boxes[i][0], &boxes[i][2], i);
+        }
+        state.PauseTiming();
+        tree.RemoveAll();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * boxes.size());
+}
+
+static void BM_RTree_BulkLoad(benchmark::State &state)
+{
+    auto boxes(random_boxes(state.range(0)));
+    int const n = boxes.size();
+    std::vector<double> min, max;
+    std::vector<long> ids;
+    for (int i=0; i<n; ++i) {
+        min.push_back(boxes[i][0]); min.push_back(boxes[i][1]);
+        max.push_back(boxes[i][2]); max.push_back(boxes[i][3]);
+        ids.push_back(i);
+    }
+
+    RTreeT tree;
+    for (auto _ : state) {
+        tree.BulkLoad(n, min.data(), max.data(), ids.data());
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+/** One search per box: the typical overlap-matrix query pattern */
+static void BM_RTree_Search(benchmark::State &state)
+{
+    auto boxes(random_boxes(state.range(0)));
+    RTreeT tree;
+    for (long i=0; i<(long)boxes.size(); ++i) {
+        tree.Insert(&boxes[i][0], &boxes[i][2], i);
+    }
+
+    auto queries(random_boxes(1000));
+    long nfound = 0;
+    for (auto _ : state) {
+        for (auto &q : queries) {
+            tree.Search({q[0], q[1]}, {q[2], q[3]},
+                [&](long id) { ++nfound; return true; });
+        }
+    }
+    benchmark::DoNotOptimize(nfound);
+    state.SetItemsProcessed(state.iterations() * queries.size());
+}
+
+#define RTREE_ARGS ->Arg(10000)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond)
+
+BENCHMARK(BM_RTree_Insert) RTREE_ARGS;
+BENCHMARK(BM_RTree_BulkLoad) RTREE_ARGS;
+BENCHMARK(BM_RTree_Search) RTREE_ARGS;
+
+BENCHMARK_MAIN();
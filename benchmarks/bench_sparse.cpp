@@ -0,0 +1,192 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <spsparse/SparseSet.hpp>
+#include <spsparse/eigen.hpp>
+#include "synthetic.hpp"
+
+using namespace ibmisc;
+using namespace spsparse;
+
+typedef SparseSet<long,int> SparseSetT;
+
+/** Args: {nA_side} */
+static void BM_SparseSet_add_dense(benchmark::State &state)
+{
+    auto BvA(bench::regrid_matrix(state.range(0), 4));
+    auto const &shape(BvA.M.shape());
+    for (auto _ : state) {
+        SparseSetT dimA(shape[1]);
+        for (auto &tp : BvA.M.tuples) dimA.add_dense(tp.index(1));
+        benchmark::DoNotOptimize(dimA.dense_extent());
+    }
+    state.SetItemsProcessed(state.iterations() * BvA.M.size());
+}
+
+static void BM_SparseSet_to_dense(benchmark::State &state)
+{
+    auto BvA(bench::regrid_matrix(state.range(0), 4));
+    SparseSetT dimA(BvA.M.shape()[1]);
+    for (auto &tp : BvA.M.tuples) dimA.add_dense(tp.index(1));
+
+    for (auto _ : state) {
+        long sum = 0;
+        for (auto &tp : BvA.M.tuples) sum += dimA.to_dense(tp.index(1));
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * BvA.M.size());
+}
+
+static void BM_SparseSet_to_sparse(benchmark::State &state)
+{
+    auto BvA(bench::regrid_matrix(state.range(0), 4));
+    SparseSetT dimA(BvA.M.shape()[1]);
+    for (auto &tp : BvA.M.tuples) dimA.add_dense(tp.index(1));
+    int const n = dimA.dense_extent();
+
+    for (auto _ : state) {
+        long sum = 0;
+        for (int i=0; i<n; ++i) sum += dimA.to_sparse(i);
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+/** Sparse-to-dense conversion of a whole matrix, through Sparsify */
+static void BM_Sparsify_add_dense(benchmark::State &state)
+{
+    auto BvA(bench::regrid_matrix(state.range(0), 4));
+    auto const &shape(BvA.M.shape());
+
+    for (auto _ : state) {
+        SparseSetT dimB(shape[0]), dimA(shape[1]);
+        std::array<SparseSetT *,2> dims {&dimB, &dimA};
+        TupleList<int,double,2> M_d;
+        {auto accum(accum::add_dense(dims, accum::ref(M_d)));
+            for (auto &tp : BvA.M.tuples) accum.add(tp.index(), tp.value());
+        }
+        benchmark::DoNotOptimize(M_d.size());
+    }
+    state.SetItemsProcessed(state.iterations() * BvA.M.size());
+}
+
+/** The MakeDenseEigen pipeline: sparse-to-dense, transpose, drop
+zeros.  BM_accum_chain_hand is the same, written out by hand; the
+other variants build it from accumulators.
+Args: {nA_side} */
+static void BM_accum_chain_hand(benchmark::State &state)
+{
+    auto BvA(bench::regrid_matrix(state.range(0), 4));
+    auto const &shape(BvA.M.shape());
+
+    for (auto _ : state) {
+        SparseSetT dimB(shape[0]), dimA(shape[1]);
+        TupleList<int,double,2> M_d;
+        for (auto &tp : BvA.M.tuples) {
+            int const i = dimB.add_dense(tp.index(0));
+            int const j = dimA.add_dense(tp.index(1));
+            if (tp.value() != 0) M_d.add({j, i}, tp.value());
+        }
+        benchmark::DoNotOptimize(M_d.size());
+    }
+    state.SetItemsProcessed(state.iterations() * BvA.M.size());
+}
+
+/** Runtime Sparsify and Permute, element by element */
+static void BM_accum_chain_dynamic(benchmark::State &state)
+{
+    auto BvA(bench::regrid_matrix(state.range(0), 4));
+    auto const &shape(BvA.M.shape());
+
+    for (auto _ : state) {
+        SparseSetT dimB(shape[0]), dimA(shape[1]);
+        std::array<SparseSetT *,2> dims {&dimB, &dimA};
+        TupleList<int,double,2> M_d;
+        {auto accum(accum::sparsify(
+                std::array<SparsifyTransform,2>{SparsifyTransform::ADD_DENSE, SparsifyTransform::ADD_DENSE},
+                accum::in_index_type<long>(), dims,
+            accum::permute(accum::in_rank<2>(), {1,0},
+            accum::include_zero(false,
+            accum::ref(M_d)))));
+            for (auto &tp : BvA.M.tuples) accum.add(tp.index(), tp.value());
+        }
+        benchmark::DoNotOptimize(M_d.size());
+    }
+    state.SetItemsProcessed(state.iterations() * BvA.M.size());
+}
+
+/** StaticSparsify and StaticPermute, fused, in batches */
+static void BM_accum_chain_fused(benchmark::State &state)
+{
+    auto BvA(bench::regrid_matrix(state.range(0), 4));
+    auto const &shape(BvA.M.shape());
+
+    for (auto _ : state) {
+        SparseSetT dimB(shape[0]), dimA(shape[1]);
+        std::array<SparseSetT *,2> dims {&dimB, &dimA};
+        TupleList<int,double,2> M_d;
+        spcopy(accum::fuse(
+            accum::static_sparsify<SparsifyTransform::ADD_DENSE, SparsifyTransform::ADD_DENSE>(
+                accum::in_index_type<long>(), dims,
+            accum::static_permute<1,0>(accum::in_rank<2>(),
+            accum::include_zero(false,
+            accum::ref(M_d))))), BvA.M, false);
+        benchmark::DoNotOptimize(M_d.size());
+    }
+    state.SetItemsProcessed(state.iterations() * BvA.M.size());
+}
+
+/** Args: {nA_side, nthreads} */
+static void BM_consolidate(benchmark::State &state)
+{
+    auto BvA(bench::regrid_matrix(state.range(0), 4));
+    int const nthreads = state.range(1);
+
+    // Shuffled, with every element split into two duplicates
+    std::vector<Tuple<long,double,2>> tuples;
+    for (auto &tp : BvA.M.tuples) {
+        tuples.push_back(Tuple<long,double,2>(tp.index(), .5*tp.value()));
+        tuples.push_back(Tuple<long,double,2>(tp.index(), .5*tp.value()));
+    }
+    std::mt19937 gen(31);
+    std::shuffle(tuples.begin(), tuples.end(), gen);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto A(tuples);
+        state.ResumeTiming();
+        consolidate(A, false, nthreads);
+        benchmark::DoNotOptimize(A.data());
+    }
+    state.SetItemsProcessed(state.iterations() * tuples.size());
+}
+
+#define SPARSE_ARGS ->Arg(360)->Arg(720)->Arg(1440)->Unit(benchmark::kMillisecond)
+
+BENCHMARK(BM_SparseSet_add_dense) SPARSE_ARGS;
+BENCHMARK(BM_SparseSet_to_dense) SPARSE_ARGS;
+BENCHMARK(BM_SparseSet_to_sparse) SPARSE_ARGS;
+BENCHMARK(BM_Sparsify_add_dense) SPARSE_ARGS;
+BENCHMARK(BM_accum_chain_hand) SPARSE_ARGS;
+BENCHMARK(BM_accum_chain_dynamic) SPARSE_ARGS;
+BENCHMARK(BM_accum_chain_fused) SPARSE_ARGS;
+BENCHMARK(BM_consolidate)->ArgsProduct({{360, 720, 1440}, {1, 4}})->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,118 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+#include <map>
+#include <ibmisc/zarray.hpp>
+#include <ibmisc/rlarray.hpp>
+#include "synthetic.hpp"
+
+using namespace ibmisc;
+
+/** M of a regrid matrix, in (int) sparse indexing */
+static std::vector<spsparse::Tuple<int,double,2>> const &get_tuples(int nA_side)
+{
+    static std::map<int, std::vector<spsparse::Tuple<int,double,2>>> cache;
+    auto &ret(cache[nA_side]);
+    if (ret.size() == 0) {
+        auto BvA(bench::regrid_matrix(nA_side, 4));
+        for (auto &tp : BvA.M.tuples) {
+            ret.push_back(spsparse::Tuple<int,double,2>(
+                {(int)tp.index(0), (int)tp.index(1)}, tp.value()));
+        }
+    }
+    return ret;
+}
+
+/** Args: {nA_side} */
+static void BM_ZArray_encode(benchmark::State &state, spsparse::ZVCodec codec)
+{
+    auto const &tuples(get_tuples(state.range(0)));
+    for (auto _ : state) {
+        ZArray<int,double,2> za({1L<<30, 1L<<30});
+        {auto accum(za.accum(0, codec));
+            for (auto &tp : tuples) accum.add(tp.index(), tp.value());
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * tuples.size());
+}
+
+static void BM_ZArray_decode(benchmark::State &state, spsparse::ZVCodec codec)
+{
+    auto const &tuples(get_tuples(state.range(0)));
+    ZArray<int,double,2> za({1L<<30, 1L<<30});
+    {auto accum(za.accum(0, codec));
+        for (auto &tp : tuples) accum.add(tp.index(), tp.value());
+    }
+
+    for (auto _ : state) {
+        double sum = 0;
+        for (auto ii(za.generator()); ++ii; ) sum += ii->value();
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * tuples.size());
+}
+
+static void BM_RLArray_encode(benchmark::State &state)
+{
+    auto const &tuples(get_tuples(state.range(0)));
+    for (auto _ : state) {
+        RLArray<int,double,2> rla({1L<<30, 1L<<30});
+        {auto accum(rla.accum());
+            for (auto &tp : tuples) accum.add(tp.index(), tp.value());
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * tuples.size());
+}
+
+static void BM_RLArray_decode(benchmark::State &state)
+{
+    auto const &tuples(get_tuples(state.range(0)));
+    RLArray<int,double,2> rla({1L<<30, 1L<<30});
+    {auto accum(rla.accum());
+        for (auto &tp : tuples) accum.add(tp.index(), tp.value());
+    }
+
+    for (auto _ : state) {
+        double sum = 0;
+        for (auto ii(rla.generator()); ++ii; ) sum += ii->value();
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * tuples.size());
+}
+
+#define ZARRAY_ARGS ->Arg(360)->Arg(720)->Arg(1440)->Unit(benchmark::kMillisecond)
+
+BENCHMARK_CAPTURE(BM_ZArray_encode, zlib, spsparse::ZVCodec::ZLIB) ZARRAY_ARGS;
+BENCHMARK_CAPTURE(BM_ZArray_decode, zlib, spsparse::ZVCodec::ZLIB) ZARRAY_ARGS;
+BENCHMARK_CAPTURE(BM_ZArray_encode, none, spsparse::ZVCodec::NONE) ZARRAY_ARGS;
+BENCHMARK_CAPTURE(BM_ZArray_decode, none, spsparse::ZVCodec::NONE) ZARRAY_ARGS;
+#ifdef USE_ZSTD
+BENCHMARK_CAPTURE(BM_ZArray_encode, zstd, spsparse::ZVCodec::ZSTD) ZARRAY_ARGS;
+BENCHMARK_CAPTURE(BM_ZArray_decode, zstd, spsparse::ZVCodec::ZSTD) ZARRAY_ARGS;
+#endif
+#ifdef USE_LZ4
+BENCHMARK_CAPTURE(BM_ZArray_encode, lz4, spsparse::ZVCodec::LZ4) ZARRAY_ARGS;
+BENCHMARK_CAPTURE(BM_ZArray_decode, lz4, spsparse::ZVCodec::LZ4) ZARRAY_ARGS;
+#endif
+BENCHMARK(BM_RLArray_encode) ZARRAY_ARGS;
+BENCHMARK(BM_RLArray_decode) ZARRAY_ARGS;
+
+BENCHMARK_MAIN();
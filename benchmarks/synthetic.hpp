@@ -0,0 +1,91 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IBMISC_BENCHMARKS_SYNTHETIC_HPP
+#define IBMISC_BENCHMARKS_SYNTHETIC_HPP
+
+#include <random>
+#include <vector>
+#include <array>
+#include <ibmisc/linear/tuple.hpp>
+
+/** Synthetic inputs for the benchmarks, at realistic sizes. */
+
+namespace ibmisc {
+namespace bench {
+
+/** Overlap (unscaled regrid) matrix BvA between two lon-lat grids:
+A is nA_side x nA_side, B is (nA_side/ratio) x (nA_side/ratio), with
+B offset half an A cell so each B cell partly overlaps (ratio+1)^2 A
+cells.  A fraction of A cells (the "ocean") are left out of the
+matrix, giving it a realistic nullspace.  Sorted and consolidated.
+@param nA_side Number of A grid cells along each side
+@param ratio Number of A cells per B cell, along each side */
+inline linear::Weighted_Tuple regrid_matrix(int nA_side, int ratio, double null_fraction=.3)
+{
+    int const nB_side = nA_side / ratio;
+    linear::Weighted_Tuple BvA;
+    BvA.set_shape({(long)nB_side*nB_side, (long)nA_side*nA_side});
+
+    std::mt19937 gen(17);
+    std::uniform_real_distribution<double> uni(0., 1.);
+    std::vector<char> masked(nA_side*nA_side);
+    for (auto &m : masked) m = (uni(gen) < null_fraction);
+
+    std::vector<double> wA(nA_side*nA_side, 0.);
+    for (int jb=0; jb<nB_side; ++jb)
+    for (int ib=0; ib<nB_side; ++ib) {
+        long const iB = (long)jb*nB_side + ib;
+        double wB = 0;
+        for (int dj=0; dj<=ratio; ++dj)
+        for (int di=0; di<=ratio; ++di) {
+            int const ja = jb*ratio + dj;
+            int const ia = ib*ratio + di;
+            if (ja >= nA_side || ia >= nA_side) continue;
+            long const iA = (long)ja*nA_side + ia;
+            if (masked[iA]) continue;
+
+            // Half-cell overlap at the edges of B
+            double const fj = (dj == 0 || dj == ratio ? .5 : 1.);
+            double const fi = (di == 0 || di == ratio ? .5 : 1.);
+            double const area = fj * fi * (1. + .01*ja);    // Cells shrink toward the pole
+            BvA.M.add({iB, iA}, area);
+            wB += area;
+            wA[iA] += area;
+        }
+        if (wB != 0) BvA.wM.add({iB}, wB);
+    }
+    for (long iA=0; iA<(long)wA.size(); ++iA) {
+        if (wA[iA] != 0) BvA.Mw.add({iA}, wA[iA]);
+    }
+    return BvA;
+}
+
+/** Dense input vectors As(nvec, nA) for apply_M() */
+inline blitz::Array<double,2> random_vectors(int nvec, long n)
+{
+    std::mt19937 gen(23);
+    std::uniform_real_distribution<double> uni(-1., 1.);
+    blitz::Array<double,2> As(nvec, n);
+    for (int k=0; k<nvec; ++k)
+    for (long i=0; i<n; ++i) As(k,i) = 270. + 30.*uni(gen);
+    return As;
+}
+
+}}    // namespace
+#endif    // guard
@@ -0,0 +1,109 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Regrids time series of NetCDF variables with stored Weighted matrices.
+// See usage() below.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ibmisc/linear/stream.hpp>
+#include <ibmisc/string.hpp>
+
+using namespace ibmisc;
+
+static void usage(char const *prog)
+{
+    fprintf(stderr,
+"Usage: %s -o OUT.nc [options] -m MATRIX.nc:VNAME -v IVAR[:OVAR] ... IN.nc...\n"
+"Applies regridding matrices to every record of the input variables;\n"
+"records of the input files are concatenated into OUT.nc.\n"
+"  -m FILE:VNAME   Matrix (as written by Weighted::ncio()) for the -v that follow\n"
+"  -v IVAR[:OVAR]  Variable to regrid; OVAR defaults to IVAR\n"
+"  -d NAME=LEN,... Output dimensions for the -v that follow (default OVAR.n)\n"
+"  -r DIM          Record dimension (default time)\n"
+"  -b N            Records per batch (default 8)\n"
+"  -q N            Batches queued between stages (default 2)\n"
+"  -j N            Threads for each apply_M() (default 1)\n"
+"  -n              Do not force conservation\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    linear::RegridStream rs;
+    std::string ofname;
+    std::vector<std::unique_ptr<linear::Weighted>> matrices;
+    std::vector<std::string> odims;
+    std::vector<long> odim_lens;
+    int nthreads = 1;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        std::string const opt(argv[i]);
+        if (opt == "-n") {
+            rs.force_conservation = false;
+            continue;
+        }
+        if (opt.size() != 2 || i+1 >= argc) usage(argv[0]);
+        std::string const arg(argv[++i]);
+
+        switch(opt[1]) {
+            case 'o' : ofname = arg; break;
+            case 'r' : rs.rec_dim = arg; break;
+            case 'b' : rs.batch = atoi(arg.c_str()); break;
+            case 'q' : rs.nqueue = atoi(arg.c_str()); break;
+            case 'j' : nthreads = atoi(arg.c_str()); break;
+            case 'm' : {
+                auto const colon(arg.rfind(':'));
+                if (colon == std::string::npos) usage(argv[0]);
+                NcIO ncio(arg.substr(0, colon), 'r');
+                matrices.push_back(linear::nc_read_weighted(ncio.nc, arg.substr(colon+1)));
+            } break;
+            case 'd' : {
+                odims.clear();
+                odim_lens.clear();
+                for (auto const &dim : split<std::string>(arg, ",")) {
+                    auto const eq(dim.find('='));
+                    if (eq == std::string::npos) usage(argv[0]);
+                    odims.push_back(dim.substr(0, eq));
+                    odim_lens.push_back(atol(dim.substr(eq+1).c_str()));
+                }
+            } break;
+            case 'v' : {
+                if (matrices.empty()) {
+                    fprintf(stderr, "%s: -v %s comes before any -m\n", argv[0], arg.c_str());
+                    return 1;
+                }
+                auto const colon(arg.find(':'));
+                std::string const ivname(arg.substr(0, colon));
+                std::string const ovname(colon == std::string::npos ? ivname : arg.substr(colon+1));
+                rs.add(ivname, ovname, matrices.back().get(), odims, odim_lens);
+            } break;
+            default : usage(argv[0]);
+        }
+    }
+    rs.ifnames.assign(argv + i, argv + argc);
+    if (ofname == "" || rs.ifnames.empty() || rs.vars.empty()) usage(argv[0]);
+
+    for (auto &W : matrices) W->nthreads = nthreads;
+    long const nrec = rs.run(ofname);
+    printf("Wrote %ld records of %ld variables to %s\n",
+        nrec, (long)rs.vars.size(), ofname.c_str());
+    return 0;
+}
@@ -0,0 +1,25 @@
+# - Find lz4
+# Find the native lz4 includes and library
+#
+#  LZ4_INCLUDES    - where to find lz4.h
+#  LZ4_LIBRARIES   - List of libraries when using lz4.
+#  LZ4_FOUND       - True if lz4 found.
+
+if (LZ4_INCLUDES)
+  # Already in cache, be silent
+  set (LZ4_FIND_QUIETLY TRUE)
+endif (LZ4_INCLUDES)
+
+find_path (LZ4_INCLUDES lz4.h
+  HINTS "${LZ4_ROOT}/include" "$ENV{LZ4_ROOT}/include")
+
+find_library (LZ4_LIBRARIES
+  NAMES lz4
+  HINTS "${LZ4_ROOT}/lib" "$ENV{LZ4_ROOT}/lib")
+
+# handle the QUIETLY and REQUIRED arguments and set LZ4_FOUND to TRUE if
+# all listed variables are TRUE
+include (FindPackageHandleStandardArgs)
+find_package_handle_standard_args (LZ4 DEFAULT_MSG LZ4_LIBRARIES LZ4_INCLUDES)
+
+mark_as_advanced (LZ4_LIBRARIES LZ4_INCLUDES)
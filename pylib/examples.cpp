@@ -21,6 +21,8 @@
 #include <spsparse/eigen.hpp>
 #include <spsparse/SparseSet.hpp>
 #include <ibmisc/linear/compressed.hpp>
+#include <ibmisc/linear/runlength.hpp>
+#include <ibmisc/linear/sell.hpp>
 #include <ibmisc/linear/eigen.hpp>
 #include <ibmisc/enum.hpp>
 
@@ -114,10 +116,12 @@ std::unique_ptr<linear::Weighted> example_linear_weighted(
     dims[1].add_dense(25);
 
  
-    auto BvA(BvA_o.to_eigen());
+    std::array<blitz::Array<val_type,1>,2> weights;
+    auto BvA(BvA_o.to_eigen(weights));
 
     // Produce a scaled regridding matrix
-    auto sBvA(sum(BvA, 0, '-'));
+    blitz::Array<val_type,1> sBvA(weights[0].extent(0));
+    sBvA = 1. / weights[0];
 
     // Scale and stick into a linear::Weighted_Eigen
     std::unique_ptr<linear::Weighted_Eigen> BvA1(new linear::Weighted_Eigen);
@@ -126,8 +130,8 @@ std::unique_ptr<linear::Weighted> example_linear_weighted(
 //    BvA1->dims[0] = &dims[0];
 //    BvA1->dims[1] = &dims[1];
     BvA1->M.reset(new MakeDenseEigenT::EigenSparseMatrixT(map_eigen_diagonal(sBvA) * BvA));
-    BvA1->wM.reference(sum(BvA,0,'+'));
-    BvA1->Mw.reference(sum(BvA,1,'+'));
+    BvA1->wM.reference(weights[0]);
+    BvA1->Mw.reference(weights[1]);
 
     // Make it not conservative
     BvA1->wM(2) *= .9;
@@ -138,6 +142,21 @@ std::unique_ptr<linear::Weighted> example_linear_weighted(
     if (linear_type == linear::LinearType::EIGEN) {
         auto ret(std::unique_ptr<linear::Weighted>(BvA1.release()));
         return ret;
+    } else if (linear_type == linear::LinearType::RUNLENGTH) {
+        auto ret(std::unique_ptr<linear::Weighted>(
+            new linear::Weighted_RL(
+                to_runlength(*BvA1))));
+        return ret;
+    } else if (linear_type == linear::LinearType::SELL) {
+        auto ret(std::unique_ptr<linear::Weighted>(
+            new linear::Weighted_SELL(
+                linear::to_sell(*BvA1))));
+        return ret;
+    } else if (linear_type == linear::LinearType::COMPRESSED_FLOAT) {
+        auto ret(std::unique_ptr<linear::Weighted>(
+            new linear::Weighted_Compressed_Float(
+                linear::compress<float>(*BvA1))));
+        return ret;
     } else {
         auto ret(std::unique_ptr<linear::Weighted>(
             new linear::Weighted_Compressed(
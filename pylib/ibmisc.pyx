@@ -82,6 +82,24 @@ cdef split_shape(ashape, alen):
         functools.reduce(operator.mul, ashape[0:icut], 1),
         functools.reduce(operator.mul, ashape[icut:], 1))
 
+cdef reshape_nocopy(arr, new_shape, vname, bool copy_ok):
+    """Returns a view of arr with shape new_shape.  Strided and
+    Fortran-order arrays are passed through as-is whenever numpy can
+    express the new shape without copying.
+    copy_ok:
+        If the reshape would require a copy: make a copy (True), or
+        raise an error (False; eg for output arrays)."""
+    if arr.shape == new_shape:
+        return arr
+    view = arr.view()
+    try:
+        view.shape = new_shape    # Raises if a copy would be needed
+    except AttributeError:
+        if not copy_ok:
+            raise ValueError('{} of shape {} and strides {} cannot be viewed as shape {} without a copy'.format(vname, arr.shape, arr.strides, new_shape)) from None
+        return arr.reshape(new_shape)
+    return view
+
 
 cdef extern from "examples.hpp" namespace "ibmisc::cython":
     cdef void cyexample_double_blitz(PyObject *) except +
@@ -115,55 +133,111 @@ cdef class linear_Weighted:
     def shape(self):
         return cibmisc_cython.linear_Weighted_shape(self.cself[0])
 
-    def apply_weight(self, int dim, A_s):
+    def apply_weight(self, int dim, A_s, out=None):
         """Computes dot product of a weight vector with A_s.
         dim:
             0 = use weight vector for B (output) dimension
             1 = use weight vector for A (input) dimension
         A_s: Either:
             - A single vector (1-D array) to be transformed.
-            - A 2-D array of row vectors to be transformed."""
+            - A 2-D array of row vectors to be transformed.
+            May be strided or Fortran-order; it is not copied.
+        out: (optional)
+            Array of doubles to write the result into, of shape
+            (number of vectors,).  Allocated if not given.
+        The GIL is released during the computation."""
 
         # Number of elements in sparse in put vector
         _,alen = self.shape
         leading_shape, new_shape = split_shape(A_s.shape, alen)
-        A_s = A_s.reshape(new_shape)
-        B_s = cibmisc_cython.linear_Weighted_apply_weight(self.cself[0], dim, <PyObject *>A_s)
+        A_s = reshape_nocopy(A_s, new_shape, 'A_s', True)
+        if out is None:
+            B_s = cibmisc_cython.linear_Weighted_apply_weight(self.cself[0], dim,
+                <PyObject *>A_s, <PyObject *>None)
+        else:
+            B_s = reshape_nocopy(out, (new_shape[0],), 'out', False)
+            cibmisc_cython.linear_Weighted_apply_weight(self.cself[0], dim,
+                <PyObject *>A_s, <PyObject *>B_s)
+            B_s = out
 
         return B_s
 
-    def apply_wM(self, A_s):
-        return self.apply_weight(0,A_s)
-    def apply_Mw(self, A_s):
-        return self.apply_weight(1,A_s)
+    def apply_wM(self, A_s, out=None):
+        return self.apply_weight(0,A_s,out=out)
+    def apply_Mw(self, A_s, out=None):
+        return self.apply_weight(1,A_s,out=out)
 
 
 
-    def apply_M(self, A_s, fill=np.nan, bool force_conservation=True):
+    def apply_M(self, A_s, fill=np.nan, bool force_conservation=True, out=None):
         """Applies the regrid matrix to A_s.
         A_s: Either:
             - A single vector (1-D array) to be transformed.
             - A 2-D array of row vectors to be transformed.
+            May be strided or Fortran-order; it is not copied.
         fill:
             Un-set indices in output array will get this value.
         force_conservation: bool
             If M is not conservative, apply a conservation correction
-            at the end"""
+            at the end
+        out: (optional)
+            Array of doubles to write the result into, of shape
+            (number of vectors, nB); may be strided or Fortran-order.
+            Allocated if not given.
+        The GIL is released during the computation, so several
+        regrids may run at once in Python threads."""
 
 
         # Number of elements in sparse in put vector
-        _,alen = self.shape
+        nB,alen = self.shape
         leading_shape, new_shape = split_shape(A_s.shape, alen)
-        A_s = A_s.reshape(new_shape)
-        B_s = cibmisc_cython.linear_Weighted_apply_M(self.cself[0],
-            <PyObject *>A_s, fill, force_conservation)
+        A_s = reshape_nocopy(A_s, new_shape, 'A_s', True)
+        if out is None:
+            B_s = cibmisc_cython.linear_Weighted_apply_M(self.cself[0],
+                <PyObject *>A_s, <PyObject *>None, fill, force_conservation)
+        else:
+            B_s = reshape_nocopy(out, (new_shape[0], nB), 'out', False)
+            cibmisc_cython.linear_Weighted_apply_M(self.cself[0],
+                <PyObject *>A_s, <PyObject *>B_s, fill, force_conservation)
+            B_s = out
 
         return B_s
 
     def to_coo(self):
+        if self.type in ('COMPRESSED', 'COMPRESSED_FLOAT'):
+            return scipy.sparse.coo_matrix(self.decode('M'), shape=self.shape)
         (data,shape) = cibmisc_cython.linear_Weighted_to_coo(self.cself[0])
         return scipy.sparse.coo_matrix(data, shape)
 
+    def decode(self, which='M', int nthreads=1):
+        """Decodes a ZArray of a COMPRESSED or COMPRESSED_FLOAT matrix
+        straight into new Numpy arrays, in bulk.  The GIL is released
+        meanwhile.
+        which: 'M', 'wM' or 'Mw'
+        nthreads:
+            Decode blocks (of matrices compressed in blocks) on this
+            many threads.
+        Returns: (values, (index0, ...))
+            values are double; indices int, in sparse indexing.
+            For M, this is ready for scipy.sparse.coo_matrix()."""
+        return cibmisc_cython.linear_Weighted_decode(self.cself[0], which.encode(), nthreads)
+
+    def to_csc(self):
+        """Returns the matrix (type EIGEN only) as a scipy.sparse.csc_matrix
+        in dense indexing, without copying it out of C++.
+        Returns: (M_d, (d2s_B, d2s_A))
+            M_d:
+                csc_matrix whose buffers are read-only views of the
+                C++ matrix; they keep this object alive.
+            d2s_B, d2s_A:
+                Maps from dense to sparse indices, for rows and columns.
+                Sparse (to_coo()) indexing is M_d[i,j] = M[d2s_B[i], d2s_A[j]]
+        NOTE: Views are invalidated if this object is later modified (eg by ncio())."""
+        (data, indices, indptr), shape, d2s = \
+            cibmisc_cython.linear_Weighted_to_csc(<PyObject *>self, self.cself[0])
+        M_d = scipy.sparse.csc_matrix((data, indices, indptr), shape=shape, copy=False)
+        return M_d, d2s
+
     # For now, this only works with linear_Weighted, not linear_Compressed
     def get_weights(self, int idim):
         return cibmisc_cython.linear_Weighted_get_weights(self.cself[0], idim)
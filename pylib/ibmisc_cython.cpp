@@ -3,6 +3,9 @@
 #include <ibmisc/netcdf.hpp>
 #include <ibmisc/cython.hpp>
 #include <spsparse/SparseSet.hpp>
+#include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/compressed.hpp>
+#include <ibmisc/parallel.hpp>
 #include "ibmisc_cython.hpp"
 
 static double const NaN = std::numeric_limits<double>::quiet_NaN();
@@ -26,7 +29,8 @@ PyObject *linear_Weighted_shape(
 PyObject *linear_Weighted_apply_weight(
     linear::Weighted &self,
     int dim,
-    PyObject *A_s_py)            // A_b{nj_s} One row per variable
+    PyObject *A_s_py,            // A_b{nj_s} One row per variable
+    PyObject *B_s_py)            // Output (or None to allocate)
 {
     auto shape(self.shape());
 
@@ -38,14 +42,14 @@ PyObject *linear_Weighted_apply_weight(
     auto A_s(np_to_blitz<double,2>(A_s_py, "A", {-1,-1}));    // Sparse indexed dense vector
     int n_n = A_s.extent(0);
 
-    // Allocate output
-    PyObject *B_s_py = ibmisc::cython::new_pyarray<double,1>(
-        std::array<int,1>{n_n});
-    auto B_s(np_to_blitz<double,1>(B_s_py, "B", {-1}));
-    B_s = NaN;
+    // Allocate output, or use the one we were given
+    blitz::Array<double,1> B_s;
+    B_s_py = np_out_to_blitz<double,1>(B_s_py, "B", {n_n}, B_s);
 
-    // Run it!
-    self.apply_weight(dim, A_s, B_s, true);
+    // Run it!  (A_s and B_s may be strided or in any order: no copies)
+    {ReleaseGIL nogil;
+        self.apply_weight(dim, A_s, B_s, true);
+    }
 
     return B_s_py;
 }
@@ -53,6 +57,7 @@ PyObject *linear_Weighted_apply_weight(
 PyObject *linear_Weighted_apply_M(
     linear::Weighted &self,
     PyObject *A_s_py,            // A_b{nj_s} One row per variable
+    PyObject *B_s_py,            // Output (or None to allocate)
     double fill,
     // std::string const &saccum_type,
     bool force_conservation)
@@ -64,20 +69,145 @@ PyObject *linear_Weighted_apply_M(
     // Convert accum_type
     // auto accum_type(parse_enum<AccumType>(saccum_type));
 
-    // Allocate output
+    // Allocate output, or use the one we were given
     auto shape(self.shape());
-    PyObject *B_s_py = ibmisc::cython::new_pyarray<double,2>(
-        std::array<int,2>{n_n, shape[0]});
-    auto B_s(np_to_blitz<double,2>(B_s_py, "B_s_py", {-1,-1}));
-    B_s = fill;
+    blitz::Array<double,2> B_s;
+    B_s_py = np_out_to_blitz<double,2>(B_s_py, "B_s_py", {n_n, (int)shape[0]}, B_s);
 
-    // Run it!
-    self.apply_M(A_s, B_s, linear::AccumType::REPLACE, force_conservation);
+    // Run it!  (A_s and B_s may be strided or in any order: no copies)
+    {ReleaseGIL nogil;
+        B_s = fill;
+        self.apply_M(A_s, B_s, linear::AccumType::REPLACE, force_conservation);
+    }
 
     return B_s_py;
 }
 
 
+/** Elements decoded per next_batch() */
+static long const decode_batch = 4096;
+
+/** Decodes all of za into the output arrays, which hold nnz elements.
+@return Number of elements decoded */
+template<class ValueT, int RANK>
+static long decode_all(ZArray<int,ValueT,RANK> const &za,
+    std::array<int *,RANK> const &indices, double *values, long nnz)
+{
+    std::vector<std::array<int,RANK>> bindices(decode_batch);
+    std::vector<ValueT> bvalues(decode_batch);
+    auto gen(za.generator());
+    long n = 0;
+    for (;;) {
+        long const nb = gen.next_batch(&bindices[0], &bvalues[0], decode_batch);
+        if (n + nb > nnz) (*ibmisc_error)(-1,
+            "ZArray holds more than its nnz=%ld elements", nnz);
+        for (long j=0; j<nb; ++j) {
+            for (int k=0; k<RANK; ++k) indices[k][n+j] = bindices[j][k];
+            values[n+j] = bvalues[j];
+        }
+        n += nb;
+        if (nb < decode_batch) return n;
+    }
+}
+
+template<class ValueT, int RANK>
+static PyObject *np_decode_zarray(ZArray<int,ValueT,RANK> const &za, int nthreads)
+{
+    long const nnz = za.nnz();
+    npy_intp dims[1] {(npy_intp)nnz};
+    std::array<PyObject *,RANK> indices_py;
+    std::array<int *,RANK> indices;
+    for (int k=0; k<RANK; ++k) {
+        indices_py[k] = PyArray_SimpleNew(1, dims, np_type_num<int>());
+        if (!indices_py[k]) (*ibmisc_error)(-1, "Cannot allocate Numpy array of %ld", nnz);
+        indices[k] = (int *)PyArray_DATA((PyArrayObject *)indices_py[k]);
+    }
+    PyObject *values_py = PyArray_SimpleNew(1, dims, np_type_num<double>());
+    if (!values_py) (*ibmisc_error)(-1, "Cannot allocate Numpy array of %ld", nnz);
+    double * const values = (double *)PyArray_DATA((PyArrayObject *)values_py);
+
+    try {
+        {ReleaseGIL nogil;
+            long const nblocks = za.nblocks();
+            long n;
+            if (nthreads <= 1 || nblocks <= 1) {
+                n = decode_all(za, indices, values, nnz);
+            } else {
+                // Decode pieces (runs of blocks) in parallel, then
+                // copy them into place
+                long const npieces = std::min(nblocks, 4L*nthreads);
+                std::vector<std::vector<std::array<int,RANK>>> pindices(npieces);
+                std::vector<std::vector<ValueT>> pvalues(npieces);
+                parallel_for(0, npieces, nthreads, [&](long p0, long p1) {
+                    for (long p=p0; p<p1; ++p) {
+                        auto gen(za.generator(p*nblocks/npieces, (p+1)*nblocks/npieces));
+                        auto &pi(pindices[p]);
+                        auto &pv(pvalues[p]);
+                        for (long nb = decode_batch; nb == decode_batch; ) {
+                            size_t const n0 = pi.size();
+                            pi.resize(n0 + decode_batch);
+                            pv.resize(n0 + decode_batch);
+                            nb = gen.next_batch(&pi[n0], &pv[n0], decode_batch);
+                            pi.resize(n0 + nb);
+                            pv.resize(n0 + nb);
+                        }
+                    }
+                });
+                std::vector<long> start(npieces+1, 0);
+                for (long p=0; p<npieces; ++p) start[p+1] = start[p] + pvalues[p].size();
+                n = start[npieces];
+                if (n > nnz) (*ibmisc_error)(-1,
+                    "ZArray holds more than its nnz=%ld elements", nnz);
+                parallel_for(0, npieces, nthreads, [&](long p0, long p1) {
+                    for (long p=p0; p<p1; ++p) {
+                        for (size_t j=0; j<pvalues[p].size(); ++j) {
+                            for (int k=0; k<RANK; ++k) indices[k][start[p]+j] = pindices[p][j][k];
+                            values[start[p]+j] = pvalues[p][j];
+                        }
+                    }
+                });
+            }
+            if (n != nnz) (*ibmisc_error)(-1,
+                "ZArray holds %ld elements, not its nnz=%ld", n, nnz);
+        }
+    } catch(...) {
+        for (auto arr_py : indices_py) Py_DECREF(arr_py);
+        Py_DECREF(values_py);
+        throw;
+    }
+
+    PyObject *indices_t = PyTuple_New(RANK);
+    for (int k=0; k<RANK; ++k) PyTuple_SetItem(indices_t, k, indices_py[k]);    // Steals
+    return Py_BuildValue("NN", values_py, indices_t);
+}
+
+template<class ValueT>
+static PyObject *decode_compressed(linear::Weighted_CompressedT<ValueT> const &self,
+    std::string const &which, int nthreads)
+{
+    if (which == "M") return np_decode_zarray(self.M, nthreads);
+    if (which == "wM") return np_decode_zarray(self.weights[0], nthreads);
+    if (which == "Mw") return np_decode_zarray(self.weights[1], nthreads);
+    (*ibmisc_error)(-1, "decode(): which must be M, wM or Mw, not %s", which.c_str());
+}
+
+PyObject *linear_Weighted_decode(linear::Weighted const &self,
+    std::string const &which, int nthreads)
+{
+    switch(self.type.index()) {
+        case linear::LinearType::COMPRESSED :
+            return decode_compressed(
+                dynamic_cast<linear::Weighted_Compressed const &>(self), which, nthreads);
+        case linear::LinearType::COMPRESSED_FLOAT :
+            return decode_compressed(
+                dynamic_cast<linear::Weighted_Compressed_Float const &>(self), which, nthreads);
+        default :
+            (*ibmisc_error)(-1,
+                "decode() requires a Weighted of type COMPRESSED or COMPRESSED_FLOAT, not %s",
+                self.type.str());
+    }
+}
+
 PyObject *linear_Weighted_to_coo(linear::Weighted const &self)
 {
     int const rank = 2;
@@ -121,6 +251,55 @@ PyObject *linear_Weighted_to_coo(linear::Weighted const &self)
 
 }
 
+/** Wraps n elements of C++ memory in a read-only 1-D Numpy array,
+which holds a reference to owner_py. */
+template<class T>
+static PyObject *np_borrow_vector(T const *data, long n, PyObject *owner_py)
+{
+    npy_intp dims[1] {(npy_intp)n};
+    PyObject *arr_py = PyArray_SimpleNewFromData(
+        1, dims, np_type_num<T>(), (void *)data);
+    if (!arr_py) (*ibmisc_error)(-1, "Cannot wrap C++ buffer as Numpy array");
+    PyArray_CLEARFLAGS((PyArrayObject *)arr_py, NPY_ARRAY_WRITEABLE);
+
+    // The array now keeps owner_py alive
+    Py_INCREF(owner_py);
+    if (PyArray_SetBaseObject((PyArrayObject *)arr_py, owner_py) < 0) {
+        Py_DECREF(arr_py);
+        (*ibmisc_error)(-1, "Cannot set base object of Numpy array");
+    }
+    return arr_py;
+}
+
+PyObject *linear_Weighted_to_csc(
+    PyObject *self_py, linear::Weighted &self)
+{
+    if (self.type != linear::LinearType::EIGEN) (*ibmisc_error)(-1,
+        "to_csc() requires a Weighted of type EIGEN, not %s", self.type.str());
+    auto &eigen(dynamic_cast<linear::Weighted_Eigen &>(self));
+    if (!eigen.M) (*ibmisc_error)(-1, "to_csc(): matrix M has not been set");
+    auto &M(*eigen.M);
+
+    // Buffers are only contiguous CSC in compressed mode
+    M.makeCompressed();
+
+    PyObject *data_py = np_borrow_vector(M.valuePtr(), M.nonZeros(), self_py);
+    PyObject *indices_py = np_borrow_vector(M.innerIndexPtr(), M.nonZeros(), self_py);
+    PyObject *indptr_py = np_borrow_vector(M.outerIndexPtr(), M.outerSize()+1, self_py);
+
+    std::array<PyObject *,2> d2s_py;
+    for (int k=0; k<2; ++k) {
+        auto const &d2s(eigen.dims[k]->d2s());
+        d2s_py[k] = np_borrow_vector(d2s.data(), d2s.size(), self_py);
+    }
+
+    // "N" steals the references we just made
+    return Py_BuildValue("(NNN)(ll)(NN)",
+        data_py, indices_py, indptr_py,
+        (long)M.rows(), (long)M.cols(),
+        d2s_py[0], d2s_py[1]);
+}
+
 PyObject *linear_Weighted_get_weights(linear::Weighted const &self, int idim)
 {
     auto shape(self.shape());
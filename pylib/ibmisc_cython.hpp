@@ -16,17 +16,36 @@ extern PyObject *linear_Weighted_shape(
 extern PyObject *linear_Weighted_apply_weight(
     linear::Weighted &self,
     int dim,
-    PyObject *A_s_py);            // A_b{nj_s} One row per variable
+    PyObject *A_s_py,            // A_b{nj_s} One row per variable
+    PyObject *B_s_py);           // Output (or None to allocate)
 
 extern PyObject *linear_Weighted_apply_M(
     linear::Weighted &self,
     PyObject *A_s_py,            // A_b{nj_s} One row per variable
+    PyObject *B_s_py,            // Output (or None to allocate)
     double fill,
     // std::string const &saccum_type,
     bool force_conservation);
 
 extern PyObject *linear_Weighted_to_coo(linear::Weighted const &self);
 
+/** Decodes a ZArray of a Weighted_Compressed (or _Float) straight
+into new Numpy arrays, in batches; without the GIL.  Blocks of
+framed ZArrays are decoded on up to nthreads threads.
+@param which "M", "wM" or "Mw"
+@return (values, (index0, ...)): values are always double */
+extern PyObject *linear_Weighted_decode(linear::Weighted const &self,
+    std::string const &which, int nthreads);
+
+/** Exports the CSC buffers of a Weighted_Eigen's matrix M (dense
+indexing), and its dense-to-sparse dimension maps, as read-only Numpy
+arrays that reference the C++ memory (no copy).  Each array holds a
+reference to self_py, keeping the matrix alive.
+@param self_py The Python object owning self.
+@return ((data, indices, indptr), shape, (d2s0, d2s1)) */
+extern PyObject *linear_Weighted_to_csc(
+    PyObject *self_py, linear::Weighted &self);
+
 extern PyObject *linear_Weighted_get_weights(linear::Weighted const &self, int idim);
 
 }}    // namespace
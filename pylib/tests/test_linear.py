@@ -15,7 +15,9 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 import unittest
+import threading
 import numpy as np
+import scipy.sparse
 from numpy.testing import *
 import ibmisc
 import copy
@@ -51,7 +53,7 @@ class TestLinear(unittest.TestCase):
 
     def test_linear(self):
         for force_conservation in (False, True):
-            for linear_type in ('EIGEN', 'COMPRESSED'):
+            for linear_type in ('EIGEN', 'COMPRESSED', 'RUNLENGTH', 'COMPRESSED_FLOAT', 'SELL'):
                 print('-------------------------', force_conservation, linear_type)
                 BvA1 = ibmisc.example_linear_weighted(linear_type)
                 shape = BvA1.shape
@@ -75,13 +77,94 @@ class TestLinear(unittest.TestCase):
 
                 bb1 = BvA1.apply_M(aa, fill=-17000., force_conservation=force_conservation)
                 #print(bb1)
-                assert_allclose(answers[force_conservation], bb1.reshape(-1))
+                # Float storage carries about 7 significant digits
+                rtol = 1e-5 if linear_type == 'COMPRESSED_FLOAT' else 1e-7
+                assert_allclose(answers[force_conservation], bb1.reshape(-1), rtol=rtol)
 #                self.assertTrue(np.all(answers[force_conservation] == bb1))
 
                 # Convert to SciPy SparseMatrix
                 x = BvA1.to_coo()
                 print('xxx', type(x), x)
 
+    def test_decode(self):
+        M0 = ibmisc.example_linear_weighted('EIGEN').to_coo().toarray()
+        for linear_type in ('COMPRESSED', 'COMPRESSED_FLOAT'):
+            BvA1 = ibmisc.example_linear_weighted(linear_type)
+            rtol = 1e-5 if linear_type == 'COMPRESSED_FLOAT' else 1e-7
+            for nthreads in (1,3):
+                values, (ii, jj) = BvA1.decode('M', nthreads=nthreads)
+                M = scipy.sparse.coo_matrix((values, (ii, jj)), shape=BvA1.shape)
+                assert_allclose(M0, M.toarray(), rtol=rtol)
+
+    def test_to_csc(self):
+        BvA1 = ibmisc.example_linear_weighted('EIGEN')
+        M_d, (d2s_B, d2s_A) = BvA1.to_csc()
+
+        # Views of the C++ buffers; not copies
+        self.assertFalse(M_d.data.flags.writeable)
+        self.assertFalse(M_d.data.flags.owndata)
+
+        # Same matrix as to_coo(), once converted to sparse indexing
+        M_s = scipy.sparse.coo_matrix(
+            (M_d.tocoo().data, (d2s_B[M_d.tocoo().row], d2s_A[M_d.tocoo().col])),
+            shape=BvA1.shape)
+        assert_allclose(BvA1.to_coo().toarray(), M_s.toarray())
+
+        # Views keep the matrix alive
+        del BvA1
+        self.assertGreater(M_d.sum(), 0)
+
+    def test_apply_out(self):
+        """Strided / Fortran-order inputs and outputs, with no copies."""
+        for linear_type in ('EIGEN', 'COMPRESSED', 'RUNLENGTH', 'SELL'):
+            BvA1 = ibmisc.example_linear_weighted(linear_type)
+            nB,nA = BvA1.shape
+            nvec = 3
+
+            aa = np.zeros((nvec,nA))
+            for k in range(0,nvec):
+                for i in range(0,nA):
+                    aa[k,i] = 32.*i*i - 17. + k
+            bb = BvA1.apply_M(aa, fill=-17000.)
+
+            # Fortran-order input and output
+            aa_f = np.asfortranarray(aa)
+            bb_f = np.zeros((nvec,nB), order='F')
+            ret = BvA1.apply_M(aa_f, fill=-17000., out=bb_f)
+            self.assertIs(ret, bb_f)
+            assert_allclose(bb, bb_f)
+
+            # Strided input and output
+            aa_s = np.zeros((nvec,2*nA))
+            aa_s[:,::2] = aa
+            bb_s = np.zeros((nvec,2*nB))
+            BvA1.apply_M(aa_s[:,::2], fill=-17000., out=bb_s[:,::2])
+            assert_allclose(bb, bb_s[:,::2])
+
+            # 1-D output for a single vector
+            bb1 = np.zeros(nB)
+            BvA1.apply_M(aa[1,:], fill=-17000., out=bb1)
+            assert_allclose(bb[1,:], bb1)
+
+            # Output of the wrong shape
+            with self.assertRaises(Exception):
+                BvA1.apply_M(aa, out=np.zeros((nvec,nB+1)))
+
+            # apply_weight()
+            ww = BvA1.apply_wM(aa)
+            ww_s = np.zeros(2*nvec)
+            BvA1.apply_wM(aa_f, out=ww_s[::2])
+            assert_allclose(ww, ww_s[::2])
+
+            # Several regrids at once in threads (GIL is released)
+            outs = [np.zeros((nvec,nB)) for _ in range(4)]
+            threads = [threading.Thread(target=BvA1.apply_M, args=(aa,),
+                kwargs={'fill' : -17000., 'out' : out}) for out in outs]
+            for t in threads: t.start()
+            for t in threads: t.join()
+            for out in outs:
+                assert_allclose(bb, out)
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -86,6 +86,32 @@ double ConstantSet::get_as(std::string const &name,
     return get_as(name, units);
 }
 
+BoundConstants ConstantSet::bind(
+    std::vector<std::pair<std::string, std::string>> const &vars) const
+{
+    BoundConstants ret(this);
+    for (auto const &var : vars) ret.add(var.first, var.second);
+    return ret;
+}
+
+// =======================================================
+BoundConstants::Handle BoundConstants::add(
+    std::string const &name, std::string const &units)
+{
+    size_t const src_ix = cs->index.at(name);
+    bindings.push_back(Binding{src_ix, units});
+    vals.push_back(cs->get_as(name, units));
+    return Handle(vals.size()-1);
+}
+
+void BoundConstants::refresh()
+{
+    for (size_t i=0; i<bindings.size(); ++i) {
+        auto const &b(bindings[i]);
+        vals[i] = cs->get_as((*cs)[b.src_ix].name, b.units);
+    }
+}
+
 // =======================================================
 void ConstantSet::read_nc(netCDF::NcGroup *nc, std::string const &prefix)
 {
@@ -24,6 +24,8 @@
 
 namespace ibmisc {
 
+class BoundConstants;
+
 class ConstantSet
 {
 public:
@@ -58,7 +60,7 @@ protected:
 public:
     UTSystem const * ut_system; //!< Unit system to use for conversions
 
-    void init(UTSystem const *_ut_system)
+    void init(UTSystem const *_ut_system = &UTSystem::shared())
     {
         ut_system = _ut_system;
     }
@@ -105,9 +107,95 @@ public:
     double get_as(std::string const &name,
         std::string const &sunits) const;
 
+    /** Resolves (name, units) pairs once, for fast lookup later:
+    bound[i] is vars[i], converted to its units. */
+    BoundConstants bind(
+        std::vector<std::pair<std::string, std::string>> const &vars) const;
+
     void read_nc(netCDF::NcGroup *nc, std::string const &prefix);
 
     void ncio(NcIO &ncio, std::string const &vname);
+
+    /** Names, units, descriptions and values; not ut_system, which
+    must be set with init() after loading. */
+    template<class ArchiveT>
+    void serialize(ArchiveT &ar, const unsigned int file_version)
+    {
+        int64_t n = data.size();
+        ar & n;
+        if (ArchiveT::is_loading::value) {
+            index.clear();
+            data.clear();
+        }
+        for (int64_t i=0; i<n; ++i) {
+            std::string name, units, description;
+            double val;
+            if (!ArchiveT::is_loading::value) {
+                name = data[i].name;
+                units = data[i].units;
+                description = data[i].description;
+                val = data[i].val;
+            }
+            ar & name;
+            ar & units;
+            ar & description;
+            ar & val;
+            if (ArchiveT::is_loading::value) set(name, val, units, description);
+        }
+    }
+};
+
+/** Constants looked up and converted to the desired units once, to
+be read cheaply (eg every timestep):
+
+    BoundConstants bc(&constants);
+    auto const RHOW(bc.add("rhow", "kg m-3"));
+    ...
+    double const rhow = bc[RHOW];
+
+Call refresh() after the ConstantSet's values change. */
+class BoundConstants
+{
+    struct Binding {
+        size_t src_ix;        // Index in the ConstantSet
+        std::string units;    // To convert to
+    };
+
+    ConstantSet const *cs;
+    std::vector<Binding> bindings;
+    std::vector<double> vals;    // Converted values, by handle
+
+public:
+    /** Identifies one bound constant */
+    class Handle {
+        friend class BoundConstants;
+        size_t ix;
+        explicit Handle(size_t _ix) : ix(_ix) {}
+    public:
+        size_t index() const { return ix; }
+    };
+
+    explicit BoundConstants(ConstantSet const *_cs) : cs(_cs) {}
+
+    /** Binds (and converts) one more constant */
+    Handle add(std::string const &name, std::string const &units);
+
+    /** Re-reads and re-converts all bound constants */
+    void refresh();
+
+    double operator[](Handle const &h) const
+        { return vals[h.ix]; }
+    double operator[](size_t ix) const
+        { return vals[ix]; }
+
+    /** Handle of the ix'th constant bound */
+    Handle handle(size_t ix) const
+        { return Handle(ix); }
+
+    size_t size() const { return vals.size(); }
+
+    /** All converted values, in the order bound */
+    double const *data() const { return vals.data(); }
 };
 
 }
@@ -18,6 +18,14 @@
 
 #pragma once
 
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
 namespace ibmisc {
 
 /**An STL-like constant-size array class that allows for the element
@@ -33,6 +41,11 @@ struct SMBMsg {
 Note that standard pointer arithmetic cannot be used on pointers to
 elements of a DynArray.
 
+Storage is cache-line aligned and may grow (reserve(), resize(),
+push_back()), so a message buffer can be reused from one exchange to
+the next.  Elements are contiguous: buf / nbytes() may be sent with
+MPI directly, eg with mpi_type().  Growing invalidates iterators.
+
 @param T The element type of the array.  It will generally be an "extensible" type, one with an implied array at the end.
 */
 template<class T>
@@ -90,26 +103,122 @@ public:
     };          // iterator
     // -------------------------------------------------------
 
-    size_t const size;
-    size_t const ele_size;
-    char * const buf;
-    char * const buf_end;
+    static size_t const ALIGN = 64;    // Cache line
+
+    // Read-only for users
+    size_t size;
+    size_t ele_size;
+    char *buf;
+    char *buf_end;
+private:
+    size_t _capacity;    // Elements
+
+    static char *alloc(size_t nbytes)
+    {
+        void *ret = 0;
+        if (nbytes > 0 && posix_memalign(&ret, ALIGN, nbytes) != 0) throw std::bad_alloc();
+        return (char *)ret;
+    }
 
-    /** Instantiate a fixed-size array.
+public:
+    /** Instantiate an array.
     @param _ele_size The size of each element, must be at least
     sizeof(T) where T is the template parameter.
     @param Number of elements to allocate in the array. */
-    DynArray(size_t _ele_size, size_t _size) :
-        ele_size(_ele_size),
+    DynArray(size_t _ele_size, size_t _size = 0) :
         size(_size),
-        buf((char *)malloc(size * ele_size)),
-        buf_end(buf + size * ele_size) {}
+        ele_size(_ele_size),
+        buf(alloc(size * ele_size)),
+        buf_end(buf + size * ele_size),
+        _capacity(_size) {}
 
     ~DynArray() { free(buf); }
 
     DynArray(DynArray const &b) = delete;
     void operator=(DynArray const &b) = delete;
-    void operator=(DynArray &&b) = delete;
+
+    DynArray(DynArray &&b) noexcept :
+        size(b.size), ele_size(b.ele_size), buf(b.buf), buf_end(b.buf_end),
+        _capacity(b._capacity)
+    {
+        b.size = 0;
+        b.buf = b.buf_end = 0;
+        b._capacity = 0;
+    }
+
+    DynArray &operator=(DynArray &&b) noexcept
+    {
+        std::swap(size, b.size);
+        std::swap(ele_size, b.ele_size);
+        std::swap(buf, b.buf);
+        std::swap(buf_end, b.buf_end);
+        std::swap(_capacity, b._capacity);
+        return *this;
+    }
+
+    size_t capacity() const { return _capacity; }
+    size_t nbytes() const { return size * ele_size; }
+
+    /** Makes room for n elements, keeping the current ones. */
+    void reserve(size_t n)
+    {
+        if (n <= _capacity) return;
+        char *nbuf = alloc(n * ele_size);
+        if (buf) memcpy(nbuf, buf, size * ele_size);
+        free(buf);
+        buf = nbuf;
+        buf_end = buf + size * ele_size;
+        _capacity = n;
+    }
+
+    /** Changes the number of elements; new ones are zeroed. */
+    void resize(size_t n)
+    {
+        if (n > _capacity) reserve(std::max(n, 2*_capacity));
+        if (n > size) memset(buf + size*ele_size, 0, (n - size)*ele_size);
+        size = n;
+        buf_end = buf + size * ele_size;
+    }
+
+    /** Keeps the storage, for reuse */
+    void clear() { resize(0); }
+
+    /** Appends a (zeroed) element.
+    @return The new element */
+    T &push_back()
+    {
+        resize(size + 1);
+        return (*this)[size-1];
+    }
+
+    /** Copies all elements, contiguously, to dest.
+    @return End of what was written */
+    char *pack(char *dest) const
+    {
+        if (size > 0) memcpy(dest, buf, nbytes());
+        return dest + nbytes();
+    }
+
+    /** Replaces the contents with n elements copied from src.
+    @return End of what was read */
+    char const *unpack(char const *src, size_t n)
+    {
+        resize(n);
+        if (n > 0) memcpy(buf, src, nbytes());
+        return src + nbytes();
+    }
+
+#ifdef USE_MPI
+    /** A (committed) MPI datatype for one element; send buf with
+    count size.  Free it with MPI_Type_free(). */
+    MPI_Datatype mpi_type() const
+    {
+        MPI_Datatype ret;
+        MPI_Type_contiguous(ele_size, MPI_BYTE, &ret);
+        MPI_Type_commit(&ret);
+        return ret;
+    }
+#endif
 
     iterator begin() { return iterator(this, reinterpret_cast<T *>(buf)); }
     iterator end() { return  iterator(this, reinterpret_cast<T *>(buf_end)); }
@@ -0,0 +1,73 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <ibmisc/IndexSet.hpp>
+
+namespace ibmisc {
+namespace _index_set {
+
+bool build_mph(std::vector<uint64_t> const &hashes,
+    std::vector<uint32_t> &disp, std::vector<uint32_t> &slot_to_ix)
+{
+    size_t const n = hashes.size();
+    disp.clear();
+    slot_to_ix.clear();
+    if (n == 0 || n >= UINT32_MAX) return false;
+
+    // Place the keys in buckets; then, biggest bucket first, find a
+    // displacement that sends all its keys to free slots.
+    size_t const nbucket = n/4 + 1;
+    std::vector<std::vector<uint32_t>> buckets(nbucket);
+    for (size_t i=0; i<n; ++i) buckets[mix(hashes[i], 0) % nbucket].push_back(i);
+
+    std::vector<uint32_t> order(nbucket);
+    for (size_t b=0; b<nbucket; ++b) order[b] = b;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+        { return buckets[a].size() > buckets[b].size(); });
+
+    uint32_t const none = UINT32_MAX;
+    std::vector<uint32_t> slots(n, none);
+    std::vector<size_t> tried;
+    disp.assign(nbucket, 0);
+    for (uint32_t const b : order) {
+        auto const &bucket(buckets[b]);
+        if (bucket.empty()) break;
+
+        for (uint32_t d=1;; ++d) {
+            if (d > (1u<<20)) return false;    // Identical hashes, most likely
+            tried.clear();
+            for (uint32_t const i : bucket) {
+                size_t const slot = mix(hashes[i], d) % n;
+                if (slots[slot] != none) break;
+                slots[slot] = i;
+                tried.push_back(slot);
+            }
+            if (tried.size() == bucket.size()) {
+                disp[b] = d;
+                break;
+            }
+            for (size_t const slot : tried) slots[slot] = none;
+        }
+    }
+
+    slot_to_ix.swap(slots);
+    return true;
+}
+
+}}    // namespace
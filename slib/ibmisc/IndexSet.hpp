@@ -22,9 +22,12 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
-#include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <functional>
 #include <ibmisc/ibmisc.hpp>
 #include <ibmisc/iter.hpp>
+#include <ibmisc/hash.hpp>
 
 
 namespace ibmisc {
@@ -34,23 +37,81 @@ namespace ibmisc {
 template<class KeyT>
 class IndexSet;
 
+namespace _index_set {
+
+/** Mixes a key's hash with a displacement (splitmix64 finalizer) */
+inline uint64_t mix(uint64_t h, uint64_t d)
+{
+    h ^= d * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+/** Builds a minimal perfect hash ("hash and displace") over distinct
+hash values: key i lives in slot mix(h[i], disp[mix(h[i],0) % disp.size()])
+% h.size(), and slot_to_ix[slot] == i.
+@return false if it could not (eg two keys have the same hash). */
+extern bool build_mph(std::vector<uint64_t> const &hashes,
+    std::vector<uint32_t> &disp, std::vector<uint32_t> &slot_to_ix);
+
+}    // namespace _index_set
 // -----------------------------------------
 
-/** Maps keys to integers, according to order of insertion. */
+/** Maps keys to integers, according to order of insertion.
+
+Lookups go through a hash table.  Once the set is complete, freeze()
+replaces that with a minimal perfect hash: at() is then one hash, one
+table probe and one key comparison.  Inserting unfreezes the set. */
 template<class KeyT>        // Our metadata structure
 class IndexSet
 {
-    std::map<KeyT, size_t> _key_to_ix;
+    std::unordered_map<KeyT, size_t, Hash<KeyT>> _key_to_ix;
     std::vector<KeyT> _ix_to_key;
 
+    // Frozen mode (empty if not frozen)
+    std::vector<uint32_t> _disp;
+    std::vector<uint32_t> _slot_to_ix;
+
+    /** Frozen lookup: index of key, or -1 */
+    size_t frozen_at(KeyT const &key) const
+    {
+        uint64_t const h = Hash<KeyT>()(key);
+        uint32_t const d = _disp[_index_set::mix(h, 0) % _disp.size()];
+        size_t const ix = _slot_to_ix[_index_set::mix(h, d) % _slot_to_ix.size()];
+        return (_ix_to_key[ix] == key ? ix : (size_t)-1);
+    }
+
+    void unfreeze()
+    {
+        _disp.clear();
+        _slot_to_ix.clear();
+    }
+
 public:
     IndexSet() {}
 
     void clear() {
         _key_to_ix.clear();
         _ix_to_key.clear();
+        unfreeze();
     }
 
+    /** Builds a minimal perfect hash over the current keys, for
+    faster at() and contains().
+    @return false (and stays unfrozen) if one could not be built. */
+    bool freeze()
+    {
+        std::vector<uint64_t> hashes;
+        hashes.reserve(size());
+        for (auto const &key : _ix_to_key) hashes.push_back(Hash<KeyT>()(key));
+        if (_index_set::build_mph(hashes, _disp, _slot_to_ix)) return true;
+        unfreeze();
+        return false;
+    }
+
+    bool frozen() const { return !_slot_to_ix.empty(); }
+
     /** Initialize from initializer list */
     IndexSet(std::vector<KeyT> &&keys) : _ix_to_key(std::move(keys))
     {
@@ -88,6 +149,7 @@ public:
             buf << "Duplicate key detected trying to insert " << key;
             (*ibmisc_error)(-1, "%s", buf.str().c_str());
         }
+        unfreeze();
         _key_to_ix.insert(std::make_pair(key, _key_to_ix.size()));
         size_t ix = _ix_to_key.size();
         _ix_to_key.push_back(key);
@@ -96,6 +158,7 @@ public:
 
     bool contains(KeyT const &key) const
     {
+        if (frozen()) return frozen_at(key) != (size_t)-1;
         auto ii(_key_to_ix.find(key));
         return (ii != _key_to_ix.end());
     }
@@ -103,6 +166,10 @@ public:
 
     size_t at(KeyT const &key, bool raise_error=true) const
     {
+        if (frozen()) {
+            size_t const ix = frozen_at(key);
+            if (ix != (size_t)-1 || !raise_error) return ix;
+        }
         auto ii(_key_to_ix.find(key));
         if (ii == _key_to_ix.end()) {
             if (raise_error) {
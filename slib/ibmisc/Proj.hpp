@@ -40,6 +40,22 @@ This file is in the public domain.
 
 namespace ibmisc {
 
+/** Memory-safe peer class for a proj.4 context, which holds error
+state etc.  A Proj made in a ProjContext may only be used by one
+thread at a time, and must be destroyed before the context. */
+class ProjContext {
+    projCtx ctx;
+
+public:
+    ProjContext() : ctx(pj_ctx_alloc()) {}
+    ~ProjContext() { pj_ctx_free(ctx); }
+
+    ProjContext(ProjContext const &) = delete;
+    ProjContext &operator=(ProjContext const &) = delete;
+
+    projCtx get() const { return ctx; }
+};
+
 /** Memory-safe peer class for projections in the proj.4 C library.
 @see http://trac.osgeo.org/proj */
 class Proj {
@@ -61,6 +77,10 @@ public:
     explicit Proj(std::string const &definition)
         : pj(pj_init_plus(definition.c_str())) {}
 
+    /** Create a projection in a private context (eg, one per thread). */
+    Proj(std::string const &definition, ProjContext const &ctx)
+        : pj(pj_init_plus_ctx(ctx.get(), definition.c_str())) {}
+
 protected:
     /** Needed by latlong_from_proj() */
     explicit Proj(projPJ _pj) : pj(_pj) {}
@@ -87,11 +107,15 @@ public:
     }
 
     /** Copy constructor */
-    Proj(const Proj &h)
+    Proj(const Proj &h) : pj(0)
     { *this = h; }
 
     Proj& operator=(const Proj &h)
     {
+        if (&h == this) return *this;
+        if (pj) pj_free(pj);
+        pj = 0;
+        if (!h.pj) return *this;
         char *pj_def = pj_get_def(h.pj, 0);
         pj = pj_init_plus(pj_def);
         pj_dalloc(pj_def);
@@ -16,9 +16,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <ibmisc/Proj2.hpp>
 #include <ibmisc/netcdf.hpp>
 #include <ibmisc/ibmisc.hpp>
+#include <ibmisc/parallel.hpp>
 
 namespace ibmisc {
 
@@ -28,16 +34,50 @@ sproj(_sproj), direction(_direction)
 
 
 Proj2::Proj2(Proj2 const &rhs) :
-sproj(rhs.sproj), direction(rhs.direction)
-    { realize(); }
+sproj(rhs.sproj), direction(rhs.direction), _id(rhs._id) {}
+
+
+Proj2::Proj2(Proj2 const &rhs, Direction _direction) :
+sproj(rhs.sproj), direction(_direction), _id(rhs._id) {}
+
 
+Proj2::Projs::Projs(std::string const &sproj) :
+    proj(sproj, ctx), llproj(proj.latlong_from_proj()) {}
+
+/** Process-wide registry of projection strings; Proj2::_id indexes
+into it.  Entries are never removed: there are only ever a few. */
+static std::mutex registry_mutex;
+static std::vector<std::string> registry;
 
 void Proj2::realize()
 {
+    _id = -1;
     if (sproj == "") return;
 
-    _proj = Proj(sproj);
-    _llproj = _proj.latlong_from_proj();
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    auto ii(std::find(registry.begin(), registry.end(), sproj));
+    _id = ii - registry.begin();
+    if (ii == registry.end()) registry.push_back(sproj);
+}
+
+Proj2::Projs const &Proj2::projs() const
+{
+    // One set of proj.4 objects per projection per thread, kept until
+    // the thread exits.  Cheap after the first use on each thread.
+    static thread_local std::vector<std::unique_ptr<Projs>> tl_projs;
+
+    if (_id < 0) (*ibmisc_error)(-1,
+        "Proj2: no projection has been set");
+    if (_id >= (int)tl_projs.size()) tl_projs.resize(_id+1);
+    std::unique_ptr<Projs> &p(tl_projs[_id]);
+    if (!p) {
+        std::string def;
+        {std::lock_guard<std::mutex> lock(registry_mutex);
+            def = registry[_id];
+        }
+        p.reset(new Projs(def));
+    }
+    return *p;
 }
 
 /** Transforms a single coordinate pair
@@ -49,8 +89,9 @@ void Proj2::realize()
 @param y1 Destination y (or latitude) coordinate (radians) */
 int Proj2::transform(double x0, double y0, double &x1, double &y1) const
 {
+    Projs const &p(projs());
     if (direction == Direction::XY2LL) {
-        int ret = ibmisc::transform(_proj, _llproj, x0, y0, x1, y1);
+        int ret = ibmisc::transform(p.proj, p.llproj, x0, y0, x1, y1);
         x1 *= R2D;
         y1 *= R2D;
         return ret;
@@ -58,7 +99,84 @@ int Proj2::transform(double x0, double y0, double &x1, double &y1) const
 
     x0 *= D2R;
     y0 *= D2R;
-    return ibmisc::transform(_llproj, _proj, x0, y0, x1, y1);
+    return ibmisc::transform(p.llproj, p.proj, x0, y0, x1, y1);
+}
+
+/** Transforms one chunk of points, in place, with the given pair of projections. */
+static int transform_inplace(
+    Proj const &proj, Proj const &llproj, Proj2::Direction direction,
+    long n, double *x, double *y)
+{
+    if (direction == Proj2::Direction::XY2LL) {
+        int ret = ibmisc::transform(proj, llproj, n, 1, x, y);
+        for (long i=0; i<n; ++i) {
+            x[i] *= R2D;
+            y[i] *= R2D;
+        }
+        return ret;
+    }
+
+    for (long i=0; i<n; ++i) {
+        x[i] *= D2R;
+        y[i] *= D2R;
+    }
+    return ibmisc::transform(llproj, proj, n, 1, x, y);
+}
+
+/** Minimum number of points per thread in the batch transform() */
+static long const transform_grain = 4096;
+
+int Proj2::transform(long n,
+    double const *x0, double const *y0,
+    double *x1, double *y1,
+    int nthreads) const
+{
+    if (x1 != x0) std::copy(x0, x0+n, x1);
+    if (y1 != y0) std::copy(y0, y0+n, y1);
+
+    if (nthreads <= 1 || n < 2*transform_grain) {
+        Projs const &p(projs());
+        return transform_inplace(p.proj, p.llproj, direction, n, x1, y1);
+    }
+
+    std::atomic<int> ret(0);
+    parallel_for(0, n, nthreads, [&](long i0, long i1) {
+        Projs const &p(projs());    // This thread's own
+        int err = transform_inplace(p.proj, p.llproj, direction,
+            i1-i0, x1+i0, y1+i0);
+        int zero = 0;
+        if (err) ret.compare_exchange_strong(zero, err);
+    }, transform_grain);
+    return ret;
+}
+
+int Proj2::transform(
+    blitz::Array<double,1> const &x0, blitz::Array<double,1> const &y0,
+    blitz::Array<double,1> &x1, blitz::Array<double,1> &y1,
+    int nthreads) const
+{
+    long const n = x0.extent(0);
+    if (y0.extent(0) != n) (*ibmisc_error)(-1,
+        "x0 and y0 must have the same size (%ld vs %d)", n, y0.extent(0));
+    if (x1.size() == 0) x1.reference(blitz::Array<double,1>(n));
+    if (y1.size() == 0) y1.reference(blitz::Array<double,1>(n));
+    if (x1.extent(0) != n || y1.extent(0) != n) (*ibmisc_error)(-1,
+        "Output arrays must have size %ld (vs %d, %d)", n, x1.extent(0), y1.extent(0));
+
+    if (n == 0) return 0;
+
+    // Work on contiguous copies
+    std::vector<double> x(n), y(n);
+    for (long i=0; i<n; ++i) {
+        x[i] = x0(x0.lbound(0) + i);
+        y[i] = y0(y0.lbound(0) + i);
+    }
+    int ret = transform(n, &x[0], &y[0], &x[0], &y[0], nthreads);
+    for (long i=0; i<n; ++i) {
+        x1(x1.lbound(0) + i) = x[i];
+        y1(y1.lbound(0) + i) = y[i];
+    }
+    return ret;
 }
 
 }   // namespace ibmisc
@@ -20,7 +20,9 @@
 
 #include <ibmisc/Proj.hpp>
 #include <ibmisc/netcdf.hpp>
+#include <blitz/array.h>
 #include <cmath>
+#include <memory>
 
 namespace ibmisc {
 
@@ -33,15 +35,34 @@ both the forward and backward translation together in one.  Instances have
 a <i>direction</i>, which can be either spherical-to-map, or map-to-spherical. */
 class Proj2 {
 public:
-    /** The proj.4 projection string. */
+    /** The proj.4 projection string.  Fixed at construction: changing
+    it afterwards does not change the projection used. */
     std::string sproj;
     /** Direction enums for latlon-to-xy, and xy-to-latlon */
     enum class Direction {LL2XY, XY2LL};
     /** The direction of translation for this instance. */
     Direction direction;
 protected:
-    Proj _proj, _llproj;
+    /** A projection and its underlying lat/lon system, in a proj.4
+    context of their own.  proj.4 objects keep error state and may not
+    be used by two threads at once, so each thread makes its own (see
+    projs()).  ctx is declared first so it is destroyed last. */
+    struct Projs {
+        ProjContext ctx;
+        Proj proj, llproj;
+        Projs(std::string const &sproj);
+    };
+    /** Index of sproj in a process-wide registry of projection
+    strings (-1 if sproj is empty); set by realize().  Copies of a
+    Proj2 share it, but never the proj.4 objects themselves. */
+    int _id;
+
+    /** Looks up (or registers) sproj, setting _id. */
     void realize();
+
+    /** The calling thread's projections for sproj, made the first
+    time this thread uses them. */
+    Projs const &projs() const;
 public:
 
     /** @param _sproj The projection string.
@@ -49,13 +70,13 @@ public:
     Proj2(std::string const &_sproj, Direction _direction);
 
 
-    /** Copy constructor */
+    /** Copy constructor; cheap, does not initialize any projections.
+    Copies (and the original) may be used on different threads at
+    once. */
     Proj2(Proj2 const &rhs);
 
     /** Copies an existing Proj2, but with a different direction. */
-    Proj2(Proj2 const &rhs, Direction _direction) :
-        sproj(rhs.sproj), direction(_direction)
-        { realize(); }
+    Proj2(Proj2 const &rhs, Direction _direction);
 
 
 
@@ -68,6 +89,24 @@ public:
     @param y1 Destination y (or latitude) coordinate (radians) */
     int transform(double x0, double y0, double &x1, double &y1) const;
 
+    /** Transforms n coordinate pairs with one proj.4 call per chunk.
+    Input and output arrays may be the same.
+    @param nthreads Split the points among this many threads, each
+        with its own proj.4 context.
+    @return Zero, or the first proj.4 error code encountered. */
+    int transform(long n,
+        double const *x0, double const *y0,
+        double *x1, double *y1,
+        int nthreads=1) const;
+
+    /** Transforms arrays of coordinate pairs (any strides).  x1 and y1
+    are allocated if they are empty.
+    @see transform(long, double const *, ...) */
+    int transform(
+        blitz::Array<double,1> const &x0, blitz::Array<double,1> const &y0,
+        blitz::Array<double,1> &x1, blitz::Array<double,1> &y1,
+        int nthreads=1) const;
+
 #ifdef USE_NETCDF
 void ncio_proj2(
     ibmisc::NcIO &ncio,
@@ -30,6 +30,20 @@
 #include <cmath>
 #include <cassert>
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/geodesy.hpp>
 
 namespace ibmisc {
 
@@ -40,14 +54,118 @@ namespace ibmisc {
 // RTree.h
 //
 
-#define RTREE_TEMPLATE template<class DATATYPE, class ELEMTYPE, int NUMDIMS, class ELEMTYPEREAL, int TMAXNODES, int TMINNODES>
-#define RTREE_QUAL RTree<DATATYPE, ELEMTYPE, NUMDIMS, ELEMTYPEREAL, TMAXNODES, TMINNODES>
+#define RTREE_TEMPLATE template<class DATATYPE, class ELEMTYPE, int NUMDIMS, class ELEMTYPEREAL, int TMAXNODES, int TMINNODES, template<class> class ALLOCATOR>
+#define RTREE_QUAL RTree<DATATYPE, ELEMTYPE, NUMDIMS, ELEMTYPEREAL, TMAXNODES, TMINNODES, ALLOCATOR>
 
-#define RTREE_DONT_USE_MEMPOOLS // This version does not contain a fixed memory allocator, fill in lines with EXAMPLE to implement one.
 #define RTREE_USE_SPHERICAL_VOLUME // Better split classification, may be slower on some systems
 
 // Fwd decl
 class RTFileStream;  // File I/O helper class, look below for implementation and notes.
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES> class FlatRTree;
+
+
+/// \class RTreePool
+/// Default node allocator for RTree: hands out fixed-size objects from
+/// contiguous blocks, recycling freed ones through a free list.
+/// clear() recycles every object at once, without visiting them; the
+/// blocks themselves are kept for reuse until release() or destruction.
+///
+/// An RTree ALLOCATOR provides alloc(), free(T*), clear(), and
+/// static bool const bulk_free (true if clear() frees all objects).
+/// T must be trivially destructible.
+template<class T>
+class RTreePool
+{
+  union Slot
+  {
+    Slot* m_next;                                 ///< Free list link
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type m_obj;
+  };
+
+  enum { BLOCK_SIZE = 256 };                      ///< Objects per block
+
+  std::vector<std::unique_ptr<Slot[]>> m_blocks;
+  size_t m_block;                                 ///< Block being carved up
+  size_t m_pos;                                   ///< Next unused slot in m_blocks[m_block]
+  Slot* m_free;                                   ///< Freed slots
+
+public:
+  static bool const bulk_free = true;
+
+  RTreePool() : m_block(0), m_pos(0), m_free(NULL) {}
+
+  T* alloc()
+  {
+    Slot* slot;
+    if(m_free)
+    {
+      slot = m_free;
+      m_free = m_free->m_next;
+    }
+    else
+    {
+      if(m_block < m_blocks.size() && m_pos == BLOCK_SIZE)
+      {
+        ++m_block;
+        m_pos = 0;
+      }
+      if(m_block == m_blocks.size())
+      {
+        m_blocks.push_back(std::unique_ptr<Slot[]>(new Slot[BLOCK_SIZE]));
+      }
+      slot = &m_blocks[m_block][m_pos++];
+    }
+    return new (&slot->m_obj) T;
+  }
+
+  void free(T* a_obj)
+  {
+    Slot* slot = reinterpret_cast<Slot*>(a_obj);
+    slot->m_next = m_free;
+    m_free = slot;
+  }
+
+  /// Frees all objects in O(1); memory is kept for reuse.
+  void clear()
+  {
+    m_block = 0;
+    m_pos = 0;
+    m_free = NULL;
+  }
+
+  /// Frees all objects and returns memory to the system.
+  void release()
+  {
+    clear();
+    m_blocks.clear();
+  }
+
+  /// Number of bytes held by the pool
+  size_t capacity_bytes() const
+    { return m_blocks.size() * BLOCK_SIZE * sizeof(Slot); }
+};
+
+template<class T>
+bool const RTreePool<T>::bulk_free;
+
+
+/// \class RTreeNewDelete
+/// RTree ALLOCATOR that uses plain new / delete for every object.
+template<class T>
+class RTreeNewDelete
+{
+public:
+  static bool const bulk_free = false;
+
+  T* alloc()                                      { return new T; }
+  void free(T* a_obj)                             { delete a_obj; }
+  void clear()                                    {}
+  void release()                                  {}
+};
+
+template<class T>
+bool const RTreeNewDelete<T>::bulk_free;
+
 
 
 /// \class RTree
@@ -60,14 +178,16 @@ class RTFileStream;  // File I/O helper class, look below for implementation and
 /// ELEMTYPE Type of element such as int or float
 /// NUMDIMS Number of dimensions such as 2 or 3
 /// ELEMTYPEREAL Type of element that allows fractional and large values such as float or double, for use in volume calcs
+/// ALLOCATOR Node allocator template (see RTreePool, the default, and RTreeNewDelete)
 ///
 /// NOTES: Inserting and removing data requires the knowledge of its constant Minimal Bounding Rectangle.
-///        This version uses new/delete for nodes, I recommend using a fixed size allocator for efficiency.
+///        Nodes come from ALLOCATOR; with the default RTreePool, RemoveAll() is O(1).
 ///        Instead of using a callback function for returned results, I recommend and efficient pre-sized, grow-only memory
 ///        array similar to MFC CArray or STL Vector for returning search query result.
 ///
 template<class DATATYPE, class ELEMTYPE, int NUMDIMS, 
-         class ELEMTYPEREAL = ELEMTYPE, int TMAXNODES = 8, int TMINNODES = TMAXNODES / 2>
+         class ELEMTYPEREAL = ELEMTYPE, int TMAXNODES = 8, int TMINNODES = TMAXNODES / 2,
+         template<class> class ALLOCATOR = RTreePool>
 class RTree
 {
 protected: 
@@ -90,6 +210,8 @@ public:
 public:
 
   RTree();
+  RTree(RTree const &) = delete;
+  RTree &operator=(RTree const &) = delete;
   virtual ~RTree();
   
   /// Insert entry
@@ -112,9 +234,20 @@ public:
   /// \return Returns the number of entries found
   int Search(std::array<ELEMTYPE, NUMDIMS> const &a_min, std::array<ELEMTYPE, NUMDIMS> const &a_max, RTree::Callback const &a_resultCallback);
   
-  /// Remove all entries from tree
+  /// Remove all entries from tree.
+  /// O(1) if ALLOCATOR::bulk_free; node memory is kept for reuse.
   void RemoveAll();
 
+  /// Replace the contents of the tree with a packed tree, built
+  /// bottom-up by Sort-Tile-Recursive (STR) ordering.  Much faster
+  /// than n calls to Insert(), and the result has less node overlap
+  /// (so faster Search()).  The tree may be modified afterwards as usual.
+  /// \param a_count Number of entries
+  /// \param a_min Min of bounding rects: a_min[i*NUMDIMS + dim]
+  /// \param a_max Max of bounding rects: a_max[i*NUMDIMS + dim]
+  /// \param a_dataIds Id of each entry
+  void BulkLoad(int a_count, const ELEMTYPE* a_min, const ELEMTYPE* a_max, const DATATYPE* a_dataIds);
+
   /// Count the data elements in this container.  This is slow as no internal counter is maintained.
   int Count();
 
@@ -129,6 +262,10 @@ public:
   /// Save tree contents to stream
   bool Save(RTFileStream& a_stream);
 
+  /// Copy the tree into a_flat, an immutable flat-array form of it that
+  /// is faster to search.  The tree itself is unchanged.
+  void Freeze(FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, TMAXNODES>& a_flat);
+
   /// Iterator is not remove safe.
   class Iterator
   {
@@ -377,12 +514,15 @@ protected:
   void ReInsert(Node* a_node, ListNode** a_listNode);
   bool Search(Node* a_node, Rect* a_rect, int& a_foundCount, RTree::Callback const &a_resultCallback);
   void RemoveAllRec(Node* a_node);
+  void BulkPack(Branch* a_begin, Branch* a_end, int a_dim, int a_level, std::vector<Branch>& a_parents);
   void Reset();
   void CountRec(Node* a_node, int& a_count);
 
   bool SaveRec(Node* a_node, RTFileStream& a_stream);
   bool LoadRec(Node* a_node, RTFileStream& a_stream);
   
+  ALLOCATOR<Node> m_nodePool;                      ///< Source of Nodes
+  ALLOCATOR<ListNode> m_listNodePool;              ///< Source of ListNodes
   Node* m_root;                                    ///< Root of tree
   ELEMTYPEREAL m_unitSphereVolume;                 ///< Unit sphere constant for required number of dimensions
 };
@@ -797,16 +937,109 @@ void RTREE_QUAL::RemoveAll()
 }
 
 
+RTREE_TEMPLATE
+void RTREE_QUAL::BulkLoad(int a_count, const ELEMTYPE* a_min, const ELEMTYPE* a_max, const DATATYPE* a_dataIds)
+{
+  RemoveAll();
+  if(a_count == 0)
+  {
+    return;
+  }
+
+  std::vector<Branch> branches(a_count);
+  for(int i = 0; i < a_count; ++i)
+  {
+    for(int axis = 0; axis < NUMDIMS; ++axis)
+    {
+      branches[i].m_rect.m_min[axis] = a_min[i*NUMDIMS + axis];
+      branches[i].m_rect.m_max[axis] = a_max[i*NUMDIMS + axis];
+    }
+    branches[i].m_data = a_dataIds[i];
+  }
+
+  // Pack one level at a time, until a single node is left
+  std::vector<Branch> parents;
+  for(int level = 0; ; ++level)
+  {
+    if(branches.size() <= (size_t)MAXNODES)
+    {
+      m_root->m_level = level;
+      for(size_t i = 0; i < branches.size(); ++i)
+      {
+        m_root->m_branch[i] = branches[i];
+      }
+      m_root->m_count = branches.size();
+      break;
+    }
+
+    parents.clear();
+    BulkPack(&branches[0], &branches[0] + branches.size(), 0, level, parents);
+    branches.swap(parents);
+  }
+}
+
+
+// Sort-Tile-Recursive: sort [a_begin, a_end) by center along a_dim, cut
+// into slabs and recurse on the next dimension.  Runs along the last
+// dimension are cut into (evenly filled) nodes at level a_level; a
+// branch pointing to each new node is appended to a_parents.
+RTREE_TEMPLATE
+void RTREE_QUAL::BulkPack(Branch* a_begin, Branch* a_end, int a_dim, int a_level, std::vector<Branch>& a_parents)
+{
+  std::sort(a_begin, a_end, [a_dim](Branch const &a, Branch const &b) {
+    return (a.m_rect.m_min[a_dim] + a.m_rect.m_max[a_dim])
+      < (b.m_rect.m_min[a_dim] + b.m_rect.m_max[a_dim]);
+  });
+
+  long const count = a_end - a_begin;
+  long const nnodes = (count + MAXNODES - 1) / MAXNODES;
+
+  if(a_dim < NUMDIMS-1)
+  {
+    // Enough slabs that the remaining dimensions split evenly
+    long const nslabs = (long)std::ceil(std::pow((double)nnodes, 1.0 / (NUMDIMS - a_dim)));
+    long const slabSize = ((nnodes + nslabs - 1) / nslabs) * MAXNODES;
+    for(long slab = 0; slab < count; slab += slabSize)
+    {
+      BulkPack(a_begin + slab, a_begin + std::min(slab + slabSize, count), a_dim+1, a_level, a_parents);
+    }
+    return;
+  }
+
+  // Cut into nnodes nodes, sizes as equal as possible
+  Branch* cur = a_begin;
+  for(long i = 0; i < nnodes; ++i)
+  {
+    Branch* next = a_begin + count * (i+1) / nnodes;
+    Node* node = AllocNode();
+    node->m_level = a_level;
+    node->m_count = next - cur;
+    std::copy(cur, next, node->m_branch);
+    cur = next;
+
+    Branch parent;
+    parent.m_rect = NodeCover(node);
+    parent.m_child = node;
+    a_parents.push_back(parent);
+  }
+}
+
+
 RTREE_TEMPLATE
 void RTREE_QUAL::Reset()
 {
-#ifdef RTREE_DONT_USE_MEMPOOLS
-  // Delete all existing nodes
-  RemoveAllRec(m_root);
-#else // RTREE_DONT_USE_MEMPOOLS
-  // Just reset memory pools.  We are not using complex types
-  // EXAMPLE
-#endif // RTREE_DONT_USE_MEMPOOLS
+  if(ALLOCATOR<Node>::bulk_free)
+  {
+    // Just reset memory pools.  We are not using complex types
+    m_nodePool.clear();
+    m_listNodePool.clear();
+  }
+  else
+  {
+    // Delete all existing nodes
+    RemoveAllRec(m_root);
+  }
+  m_root = NULL;
 }
 
 
@@ -830,12 +1063,7 @@ void RTREE_QUAL::RemoveAllRec(Node* a_node)
 RTREE_TEMPLATE
 typename RTREE_QUAL::Node* RTREE_QUAL::AllocNode()
 {
-  Node* newNode;
-#ifdef RTREE_DONT_USE_MEMPOOLS
-  newNode = new Node;
-#else // RTREE_DONT_USE_MEMPOOLS
-  // EXAMPLE
-#endif // RTREE_DONT_USE_MEMPOOLS
+  Node* newNode = m_nodePool.alloc();
   InitNode(newNode);
   return newNode;
 }
@@ -846,11 +1074,7 @@ void RTREE_QUAL::FreeNode(Node* a_node)
 {
   ASSERT(a_node);
 
-#ifdef RTREE_DONT_USE_MEMPOOLS
-  delete a_node;
-#else // RTREE_DONT_USE_MEMPOOLS
-  // EXAMPLE
-#endif // RTREE_DONT_USE_MEMPOOLS
+  m_nodePool.free(a_node);
 }
 
 
@@ -859,22 +1083,14 @@ void RTREE_QUAL::FreeNode(Node* a_node)
 RTREE_TEMPLATE
 typename RTREE_QUAL::ListNode* RTREE_QUAL::AllocListNode()
 {
-#ifdef RTREE_DONT_USE_MEMPOOLS
-  return new ListNode;
-#else // RTREE_DONT_USE_MEMPOOLS
-  // EXAMPLE
-#endif // RTREE_DONT_USE_MEMPOOLS
+  return m_listNodePool.alloc();
 }
 
 
 RTREE_TEMPLATE
 void RTREE_QUAL::FreeListNode(ListNode* a_listNode)
 {
-#ifdef RTREE_DONT_USE_MEMPOOLS
-  delete a_listNode;
-#else // RTREE_DONT_USE_MEMPOOLS
-  // EXAMPLE
-#endif // RTREE_DONT_USE_MEMPOOLS
+  m_listNodePool.free(a_listNode);
 }
 
 
@@ -1611,6 +1827,701 @@ bool RTREE_QUAL::Search(Node* a_node, Rect* a_rect, int& a_foundCount, RTree::Ca
 }
 
 
+RTREE_TEMPLATE
+void RTREE_QUAL::Freeze(FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, TMAXNODES>& a_flat)
+{
+  typedef FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, TMAXNODES> FlatT;
+
+  // Lay out nodes in breadth-first order, so the children of each node
+  // (and the data of each leaf) are contiguous.
+  std::vector<typename FlatT::Node> nodes;
+  std::vector<DATATYPE> data;
+  std::vector<Node*> queue(1, m_root);
+  for(size_t k = 0; k < queue.size(); ++k)
+  {
+    Node* node = queue[k];
+    typename FlatT::Node flat;
+    flat.Clear();
+    flat.m_count = node->m_count;
+    flat.m_level = node->m_level;
+    flat.m_first = (node->IsLeaf() ? data.size() : queue.size());
+    for(int index = 0; index < node->m_count; ++index)
+    {
+      Branch& branch = node->m_branch[index];
+      for(int axis = 0; axis < NUMDIMS; ++axis)
+      {
+        flat.m_min[axis][index] = branch.m_rect.m_min[axis];
+        flat.m_max[axis][index] = branch.m_rect.m_max[axis];
+      }
+      if(node->IsLeaf())
+      {
+        data.push_back(branch.m_data);
+      }
+      else
+      {
+        queue.push_back(branch.m_child);
+      }
+    }
+    nodes.push_back(flat);
+  }
+
+  a_flat.Assign(std::move(nodes), std::move(data));
+}
+
+
+/// \struct RTreeEuclidean
+/// Distance metric for FlatRTree::Nearest(): the least Euclidean
+/// distance from a point to any point of a box (0 inside the box).
+template<class ELEMTYPE, int NUMDIMS>
+struct RTreeEuclidean
+{
+  ELEMTYPE operator()(std::array<ELEMTYPE, NUMDIMS> const& a_point,
+    std::array<ELEMTYPE, NUMDIMS> const& a_min, std::array<ELEMTYPE, NUMDIMS> const& a_max) const
+  {
+    ELEMTYPE sum = 0;
+    for(int axis = 0; axis < NUMDIMS; ++axis)
+    {
+      ELEMTYPE const d = std::max(ELEMTYPE(0),
+        std::max(a_min[axis] - a_point[axis], a_point[axis] - a_max[axis]));
+      sum += d*d;
+    }
+    return std::sqrt(sum);
+  }
+};
+
+
+/// \struct RTreeHaversine
+/// Distance metric for FlatRTree::Nearest() on trees of (lon, lat)
+/// boxes, in degrees: the least great circle distance (degrees, see
+/// haversine_distance()) from a point to any point of a box.  Longitude
+/// wraps around; boxes must not be wider than 360 degrees.
+struct RTreeHaversine
+{
+  double operator()(std::array<double, 2> const& a_point,
+    std::array<double, 2> const& a_min, std::array<double, 2> const& a_max) const
+  {
+    double const lon = a_point[0];
+    double const lat = a_point[1];
+
+    // Inside the box's span of longitude: nearest point is on our meridian
+    if(Wrap(lon - a_min[0]) <= a_max[0] - a_min[0])
+    {
+      return std::max(0., std::max(a_min[1] - lat, lat - a_max[1]));
+    }
+
+    // Otherwise it is on the nearer of the box's two meridian edges
+    double const dmin = std::abs(Wrap180(lon - a_min[0]));
+    double const dmax = std::abs(Wrap180(lon - a_max[0]));
+    return MeridianDistance(lon, lat, (dmin < dmax ? a_min[0] : a_max[0]), a_min[1], a_max[1]);
+  }
+
+protected:
+  /// \return a_deg in [0, 360)
+  static double Wrap(double a_deg)
+  {
+    double const ret = std::fmod(a_deg, 360.);
+    return (ret < 0 ? ret + 360. : ret);
+  }
+
+  /// \return a_deg in [-180, 180)
+  static double Wrap180(double a_deg)
+    { return Wrap(a_deg + 180.) - 180.; }
+
+  /// Least distance from (lon, lat) to the meridian segment at a_lon
+  /// between a_lat0 and a_lat1
+  static double MeridianDistance(double lon, double lat, double a_lon, double a_lat0, double a_lat1)
+  {
+    // Along the meridian, cos(distance) = R cos(lat2 - peak)
+    double const R2D = 180. / M_PI;
+    double const D2R = M_PI / 180.;
+    double const peak = std::atan2(std::sin(lat*D2R), std::cos(lat*D2R) * std::cos((lon-a_lon)*D2R)) * R2D;
+    double ret = std::min(
+      haversine_distance(lon, lat, a_lon, a_lat0),
+      haversine_distance(lon, lat, a_lon, a_lat1));
+    if(a_lat0 < peak && peak < a_lat1)
+    {
+      ret = std::min(ret, haversine_distance(lon, lat, a_lon, peak));
+    }
+    return ret;
+  }
+};
+
+
+/// \class FlatRTree
+/// Read-only RTree, produced by RTree::Freeze().
+/// Nodes sit in one array and refer to their children by index.  Each
+/// node stores its children's bounding boxes in struct-of-arrays form
+/// (m_min[axis][child]), so all children of a node are tested with
+/// one (vectorizable) loop per axis.
+///
+/// The arrays contain no pointers, so Save() writes them verbatim; Map()
+/// maps such a file read-only and queries it in place, with no loading
+/// step.  Processes mapping the same file share its pages.
+/// DATATYPE must be trivially copyable for Save() / Map().
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES = 8>
+class FlatRTree
+{
+public:
+
+  typedef std::function<bool (DATATYPE id)> Callback;
+
+  enum { MAX_DEPTH = 32 };                        ///< Max depth of tree
+
+  struct Node
+  {
+    ELEMTYPE m_min[NUMDIMS][MAXNODES];            ///< Min of each child's bounding box
+    ELEMTYPE m_max[NUMDIMS][MAXNODES];            ///< Max of each child's bounding box
+    int m_first;                                  ///< Index of first child node (or first data item, for leaves)
+    int m_count;                                  ///< Number of children
+    int m_level;                                  ///< Leaf is zero, others positive
+
+    /// Empties the node; unused slots never overlap anything
+    void Clear()
+    {
+      for(int axis = 0; axis < NUMDIMS; ++axis)
+      {
+        for(int index = 0; index < MAXNODES; ++index)
+        {
+          m_min[axis][index] = std::numeric_limits<ELEMTYPE>::max();
+          m_max[axis][index] = std::numeric_limits<ELEMTYPE>::lowest();
+        }
+      }
+      m_first = 0;
+      m_count = 0;
+      m_level = 0;
+    }
+  };
+
+protected:
+
+  /// Start of a Save() file.  Nodes and data follow, at the given offsets.
+  struct FileHeader
+  {
+    char m_magic[8];                              ///< "IBRTFLAT"
+    int32_t m_byteOrder;                          ///< 0x01020304, as written
+    int32_t m_dataSize;
+    int32_t m_numDims;
+    int32_t m_elemSize;
+    int32_t m_maxNodes;
+    int32_t m_nodeSize;
+    int64_t m_nodeCount;
+    int64_t m_dataCount;
+    int64_t m_nodeOffset;
+    int64_t m_dataOffset;
+  };
+
+  enum { FILE_ALIGN = 64 };                       ///< Alignment of arrays in a Save() file
+
+  std::vector<Node> m_nodes;                      ///< m_nodes[0] is the root
+  std::vector<DATATYPE> m_data;
+
+  std::shared_ptr<void> m_map;                    ///< Memory-mapped file, if any (replaces m_nodes and m_data)
+  Node const* m_mapNodes;
+  DATATYPE const* m_mapData;
+  long m_mapNodeCount;
+  long m_mapDataCount;
+
+  static FileHeader MakeHeader(long a_nodeCount, long a_dataCount)
+  {
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, "IBRTFLAT", 8);
+    header.m_byteOrder = 0x01020304;
+    header.m_dataSize = sizeof(DATATYPE);
+    header.m_numDims = NUMDIMS;
+    header.m_elemSize = sizeof(ELEMTYPE);
+    header.m_maxNodes = MAXNODES;
+    header.m_nodeSize = sizeof(Node);
+    header.m_nodeCount = a_nodeCount;
+    header.m_dataCount = a_dataCount;
+    header.m_nodeOffset = FILE_ALIGN;
+    header.m_dataOffset = FileAlign(header.m_nodeOffset + a_nodeCount * sizeof(Node));
+    return header;
+  }
+
+  static long FileAlign(long a_offset)
+    { return (a_offset + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN; }
+
+public:
+
+  FlatRTree() : m_mapNodes(NULL), m_mapData(NULL), m_mapNodeCount(0), m_mapDataCount(0) {}
+
+  /// Set the contents (normally called by RTree::Freeze())
+  void Assign(std::vector<Node>&& a_nodes, std::vector<DATATYPE>&& a_data)
+  {
+    m_map.reset();
+    m_nodes = std::move(a_nodes);
+    m_data = std::move(a_data);
+  }
+
+  /// Nodes, root first
+  Node const* Nodes() const                       { return m_map ? m_mapNodes : m_nodes.data(); }
+
+  /// Data of all leaves, concatenated
+  DATATYPE const* Data() const                    { return m_map ? m_mapData : m_data.data(); }
+
+  /// Number of data elements
+  long Count() const                              { return m_map ? m_mapDataCount : m_data.size(); }
+
+  /// Number of nodes
+  long NodeCount() const                          { return m_map ? m_mapNodeCount : m_nodes.size(); }
+
+  /// Write tree to a file that Map() can use.  The file is specific to
+  /// the template parameters and byte order.
+  /// \return false on I/O error
+  bool Save(const char* a_fileName) const;
+
+  /// Replace the contents with a read-only memory map of a Save() file.
+  /// The mapping is shared by copies of this FlatRTree, and released
+  /// with the last of them.
+  /// \return false if the file could not be mapped, was not written
+  ///         by Save() with the same template parameters, or is corrupt
+  ///         (truncated, or nodes referring outside the file)
+  bool Map(const char* a_fileName);
+
+  /// Find all within search rectangle.  Results are reported in the
+  /// same order as RTree::Search() on the tree this was frozen from.
+  /// \param a_resultCallback Called as bool(DATATYPE); should return 'true' to continue searching.
+  ///        May be a Callback, or any functor (which can then be inlined).
+  /// \return Returns the number of entries found
+  template<class CallbackT>
+  int Search(std::array<ELEMTYPE, NUMDIMS> const &a_min, std::array<ELEMTYPE, NUMDIMS> const &a_max, CallbackT const &a_resultCallback) const;
+
+  /// Search for many rectangles at once.  Hits for query q are
+  /// a_hits[a_offsets[q]] .. a_hits[a_offsets[q+1]-1] (CSR layout), in
+  /// Search() order.
+  /// \param a_count Number of query rectangles
+  /// \param a_min Min of query rects: a_min[q*NUMDIMS + dim]
+  /// \param a_max Max of query rects: a_max[q*NUMDIMS + dim]
+  /// \param a_offsets Set to a_count+1 offsets into a_hits
+  /// \param a_hits Set to the hits of all queries, concatenated
+  /// \param a_nthreads Number of threads to split the queries among
+  void SearchBatch(int a_count, const ELEMTYPE* a_min, const ELEMTYPE* a_max,
+    std::vector<long>& a_offsets, std::vector<DATATYPE>& a_hits, int a_nthreads = 1) const;
+
+  /// Find the entries nearest a point, nearest first, in a single
+  /// best-first traversal (a priority queue ordered by the distance
+  /// to each node's bounding box).  Equally distant entries come out
+  /// in a fixed order.
+  /// \param a_k Max number of entries to find; -1 for no limit
+  /// \param a_radius Only find entries within this distance
+  /// \param a_hits Set to (distance, id) of the entries found
+  /// \param a_dist Distance from a point to a box, eg RTreeEuclidean or RTreeHaversine
+  /// \return Number of entries found
+  template<class DistT = RTreeEuclidean<ELEMTYPE, NUMDIMS>>
+  int Nearest(std::array<ELEMTYPE, NUMDIMS> const& a_point, int a_k,
+    std::vector<std::pair<ELEMTYPE, DATATYPE>>& a_hits,
+    ELEMTYPE a_radius = std::numeric_limits<ELEMTYPE>::max(),
+    DistT const& a_dist = DistT()) const;
+
+  /// Find all entries within a_radius of a point, nearest first
+  template<class DistT = RTreeEuclidean<ELEMTYPE, NUMDIMS>>
+  int Within(std::array<ELEMTYPE, NUMDIMS> const& a_point, ELEMTYPE a_radius,
+    std::vector<std::pair<ELEMTYPE, DATATYPE>>& a_hits,
+    DistT const& a_dist = DistT()) const
+    { return Nearest(a_point, -1, a_hits, a_radius, a_dist); }
+
+  /// Nearest() for many points at once, in the CSR layout of SearchBatch().
+  /// \param a_points Query points: a_points[q*NUMDIMS + dim]
+  /// \param a_dists If not NULL, set to the distance of each hit
+  void NearestBatch(int a_count, const ELEMTYPE* a_points, int a_k, ELEMTYPE a_radius,
+    std::vector<long>& a_offsets, std::vector<DATATYPE>& a_hits,
+    std::vector<ELEMTYPE>* a_dists = NULL, int a_nthreads = 1) const
+    { NearestBatch(a_count, a_points, a_k, a_radius, RTreeEuclidean<ELEMTYPE, NUMDIMS>(),
+      a_offsets, a_hits, a_dists, a_nthreads); }
+
+  template<class DistT>
+  void NearestBatch(int a_count, const ELEMTYPE* a_points, int a_k, ELEMTYPE a_radius,
+    DistT const& a_dist,
+    std::vector<long>& a_offsets, std::vector<DATATYPE>& a_hits,
+    std::vector<ELEMTYPE>* a_dists = NULL, int a_nthreads = 1) const;
+
+protected:
+
+  /// Entry of Nearest()'s queue: a node, or a data item
+  struct QueueEntry
+  {
+    ELEMTYPE m_dist;
+    long m_seq;                                   ///< Order pushed; breaks ties
+    int m_index;                                  ///< Node index, or data index if m_data
+    bool m_data;
+
+    bool operator<(QueueEntry const& a_other) const   // Reversed, for a min-heap
+      { return m_dist > a_other.m_dist || (m_dist == a_other.m_dist && m_seq > a_other.m_seq); }
+  };
+
+  template<class DistT>
+  int Nearest(std::array<ELEMTYPE, NUMDIMS> const& a_point, int a_k, ELEMTYPE a_radius,
+    DistT const& a_dist, std::vector<QueueEntry>& a_queue,
+    std::vector<std::pair<ELEMTYPE, DATATYPE>>& a_hits) const;
+};
+
+
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+template<class CallbackT>
+int FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, MAXNODES>::Search(std::array<ELEMTYPE, NUMDIMS> const &a_min, std::array<ELEMTYPE, NUMDIMS> const &a_max, CallbackT const &a_resultCallback) const
+{
+  if(NodeCount() == 0)
+  {
+    return 0;
+  }
+  Node const* nodes = Nodes();
+  DATATYPE const* data = Data();
+
+  // Depth-first, with an explicit stack instead of recursion
+  int stack[MAX_DEPTH * MAXNODES];
+  int tos = 0;
+  stack[tos++] = 0;
+
+  int foundCount = 0;
+  while(tos > 0)
+  {
+    Node const& node = nodes[stack[--tos]];
+
+    bool overlap[MAXNODES];
+    for(int index = 0; index < MAXNODES; ++index)
+    {
+      overlap[index] = true;
+    }
+    for(int axis = 0; axis < NUMDIMS; ++axis)
+    {
+      for(int index = 0; index < MAXNODES; ++index)
+      {
+        overlap[index] = overlap[index]
+          & (node.m_min[axis][index] <= a_max[axis])
+          & (a_min[axis] <= node.m_max[axis][index]);
+      }
+    }
+
+    if(node.m_level == 0)
+    {
+      for(int index = 0; index < node.m_count; ++index)
+      {
+        if(overlap[index])
+        {
+          ++foundCount;
+          if(!a_resultCallback(data[node.m_first + index]))
+          {
+            return foundCount; // Don't continue searching
+          }
+        }
+      }
+    }
+    else
+    {
+      // Push in reverse, so children are visited in order
+      for(int index = node.m_count - 1; index >= 0; --index)
+      {
+        if(overlap[index])
+        {
+          ASSERT(tos < MAX_DEPTH * MAXNODES);
+          stack[tos++] = node.m_first + index;
+        }
+      }
+    }
+  }
+
+  return foundCount;
+}
+
+
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+void FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, MAXNODES>::SearchBatch(int a_count, const ELEMTYPE* a_min, const ELEMTYPE* a_max,
+  std::vector<long>& a_offsets, std::vector<DATATYPE>& a_hits, int a_nthreads) const
+{
+  a_offsets.assign(a_count+1, 0);
+  a_hits.clear();
+  if(a_count == 0)
+  {
+    return;
+  }
+
+  // Each chunk of queries collects its hits separately
+  long const nchunks = std::max(1, std::min(a_nthreads, a_count));
+  std::vector<std::vector<DATATYPE>> chunkHits(nchunks);
+  ibmisc::parallel_for(0, nchunks, nchunks, [&](long c0, long c1) {
+    for(long c = c0; c < c1; ++c)
+    {
+      std::vector<DATATYPE>& hits = chunkHits[c];
+      for(long q = a_count*c/nchunks; q < a_count*(c+1)/nchunks; ++q)
+      {
+        std::array<ELEMTYPE, NUMDIMS> qmin, qmax;
+        for(int axis = 0; axis < NUMDIMS; ++axis)
+        {
+          qmin[axis] = a_min[q*NUMDIMS + axis];
+          qmax[axis] = a_max[q*NUMDIMS + axis];
+        }
+        a_offsets[q+1] = Search(qmin, qmax, [&hits](DATATYPE const &id) {
+          hits.push_back(id);
+          return true;
+        });
+      }
+    }
+  });
+
+  for(int q = 0; q < a_count; ++q)
+  {
+    a_offsets[q+1] += a_offsets[q];
+  }
+  a_hits.reserve(a_offsets[a_count]);
+  for(auto& hits : chunkHits)
+  {
+    a_hits.insert(a_hits.end(), hits.begin(), hits.end());
+    std::vector<DATATYPE>().swap(hits);
+  }
+}
+
+
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+template<class DistT>
+int FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, MAXNODES>::Nearest(std::array<ELEMTYPE, NUMDIMS> const& a_point, int a_k,
+  std::vector<std::pair<ELEMTYPE, DATATYPE>>& a_hits, ELEMTYPE a_radius, DistT const& a_dist) const
+{
+  std::vector<QueueEntry> queue;
+  a_hits.clear();
+  return Nearest(a_point, a_k, a_radius, a_dist, queue, a_hits);
+}
+
+
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+template<class DistT>
+int FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, MAXNODES>::Nearest(std::array<ELEMTYPE, NUMDIMS> const& a_point, int a_k, ELEMTYPE a_radius,
+  DistT const& a_dist, std::vector<QueueEntry>& a_queue,
+  std::vector<std::pair<ELEMTYPE, DATATYPE>>& a_hits) const
+{
+  if(NodeCount() == 0 || a_k == 0)
+  {
+    return 0;
+  }
+  Node const* nodes = Nodes();
+  DATATYPE const* data = Data();
+
+  // Entries come off the queue in order of distance.  A data item's
+  // distance is exact, and no closer to anything still queued, so it
+  // is the next nearest.
+  long seq = 0;
+  a_queue.clear();
+  a_queue.push_back(QueueEntry{0, seq++, 0, false});
+  int foundCount = 0;
+  while(!a_queue.empty())
+  {
+    std::pop_heap(a_queue.begin(), a_queue.end());
+    QueueEntry const top = a_queue.back();
+    a_queue.pop_back();
+
+    if(top.m_data)
+    {
+      a_hits.push_back(std::make_pair(top.m_dist, data[top.m_index]));
+      if(++foundCount == a_k)
+      {
+        break;
+      }
+      continue;
+    }
+
+    Node const& node = nodes[top.m_index];
+    for(int index = 0; index < node.m_count; ++index)
+    {
+      std::array<ELEMTYPE, NUMDIMS> bmin, bmax;
+      for(int axis = 0; axis < NUMDIMS; ++axis)
+      {
+        bmin[axis] = node.m_min[axis][index];
+        bmax[axis] = node.m_max[axis][index];
+      }
+      ELEMTYPE const dist = a_dist(a_point, bmin, bmax);
+      if(dist <= a_radius)
+      {
+        a_queue.push_back(QueueEntry{dist, seq++, node.m_first + index, node.m_level == 0});
+        std::push_heap(a_queue.begin(), a_queue.end());
+      }
+    }
+  }
+
+  return foundCount;
+}
+
+
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+template<class DistT>
+void FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, MAXNODES>::NearestBatch(int a_count, const ELEMTYPE* a_points, int a_k, ELEMTYPE a_radius,
+  DistT const& a_dist,
+  std::vector<long>& a_offsets, std::vector<DATATYPE>& a_hits,
+  std::vector<ELEMTYPE>* a_dists, int a_nthreads) const
+{
+  a_offsets.assign(a_count+1, 0);
+  a_hits.clear();
+  if(a_dists)
+  {
+    a_dists->clear();
+  }
+  if(a_count == 0)
+  {
+    return;
+  }
+
+  // Each chunk of queries collects its hits separately, and reuses one queue
+  long const nchunks = std::max(1, std::min(a_nthreads, a_count));
+  std::vector<std::vector<std::pair<ELEMTYPE, DATATYPE>>> chunkHits(nchunks);
+  ibmisc::parallel_for(0, nchunks, nchunks, [&](long c0, long c1) {
+    std::vector<QueueEntry> queue;
+    for(long c = c0; c < c1; ++c)
+    {
+      for(long q = a_count*c/nchunks; q < a_count*(c+1)/nchunks; ++q)
+      {
+        std::array<ELEMTYPE, NUMDIMS> point;
+        for(int axis = 0; axis < NUMDIMS; ++axis)
+        {
+          point[axis] = a_points[q*NUMDIMS + axis];
+        }
+        a_offsets[q+1] = Nearest(point, a_k, a_radius, a_dist, queue, chunkHits[c]);
+      }
+    }
+  });
+
+  for(int q = 0; q < a_count; ++q)
+  {
+    a_offsets[q+1] += a_offsets[q];
+  }
+  a_hits.reserve(a_offsets[a_count]);
+  if(a_dists)
+  {
+    a_dists->reserve(a_offsets[a_count]);
+  }
+  for(auto& hits : chunkHits)
+  {
+    for(auto const& hit : hits)
+    {
+      a_hits.push_back(hit.second);
+      if(a_dists)
+      {
+        a_dists->push_back(hit.first);
+      }
+    }
+    std::vector<std::pair<ELEMTYPE, DATATYPE>>().swap(hits);
+  }
+}
+
+
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+bool FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, MAXNODES>::Save(const char* a_fileName) const
+{
+  static_assert(std::is_trivially_copyable<DATATYPE>::value, "FlatRTree::Save() needs a trivially copyable DATATYPE");
+
+  FileHeader header(MakeHeader(NodeCount(), Count()));
+  char const zeros[FILE_ALIGN] = {0};
+
+  FILE* file = fopen(a_fileName, "wb");
+  if(!file)
+  {
+    return false;
+  }
+  bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+  long offset = sizeof(header);
+  ok = ok && fwrite(zeros, 1, header.m_nodeOffset - offset, file) == (size_t)(header.m_nodeOffset - offset);
+  ok = ok && fwrite(Nodes(), sizeof(Node), NodeCount(), file) == (size_t)NodeCount();
+  offset = header.m_nodeOffset + NodeCount() * sizeof(Node);
+  ok = ok && fwrite(zeros, 1, header.m_dataOffset - offset, file) == (size_t)(header.m_dataOffset - offset);
+  ok = ok && fwrite(Data(), sizeof(DATATYPE), Count(), file) == (size_t)Count();
+  ok = (fclose(file) == 0) && ok;
+  return ok;
+}
+
+
+template<class DATATYPE, class ELEMTYPE, int NUMDIMS, int MAXNODES>
+bool FlatRTree<DATATYPE, ELEMTYPE, NUMDIMS, MAXNODES>::Map(const char* a_fileName)
+{
+  static_assert(std::is_trivially_copyable<DATATYPE>::value, "FlatRTree::Map() needs a trivially copyable DATATYPE");
+
+  int fd = open(a_fileName, O_RDONLY);
+  if(fd < 0)
+  {
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FileHeader))
+  {
+    close(fd);
+    return false;
+  }
+  size_t const size = st.st_size;
+  void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED)
+  {
+    return false;
+  }
+  std::shared_ptr<void> map(addr, [size](void* a_addr) { munmap(a_addr, size); });
+
+  // Check the file was written for this type, and is all there.
+  // Counts are bounded by the file size before any arithmetic on them,
+  // so nothing below can overflow.
+  FileHeader const& header = *(FileHeader const*)addr;
+  if(header.m_nodeCount < 0 || header.m_dataCount < 0
+    || header.m_nodeCount > std::numeric_limits<int>::max()
+    || header.m_dataCount > std::numeric_limits<int>::max()
+    || (size_t)header.m_nodeCount > size / sizeof(Node)
+    || (size_t)header.m_dataCount > size / sizeof(DATATYPE))
+  {
+    return false;
+  }
+  FileHeader const expected(MakeHeader(header.m_nodeCount, header.m_dataCount));
+  if(memcmp(&header, &expected, sizeof(FileHeader)) != 0
+    || (size_t)header.m_dataOffset > size
+    || (size_t)header.m_dataCount > (size - header.m_dataOffset) / sizeof(DATATYPE))
+  {
+    return false;
+  }
+
+  // Check the nodes, so queries can trust them: every child range lies
+  // inside the node (or data) array, children come after their parent
+  // (no cycles), and levels count down by one to the leaves.
+  Node const* nodes = (Node const*)((char const*)addr + header.m_nodeOffset);
+  long const nodeCount = header.m_nodeCount;
+  long const dataCount = header.m_dataCount;
+  if(nodeCount > 0 && (nodes[0].m_level < 0 || nodes[0].m_level >= MAX_DEPTH))
+  {
+    return false;
+  }
+  for(long i = 0; i < nodeCount; ++i)
+  {
+    Node const& node = nodes[i];
+    if(node.m_count < 0 || node.m_count > MAXNODES || node.m_first < 0)
+    {
+      return false;
+    }
+    long const end = (long)node.m_first + node.m_count;
+    if(node.m_level == 0)
+    {
+      if(end > dataCount)
+      {
+        return false;
+      }
+      continue;
+    }
+    if(node.m_level < 0 || node.m_first <= i || end > nodeCount)
+    {
+      return false;
+    }
+    for(long child = node.m_first; child < end; ++child)
+    {
+      if(nodes[child].m_level != node.m_level - 1)
+      {
+        return false;
+      }
+    }
+  }
+
+  m_nodes.clear();
+  m_data.clear();
+  m_map = map;
+  m_mapNodes = nodes;
+  m_mapData = (DATATYPE const*)((char const*)addr + header.m_dataOffset);
+  m_mapNodeCount = header.m_nodeCount;
+  m_mapDataCount = header.m_dataCount;
+  return true;
+}
+
+
 #undef RTREE_TEMPLATE
 #undef RTREE_QUAL
 }   // namespace ibmisc
@@ -17,7 +17,10 @@
  */
 
 #include <iostream>
+#include <algorithm>
 #include <ibmisc/VarTransformer.hpp>
+#include <ibmisc/error.hpp>
+#include <spsparse/eigen.hpp>
 
 namespace ibmisc {
 
@@ -41,6 +44,7 @@ void VarTransformer::set_dims(
 
         // Automatically addd the UNIT scalar to every dimension
         _dimensions[idim].insert(UNIT);
+        _dimensions[idim].freeze();    // set() looks names up here
     }
 
     // Allocate the tensor to our size now.
@@ -48,6 +52,7 @@ void VarTransformer::set_dims(
     for (int i=0; i<RANK; ++i) extent[i] = _dimensions[i].size();
     _tensor.reference(blitz::Array<double, RANK>(extent));
     _tensor = 0;
+    _compiled.transpose = 0;
 }
 
 
@@ -74,6 +79,7 @@ bool VarTransformer::set(std::string const &output, std::string const &input, st
         int iscalar = dim(SCALARS).at(scalar);
     
         _tensor(ioutput, iinput, iscalar) = val;
+        _compiled.transpose = 0;
     }
     return is_good;
 }
@@ -155,7 +161,8 @@ Mxb<double, Eigen::ColMajor, int> VarTransformer::apply_scalars(
             }
         }
     }
-    ret.M.setFromTriplets(triplets.begin(), triplets.end());
+    spsparse::build_compressed(ret.M, triplets.begin(), triplets.end(),
+        ret.M.rows(), ret.M.cols());
 
 //std::cout << "apply_scalars() returning M=" << ret.M << std::endl;
 //std::cout << "apply_scalars() returning b=" << ret.b << std::endl;
@@ -164,6 +171,171 @@ Mxb<double, Eigen::ColMajor, int> VarTransformer::apply_scalars(
     return ret;
 }
 
+void VarTransformer::compile(char transpose)
+{
+    int n_outputs_nu = dim(OUTPUTS).size()-1;       // # OUTPUTS no unit
+    int n_inputs_wu = dim(INPUTS).size();
+    int n_scalars_wu = dim(SCALARS).size(); // # SCALARS w/unit
+
+    int unit_inputs = dim(INPUTS).size()-1;
+
+    // Sparsity of M: every (i,j) with a nonzero somewhere along k
+    std::vector<Eigen::Triplet<double,int>> triplets;
+    for (int i=0; i < n_outputs_nu; ++i) {
+        for (int j=0; j < unit_inputs; ++j) {
+            for (int k=0; k < n_scalars_wu; ++k) {
+                if (_tensor(i,j,k) != 0) {
+                    if (transpose == 'T') {
+                        triplets.push_back(Eigen::Triplet<double,int>(j,i,1.0));
+                    } else {
+                        triplets.push_back(Eigen::Triplet<double,int>(i,j,1.0));
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    Compiled &cc(_compiled);
+    cc.proto = MxbT(n_outputs_nu, n_inputs_wu, transpose);
+    spsparse::build_compressed(cc.proto.M, triplets.begin(), triplets.end(),
+        cc.proto.M.rows(), cc.proto.M.cols());
+
+    // Terms for each value slot, in the order of M's value array
+    cc.term_begin.clear();
+    cc.term_k.clear();
+    cc.term_val.clear();
+    auto add_terms = [&](int i, int j) {
+        cc.term_begin.push_back(cc.term_k.size());
+        for (int k=0; k < n_scalars_wu; ++k) {
+            if (_tensor(i,j,k) != 0) {
+                cc.term_k.push_back(k);
+                cc.term_val.push_back(_tensor(i,j,k));
+            }
+        }
+    };
+    auto &M(cc.proto.M);
+    for (int outer=0; outer < M.outerSize(); ++outer) {
+        for (MxbT::SparseMatrixT::InnerIterator ii(M, outer); ii; ++ii) {
+            if (transpose == 'T') add_terms(ii.col(), ii.row());
+            else add_terms(ii.row(), ii.col());
+        }
+    }
+    for (int i=0; i < n_outputs_nu; ++i) add_terms(i, unit_inputs);
+    cc.term_begin.push_back(cc.term_k.size());
+
+    // The same terms as a (scalar x slot) matrix, for batches
+    long const nslot = cc.term_begin.size() - 1;
+    std::vector<Eigen::Triplet<double,int>> term_triplets;
+    term_triplets.reserve(cc.term_k.size());
+    for (long s=0; s < nslot; ++s) {
+        for (int t=cc.term_begin[s]; t < cc.term_begin[s+1]; ++t)
+            term_triplets.push_back(Eigen::Triplet<double,int>(cc.term_k[t], s, cc.term_val[t]));
+    }
+    cc.terms.resize(n_scalars_wu, nslot);
+    cc.terms.setFromTriplets(term_triplets.begin(), term_triplets.end());
+
+    cc.scalars.assign(n_scalars_wu, 0.);
+    cc.transpose = (transpose == 'T' ? 'T' : '.');
+}
+
+/** @return True if ret already has the sparsity of proto */
+static bool same_pattern(VarTransformer::MxbT const &ret, VarTransformer::MxbT const &proto)
+{
+    auto const &M0(proto.M);
+    return ret.M.rows() == M0.rows() && ret.M.cols() == M0.cols()
+        && ret.M.nonZeros() == M0.nonZeros() && ret.M.isCompressed()
+        && ret.b.size() == proto.b.size()
+        && std::equal(M0.outerIndexPtr(), M0.outerIndexPtr() + M0.outerSize() + 1,
+            ret.M.outerIndexPtr())
+        && std::equal(M0.innerIndexPtr(), M0.innerIndexPtr() + M0.nonZeros(),
+            ret.M.innerIndexPtr());
+}
+
+void VarTransformer::apply_scalars(MxbT &ret,
+    std::vector<std::pair<std::string, double>> const &nvpairs)
+{
+    Compiled &cc(_compiled);
+    if (!cc.transpose) (*ibmisc_error)(-1,
+        "VarTransformer::apply_scalars(): must call compile() first");
+
+    // Give ret our sparsity, unless it already has it
+    auto const &M0(cc.proto.M);
+    if (!same_pattern(ret, cc.proto)) ret = cc.proto;
+
+    // Convert name/value pairs to a regular vector
+    std::fill(cc.scalars.begin(), cc.scalars.end(), 0.);
+    for (auto ii = nvpairs.begin(); ii != nvpairs.end(); ++ii) {
+        if (dim(SCALARS).contains(ii->first))
+            cc.scalars[dim(SCALARS).at(ii->first)] = ii->second;
+    }
+    cc.scalars[dim(SCALARS).at(UNIT)] = 1.0;
+
+    // Refill values: nonzeros of M, then b
+    long const nnz = M0.nonZeros();
+    double *Mvals = ret.M.valuePtr();
+    double *bvals = ret.b.data();
+    long const nslot = cc.term_begin.size() - 1;
+    for (long s=0; s < nslot; ++s) {
+        double coeff = 0;
+        for (int t=cc.term_begin[s]; t < cc.term_begin[s+1]; ++t)
+            coeff += cc.term_val[t] * cc.scalars[cc.term_k[t]];
+        if (s < nnz) Mvals[s] = coeff;
+        else bvals[s - nnz] = coeff;
+    }
+}
+
+/** values = scalars * terms.  Only nonzeros of the tensor are
+multiplied, so (as above) unused scalars may be inf or nan. */
+Eigen::MatrixXd VarTransformer::apply_scalars(
+    Eigen::MatrixXd const &scalars,
+    std::vector<std::string> const &names) const
+{
+    Compiled const &cc(_compiled);
+    if (!cc.transpose) (*ibmisc_error)(-1,
+        "VarTransformer::apply_scalars(): must call compile() first");
+
+    int const n_scalars_wu = dim(SCALARS).size();
+    int const unit_scalars = dim(SCALARS).at(UNIT);
+    int const ncol = scalars.cols();
+    if (names.size() != 0 && names.size() != ncol) (*ibmisc_error)(-1,
+        "VarTransformer::apply_scalars(): %d columns of scalars but %ld names",
+        ncol, (long)names.size());
+    if (names.size() == 0 && ncol != n_scalars_wu && ncol != n_scalars_wu-1) (*ibmisc_error)(-1,
+        "VarTransformer::apply_scalars(): %d columns of scalars, expected %d",
+        ncol, n_scalars_wu-1);
+
+    // Scalars in dim(SCALARS) order, one row per scenario
+    Eigen::MatrixXd S(Eigen::MatrixXd::Zero(scalars.rows(), n_scalars_wu));
+    for (int c=0; c < ncol; ++c) {
+        int k = c;
+        if (names.size() != 0) {
+            if (!dim(SCALARS).contains(names[c])) continue;
+            k = dim(SCALARS).at(names[c]);
+        }
+        if (k != unit_scalars) S.col(k) = scalars.col(c);
+    }
+    S.col(unit_scalars).setOnes();
+
+    return S * cc.terms;
+}
+
+void VarTransformer::get_scenario(MxbT &ret, Eigen::MatrixXd const &values, int m) const
+{
+    Compiled const &cc(_compiled);
+    auto const &M0(cc.proto.M);
+    long const nnz = M0.nonZeros();
+    if (values.cols() != nnz + cc.proto.b.size()) (*ibmisc_error)(-1,
+        "VarTransformer::get_scenario(): values has %ld columns, expected %ld",
+        (long)values.cols(), (long)(nnz + cc.proto.b.size()));
+
+    if (!same_pattern(ret, cc.proto)) ret = cc.proto;
+
+    double *Mvals = ret.M.valuePtr();
+    double *bvals = ret.b.data();
+    for (long s=0; s < nnz; ++s) Mvals[s] = values(m, s);
+    for (long s=0; s < ret.b.size(); ++s) bvals[s] = values(m, nnz + s);
+}
 
 std::ostream &operator<<(std::ostream &out, VarTransformer const &vt)
 {
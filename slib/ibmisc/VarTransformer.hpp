@@ -20,8 +20,10 @@
 
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <blitz/array.h>
 #include <ibmisc/IndexSet.hpp>
+#include <ibmisc/bundle.hpp>
 #include <Eigen/SparseCore>
 #include <Eigen/Dense>
 
@@ -36,13 +38,16 @@ By convention, the unit element is the last one in a dimension.
 This class stores the (smaller) vector x, along with the unit vector b. */
 template<class _Scalar, int _Options, class _StorageIndex>
 struct Mxb {
-    Eigen::SparseMatrix<_Scalar, _Options, _StorageIndex> M;
+    typedef Eigen::SparseMatrix<_Scalar, _Options, _StorageIndex> SparseMatrixT;
+    SparseMatrixT M;
     // b is either a row-vector or column-vector
     Eigen::Matrix<_Scalar, Eigen::Dynamic, Eigen::Dynamic, _Options> b;
+    char transpose;    // '.' or 'T', as passed to the constructor
 
-    Mxb(int nrow, int ncol, char transpose) :
-        M(transpose ? ncol : nrow, transpose ? nrow : ncol),
-        b(decltype(b)::Zero(transpose ? 1 : ncol, transpose ? nrow : 1))
+    Mxb(int nrow, int ncol, char _transpose) :
+        M(_transpose ? ncol : nrow, _transpose ? nrow : ncol),
+        b(decltype(b)::Zero(_transpose ? 1 : ncol, _transpose ? nrow : 1)),
+        transpose(_transpose)
         {}
 };
 
@@ -131,9 +136,175 @@ public:
         std::vector<std::pair<std::string, double>> const &nvpairs = {},
         char transpose = '.');
 
+    /** Extracts the nonzero structure of the tensor once, so that
+    later calls to apply_scalars(ret, ...) only refill values.
+    Must be called again after set() or set_dims().
+    @param transpose Use '.' for regular, 'T' for transpose. */
+    void compile(char transpose = '.');
+
+    /** Same as apply_scalars() above, using the structure from
+    compile().  The first time, ret gets the compiled sparsity;
+    after that, only its values are overwritten (no allocation).
+    NOTE: Entries whose coefficient comes out 0 for these scalars
+          are kept as explicit zeros. */
+    void apply_scalars(MxbT &ret,
+        std::vector<std::pair<std::string, double>> const &nvpairs = {});
+
+    /** Evaluates the compiled tensor for many sets of scalars (eg
+    ensemble members, or sub-steps with different dt) in one sparse
+    tensor contraction.  All results share the sparsity of pattern().
+    @param scalars One row per scenario.  Column c is the value of
+        scalar names[c]; or if names is empty, of dim(SCALARS)[c].
+        Names not in dim(SCALARS) are ignored; UNIT is always 1.
+    @return One row per scenario: values of the nonzeros of
+        pattern().M (in the order of its valuePtr()), then of b. */
+    Eigen::MatrixXd apply_scalars(
+        Eigen::MatrixXd const &scalars,
+        std::vector<std::string> const &names = {}) const;
+
+    /** Sparsity and shape of the results of compile()d apply_scalars(). */
+    MxbT const &pattern() const
+        { return _compiled.proto; }
+
+    /** Sets ret to scenario m of a batch apply_scalars(), reusing its
+    memory if it already has pattern(). */
+    void get_scenario(MxbT &ret, Eigen::MatrixXd const &values, int m) const;
+
+    /** Computes outputs = M inputs + b at every grid point, in one
+    streaming pass over the grid.  Variables are matched by name with
+    dim(OUTPUTS) and dim(INPUTS); outputs missing from the bundle are
+    skipped.  All variables must be allocated, with the same shape and
+    storage order, and contiguous in memory.  Outputs must not share
+    memory with inputs.  Inputs and outputs may be views (eg of some
+    of a coupler's variables), or whole bundles.
+    @param mxb Result of apply_scalars() on this VarTransformer. */
+    template<int BRANK>
+    void apply(MxbT const &mxb,
+        BundleView<double,BRANK> const &inputs,
+        BundleView<double,BRANK> &outputs) const;
+
+    template<int BRANK>
+    void apply(MxbT const &mxb,
+        ArrayBundle<double,BRANK> const &inputs,
+        ArrayBundle<double,BRANK> &outputs) const
+    {
+        BundleView<double,BRANK> const vinputs(inputs);
+        BundleView<double,BRANK> voutputs(outputs);
+        apply(mxb, vinputs, voutputs);
+    }
+
+protected:
+    /** Output of compile() */
+    struct Compiled {
+        char transpose = 0;    // 0 if not compiled
+        MxbT proto {0, 0, '.'};    // Sparsity (and shape) of the result
+
+        // Each value slot (nonzeros of M, then elements of b) is a sum
+        // of terms, tensor value * scalar:
+        //     term_begin[slot] <= term < term_begin[slot+1]
+        std::vector<int> term_begin;
+        std::vector<int> term_k;          // Scalar index of each term
+        std::vector<double> term_val;     // Tensor value of each term
+        std::vector<double> scalars;      // Scratch space
+        Eigen::SparseMatrix<double> terms;    // terms(k, slot) = term_val
+    } _compiled;
+
+public:
+
     friend std::ostream &operator<<(std::ostream &out, VarTransformer const &vt);
 };
 
+
+template<int BRANK>
+void VarTransformer::
+    apply(MxbT const &mxb,
+        BundleView<double,BRANK> const &inputs,
+        BundleView<double,BRANK> &outputs) const
+{
+    int const n_outputs_nu = dim(OUTPUTS).size()-1;
+    int const n_inputs_nu = dim(INPUTS).size()-1;
+
+    // Terms of M, sorted by output: M(i,j) * x_j
+    std::vector<int> row_begin(n_outputs_nu+1, 0);
+    std::vector<std::pair<int,double>> terms(mxb.M.nonZeros());
+    for (int k=0; k<mxb.M.outerSize(); ++k) {
+        for (MxbT::SparseMatrixT::InnerIterator ii(mxb.M, k); ii; ++ii) {
+            ++row_begin[(mxb.transpose == 'T' ? ii.col() : ii.row()) + 1];
+        }
+    }
+    for (int i=0; i<n_outputs_nu; ++i) row_begin[i+1] += row_begin[i];
+    {std::vector<int> pos(row_begin.begin(), row_begin.end()-1);
+        for (int k=0; k<mxb.M.outerSize(); ++k) {
+            for (MxbT::SparseMatrixT::InnerIterator ii(mxb.M, k); ii; ++ii) {
+                int const i = (mxb.transpose == 'T' ? ii.col() : ii.row());
+                int const j = (mxb.transpose == 'T' ? ii.row() : ii.col());
+                terms[pos[i]++] = std::make_pair(j, ii.value());
+            }
+        }
+    }
+
+    // Look up the arrays, and check they are compatible
+    blitz::Array<double,BRANK> const *arr0 = nullptr;
+    auto check_arr = [&arr0](blitz::Array<double,BRANK> const &arr, std::string const &name) {
+        if (!arr.data() || !arr.isStorageContiguous()) (*ibmisc_error)(-1,
+            "VarTransformer::apply(): variable %s must be allocated and contiguous", name.c_str());
+        if (!arr0) {
+            arr0 = &arr;
+            return;
+        }
+        for (int k=0; k<BRANK; ++k) {
+            if (arr.extent(k) != arr0->extent(k) || arr.ordering(k) != arr0->ordering(k))
+                (*ibmisc_error)(-1,
+                "VarTransformer::apply(): variable %s has a different shape", name.c_str());
+        }
+    };
+
+    std::vector<double const *> x(n_inputs_nu, nullptr);
+    for (int i=0; i<n_outputs_nu; ++i) {
+        std::string const &oname(dim(OUTPUTS)[i]);
+        if (!outputs.contains(oname)) continue;
+        for (int t=row_begin[i]; t<row_begin[i+1]; ++t) {
+            int const j = terms[t].first;
+            if (x[j]) continue;
+            std::string const &iname(dim(INPUTS)[j]);
+            if (!inputs.contains(iname)) (*ibmisc_error)(-1,
+                "VarTransformer::apply(): input %s is missing, needed for %s",
+                iname.c_str(), oname.c_str());
+            auto const &arr(inputs.array(iname));
+            check_arr(arr, iname);
+            x[j] = arr.data();
+        }
+    }
+    std::vector<double *> y(n_outputs_nu, nullptr);
+    for (int i=0; i<n_outputs_nu; ++i) {
+        std::string const &oname(dim(OUTPUTS)[i]);
+        if (!outputs.contains(oname)) continue;
+        auto &arr(outputs.array(oname));
+        check_arr(arr, oname);
+        y[i] = arr.data();
+    }
+    if (!arr0) return;
+
+    // Stream over the grid in L1-sized blocks: each block of each
+    // output is initialized with b, then gets one axpy per term.
+    long const n = arr0->size();
+    long const block = 512;
+    for (long c0=0; c0<n; c0 += block) {
+        long const nc = std::min(block, n-c0);
+        for (int i=0; i<n_outputs_nu; ++i) {
+            if (!y[i]) continue;
+            double * const yy = y[i] + c0;
+            double const bi = mxb.b(i);
+            for (long c=0; c<nc; ++c) yy[c] = bi;
+            for (int t=row_begin[i]; t<row_begin[i+1]; ++t) {
+                double const * const xx = x[terms[t].first] + c0;
+                double const v = terms[t].second;
+                for (long c=0; c<nc; ++c) yy[c] += v * xx[c];
+            }
+        }
+    }
+}
+
 /** Print out the tensor as readable symbolic equations.
 Used to check and debug. */
 std::ostream &operator<<(std::ostream &out, VarTransformer const &vt);
@@ -0,0 +1,40 @@
+#include <cstring>
+#include <sys/mman.h>
+#include <ibmisc/blitz_alloc.hpp>
+#include <ibmisc/parallel.hpp>
+
+namespace ibmisc {
+
+ArrayAllocPolicy &array_alloc_policy()
+{
+    static ArrayAllocPolicy policy;
+    return policy;
+}
+
+namespace _blitz_alloc {
+
+/** Smallest array worth giving huge pages */
+static size_t const huge_page_size = 2*1024*1024;
+
+void prepare(void *data, size_t nbytes, long nslow, ArrayAllocPolicy const &policy)
+{
+#ifdef MADV_HUGEPAGE
+    if (policy.huge_pages && nbytes >= huge_page_size) {
+        // madvise() wants whole pages: advise the ones entirely inside
+        uintptr_t const page = 4096;
+        uintptr_t const begin = ((uintptr_t)data + page - 1) & ~(page - 1);
+        uintptr_t const end = ((uintptr_t)data + nbytes) & ~(page - 1);
+        if (end > begin) madvise((void *)begin, end - begin, MADV_HUGEPAGE);
+    }
+#endif
+
+    if (policy.first_touch_threads > 1 && nslow > 1) {
+        size_t const slice = nbytes / nslow;
+        ibmisc::parallel_for(0, nslow, policy.first_touch_threads, [&](long i0, long i1) {
+            memset((char *)data + i0*slice, 0, (i1-i0)*slice);
+        });
+    }
+}
+
+}    // namespace ibmisc::_blitz_alloc
+}    // namespace ibmisc
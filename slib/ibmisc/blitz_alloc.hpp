@@ -0,0 +1,168 @@
+#ifndef IBMISC_BLITZ_ALLOC_HPP
+#define IBMISC_BLITZ_ALLOC_HPP
+
+#include <cstdint>
+#include <blitz/array.h>
+
+namespace ibmisc {
+
+/** How ibmisc allocates the blitz::Arrays it creates itself
+(Indexing::make_blitz(), ArrayBundle::allocate(), spsparse::to_blitz(),
+ncio_blitz_alloc()...). */
+struct ArrayAllocPolicy {
+    /** Align the first element on this many bytes (0 = whatever
+    blitz's new[] gives) */
+    size_t alignment;
+
+    /** Ask the kernel for transparent huge pages on big arrays
+    (madvise(MADV_HUGEPAGE); no-op where unsupported) */
+    bool huge_pages;
+
+    /** If >1, first-touch (zero) the array on this many threads, in
+    the chunks parallel_for() would give them along the slowest-varying
+    dimension.  When a parallel apply_M() later runs with the same
+    nthreads over the same dimension, each thread's pages are then
+    local to its socket, as long as threads stay where they started. */
+    int first_touch_threads;
+
+    ArrayAllocPolicy(size_t _alignment = 64, bool _huge_pages = false, int _first_touch_threads = 1)
+        : alignment(_alignment), huge_pages(_huge_pages), first_touch_threads(_first_touch_threads) {}
+};
+
+/** Process-wide policy used by default; set it once at startup. */
+extern ArrayAllocPolicy &array_alloc_policy();
+
+namespace _blitz_alloc {
+
+/** Applies huge_pages and first_touch_threads to a freshly allocated
+contiguous block of nslow equal-sized slices */
+extern void prepare(void *data, size_t nbytes, long nslow, ArrayAllocPolicy const &policy);
+
+}    // namespace ibmisc::_blitz_alloc
+
+/** Allocates a contiguous blitz::Array according to policy; like
+blitz::Array<T,RANK>(extent, storage).  The array owns its memory, as
+usual, and may be freely referenced and copied.
+
+(Blitz has no custom allocators.  For alignment, the memory comes from
+new[] with some slack, and is owned by a blitz::Array over the whole
+block; the result is a view of the aligned part of that.) */
+template<class T, int RANK>
+blitz::Array<T,RANK> alloc_blitz(
+    blitz::TinyVector<int,RANK> const &extent,
+    blitz::GeneralArrayStorage<RANK> const &storage = blitz::GeneralArrayStorage<RANK>(),
+    ArrayAllocPolicy const &policy = array_alloc_policy())
+{
+    long n = 1;
+    bool ascending = true;
+    for (int i=0; i<RANK; ++i) {
+        n *= extent[i];
+        ascending = ascending && storage.isRankStoredAscending(i);
+    }
+    int const slowest = storage.ordering(RANK-1);
+
+    if (n == 0 || !ascending || policy.alignment <= sizeof(T)
+        || policy.alignment % sizeof(T) != 0)
+    {
+        blitz::Array<T,RANK> ret(extent, storage);
+        if (n > 0 && ascending) _blitz_alloc::prepare(
+            ret.dataFirst(), n * sizeof(T), extent[slowest], policy);
+        return ret;
+    }
+
+    // Strides of the contiguous result
+    blitz::TinyVector<int,RANK> stride;
+    long s = 1;
+    for (int r=0; r<RANK; ++r) {
+        int const k = storage.ordering(r);    // Fastest-varying first
+        stride[k] = s;
+        s *= extent[k];
+    }
+
+    // Owner array covers the slack too.  Its rows overlap, but it is
+    // never accessed; it only carries the memory block.
+    long const slack = policy.alignment / sizeof(T);
+    T *block = new T[n + slack];
+    long const skip = ((policy.alignment - (uintptr_t)block % policy.alignment)
+        % policy.alignment) / sizeof(T);
+    int const fastest = storage.ordering(0);
+    blitz::TinyVector<int,RANK> owner_extent(extent);
+    owner_extent[fastest] += slack;
+    blitz::Array<T,RANK> owner(block, owner_extent, stride,
+        blitz::deleteDataWhenDone, storage);
+
+    blitz::TinyVector<int,RANK> lb(storage.base()), ub;
+    for (int i=0; i<RANK; ++i) ub[i] = lb[i] + extent[i] - 1;
+    lb[fastest] += skip;
+    ub[fastest] += skip;
+    blitz::Array<T,RANK> ret(owner(blitz::RectDomain<RANK>(lb, ub)));
+    ret.reindexSelf(storage.base());
+
+    _blitz_alloc::prepare(ret.dataFirst(), n * sizeof(T), extent[slowest], policy);
+    return ret;
+}
+
+/** Like alloc_blitz(), but with explicit strides (in elements), which
+need not be contiguous: dimensions may even overlap, making one block
+addressable in several ways (see ArrayBundle::allocate_slab()).  The
+array owns its memory, as usual; arrays sliced from it share it.
+@param nelem Number of elements to allocate; must cover every element
+    reachable through stride.
+@param nslow policy.first_touch_threads splits the block into this
+    many equal slices.
+Memory is aligned only if some dimension has stride 1. */
+template<class T, int RANK>
+blitz::Array<T,RANK> alloc_blitz_strided(
+    long nelem, long nslow,
+    blitz::TinyVector<int,RANK> const &extent,
+    blitz::TinyVector<int,RANK> const &stride,
+    blitz::GeneralArrayStorage<RANK> const &storage = blitz::GeneralArrayStorage<RANK>(),
+    ArrayAllocPolicy const &policy = array_alloc_policy())
+{
+    int unit = -1;    // Dimension to shift for alignment
+    bool ascending = true;
+    for (int i=0; i<RANK; ++i) {
+        if (unit < 0 && stride[i] == 1 && extent[i] > 0) unit = i;
+        ascending = ascending && storage.isRankStoredAscending(i);
+    }
+    bool const align = (nelem > 0 && ascending && unit >= 0
+        && policy.alignment > sizeof(T) && policy.alignment % sizeof(T) == 0);
+
+    // As in alloc_blitz(), the owner covers the slack too
+    long const slack = (align ? policy.alignment / sizeof(T) : 0);
+    T *block = new T[nelem + slack];
+    long const skip = (!align ? 0 :
+        ((policy.alignment - (uintptr_t)block % policy.alignment)
+        % policy.alignment) / sizeof(T));
+    blitz::TinyVector<int,RANK> owner_extent(extent);
+    if (align) owner_extent[unit] += slack;
+    blitz::Array<T,RANK> owner(block, owner_extent, stride,
+        blitz::deleteDataWhenDone, storage);
+
+    if (nelem > 0 && ascending) _blitz_alloc::prepare(
+        block + skip, nelem * sizeof(T), nslow, policy);
+    if (!align) return owner;
+
+    blitz::TinyVector<int,RANK> lb(storage.base()), ub;
+    for (int i=0; i<RANK; ++i) ub[i] = lb[i] + extent[i] - 1;
+    lb[unit] += skip;
+    ub[unit] += skip;
+    blitz::Array<T,RANK> ret(owner(blitz::RectDomain<RANK>(lb, ub)));
+    ret.reindexSelf(storage.base());
+    return ret;
+}
+
+/** Like blitz::Array<T,RANK>(lbounds, extent, storage) */
+template<class T, int RANK>
+blitz::Array<T,RANK> alloc_blitz(
+    blitz::TinyVector<int,RANK> const &lbounds,
+    blitz::TinyVector<int,RANK> const &extent,
+    blitz::GeneralArrayStorage<RANK> storage,
+    ArrayAllocPolicy const &policy = array_alloc_policy())
+{
+    storage.base() = lbounds;
+    return alloc_blitz<T,RANK>(extent, storage, policy);
+}
+
+}    // namespace ibmisc
+#endif    // IBMISC_BLITZ_ALLOC_HPP
@@ -2,11 +2,76 @@
 #define IBMISC_BUNDLE_HPP
 
 #include <ibmisc/blitz.hpp>
+#include <ibmisc/blitz_alloc.hpp>
+#include <ibmisc/footprint.hpp>
 #include <ibmisc/netcdf.hpp>
 #include <ibmisc/IndexSet.hpp>
+#include <ibmisc/indexing.hpp>
 
 namespace ibmisc {
 
+/** Memory layout for ArrayBundle::allocate_slab() */
+enum class SlabLayout {
+    VAR_MAJOR,      // [nvar][shape...]: each variable is contiguous
+    INTERLEAVED     // [shape...][nvar]: variable index varies fastest
+};
+
+namespace _bundle {
+
+/** Reads/writes the attributes of a bundle variable (after its array).
+Reading replaces meta.attr with the attributes on disk. */
+template<int RANK>
+void ncio_attrs(NcIO &ncio, ArrayMeta<RANK> &meta, std::string const &vname)
+{
+    netCDF::NcVar ncvar = ncio.getVar(vname);
+    if (ncio.rw == 'w') {
+        for (auto &kv : meta.attr) {
+            std::string const &name(std::get<0>(kv));
+            std::string &value(std::get<1>(kv));    // Read back into Data
+
+            get_or_put_att(ncvar, ncio.rw, name, value);
+        }
+    } else {
+        meta.attr.clear();
+        auto atts(ncvar.getAtts());
+        for (auto ii(atts.begin()); ii != atts.end(); ++ii) {
+            std::string const &aname(ii->first);
+            std::string aval;
+            ii->second.getValues(aval);
+
+            meta.attr.push_back(std::make_pair(aname, aval));
+        }
+    }
+}
+
+/** Slices of an ArrayBundle slab, indexed (var, dims..., i) (see
+ArrayBundle::_slab); they share its memory.  Recurses over the NMID
+middle (variable) dimensions to build the blitz slicing arguments. */
+template<class TypeT, int NMID>
+struct SlabSlice {
+    /** Variable ivar: (ivar, Range::all()..., 0) */
+    template<int N, class... ArgsT>
+    static blitz::Array<TypeT,N-2> var(blitz::Array<TypeT,N> const &slab, int ivar, ArgsT... args)
+        { return SlabSlice<TypeT,NMID-1>::var(slab, ivar, args..., blitz::Range::all()); }
+
+    /** All variables, as 2-D (var, i): (Range::all(), lbound..., Range::all()) */
+    template<int N, class... ArgsT>
+    static blitz::Array<TypeT,2> all(blitz::Array<TypeT,N> const &slab, ArgsT... args)
+        { return SlabSlice<TypeT,NMID-1>::all(slab, args..., slab.lbound(N-1-NMID)); }
+};
+
+template<class TypeT>
+struct SlabSlice<TypeT,0> {
+    template<int N, class... ArgsT>
+    static blitz::Array<TypeT,N-2> var(blitz::Array<TypeT,N> const &slab, int ivar, ArgsT... args)
+        { return slab(ivar, args..., 0); }
+
+    template<int N, class... ArgsT>
+    static blitz::Array<TypeT,2> all(blitz::Array<TypeT,N> const &slab, ArgsT... args)
+        { return slab(blitz::Range::all(), args..., blitz::Range::all()); }
+};
+
+}    // namespace _bundle
 
 // ===============================================================
 /** Area of memory where a TOPO-generating procedure can place its outputs.
@@ -44,7 +109,7 @@ public:
         {
             if (check && arr->data()) (*ibmisc_error)(-1,
                 "ArrayBundle variable %s already allocated", meta.name.c_str());
-            arr->reference(blitz::Array<TypeT,RANK>(ibmisc::to_tiny<int,int,RANK>(meta.shape), storage));
+            arr->reference(alloc_blitz<TypeT,RANK>(ibmisc::to_tiny<int,int,RANK>(meta.shape), storage));
         }
 
         void allocate(bool check, std::array<int,RANK> const &shape,
@@ -52,7 +117,7 @@ public:
         {
             if (check && arr->data()) (*ibmisc_error)(-1,
                 "ArrayBundle variable %s already allocated", meta.name.c_str());
-            arr->reference(blitz::Array<TypeT,RANK>(ibmisc::to_tiny<int,int,RANK>(shape), storage));
+            arr->reference(alloc_blitz<TypeT,RANK>(ibmisc::to_tiny<int,int,RANK>(shape), storage));
         }
 
         std::vector<NamedDim> named_dims()
@@ -90,6 +155,18 @@ public:
     Data &at(std::string const &name)
         { return data[index.at(name)]; }
 
+    /** Memory of each allocated array.  Arrays in a slab (see
+    allocate_slab()) each count their part of it. */
+    MemoryFootprint memory_footprint(std::string const &name = "ArrayBundle") const
+    {
+        MemoryFootprint ret(name);
+        for (auto const &d : data) {
+            size_t const nbytes = (d.arr->data() ? d.arr->size() * sizeof(TypeT) : 0);
+            ret.add(MemoryFootprint(d.meta.name, nbytes));
+        }
+        return ret;
+    }
+
 private:
 
     static std::vector<std::pair<std::string, std::string>> make_attrs(
@@ -152,6 +229,31 @@ public:
 
     void free();    // Reverse of allocate()
 
+    // ------------------------------------------------------------------
+    // Allocate All Variables in One Slab
+
+    /** Allocates all variables, which must have the same shape, in one
+    contiguous block of memory.  slab() then views them all as one
+    2-D array, eg for ncio or Weighted::apply_M() without copying.
+    The variables' arrays (and slab()) share that memory, reference
+    counted as usual for blitz::Arrays: it is freed with the last of
+    them, so they stay valid after free() or the bundle is gone.
+    @param layout Order of the variables in the slab */
+    void allocate_slab(bool check = true,
+        SlabLayout layout = SlabLayout::VAR_MAJOR,
+        blitz::GeneralArrayStorage<RANK> const &storage = blitz::GeneralArrayStorage<RANK>());
+
+    void allocate_slab(
+        std::array<int, RANK> const &_shape,
+        std::array<std::string,RANK> const &sdims,
+        bool check = true,
+        SlabLayout layout = SlabLayout::VAR_MAJOR,
+        blitz::GeneralArrayStorage<RANK> const &storage = blitz::GeneralArrayStorage<RANK>());
+
+    /** The slab from allocate_slab(), as a (nvar, n) array for
+    VAR_MAJOR, or (n, nvar) for INTERLEAVED.  Variable i is data[i]. */
+    blitz::Array<TypeT,2> slab();
+
     // ------------------------------------------------------------------
     // Allocate Some Variables in a Bundle
 
@@ -175,6 +277,14 @@ public:
 
     // -------------------------------------------------------------------
 private:
+    /** Memory from allocate_slab(), indexed (var, dims..., i), where
+    i is the flat index within a variable.  Its dimensions overlap: it
+    is never used directly, only sliced into the variables and slab()
+    (see _bundle::SlabSlice), which then share its memory block. */
+    blitz::Array<TypeT,RANK+2> _slab;
+    SlabLayout _slab_layout = SlabLayout::VAR_MAJOR;
+    long _slab_nvar = 0;
+
 #   define NCIO_BUNDLE_PARAMS \
         NcIO &ncio, \
         std::vector<std::string> const &vars, \
@@ -193,6 +303,10 @@ private:
         NCIO_BUNDLE_PARAMS,
         ncio_blitz_fn const &_ncio_blitz_fn);
 
+    /** Indices (into data) of the variables named in vars; or of all
+    variables, if vars is empty. */
+    std::vector<int> var_indices(std::vector<std::string> const &vars) const;
+
 public:
     void ncio(
         NCIO_BUNDLE_PARAMS,
@@ -213,7 +327,37 @@ public:
         std::vector<size_t> const &nc_start,    // Where to start each dimension in NetCDF
         std::vector<int> const &b2n);    // Where to slot each Blitz++ dimension
 
+    /** Reads/writes this rank's part of each variable (eg in a
+    parallel NcIO): the hyperslab of ncdims covered by domain. */
+    void ncio_partial(
+        NCIO_BUNDLE_PARAMS,
+        std::vector<netCDF::NcDim> const &ncdims,
+        Domain const &domain,
+        std::vector<int> const &b2n)
+    {
+        ncio_partial(NCIO_BUNDLE_ARGS, ncdims,
+            domain.nc_start(b2n, ncdims.size()), b2n);
+    }
 
+    /** Reads/writes the bundle's variables, which must all be allocated
+    with the same shape, as ONE NetCDF variable with an extra leading
+    dimension over the variables: one getVar/putVar in place of one
+    per variable.  If the variables lie evenly spaced in memory (eg
+    after allocate_slab()), they are read/written in place; otherwise
+    they are staged through a buffer in ncio.tmp.
+    Variable names are stored in the attribute "var_names"; and each
+    variable's attributes as "<name>.<attr>".
+    @param vname Name of the stacked NetCDF variable.
+    @param ncdims Dimensions for each variable, as in ncio(); the
+        variable dimension is added ahead of them.
+    @param var_dim Name of the dimension over variables. */
+    void ncio_stacked(
+        NcIO &ncio,
+        std::vector<std::string> const &vars,
+        std::string const &vname,
+        std::string const &snc_type = "",
+        std::vector<netCDF::NcDim> const &ncdims = {},
+        std::string const &var_dim = "var");
 
 };
 // --------------------------------------------------------------------
@@ -305,6 +449,7 @@ blitz::Array<TypeT,RANK> &ArrayBundle<TypeT,RANK>::add(
 {
     data.push_back(Data(name, arr, to_array<int,int,RANK>(arr.shape()),
         std::move(sdims), make_attrs(vattr)));
+    index.insert(data.back().meta.name);
     return *data.back().arr;
 }
 
@@ -355,6 +500,110 @@ void ArrayBundle<TypeT,RANK>::free()
     for (auto &meta : data) {
         meta.arr->free();
     }
+    _slab.free();
+    _slab_nvar = 0;
+}
+
+// ------------------------------------------------------------------
+// Allocate All Variables in One Slab
+
+template<class TypeT, int RANK>
+void ArrayBundle<TypeT,RANK>::allocate_slab(bool check,
+    SlabLayout layout,
+    blitz::GeneralArrayStorage<RANK> const &storage)
+{
+    if (data.size() == 0) return;
+
+    std::array<int,RANK> const shape(data[0].meta.shape);
+    for (auto &meta : data) {
+        if (meta.meta.shape != shape) (*ibmisc_error)(-1,
+            "ArrayBundle::allocate_slab(): variables %s and %s have different shapes",
+            data[0].meta.name.c_str(), meta.meta.name.c_str());
+        if (check && meta.arr->data()) (*ibmisc_error)(-1,
+            "ArrayBundle variable %s already allocated", meta.meta.name.c_str());
+    }
+    long n = 1;
+    for (int k=0; k<RANK; ++k) {
+        if (shape[k] < 0) (*ibmisc_error)(-1,
+            "ArrayBundle::allocate_slab(): shape of %s is not set", data[0].meta.name.c_str());
+        n *= shape[k];
+    }
+
+    long const nvar = data.size();
+    bool const interleaved = (layout == SlabLayout::INTERLEAVED);
+    _slab_layout = layout;
+    _slab_nvar = nvar;
+
+    if (n == 0) {
+        _slab.free();
+        blitz::TinyVector<int,RANK> extent;
+        for (int k=0; k<RANK; ++k) extent[k] = shape[k];
+        for (long i=0; i<nvar; ++i) {
+            data[i].arr->reference(blitz::Array<TypeT,RANK>(extent, storage));
+        }
+        return;
+    }
+
+    // (var, dims..., i) view of the slab; see _slab
+    blitz::TinyVector<int,RANK+2> extent, stride;
+    blitz::GeneralArrayStorage<RANK+2> sstorage;
+    extent[0] = nvar;
+    stride[0] = (interleaved ? 1 : n);
+    sstorage.base()[0] = 0;
+    extent[RANK+1] = n;
+    stride[RANK+1] = (interleaved ? nvar : 1);
+    sstorage.base()[RANK+1] = 0;
+
+    // Strides of each variable, following the storage order
+    long s = (interleaved ? nvar : 1);
+    int ir = 0;
+    if (interleaved) sstorage.ordering()[ir++] = 0;
+    for (int r=0; r<RANK; ++r) {
+        int const k = storage.ordering()[r];    // Fastest-varying first
+        extent[k+1] = shape[k];
+        stride[k+1] = s;
+        sstorage.base()[k+1] = storage.base()[k];
+        sstorage.ascendingFlag()[k+1] = storage.isRankStoredAscending(k);
+        sstorage.ordering()[ir++] = k+1;
+        s *= shape[k];
+    }
+    sstorage.ordering()[ir++] = RANK+1;
+    if (!interleaved) sstorage.ordering()[ir++] = 0;
+
+    _slab.reference(alloc_blitz_strided<TypeT,RANK+2>(
+        nvar * n, nvar * n, extent, stride, sstorage));
+
+    for (long i=0; i<nvar; ++i) {
+        data[i].arr->reference(_bundle::SlabSlice<TypeT,RANK>::var(_slab, i));
+    }
+}
+
+template<class TypeT, int RANK>
+void ArrayBundle<TypeT,RANK>::allocate_slab(
+    std::array<int, RANK> const &_shape,
+    std::array<std::string,RANK> const &sdims,
+    bool check,
+    SlabLayout layout,
+    blitz::GeneralArrayStorage<RANK> const &storage)
+{
+    for (auto &meta : data) {
+        if (meta.meta.shape[0] < 0) meta.meta.set_shape(_shape, sdims, check);
+    }
+    allocate_slab(check, layout, storage);
+}
+
+template<class TypeT, int RANK>
+blitz::Array<TypeT,2> ArrayBundle<TypeT,RANK>::slab()
+{
+    if (_slab_nvar == 0) (*ibmisc_error)(-1,
+        "ArrayBundle::slab(): allocate_slab() has not been called");
+
+    bool const interleaved = (_slab_layout == SlabLayout::INTERLEAVED);
+    if (_slab.size() == 0) return blitz::Array<TypeT,2>(interleaved
+        ? blitz::shape(0, _slab_nvar) : blitz::shape(_slab_nvar, 0));
+
+    blitz::Array<TypeT,2> ret(_bundle::SlabSlice<TypeT,RANK>::all(_slab));    // (var, i)
+    return interleaved ? ret.transpose(1,0) : ret;
 }
 
 
@@ -407,50 +656,28 @@ void ArrayBundle<TypeT,RANK>::ncio(
     NCIO_BUNDLE_PARAMS,
     ncio_blitz_fn const &_ncio_blitz_fn)
 {
-    // Determine which variables in the bundle we will operate on
-    std::vector<std::string> all_vars;
-    std::vector<std::string> const *myvars;
-    if (vars.size() == 0) {
-        for (size_t i=0; i<index.size(); ++i) {
-            all_vars.push_back(index[i]);
-        }
-        myvars = &all_vars;
-    } else {
-        myvars = &vars;
-    }
-
-
     // Do ncio_blitz() for each varaible
-    for (auto &var : *myvars) {
-        int i=index.at(var);
-
+    for (int i : var_indices(vars)) {
         auto &meta(data[i]);
         std::string vname(prefix+meta.meta.name);
 
         // Delegate to lower level to read/write this array.
         _ncio_blitz_fn(ncio, *meta.arr, vname, snc_type, to_vector(meta.meta.sdims));
+        _bundle::ncio_attrs(ncio, meta.meta, vname);
+    }
+}
 
-        // Read/write attributes
-        netCDF::NcVar ncvar = ncio.nc->getVar(vname);
-        if (ncio.rw == 'w') {
-            for (auto &kv : meta.meta.attr) {
-                std::string const &name(std::get<0>(kv));
-                std::string &value(std::get<1>(kv));    // Read back into Data
-
-                get_or_put_att(ncvar, ncio.rw, name, value);
-            }
-        } else {
-            meta.meta.attr.clear();
-            auto atts(ncvar.getAtts());
-            for (auto ii(atts.begin()); ii != atts.end(); ++ii) {
-                std::string const &aname(ii->first);
-                std::string aval;
-                ii->second.getValues(aval);
-
-                meta.meta.attr.push_back(std::make_pair(aname, aval));
-            }
-        }
+template<class TypeT, int RANK>
+std::vector<int> ArrayBundle<TypeT,RANK>::var_indices(
+    std::vector<std::string> const &vars) const
+{
+    std::vector<int> ret;
+    if (vars.size() == 0) {
+        for (size_t i=0; i<index.size(); ++i) ret.push_back(i);
+    } else {
+        for (auto &var : vars) ret.push_back(index.at(var));
     }
+    return ret;
 }
 // --------------------------------------------------------------------
 template<class TypeT, int RANK>
@@ -494,6 +721,405 @@ void ArrayBundle<TypeT,RANK>::ncio_partial(
             ncdims, nc_start, b2n, _5));
 }
 
+// --------------------------------------------------------------------
+template<class TypeT, int RANK>
+void ArrayBundle<TypeT,RANK>::ncio_stacked(
+    NcIO &ncio,
+    std::vector<std::string> const &vars,
+    std::string const &vname,
+    std::string const &snc_type,
+    std::vector<netCDF::NcDim> const &ncdims,
+    std::string const &var_dim)
+{
+    std::vector<int> const ivars(var_indices(vars));
+    int const nvar = ivars.size();
+    if (nvar == 0) return;
+
+    blitz::Array<TypeT,RANK> &arr0(*data[ivars[0]].arr);
+    for (int i : ivars) {
+        auto &meta(data[i]);
+        if (!meta.arr->data()) (*ibmisc_error)(-1,
+            "ArrayBundle::ncio_stacked(): variable %s must be allocated",
+            meta.meta.name.c_str());
+        for (int k=0; k<RANK; ++k) {
+            if (meta.arr->extent(k) != arr0.extent(k) || meta.arr->lbound(k) != arr0.lbound(k))
+                (*ibmisc_error)(-1,
+                "ArrayBundle::ncio_stacked(): variables %s and %s have different shapes",
+                data[ivars[0]].meta.name.c_str(), meta.meta.name.c_str());
+        }
+    }
+
+    // In place if the variables are evenly spaced, with the same strides
+    bool in_place = true;
+    long const dvar = (nvar == 1 ? arr0.size() :
+        data[ivars[1]].arr->data() - arr0.data());
+    for (int j=0; j<nvar; ++j) {
+        auto &arr(*data[ivars[j]].arr);
+        if (arr.data() != arr0.data() + j*dvar) in_place = false;
+        for (int k=0; k<RANK; ++k) if (arr.stride(k) != arr0.stride(k)) in_place = false;
+    }
+    // ...and do not overlap: either one after the other, or interleaved
+    if (in_place && nvar > 1) {
+        if (dvar == 1) {
+            for (int k=0; k<RANK; ++k) if (arr0.stride(k) % nvar != 0) in_place = false;
+        } else if (dvar < arr0.size() || !arr0.isStorageContiguous()) {
+            in_place = false;
+        }
+    }
+
+    // Shape and storage of the stacked (var, ...) array: the same
+    // layout as each variable, plus the var dimension.
+    blitz::TinyVector<int,RANK+1> shape, stride;
+    blitz::GeneralArrayStorage<RANK+1> storage;
+    shape[0] = nvar;
+    storage.base()[0] = 0;
+    for (int k=0; k<RANK; ++k) {
+        shape[k+1] = arr0.extent(k);
+        storage.base()[k+1] = arr0.lbound(k);
+    }
+    bool const var_fastest = (in_place && dvar == 1);
+    int r = 0;
+    if (var_fastest) storage.ordering()[r++] = 0;
+    for (int k=0; k<RANK; ++k) storage.ordering()[r++] = arr0.ordering(k) + 1;
+    if (!var_fastest) storage.ordering()[r++] = 0;
+
+    blitz::Array<TypeT,RANK+1> *stacked;
+    if (in_place) {
+        stride[0] = dvar;
+        for (int k=0; k<RANK; ++k) stride[k+1] = arr0.stride(k);
+        stacked = &ncio.tmp.make<blitz::Array<TypeT,RANK+1>>(
+            arr0.data(), shape, stride, blitz::neverDeleteData, storage);
+    } else {
+        stacked = &ncio.tmp.make<blitz::Array<TypeT,RANK+1>>(shape, storage);
+    }
+
+    // Views of each variable's place in the staging buffer
+    auto &staged(ncio.tmp.make<std::vector<blitz::Array<TypeT,RANK>>>());
+    if (!in_place) {
+        long const n = arr0.size();
+        blitz::GeneralArrayStorage<RANK> vstorage;
+        for (int k=0; k<RANK; ++k) {
+            vstorage.ordering()[k] = arr0.ordering(k);
+            vstorage.base()[k] = arr0.lbound(k);
+        }
+        for (int j=0; j<nvar; ++j) {
+            staged.push_back(blitz::Array<TypeT,RANK>(
+                stacked->data() + j*n, arr0.shape(), blitz::neverDeleteData, vstorage));
+        }
+    }
+    std::vector<blitz::Array<TypeT,RANK> *> vars_arr;
+    for (int i : ivars) vars_arr.push_back(&*data[i].arr);
+
+    // Gather into the staging buffer just before writing
+    if (!in_place && ncio.rw == 'w') {
+        ncio += [&staged, vars_arr]() {
+            for (size_t j=0; j<staged.size(); ++j) staged[j] = *vars_arr[j];
+        };
+    }
+
+    std::vector<std::string> sdims {var_dim};
+    for (auto &sdim : data[ivars[0]].meta.sdims) sdims.push_back(sdim);
+    std::vector<netCDF::NcDim> stacked_ncdims;
+    if (ncdims.size() > 0) {
+        stacked_ncdims.push_back(get_or_add_dim(ncio, var_dim, nvar));
+        for (auto &ncdim : ncdims) stacked_ncdims.push_back(ncdim);
+    }
+    netCDF::NcVar ncvar = ncio_blitz<TypeT,RANK+1>(ncio, *stacked, vname, snc_type,
+        stacked_ncdims, DimOrderMatch::MEMORY, true, sdims);
+
+    // Scatter from the staging buffer just after reading
+    if (!in_place && ncio.rw == 'r') {
+        ncio += [&staged, vars_arr]() {
+            for (size_t j=0; j<staged.size(); ++j) *vars_arr[j] = staged[j];
+        };
+    }
+
+    // Read/write names and attributes
+    std::string var_names;
+    for (int i : ivars) {
+        if (var_names.size() > 0) var_names += ',';
+        var_names += data[i].meta.name;
+    }
+    std::string nc_var_names(var_names);
+    get_or_put_att(ncvar, ncio.rw, "var_names", nc_var_names);
+    if (nc_var_names != var_names) (*ibmisc_error)(-1,
+        "ArrayBundle::ncio_stacked(): %s holds variables (%s), expected (%s)",
+        vname.c_str(), nc_var_names.c_str(), var_names.c_str());
+
+    if (ncio.rw == 'w') {
+        for (int i : ivars) {
+            auto &meta(data[i]);
+            for (auto &kv : meta.meta.attr) {
+                std::string value(std::get<1>(kv));
+                get_or_put_att(ncvar, ncio.rw, meta.meta.name + "." + std::get<0>(kv), value);
+            }
+        }
+    } else {
+        auto atts(ncvar.getAtts());
+        for (int i : ivars) {
+            auto &meta(data[i]);
+            std::string const aprefix(meta.meta.name + ".");
+            meta.meta.attr.clear();
+            for (auto ii(atts.begin()); ii != atts.end(); ++ii) {
+                std::string const &aname(ii->first);
+                if (aname.compare(0, aprefix.size(), aprefix) != 0) continue;
+                std::string aval;
+                ii->second.getValues(aval);
+                meta.meta.attr.push_back(std::make_pair(aname.substr(aprefix.size()), aval));
+            }
+        }
+    }
+}
+
+// -------------------------------------------------------------
+/** A view of some of an ArrayBundle's variables, each possibly
+restricted to a hyperslab (see slice()); eg the inputs of one
+component.  Arrays are Blitz views of the bundle's memory, and
+metadata is the bundle's own: nothing is copied.
+Make a view once (eg at setup) and reuse it every timestep: it sees
+the bundle's current values, but must be remade if the bundle's
+variables are reallocated.  As with ArrayBundle, the view must outlive
+the NcIO it is used with (until flush() / close()). */
+template<class TypeT, int RANK>
+class BundleView {
+    ArrayBundle<TypeT,RANK> *bundle;
+    std::vector<blitz::Array<TypeT,RANK>> arrays;    // arrays[i] views data[ivars[i]]
+
+public:
+    /** Indices (into the bundle's data) of the variables in the view */
+    std::vector<int> ivars;
+
+    BundleView() : bundle(nullptr) {}
+
+    /** Views the named variables of _bundle; or all, if vars is empty. */
+    BundleView(ArrayBundle<TypeT,RANK> &_bundle, std::vector<std::string> const &vars = {});
+
+    /** For read-only views (eg inputs); use as a const BundleView */
+    BundleView(ArrayBundle<TypeT,RANK> const &_bundle, std::vector<std::string> const &vars = {})
+        : BundleView(const_cast<ArrayBundle<TypeT,RANK> &>(_bundle), vars) {}
+
+    size_t size() const { return ivars.size(); }
+
+    /** @return Position of variable name in this view, or -1 */
+    int find(std::string const &name) const;
+
+    bool contains(std::string const &name) const
+        { return find(name) >= 0; }
+
+    ArrayMeta<RANK> &meta(size_t i)
+        { return bundle->data[ivars[i]].meta; }
+    ArrayMeta<RANK> const &meta(size_t i) const
+        { return bundle->data[ivars[i]].meta; }
+
+    blitz::Array<TypeT,RANK> &array(size_t i)
+        { return arrays[i]; }
+    blitz::Array<TypeT,RANK> const &array(size_t i) const
+        { return arrays[i]; }
+
+    blitz::Array<TypeT,RANK> &array(std::string const &name)
+        { return arrays[at(name)]; }
+    blitz::Array<TypeT,RANK> const &array(std::string const &name) const
+        { return arrays[at(name)]; }
+
+    /** View of some of this view's variables */
+    BundleView select(std::vector<std::string> const &vars) const;
+
+    /** View of the part of each variable inside domain, in the arrays'
+    own index space; lbounds of the result are domain[k].begin. */
+    BundleView slice(Domain const &domain) const;
+
+    /** Views the variables as one (nvar, n) matrix, eg As for
+    Weighted::apply_M(); possible if each variable's elements are
+    evenly spaced in memory (eg a contiguous array), and so are the
+    variables (eg after ArrayBundle::allocate_slab()).
+    @return False (leaving M alone) if they are not. */
+    bool matrix(blitz::Array<TypeT,2> &M) const;
+
+    /** Reads/writes the variables, as ArrayBundle::ncio() */
+    void ncio(
+        NcIO &ncio,
+        std::string const &prefix,
+        std::string const &snc_type,
+        std::vector<netCDF::NcDim> const &ncdims = {},
+        DimOrderMatch match = DimOrderMatch::MEMORY,
+        bool ncdims_in_nc_order = true);
+
+    /** Reads/writes the variables into part of larger NetCDF
+    variables, as ArrayBundle::ncio_partial() */
+    void ncio_partial(
+        NcIO &ncio,
+        std::string const &prefix,
+        std::string const &snc_type,
+        std::vector<netCDF::NcDim> const &ncdims,
+        std::vector<size_t> const &nc_start,
+        std::vector<int> const &b2n);
+
+    /** Reads/writes a slice() at its place in the NetCDF variables */
+    void ncio_partial(
+        NcIO &ncio,
+        std::string const &prefix,
+        std::string const &snc_type,
+        std::vector<netCDF::NcDim> const &ncdims,
+        Domain const &domain,
+        std::vector<int> const &b2n)
+    {
+        ncio_partial(ncio, prefix, snc_type, ncdims,
+            domain.nc_start(b2n, ncdims.size()), b2n);
+    }
+
+private:
+    int at(std::string const &name) const
+    {
+        int const i = find(name);
+        if (i < 0) (*ibmisc_error)(-1,
+            "BundleView: no variable %s", name.c_str());
+        return i;
+    }
+};
+
+template<class TypeT, int RANK>
+BundleView<TypeT,RANK>::BundleView(
+    ArrayBundle<TypeT,RANK> &_bundle, std::vector<std::string> const &vars)
+: bundle(&_bundle)
+{
+    if (vars.size() == 0) {
+        for (size_t i=0; i<bundle->data.size(); ++i) ivars.push_back(i);
+    } else {
+        for (auto &var : vars) ivars.push_back(bundle->index.at(var));
+    }
+    arrays.reserve(ivars.size());
+    for (int i : ivars) arrays.push_back(*bundle->data[i].arr);
+}
+
+template<class TypeT, int RANK>
+int BundleView<TypeT,RANK>::find(std::string const &name) const
+{
+    if (!bundle || !bundle->index.contains(name)) return -1;
+    int const ix = bundle->index.at(name);
+    for (size_t i=0; i<ivars.size(); ++i) {
+        if (ivars[i] == ix) return i;
+    }
+    return -1;
+}
+
+template<class TypeT, int RANK>
+BundleView<TypeT,RANK> BundleView<TypeT,RANK>::select(
+    std::vector<std::string> const &vars) const
+{
+    BundleView ret;
+    ret.bundle = bundle;
+    for (auto &var : vars) {
+        int const i = at(var);
+        ret.ivars.push_back(ivars[i]);
+        ret.arrays.push_back(arrays[i]);
+    }
+    return ret;
+}
+
+template<class TypeT, int RANK>
+BundleView<TypeT,RANK> BundleView<TypeT,RANK>::slice(Domain const &domain) const
+{
+    if (domain.rank() != RANK) (*ibmisc_error)(-1,
+        "BundleView::slice(): domain has rank %d, not %d", domain.rank(), RANK);
+
+    BundleView ret;
+    ret.bundle = bundle;
+    ret.ivars = ivars;
+    blitz::TinyVector<int,RANK> lb, ub;
+    for (int k=0; k<RANK; ++k) {
+        lb[k] = domain[k].begin;
+        ub[k] = domain[k].end - 1;
+    }
+    for (size_t i=0; i<arrays.size(); ++i) {
+        auto const &arr(arrays[i]);
+        for (int k=0; k<RANK; ++k) {
+            if (lb[k] < arr.lbound(k) || ub[k] > arr.ubound(k) || lb[k] > ub[k]+1)
+                (*ibmisc_error)(-1,
+                "BundleView::slice(): domain [%d, %d] outside of %s dimension %d [%d, %d]",
+                lb[k], ub[k], meta(i).name.c_str(), k, arr.lbound(k), arr.ubound(k));
+        }
+        blitz::Array<TypeT,RANK> sub(
+            const_cast<blitz::Array<TypeT,RANK> &>(arr)(blitz::RectDomain<RANK>(lb, ub)));
+        sub.reindexSelf(lb);
+        ret.arrays.push_back(sub);
+    }
+    return ret;
+}
+
+template<class TypeT, int RANK>
+bool BundleView<TypeT,RANK>::matrix(blitz::Array<TypeT,2> &M) const
+{
+    if (arrays.size() == 0) return false;
+    auto const &arr0(arrays[0]);
+
+    // Spacing of elements within each variable
+    std::array<int,RANK> dims;
+    for (int k=0; k<RANK; ++k) dims[k] = k;
+    std::sort(dims.begin(), dims.end(),
+        [&arr0](int a, int b) { return arr0.stride(a) < arr0.stride(b); });
+    long const n = arr0.numElements();
+    long s = 0;    // Element spacing, once known
+    long next = 0;    // Stride the next dimension must have
+    for (int k : dims) {
+        if (arr0.extent(k) == 1) continue;
+        if (arr0.stride(k) <= 0) return false;
+        if (s == 0) s = arr0.stride(k);
+        else if (arr0.stride(k) != next) return false;
+        next = arr0.stride(k) * arr0.extent(k);
+    }
+    if (s == 0) s = 1;
+
+    // Spacing of the variables; they must not overlap
+    int const nvar = arrays.size();
+    long const dvar = (nvar == 1 ? n*s : arrays[1].data() - arr0.data());
+    for (int j=0; j<nvar; ++j) {
+        auto const &arr(arrays[j]);
+        if (arr.data() != arr0.data() + j*dvar) return false;
+        for (int k=0; k<RANK; ++k) {
+            if (arr.extent(k) != arr0.extent(k) || arr.stride(k) != arr0.stride(k))
+                return false;
+        }
+    }
+    if (nvar > 1 && !(dvar >= n*s || (dvar > 0 && nvar*dvar <= s))) return false;
+
+    M.reference(blitz::Array<TypeT,2>(const_cast<TypeT *>(arr0.data()),
+        blitz::shape(nvar, n), blitz::shape(dvar, s), blitz::neverDeleteData));
+    return true;
+}
+
+template<class TypeT, int RANK>
+void BundleView<TypeT,RANK>::ncio(
+    NcIO &ncio,
+    std::string const &prefix,
+    std::string const &snc_type,
+    std::vector<netCDF::NcDim> const &ncdims,
+    DimOrderMatch match,
+    bool ncdims_in_nc_order)
+{
+    for (size_t i=0; i<size(); ++i) {
+        std::string const vname(prefix + meta(i).name);
+        ncio_blitz<TypeT,RANK>(ncio, arrays[i], vname, snc_type,
+            ncdims, match, ncdims_in_nc_order, to_vector(meta(i).sdims));
+        _bundle::ncio_attrs(ncio, meta(i), vname);
+    }
+}
+
+template<class TypeT, int RANK>
+void BundleView<TypeT,RANK>::ncio_partial(
+    NcIO &ncio,
+    std::string const &prefix,
+    std::string const &snc_type,
+    std::vector<netCDF::NcDim> const &ncdims,
+    std::vector<size_t> const &nc_start,
+    std::vector<int> const &b2n)
+{
+    for (size_t i=0; i<size(); ++i) {
+        std::string const vname(prefix + meta(i).name);
+        ncio_blitz_partial<TypeT,RANK>(ncio, arrays[i], vname, snc_type,
+            ncdims, nc_start, b2n, to_vector(meta(i).sdims));
+        _bundle::ncio_attrs(ncio, meta(i), vname);
+    }
+}
 
 // -------------------------------------------------------------
 /** Reshapes a bundle of Blitz++ arrays to a bundle of 1-D Blitz++ array */
@@ -199,6 +199,9 @@ blitz::GeneralArrayStorage<N> const &storage)
 
     // Set up shape and strides
     for (int i=0;i<N;++i) {
+        if (PyArray_STRIDE(vec, i) % T_size != 0) (*ibmisc_error)(-1,
+            "%s: stride #%d (%ld bytes) is not a multiple of the element size %d",
+            vname.c_str(), i, (long)PyArray_STRIDE(vec, i), T_size);
         shape[i]   = PyArray_DIM(vec, i);
         // Python/Numpy strides are in bytes, Blitz++ in sizeof(T) units.
         strides[i] = PyArray_STRIDE(vec, i) / T_size;
@@ -209,6 +212,30 @@ blitz::GeneralArrayStorage<N> const &storage)
 }
 
 
+/** Optional Numpy output argument: returns out_py (as a new
+reference), after checking its type and dimensions; or if out_py is
+None or NULL, allocates a new array of dimensions dims.  Either way,
+out is set to reference the array's data (no copy). */
+template<class T, int N>
+PyObject *np_out_to_blitz(
+PyObject *out_py,
+std::string const &vname,
+std::array<int,N> dims,
+blitz::Array<T,N> &out);
+
+/** Releases the GIL for the life of this object; so threads may run
+Python code while we compute.  No Python API calls may be made
+while it is held. */
+class ReleaseGIL {
+    PyThreadState *_save;
+public:
+    ReleaseGIL() : _save(PyEval_SaveThread()) {}
+    ~ReleaseGIL() { PyEval_RestoreThread(_save); }
+    ReleaseGIL(ReleaseGIL const &) = delete;
+    ReleaseGIL &operator=(ReleaseGIL const &) = delete;
+};
+
+
 /** Allocates a Numpy array of a given type and size
 For memory allocation issues, see:
 http://grokbase.com/t/python/python-list/005ttee301/decrefing-and-pyarray-functions-in-c-extensions
@@ -225,6 +252,25 @@ PyObject *new_pyarray(std::array<int,N> dims)
     return PyArray_FromDims(N, &dims[0], np_type_num<T>());
 }
 
+template<class T, int N>
+PyObject *np_out_to_blitz(
+PyObject *out_py,
+std::string const &vname,
+std::array<int,N> dims,
+blitz::Array<T,N> &out)
+{
+    if (!out_py || out_py == Py_None) {
+        out_py = new_pyarray<T,N>(dims);
+        out.reference(np_to_blitz<T,N>(out_py, vname, dims));
+    } else {
+        out.reference(np_to_blitz<T,N>(out_py, vname, dims));
+        if (!PyArray_ISWRITEABLE((PyArrayObject *)out_py)) (*ibmisc_error)(-1,
+            "%s: output array is not writeable", vname.c_str());
+        Py_INCREF(out_py);
+    }
+    return out_py;
+}
+
 #if 0
 template<class T, int N>
 PyObject *blitz_to_np(
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <boost/format.hpp>
 #include <ibmisc/datetime.hpp>
+#include <ibmisc/error.hpp>
 
 namespace ibmisc {
 
@@ -32,6 +33,19 @@ const std::array<std::string,12> Cal365::month_name3
 const std::array<int,12> Cal365::month_len {31,28,31,30,31,30,31,31,30,31,30,31};
 const std::array<int,13> Cal365::month_start = init_month_start();
 
+static std::array<unsigned char,365> init_doy(bool month)
+{
+    std::array<unsigned char,365> ret;
+    int doy = 0;
+    for (int mm=0; mm<12; ++mm) {
+    for (int dd=0; dd<Cal365::month_len[mm]; ++dd) {
+        ret[doy++] = (month ? mm+1 : dd+1);
+    }}
+    return ret;
+}
+const std::array<unsigned char,365> Cal365::doy_month = init_doy(true);
+const std::array<unsigned char,365> Cal365::doy_day = init_doy(false);
+
 Cal365 cal365;    // Singleton
 
 // ------------------------------------------------------
@@ -60,6 +74,46 @@ Date Cal365::to_date(JDate jda) const
     return Date(yy,mm-month_start.begin()+1,dd+1);
 }
 
+void Cal365::to_jdates(Date const *da, size_t n, long *jdays) const
+{
+    for (size_t i=0; i<n; ++i) {
+        jdays[i] = da[i].year()*365L + month_start[da[i].month()-1] + (da[i].day()-1);
+    }
+}
+
+void Cal365::to_dates(long const *jdays, size_t n, Date *da) const
+{
+    for (size_t i=0; i<n; ++i) {
+        long const j = jdays[i];
+        long const yy = (j >= 0 ? j / 365 : -((-j + 364) / 365));    // floor
+        int const doy = j - yy*365;
+        da[i] = Date(yy, doy_month[doy], doy_day[doy]);
+    }
+}
+
+// ------------------------------------------------------
+// Generic array-wise conversions, one value at a time
+
+void Calendar::to_jdates(Date const *da, size_t n, long *jdays) const
+    { for (size_t i=0; i<n; ++i) jdays[i] = to_jdate(da[i]).day(); }
+
+void Calendar::to_dates(long const *jdays, size_t n, Date *da) const
+    { for (size_t i=0; i<n; ++i) da[i] = to_date(JDate(jdays[i])); }
+
+void Calendar::to_jdatetimes(Datetime const *dt, size_t n, long *jdays, long *usecs) const
+{
+    std::vector<Date> da(dt, dt+n);
+    to_jdates(da.data(), n, jdays);
+    for (size_t i=0; i<n; ++i) usecs[i] = to_jtime(dt[i]).usec();
+}
+
+void Calendar::to_datetimes(long const *jdays, long const *usecs, size_t n, Datetime *dt) const
+{
+    std::vector<Date> da(n);
+    to_dates(jdays, n, da.data());
+    for (size_t i=0; i<n; ++i) dt[i] = Datetime(da[i], to_time(JTime(usecs[i])));
+}
+
 // ------------------------------------------------------
 
 // =====================================================
@@ -116,6 +170,60 @@ Datetime TimeUnit::to_datetime(double tm) const
     return cal->to_datetime(to_jdatetime(tm));
 }
 
+double TimeUnit::to_double(Datetime const &dt) const
+{
+    double ret;
+    to_doubles(&dt, 1, &ret);
+    return ret;
+}
+
+void TimeUnit::to_jdatetimes(double const *tm, size_t n, long *jdays, long *usecs) const
+{
+    if (uniti != TimeElement::SECOND) (*ibmisc_error)(-1,
+        "TimeUnit: only seconds are supported");
+
+    // Same arithmetic as to_jdatetime(), in a loop the compiler can vectorise
+    long const base_day = basej.jdate().day();
+    long const base_usec = basej.jtime().usec();
+    for (size_t i=0; i<n; ++i) {
+        double tm_int0;
+        double const tm_frac = modf(tm[i], &tm_int0);
+        long const tm_int = tm_int0;
+        long const usec = base_usec + (tm_int % 86400L) * 1000000L
+            + (long)(tm_frac * 1000000. + .5);
+        jdays[i] = base_day + tm_int / 86400L + usec / USEC::DAY;
+        usecs[i] = usec % USEC::DAY;
+    }
+}
+
+void TimeUnit::to_datetimes(double const *tm, size_t n, Datetime *dt) const
+{
+    std::vector<long> jdays(n), usecs(n);
+    to_jdatetimes(tm, n, jdays.data(), usecs.data());
+    cal->to_datetimes(jdays.data(), usecs.data(), n, dt);
+}
+
+void TimeUnit::to_doubles(Datetime const *dt, size_t n, double *tm) const
+{
+    if (uniti != TimeElement::SECOND) (*ibmisc_error)(-1,
+        "TimeUnit: only seconds are supported");
+
+    std::vector<long> jdays(n), usecs(n);
+    cal->to_jdatetimes(dt, n, jdays.data(), usecs.data());
+    long const base_day = basej.jdate().day();
+    long const base_usec = basej.jtime().usec();
+    for (size_t i=0; i<n; ++i) {
+        tm[i] = (jdays[i] - base_day) * 86400.
+            + (usecs[i] - base_usec) * 1e-6;
+    }
+}
+
+long find_record(TimeUnit const &tu, double const *axis, size_t n, Datetime const &dt)
+{
+    double const tm = tu.to_double(dt);
+    return (std::upper_bound(axis, axis + n, tm) - axis) - 1;
+}
+
 
 }    // namespace
 
@@ -19,6 +19,8 @@
 #pragma once
 
 #include <tuple>
+#include <string>
+#include <vector>
 #include <ibmisc/array.hpp>
 
 namespace ibmisc {
@@ -212,6 +214,13 @@ struct Calendar {
     Date sub(Date const da, long nday) const
         { return to_date(to_jdate(da) - nday); }
 
+    // ----- Array-wise versions, for whole time axes.  Calendars
+    // override these with table-driven loops.
+    virtual void to_jdates(Date const *da, size_t n, long *jdays) const;
+    virtual void to_dates(long const *jdays, size_t n, Date *da) const;
+
+    void to_jdatetimes(Datetime const *dt, size_t n, long *jdays, long *usecs) const;
+    void to_datetimes(long const *jdays, long const *usecs, size_t n, Datetime *dt) const;
 };
 
 struct Cal365 : public Calendar {
@@ -219,11 +228,19 @@ struct Cal365 : public Calendar {
     static const std::array<int,12> month_len;
     static const std::array<int,13> month_start;
 
+    // Month (1-based) and day-of-month (1-based) of each day of the year
+    static const std::array<unsigned char,365> doy_month;
+    static const std::array<unsigned char,365> doy_day;
+
     virtual ~Cal365();
 
     std::string to_cf() const;
     JDate to_jdate(Date const &cda) const;
     Date to_date(JDate da) const;
+
+    void to_jdates(Date const *da, size_t n, long *jdays) const;
+    /** Negative days are taken to be in years before 0 */
+    void to_dates(long const *jdays, size_t n, Date *da) const;
 };
 // ---------------------------------------------------
 extern Cal365 cal365;
@@ -249,8 +266,23 @@ public:
 
     Datetime to_datetime(double tm) const;
 
+    /** Inverse of to_datetime() */
+    double to_double(Datetime const &dt) const;
+
+    // ----- Array-wise versions, for whole time axes
+    void to_jdatetimes(double const *tm, size_t n, long *jdays, long *usecs) const;
+    void to_datetimes(double const *tm, size_t n, Datetime *dt) const;
+    void to_doubles(Datetime const *dt, size_t n, double *tm) const;
 };
 
+/** Finds the record of a (sorted, ascending) time axis in which dt
+falls: the last i with axis[i] <= dt.
+@return -1 if dt is before axis[0]. */
+extern long find_record(TimeUnit const &tu, double const *axis, size_t n, Datetime const &dt);
+
+inline long find_record(TimeUnit const &tu, std::vector<double> const &axis, Datetime const &dt)
+    { return find_record(tu, axis.data(), axis.size(), dt); }
+
 
 
 }    // namespace
@@ -1,60 +1,156 @@
 #include <cstdint>
+#include <cstring>
 #include <ibmisc/error.hpp>
 #include <ibmisc/endian.hpp>
 #include <boost/endian/conversion.hpp>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace ibmisc {
 
-void big_to_native(char *buf, int const item_size, long nitem)
-{
-    if (item_size == 1) return;
+// -----------------------------------------------------------------
+// Byte-swap kernels.  The generic one is written so GCC can
+// auto-vectorize it; the SIMD ones do 16/32 bytes per instruction,
+// and are selected at runtime based on the CPU.
+
+namespace {
 
+template<class UIntT>
+void swap_generic(char *buf, long nitem)
+{
     for (long i=0; i<nitem; ++i) {
-        switch(item_size) {
-            case 2:
-                boost::endian::big_to_native_inplace<uint16_t>(
-                    *(uint16_t *)(buf + item_size*i));
-            break;
-            case 4:
-                boost::endian::big_to_native_inplace<uint32_t>(
-                    *(uint32_t *)(buf + item_size*i));
-            break;
-            case 8:
-                boost::endian::big_to_native_inplace<uint64_t>(
-                    *(uint64_t *)(buf + item_size*i));
-            break;
-            default:
-                (*ibmisc_error)(-1, "Illegal item size: %d", item_size);
-            return;
-        }
+        UIntT val;
+        memcpy(&val, buf + sizeof(UIntT)*i, sizeof(UIntT));
+        val = boost::endian::endian_reverse(val);
+        memcpy(buf + sizeof(UIntT)*i, &val, sizeof(UIntT));
+    }
+}
+
+void swap_scalar(char *buf, int const item_size, long nitem)
+{
+    switch(item_size) {
+        case 2: swap_generic<uint16_t>(buf, nitem); break;
+        case 4: swap_generic<uint32_t>(buf, nitem); break;
+        case 8: swap_generic<uint64_t>(buf, nitem); break;
     }
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+/** pshufb control vector reversing each item_size-byte item within a
+16-byte lane */
+inline void shuffle_mask(char *mask, int item_size)
+{
+    for (int i=0; i<16; ++i)
+        mask[i] = (char)((i / item_size) * item_size + (item_size - 1 - i % item_size));
+}
 
+__attribute__((target("ssse3")))
+void swap_ssse3(char *buf, int const item_size, long nitem)
+{
+    char m[16];
+    shuffle_mask(m, item_size);
+    __m128i const mask = _mm_loadu_si128((__m128i const *)m);
+
+    long const nbytes = item_size * nitem;
+    long i=0;
+    for (; i+16 <= nbytes; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *)(buf + i));
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_shuffle_epi8(v, mask));
+    }
+    swap_scalar(buf + i, item_size, (nbytes - i) / item_size);
+}
 
-void little_to_native(char *buf, int const item_size, long nitem)
+__attribute__((target("avx2")))
+void swap_avx2(char *buf, int const item_size, long nitem)
 {
-    if (item_size == 1) return;
+    char m[32];
+    shuffle_mask(m, item_size);
+    shuffle_mask(m+16, item_size);    // vpshufb works within 128-bit lanes
+    __m256i const mask = _mm256_loadu_si256((__m256i const *)m);
+
+    long const nbytes = item_size * nitem;
+    long i=0;
+    for (; i+32 <= nbytes; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)(buf + i));
+        _mm256_storeu_si256((__m256i *)(buf + i), _mm256_shuffle_epi8(v, mask));
+    }
+    swap_scalar(buf + i, item_size, (nbytes - i) / item_size);
+}
+#endif
 
-    for (long i=0; i<nitem; ++i) {
+#if defined(__ARM_NEON)
+void swap_neon(char *buf, int const item_size, long nitem)
+{
+    long const nbytes = item_size * nitem;
+    long i=0;
+    for (; i+16 <= nbytes; i += 16) {
+        uint8x16_t v = vld1q_u8((uint8_t const *)(buf + i));
         switch(item_size) {
-            case 2:
-                boost::endian::little_to_native_inplace<uint16_t>(
-                    *(uint16_t *)(buf + item_size*i));
-            break;
-            case 4:
-                boost::endian::little_to_native_inplace<uint32_t>(
-                    *(uint32_t *)(buf + item_size*i));
-            break;
-            case 8:
-                boost::endian::little_to_native_inplace<uint64_t>(
-                    *(uint64_t *)(buf + item_size*i));
-            break;
-            default:
-                (*ibmisc_error)(-1, "Illegal item size: %d", item_size);
-            return;
+            case 2: v = vrev16q_u8(v); break;
+            case 4: v = vrev32q_u8(v); break;
+            case 8: v = vrev64q_u8(v); break;
         }
+        vst1q_u8((uint8_t *)(buf + i), v);
+    }
+    swap_scalar(buf + i, item_size, (nbytes - i) / item_size);
+}
+#endif
+
+typedef void (*swap_fn)(char *, int, long);
+
+swap_fn choose_swap()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &swap_avx2;
+    if (__builtin_cpu_supports("ssse3")) return &swap_ssse3;
+#endif
+#if defined(__ARM_NEON)
+    return &swap_neon;
+#endif
+    return &swap_scalar;
+}
+
+}    // anonymous namespace
+
+void swap_bytes(char *buf, int const item_size, long nitem)
+{
+    static swap_fn const swap = choose_swap();
+
+    switch(item_size) {
+        case 1: return;
+        case 2:
+        case 4:
+        case 8:
+            swap(buf, item_size, nitem);
+        break;
+        default:
+            (*ibmisc_error)(-1, "Illegal item size: %d", item_size);
+    }
+}
+
+void big_to_native(char *buf, int const item_size, long nitem)
+{
+    if (boost::endian::order::native == boost::endian::order::big) {
+        if (item_size != 1 && item_size != 2 && item_size != 4 && item_size != 8)
+            (*ibmisc_error)(-1, "Illegal item size: %d", item_size);
+        return;
+    }
+    swap_bytes(buf, item_size, nitem);
+}
+
+void little_to_native(char *buf, int const item_size, long nitem)
+{
+    if (boost::endian::order::native == boost::endian::order::little) {
+        if (item_size != 1 && item_size != 2 && item_size != 4 && item_size != 8)
+            (*ibmisc_error)(-1, "Illegal item size: %d", item_size);
+        return;
     }
+    swap_bytes(buf, item_size, nitem);
 }
 
 void endian_to_native(char *buf, int const item_size, long nitem, Endian endian)
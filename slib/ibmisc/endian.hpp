@@ -2,12 +2,20 @@
 #define IBMISC_ENDIAN_HPP
 
 #include <iostream>
+#include <cstring>
 #include <boost/lexical_cast.hpp>
+#include <boost/integer.hpp>
+#include <boost/endian/conversion.hpp>
 
 namespace ibmisc {
 
 enum class Endian {LITTLE, BIG};
 
+/** Reverse the bytes of each item in an array, in place.  Uses SIMD
+kernels (SSSE3 / AVX2 / NEON) where the CPU supports them.
+@param item_size 1, 2, 4 or 8 */
+void swap_bytes(char *buf, int const item_size, long nitem);
+
 /** Convert an entire array of big-endian items to native-endian format */
 void big_to_native(char *buf, int const item_size, long nitem);
 
@@ -17,6 +25,25 @@ void little_to_native(char *buf, int const item_size, long nitem);
 /** Convert big or little to native */
 void endian_to_native(char *buf, int const item_size, long nitem, Endian endian);
 
+/** Convert nitem items of type SrcT, stored in the given byte order
+at (possibly unaligned) src, to native DestT --- in one pass. */
+template<class SrcT, class DestT>
+void endian_cast(char const *src, DestT *dest, long nitem, Endian endian)
+{
+    typedef typename boost::uint_t<8*sizeof(SrcT)>::exact UIntT;
+    bool const swap = (endian == Endian::BIG) !=
+        (boost::endian::order::native == boost::endian::order::big);
+
+    for (long i=0; i<nitem; ++i) {
+        UIntT ival;
+        memcpy(&ival, src + sizeof(SrcT)*i, sizeof(SrcT));
+        if (swap) ival = boost::endian::endian_reverse(ival);
+        SrcT val;
+        memcpy(&val, &ival, sizeof(SrcT));
+        dest[i] = (DestT)val;
+    }
+}
+
 } // namespace
 
 // =================================================================
@@ -27,4 +27,36 @@ namespace ibmisc {
 
 everytrace_error_ptr ibmisc_error = &everytrace_error_default;
 
+// ------------------------------------------------------------
+static thread_local DeferredError deferred = {false, 0, {0}};
+
+void defer_error(int retcode, char const *fmt, ...)
+{
+    if (deferred.set) return;    // Keep the first one
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(deferred.msg, DeferredError::max_len, fmt, args);
+    va_end(args);
+    deferred.retcode = retcode;
+    deferred.set = true;
+}
+
+bool has_deferred_error()
+    { return deferred.set; }
+
+DeferredError take_deferred_error()
+{
+    DeferredError ret(deferred);
+    deferred.set = false;
+    return ret;
+}
+
+void raise_deferred_error()
+{
+    if (!deferred.set) return;
+    DeferredError const err(take_deferred_error());
+    (*ibmisc_error)(err.retcode, "%s", err.msg);
+}
+
 }   // Namespace
@@ -19,6 +19,8 @@
 #ifndef IBMISC_ERROR_HPP
 #define IBMISC_ERROR_HPP
 
+#include <array>
+#include <cstdio>
 #include <everytrace.hpp>
 
 /** @defgroup ibmisc ibmisc.hpp
@@ -31,6 +33,69 @@ typedef everytrace::Exception Exception;
     library can change if needed. */
 extern everytrace_error_ptr ibmisc_error;
 
+/** Default for the CHECKED template parameter of containers with
+per-element argument checks in their hot loops (TupleList::add(),
+accum::Blitz::add(), SparseSet::to_dense(), ZArray_Generator...).
+Build with -DIBMISC_UNCHECKED to drop those checks everywhere, eg for
+release pipelines whose inputs are known good; or instantiate a
+container with CHECKED=false where it matters. */
+#ifdef IBMISC_UNCHECKED
+constexpr bool checked_default = false;
+#else
+constexpr bool checked_default = true;
+#endif
+
+// ------------------------------------------------------------
+/** An error recorded by defer_error(), awaiting raise_deferred_error() */
+struct DeferredError {
+    static size_t const max_len = 512;
+
+    bool set;
+    int retcode;
+    char msg[max_len];    // Truncated if longer
+};
+
+/** Records an error for the current thread, without calling
+ibmisc_error.  For code that should not unwind right where the error
+is found: worker threads, tight loops that report after the fact.
+The message is formatted into a fixed thread-local buffer: no
+allocation, no shared state.  Only the first error since the last
+raise_deferred_error() is kept.
+
+parallel_for() hands errors deferred by its worker threads on to the
+calling thread. */
+extern void defer_error(int retcode, char const *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/** @return True if the current thread has a deferred error */
+extern bool has_deferred_error();
+
+/** @return The current thread's deferred error (if any), and clears it */
+extern DeferredError take_deferred_error();
+
+/** If the current thread has a deferred error, clears it and passes
+it to ibmisc_error. */
+extern void raise_deferred_error();
+
+/** Formats an index tuple as "(i j k)" into buf, without allocating;
+for error messages in hot paths.
+@return buf */
+template<class IndexT, size_t RANK>
+char const *format_index(char *buf, size_t bufsize, std::array<IndexT,RANK> const &index)
+{
+    if (bufsize == 0) return buf;
+    size_t len = 0;
+    buf[0] = '\0';
+    char sep = '(';
+    for (size_t i=0; i<RANK && len < bufsize; ++i) {
+        int const n = snprintf(buf+len, bufsize-len, "%c%ld", sep, (long)index[i]);
+        if (n > 0) len += n;
+        sep = ' ';
+    }
+    if (len < bufsize) snprintf(buf+len, bufsize-len, RANK == 0 ? "()" : ")");
+    return buf;
+}
+
 }   // namespace
 /** @} */
 
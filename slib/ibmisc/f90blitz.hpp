@@ -18,7 +18,6 @@
 
 #pragma once
 
-#include <mpi.h>
 #include <cstdio>
 #include <blitz/array.h>
 #include <iostream>
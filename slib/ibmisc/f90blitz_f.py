@@ -85,6 +85,37 @@ def get_spec(ftype,ctype,rank) :
     return get_spec_tpl.substitute(d)
 
 # ---------------------------------------------------
+# Applying a registered ibmisc::linear::Weighted (see linear/fortran.hpp)
+# directly to Fortran arrays.  For ranks 1 and 2, real*8 only.
+linear_interface_tpl = string.Template('''
+        subroutine ibmisc_linear_apply_m_$rank(handle, As, out, accum_type, force_conservation) bind(c)
+            use, intrinsic :: iso_c_binding
+            import :: arr_spec_$rank
+            integer(c_int), value :: handle
+            type(arr_spec_$rank) :: As, out
+            integer(c_int), value :: accum_type, force_conservation
+        end subroutine''')
+
+linear_apply_tpl = string.Template('''
+    ! out = M * As; As(nA$vecdim), out(nB$vecdim)
+    subroutine linear_apply_m_$rank(handle, As, out, accum_type, force_conservation)
+    implicit none
+    integer, intent(IN) :: handle
+    real*8, dimension($colons), target :: As, out
+    integer, intent(IN) :: accum_type    ! 0=REPLACE, 1=ACCUMULATE, 2=REPLACE_OR_ACCUMULATE
+    logical, intent(IN) :: force_conservation
+    type(arr_spec_$rank) :: As_spec, out_spec
+
+        call get_spec_double_$rank(As, lbound(As), As_spec)
+        call get_spec_double_$rank(out, lbound(out), out_spec)
+        call ibmisc_linear_apply_m_$rank(handle, As_spec, out_spec, &
+            accum_type, merge(1, 0, force_conservation))
+    end subroutine''')
+
+def linear_ranks(fctypes, ranks) :
+    if ('real*8', 'double') not in fctypes : return []
+    return [r for r in ranks if r in (1,2)]
+
 def get_module(module_name, fctypes, ranks) :
     out = []
     out.append('''! ======== DO NOT EDIT!!!!  Machine Generated!!!!
@@ -98,6 +129,19 @@ implicit none
     for rank in ranks :
         out.append(arr_spec_tpl.substitute(rank=str(rank)))
 
+    lranks = linear_ranks(fctypes, ranks)
+    if len(lranks) > 0 :
+        out.append('\n\n    interface')
+        out.append('''
+        subroutine ibmisc_linear_shape(handle, nB, nA) bind(c)
+            use, intrinsic :: iso_c_binding
+            integer(c_int), value :: handle
+            integer(c_int) :: nB, nA
+        end subroutine''')
+        for rank in lranks :
+            out.append(linear_interface_tpl.substitute(rank=str(rank)))
+        out.append('\n    end interface\n')
+
     out.append('\ncontains\n')
 
 
@@ -108,6 +152,12 @@ implicit none
             out.append(get_spec(ftype,ctype,rank))
             out.append('\n\n')
 
+    for rank in lranks :
+        out.append(linear_apply_tpl.substitute(rank=str(rank),
+            colons=','.join([':' for i in range(1,rank+1)]),
+            vecdim=(', nvec' if rank == 2 else '')))
+        out.append('\n\n')
+
     out.append('\nend module %s\n' % module_name)
 
     return ''.join(out)
@@ -2,6 +2,7 @@
 #include <boost/filesystem.hpp>
 #include <ibmisc/ibmisc.hpp>
 #include <ibmisc/filesystem.hpp>
+#include <ibmisc/parallel.hpp>
 
 namespace ibmisc {
 
@@ -24,4 +25,88 @@ std::string EnvSearchPath::locate(std::string const &file_name) const
         "Cannot locate file %s in path $%s", file_name.c_str(), env_var.c_str());
 }
 
+// -------------------------------------------------------------
+CachedSearchPath::CachedSearchPath(std::string const &_name,
+    std::vector<std::string> const &_path, bool _prescan)
+    : name(_name), path(_path), prescan(_prescan), scanned(false) {}
+
+std::string CachedSearchPath::search(std::string const &file_name) const
+{
+    // Listings only know about plain names in each directory
+    bool const use_listing = prescan && file_name.find('/') == std::string::npos;
+    if (use_listing) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!scanned) {
+            listings.clear();
+            for (auto &dir : path) {
+                listings.push_back(std::unordered_set<std::string>());
+                boost::system::error_code ec;
+                for (boost::filesystem::directory_iterator ii(dir, ec), end;
+                    !ec && ii != end; ii.increment(ec))
+                {
+                    listings.back().insert(ii->path().filename().string());
+                }
+            }
+            scanned = true;
+        }
+        for (size_t i=0; i<path.size(); ++i) {
+            if (listings[i].count(file_name))
+                return (boost::filesystem::path(path[i]) / file_name).string();
+        }
+        return "";
+    }
+
+    for (auto &dir : path) {
+        auto fname(boost::filesystem::path(dir) / file_name);
+        if (boost::filesystem::exists(fname))
+            return fname.string();
+    }
+    return "";
+}
+
+std::string CachedSearchPath::find(std::string const &file_name) const
+{
+    {std::lock_guard<std::mutex> lock(mtx);
+        auto ii(cache.find(file_name));
+        if (ii != cache.end()) return ii->second;
+    }
+
+    // Search outside the lock, so lookups can overlap
+    std::string ret(search(file_name));
+
+    std::lock_guard<std::mutex> lock(mtx);
+    cache.insert(std::make_pair(file_name, ret));
+    return ret;
+}
+
+std::string CachedSearchPath::locate(std::string const &file_name) const
+{
+    std::string ret(find(file_name));
+    if (ret.empty()) (*ibmisc_error)(-1,
+        "Cannot locate file %s in path %s", file_name.c_str(), name.c_str());
+    return ret;
+}
+
+std::vector<std::string> CachedSearchPath::locate(
+    std::vector<std::string> const &file_names, int nthreads) const
+{
+    std::vector<std::string> ret(file_names.size());
+    parallel_for(0, file_names.size(), nthreads, [&](long i0, long i1) {
+        for (long i=i0; i<i1; ++i) ret[i] = find(file_names[i]);
+    });
+    for (size_t i=0; i<ret.size(); ++i) {
+        if (ret[i].empty()) (*ibmisc_error)(-1,
+            "Cannot locate file %s in path %s", file_names[i].c_str(), name.c_str());
+    }
+    return ret;
+}
+
+void CachedSearchPath::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    cache.clear();
+    listings.clear();
+    scanned = false;
+}
+
 }
@@ -3,13 +3,16 @@
 
 #include <vector>
 #include <string>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace ibmisc {
 
 
 struct FileLocator {
     virtual std::string locate(std::string const &file_name) const = 0;
-    ~FileLocator() {}
+    virtual ~FileLocator() {}
 };
 
 /** Locate existing files in a path given by an environnment variable. */
@@ -21,8 +24,51 @@ class EnvSearchPath : public FileLocator {
 public:
     EnvSearchPath(std::string const &_env_var);
 
+    std::string const &name() const { return env_var; }
+    std::vector<std::string> const &dirs() const { return path; }
+
     std::string locate(std::string const &file_name) const;
 };
 
+/** A search path that remembers every lookup, found or not, so each
+name is stat()ed at most once per directory (on Lustre, each stat is a
+metadata RPC).  With prescan, each directory is instead listed once,
+on first use, and plain file names are looked up in the listings.
+
+Thread-safe.  Files created after a failed lookup are not seen until
+clear(). */
+class CachedSearchPath : public FileLocator {
+    std::string const name;    // For error messages
+    std::vector<std::string> const path;
+    bool const prescan;
+
+    mutable std::mutex mtx;
+    mutable std::unordered_map<std::string, std::string> cache;    // "" if not found
+    mutable std::vector<std::unordered_set<std::string>> listings;    // Per dir, if prescan
+    mutable bool scanned;
+
+    /** Uncached lookup; "" if not found */
+    std::string search(std::string const &file_name) const;
+
+public:
+    CachedSearchPath(std::string const &_name,
+        std::vector<std::string> const &_path, bool _prescan = false);
+    CachedSearchPath(EnvSearchPath const &env, bool _prescan = false)
+        : CachedSearchPath("$" + env.name(), env.dirs(), _prescan) {}
+
+    /** @return Full path of the file, or "" if it is not found */
+    std::string find(std::string const &file_name) const;
+
+    /** Like find(), but not finding the file is an error */
+    std::string locate(std::string const &file_name) const;
+
+    /** Locates many files, nthreads at a time */
+    std::vector<std::string> locate(
+        std::vector<std::string> const &file_names, int nthreads = 8) const;
+
+    /** Forgets all lookups and listings */
+    void clear();
+};
+
 }    // namespace ibmisc
 #endif    // IBMISC_FILESYSTEM_HPP
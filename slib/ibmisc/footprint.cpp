@@ -0,0 +1,65 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <ostream>
+#include <sstream>
+#include <ibmisc/footprint.hpp>
+
+namespace ibmisc {
+
+MemoryFootprint &MemoryFootprint::add(MemoryFootprint &&child)
+{
+    bytes += child.bytes;
+    capacity += child.capacity;
+    raw_bytes += child.raw_bytes;
+    children.push_back(std::move(child));
+    return *this;
+}
+
+namespace {
+
+void report_node(std::ostream &os, MemoryFootprint const &node, int depth, int max_depth)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%12zu %12zu %7.2f  %*s%s\n",
+        node.bytes, node.slack(), node.compression_ratio(),
+        2*depth, "", node.name.c_str());
+    os << buf;
+
+    if (max_depth >= 0 && depth >= max_depth) return;
+    for (auto const &child : node.children)
+        report_node(os, child, depth+1, max_depth);
+}
+
+}
+
+void MemoryFootprint::report(std::ostream &os, int max_depth) const
+{
+    os << "       bytes        slack   ratio  name\n";
+    report_node(os, *this, 0, max_depth);
+}
+
+std::string MemoryFootprint::report(int max_depth) const
+{
+    std::stringstream ss;
+    report(ss, max_depth);
+    return ss.str();
+}
+
+}    // namespace
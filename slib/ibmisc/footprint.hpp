@@ -0,0 +1,80 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IBMISC_FOOTPRINT_HPP
+#define IBMISC_FOOTPRINT_HPP
+
+#include <algorithm>
+#include <array>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace ibmisc {
+
+/** Memory used by a container, and by its parts.  Containers report
+this through a memory_footprint() method; a report() shows the tree.
+
+Sizes count heap memory owned by the container (not sizeof() the
+object itself).  Totals are kept up to date as children are add()ed. */
+struct MemoryFootprint {
+    std::string name;
+    size_t bytes;        // In use
+    size_t capacity;     // Allocated; >= bytes
+    size_t raw_bytes;    // Size of the contents uncompressed; == bytes if not compressed
+    std::vector<MemoryFootprint> children;
+
+    explicit MemoryFootprint(std::string const &_name = "",
+        size_t _bytes = 0, size_t _capacity = 0, size_t _raw_bytes = 0)
+    : name(_name), bytes(_bytes), capacity(std::max(_bytes, _capacity)),
+        raw_bytes(_raw_bytes ? _raw_bytes : _bytes) {}
+
+    /** Allocated but not in use */
+    size_t slack() const
+        { return capacity - bytes; }
+
+    /** Uncompressed / compressed size; 1 if not compressed */
+    double compression_ratio() const
+        { return bytes == 0 ? 1.0 : (double)raw_bytes / (double)bytes; }
+
+    /** Adds a part; its sizes are added to ours. */
+    MemoryFootprint &add(MemoryFootprint &&child);
+
+    /** Indented table, one line per node, down to max_depth levels. */
+    void report(std::ostream &os, int max_depth = -1) const;
+    std::string report(int max_depth = -1) const;
+
+    /** Stores the report as a string attribute; works with
+    netCDF::NcVar or NcGroup. */
+    template<class NcAttOwnerT>
+    void put_att(NcAttOwnerT &nc, std::string const &att_name = "memory_footprint") const
+        { nc.putAtt(att_name, report()); }
+};
+
+/** Footprint of a std::vector of plain data */
+template<class T>
+MemoryFootprint vector_footprint(std::string const &name, std::vector<T> const &vec)
+    { return MemoryFootprint(name, vec.size() * sizeof(T), vec.capacity() * sizeof(T)); }
+
+/** Footprint of a compressed buffer, holding raw_bytes of data */
+inline MemoryFootprint compressed_footprint(std::string const &name,
+    std::vector<char> const &buf, size_t raw_bytes)
+    { return MemoryFootprint(name, buf.size(), buf.capacity(), raw_bytes); }
+
+}    // namespace
+#endif    // guard
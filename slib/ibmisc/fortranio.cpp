@@ -1,16 +1,435 @@
 // http://www.eecs.umich.edu/courses/eecs380/HANDOUTS/cppBinaryFileIO-2.html
 #include <ibmisc/fortranio.hpp>
 #include <ibmisc/endian.hpp>
+#include <ibmisc/profile.hpp>
 #include <boost/endian/conversion.hpp>
 #include <ibmisc/endian.hpp>
 #include <iostream>
 #include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace ibmisc {
 namespace fortran {
 
 EndR endr;
 
+// ---------------------------------------------------------------
+/** Reads whole records (with their markers) on a background thread,
+keeping at most nahead of them queued. */
+class Prefetcher {
+    std::string const fname;
+    Endian const endian;
+    size_t const nahead;
+
+    std::mutex mtx;
+    std::condition_variable cv;    // Signalled when queue changes (or stopping)
+    std::deque<std::vector<char>> queue;
+    bool done;        // Thread has reached the end of the file
+    bool stopping;
+    std::thread th;
+
+    void run(long offset);
+
+public:
+    Prefetcher(std::string const &_fname, Endian _endian, int _nahead)
+        : fname(_fname), endian(_endian), nahead(std::max(_nahead, 1))
+        { start(0); }
+    ~Prefetcher() { stop(); }
+
+    std::string const &name() const { return fname; }
+
+    /** Starts reading at byte offset */
+    void start(long offset);
+    void stop();
+
+    /** Next record into rec, waiting if need be.
+    @return false at end of file. */
+    bool next(std::vector<char> &rec);
+};
+
+void Prefetcher::start(long offset)
+{
+    stop();
+    queue.clear();
+    done = false;
+    stopping = false;
+    th = std::thread(&Prefetcher::run, this, offset);
+}
+
+void Prefetcher::stop()
+{
+    if (!th.joinable()) return;
+    {std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    th.join();
+}
+
+void Prefetcher::run(long offset)
+{
+    std::ifstream fin(fname, std::ios::binary | std::ios::in);
+    fin.seekg(offset);
+    try {
+        for (;;) {
+            // Record marker, body and trailer; a short last record is
+            // passed on as-is, for fortran::read() to report.
+            std::vector<char> rec(4);
+            fin.read(&rec[0], 4);
+            if (fin.gcount() < 4) break;
+            uint32_t nbytes;
+            memcpy(&nbytes, &rec[0], 4);
+            endian_to_native((char *)&nbytes, 4, 1, endian);
+            if (nbytes > 0) {
+                rec.resize(8 + (size_t)nbytes);
+                fin.read(&rec[4], 4 + (size_t)nbytes);
+                rec.resize(4 + fin.gcount());
+            }
+
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&]{ return stopping || queue.size() < nahead; });
+            if (stopping) return;
+            queue.push_back(std::move(rec));
+            cv.notify_all();
+            if (nbytes == 0 || !fin) break;    // Terminating record, or EOF
+        }
+    } catch(std::exception const &) {    // eg bad_alloc on a corrupt marker
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    done = true;
+    cv.notify_all();
+}
+
+bool Prefetcher::next(std::vector<char> &rec)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]{ return done || !queue.empty(); });
+    if (queue.empty()) return false;
+    rec.swap(queue.front());
+    queue.pop_front();
+    cv.notify_all();
+    return true;
+}
+
+// ---------------------------------------------------------------
+UnformattedInput::UnformattedInput(std::string const &_fname, ibmisc::Endian _endian, bool use_mmap) :
+    endian(_endian), fname(_fname), map(NULL), map_size(0), pos(0),
+    _eof(false), _fail(false), records_scanned(false)
+{
+    if (!use_mmap) {
+        fin.open(fname, std::ios::binary | std::ios::in);
+        return;
+    }
+
+    int const fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) (*ibmisc_error)(-1,
+        "Cannot open %s: %s", fname.c_str(), strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        (*ibmisc_error)(-1, "Cannot stat %s: %s", fname.c_str(), strerror(errno));
+    }
+    map_size = st.st_size;
+
+    // Private + writable: views may be modified in place without
+    // touching the file (copy-on-write).
+    void *addr = (map_size == 0 ? NULL :
+        mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));
+    ::close(fd);
+    if (addr == MAP_FAILED) (*ibmisc_error)(-1,
+        "Cannot mmap %s: %s", fname.c_str(), strerror(errno));
+    map = (addr ? (char *)addr : (char *)&map);    // Non-NULL even for empty files
+}
+
+UnformattedInput::UnformattedInput(std::string const &_fname, ibmisc::Endian _endian,
+    Prefetch const &_prefetch) :
+    endian(_endian), fname(_fname), map(NULL), map_size(0), pos(0),
+    _eof(false), _fail(false), records_scanned(false)
+{
+    if (access(fname.c_str(), R_OK) != 0) (*ibmisc_error)(-1,
+        "Cannot open %s: %s", fname.c_str(), strerror(errno));
+    prefetch.reset(new Prefetcher(fname, endian, _prefetch.nahead));
+}
+
+UnformattedInput::~UnformattedInput()
+    { close(); }
+
+void UnformattedInput::close()
+{
+    if (prefetch) {
+        prefetch.reset();
+        cur.clear();
+        pos = 0;
+    } else if (map) {
+        if (map_size > 0) munmap(map, map_size);
+        map = NULL;
+        map_size = 0;
+    } else {
+        fin.close();
+    }
+}
+
+void UnformattedInput::set_eof()
+{
+    if (map || prefetch) _eof = true;
+    else fin.setstate(std::ios::eofbit);
+}
+
+void UnformattedInput::stream_bytes(char *buf, size_t nbytes)
+{
+    while (nbytes > 0) {
+        if (pos == cur.size()) {
+            pos = 0;
+            cur.clear();
+            if (!prefetch || !prefetch->next(cur)) {
+                _eof = true;
+                _fail = true;
+                return;
+            }
+        }
+        size_t const n = std::min(nbytes, cur.size() - pos);
+        if (buf) {
+            memcpy(buf, &cur[pos], n);
+            buf += n;
+        }
+        pos += n;
+        nbytes -= n;
+    }
+}
+
+void UnformattedInput::read_bytes(char *buf, size_t nbytes)
+{
+    if (prefetch) {
+        stream_bytes(buf, nbytes);
+        return;
+    }
+    if (!map) {
+        fin.read(buf, nbytes);
+        return;
+    }
+    char const *src = view_bytes(nbytes);
+    if (src) memcpy(buf, src, nbytes);
+}
+
+void UnformattedInput::skip_bytes(size_t nbytes)
+{
+    if (prefetch) {
+        stream_bytes(NULL, nbytes);
+        return;
+    }
+    if (!map) {
+        fin.seekg(nbytes, fin.cur);
+        return;
+    }
+    view_bytes(nbytes);
+}
+
+char *UnformattedInput::view_bytes(size_t nbytes)
+{
+    if (!map) return NULL;
+    if (pos + nbytes > map_size) {
+        pos = map_size;
+        _eof = true;
+        _fail = true;
+        return NULL;
+    }
+    char *ret = map + pos;
+    pos += nbytes;
+    return ret;
+}
+
+std::vector<UnformattedInput::Record> const &UnformattedInput::records()
+{
+    if (records_scanned) return _records;
+
+    // Scan separately, leaving the read-ahead undisturbed
+    if (prefetch) {
+        UnformattedInput scan(prefetch->name(), endian);
+        _records = scan.records();
+        records_scanned = true;
+        return _records;
+    }
+
+    // Remember where we were
+    size_t const pos0 = pos;
+    bool const eof0 = _eof, fail0 = _fail;
+    std::streampos spos0;
+    if (!map) {
+        spos0 = fin.tellg();
+        fin.clear();
+        fin.seekg(0);
+    } else {
+        pos = 0;
+        _eof = _fail = false;
+    }
+
+    // Scan the record markers
+    for (long offset=0;;) {
+        uint32_t nbytes0, nbytes1;
+        read_bytes((char *)&nbytes0, 4);
+        if (fail()) break;
+        endian_to_native((char *)&nbytes0, 4, 1, endian);
+        if (nbytes0 == 0) break;    // Zero-length terminating record
+
+        skip_bytes(nbytes0);
+        read_bytes((char *)&nbytes1, 4);
+        if (fail()) (*ibmisc_error)(-1,
+            "Truncated record at offset %ld", offset);
+        endian_to_native((char *)&nbytes1, 4, 1, endian);
+        if (nbytes0 != nbytes1) (*ibmisc_error)(-1,
+            "Record at offset %ld: nbytes0=%d does not match nbytes1=%d",
+            offset, nbytes0, nbytes1);
+
+        _records.push_back(Record{offset, (long)nbytes0});
+        offset += 8 + nbytes0;
+    }
+
+    // Go back
+    if (!map) {
+        fin.clear();
+        fin.seekg(spos0);
+    } else {
+        pos = pos0;
+        _eof = eof0;
+        _fail = fail0;
+    }
+
+    records_scanned = true;
+    return _records;
+}
+
+void UnformattedInput::seek_record(long irec)
+{
+    auto &recs(records());
+    if (irec < 0 || irec >= (long)recs.size()) (*ibmisc_error)(-1,
+        "Record %ld out of range [0, %ld)", irec, (long)recs.size());
+
+    if (prefetch) {
+        prefetch->start(recs[irec].offset);
+        cur.clear();
+        pos = 0;
+        _eof = _fail = false;
+    } else if (map) {
+        pos = recs[irec].offset;
+        _eof = _fail = false;
+    } else {
+        fin.clear();
+        fin.seekg(recs[irec].offset);
+    }
+}
+
+// ---------------------------------------------------------------
+// Sidecar record index: a header identifying the file it indexes,
+// then the records.  Native byte order; it is a cache, not data.
+
+namespace {
+
+char const idx_magic[8] = {'I','B','F','I','D','X','0','1'};
+
+struct IndexHeader {
+    char magic[8];
+    int64_t size;     // Of the indexed file
+    int64_t mtime;    // Of the indexed file (seconds)
+    int32_t endian;
+    int32_t pad;
+    int64_t nrec;
+};
+
+bool stat_header(std::string const &fname, Endian endian, IndexHeader &hdr)
+{
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0) return false;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, idx_magic, sizeof(idx_magic));
+    hdr.size = st.st_size;
+    hdr.mtime = st.st_mtime;
+    hdr.endian = (int32_t)endian;
+    return true;
+}
+
+}    // anonymous namespace
+
+bool UnformattedInput::load_index(std::string const &idx_fname)
+{
+    std::string const iname(idx_fname.empty() ? fname + ".idx" : idx_fname);
+    IndexHeader want, hdr;
+    if (!stat_header(fname, endian, want)) return false;
+
+    std::ifstream fidx(iname, std::ios::binary | std::ios::in);
+    if (!fidx.read((char *)&hdr, sizeof(hdr))) return false;
+    if (memcmp(hdr.magic, want.magic, sizeof(hdr.magic)) != 0
+        || hdr.size != want.size || hdr.mtime != want.mtime
+        || hdr.endian != want.endian || hdr.nrec < 0) return false;
+
+    std::vector<Record> recs(hdr.nrec);
+    std::vector<int64_t> buf(2*hdr.nrec);
+    if (hdr.nrec > 0 && !fidx.read((char *)&buf[0], buf.size() * sizeof(int64_t)))
+        return false;
+    for (long i=0; i<hdr.nrec; ++i) {
+        recs[i] = Record{(long)buf[2*i], (long)buf[2*i+1]};
+        if (recs[i].offset < 0 || recs[i].offset + 8 + recs[i].nbytes > hdr.size)
+            return false;
+    }
+
+    _records = std::move(recs);
+    records_scanned = true;
+    return true;
+}
+
+bool UnformattedInput::save_index(std::string const &idx_fname)
+{
+    std::string const iname(idx_fname.empty() ? fname + ".idx" : idx_fname);
+    auto const &recs(records());
+    IndexHeader hdr;
+    if (!stat_header(fname, endian, hdr)) return false;
+    hdr.nrec = recs.size();
+
+    std::vector<int64_t> buf;
+    buf.reserve(2*recs.size());
+    for (auto const &rec : recs) {
+        buf.push_back(rec.offset);
+        buf.push_back(rec.nbytes);
+    }
+
+    // Write to a temporary name, then rename: readers never see a
+    // partial index.
+    std::string const tmp_name(iname + ".tmp" + std::to_string(getpid()));
+    {std::ofstream fidx(tmp_name, std::ios::binary | std::ios::out | std::ios::trunc);
+        fidx.write((char const *)&hdr, sizeof(hdr));
+        if (!buf.empty()) fidx.write((char const *)&buf[0], buf.size() * sizeof(int64_t));
+        fidx.close();
+        if (!fidx) {
+            ::unlink(tmp_name.c_str());
+            return false;
+        }
+    }
+    if (::rename(tmp_name.c_str(), iname.c_str()) != 0) {
+        ::unlink(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool UnformattedInput::use_index(std::string const &idx_fname)
+{
+    if (load_index(idx_fname)) return true;
+    records();
+    save_index(idx_fname);
+    return false;
+}
+
+// ---------------------------------------------------------------
+
 
 SimpleBufSpec::SimpleBufSpec(char *_buf, int _item_size, long _nitem)
     : BufSpec(_item_size*_nitem), item_size(_item_size), nitem(_nitem), buf(_buf) {}
@@ -18,7 +437,7 @@ void SimpleBufSpec::read(UnformattedInput &infile)
 {
     // Read into the buffer
     size_t nbytes = item_size * nitem;
-    infile.fin.read(buf, nbytes);
+    infile.read_bytes(buf, nbytes);
 
      // Swap for endian
     endian_to_native(buf, item_size, nitem, infile.endian);
@@ -30,18 +449,19 @@ void SimpleBufSpec::read(UnformattedInput &infile)
 //template<class IStreamT>
 void read::operator>>(EndR const &endr)
 {
+    IBMISC_SCOPED_TIMER("fortran::read");
     // Read header
     uint32_t nbytes0;
-    infile->fin.read((char *)&nbytes0, 4);
+    infile->read_bytes((char *)&nbytes0, 4);
     if (infile->endian == ibmisc::Endian::BIG) {
         boost::endian::big_to_native_inplace(nbytes0);
     } else {
         boost::endian::little_to_native_inplace(nbytes0);
     }
     // Some GISS files terminate with a zero-length record.
-    if (nbytes0 == 0) infile->fin.setstate(std::ios::eofbit);
+    if (nbytes0 == 0) infile->set_eof();
     if (infile->eof()) return;    // We're done, user must check for EOF
-    if (infile->fin.fail()) (*ibmisc_error)(-1,
+    if (infile->fail()) (*ibmisc_error)(-1,
         "Error reading nbytes0\n");
 
     // Set wildcard spec sizes
@@ -65,27 +485,105 @@ void read::operator>>(EndR const &endr)
         // Read the bodies
         for (auto &spec : specs) {
             spec->read(*infile);
-            if (infile->fin.fail()) (*ibmisc_error)(-1,
+            if (infile->fail()) (*ibmisc_error)(-1,
                 "Error reading into a buffer");
         }
     } else {
         // Skip past this record
-        infile->fin.seekg(nbytes0, infile->fin.cur);
+        infile->skip_bytes(nbytes0);
     }
 
     // Read trailer
     uint32_t nbytes1;
-    infile->fin.read((char *)&nbytes1, 4);
+    infile->read_bytes((char *)&nbytes1, 4);
     if (infile->endian == ibmisc::Endian::BIG) {
         boost::endian::big_to_native_inplace(nbytes1);
     } else {
         boost::endian::little_to_native_inplace(nbytes1);
     }
-    if (infile->fin.fail()) (*ibmisc_error)(-1,
+    if (infile->fail()) (*ibmisc_error)(-1,
         "Error reading nbytes1\n");
     if (nbytes0 != nbytes1) (*ibmisc_error)(-1,
         "Record nbytes0=%d does not match nbytes1=%d", nbytes0, nbytes1);
 }
 
+// ---------------------------------------------------------------
+UnformattedOutput::UnformattedOutput(std::string const &fname, ibmisc::Endian _endian,
+    size_t bufsize) :
+    endian(_endian), buf(std::max(bufsize, (size_t)8)), len(0),
+    swap((_endian == Endian::BIG) != (boost::endian::order::native == boost::endian::order::big))
+{
+    fout.open(fname, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!fout) (*ibmisc_error)(-1,
+        "Cannot open %s for writing: %s", fname.c_str(), strerror(errno));
+}
+
+UnformattedOutput::~UnformattedOutput()
+    { close(); }
+
+void UnformattedOutput::flush()
+{
+    if (len == 0) return;
+    fout.write(&buf[0], len);
+    len = 0;
+    if (fout.fail()) (*ibmisc_error)(-1,
+        "Error writing Fortran file: %s", strerror(errno));
+}
+
+void UnformattedOutput::close()
+{
+    if (!fout.is_open()) return;
+    flush();
+    fout.close();
+}
+
+void UnformattedOutput::write_bytes(char const *src, size_t nbytes)
+{
+    // Big writes skip the buffer
+    if (nbytes >= buf.size()) {
+        flush();
+        fout.write(src, nbytes);
+        return;
+    }
+    if (len + nbytes > buf.size()) flush();
+    memcpy(&buf[len], src, nbytes);
+    len += nbytes;
+}
+
+void UnformattedOutput::write_items(char const *src, int item_size, long nitem)
+{
+    if (!swap || item_size == 1) {
+        write_bytes(src, item_size * nitem);
+        return;
+    }
+    while (nitem > 0) {
+        long const n = std::min(nitem, (long)((buf.size() - len) / item_size));
+        if (n == 0) {
+            flush();
+            continue;
+        }
+        memcpy(&buf[len], src, n * item_size);
+        len += n * item_size;
+        to_file_endian(item_size, n);
+        src += n * item_size;
+        nitem -= n;
+    }
+}
+
+void write::operator<<(EndR const &endr)
+{
+    IBMISC_SCOPED_TIMER("fortran::write");
+    long total = 0;
+    for (auto &spec : specs) total += spec->nbytes;
+    if (total > INT32_MAX) (*ibmisc_error)(-1,
+        "Fortran record of %ld bytes is too long (max 2GB)", total);
+
+    int32_t const nbytes = total;
+    outfile->write_items((char const *)&nbytes, 4, 1);
+    for (auto &spec : specs) spec->write(*outfile);
+    outfile->write_items((char const *)&nbytes, 4, 1);
+    if (outfile->fail()) (*ibmisc_error)(-1,
+        "Error writing Fortran record");
+}
 
 }}
@@ -5,9 +5,14 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
 
+#include <boost/endian/conversion.hpp>
 #include <ibmisc/blitz.hpp>
 #include <ibmisc/error.hpp>
 #include <ibmisc/endian.hpp>
@@ -16,19 +21,104 @@
 namespace ibmisc {
 namespace fortran {
 
+class Prefetcher;
+
+/** Selects the read-ahead UnformattedInput constructor */
+struct Prefetch {
+    int nahead;    // Max. records read ahead
+    explicit Prefetch(int _nahead = 2) : nahead(_nahead) {}
+};
+
+/** An unformatted Fortran file, open for reading.
+
+By default reads through std::ifstream.  If opened with use_mmap,
+the file is instead mapped into memory: reads become memcpy()s out of
+the mapping, and native-endian arrays can be viewed in place with
+fortran::view() (no copy at all).
+
+If opened with Prefetch, a background thread reads up to nahead
+whole records ahead of the one being consumed, so the file system's
+latency overlaps with the caller's work on each record.
+
+In any mode, records() scans the record markers once, after which
+seek_record() jumps straight to any record.  use_index() saves that
+scan in a sidecar file, so later runs on the same (unchanged) file
+skip it. */
 struct UnformattedInput {
     std::ifstream fin;
     Endian const endian;
     TmpAlloc tmp;
 
-    UnformattedInput(std::string const &fname, ibmisc::Endian _endian) :
-        fin(fname, std::ios::binary | std::ios::in),
-        endian(_endian) {}
+    /** Location of one record in the file */
+    struct Record {
+        long offset;    // Of the leading record marker
+        long nbytes;    // Of the record body
+    };
+
+private:
+    std::string const fname;
 
-    void close() { fin.close(); }
+    // mmap mode
+    char *map;          // NULL if not in mmap mode
+    size_t map_size;
+    size_t pos;         // Current read position in map (or in cur)
+    bool _eof, _fail;   // mmap and Prefetch modes
 
-    bool eof() const { return fin.eof(); }
+    // Prefetch mode
+    std::unique_ptr<Prefetcher> prefetch;
+    std::vector<char> cur;    // Record being consumed, with its markers
 
+    /** Prefetch mode: copies (or skips, if buf==NULL) nbytes */
+    void stream_bytes(char *buf, size_t nbytes);
+
+    std::vector<Record> _records;
+    bool records_scanned;
+
+public:
+    UnformattedInput(std::string const &fname, ibmisc::Endian _endian, bool use_mmap = false);
+    UnformattedInput(std::string const &fname, ibmisc::Endian _endian, Prefetch const &_prefetch);
+    ~UnformattedInput();
+
+    void close();
+
+    bool eof() const { return (map || prefetch) ? _eof : fin.eof(); }
+    bool fail() const { return (map || prefetch) ? _fail : fin.fail(); }
+    bool is_mmap() const { return map != NULL; }
+
+    /** Marks end of file (eg on a zero-length terminating record) */
+    void set_eof();
+
+    /** Low-level: read raw bytes at the current position */
+    void read_bytes(char *buf, size_t nbytes);
+    /** Low-level: skip raw bytes at the current position */
+    void skip_bytes(size_t nbytes);
+    /** Low-level (mmap mode only): returns a pointer to the next
+    nbytes of the mapping and advances past them; NULL if not in
+    mmap mode or past EOF.  Valid until the file is closed. */
+    char *view_bytes(size_t nbytes);
+
+    /** Index of all records in the file, built (on first call) by
+    scanning the record markers. */
+    std::vector<Record> const &records();
+    long nrecords() { return records().size(); }
+
+    /** Positions the file so the next fortran::read() reads record
+    irec (0-based). */
+    void seek_record(long irec);
+
+    /** Loads the record index from a sidecar file (by default,
+    fname + ".idx"); or if that is missing or stale (the file's size
+    or mtime have changed), scans the file and tries to save a new
+    one.  Failure to save (eg a read-only directory) is not an error.
+    @return true if the index was loaded rather than scanned. */
+    bool use_index(std::string const &idx_fname = "");
+
+    /** Loads the sidecar index, if it is valid for this file.
+    @return false (and changes nothing) otherwise. */
+    bool load_index(std::string const &idx_fname = "");
+    /** Writes records() to a sidecar index.
+    @return false if it could not be written. */
+    bool save_index(std::string const &idx_fname = "");
 };
 
 
@@ -218,6 +308,57 @@ BufSpecPtr allocate(
     blitz::GeneralArrayStorage<RANK> const &_storage = blitz::fortranArray)
 { return BufSpecPtr(new ArrayBuf<TypeT,RANK>(&_buf, NULL, &_stdshapes, _storage)); }
 
+// ---------------------------------------------------------------------
+/** Reads an array of known shape.  If the file is memory-mapped and
+the data are native-endian and suitably aligned, buf is set to point
+straight into the mapping (no copy); it is then valid only as long as
+the UnformattedInput stays open.  Otherwise, buf is allocated and
+the data copied in. */
+template<class TypeT, int RANK>
+struct ArrayView : public BufSpec {
+    blitz::Array<TypeT,RANK> *buf;
+    blitz::TinyVector<int,RANK> const shape;
+    blitz::GeneralArrayStorage<RANK> const storage;
+
+    ArrayView(
+        blitz::Array<TypeT,RANK> *_buf,
+        blitz::TinyVector<int,RANK> const &_shape,
+        blitz::GeneralArrayStorage<RANK> const &_storage)
+    : BufSpec(blitz::product(_shape) * sizeof(TypeT)),
+        buf(_buf), shape(_shape), storage(_storage) {}
+
+    void read(UnformattedInput &infile);
+};
+
+template<class TypeT, int RANK>
+void ArrayView<TypeT,RANK>::read(UnformattedInput &infile)
+{
+    bool const native = (infile.endian == Endian::BIG) ==
+        (boost::endian::order::native == boost::endian::order::big);
+
+    char *p = infile.view_bytes(nbytes);
+    if (infile.is_mmap() && !p) return;    // Caller reports the error
+    if (p && (native || sizeof(TypeT) == 1) && (uintptr_t)p % alignof(TypeT) == 0) {
+        buf->reference(blitz::Array<TypeT,RANK>(
+            (TypeT *)p, shape, blitz::neverDeleteData, storage));
+        return;
+    }
+
+    buf->reference(blitz::Array<TypeT,RANK>(shape, storage));
+    char *dest = (char *)buf->dataFirst();
+    if (p) memcpy(dest, p, nbytes);
+    else infile.read_bytes(dest, nbytes);
+    endian_to_native(dest, sizeof(TypeT), buf->size(), infile.endian);
+}
+
+/** Reads an array, zero-copy if possible; see ArrayView. */
+template<class TypeT, int RANK>
+BufSpecPtr view(
+    blitz::Array<TypeT,RANK> &_buf,
+    blitz::TinyVector<int,RANK> const &_shape,
+    blitz::GeneralArrayStorage<RANK> const &_storage = blitz::fortranArray)
+{ return BufSpecPtr(new ArrayView<TypeT,RANK>(&_buf, _shape, _storage)); }
+
 // ============================================================================
 // ---------------------------------------------------------------------
 /** Wrap double arrays in this when we want to read into a float. */
@@ -256,6 +397,24 @@ public:
 template<class SrcT, class DestT, int RANK>
 void BlitzCast<SrcT, DestT, RANK>::read(UnformattedInput &infile)
 {
+    // Fast path: read, swap and cast straight into dest a chunk at a
+    // time, without staging the whole record in a SrcT array.
+    bool ascending = true;
+    for (int i=0; i<RANK; ++i) ascending = ascending && dest->isRankStoredAscending(i);
+    if (!subbuf->wildcard && ascending && dest->isStorageContiguous()) {
+        long const chunk_items = (1L<<16) / sizeof(SrcT);
+        long const n = dest->size();
+        std::vector<char> chunk(std::min(n, chunk_items) * sizeof(SrcT));
+        DestT *out = dest->dataFirst();
+        for (long i=0; i<n; i += chunk_items) {
+            long const m = std::min(n - i, chunk_items);
+            infile.read_bytes(&chunk[0], m * sizeof(SrcT));
+            if (infile.fail()) return;    // Caller reports the error
+            endian_cast<SrcT,DestT>(&chunk[0], out + i, m, infile.endian);
+        }
+        return;
+    }
+
     subbuf->read(infile);
 
     if (subbuf->wildcard) {
@@ -307,6 +466,179 @@ public:
     void operator>>(EndR const &endr);
 };
 
+/** Reads record irec (0-based), wherever the file is positioned:
+
+    fortran::read_record(fin, 3) >> str0 >> data >> fortran::endr;
+
+Combine with UnformattedInput::use_index() to avoid the initial scan. */
+inline read read_record(UnformattedInput &infile, long irec)
+{
+    infile.seek_record(irec);
+    return read(infile);
+}
+
+// ============================================================================
+/** An unformatted Fortran file, open for writing.  Output goes
+through one large buffer: payloads are copied (or cast) into it and
+converted to the file's byte order there with swap_bytes(), so
+writing needs no temporary arrays and few system calls.
+
+Example:
+
+    fortran::UnformattedOutput fout("topo", Endian::BIG);
+    blitz::Array<double,2> zatmo(...);
+    std::array<char,80> title;
+    fortran::write(fout) << title
+        << fortran::write_cast<float>(zatmo) << fortran::endr;
+*/
+struct UnformattedOutput {
+    std::ofstream fout;
+    Endian const endian;
+private:
+    std::vector<char> buf;
+    size_t len;    // Bytes of buf in use
+    bool const swap;    // File is not native-endian
+
+    /** Swaps the last nitem items in buf, if needed */
+    void to_file_endian(int item_size, long nitem)
+        { if (swap && item_size > 1) swap_bytes(&buf[len - item_size*nitem], item_size, nitem); }
+
+public:
+    UnformattedOutput(std::string const &fname, ibmisc::Endian _endian,
+        size_t bufsize = 1<<20);
+    ~UnformattedOutput();
+
+    /** Writes out the buffer */
+    void flush();
+    void close();
+
+    bool fail() const { return fout.fail(); }
+
+    /** Low-level: writes raw bytes */
+    void write_bytes(char const *src, size_t nbytes);
+
+    /** Low-level: writes native-endian items, in the file's byte order
+    @param item_size 1, 2, 4 or 8 */
+    void write_items(char const *src, int item_size, long nitem);
+
+    /** Low-level: writes nitem items from src (a pointer or iterator),
+    each cast to DestT, in the file's byte order */
+    template<class DestT, class IterT>
+    void write_cast(IterT src, long nitem);
+};
+
+template<class DestT, class IterT>
+void UnformattedOutput::write_cast(IterT src, long nitem)
+{
+    while (nitem > 0) {
+        long n = std::min(nitem, (long)((buf.size() - len) / sizeof(DestT)));
+        if (n == 0) {
+            flush();
+            continue;
+        }
+        for (long i=0; i<n; ++i, ++src) {
+            DestT const val = (DestT)*src;
+            memcpy(&buf[len + i*sizeof(DestT)], &val, sizeof(DestT));    // May be unaligned
+        }
+        len += n * sizeof(DestT);
+        to_file_endian(sizeof(DestT), n);
+        nitem -= n;
+    }
+}
+
+/** Something to be written as (part of) a record */
+struct OutSpec {
+    long const nbytes;
+
+    OutSpec(long _nbytes) : nbytes(_nbytes) {}
+    virtual ~OutSpec() {}
+    virtual void write(UnformattedOutput &outfile) = 0;
+};
+
+struct SimpleOutSpec : public OutSpec {
+    char const * const buf;
+    int const item_size;    // 1, 2, 4, 8
+    long const nitem;
+
+    SimpleOutSpec(char const *_buf, int _item_size, long _nitem)
+        : OutSpec(_item_size*_nitem), buf(_buf), item_size(_item_size), nitem(_nitem) {}
+    void write(UnformattedOutput &outfile)
+        { outfile.write_items(buf, item_size, nitem); }
+};
+
+/** Writes a blitz::Array in memory order, cast to DestT */
+template<class SrcT, class DestT, int RANK>
+struct BlitzCastOut : public OutSpec {
+    blitz::Array<SrcT,RANK> const arr;    // Shares memory with the caller's
+
+    BlitzCastOut(blitz::Array<SrcT,RANK> const &_arr)
+        : OutSpec(_arr.size() * sizeof(DestT)), arr(_arr) {}
+
+    void write(UnformattedOutput &outfile);
+};
+
+template<class SrcT, class DestT, int RANK>
+void BlitzCastOut<SrcT,DestT,RANK>::write(UnformattedOutput &outfile)
+{
+    bool ascending = true;
+    for (int i=0; i<RANK; ++i) ascending = ascending && arr.isRankStoredAscending(i);
+    if (ascending && arr.isStorageContiguous()) {
+        SrcT const *src = arr.dataFirst();
+        if (std::is_same<SrcT,DestT>::value) {
+            outfile.write_items((char const *)src, sizeof(SrcT), arr.size());
+        } else {
+            outfile.write_cast<DestT>(src, arr.size());
+        }
+    } else {
+        outfile.write_cast<DestT>(arr.begin(), arr.size());
+    }
+}
+
+/** Implicit conversions for fortran::write */
+struct OutSpecPtr : public std::unique_ptr<OutSpec>
+{
+    typedef std::unique_ptr<OutSpec> super;
+
+    OutSpecPtr(OutSpec *spec) : super(spec) {}
+
+    template<class TypeT, int RANK>
+    OutSpecPtr(blitz::Array<TypeT,RANK> const &arr)
+        : super(new BlitzCastOut<TypeT,TypeT,RANK>(arr)) {}
+
+    template<class TypeT, size_t SIZE>
+    OutSpecPtr(std::array<TypeT, SIZE> const &arr)
+        : super(new SimpleOutSpec((char const *)&arr[0], sizeof(TypeT), arr.size())) {}
+
+    OutSpecPtr(float const &val)
+        : super(new SimpleOutSpec((char const *)&val, sizeof(float), 1)) {}
+    OutSpecPtr(int const &val)
+        : super(new SimpleOutSpec((char const *)&val, sizeof(int), 1)) {}
+    OutSpecPtr(double const &val)
+        : super(new SimpleOutSpec((char const *)&val, sizeof(double), 1)) {}
+};
+
+/** Writes arr with each element cast to DestT (eg double -> float) */
+template<class DestT, class SrcT, int RANK>
+OutSpecPtr write_cast(blitz::Array<SrcT,RANK> const &arr)
+    { return OutSpecPtr(new BlitzCastOut<SrcT,DestT,RANK>(arr)); }
+
+class write {
+    UnformattedOutput *outfile;
+    std::vector<std::unique_ptr<OutSpec>> specs;
+
+public:
+    write(UnformattedOutput &_outfile) : outfile(&_outfile) {}
+
+    write &operator<<(OutSpecPtr &&specp)
+    {
+        specs.push_back(std::move(specp));
+        return *this;
+    }
+
+    /** Writes the record */
+    void operator<<(EndR const &endr);
+};
+
 // -------------------------------------------------------
 /** Trims trailing whitespace.  Returns a new string, because
 that is how Fortran's TRIM() works. */
@@ -17,6 +17,8 @@
  */
 
 #include <cmath>
+#include <algorithm>
+#include <ibmisc/geodesy.hpp>
 
 namespace ibmisc {
 
@@ -46,4 +48,86 @@ double lon2_deg, double lat2_deg)
         return c * R2D;         // Convert to degrees
 }
 
+SpherePoints::SpherePoints(long n, double const *lon_deg, double const *lat_deg)
+    : x(n), y(n), z(n)
+{
+    for (long i=0; i<n; ++i) {
+        double const lon = lon_deg[i] * D2R;
+        double const lat = lat_deg[i] * D2R;
+        double const coslat = cos(lat);
+        x[i] = coslat * cos(lon);
+        y[i] = coslat * sin(lon);
+        z[i] = sin(lat);
+    }
+}
+
+/** Distances from (x1,y1,z1) to n points.  Half the chord length c/2
+between two unit vectors is the square root of the haversine of their
+angle; so the angle is 2*asin(c/2).  The chord is computed from
+coordinate differences, which stays accurate for nearby points.
+Results agree with haversine_distance() to ~1e-11 degrees, and are
+more accurate near antipodes. */
+static void chord_distance(
+double x1, double y1, double z1,
+long n, double const *x2, double const *y2, double const *z2,
+double *out)
+{
+    // Vectorizable pass: half chord length
+    for (long j=0; j<n; ++j) {
+        double const dx = x1 - x2[j];
+        double const dy = y1 - y2[j];
+        double const dz = z1 - z2[j];
+        out[j] = .5 * sqrt(dx*dx + dy*dy + dz*dz);
+    }
+    for (long j=0; j<n; ++j) {
+        double h = out[j];
+        if (h < .7) {
+            out[j] = 2. * asin(h) * R2D;
+        } else {
+            // asin() is ill-conditioned near 1; use the antipode instead
+            double const sx = x1 + x2[j];
+            double const sy = y1 + y2[j];
+            double const sz = z1 + z2[j];
+            h = .5 * sqrt(sx*sx + sy*sy + sz*sz);
+            out[j] = (M_PI - 2. * asin(std::min(h, 1.0))) * R2D;
+        }
+    }
+}
+
+extern void sphere_distance(
+SpherePoints const &p1, long i,
+SpherePoints const &p2, double *out)
+{
+    chord_distance(p1.x[i], p1.y[i], p1.z[i],
+        p2.size(), &p2.x[0], &p2.y[0], &p2.z[0], out);
+}
+
+extern void sphere_distance(
+SpherePoints const &p1,
+SpherePoints const &p2, double *out)
+{
+    long const n2 = p2.size();
+    for (long i=0; i<p1.size(); ++i) sphere_distance(p1, i, p2, out + i*n2);
+}
+
+extern void haversine_distance(
+double lon1_deg, double lat1_deg,
+long n2, double const *lon2_deg, double const *lat2_deg,
+double *out)
+{
+    SpherePoints const p1(1, &lon1_deg, &lat1_deg);
+    SpherePoints const p2(n2, lon2_deg, lat2_deg);
+    sphere_distance(p1, 0, p2, out);
+}
+
+extern void haversine_distance(
+long n1, double const *lon1_deg, double const *lat1_deg,
+long n2, double const *lon2_deg, double const *lat2_deg,
+double *out)
+{
+    SpherePoints const p1(n1, lon1_deg, lat1_deg);
+    SpherePoints const p2(n2, lon2_deg, lat2_deg);
+    sphere_distance(p1, p2, out);
+}
+
 }
@@ -18,11 +18,54 @@
 
 #pragma once
 
+#include <vector>
+
 namespace ibmisc {
 
 double haversine_distance(
 double lon1_deg, double lat1_deg,
 double lon2_deg, double lat2_deg);
 
+/** A set of points, stored as unit vectors on the sphere.  Computing
+them costs the trigonometry once per point; distances between
+SpherePoints then need only a (vectorizable) squared chord length and
+one asin() per pair. */
+struct SpherePoints {
+    std::vector<double> x, y, z;
+
+    SpherePoints() {}
+
+    /** @param lon_deg, lat_deg Point locations (degrees) */
+    SpherePoints(long n, double const *lon_deg, double const *lat_deg);
+
+    long size() const { return x.size(); }
+};
+
+/** Great circle distance (in degrees) from point i of p1 to every point of p2.
+@param out Output; out[j] is the distance to p2 point j */
+extern void sphere_distance(
+SpherePoints const &p1, long i,
+SpherePoints const &p2, double *out);
+
+/** Great circle distance (in degrees) between all pairs of points.
+@param out Output; out[i*p2.size() + j] is the distance from p1 point i to p2 point j */
+extern void sphere_distance(
+SpherePoints const &p1,
+SpherePoints const &p2, double *out);
+
+/** One-to-many version of haversine_distance().
+@param out Output; out[j] is the distance to (lon2_deg[j], lat2_deg[j]) */
+extern void haversine_distance(
+double lon1_deg, double lat1_deg,
+long n2, double const *lon2_deg, double const *lat2_deg,
+double *out);
+
+/** Many-to-many version of haversine_distance().
+@param out Output; out[i*n2 + j] is the distance from point i to point j */
+extern void haversine_distance(
+long n1, double const *lon1_deg, double const *lat1_deg,
+long n2, double const *lon2_deg, double const *lat2_deg,
+double *out);
+
 }
 
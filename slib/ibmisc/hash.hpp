@@ -18,33 +18,118 @@
 
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
-#ifdef USE_BOOST
-#include <boost/functional/hash.hpp>
-#endif
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
-/**@file std::hash<std::pair<>> is defined in "namespace std" to fix a shortcoming in C++.
+/**@file Fast, well-mixed hashing of composite keys: std::pair<>,
+std::tuple<> and std::array<>, as used for multi-dimensional grid
+indices.  std::hash<> is specialized for those in "namespace std", to
+fix a shortcoming in C++; ibmisc::Hash<> also mixes plain integers (the
+identity std::hash<int> clusters badly in power-of-two tables).
 
 @see: http://stackoverflow.com/questions/7222143/unordered-map-hash-function-c
 */
+namespace ibmisc {
+
+/** Avalanching finalizer of one 64-bit word, in the style of wyhash:
+one 64x64->128 multiply of the word by its rotation, folding the high
+half into the low.  Both the top bits (as taken by FlatIndexMap) and
+the low bits (power-of-two tables) are good, even for keys with
+power-of-two strides.  (A multiply by a constant is not: it leaves
+i*1024 + j clustered.) */
+inline uint64_t hash_mix(uint64_t x)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t const r = (__uint128_t)(x ^ 0x2d358dccaa6c78a5ull)
+        * (((x >> 32) | (x << 32)) ^ 0x8bb84b93962eacc9ull);
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    // Finalizer of splitmix64
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+#endif
+}
+
+/** Folds hash h into seed; order-dependent, so (i,j) and (j,i) differ. */
+inline uint64_t hash_combine(uint64_t seed, uint64_t h)
+    { return hash_mix(seed ^ (h * 0x9e3779b97f4a7c15ull)); }
+
+/** Hash functor for unordered containers.  Integers (and enums) are
+mixed with hash_mix(); pairs, tuples and arrays are hashed element by
+element with hash_combine(); anything else goes through std::hash<>,
+then hash_mix(). */
+template<class T, class Enable = void>
+struct Hash {
+    size_t operator()(T const &v) const
+        { return (size_t)hash_mix(std::hash<T>()(v)); }
+};
+
+template<class T>
+struct Hash<T, typename std::enable_if<
+    std::is_integral<T>::value || std::is_enum<T>::value>::type>
+{
+    size_t operator()(T const &v) const
+        { return (size_t)hash_mix((uint64_t)v); }
+};
+
+namespace _hash {
+    template<class TupleT, size_t I = 0,
+        bool DONE = (I == std::tuple_size<TupleT>::value)>
+    struct FoldTuple {
+        static uint64_t apply(uint64_t seed, TupleT const &v)
+        {
+            typedef typename std::decay<typename std::tuple_element<I,TupleT>::type>::type ElT;
+            return FoldTuple<TupleT,I+1>::apply(
+                hash_combine(seed, Hash<ElT>()(std::get<I>(v))), v);
+        }
+    };
+    template<class TupleT, size_t I>
+    struct FoldTuple<TupleT, I, true> {
+        static uint64_t apply(uint64_t seed, TupleT const &v) { return seed; }
+    };
+}    // namespace _hash
+
+template<class S, class T>
+struct Hash<std::pair<S,T>> {
+    size_t operator()(std::pair<S,T> const &v) const
+        { return (size_t)hash_combine(Hash<S>()(v.first), Hash<T>()(v.second)); }
+};
+
+template<class... Ts>
+struct Hash<std::tuple<Ts...>> {
+    size_t operator()(std::tuple<Ts...> const &v) const
+        { return (size_t)_hash::FoldTuple<std::tuple<Ts...>>::apply(0, v); }
+};
+
+template<class T, size_t N>
+struct Hash<std::array<T,N>> {
+    size_t operator()(std::array<T,N> const &v) const
+    {
+        uint64_t seed = N;
+        for (size_t i=0; i<N; ++i) seed = hash_combine(seed, Hash<T>()(v[i]));
+        return (size_t)seed;
+    }
+};
+
+}    // namespace ibmisc
+
 namespace std
 {
   /** Used to hash elements of type std::pair<>.  This should have been
   in the standard C++11
   @see: http://stackoverflow.com/questions/7222143/unordered-map-hash-function-c */
   template<typename S, typename T> struct hash<pair<S, T>>
-  {
-    inline size_t operator()(const pair<S, T> & v) const
-#ifdef USE_BOOST
-    {
-      size_t seed = 0;
-      boost::hash_combine(seed, v.first);
-      boost::hash_combine(seed, v.second);
-      return seed;
-    }
-#else
-    { return std::hash<S>()(v.first)*31 + std::hash<T>()(v.second); }
-#endif
+    : public ibmisc::Hash<pair<S, T>> {};
+
+  template<typename... Ts> struct hash<tuple<Ts...>>
+    : public ibmisc::Hash<tuple<Ts...>> {};
 
-  };
+  template<typename T, size_t N> struct hash<array<T, N>>
+    : public ibmisc::Hash<array<T, N>> {};
 }
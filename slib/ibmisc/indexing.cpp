@@ -116,6 +116,22 @@ Domain::Domain(std::vector<long> const &_begin, std::vector<long> const &_end)
 
 
 
+std::vector<size_t> Domain::nc_start(std::vector<int> const &b2n, int nc_rank) const
+{
+    if ((int)b2n.size() != rank()) (*ibmisc_error)(-1,
+        "Domain::nc_start(): b2n has %ld entries, but the domain has rank %d",
+        (long)b2n.size(), rank());
+
+    std::vector<size_t> ret(nc_rank, 0);
+    for (int i=0; i<rank(); ++i) {
+        if (b2n[i] < 0 || b2n[i] >= nc_rank) (*ibmisc_error)(-1,
+            "Domain::nc_start(): b2n[%d]=%d is out of range (0--%d)",
+            i, b2n[i], nc_rank);
+        ret[b2n[i]] = (*this)[i].begin;
+    }
+    return ret;
+}
+
 void Domain::ncio(
     NcIO &ncio,
     std::string const &vname)
@@ -152,6 +168,17 @@ bool in_domain(
     return domain->in_domain(tuple);
 }
 
+std::vector<IndexRun> domain_runs(
+    Domain const &domain,
+    Indexing const &indexing)
+{
+    std::vector<IndexRun> runs;
+    for_each_run(domain, indexing, [&runs](long begin, long end) {
+        runs.push_back(IndexRun(begin, end));
+    });
+    return runs;
+}
+
 // ====================================================
 /** Adds the dimensions specified by indexing to a NcDimSpec.
 @param permutation Permutation to apply to dims from indexing.
@@ -19,12 +19,19 @@
 #ifndef IBMISC_INDEXING
 #define IBMISC_INDEXING
 
+#include <algorithm>
+#include <array>
+#include <vector>
 #include <ibmisc/netcdf.hpp>
+#include <ibmisc/math.hpp>
+#include <ibmisc/blitz_alloc.hpp>
+#include <ibmisc/transpose.hpp>
 
 namespace ibmisc {
 
 
 class Indexing;
+class Domain;
 
 /** Fields describing one dimension */
 struct IndexingData {
@@ -41,7 +48,18 @@ public:
     IndexingData(std::string const &_name, long _base, long _extent) :
         name(_name), base(_base), extent(_extent) {}
 
+    IndexingData() : base(0), extent(0), _stride(0) {}    // For serialization
+
     bool operator==(IndexingData const &other);
+
+    template<class ArchiveT>
+    void serialize(ArchiveT &ar, const unsigned int file_version)
+    {
+        ar & name;
+        ar & base;
+        ar & extent;
+        ar & _stride;
+    }
 };
 
 /** Base class for Indexing<..> template: most of the core functionality,
@@ -110,10 +128,22 @@ public:
     /** Read/Write this indexing spec to a NetCDF file. */
     void ncio(NcIO &ncio, std::string const &vname);
 
+    template<class ArchiveT>
+    void serialize(ArchiveT &ar, const unsigned int file_version)
+    {
+        ar & data;
+        ar & _indices;
+    }
+
     /** Allocates a blitz::Array according to the indexing described here. */
     template<class ValT, int RANK>
     blitz::Array<ValT,RANK> make_blitz();
 
+    /** Allocates a blitz::Array covering just domain, with our storage
+    order.  Bases are domain[k].begin, so global indices work. */
+    template<class ValT, int RANK>
+    blitz::Array<ValT,RANK> make_blitz(Domain const &domain) const;
+
     /** Creates a blitz::Array on existing memory, according to our indexing. */
     template<class ValT, int RANK>
     blitz::Array<ValT,RANK> to_blitz(ValT *data);
@@ -144,7 +174,8 @@ public:
             ix -= tuple_k * data[k].stride();
             tuple[k] = tuple_k + data[k].base;
         }
-        tuple[_indices[rank()-1]] = ix;
+        int const k = _indices[rank()-1];
+        tuple[k] = ix + data[k].base;
     }
 
 
@@ -159,6 +190,88 @@ public:
 
 
 
+/** Indexing with the rank fixed at compile time, for inner loops.
+Divisions by the strides in index_to_tuple() are done with
+precomputed magic numbers (see FastDivider).  Gives the same results
+as the Indexing it was made from. */
+template<int RANK>
+class CompiledIndexing
+{
+    std::array<int,RANK> _indices;    // Dims by descending stride
+    std::array<long,RANK> _base;
+    std::array<long,RANK> _stride;
+    std::array<FastDivider,RANK> _div;    // _div[d] divides by _stride[_indices[d]]
+
+public:
+    explicit CompiledIndexing(Indexing const &indexing);
+
+    template<class TupleT>
+    long tuple_to_index(TupleT const *tuple) const
+    {
+        long ix = 0;
+        for (int k=0; k<RANK; ++k)
+            ix += (tuple[k]-_base[k]) * _stride[k];
+        return ix;
+    }
+
+    template<class TupleT>
+    long tuple_to_index(std::array<TupleT,RANK> const &tuple) const
+        { return tuple_to_index(&tuple[0]); }
+
+    template<class TupleT>
+    void index_to_tuple(TupleT *tuple, long ix) const
+    {
+        for (int d=0; d<RANK-1; ++d) {       // indices by descending stride
+            int const k = _indices[d];
+            long const tuple_k = _div[d].divide(ix);
+            ix -= tuple_k * _stride[k];
+            tuple[k] = tuple_k + _base[k];
+        }
+        int const k = _indices[RANK-1];
+        tuple[k] = ix + _base[k];
+    }
+
+    template<class TupleT>
+    std::array<TupleT,RANK> index_to_tuple(long ix) const
+    {
+        std::array<TupleT, RANK> ret;
+        index_to_tuple(&ret[0], ix);
+        return ret;
+    }
+
+    /** Converts n tuples, stored contiguously (tuples[i*RANK + k]) */
+    template<class TupleT>
+    void tuple_to_index(long n, TupleT const *tuples, long *ix) const
+    {
+        for (long i=0; i<n; ++i)
+            ix[i] = tuple_to_index(tuples + i*RANK);
+    }
+
+    /** Converts n indices to tuples, stored contiguously (tuples[i*RANK + k]) */
+    template<class TupleT>
+    void index_to_tuple(long n, long const *ix, TupleT *tuples) const
+    {
+        for (long i=0; i<n; ++i)
+            index_to_tuple(tuples + i*RANK, ix[i]);
+    }
+};
+
+template<int RANK>
+CompiledIndexing<RANK>::CompiledIndexing(Indexing const &indexing)
+{
+    if (indexing.rank() != RANK) (*ibmisc_error)(-1,
+        "Rank mismatch: %d vs %d", indexing.rank(), RANK);
+
+    for (int k=0; k<RANK; ++k) {
+        _indices[k] = indexing.indices()[k];
+        _base[k] = indexing[k].base;
+        _stride[k] = indexing[k].stride();
+    }
+    for (int d=0; d<RANK; ++d)
+        _div[d] = FastDivider(_stride[_indices[d]]);
+}
+
+
 /** Adds the dimensions specified by indexing to a NcDimSpec.
 @param permutation Permutation to apply to dims from indexing.
        If none given, then indexing.indices will be used
@@ -183,7 +296,7 @@ blitz::Array<ValT,RANK> Indexing::make_blitz()
 
     }
 
-    return blitz::Array<ValT,RANK>(_lbounds, _extent, _stor);
+    return alloc_blitz<ValT,RANK>(_lbounds, _extent, _stor);
 }
 
 /** Creates a blitz::Array on existing memory, according to our indexing. */
@@ -206,6 +319,33 @@ blitz::Array<ValT,RANK> Indexing::to_blitz(ValT *memory)
     return blitz::Array<ValT,RANK>(memory, _shape, _stride,
         blitz::neverDeleteData, _stor);
 }
+
+/** Copies memory laid out by src_indexing into memory laid out by
+dst_indexing: the same dimensions and extents, in different storage
+orders (eg ModelE's Fortran-order (im,jm,ihc) into C order).  The copy
+is cache-blocked (see copy_strided()). */
+template<class TypeT>
+void reorder(
+    Indexing const &dst_indexing, TypeT *dst,
+    Indexing const &src_indexing, TypeT const *src,
+    int nthreads = 1)
+{
+    int const rank = src_indexing.rank();
+    if (dst_indexing.rank() != rank) (*ibmisc_error)(-1,
+        "Rank mismatch: %d vs %d", dst_indexing.rank(), rank);
+
+    std::vector<ptrdiff_t> dst_stride(rank), src_stride(rank);
+    std::vector<size_t> count(rank);
+    for (int k=0; k<rank; ++k) {
+        if (dst_indexing[k].extent != src_indexing[k].extent) (*ibmisc_error)(-1,
+            "Extent mismatch in dimension %s: %ld vs %ld",
+            src_indexing[k].name.c_str(), dst_indexing[k].extent, src_indexing[k].extent);
+        dst_stride[k] = dst_indexing[k].stride();
+        src_stride[k] = src_indexing[k].stride();
+        count[k] = src_indexing[k].extent;
+    }
+    copy_strided(dst, &dst_stride[0], src, &src_stride[0], &count[0], rank, nthreads);
+}
 // ==============================================================
 struct DomainData {
     long const begin;    // First "included" element in each index
@@ -233,6 +373,28 @@ public:
 
     void ncio(NcIO &ncio, std::string const &vname);
 
+    /** DomainData is immutable, so it's rebuilt on load */
+    template<class ArchiveT>
+    void serialize(ArchiveT &ar, const unsigned int file_version)
+    {
+        std::vector<long> begin, end;
+        for (auto const &d : data) {
+            begin.push_back(d.begin);
+            end.push_back(d.end);
+        }
+        ar & begin;
+        ar & end;
+        if (ArchiveT::is_loading::value) {
+            data.clear();
+            for (size_t i=0; i<begin.size(); ++i) data.push_back(DomainData(begin[i], end[i]));
+        }
+    }
+
+    /** Where this domain starts in a NetCDF variable, for
+    ncio_blitz_partial(): nc_start[b2n[i]] = (*this)[i].begin, and 0
+    for NetCDF dimensions not in b2n. */
+    std::vector<size_t> nc_start(std::vector<int> const &b2n, int nc_rank) const;
+
     template<class TupleT>
     bool in_domain(TupleT const *tuple) const;
 
@@ -258,6 +420,142 @@ extern bool in_domain(
     Indexing const *indexing,
     long ix);
 
+/** A contiguous range [begin, end) of linear indices */
+struct IndexRun {
+    long begin;
+    long end;
+
+    IndexRun(long _begin, long _end) : begin(_begin), end(_end) {}
+    bool operator==(IndexRun const &other) const
+        { return begin == other.begin && end == other.end; }
+};
+
+/** Calls fn(begin, end) for each range of linear indices (in indexing)
+that lies inside domain.  Ranges run along the fastest-varying
+dimension, in increasing order; adjacent ranges are merged, so a
+domain spanning whole rows yields a single range.  Equivalent to (but
+much faster than) testing in_domain() on every index. */
+template<class FnT>
+void for_each_run(Domain const &domain, Indexing const &indexing, FnT const &fn)
+{
+    int const rank = indexing.rank();
+    if (domain.rank() != rank) (*ibmisc_error)(-1,
+        "Rank mismatch: %d vs %d", domain.rank(), rank);
+    if (rank == 0) return;
+
+    // Domain clipped to the indexing, relative to base; by descending stride
+    std::vector<long> lo(rank), hi(rank), stride(rank);
+    for (int d=0; d<rank; ++d) {
+        int const k = indexing.indices()[d];
+        IndexingData const &dim(indexing[k]);
+        lo[d] = std::max(domain[k].begin, dim.base) - dim.base;
+        hi[d] = std::min(domain[k].end, dim.base + dim.extent) - dim.base;
+        if (lo[d] >= hi[d]) return;    // Empty
+        stride[d] = dim.stride();
+    }
+    long const len = hi[rank-1] - lo[rank-1];
+
+    // Odometer over all but the fastest-varying dimension
+    std::vector<long> tuple(lo);
+    long run_begin = -1, run_end = -1;
+    for (;;) {
+        long ix = 0;
+        for (int d=0; d<rank; ++d) ix += tuple[d] * stride[d];
+        if (ix == run_end) {
+            run_end += len;
+        } else {
+            if (run_begin >= 0) fn(run_begin, run_end);
+            run_begin = ix;
+            run_end = ix + len;
+        }
+
+        int d = rank-2;
+        for (; d >= 0; --d) {
+            if (++tuple[d] < hi[d]) break;
+            tuple[d] = lo[d];
+        }
+        if (d < 0) break;
+    }
+    fn(run_begin, run_end);
+}
+
+/** @return The ranges of linear indices inside domain (see for_each_run()) */
+extern std::vector<IndexRun> domain_runs(
+    Domain const &domain,
+    Indexing const &indexing);
+
+// ============================================
+template<class ValT, int RANK>
+blitz::Array<ValT,RANK> Indexing::make_blitz(Domain const &domain) const
+{
+    if (rank() != RANK || domain.rank() != RANK) (*ibmisc_error)(-1,
+        "Rank mismatch: %d vs %d vs %d", rank(), domain.rank(), RANK);
+
+    blitz::TinyVector<int, RANK> _lbounds, _extent;
+    blitz::GeneralArrayStorage<RANK> _stor;
+    for (int i=0; i<RANK; ++i) {
+        _lbounds[i] = domain[i].begin;
+        _extent[i] = domain[i].end - domain[i].begin;
+        _stor.ordering()[RANK-i-1] = _indices[i];    // Reverse order
+    }
+
+    return alloc_blitz<ValT,RANK>(_lbounds, _extent, _stor);
+}
+
+/** Reads/writes just the part of a NetCDF variable inside domain.
+The NetCDF variable is laid out by indexing, with dimensions in
+decreasing stride order (as from append(NcDimSpec, indexing)); domain
+is in the same (global) index space.  Each MPI rank can thus read only
+the hyperslab it owns.
+@param arr If unallocated when reading, is allocated with
+    indexing.make_blitz(domain); otherwise it must cover the domain. */
+template<class TypeT, int RANK>
+netCDF::NcVar ncio_blitz_domain(
+    NcIO &ncio,
+    blitz::Array<TypeT, RANK> &arr,
+    std::string const &vname,
+    std::string const &snc_type,
+    Indexing const &indexing,
+    Domain const &domain)
+{
+    if (indexing.rank() != RANK || domain.rank() != RANK) (*ibmisc_error)(-1,
+        "Rank mismatch in %s: %d vs %d vs %d",
+        vname.c_str(), indexing.rank(), domain.rank(), RANK);
+
+    std::vector<int> b2n(RANK);
+    std::vector<size_t> nc_start(RANK);
+    std::vector<netCDF::NcDim> ncdims;
+    for (int in=0; in<RANK; ++in) {
+        int const k = indexing.indices()[in];
+        IndexingData const &dim(indexing[k]);
+        if (domain[k].begin < dim.base || domain[k].end > dim.base + dim.extent
+            || domain[k].begin > domain[k].end) (*ibmisc_error)(-1,
+            "Domain [%ld, %ld) outside of dimension %s [%ld, %ld) in %s",
+            domain[k].begin, domain[k].end, dim.name.c_str(),
+            dim.base, dim.base + dim.extent, vname.c_str());
+
+        b2n[k] = in;
+        nc_start[in] = domain[k].begin - dim.base;
+
+        // Dimensions come from the variable on disk when reading
+        if (ncio.rw == 'w') ncdims.push_back(get_or_add_dim(ncio, dim.name, dim.extent));
+    }
+
+    if (ncio.rw == 'r' && !arr.data()) {
+        arr.reference(indexing.make_blitz<TypeT,RANK>(domain));
+    } else {
+        for (int k=0; k<RANK; ++k) {
+            if (arr.lbound(k) != domain[k].begin
+                || arr.extent(k) != domain[k].end - domain[k].begin) (*ibmisc_error)(-1,
+                "Array dimension %d [%d, %d) does not match domain [%ld, %ld) in %s",
+                k, arr.lbound(k), arr.lbound(k) + arr.extent(k),
+                domain[k].begin, domain[k].end, vname.c_str());
+        }
+    }
+
+    return ncio_blitz_partial(ncio, arr, vname, snc_type, ncdims, nc_start, b2n);
+}
+
 // ============================================
 
 
@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <ibmisc/iothread.hpp>
+
+namespace ibmisc {
+
+IOThread::IOThread(size_t _max_pending)
+    : npending(0), max_pending(std::max((size_t)1, _max_pending)), stopping(false),
+    th(&IOThread::run, this)
+{}
+
+IOThread::~IOThread()
+{
+    {std::unique_lock<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv_work.notify_all();
+    th.join();
+}
+
+void IOThread::run()
+{
+    for (;;) {
+        std::packaged_task<void()> task;
+        {std::unique_lock<std::mutex> lock(mtx);
+            cv_work.wait(lock, [this]{ return stopping || !queue.empty(); });
+            if (queue.empty()) return;    // Stopping, and nothing left to do
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        task();    // Exceptions are stored in the task's future
+
+        {std::unique_lock<std::mutex> lock(mtx);
+            --npending;
+        }
+        cv_done.notify_all();
+    }
+}
+
+std::future<void> IOThread::submit(std::function<void()> &&fn)
+{
+    std::packaged_task<void()> task(std::move(fn));
+    std::future<void> ret(task.get_future());
+
+    {std::unique_lock<std::mutex> lock(mtx);
+        cv_done.wait(lock, [this]{ return npending < max_pending; });
+        ++npending;
+        queue.push_back(std::move(task));
+    }
+    cv_work.notify_one();
+    return ret;
+}
+
+void IOThread::wait()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_done.wait(lock, [this]{ return npending == 0; });
+}
+
+}    // namespace ibmisc
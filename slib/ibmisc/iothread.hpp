@@ -0,0 +1,45 @@
+#ifndef IBMISC_IOTHREAD_HPP
+#define IBMISC_IOTHREAD_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace ibmisc {
+
+/** A single background thread that runs tasks (typically I/O) in the
+order they were submitted.  At most max_pending tasks may be queued
+or running at once; submit() blocks beyond that, which bounds the
+memory held by tasks waiting to be written. */
+class IOThread {
+    std::mutex mtx;
+    std::condition_variable cv_work;    // Signalled when a task is queued (or stopping)
+    std::condition_variable cv_done;    // Signalled when a task finishes
+    std::deque<std::packaged_task<void()>> queue;
+    size_t npending;    // Queued + running
+    size_t const max_pending;
+    bool stopping;
+    std::thread th;
+
+    void run();
+
+public:
+    explicit IOThread(size_t _max_pending = 2);
+
+    /** Finishes all submitted tasks, then joins the thread */
+    ~IOThread();
+
+    /** Queues fn to be run on the I/O thread.
+    @return Future that becomes ready when fn is done; get() rethrows
+        anything fn threw. */
+    std::future<void> submit(std::function<void()> &&fn);
+
+    /** Blocks until every submitted task has finished */
+    void wait();
+};
+
+}    // namespace ibmisc
+#endif    // IBMISC_IOTHREAD_HPP
@@ -0,0 +1,226 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include <ibmisc/linear/cache.hpp>
+#include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/tuple.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+// ------------------------------------------------------------
+MatrixKey::MatrixKey() : h0(0xcbf29ce484222325ull), h1(0x6a09e667f3bcc909ull), nbytes(0) {}
+
+/** Finalizer of splitmix64 */
+static uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+void MatrixKey::add_bytes(char const *data, size_t n)
+{
+    // h0: FNV-1a, byte at a time
+    for (size_t i=0; i<n; ++i) {
+        h0 ^= (unsigned char)data[i];
+        h0 *= 0x100000001b3ull;
+    }
+
+    // h1: mixed 8-byte words
+    size_t i = 0;
+    for (; i+8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, data+i, 8);
+        h1 = mix64(h1 ^ w) + 0x9e3779b97f4a7c15ull;
+    }
+    uint64_t w = n;    // Tail, and the length of this piece
+    if (n > i) memcpy(&w, data+i, n-i);
+    h1 = mix64(h1 ^ w ^ ((uint64_t)(n-i) << 56));
+
+    nbytes += n;
+}
+
+std::string MatrixKey::hex() const
+{
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx",
+        (unsigned long long)mix64(h0 ^ nbytes), (unsigned long long)h1);
+    return std::string(buf);
+}
+
+// ------------------------------------------------------------
+namespace {
+
+/** A name no other process (here or on another host) will use */
+std::string tmp_name(std::string const &fname)
+{
+    static std::atomic<long> count(0);
+    char host[256] = "";
+    gethostname(host, sizeof(host)-1);
+    return fname + ".tmp." + host + "." + std::to_string(getpid())
+        + "." + std::to_string(count++);
+}
+
+/** Removes a lock file at the end of a scope */
+class LockFile {
+    std::string const fname;
+public:
+    bool const held;
+
+    /** Tries to create fname, which must not exist */
+    LockFile(std::string const &_fname) : fname(_fname), held(take(_fname)) {}
+    ~LockFile() { if (held) ::unlink(fname.c_str()); }
+
+    static bool take(std::string const &fname)
+    {
+        int const fd = ::open(fname.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0) {
+            if (errno == EEXIST) return false;
+            (*ibmisc_error)(-1, "Cannot create lock file %s: %s",
+                fname.c_str(), strerror(errno));
+        }
+        ::close(fd);
+        return true;
+    }
+};
+
+bool exists(std::string const &fname)
+{
+    struct stat st;
+    return ::stat(fname.c_str(), &st) == 0;
+}
+
+}    // anonymous namespace
+
+// ------------------------------------------------------------
+MatrixCache::MatrixCache(std::string const &_dir, Format _format, double _lock_timeout)
+    : dir(_dir), format(_format), lock_timeout(_lock_timeout)
+{
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(dir, ec);
+    if (!boost::filesystem::is_directory(dir)) (*ibmisc_error)(-1,
+        "Cannot create matrix cache directory %s", dir.c_str());
+}
+
+std::string MatrixCache::path(MatrixKey const &key) const
+{
+    return (boost::filesystem::path(dir) /
+        (key.hex() + (format == Format::NETCDF ? ".nc" : ".snap"))).string();
+}
+
+bool MatrixCache::has(MatrixKey const &key) const
+    { return exists(path(key)); }
+
+std::unique_ptr<Weighted> MatrixCache::get(MatrixKey const &key) const
+{
+    std::string const fname(path(key));
+    if (!exists(fname)) return std::unique_ptr<Weighted>();
+
+    if (format == Format::NETCDF) {
+        std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+        NcIO ncio(fname, 'r');
+        return nc_read_weighted(ncio.nc, "BvA");
+    }
+
+    Snapshot snap(fname);
+    int type;
+    snap.get("type", type);
+    std::unique_ptr<Weighted> ret;
+    switch(type) {
+        case LinearType::EIGEN : {
+            std::unique_ptr<Weighted_Eigen> W(new Weighted_Eigen);
+            snap.get("BvA", *W);
+            ret = std::move(W);
+        } break;
+        case LinearType::TUPLE : {
+            std::unique_ptr<Weighted_Tuple> W(new Weighted_Tuple);
+            snap.get("BvA", *W);
+            ret = std::move(W);
+        } break;
+        default :
+            (*ibmisc_error)(-1,
+                "Matrix cache entry %s has unsupported type %d", fname.c_str(), type);
+    }
+    return ret;
+}
+
+void MatrixCache::put(MatrixKey const &key, Weighted &W) const
+{
+    std::string const fname(path(key));
+    std::string const tmp(tmp_name(fname));
+
+    if (format == Format::NETCDF) {
+        std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+        NcIO ncio(tmp, 'w');
+        W.ncio(ncio, "BvA");
+        ncio.close();
+    } else {
+        int const type = W.type.index();
+        SnapshotWriter snap(tmp);
+        snap.add("type", type);
+        auto const pinned(W.concrete());
+        if (auto *We = dynamic_cast<Weighted_Eigen const *>(pinned.get())) {
+            snap.add("BvA", *We);
+        } else if (auto *Wt = dynamic_cast<Weighted_Tuple const *>(pinned.get())) {
+            snap.add("BvA", *Wt);
+        } else {
+            (*ibmisc_error)(-1,
+                "Matrix cache %s: snapshots hold only Weighted_Eigen and Weighted_Tuple, not %s",
+                dir.c_str(), W.type.str());
+        }
+        snap.close();
+    }
+
+    // Atomic, even if another job is putting the same entry
+    if (::rename(tmp.c_str(), fname.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        (*ibmisc_error)(-1, "Cannot rename %s to %s: %s",
+            tmp.c_str(), fname.c_str(), strerror(errno));
+    }
+}
+
+std::unique_ptr<Weighted> MatrixCache::get_or_build(MatrixKey const &key,
+    std::function<std::unique_ptr<Weighted>()> const &build) const
+{
+    std::string const fname(path(key));
+    std::string const lock_fname(fname + ".lock");
+    auto const t0(std::chrono::steady_clock::now());
+
+    for (;;) {
+        auto ret(get(key));
+        if (ret) return ret;
+
+        {LockFile lock(lock_fname);
+            if (lock.held) {
+                ret = get(key);    // Finished while we took the lock
+                if (ret) return ret;
+                ret = build();
+                put(key, *ret);
+                return ret;
+            }
+        }
+
+        // Another job is building it: wait for it to finish
+        while (exists(lock_fname) && !exists(fname)) {
+            double const waited = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - t0).count();
+            if (waited > lock_timeout) {    // Stale lock
+                ret = build();
+                put(key, *ret);
+                ::unlink(lock_fname.c_str());
+                return ret;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+    }
+}
+
+}}    // namespace
@@ -0,0 +1,95 @@
+#ifndef IBMISC_LINEAR_CACHE_HPP
+#define IBMISC_LINEAR_CACHE_HPP
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ibmisc/snapshot.hpp>
+#include <ibmisc/linear/linear.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+/** Fingerprint of everything a regrid matrix is generated from: the
+grids' SparseSets, Indexing, projection strings (sproj), options...
+Objects are hashed through their serialize() hooks (see snapshot.hpp),
+each labelled, so the same objects added in the same order always give
+the same key.  Keys are native-endian, like snapshots.
+
+    MatrixKey key;
+    key.add("dimB", dimB).add("dimA", dimA)
+        .add("sproj", sproj).add("correctA", correctA);
+*/
+class MatrixKey {
+    uint64_t h0, h1;    // Two independent 64-bit hashes
+    long nbytes;
+
+    void add_bytes(char const *data, size_t n);
+
+public:
+    MatrixKey();
+
+    /** Adds an object: anything a SnapshotOArchive can serialize */
+    template<class T>
+    MatrixKey &add(std::string const &label, T const &obj)
+    {
+        std::vector<char> buf;
+        SnapshotOArchive ar(buf);
+        ar & label;
+        ar & obj;
+        add_bytes(buf.empty() ? nullptr : &buf[0], buf.size());
+        return *this;
+    }
+
+    /** 32 hex digits; used as the cache file name */
+    std::string hex() const;
+
+    bool operator==(MatrixKey const &other) const
+        { return h0 == other.h0 && h1 == other.h1 && nbytes == other.nbytes; }
+};
+
+/** A directory of regrid matrices, named by their MatrixKey.  Safe to
+share between jobs, including on a shared filesystem: entries are
+written under a temporary name and renamed into place, so readers
+never see a partial one; and get_or_build() takes a lock file, so
+only one job builds each matrix while the others wait for it.
+Threads of one job may share a cache too (NetCDF I/O holds
+netcdf_mutex). */
+class MatrixCache {
+public:
+    /** NETCDF stores any Weighted (read back with nc_read_weighted()).
+    SNAPSHOT stores Weighted_Eigen and Weighted_Tuple as memory-mapped
+    snapshots, which load faster. */
+    enum class Format {NETCDF, SNAPSHOT};
+
+    std::string const dir;
+    Format const format;
+
+    /** get_or_build() waits at most this long for another job's lock;
+    then builds the matrix itself (eg if that job died). */
+    double lock_timeout;
+
+    MatrixCache(std::string const &_dir, Format _format = Format::NETCDF,
+        double _lock_timeout = 3600.);
+
+    /** File holding the matrix for key */
+    std::string path(MatrixKey const &key) const;
+
+    bool has(MatrixKey const &key) const;
+
+    /** @return The stored matrix; or null if there is none */
+    std::unique_ptr<Weighted> get(MatrixKey const &key) const;
+
+    /** Stores W (replacing any entry already there) */
+    void put(MatrixKey const &key, Weighted &W) const;
+
+    /** Returns the stored matrix, building and storing it first if
+    needed.  If another job is building it, waits for that one. */
+    std::unique_ptr<Weighted> get_or_build(MatrixKey const &key,
+        std::function<std::unique_ptr<Weighted>()> const &build) const;
+};
+
+}}    // namespace
+#endif    // guard
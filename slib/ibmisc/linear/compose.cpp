@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <numeric>
+#include <ibmisc/linear/compose.hpp>
+#include <ibmisc/linear/tuple.hpp>
+#include <ibmisc/parallel.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+namespace {
+
+/** Non-empty rows of a matrix, in compressed sparse row form */
+struct CSR {
+    std::vector<long> rows;      // Sparse index of each row
+    std::vector<long> ptr;       // Entries of rows[r] are [ptr[r], ptr[r+1])
+    std::vector<long> cols;      // Sparse column index
+    std::vector<double> vals;
+
+    CSR(Weighted const &W);
+};
+
+CSR::CSR(Weighted const &W)
+{
+    blitz::Array<int,1> indices0, indices1;
+    blitz::Array<double,1> values;
+    W.to_coo(indices0, indices1, values);
+    long const nnz = values.extent(0);
+
+    // Stable: keep the order of entries within each row
+    std::vector<long> perm(nnz);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::stable_sort(perm.begin(), perm.end(),
+        [&](long a, long b) { return indices0(a) < indices0(b); });
+
+    ptr.push_back(0);
+    for (long n=0; n<nnz; ++n) {
+        long const e = perm[n];
+        if (n == 0 || indices0(e) != rows.back()) {
+            if (n > 0) ptr.push_back(cols.size());
+            rows.push_back(indices0(e));
+        }
+        cols.push_back(indices1(e));
+        vals.push_back(values(e));
+    }
+    if (nnz > 0) ptr.push_back(cols.size());
+}
+
+/** Adds the non-zero weights of W to a TupleList */
+void add_weights(Weighted const &W, int idim, Weighted_Tuple::TupleListLT<1> &out)
+{
+    blitz::Array<double,1> w;
+    W.get_weights(idim, w);
+    for (int i=0; i<w.extent(0); ++i) {
+        if (w(i) != 0) out.add({(long)i}, w(i));
+    }
+}
+
+}    // namespace (anonymous)
+
+std::unique_ptr<Weighted_Eigen> compose(
+    Weighted const &BvA,
+    Weighted const &AvC,
+    int nthreads)
+{
+    auto const shapeB(BvA.shape());
+    auto const shapeC(AvC.shape());
+    if (shapeB[1] != shapeC[0]) (*ibmisc_error)(-1,
+        "Cannot compose (%ld x %ld) with (%ld x %ld) matrix",
+        shapeB[0], shapeB[1], shapeC[0], shapeC[1]);
+
+    CSR const B(BvA);
+    CSR A(AvC);
+
+    // Number the columns of C that are used: 0..ccols.size()-1
+    std::vector<long> ccols(A.cols);
+    std::sort(ccols.begin(), ccols.end());
+    ccols.erase(std::unique(ccols.begin(), ccols.end()), ccols.end());
+    for (auto &c : A.cols)
+        c = std::lower_bound(ccols.begin(), ccols.end(), c) - ccols.begin();
+    long const nc = ccols.size();
+
+    // Row of A (if any) for each entry of BvA
+    std::vector<long> arow(B.cols.size());
+    parallel_for(0, B.cols.size(), nthreads, [&](long e0, long e1) {
+        for (long e=e0; e<e1; ++e) {
+            auto ii(std::lower_bound(A.rows.begin(), A.rows.end(), B.cols[e]));
+            arow[e] = (ii != A.rows.end() && *ii == B.cols[e] ? ii - A.rows.begin() : -1);
+        }
+    });
+
+    // ---------- Symbolic pass: nnz of each row of BvC
+    long const nrows = B.rows.size();
+    std::vector<long> ptr(nrows+1, 0);
+    parallel_for(0, nrows, nthreads, [&](long r0, long r1) {
+        std::vector<long> mark(nc, -1);
+        for (long r=r0; r<r1; ++r) {
+            long count = 0;
+            for (long e=B.ptr[r]; e<B.ptr[r+1]; ++e) {
+                long const k = arow[e];
+                if (k < 0) continue;
+                for (long f=A.ptr[k]; f<A.ptr[k+1]; ++f) {
+                    long const c = A.cols[f];
+                    if (mark[c] != r) {
+                        mark[c] = r;
+                        ++count;
+                    }
+                }
+            }
+            ptr[r+1] = count;
+        }
+    });
+    std::partial_sum(ptr.begin(), ptr.end(), ptr.begin());
+
+    // ---------- Numeric pass
+    std::vector<long> cols(ptr[nrows]);
+    std::vector<double> vals(ptr[nrows]);
+    parallel_for(0, nrows, nthreads, [&](long r0, long r1) {
+        std::vector<double> acc(nc, 0.);
+        std::vector<long> mark(nc, -1);
+        for (long r=r0; r<r1; ++r) {
+            long n = ptr[r];
+            for (long e=B.ptr[r]; e<B.ptr[r+1]; ++e) {
+                long const k = arow[e];
+                if (k < 0) continue;
+                for (long f=A.ptr[k]; f<A.ptr[k+1]; ++f) {
+                    long const c = A.cols[f];
+                    if (mark[c] != r) {
+                        mark[c] = r;
+                        cols[n++] = c;
+                    }
+                    acc[c] += B.vals[e] * A.vals[f];
+                }
+            }
+
+            // Columns in increasing order
+            std::sort(&cols[ptr[r]], &cols[ptr[r+1]]);
+            for (long m=ptr[r]; m<ptr[r+1]; ++m) {
+                vals[m] = acc[cols[m]];
+                acc[cols[m]] = 0;
+            }
+        }
+    });
+
+    // ---------- Assemble
+    Weighted_Tuple BvC(BvA.conservative && AvC.conservative);
+    BvC.scaled = BvA.scaled && AvC.scaled;
+    BvC.set_shape({shapeB[0], shapeC[1]});
+    for (long r=0; r<nrows; ++r) {
+        for (long m=ptr[r]; m<ptr[r+1]; ++m) {
+            BvC.M.add({B.rows[r], ccols[cols[m]]}, vals[m]);
+        }
+    }
+    add_weights(BvA, 0, BvC.wM);
+    add_weights(AvC, 1, BvC.Mw);
+
+    return to_eigen(BvC);
+}
+
+// ======================================================
+std::shared_ptr<Weighted_Eigen> ComposeCache::get(Weighted const &BvA, Weighted const &AvC)
+{
+    KeyT const key(BvA.generation(), AvC.generation());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto ii(cache.find(key));
+        if (ii != cache.end()) return ii->second.BvC;
+    }
+
+    // Other threads may use the cache meanwhile; if one composed the
+    // same pair first, keep theirs.
+    std::shared_ptr<Weighted_Eigen> BvC(compose(BvA, AvC, nthreads).release());
+    std::lock_guard<std::mutex> lock(mutex);
+    auto ret(cache.insert(std::make_pair(key, Entry{&BvA, &AvC, BvC})));
+    return ret.first->second.BvC;
+}
+
+void ComposeCache::invalidate(Weighted const *W)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto ii(cache.begin()); ii != cache.end(); ) {
+        if (ii->second.BvA == W || ii->second.AvC == W) ii = cache.erase(ii);
+        else ++ii;
+    }
+}
+
+void ComposeCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    cache.clear();
+}
+
+size_t ComposeCache::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return cache.size();
+}
+
+}}    // namespace
@@ -0,0 +1,61 @@
+#ifndef IBMISC_LINEAR_COMPOSE_HPP
+#define IBMISC_LINEAR_COMPOSE_HPP
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <ibmisc/linear/eigen.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+/** Composes two regridders: BvC = BvA * AvC, computed with a
+(row-parallel) sparse matrix-matrix product.  Applying the result once
+is equivalent to applying AvC, then BvA.
+
+The result takes its B weights (wM) from BvA and its C weights (Mw)
+from AvC.  It is conservative only if both operands are; if not,
+apply_M() corrects the composition end-to-end, from C to B.
+
+Entries are summed in a fixed order, so the result does not depend on
+nthreads. */
+extern std::unique_ptr<Weighted_Eigen> compose(
+    Weighted const &BvA,
+    Weighted const &AvC,
+    int nthreads = 1);
+
+/** Remembers compositions, so a chain of regridders applied every
+timestep is multiplied only once.  Keyed on the operands' generation(),
+so a changed operand (see Weighted::changed()) or a new matrix at a
+recycled address never matches a stale entry; invalidate() frees them.
+Thread-safe; compositions are computed outside the lock. */
+class ComposeCache {
+    typedef std::pair<uint64_t, uint64_t> KeyT;
+
+    struct Entry {
+        Weighted const *BvA, *AvC;    // For invalidate() only
+        std::shared_ptr<Weighted_Eigen> BvC;
+    };
+
+    std::mutex mutex;
+    std::map<KeyT, Entry> cache;
+
+public:
+    /** Threads to use for each new composition */
+    int nthreads;
+
+    ComposeCache(int _nthreads = 1) : nthreads(_nthreads) {}
+
+    /** @return compose(BvA, AvC), computing it only the first time */
+    std::shared_ptr<Weighted_Eigen> get(Weighted const &BvA, Weighted const &AvC);
+
+    /** Drops all compositions that have W as an operand */
+    void invalidate(Weighted const *W);
+
+    void clear();
+
+    size_t size();
+};
+
+}}    // namespace
+#endif    // guard
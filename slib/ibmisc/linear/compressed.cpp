@@ -1,8 +1,16 @@
+#include <algorithm>
+#include <map>
+#include <mutex>
 #include <spsparse/eigen.hpp>
 #include <spsparse/blitz.hpp>
 #include <spsparse/SparseSet.hpp>
 #include <ibmisc/linear/compressed.hpp>
 #include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/inplace.hpp>
+#include <ibmisc/linear/patch.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/profile.hpp>
+#include <ibmisc/progress.hpp>
 
 
 namespace ibmisc {
@@ -11,18 +19,179 @@ static double const nan = std::numeric_limits<double>::quiet_NaN();
 
 namespace linear {
 
-void Weighted_Compressed::set_shape(std::array<long,2> _shape)
+template<class ValueT>
+size_t Weighted_Compressed_Decoded<ValueT>::
+    nbytes() const
 {
+    size_t ret = 0;
+    for (int i=0; i<2; ++i) {
+        ret += windex[i].capacity() * sizeof(int);
+        ret += wvalue[i].capacity() * sizeof(ValueT);
+    }
+    ret += rows.capacity() * sizeof(int);
+    ret += row_ptr.capacity() * sizeof(long);
+    ret += cols.capacity() * sizeof(int);
+    ret += vals.capacity() * sizeof(ValueT);
+    ret += acols.capacity() * sizeof(int);
+    ret += dcols.capacity() * sizeof(int);
+    return ret;
+}
+// ------------------------------------------------------
+template<> Weighted_CompressedT<double>::Weighted_CompressedT()
+    : Weighted(LinearType::COMPRESSED), _cache_budget(0), _decoded_mutex(new std::mutex) {}
+
+template<> Weighted_CompressedT<float>::Weighted_CompressedT()
+    : Weighted(LinearType::COMPRESSED_FLOAT), _cache_budget(0), _decoded_mutex(new std::mutex) {}
+
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    set_cache_budget(size_t budget)
+{
+    std::lock_guard<std::mutex> lock(*_decoded_mutex);
+    _cache_budget = budget;
+    if (budget == 0 || (_decoded.get() && _decoded->nbytes() > budget)) _decoded.reset();
+}
+
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    clear_cache()
+{
+    std::lock_guard<std::mutex> lock(*_decoded_mutex);
+    _decoded.reset();
+}
+
+template<class ValueT>
+size_t Weighted_CompressedT<ValueT>::
+    cache_nbytes() const
+{
+    std::lock_guard<std::mutex> lock(*_decoded_mutex);
+    return _decoded.get() ? _decoded->nbytes() : 0;
+}
+
+template<class ValueT>
+size_t Weighted_CompressedT<ValueT>::
+    cache_nbytes_needed() const
+{
+    // Upper bound: every non-zero of M could be in its own row
+    size_t const nnz = M.nnz();
+    return (weights[0].nnz() + weights[1].nnz()) * (sizeof(int) + sizeof(ValueT))
+        + nnz * (sizeof(int) + sizeof(ValueT))
+        + nnz * sizeof(int) + (nnz+1) * sizeof(long)
+        + nnz * sizeof(int) * 2;    // acols, dcols
+}
+
+template<class ValueT>
+typename Weighted_CompressedT<ValueT>::DecodedT const *Weighted_CompressedT<ValueT>::
+    decoded() const
+{
+    std::lock_guard<std::mutex> lock(*_decoded_mutex);
+    if (_decoded.get()) return _decoded.get();
+    if (_cache_budget == 0 || cache_nbytes_needed() > _cache_budget) return NULL;
+
+    IBMISC_SCOPED_TIMER("Weighted_Compressed::decode");
+    profile::work(M.nnz());
+    std::unique_ptr<DecodedT> dec(new DecodedT);
+
+    // Weights
+    for (int i=0; i<2; ++i) {
+        dec->windex[i].reserve(weights[i].nnz());
+        dec->wvalue[i].reserve(weights[i].nnz());
+        for (auto ii(weights[i].generator()); ++ii; ) {
+            dec->windex[i].push_back(ii->index(0));
+            dec->wvalue[i].push_back(ii->value());
+        }
+    }
+
+    // M: decode to COO, then sort by row (stable, to keep the
+    // original summation order within each row)
+    long const nnz = M.nnz();
+    std::vector<int> rows0, cols0;
+    std::vector<ValueT> vals0;
+    rows0.reserve(nnz); cols0.reserve(nnz); vals0.reserve(nnz);
+    long const nblocks = M.nblocks();
+    if (nblocks <= 1 || nthreads <= 1) {
+        for (auto ii(M.generator()); ++ii; ) {
+            rows0.push_back(ii->index(0));
+            cols0.push_back(ii->index(1));
+            vals0.push_back(ii->value());
+        }
+    } else {
+        // Block-framed: decode blocks in parallel, then concatenate in order
+        std::vector<std::vector<int>> brows(nblocks), bcols(nblocks);
+        std::vector<std::vector<ValueT>> bvals(nblocks);
+        parallel_for(0, nblocks, nthreads, [&](long b0, long b1) {
+            for (long b=b0; b<b1; ++b) {
+                for (auto ii(M.generator(b, b+1)); ++ii; ) {
+                    brows[b].push_back(ii->index(0));
+                    bcols[b].push_back(ii->index(1));
+                    bvals[b].push_back(ii->value());
+                }
+            }
+        });
+        for (long b=0; b<nblocks; ++b) {
+            rows0.insert(rows0.end(), brows[b].begin(), brows[b].end());
+            cols0.insert(cols0.end(), bcols[b].begin(), bcols[b].end());
+            vals0.insert(vals0.end(), bvals[b].begin(), bvals[b].end());
+        }
+    }
+
+    std::vector<long> perm(rows0.size());
+    for (size_t j=0; j<perm.size(); ++j) perm[j] = j;
+    std::stable_sort(perm.begin(), perm.end(),
+        [&rows0](long a, long b) { return rows0[a] < rows0[b]; });
+
+    dec->cols.reserve(perm.size());
+    dec->vals.reserve(perm.size());
+    for (size_t j=0; j<perm.size(); ++j) {
+        int const row = rows0[perm[j]];
+        if (dec->rows.size() == 0 || dec->rows.back() != row) {
+            dec->rows.push_back(row);
+            dec->row_ptr.push_back(j);
+        }
+        dec->cols.push_back(cols0[perm[j]]);
+        dec->vals.push_back(vals0[perm[j]]);
+    }
+    dec->row_ptr.push_back(perm.size());
+
+    dec->rows.shrink_to_fit();
+    dec->row_ptr.shrink_to_fit();
+
+    // Dense renumbering of columns
+    dec->acols = dec->cols;
+    std::sort(dec->acols.begin(), dec->acols.end());
+    dec->acols.erase(std::unique(dec->acols.begin(), dec->acols.end()), dec->acols.end());
+    dec->acols.shrink_to_fit();
+    dec->dcols.reserve(dec->cols.size());
+    for (int const j : dec->cols) {
+        dec->dcols.push_back(
+            std::lower_bound(dec->acols.begin(), dec->acols.end(), j) - dec->acols.begin());
+    }
+
+    _decoded = std::move(dec);
+    return _decoded.get();
+}
+// ------------------------------------------------------
+
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    set_shape(std::array<long,2> _shape)
+{
+    clear_cache();
+    changed();
     M.accum().set_shape(_shape);
 }
 
-std::array<long,2> Weighted_Compressed::shape() const
+template<class ValueT>
+std::array<long,2> Weighted_CompressedT<ValueT>::
+    shape() const
 {
     return M.shape();
 }
 
 
-void Weighted_Compressed::apply_weight(
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    apply_weight(
     int dim,    // 0=B, 1=A
     blitz::Array<double,2> const &As,    // As(nvec, nA)
     blitz::Array<double,1> &out,          // out(nvec)
@@ -33,85 +202,524 @@ void Weighted_Compressed::apply_weight(
 
     if (zero_out) out = 0;
 
-    for (auto ii(weights[dim].generator()); ++ii; ) {
-        for (int k=0; k<nvec; ++k) {
-            out(k) += ii->value() * As(k,ii->index(0));
+    auto const *dec(decoded());
+    if (dec) {
+        apply_weight_gemv(dec->windex[dim], dec->wvalue[dim], As, out, nthreads);
+        return;
+    }
+
+    // Each thread computes out(k) for its own range of vectors
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        for (auto ii(weights[dim].generator()); ++ii; ) {
+            for (long k=k0; k<k1; ++k) {
+                out(k) += ii->value() * As(k,ii->index(0));
+            }
         }
+    });
+}
+
+/** y[0:n] += a * x[0:n]; written plainly so the compiler can vectorize */
+static inline void axpy(long const n, double const a,
+    double const * __restrict__ x, double * __restrict__ y)
+{
+    for (long k=0; k<n; ++k) y[k] += a * x[k];
+}
+
+/** Prepares the active space of Bs for vectors [k0,k1), based on accum_type */
+static void prepare_active(
+    blitz::Array<double,2> &Bs, long k0, long k1,
+    int const i, AccumType accum_type)
+{
+    switch(accum_type.index()) {
+        case AccumType::REPLACE :
+            for (long k=k0; k<k1; ++k) Bs(k,i) = 0;
+        break;
+        case AccumType::REPLACE_OR_ACCUMULATE :
+            for (long k=k0; k<k1; ++k) {
+                auto &Bs_ki(Bs(k,i));
+                if (std::isnan(Bs_ki)) Bs_ki = 0;
+            }
+        break;
     }
 }
 
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    _apply_M_tiled(
+    DecodedT const &dec,
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,2> &Bs) const    // Bs(nvec, nB)
+{
+    long const nvec = As.extent(0);
+    long const nac = dec.acols.size();
+    long const nrows = dec.rows.size();
+
+    // Tiles: At(nac, nt), Bt(nrows, nt); both vector-major
+    long const nt_max = std::min(nvec, (long)vmajor_tile_nvec);
+    std::vector<double> At(nac * nt_max);
+    std::vector<double> Bt(nrows * nt_max);
+
+    for (long k0=0; k0<nvec; k0 += nt_max) {
+        long const nt = std::min(nt_max, nvec - k0);
 
-void Weighted_Compressed::apply_M(
+        parallel_for(0, nac, nthreads, [&](long c0, long c1) {
+            for (long c=c0; c<c1; ++c) {
+                int const j = dec.acols[c];
+                double * const At_c = &At[c*nt];
+                for (long k=0; k<nt; ++k) At_c[k] = As(k0+k, j);
+            }
+        });
+
+        parallel_for(0, nrows, nthreads, [&](long r0, long r1) {
+            for (long r=r0; r<r1; ++r) {
+                double * const Bt_r = &Bt[r*nt];
+                for (long k=0; k<nt; ++k) Bt_r[k] = 0;
+                for (long jj=dec.row_ptr[r]; jj<dec.row_ptr[r+1]; ++jj) {
+                    axpy(nt, dec.vals[jj], &At[dec.dcols[jj]*nt], Bt_r);
+                }
+
+                int const i = dec.rows[r];
+                for (long k=0; k<nt; ++k) Bs(k0+k, i) += Bt_r[k];
+            }
+        });
+    }
+}
+
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    apply_M(
     blitz::Array<double,2> const &As,    // As(nvec, nA)
     blitz::Array<double,2> &Bs,         // Bs(nvec, nB)
     AccumType accum_type,
     bool force_conservation) const
 {
+    IBMISC_SCOPED_TIMER("Weighted_Compressed::apply_M");
+    profile::work(M.nnz());
     auto const nvec(As.extent(0));
     auto const nA(As.extent(1));
     auto const nB(Bs.extent(1));
 
-    // Prepare ActiveSpace, based on accum_type
-    switch(accum_type.index()) {
-        case AccumType::REPLACE :
-            for (auto ii(weights[0].generator()); ++ii; ) {
-                for (int k=0; k<nvec; ++k) Bs(k,ii->index(0)) = 0;
+    // Build the caches (if enabled) before going parallel
+    auto const *dec(decoded());
+    auto const &active(active_rows());
+
+    // Are the vectors interleaved in memory?  (Vector-major layout)
+    bool const vcontig = (nvec > 1 && As.stride(0) == 1 && Bs.stride(0) == 1);
+
+    if (dec) {
+        // Threads own disjoint sets of output rows i
+        parallel_for(0, active.size(), nthreads, [&](long j0, long j1) {
+            for (long j=j0; j<j1; ++j)
+                prepare_active(Bs, 0, nvec, active[j], accum_type);
+        });
+
+        if (vcontig) {
+            // Vectors are already interleaved: contiguous AXPY per non-zero
+            parallel_for(0, dec->rows.size(), nthreads, [&](long r0, long r1) {
+                for (long r=r0; r<r1; ++r) {
+                    double * const Bs_i = &Bs(0,dec->rows[r]);
+                    for (long jj=dec->row_ptr[r]; jj<dec->row_ptr[r+1]; ++jj) {
+                        axpy(nvec, dec->vals[jj], &As(0,dec->cols[jj]), Bs_i);
+                    }
+                }
+            });
+        } else if (nvec >= vmajor_min_nvec) {
+            _apply_M_tiled(*dec, As, Bs);
+        } else {
+            parallel_for(0, dec->rows.size(), nthreads, [&](long r0, long r1) {
+                for (long r=r0; r<r1; ++r) {
+                    auto const i(dec->rows[r]);
+                    for (long jj=dec->row_ptr[r]; jj<dec->row_ptr[r+1]; ++jj) {
+                        auto const j(dec->cols[jj]);
+                        auto const val(dec->vals[jj]);
+                        for (int k=0; k<nvec; ++k) {
+                            Bs(k,i) += val * As(k,j);
+                        }
+                    }
+                }
+            });
+        }
+    } else if (vcontig) {
+        parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+            for (int const i : active) prepare_active(Bs, k0, k1, i, accum_type);
+
+            for (auto ii(M.generator()); ++ii; ) {
+                axpy(k1-k0, ii->value(), &As(k0,ii->index(1)), &Bs(k0,ii->index(0)));
             }
-        break;
-        case AccumType::REPLACE_OR_ACCUMULATE :
-            for (auto ii(weights[0].generator()); ++ii; ) {
-                for (int k=0; k<nvec; ++k) {
-                    auto &Bs_ki(Bs(k,ii->index(0)));
-                    if (std::isnan(Bs_ki)) Bs_ki = 0;
+        });
+    } else {
+        // Rows come out of the decoder in no particular order;
+        // so threads own disjoint sets of vectors k instead.
+        parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+            for (int const i : active) prepare_active(Bs, k0, k1, i, accum_type);
+
+            for (auto ii(M.generator()); ++ii; ) {
+                auto const i(ii->index(0));
+
+                for (long k=k0; k<k1; ++k) {
+                    Bs(k,i) += ii->value() * As(k,ii->index(1));
                 }
             }
-        break;
+        });
     }
 
-    // Multiply
-    for (auto ii(M.generator()); ++ii; ) {
-        auto const i(ii->index(0));
+    correct_conservation(As, Bs, active, force_conservation);
+}
 
-        for (int k=0; k<nvec; ++k) {
-            Bs(k,i) += ii->value() * As(k,ii->index(1));
-        }
-    }
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    apply_M_rows(
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,2> &Bs,          // Bs(nvec, nB)
+    long i0, long i1,
+    AccumType accum_type) const
+{
+    IBMISC_SCOPED_TIMER("Weighted_Compressed::apply_M_rows");
+    check_rows(Bs, i0, i1);
+    auto const nvec(As.extent(0));
 
-    if (force_conservation && !conservative) {
-        // Compute correction factor for each variable
-        blitz::Array<double,1> wA(nvec);
-        blitz::Array<double,1> wB(nvec);
+    // Build the caches (if enabled) before going parallel
+    auto const *dec(decoded());
+    auto const &active(active_rows());
+    auto const a0(std::lower_bound(active.begin(), active.end(), i0));
+    auto const a1(std::lower_bound(a0, active.end(), i1));
 
-        apply_weight(0, Bs, wB, true);
-        apply_weight(1, As, wA, true);
+    bool const vcontig = (nvec > 1 && As.stride(0) == 1 && Bs.stride(0) == 1);
 
-        blitz::Array<double,1> factor(nvec);
-        for (int k=0; k<nvec; ++k) factor(k)=wA(k)/wB(k);
+    if (dec) {
+        parallel_for(0, a1-a0, nthreads, [&](long j0, long j1) {
+            for (long j=j0; j<j1; ++j)
+                prepare_active(Bs, 0, nvec, a0[j], accum_type);
+        });
 
-        // Multiply by correction factor
-        for (auto ii(weights[0].generator()); ++ii; ) {
-            auto const i(ii->index(0));
-            for (int k=0; k<nvec; ++k) {
-                Bs(k,i) *= factor(k);
+        // Cached rows are sorted: just multiply the ones in range
+        long const r0 = std::lower_bound(dec->rows.begin(), dec->rows.end(), i0) - dec->rows.begin();
+        long const r1 = std::lower_bound(dec->rows.begin() + r0, dec->rows.end(), i1) - dec->rows.begin();
+        parallel_for(r0, r1, nthreads, [&](long ra, long rb) {
+            for (long r=ra; r<rb; ++r) {
+                auto const i(dec->rows[r]);
+                for (long jj=dec->row_ptr[r]; jj<dec->row_ptr[r+1]; ++jj) {
+                    if (vcontig) {
+                        axpy(nvec, dec->vals[jj], &As(0,dec->cols[jj]), &Bs(0,i));
+                    } else {
+                        for (int k=0; k<nvec; ++k) Bs(k,i) += dec->vals[jj] * As(k,dec->cols[jj]);
+                    }
+                }
             }
+        });
+    } else {
+        // Decode only blocks that may hold our rows; threads own
+        // disjoint sets of vectors k.
+        auto const blocks(M.blocks_for_rows(i0, i1));
+        parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+            for (auto ii=a0; ii != a1; ++ii) prepare_active(Bs, k0, k1, *ii, accum_type);
+
+            for (long const b : blocks) {
+                for (auto ii(M.generator(b, b+1)); ++ii; ) {
+                    auto const i(ii->index(0));
+                    if (i < i0 || i >= i1) continue;
+                    for (long k=k0; k<k1; ++k) {
+                        Bs(k,i) += ii->value() * As(k,ii->index(1));
+                    }
+                }
+            }
+        });
+    }
+}
+
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    apply_MT(
+    blitz::Array<double,2> const &Bs,    // Bs(nvec, nB)
+    blitz::Array<double,2> &As,          // As(nvec, nA)
+    AccumType accum_type) const
+{
+    long const nvec(Bs.extent(0));
+    auto const *dec(decoded());
+
+    // Reproducible mode must not choose by nthreads
+    bool const repro = (reduce_mode == ReduceMode::REPRODUCIBLE);
+    if (dec && (repro ? nvec < reproducible_pieces : (nthreads > 1 && nvec < nthreads))) {
+        // Too few vectors to go around: threads take pieces of M's
+        // rows instead, scattering into their own buffers over the
+        // (dense) columns
+        long const nac = dec->acols.size();
+        long const nrows = dec->rows.size();
+        long const npieces = reduce_pieces(nrows, nthreads, reduce_mode);
+        std::vector<std::vector<double>> bufs(npieces);
+        parallel_for(0, npieces, nthreads, [&](long p0, long p1) {
+            for (long p=p0; p<p1; ++p) {
+                std::vector<double> &buf(bufs[p]);
+                buf.assign(nac * nvec, 0.);
+                for (long r=nrows*p/npieces; r<nrows*(p+1)/npieces; ++r) {
+                    int const i = dec->rows[r];
+                    for (long jj=dec->row_ptr[r]; jj<dec->row_ptr[r+1]; ++jj) {
+                        double * const buf_c = &buf[dec->dcols[jj] * nvec];
+                        for (long k=0; k<nvec; ++k) buf_c[k] += dec->vals[jj] * Bs(k,i);
+                    }
+                }
+            }
+        });
+
+        auto const &windex1(dec->windex[1]);
+        for (size_t j=0; j<windex1.size(); ++j)
+            prepare_active(As, 0, nvec, windex1[j], accum_type);
+
+        // Reduce, in a fixed order
+        if (repro) {
+            std::vector<double> sum(nac * nvec, 0.);
+            pairwise_reduce(bufs, nac * nvec, sum.data(), nthreads);
+            bufs.assign(1, std::move(sum));
         }
+        parallel_for(0, nac, nthreads, [&](long c0, long c1) {
+            for (auto const &buf : bufs) {
+                for (long c=c0; c<c1; ++c) {
+                    int const j = dec->acols[c];
+                    for (long k=0; k<nvec; ++k) As(k,j) += buf[c*nvec + k];
+                }
+            }
+        });
+        return;
     }
+
+    // Threads own disjoint sets of vectors k
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        if (dec) {
+            auto const &windex1(dec->windex[1]);
+            for (size_t j=0; j<windex1.size(); ++j)
+                prepare_active(As, k0, k1, windex1[j], accum_type);
+
+            for (size_t r=0; r<dec->rows.size(); ++r) {
+                int const i = dec->rows[r];
+                for (long jj=dec->row_ptr[r]; jj<dec->row_ptr[r+1]; ++jj) {
+                    int const j = dec->cols[jj];
+                    for (long k=k0; k<k1; ++k) As(k,j) += dec->vals[jj] * Bs(k,i);
+                }
+            }
+        } else {
+            for (auto ii(weights[1].generator()); ++ii; )
+                prepare_active(As, k0, k1, ii->index(0), accum_type);
+
+            for (auto ii(M.generator()); ++ii; ) {
+                auto const i(ii->index(0));
+                auto const j(ii->index(1));
+                for (long k=k0; k<k1; ++k) As(k,j) += ii->value() * Bs(k,i);
+            }
+        }
+    });
+}
+
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    apply_M_inplace(
+    blitz::Array<double,2> &As,
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    auto const *dec(decoded());
+    auto weights_fn = [&](int dim) {
+        return [this,dec,dim](std::function<void(long,double)> const &fn) {
+            if (dec) {
+                for (size_t j=0; j<dec->windex[dim].size(); ++j)
+                    fn(dec->windex[dim][j], dec->wvalue[dim][j]);
+            } else {
+                for (auto ii(weights[dim].generator()); ++ii; )
+                    fn(ii->index(0), ii->value());
+            }
+        };
+    };
+
+    apply_M_inplace_stream(shape(), conservative, As, accum_type, force_conservation,
+        nthreads,
+        weights_fn(0),
+        [&](std::function<void(long,long,double)> const &fn) {
+            if (dec) {
+                for (size_t r=0; r<dec->rows.size(); ++r) {
+                    for (long jj=dec->row_ptr[r]; jj<dec->row_ptr[r+1]; ++jj)
+                        fn(dec->rows[r], dec->cols[jj], dec->vals[jj]);
+                }
+            } else {
+                for (auto ii(M.generator()); ++ii; )
+                    fn(ii->index(0), ii->index(1), ii->value());
+            }
+        },
+        weights_fn(1));
 }
 
-void Weighted_Compressed::ncio(NcIO &ncio, std::string const &vname)
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    ncio(NcIO &ncio, std::string const &vname)
 {
     // Call to superclass
     Weighted::ncio(ncio, vname);
+    if (ncio.rw == 'r') clear_cache();
 
     weights[0].ncio(ncio, vname + ".wM");
     M.ncio(ncio, vname + ".M");
     weights[1].ncio(ncio, vname + ".Mw");
 }
 
+namespace {
+
+/** Removes the elements of Z for which changed(index) is true, and adds
+those of add, re-encoding only the blocks that change. */
+template<class ValueT, int RANK, class ChangedT>
+void patch_zarray(
+    ZArray<int,ValueT,RANK> &Z,
+    ChangedT const &changed,
+    spsparse::TupleList<long,double,RANK> const &add,
+    long block_size,
+    int nthreads)
+{
+    typedef std::array<int,RANK> IndexT;
+
+    std::vector<IndexT> add_indices;
+    std::vector<ValueT> add_values;
+    for (auto ii=add.begin(); ii != add.end(); ++ii) {
+        IndexT ix;
+        for (int k=0; k<RANK; ++k) ix[k] = ii->index(k);
+        add_indices.push_back(ix);
+        add_values.push_back(ii->value());
+    }
+
+    if (!Z.framed()) {
+        // Re-encode everything, in blocks for next time
+        ZArray<int,ValueT,RANK> Z2(Z.shape());
+        {
+            auto accum(Z2.accum(block_size, Z.codec()));
+            for (auto ii(Z.generator()); ++ii; ) {
+                if (!changed(ii->index())) accum.add(ii->index(), ii->value());
+            }
+            for (size_t n=0; n<add_indices.size(); ++n)
+                accum.add(add_indices[n], add_values[n]);
+        }
+        Z = std::move(Z2);
+        return;
+    }
+
+    // Survivors of each block with a changed element
+    long const nblocks = Z.nblocks();
+    std::vector<char> hit(nblocks, 0);
+    std::vector<std::vector<IndexT>> bindices(nblocks);
+    std::vector<std::vector<ValueT>> bvalues(nblocks);
+    parallel_for(0, nblocks, nthreads, [&](long b0, long b1) {
+        for (long b=b0; b<b1; ++b) {
+            std::vector<IndexT> indices;
+            std::vector<ValueT> values;
+            for (auto ii(Z.generator(b, b+1)); ++ii; ) {
+                if (changed(ii->index())) {
+                    hit[b] = 1;
+                } else {
+                    indices.push_back(ii->index());
+                    values.push_back(ii->value());
+                }
+            }
+            if (hit[b]) {
+                bindices[b] = std::move(indices);
+                bvalues[b] = std::move(values);
+            }
+        }
+    });
+
+    // Runs of consecutive changed blocks
+    std::vector<std::pair<long,long>> runs;
+    for (long b=0; b<nblocks; ) {
+        if (!hit[b]) { ++b; continue; }
+        long const b0 = b;
+        while (b < nblocks && hit[b]) ++b;
+        runs.push_back(std::make_pair(b0, b));
+    }
+    if (runs.empty()) {
+        if (!add_indices.empty()) Z.splice(nblocks, nblocks, add_indices, add_values);
+        return;
+    }
+
+    // Splice from the end, so earlier block numbers stay valid.
+    // New elements go in with the first run.
+    for (long r=runs.size()-1; r >= 0; --r) {
+        std::vector<IndexT> indices;
+        std::vector<ValueT> values;
+        for (long b=runs[r].first; b<runs[r].second; ++b) {
+            indices.insert(indices.end(), bindices[b].begin(), bindices[b].end());
+            values.insert(values.end(), bvalues[b].begin(), bvalues[b].end());
+        }
+        if (r == 0) {
+            indices.insert(indices.end(), add_indices.begin(), add_indices.end());
+            values.insert(values.end(), add_values.begin(), add_values.end());
+        }
+        Z.splice(runs[r].first, runs[r].second, indices, values);
+    }
+}
+
+}    // anonymous namespace
+
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    apply_patch(WeightedPatch const &patch)
+{
+    patch.check(shape());
+    PatchedSet const prows(patch.rows), pcols(patch.cols);
+
+    patch_zarray(weights[0],
+        [&prows](std::array<int,1> const &ix) { return prows.contains(ix[0]); },
+        patch.wM, frame_block_size, nthreads);
+    patch_zarray(M,
+        [&](std::array<int,2> const &ix)
+            { return prows.contains(ix[0]) || pcols.contains(ix[1]); },
+        patch.M, frame_block_size, nthreads);
+    patch_zarray(weights[1],
+        [&pcols](std::array<int,1> const &ix) { return pcols.contains(ix[0]); },
+        patch.Mw, frame_block_size, nthreads);
+
+    clear_cache();
+    changed();
+}
+
 // ======================================================
-Weighted_Compressed compress(Weighted_Eigen const &eigen)
+namespace {
+
+/** Encodes M into Z, block-framed (blocks of frame_block_size).
+Ranges of M's outer index (columns; or rows, if row-major) are
+encoded in parallel as separate pieces, then joined in order. */
+template<class ValueT, class EigenMatrixT>
+void compress_M(
+    ZArray<int,ValueT,2> &Z,
+    EigenMatrixT const &M,
+    Weighted_Eigen const &eigen,
+    int nthreads)
 {
-    Weighted_Compressed ret;
+    long const nouter = M.outerSize();
+    Progress progress("linear::compress", nouter);
+    std::array<long,2> const shape {
+        eigen.dims[0]->sparse_extent(), eigen.dims[1]->sparse_extent()};
+    long const nchunks = std::max(1L, std::min(nouter, 4L*nthreads));
+    std::vector<ZArray<int,ValueT,2>> parts(nchunks, ZArray<int,ValueT,2>(shape));
+    parallel_for(0, nchunks, nthreads, [&](long c0, long c1) {
+        for (long c=c0; c<c1; ++c) {
+            long const k0 = nouter * c / nchunks;
+            long const k1 = nouter * (c+1) / nchunks;
+            {auto accum(parts[c].accum(Weighted_CompressedT<ValueT>::frame_block_size));
+                for (long k=k0; k<k1; ++k) {
+                for (typename EigenMatrixT::InnerIterator ii(M,k); ii; ++ii) {
+                    accum.add({
+                        (int)eigen.dims[0]->to_sparse(ii.row()),
+                        (int)eigen.dims[1]->to_sparse(ii.col())},
+                        ii.value());
+                }}
+            }
+            progress.add(k1 - k0);
+        }
+    });
+    Z = ZArray<int,ValueT,2>::concat(parts);
+}
+
+}    // anonymous namespace
+
+template<class ValueT>
+Weighted_CompressedT<ValueT> compress(Weighted_Eigen const &eigen, int nthreads, bool by_rows)
+{
+    IBMISC_SCOPED_TIMER("linear::compress");
+    Weighted_CompressedT<ValueT> ret;
     ret.scaled = eigen.scaled;
     ret.conservative = eigen.conservative;
 
@@ -121,10 +729,21 @@ Weighted_Compressed compress(Weighted_Eigen const &eigen)
         ret.weights[0].accum()),
         eigen.wM);
 
-    spsparse::spcopy(
-        spsparse::accum::to_sparse(eigen.dims,
-        ret.M.accum()),
-        *eigen.M);
+    auto const &M(*eigen.M);
+    if (by_rows) {
+        Eigen::SparseMatrix<double,Eigen::RowMajor,int> const Mr(M);
+        compress_M(ret.M, Mr, eigen, std::max(nthreads, 1));
+        ret.M.index_blocks(nthreads);
+    } else if (nthreads <= 1 || M.outerSize() <= 1) {
+        Progress progress("linear::compress", M.outerSize());
+        spsparse::spcopy(
+            spsparse::accum::to_sparse(eigen.dims,
+            ret.M.accum()),
+            M);
+        progress.add(M.outerSize());
+    } else {
+        compress_M(ret.M, M, eigen, nthreads);
+    }
 
     spsparse::spcopy(
         spsparse::accum::to_sparse(
@@ -135,10 +754,26 @@ Weighted_Compressed compress(Weighted_Eigen const &eigen)
     return ret;
 }
 
-long Weighted_Compressed::nnz() const
+template<class ValueT>
+long Weighted_CompressedT<ValueT>::
+    nnz() const
     { return M.nnz(); }
 
-void Weighted_Compressed::_to_coo(
+template<class ValueT>
+MemoryFootprint Weighted_CompressedT<ValueT>::
+    memory_footprint(std::string const &name) const
+{
+    MemoryFootprint ret(name);
+    ret.add(weights[0].memory_footprint("wM"));
+    ret.add(M.memory_footprint("M"));
+    ret.add(weights[1].memory_footprint("Mw"));
+    ret.add(MemoryFootprint("decoded_cache", cache_nbytes()));
+    return ret;
+}
+
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    _to_coo(
     blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
     blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
     blitz::Array<double,1> &values) const      // Must bepre-allocated(nnz)
@@ -153,7 +788,9 @@ void Weighted_Compressed::_to_coo(
     }
 }
 
-void Weighted_Compressed::_get_weights(
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    _get_weights(
     int idim,    // 0=wM, 1=Mw
     blitz::Array<double,1> &w) const
 {
@@ -162,5 +799,104 @@ void Weighted_Compressed::_get_weights(
     }
 }
 
+template<class ValueT>
+void Weighted_CompressedT<ValueT>::
+    _build_active(std::vector<int> &active) const
+{
+    for (auto ii(weights[0].generator()); ++ii; ) {
+        if (ii->value() != 0) active.push_back(ii->index(0));
+    }
+    std::sort(active.begin(), active.end());
+    active.erase(std::unique(active.begin(), active.end()), active.end());
+}
+
+// ======================================================
+template<class ValueT>
+CompressedBuilder<ValueT>::CompressedBuilder(std::array<long,2> const &shape,
+    bool by_rows, int nthreads, bool conservative)
+    : _shape(shape), _by_rows(by_rows), _nthreads(std::max(nthreads, 1)),
+    _pending(false), _last_row(0)
+{
+    _W.conservative = conservative;
+    _W.scaled = false;
+    long const block_size = (by_rows || _nthreads > 1
+        ? Weighted_CompressedT<ValueT>::frame_block_size : 0);
+    _Maccum.reset(new MAccumT(_W.M.accum(block_size,
+        spsparse::ZVCodec::ZLIB, -1, false, _nthreads)));
+    _Maccum->set_shape(shape);
+    for (int i=0; i<2; ++i) _ixs[i].set_key_extent(shape[i]);
+}
+
+template<class ValueT>
+void CompressedBuilder<ValueT>::check_shape(std::array<long,2> const &shape) const
+{
+    for (int i=0; i<2; ++i) {
+        if (shape[i] >= 0 && shape[i] != _shape[i]) (*ibmisc_error)(-1,
+            "CompressedBuilder: shape (%ld, %ld) does not match (%ld, %ld)",
+            shape[0], shape[1], _shape[0], _shape[1]);
+    }
+}
+
+template<class ValueT>
+void CompressedBuilder<ValueT>::flush()
+{
+    if (!_pending) return;
+    if (!_Maccum) (*ibmisc_error)(-1,
+        "CompressedBuilder: add() after finish()");
+    if (_by_rows && _W.M.nnz() > 0 && _pending_index[0] < _last_row) (*ibmisc_error)(-1,
+        "CompressedBuilder: by_rows needs elements in row order (row %d after %d)",
+        _pending_index[0], _last_row);
+    _last_row = _pending_index[0];
+
+    _Maccum->add(_pending_index, _pending_value);
+    for (int i=0; i<2; ++i) {
+        int const ix = _ixs[i].insert(_pending_index[i], _sums[i].size());
+        if (ix == (int)_sums[i].size()) {
+            _sum_index[i].push_back(_pending_index[i]);
+            _sums[i].push_back(0);
+        }
+        _sums[i][ix] += _pending_value;
+    }
+    _pending = false;
+}
+
+template<class ValueT>
+Weighted_CompressedT<ValueT> CompressedBuilder<ValueT>::finish()
+{
+    IBMISC_SCOPED_TIMER("linear::CompressedBuilder::finish");
+    flush();
+    _Maccum.reset();    // Completes M
+    if (_by_rows) _W.M.index_blocks(_nthreads);
+
+    // Weights, in index order (as compress() writes them)
+    for (int i=0; i<2; ++i) {
+        auto accum(_W.weights[i].accum());
+        accum.set_shape({_shape[i]});
+        if (!_weights[i].empty()) {    // Given by add_weight()
+            std::stable_sort(_weights[i].begin(), _weights[i].end(),
+                [](std::pair<int,double> const &a, std::pair<int,double> const &b)
+                { return a.first < b.first; });
+            for (auto const &w : _weights[i]) accum.add({w.first}, w.second);
+            continue;
+        }
+
+        std::vector<int> order(_sums[i].size());
+        for (size_t k=0; k<order.size(); ++k) order[k] = k;
+        std::sort(order.begin(), order.end(),
+            [&](int a, int b) { return _sum_index[i][a] < _sum_index[i][b]; });
+        for (int k : order) accum.add({_sum_index[i][k]}, _sums[i][k]);
+    }
+    return std::move(_W);
+}
+
+// ======================================================
+template struct Weighted_Compressed_Decoded<double>;
+template struct Weighted_Compressed_Decoded<float>;
+template class Weighted_CompressedT<double>;
+template class Weighted_CompressedT<float>;
+template Weighted_Compressed compress<double>(Weighted_Eigen const &eigen, int nthreads, bool by_rows);
+template Weighted_Compressed_Float compress<float>(Weighted_Eigen const &eigen, int nthreads, bool by_rows);
+template class CompressedBuilder<double>;
+template class CompressedBuilder<float>;
 
 }}    // namespace
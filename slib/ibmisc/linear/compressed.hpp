@@ -1,8 +1,12 @@
 #ifndef IBMISC_LINEAR_COMPRESSED_HPP
 #define IBMISC_LINEAR_COMPRESSED_HPP
 
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <ibmisc/linear/linear.hpp>
 #include <ibmisc/zarray.hpp>
+#include <spsparse/flatmap.hpp>
 
 namespace ibmisc {
 namespace linear {
@@ -10,16 +14,95 @@ namespace linear {
 class Weighted_Eigen;
 
 // ==================================================================
-class Weighted_Compressed : public Weighted
-{
-    friend Weighted_Compressed compress(Weighted_Eigen &eigen);
+/** Uncompressed copy of a Weighted_Compressed, so repeated calls to
+apply_M() run a plain sparse multiply rather than re-inflating the
+ZArrays each time.  M is stored row-compressed over its active rows
+only, since the sparse index space may be much larger than nnz. */
+template<class ValueT>
+struct Weighted_Compressed_Decoded {
+    std::array<std::vector<int>,2> windex;        // {wM, Mw} indices
+    std::array<std::vector<ValueT>,2> wvalue;     // {wM, Mw} values
+
+    std::vector<int> rows;        // Active rows of M (sparse indexing)
+    std::vector<long> row_ptr;    // M entries for rows[r] are [row_ptr[r], row_ptr[r+1])
+    std::vector<int> cols;
+    std::vector<ValueT> vals;
 
+    // For the vector-major kernel: columns of M, renumbered densely
+    std::vector<int> acols;       // Distinct columns of M (sparse indexing)
+    std::vector<int> dcols;       // dcols[jj] = index of cols[jj] in acols
+
+    /** Resident memory held by this cache, in bytes. */
+    size_t nbytes() const;
+};
+
+// ==================================================================
+/** A Weighted matrix stored as zlib-compressed ZArrays.
+@tparam ValueT Storage type of M and weights: double, or float to halve
+    the memory footprint and bandwidth (about 7 significant digits).
+    Inner products are always accumulated in double. */
+template<class ValueT>
+class Weighted_CompressedT : public Weighted
+{
 public:
-    std::array<ZArray<int,double,1>, 2> weights;    // {wM, Mw}
-    ZArray<int,double,2> M;
+    typedef ValueT val_type;
+
+    std::array<ZArray<int,ValueT,1>, 2> weights;    // {wM, Mw}
+    ZArray<int,ValueT,2> M;
+
+private:
+    typedef Weighted_Compressed_Decoded<ValueT> DecodedT;
+
+    /** Max. bytes the decoded cache may use; 0 disables caching. */
+    size_t _cache_budget;
+    /** Built lazily by const methods; all access is under _decoded_mutex */
+    mutable std::unique_ptr<DecodedT> _decoded;
+    /** Serializes building _decoded, so several threads may call
+    apply_M() on the same matrix.  Held by pointer so the class stays
+    movable. */
+    std::unique_ptr<std::mutex> _decoded_mutex;
+
+    /** Builds the decoded cache (under the mutex), if enabled and
+    within budget.  Safe to call from several threads at once.
+    @return The cache, or NULL if apply_M() should decode on the fly. */
+    DecodedT const *decoded() const;
+
+    /** apply_M() multiply step with decoded cache, for (nvec, nA)
+    arrays: transposes into vector-major tiles, then multiplies. */
+    void _apply_M_tiled(
+        DecodedT const &dec,
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &Bs) const;
 
 public:
-    Weighted_Compressed() : Weighted(LinearType::COMPRESSED) {}
+    /** Min. number of vectors for which apply_M() will transpose
+    into vector-major tiles (when using the decoded cache). */
+    static int const vmajor_min_nvec = 4;
+    /** Number of vectors per tile */
+    static int const vmajor_tile_nvec = 64;
+
+    /** Type is LinearType::COMPRESSED (double) or COMPRESSED_FLOAT */
+    Weighted_CompressedT();
+
+    /** Opt in to caching a decoded copy of this matrix, built on the
+    first apply_M() / apply_weight().  If the decoded matrix would need
+    more than budget bytes, no cache is built.  Like clear_cache(),
+    must not run concurrently with the apply methods.
+    @param budget Memory limit for the cache (bytes); 0 disables and frees it. */
+    void set_cache_budget(size_t budget);
+
+    /** Drop the decoded cache.  Must be called if M or weights are
+    changed (eg via accum()) after the cache was built; as must
+    clear_active(), if weights[0] changed.
+    NOTE: Must not run concurrently with apply_M() or the other apply
+    methods on this matrix, which use the cache without holding a lock. */
+    void clear_cache();
+
+    /** Bytes the decoded cache would need for this matrix. */
+    size_t cache_nbytes_needed() const;
+
+    /** Bytes currently resident in the decoded cache (0 if none). */
+    size_t cache_nbytes() const;
 
     void set_shape(std::array<long,2> _shape);
 
@@ -35,17 +118,64 @@ public:
         bool zero_out=true) const;
 
     /** Computes out = M * As
-    NOTE: As and out cannot be the same! */
+    NOTE: As and out cannot be the same!
+
+    Vectors are interleaved in memory if As and out have stride 1 in
+    their first dimension: eg allocated as
+        blitz::Array<double,2>(nvec, nA, blitz::ColumnMajorArray<2>())
+    or as a .transpose(1,0) view of an (nA, nvec) array.  Then each
+    non-zero of M becomes a contiguous AXPY over nvec.  If they are
+    not, and nvec >= vmajor_min_nvec, the decoded cache is used to
+    transpose into vector-major tiles internally. */
     void apply_M(
         blitz::Array<double,2> const &As,
         blitz::Array<double,2> &out,
         AccumType accum_type=AccumType::REPLACE,
         bool force_conservation=true) const;
 
+    /** With the decoded cache, multiplies only the cached rows in
+    range.  Otherwise, decodes only the blocks of M that may hold rows
+    in range: few of them, if M was compressed by_rows (see compress()). */
+    void apply_M_rows(
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        long i0, long i1,
+        AccumType accum_type=AccumType::REPLACE) const;
+
+    /** Computes out = M^T * Bs by scattering the compressed stream.
+    With few vectors and the decoded cache, rows are split among
+    threads, each with its own output buffer (so the last bits may
+    depend on nthreads, unless reduce_mode is REPRODUCIBLE). */
+    void apply_MT(
+        blitz::Array<double,2> const &Bs,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE) const;
+
+    /** Computes As = M * As in place; needs scratch only for the
+    active (wM) part of the output. */
+    void apply_M_inplace(
+        blitz::Array<double,2> &As,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
     void ncio(NcIO &ncio, std::string const &vname);
 
     long nnz() const;
 
+    /** Includes the decoded cache, if built. */
+    MemoryFootprint memory_footprint(std::string const &name = "Weighted_Compressed") const;
+
+    /** Block size for block-framed encodings: used by apply_patch()
+    for arrays that were not framed, and by parallel compress(). */
+    static long const frame_block_size = 16384;
+
+    /** Patches M and the weights in place.  Blocks holding changed
+    rows or columns are decoded and re-encoded; the rest are copied
+    still compressed.  The first patch of a matrix that was not encoded
+    in blocks (eg from compress()) re-encodes it in blocks of
+    frame_block_size, so later patches are local. */
+    void apply_patch(WeightedPatch const &patch);
+
 protected:
     void _to_coo(
         blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
@@ -55,15 +185,135 @@ protected:
     void _get_weights(
         int idim,    // 0=wM, 1=Mw
         blitz::Array<double,1> &w) const;
+
+    /** Decodes only weights[0] */
+    void _build_active(std::vector<int> &active) const;
 };
 
-extern Weighted_Compressed compress(Weighted_Eigen const &eigen);
+template<> Weighted_CompressedT<double>::Weighted_CompressedT();
+template<> Weighted_CompressedT<float>::Weighted_CompressedT();
+extern template class Weighted_CompressedT<double>;
+extern template class Weighted_CompressedT<float>;
+
+typedef Weighted_CompressedT<double> Weighted_Compressed;
+typedef Weighted_CompressedT<float> Weighted_Compressed_Float;
+
+/** Compresses eigen; compress<float>() rounds M and weights to float
+@param nthreads If >1, encode pieces of M in parallel, in block-framed
+    form (blocks of frame_block_size).  Progress is reported to
+    ibmisc_progress.
+@param by_rows Encode M row by row, block-framed, and index its blocks
+    (ZArray::index_blocks()); so each block covers a narrow range of
+    rows, and apply_M_rows() decodes only what it needs. */
+template<class ValueT = double>
+Weighted_CompressedT<ValueT> compress(Weighted_Eigen const &eigen, int nthreads = 1, bool by_rows = false);
+
+extern template Weighted_Compressed compress<double>(Weighted_Eigen const &eigen, int nthreads, bool by_rows);
+extern template Weighted_Compressed_Float compress<float>(Weighted_Eigen const &eigen, int nthreads, bool by_rows);
+
+// ==================================================================
+/** Builds a Weighted_Compressed straight from accumulator output, so
+M is never held uncompressed (as a TupleList, Eigen matrix...): it is
+encoded as elements arrive.  Only the row and column sums (wM, Mw) are
+kept uncompressed, one entry per active row / column; they are
+encoded by finish().  Weights other than those sums (eg grid cell
+areas) may be given with add_weight() instead.
+
+Elements are in sparse indexing.  Repeated elements are summed if they
+arrive one after the other, as in consolidated, sorted output; any
+order is accepted, but row-major order compresses best (and is needed
+for by_rows).
+
+    CompressedBuilder<> builder({nB, nA});
+    spsparse::spcopy(builder.accum(), M);    // Or any accumulator chain
+    Weighted_Compressed BvA(builder.finish());
+*/
+template<class ValueT = double>
+class CompressedBuilder {
+public:
+    /** Accumulator feeding a CompressedBuilder */
+    class Accum {
+        CompressedBuilder *builder;
+    public:
+        typedef double val_type;
+        typedef int index_type;
+        static int const rank = 2;
 
+        Accum(CompressedBuilder *_builder) : builder(_builder) {}
 
+        void set_shape(std::array<long,2> const &shape)
+            { builder->check_shape(shape); }
 
+        void add(std::array<int,2> const &index, double value)
+            { builder->add(index, value); }
+    };
 
+private:
+    typedef typename ZArray<int,ValueT,2>::accum_type MAccumT;
 
+    Weighted_CompressedT<ValueT> _W;
+    std::array<long,2> const _shape;
+    bool const _by_rows;
+    int const _nthreads;
+    std::unique_ptr<MAccumT> _Maccum;    // Null once finished
+
+    // Element not yet encoded, in case more of it follows
+    bool _pending;
+    std::array<int,2> _pending_index;
+    double _pending_value;
+    int _last_row;    // Of the last element encoded (for by_rows)
+    std::array<std::vector<std::pair<int,double>>,2> _weights;    // See add_weight()
+
+    // Row / column sums: sums[i][ixs[i].find(index)]
+    std::array<spsparse::FlatIndexMap<int,int>,2> _ixs;
+    std::array<std::vector<int>,2> _sum_index;
+    std::array<std::vector<double>,2> _sums;
+
+    void flush();
+
+    void check_shape(std::array<long,2> const &shape) const;
+
+public:
+    /** @param by_rows Encode M block-framed, and index its blocks
+        (ZArray::index_blocks()); elements must then come in row order.
+        See compress().
+    @param nthreads Compress blocks of M on this many threads (implies
+        block-framed). */
+    CompressedBuilder(std::array<long,2> const &shape,
+        bool by_rows = false, int nthreads = 1,
+        bool conservative = true);
+
+    Accum accum()
+        { return Accum(this); }
+
+    void add(std::array<int,2> const &index, double value)
+    {
+        if (_pending && index == _pending_index) {
+            _pending_value += value;
+            return;
+        }
+        flush();
+        _pending = true;
+        _pending_index = index;
+        _pending_value = value;
+    }
+
+    /** Adds to wM (dim=0) or Mw (dim=1) in place of the sums of M.
+    If called at all for dim, only these weights are stored. */
+    void add_weight(int dim, int index, double value)
+        { _weights[dim].push_back(std::make_pair(index, value)); }
+
+    /** Number of elements of M encoded so far */
+    long nnz() const
+        { return _W.M.nnz(); }
+
+    /** Finishes encoding, and hands over the matrix.  The builder may
+    not be used after this. */
+    Weighted_CompressedT<ValueT> finish();
+};
 
+extern template class CompressedBuilder<double>;
+extern template class CompressedBuilder<float>;
 
 }};    // namespace
 #endif    // guad
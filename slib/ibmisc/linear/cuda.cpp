@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <ibmisc/linear/cuda.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/profile.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+namespace {
+
+void check(cudaError_t err, char const *what)
+{
+    if (err != cudaSuccess) (*ibmisc_error)(-1,
+        "%s failed: %s", what, cudaGetErrorString(err));
+}
+
+void check(cusparseStatus_t err, char const *what)
+{
+    if (err != CUSPARSE_STATUS_SUCCESS) (*ibmisc_error)(-1,
+        "%s failed: %s", what, cusparseGetErrorString(err));
+}
+
+/** Destroys a dense matrix descriptor when it goes out of scope */
+struct DnMatHolder {
+    cusparseDnMatDescr_t mat;
+    DnMatHolder() : mat(NULL) {}
+    ~DnMatHolder() { if (mat) cusparseDestroyDnMat(mat); }
+};
+
+}    // namespace (anonymous)
+
+template<class TypeT>
+TypeT *Weighted_CUDA::upload(std::vector<TypeT> const &vec)
+{
+    void *ptr;
+    d_alloc.reserve(d_alloc.size() + 1);    // So push_back() can't throw and leak ptr
+    check(cudaMalloc(&ptr, std::max((size_t)1, vec.size()) * sizeof(TypeT)), "cudaMalloc");
+    d_alloc.push_back(ptr);
+    if (vec.size() > 0) check(cudaMemcpy(ptr, &vec[0], vec.size() * sizeof(TypeT),
+        cudaMemcpyHostToDevice), "cudaMemcpy");
+    return (TypeT *)ptr;
+}
+
+Weighted_CUDA::Weighted_CUDA(Weighted const &W, long _batch, int _device)
+: Weighted(LinearType::CUDA, W.conservative, W.scaled),
+    _shape(W.shape()), _nnz(W.nnz()), device(_device), batch(_batch),
+    handle(NULL), d_M(NULL), d_w{{NULL, NULL}}
+{
+    if (batch < 1) (*ibmisc_error)(-1,
+        "Weighted_CUDA: batch=%ld must be positive", batch);
+    for (auto &slot : slots) {
+        slot.stream = NULL;
+        slot.h_in = slot.h_out = slot.d_in = slot.d_out = NULL;
+        slot.d_work = NULL;
+        slot.nwork = 0;
+    }
+
+    // The destructor won't run if we throw: free what was made so far
+    try {
+        init(W);
+    } catch(...) {
+        release();
+        throw;
+    }
+}
+
+void Weighted_CUDA::init(Weighted const &W)
+{
+    check(cudaSetDevice(device), "cudaSetDevice");
+
+    // ----------- Weights
+    for (int idim=0; idim<2; ++idim) {
+        blitz::Array<double,1> w;
+        W.get_weights(idim, w);
+        for (int i=0; i<w.extent(0); ++i) {
+            if (w(i) == 0) continue;
+            windex[idim].push_back(i);
+            wvalue[idim].push_back(w(i));
+        }
+    }
+
+    // ----------- M, as CSR (stable: keep the order within each row)
+    blitz::Array<int,1> indices0, indices1;
+    blitz::Array<double,1> values;
+    W.to_coo(indices0, indices1, values);
+    std::vector<long> perm(_nnz);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::stable_sort(perm.begin(), perm.end(),
+        [&](long a, long b) { return indices0(a) < indices0(b); });
+
+    rows = windex[0];
+    for (long n=0; n<_nnz; ++n) rows.push_back(indices0(n));
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+
+    std::vector<int> rowptr(rows.size()+1, 0);
+    std::vector<int> cols(_nnz);
+    std::vector<double> vals(_nnz);
+    for (long n=0; n<_nnz; ++n) {
+        long const e = perm[n];
+        ++rowptr[std::lower_bound(rows.begin(), rows.end(), indices0(e)) - rows.begin() + 1];
+        cols[n] = indices1(e);
+        vals[n] = values(e);
+    }
+    std::partial_sum(rowptr.begin(), rowptr.end(), rowptr.begin());
+
+    // ----------- Upload
+    check(cusparseCreate(&handle), "cusparseCreate");
+    d_rowptr = upload(rowptr);
+    d_cols = upload(cols);
+    d_vals = upload(vals);
+    check(cusparseCreateCsr(&d_M, rows.size(), _shape[1], _nnz,
+        d_rowptr, d_cols, d_vals,
+        CUSPARSE_INDEX_32I, CUSPARSE_INDEX_32I, CUSPARSE_INDEX_BASE_ZERO, CUDA_R_64F),
+        "cusparseCreateCsr");
+
+    for (int idim=0; idim<2; ++idim) {
+        std::vector<int> const wptr {0, (int)windex[idim].size()};
+        check(cusparseCreateCsr(&d_w[idim], 1, _shape[idim], windex[idim].size(),
+            upload(wptr), upload(windex[idim]), upload(wvalue[idim]),
+            CUSPARSE_INDEX_32I, CUSPARSE_INDEX_32I, CUSPARSE_INDEX_BASE_ZERO, CUDA_R_64F),
+            "cusparseCreateCsr");
+    }
+
+    // ----------- Staging
+    size_t const nin = batch * std::max(1L, _shape[1]);
+    size_t const nout = batch * std::max((size_t)1, rows.size());
+    for (auto &slot : slots) {
+        check(cudaStreamCreate(&slot.stream), "cudaStreamCreate");
+        check(cudaMallocHost((void **)&slot.h_in, nin * sizeof(double)), "cudaMallocHost");
+        check(cudaMallocHost((void **)&slot.h_out, nout * sizeof(double)), "cudaMallocHost");
+        check(cudaMalloc((void **)&slot.d_in, nin * sizeof(double)), "cudaMalloc");
+        check(cudaMalloc((void **)&slot.d_out, nout * sizeof(double)), "cudaMalloc");
+    }
+}
+
+void Weighted_CUDA::release()
+{
+    // No error checks: called from the destructor, and while unwinding
+    cudaSetDevice(device);
+    for (auto &slot : slots) {
+        if (slot.stream) {
+            cudaStreamSynchronize(slot.stream);
+            cudaStreamDestroy(slot.stream);
+        }
+        cudaFree(slot.d_work);    // cudaFree[Host](NULL) is a no-op
+        cudaFree(slot.d_out);
+        cudaFree(slot.d_in);
+        cudaFreeHost(slot.h_out);
+        cudaFreeHost(slot.h_in);
+    }
+    for (auto &A : d_w) if (A) cusparseDestroySpMat(A);
+    if (d_M) cusparseDestroySpMat(d_M);
+    if (handle) cusparseDestroy(handle);
+    for (void *ptr : d_alloc) cudaFree(ptr);
+}
+
+Weighted_CUDA::~Weighted_CUDA()
+{
+    release();
+}
+
+void Weighted_CUDA::spmm(cusparseSpMatDescr_t A, long nout, long nin, long nnz,
+    double const *d_in, long nvec, double *d_out, Slot &slot) const
+{
+    if (nout == 0 || nvec == 0) return;
+    if (nnz == 0) {
+        check(cudaMemsetAsync(d_out, 0, nout * nvec * sizeof(double), slot.stream),
+            "cudaMemsetAsync");
+        return;
+    }
+
+    // Column-major (n, nvec) is the memory layout of blitz (nvec, n)
+    DnMatHolder X, Y;
+    check(cusparseCreateDnMat(&X.mat, nin, nvec, nin, const_cast<double *>(d_in),
+        CUDA_R_64F, CUSPARSE_ORDER_COL), "cusparseCreateDnMat");
+    check(cusparseCreateDnMat(&Y.mat, nout, nvec, nout, d_out,
+        CUDA_R_64F, CUSPARSE_ORDER_COL), "cusparseCreateDnMat");
+
+    double const alpha = 1;
+    double const beta = 0;
+    check(cusparseSetStream(handle, slot.stream), "cusparseSetStream");
+    size_t nwork;
+    check(cusparseSpMM_bufferSize(handle,
+        CUSPARSE_OPERATION_NON_TRANSPOSE, CUSPARSE_OPERATION_NON_TRANSPOSE,
+        &alpha, A, X.mat, &beta, Y.mat, CUDA_R_64F, CUSPARSE_SPMM_ALG_DEFAULT, &nwork),
+        "cusparseSpMM_bufferSize");
+    if (nwork > slot.nwork) {
+        // cudaFree() waits for work still using the old buffer
+        check(cudaFree(slot.d_work), "cudaFree");
+        slot.d_work = NULL;
+        slot.nwork = 0;
+        check(cudaMalloc(&slot.d_work, nwork), "cudaMalloc");
+        slot.nwork = nwork;
+    }
+    check(cusparseSpMM(handle,
+        CUSPARSE_OPERATION_NON_TRANSPOSE, CUSPARSE_OPERATION_NON_TRANSPOSE,
+        &alpha, A, X.mat, &beta, Y.mat, CUDA_R_64F, CUSPARSE_SPMM_ALG_DEFAULT, slot.d_work),
+        "cusparseSpMM");
+}
+
+void Weighted_CUDA::apply_M_device(double const *d_As, long nvec, double *d_Bc) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    check(cudaSetDevice(device), "cudaSetDevice");
+    spmm(d_M, rows.size(), _shape[1], _nnz, d_As, nvec, d_Bc, slots[0]);
+}
+
+void Weighted_CUDA::apply_weight_device(int dim, double const *d_As, long nvec, double *d_out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    check(cudaSetDevice(device), "cudaSetDevice");
+    spmm(d_w[dim], 1, _shape[dim], windex[dim].size(), d_As, nvec, d_out, slots[0]);
+}
+
+void Weighted_CUDA::apply_weight(
+    int dim,    // 0=B, 1=A
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,1> &out,          // out(nvec)
+    bool zero_out) const
+{
+    auto const nvec(As.extent(0));
+    auto const &index(windex[dim]);
+    auto const &value(wvalue[dim]);
+
+    if (zero_out) out = 0;
+
+    // Each thread computes out(k) for its own range of vectors
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        for (size_t n=0; n<index.size(); ++n) {
+            for (long k=k0; k<k1; ++k) {
+                out(k) += value[n] * As(k,index[n]);
+            }
+        }
+    });
+}
+
+void Weighted_CUDA::apply_M(
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,2> &Bs,         // Bs(nvec, nB)
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    IBMISC_SCOPED_TIMER("Weighted_CUDA::apply_M");
+    auto const nvec(As.extent(0));
+    long const nA = _shape[1];
+    long const nr = rows.size();
+    long const nbatch = (nvec + batch - 1) / batch;
+
+    {std::lock_guard<std::mutex> lock(mutex);
+        check(cudaSetDevice(device), "cudaSetDevice");
+
+        // Batch b uses slot b%2: batch b is packed and sent while batch
+        // b-1 is multiplied, then batch b-1 is received and unpacked.
+        for (long b=0; b <= nbatch; ++b) {
+            if (b < nbatch) {
+                Slot &slot(slots[b%2]);
+                long const k0 = b*batch;
+                long const nb = std::min(batch, nvec - k0);
+                parallel_for(0, nb, nthreads, [&](long kk0, long kk1) {
+                    for (long kk=kk0; kk<kk1; ++kk) {
+                        double * const in = &slot.h_in[kk*nA];
+                        for (long j=0; j<nA; ++j) in[j] = As(k0+kk,j);
+                    }
+                });
+                check(cudaMemcpyAsync(slot.d_in, slot.h_in, nb*nA*sizeof(double),
+                    cudaMemcpyHostToDevice, slot.stream), "cudaMemcpyAsync");
+                spmm(d_M, nr, nA, _nnz, slot.d_in, nb, slot.d_out, slot);
+                check(cudaMemcpyAsync(slot.h_out, slot.d_out, nb*nr*sizeof(double),
+                    cudaMemcpyDeviceToHost, slot.stream), "cudaMemcpyAsync");
+            }
+
+            if (b > 0) {
+                Slot &slot(slots[(b-1)%2]);
+                long const k0 = (b-1)*batch;
+                long const nb = std::min(batch, nvec - k0);
+                check(cudaStreamSynchronize(slot.stream), "cudaStreamSynchronize");
+                parallel_for(0, nb, nthreads, [&](long kk0, long kk1) {
+                    for (long kk=kk0; kk<kk1; ++kk) {
+                        double const * const out = &slot.h_out[kk*nr];
+                        for (long r=0; r<nr; ++r) {
+                            auto &Bs_ki(Bs(k0+kk,rows[r]));
+                            switch(accum_type.index()) {
+                                case AccumType::REPLACE :
+                                    Bs_ki = out[r];
+                                break;
+                                case AccumType::REPLACE_OR_ACCUMULATE :
+                                    Bs_ki = (std::isnan(Bs_ki) ? out[r] : Bs_ki + out[r]);
+                                break;
+                                default :
+                                    Bs_ki += out[r];
+                                break;
+                            }
+                        }
+                    }
+                });
+            }
+        }
+    }
+
+    correct_conservation(As, Bs, windex[0], force_conservation);
+}
+
+void Weighted_CUDA::ncio(NcIO &ncio, std::string const &vname)
+{
+    (*ibmisc_error)(-1,
+        "Weighted_CUDA::ncio(%s): not supported; write the host matrix instead", vname.c_str());
+}
+
+void Weighted_CUDA::_to_coo(
+    blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+    blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+    blitz::Array<double,1> &values) const      // Must bepre-allocated(nnz)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    check(cudaSetDevice(device), "cudaSetDevice");
+
+    std::vector<int> rowptr(rows.size()+1);
+    std::vector<int> cols(_nnz);
+    std::vector<double> vals(_nnz);
+    check(cudaMemcpy(&rowptr[0], d_rowptr, rowptr.size()*sizeof(int),
+        cudaMemcpyDeviceToHost), "cudaMemcpy");
+    if (_nnz == 0) return;
+    check(cudaMemcpy(&cols[0], d_cols, _nnz*sizeof(int),
+        cudaMemcpyDeviceToHost), "cudaMemcpy");
+    check(cudaMemcpy(&vals[0], d_vals, _nnz*sizeof(double),
+        cudaMemcpyDeviceToHost), "cudaMemcpy");
+    for (size_t r=0; r<rows.size(); ++r) {
+        for (int n=rowptr[r]; n<rowptr[r+1]; ++n) {
+            indices0(n) = rows[r];
+            indices1(n) = cols[n];
+            values(n) = vals[n];
+        }
+    }
+}
+
+void Weighted_CUDA::_get_weights(
+    int idim,    // 0=wM, 1=Mw
+    blitz::Array<double,1> &w) const
+{
+    for (size_t n=0; n<windex[idim].size(); ++n) {
+        w(windex[idim][n]) += wvalue[idim][n];
+    }
+}
+
+}}    // namespace
@@ -0,0 +1,139 @@
+#ifndef IBMISC_LINEAR_CUDA_HPP
+#define IBMISC_LINEAR_CUDA_HPP
+
+#include <array>
+#include <mutex>
+#include <vector>
+#include <cuda_runtime.h>
+#include <cusparse.h>
+#include <ibmisc/linear/linear.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+// ==================================================================
+/** A Weighted matrix resident on a GPU.  It is uploaded once, at
+construction, as CSR over its active rows, and applied with cuSPARSE
+SpMM.
+
+apply_M() on host arrays streams the vectors through in batches on two
+CUDA streams, so the transfers of one batch overlap the multiplication
+of the other.  Fields that are already on the device can be regridded
+with apply_M_device() and apply_weight_device(), without any transfer.
+
+Weights are also kept on the host, where apply_weight() and the
+conservation correction run: they are O(n), cheaper than a round trip
+to the device.  Calls on one Weighted_CUDA are serialized.
+
+Experimental: built only with -DUSE_CUDA=YES, which is off by default. */
+class Weighted_CUDA : public Weighted
+{
+    /** Staging for one batch of vectors */
+    struct Slot {
+        cudaStream_t stream;
+        double *h_in, *h_out;    // Pinned host memory
+        double *d_in, *d_out;
+        void *d_work;            // cuSPARSE workspace
+        size_t nwork;
+    };
+
+    std::array<long,2> _shape;
+    long _nnz;
+    int const device;
+    long const batch;
+
+    /** Sparse index of each CSR row: the rows of M, plus rows of wM
+    with no entries (which apply_M() must still set). */
+    std::vector<int> rows;
+    /** Non-zero weights {wM, Mw}, on the host */
+    std::array<std::vector<int>, 2> windex;
+    std::array<std::vector<double>, 2> wvalue;
+
+    cusparseHandle_t handle;
+    cusparseSpMatDescr_t d_M;
+    std::array<cusparseSpMatDescr_t, 2> d_w;    // Weights, as 1-row matrices
+    std::vector<void *> d_alloc;                // Freed in destructor
+    int *d_rowptr, *d_cols;
+    double *d_vals;
+
+    mutable std::mutex mutex;
+    mutable std::array<Slot, 2> slots;
+
+    template<class TypeT>
+    TypeT *upload(std::vector<TypeT> const &vec);
+
+    /** Constructor body: builds and uploads everything */
+    void init(Weighted const &W);
+
+    /** Frees whatever has been allocated (NULL members are skipped) */
+    void release();
+
+    /** Enqueues out(nvec, nout) = A * in(nvec, nin) on slot.stream */
+    void spmm(cusparseSpMatDescr_t A, long nout, long nin, long nnz,
+        double const *d_in, long nvec, double *d_out, Slot &slot) const;
+
+public:
+    /** Uploads W to the device.
+    @param batch Vectors per transfer in apply_M()
+    @param device CUDA device to use */
+    Weighted_CUDA(Weighted const &W, long batch = 64, int device = 0);
+    ~Weighted_CUDA();
+
+    Weighted_CUDA(Weighted_CUDA const &) = delete;
+    Weighted_CUDA &operator=(Weighted_CUDA const &) = delete;
+
+    /** Rows of the compact output of apply_M_device() */
+    std::vector<int> const &active_rows() const
+        { return rows; }
+
+    /** Stream the *_device() calls are queued on */
+    cudaStream_t stream() const
+        { return slots[0].stream; }
+
+    /** Queues Bc = M * As on stream(), for fields already on the device.
+    No conservation correction.  Synchronize on stream() before using
+    the result.
+    @param d_As d_As(nvec, nA), row-major and contiguous (as blitz lays out As)
+    @param d_Bc d_Bc(nvec, active_rows().size()): the active rows only */
+    void apply_M_device(double const *d_As, long nvec, double *d_Bc) const;
+
+    /** Queues out = As * weights[dim] on stream(), on the device.
+    @param d_As d_As(nvec, ndim), row-major and contiguous
+    @param d_out d_out(nvec); overwritten */
+    void apply_weight_device(int dim, double const *d_As, long nvec, double *d_out) const;
+
+    // ================= Implements Weighted
+    std::array<long,2> shape() const
+        { return _shape; }
+
+    void apply_weight(
+        int dim,    // 0=B, 1=A
+        blitz::Array<double,2> const &As,    // As(nvec, ndim)
+        blitz::Array<double,1> &out,
+        bool zero_out=true) const;
+
+    void apply_M(
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    long nnz() const
+        { return _nnz; }
+
+    /** Not supported: write the matrix this was made from instead. */
+    void ncio(NcIO &ncio, std::string const &vname);
+
+protected:
+    void _to_coo(
+        blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+        blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+        blitz::Array<double,1> &values) const;      // Must bepre-allocated(nnz)
+
+    void _get_weights(
+        int idim,    // 0=wM, 1=Mw
+        blitz::Array<double,1> &w) const;
+};
+
+}}    // namespace
+#endif    // guard
@@ -1,6 +1,12 @@
+#include <climits>
 #include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/patch.hpp>
 #include <spsparse/eigen.hpp>
+#include <spsparse/reorder.hpp>
 #include <ibmisc/netcdf.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/profile.hpp>
+#include <ibmisc/transpose.hpp>
 
 using namespace spsparse;
 using namespace blitz;
@@ -9,18 +15,65 @@ namespace ibmisc {
 namespace linear {
 
 // ----------------------------------------------------------------
-static void mask_result(Weighted_Eigen::EigenDenseMatrixT &ret, blitz::Array<double,1> const &wB_b, double fill)
+typedef Eigen::Map<Weighted_Eigen::EigenDenseMatrixT> DenseMapT;
+
+/** Computes B = BvA.M * A (dense indexing, one column per variable)
+straight into B's memory; then the conservation correction (if
+needed) and mask, in one pass over B. */
+static void apply_dense(
+    Weighted_Eigen const &BvA,
+    DenseMapT const &A,    // A{jn}
+    DenseMapT &B,          // B{in}
+    double fill,           // Fill value for cells not in BvA matrix
+    bool force_conservation,
+    Weighted_Eigen::ApplyWorkspace &work)
 {
-    int nB = ret.rows();    // == wB_b.extent(0)
-    int nvar = ret.cols();
-
-    // Mask out cells that slipped into the output because they were
-    // in the SparseSet; but don't actually get any contribution.
-    for (int i=0; i<nB; ++i) {
-        if (wB_b(i) != 0.) continue;
-        for (int n=0; n<nvar; ++n) ret(i,n) = fill;
+    typedef Weighted_Eigen::EigenRowVectorT EigenRowVectorT;
+
+    if (BvA.M->cols() != A.rows()) (*ibmisc_error)(-1,
+        "BvA.cols=%d does not match A.rows=%d", BvA.M->cols(), A.rows());
+
+    // Apply initial regridding.
+    B.noalias() = *BvA.M * A;        // B{in}
+
+    // Only apply conservation correction if all of:
+    //   a) Matrix is smoothed, so it needs a conservation correction
+    //   b) User requested conservation be maintained
+    bool const correct = (!BvA.conservative && force_conservation);
+    auto &wB_b(BvA.wM);
+    if (correct) {
+        // Integrate each variable of input (A) and output (B) over full domain
+        auto &wA_b(BvA.Mw);
+        Eigen::Map<EigenRowVectorT const> const wA(wA_b.data(), 1, wA_b.extent(0));
+        Eigen::Map<EigenRowVectorT const> const wB(wB_b.data(), 1, wB_b.extent(0));
+        work.TA.noalias() = wA * A;    // TA{n}
+        work.TB.noalias() = wB * B;    // TB{n}
+    }
+
+    // Correct each variable; and mask out cells that slipped into
+    // the output because they were in the SparseSet, but don't
+    // actually get any contribution.
+    auto const &active(BvA.active_rows());
+    int const nB = B.rows();    // == wB_b.extent(0)
+    int const nvar = B.cols();
+    for (int n=0; n<nvar; ++n) {
+        double const factor = (correct ? work.TA(n) * (1. / work.TB(n)) : 1.);
+        double * const B_n = &B(0,n);
+        int i = 0;
+        for (int const a : active) {
+            for (; i<a; ++i) B_n[i] = fill;
+            B_n[i++] *= factor;
+        }
+        for (; i<nB; ++i) B_n[i] = fill;
     }
+}
 
+void Weighted_Eigen::ApplyWorkspace::report(std::ostream &os) const
+{
+    os << "-------- Eigen::apply() conservation" << std::endl;
+    os << "    |input|    = " << TA << std::endl;
+    os << "    |output|   = " << TB << std::endl;
+    os << "    correction = " << (TA.array() / TB.array()) << std::endl;
 }
 // -----------------------------------------------------------------------
 Weighted_Eigen::EigenDenseMatrixT Weighted_Eigen::apply_e(
@@ -29,62 +82,45 @@ Weighted_Eigen::EigenDenseMatrixT Weighted_Eigen::apply_e(
     double fill,     // Fill value for cells not in BvA matrix
     bool force_conservation) const
 {
-    auto &BvA(*this);
-
     // A{jn}   One col per variable
     int nvar = A_b.extent(0);
     int nA = A_b.extent(1);
 
-    Eigen::Map<EigenDenseMatrixT> const A(
-        const_cast<double *>(A_b.data()), nA, nvar);
-
     // |i| = size of output vector space (B)
     // |j| = size of input vector space (A)
     // |n| = number of variables being processed together
+    DenseMapT const A(const_cast<double *>(A_b.data()), nA, nvar);
 
+    EigenDenseMatrixT ret(M->rows(), nvar);
+    DenseMapT B(ret.data(), ret.rows(), ret.cols());
+    ApplyWorkspace work;
+    apply_dense(*this, A, B, fill, force_conservation, work);
+    return ret;
+}
 
-    if (BvA.M->cols() != A.rows()) (*ibmisc_error)(-1,
-        "BvA.cols=%d does not match A.rows=%d", BvA.M->cols(), A.rows());
-
-    // Apply initial regridding.
-    EigenDenseMatrixT B0(*BvA.M * A);        // B0{in}
-
-    // Only apply conservation correction if all of:
-    //   a) Matrix is smoothed, so it needs a conservation correction
-    //   b) User requested conservation be maintained
-    if (BvA.conservative || !force_conservation) {
-        // Remove cells not in the sparse matrix
-        mask_result(B0, BvA.wM, fill);
-        return B0;
-    }
-    // -------------- Apply the Conservation Correction
-    // Integrate each variable of input (A) over full domain
-    auto &wA_b(BvA.Mw);
-    Eigen::Map<EigenRowVectorT> const wA(const_cast<double *>(wA_b.data()), 1, wA_b.extent(0));
-    typedef Eigen::Array<double,Eigen::Dynamic,Eigen::Dynamic> EigenArrayT;
-    EigenArrayT TA((wA * A).array());        // TA{n} row array
-
-    // Integrate each variable of output (B) over full domain
-    auto &wB_b(BvA.wM);
-    int nB = wB_b.extent(0);
-    Eigen::Map<EigenRowVectorT> const wB(const_cast<double *>(wB_b.data()), 1, wB_b.extent(0));
-    EigenArrayT TB((wB * B0).array());
-    EigenArrayT TB_inv(1. / TB);    // TB_inv{n} row array
-
-    // Factor{nn}: Conservation correction for each variable.
-
-    auto Factor(TA * TB_inv);    // Factor{n} row array
-
-    std::cout << "-------- Eigen::apply() conservation" << std::endl;
-    std::cout << "    |input|    = " << TA << std::endl;
-    std::cout << "    |output|   = " << TB << std::endl;
-    std::cout << "    correction = " << Factor << std::endl;
-
-    EigenDenseMatrixT B1(B0 * Factor.matrix().asDiagonal());    // ret{in}
-    // Remove cells not in the sparse matrix
-    mask_result(B1, BvA.wM, fill);
-
-    return B1;
+void Weighted_Eigen::apply(
+    blitz::Array<double,2> const &A_b,       // A_b{nj} One row per variable
+    blitz::Array<double,2> &B_b,             // B_b{ni} One row per variable
+    double fill,
+    bool force_conservation,
+    ApplyWorkspace &work) const
+{
+    int const nvar = A_b.extent(0);
+    int const nA = A_b.extent(1);
+    int const nB = M->rows();
+    if (B_b.extent(0) != nvar || B_b.extent(1) != nB) (*ibmisc_error)(-1,
+        "Output must have shape (%d, %d), not (%d, %d)",
+        nvar, nB, B_b.extent(0), B_b.extent(1));
+
+    // Other storage orders go through C-order copies
+    blitz::Array<double,2> const A_c(c_contiguous(A_b, nthreads));
+    blitz::Array<double,2> B_c(B_b);
+    if (!is_c_contiguous(B_b)) B_c.reference(blitz::Array<double,2>(nvar, nB));
+
+    DenseMapT const A(const_cast<double *>(A_c.data()), nA, nvar);
+    DenseMapT B(B_c.data(), nB, nvar);
+    apply_dense(*this, A, B, fill, force_conservation, work);
+    if (B_c.data() != B_b.data()) copy_blitz(B_b, B_c, nthreads);
 }
 
 blitz::Array<double,2> Weighted_Eigen::apply(
@@ -94,7 +130,10 @@ blitz::Array<double,2> Weighted_Eigen::apply(
     bool force_conservation,
     ibmisc::TmpAlloc &tmp) const
 {
-    return spsparse::to_blitz<double>(apply_e(A_b, fill), tmp);
+    blitz::Array<double,2> ret(A_b.extent(0), M->rows());
+    ApplyWorkspace work;
+    apply(A_b, ret, fill, force_conservation, work);
+    return ret;
 }
 
 
@@ -106,9 +145,12 @@ blitz::Array<double,1> Weighted_Eigen::apply(
     bool force_conservation,
     ibmisc::TmpAlloc &tmp) const
 {
+    blitz::Array<double,1> ret(M->rows());
     auto A_b2(ibmisc::reshape<double,1,2>(A_b, {1, A_b.shape()[0]}));
-    auto ret2(spsparse::to_blitz(apply_e(A_b2, fill), tmp));
-    return ibmisc::reshape<double,2,1>(ret2, {ret2.shape()[1]});
+    auto ret2(ibmisc::reshape<double,1,2>(ret, {1, ret.shape()[0]}));
+    ApplyWorkspace work;
+    apply(A_b2, ret2, fill, force_conservation, work);
+    return ret;
 }
 // -----------------------------------------------------------------------
 // ---------------------------------------------------------
@@ -157,7 +199,7 @@ void Weighted_Eigen::ncio(ibmisc::NcIO &ncio, std::string const &vname,
     ncio_blitz_alloc<double,1>(ncio, wM, vname+".wM", get_nc_type<double>(),
         {ncdims[0]});
 
-    netCDF::NcVar ncvar = ncio.nc->getVar(vname + ".M.info");
+    netCDF::NcVar ncvar = ncio.getVar(vname + ".M.info");
     get_or_put_att(ncvar, ncio.rw,
         "conservative", get_nc_type<bool>(), &conservative, 1);
 }
@@ -187,7 +229,7 @@ void Weighted_Eigen::ncio(ibmisc::NcIO &ncio, std::string const &vname)
     } else {
         for (int i=0; i<2; ++i) {
             // Write dimension if not already written
-            if (ncio.nc->getVar(default_dim_names[i]).isNull()) {
+            if (ncio.getVar(default_dim_names[i]).isNull()) {
                 dims[i]->ncio(ncio, default_dim_names[i]);
             }
         }
@@ -203,17 +245,18 @@ void Weighted_Eigen::apply_weight(
 {
     auto &weights(_dim == 0 ? wM : Mw);
     auto &dim(*dims[_dim]);
-    auto const nvec(As.extent(0));
-    auto const nA(As.extent(1));
 
     if (zero_out) out = 0;
 
+    // All vectors at once; see apply_weight_gemv()
+    std::vector<int> windex;
+    std::vector<double> wvalue;
     for (int j_d=0; j_d < dim.dense_extent(); ++j_d) {
-        int const j_s = dim.to_sparse(j_d);
-        for (int k=0; k<nvec; ++k) {
-            out(k) += weights(j_d) * As(k,j_s);
-        }
+        if (weights(j_d) == 0) continue;
+        windex.push_back(dim.to_sparse(j_d));
+        wvalue.push_back(weights(j_d));
     }
+    apply_weight_gemv(windex, wvalue, As, out, nthreads);
 }
 
 /** Sparse shape of the matrix */
@@ -221,6 +264,62 @@ std::array<long,2> Weighted_Eigen::shape() const
     { return std::array<long,2>{dims[0]->sparse_extent(), dims[1]->sparse_extent()}; }
 
 
+/** @return Dense indices j_d with weights(j_d) != 0, ascending */
+static std::vector<int> nonzero_indices(blitz::Array<double,1> const &weights)
+{
+    std::vector<int> ret;
+    for (int j_d=0; j_d<weights.extent(0); ++j_d) if (weights(j_d) != 0.) ret.push_back(j_d);
+    return ret;
+}
+
+void Weighted_Eigen::_build_active(std::vector<int> &active) const
+    { active = nonzero_indices(wM); }
+
+/** Stores X_d (dense, column per vector) into the active part of X_s
+(sparse).  (Skips nullspace that crept into dense.)
+@param active Dense indices of the active part */
+static void store_dense(
+    Weighted_Eigen::SparseSetT const &dim,
+    std::vector<int> const &active,
+    Weighted_Eigen::EigenDenseMatrixT const &X_d,
+    blitz::Array<double,2> &X_s,
+    AccumType accum_type,
+    int nthreads)
+{
+    int const n_n = X_s.extent(0);
+
+    // Threads own disjoint sets of output rows
+    parallel_for(0, active.size(), nthreads, [&](long jb0, long jb1) {
+        switch(accum_type.value()) {
+            case AccumType::REPLACE :
+                for (long jb=jb0; jb < jb1; ++jb) {
+                    int const j_d = active[jb];
+                    int j_s = dim.to_sparse(j_d);
+                    for (int n=0; n < n_n; ++n) X_s(n,j_s) = X_d(j_d,n);
+                }
+            break;
+            case AccumType::ACCUMULATE :
+                for (long jb=jb0; jb < jb1; ++jb) {
+                    int const j_d = active[jb];
+                    int j_s = dim.to_sparse(j_d);
+                    for (int n=0; n < n_n; ++n) X_s(n,j_s) += X_d(j_d,n);
+                }
+            break;
+            case AccumType::REPLACE_OR_ACCUMULATE :
+                for (long jb=jb0; jb < jb1; ++jb) {
+                    int const j_d = active[jb];
+                    int j_s = dim.to_sparse(j_d);
+                    for (int n=0; n < n_n; ++n) {
+                        auto &oval(X_s(n,j_s));
+                        if (std::isnan(oval)) oval = X_d(j_d,n);
+                        else oval += X_d(j_d,n);
+                    }
+                }
+            break;
+        }
+    });
+}
+
 /** Compute M * As */
 void Weighted_Eigen::apply_M(
     blitz::Array<double,2> const &A_s,
@@ -228,6 +327,8 @@ void Weighted_Eigen::apply_M(
     AccumType accum_type,
     bool force_conservation) const
 {
+    IBMISC_SCOPED_TIMER("Weighted_Eigen::apply_M");
+    profile::work(M->nonZeros());
     // TODO: Re-do this method, to work without copying over the matrix.
     //       This would have to stop using Eigen's facilities
 
@@ -242,43 +343,60 @@ void Weighted_Eigen::apply_M(
     blitz::Array<double,2> A_d(n_n, adim.dense_extent());
 
     // Densify the A matrix
-    for (int j_d=0; j_d < adim.dense_extent(); ++j_d) {
-        int const j_s = adim.to_sparse(j_d);
-        for (int n=0; n < n_n; ++n) {
-            A_d(n,j_d) = A_s(n,j_s);
+    parallel_for(0, adim.dense_extent(), nthreads, [&](long j0, long j1) {
+        for (int j_d=j0; j_d < j1; ++j_d) {
+            int const j_s = adim.to_sparse(j_d);
+            for (int n=0; n < n_n; ++n) {
+                A_d(n,j_d) = A_s(n,j_s);
+            }
         }
-    }
+    });
+
+    // Apply...  Each variable is regridded (and conservation-corrected)
+    // independently; so split the variables among threads.  Rows of
+    // A_d are contiguous, so each slice maps straight onto Eigen.
+    EigenDenseMatrixT B_d_eigen(M->rows(), n_n);    // Column major indexing
+    active_rows();    // Build it once, before threads share it
+    parallel_for(0, n_n, nthreads, [&](long n0, long n1) {
+        DenseMapT const A(A_d.data() + n0*A_d.extent(1), A_d.extent(1), n1-n0);
+        DenseMapT B(B_d_eigen.data() + n0*B_d_eigen.rows(), B_d_eigen.rows(), n1-n0);
+        ApplyWorkspace work;
+        apply_dense(*this, A, B, 0, force_conservation, work);
+    });
+
+    store_dense(bdim, active_rows(), B_d_eigen, B_s, accum_type, nthreads);
+}
 
-    // Apply...
-    auto B_d_eigen(apply_e(A_d, 0, force_conservation));    // Column major indexing
+/** Compute M^T * Bs */
+void Weighted_Eigen::apply_MT(
+    blitz::Array<double,2> const &B_s,
+    blitz::Array<double,2> &A_s,
+    AccumType accum_type) const
+{
+    auto &bdim(*dims[0]);
+    auto &adim(*dims[1]);
+    int n_n = B_s.extent(0);
+
+    // Densify B
+    EigenDenseMatrixT B_d(bdim.dense_extent(), n_n);
+    parallel_for(0, bdim.dense_extent(), nthreads, [&](long j0, long j1) {
+        for (int j_d=j0; j_d < j1; ++j_d) {
+            int const j_s = bdim.to_sparse(j_d);
+            for (int n=0; n < n_n; ++n) B_d(j_d,n) = B_s(n,j_s);
+        }
+    });
 
-    switch(accum_type.value()) {
-        case AccumType::REPLACE :
-            for (int j_d=0; j_d < bdim.dense_extent(); ++j_d) {
-                if (wM(j_d) == 0.) continue;    // Skip nullspace that crept into dense
-                int j_s = bdim.to_sparse(j_d);
-                for (int n=0; n < n_n; ++n) B_s(n,j_s) = B_d_eigen(j_d,n);
-            }
-        break;
-        case AccumType::ACCUMULATE :
-            for (int j_d=0; j_d < bdim.dense_extent(); ++j_d) {
-                if (wM(j_d) == 0.) continue;    // Skip nullspace that crept into dense
-                int j_s = bdim.to_sparse(j_d);
-                for (int n=0; n < n_n; ++n) B_s(n,j_s) += B_d_eigen(j_d,n);
-            }
-        break;
-        case AccumType::REPLACE_OR_ACCUMULATE :
-            for (int j_d=0; j_d < bdim.dense_extent(); ++j_d) {
-                if (wM(j_d) == 0.) continue;    // Skip nullspace that crept into dense
-                int j_s = bdim.to_sparse(j_d);
-                for (int n=0; n < n_n; ++n) {
-                    auto &oval(B_s(n,j_s));
-                    if (std::isnan(oval)) oval = B_d_eigen(j_d,n);
-                    else oval += B_d_eigen(j_d,n);
-                }
-            }
-        break;
+    // Eigen's transposed view: M^T is never formed
+    EigenDenseMatrixT A_d(adim.dense_extent(), n_n);
+    if (nthreads <= 1 || n_n <= 1) {
+        A_d = M->transpose() * B_d;
+    } else {
+        parallel_for(0, n_n, nthreads, [&](long n0, long n1) {
+            A_d.middleCols(n0, n1-n0) = M->transpose() * B_d.middleCols(n0, n1-n0);
+        });
     }
+
+    store_dense(adim, nonzero_indices(Mw), A_d, A_s, accum_type, nthreads);
 }
 
 void Weighted_Eigen::apply_M_inplace(
@@ -295,19 +413,108 @@ long Weighted_Eigen::nnz() const
     return M->nonZeros();
 }
 
+/** Dense vector of doubles */
+static MemoryFootprint blitz_footprint(std::string const &name, blitz::Array<double,1> const &w)
+    { return MemoryFootprint(name, w.data() ? w.size() * sizeof(double) : 0); }
+
+MemoryFootprint Weighted_Eigen::memory_footprint(std::string const &name) const
+{
+    MemoryFootprint ret(name);
+    ret.add(blitz_footprint("wM", wM));
+    if (M.get()) {
+        // Compressed column storage: values and inner indices, plus outer index
+        size_t const entry = sizeof(double) + sizeof(int);
+        size_t const outer = (M->outerSize() + 1) * sizeof(int)
+            + (M->isCompressed() ? 0 : M->outerSize() * sizeof(int));
+        ret.add(MemoryFootprint("M",
+            M->nonZeros() * entry + outer,
+            M->data().allocatedSize() * entry + outer));
+    }
+    ret.add(blitz_footprint("Mw", Mw));
+    for (int i=0; i<2; ++i) {
+        if (dims[i]) ret.add(dims[i]->memory_footprint(i == 0 ? "dims[0]" : "dims[1]"));
+    }
+    ret.add(tmp.memory_footprint("tmp"));
+    return ret;
+}
+
+/** Resizes w to n, keeping its values and zeroing the rest */
+static void grow(blitz::Array<double,1> &w, int n)
+{
+    if (w.extent(0) == n) return;
+    blitz::Array<double,1> w2(n);
+    w2 = 0;
+    for (int i=0; i<w.extent(0); ++i) w2(i) = w(i);
+    w.reference(w2);
+}
+
+void Weighted_Eigen::apply_patch(WeightedPatch const &patch)
+{
+    patch.check(shape());
+
+    // New rows / columns need dense indices
+    for (auto ii=patch.M.begin(); ii != patch.M.end(); ++ii) {
+        dims[0]->add_dense(ii->index(0));
+        dims[1]->add_dense(ii->index(1));
+    }
+    for (auto ii=patch.wM.begin(); ii != patch.wM.end(); ++ii)
+        dims[0]->add_dense(ii->index(0));
+    for (auto ii=patch.Mw.begin(); ii != patch.Mw.end(); ++ii)
+        dims[1]->add_dense(ii->index(0));
+
+    int const nB = dims[0]->dense_extent();
+    int const nA = dims[1]->dense_extent();
+    M->conservativeResize(nB, nA);
+    grow(wM, nB);
+    grow(Mw, nA);
+
+    // Clear changed rows and columns
+    std::vector<char> rmask(nB, 0), cmask(nA, 0);
+    int ix;
+    for (long const i : patch.rows) {
+        if (dims[0]->to_dense_ignore_missing(i, ix)) {
+            rmask[ix] = 1;
+            wM(ix) = 0;
+        }
+    }
+    for (long const j : patch.cols) {
+        if (dims[1]->to_dense_ignore_missing(j, ix)) {
+            cmask[ix] = 1;
+            Mw(ix) = 0;
+        }
+    }
+    M->prune([&](int i, int j, double) { return !(rmask[i] || cmask[j]); });
+
+    // Add new entries
+    std::vector<Eigen::Triplet<double,int>> triplets;
+    triplets.reserve(patch.M.tuples.size());
+    for (auto ii=patch.M.begin(); ii != patch.M.end(); ++ii) {
+        triplets.push_back(Eigen::Triplet<double,int>(
+            dims[0]->to_dense(ii->index(0)), dims[1]->to_dense(ii->index(1)), ii->value()));
+    }
+    EigenSparseMatrixT P(nB, nA);
+    P.setFromTriplets(triplets.begin(), triplets.end());
+    *M += P;
+
+    for (auto ii=patch.wM.begin(); ii != patch.wM.end(); ++ii)
+        wM(dims[0]->to_dense(ii->index(0))) += ii->value();
+    for (auto ii=patch.Mw.begin(); ii != patch.Mw.end(); ++ii)
+        Mw(dims[1]->to_dense(ii->index(0))) += ii->value();
+    changed();
+}
+
 void Weighted_Eigen::_to_coo(
     blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
     blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
     blitz::Array<double,1> &values) const      // Must be pre-allocated(nnz)
 {
-    long nnz = this->nnz();
     long j = 0;
-    for (auto ii(begin(*M)); ii != end(*M); ++ii) {
-        indices0(j) = dims[0]->to_sparse(ii->index(0));
-        indices1(j) = dims[1]->to_sparse(ii->index(1));
-        values(j) = ii->value();
+    spsparse::visit(*M, [&](long i0, long i1, double val) {
+        indices0(j) = dims[0]->to_sparse(i0);
+        indices1(j) = dims[1]->to_sparse(i1);
+        values(j) = val;
         ++j;
-    }
+    });
 }
 
 void Weighted_Eigen::_get_weights(
@@ -321,4 +528,90 @@ void Weighted_Eigen::_get_weights(
     }
 }
 
+// ----------------------------------------------------------------
+/** Places w(i) at w(new_of_old[i]) */
+static void permute_weights(blitz::Array<double,1> &w, std::vector<int> const &old_of_new)
+{
+    blitz::Array<double,1> w2(w.extent(0));
+    for (size_t n=0; n<old_of_new.size(); ++n) w2(n) = w(old_of_new[n]);
+    w.reference(w2);
+}
+
+void permute_dense(
+    Weighted_Eigen::SparseSetT &dim,
+    std::vector<int> const &old_of_new,
+    std::vector<Weighted_Eigen *> const &Ws)
+{
+    typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> PermT;
+
+    // Checks old_of_new too
+    dim.permute_dense(old_of_new);
+
+    // Eigen permutations map old index i to P.indices()[i]
+    int const n = old_of_new.size();
+    PermT P(n);
+    for (int k=0; k<n; ++k) P.indices()[old_of_new[k]] = k;
+
+    for (Weighted_Eigen *W : Ws) {
+        bool const rows = (W->dims[0] == &dim);
+        bool const cols = (W->dims[1] == &dim);
+        if (!rows && !cols) (*ibmisc_error)(-1,
+            "permute_dense(): a matrix does not use this dimension");
+
+        auto &M(*W->M);
+        if (rows) {
+            if (M.rows() != n || W->wM.extent(0) != n) (*ibmisc_error)(-1,
+                "permute_dense(): matrix has %ld rows; dimension has %d",
+                (long)M.rows(), n);
+            Weighted_Eigen::EigenSparseMatrixT M2(P * M);
+            M.swap(M2);
+            permute_weights(W->wM, old_of_new);
+        }
+        if (cols) {
+            if (M.cols() != n || W->Mw.extent(0) != n) (*ibmisc_error)(-1,
+                "permute_dense(): matrix has %ld columns; dimension has %d",
+                (long)M.cols(), n);
+            Weighted_Eigen::EigenSparseMatrixT M2(M * P.transpose());
+            M.swap(M2);
+            permute_weights(W->Mw, old_of_new);
+        }
+        M.makeCompressed();
+        W->changed();
+    }
+}
+
+std::vector<int> rcm_order(Weighted_Eigen const &W, int idim)
+{
+    // Pattern of M, and the graph through the other dimension
+    Weighted_Eigen::EigenSparseMatrixT S(*W.M);
+    S.coeffs().setOnes();
+    Weighted_Eigen::EigenSparseMatrixT St(S.transpose());
+    Weighted_Eigen::EigenSparseMatrixT G(idim == 0 ? S * St : St * S);
+    G.makeCompressed();
+
+    // Column-major and symmetric: column v lists the neighbors of v
+    std::vector<long> adj_ptr(G.outerIndexPtr(), G.outerIndexPtr() + G.outerSize() + 1);
+    std::vector<int> adj(G.innerIndexPtr(), G.innerIndexPtr() + G.nonZeros());
+    return spsparse::rcm_order(adj_ptr, adj);
+}
+
+std::vector<int> first_touch_order(Weighted_Eigen const &W, int idim)
+{
+    auto const &M(*W.M);
+    int const n = (idim == 0 ? M.rows() : M.cols());
+    std::vector<int> first(n, INT_MAX);
+    for (int j=0; j<M.outerSize(); ++j) {
+        for (Weighted_Eigen::EigenSparseMatrixT::InnerIterator ii(M,j); ii; ++ii) {
+            int &f(first[idim == 0 ? ii.row() : ii.col()]);
+            f = std::min(f, idim == 0 ? (int)ii.col() : (int)ii.row());
+        }
+    }
+
+    std::vector<int> ret(n);
+    for (int i=0; i<n; ++i) ret[i] = i;
+    std::stable_sort(ret.begin(), ret.end(),
+        [&first](int a, int b) { return first[a] < first[b]; });
+    return ret;
+}
+
 }}    // namespace
@@ -1,12 +1,33 @@
 #ifndef IBMISC_LINEAR_EIGEN_HPP
 #define IBMISC_LINEAR_EIGEN_HPP
 
+#include <iosfwd>
 #include <memory>
 #include <Eigen/SparseCore>
 #include <spsparse/SparseSet.hpp>
 #include <ibmisc/linear/linear.hpp>
+#include <ibmisc/snapshot.hpp>
 
 namespace ibmisc {
+
+/** Snapshot (see snapshot.hpp) of a sparse matrix, in compressed form */
+template<class ArchiveT>
+void snapshot_io(ArchiveT &ar, Eigen::SparseMatrix<double,0,int> &M)
+{
+    if (!ArchiveT::is_loading::value && !M.isCompressed()) M.makeCompressed();
+    int64_t rows = M.rows(), cols = M.cols(), nnz = M.nonZeros();
+    ar & rows & cols & nnz;
+    if (ArchiveT::is_loading::value) {
+        M.resize(rows, cols);
+        M.resizeNonZeros(nnz);
+    }
+    _snapshot::io_n(ar, M.outerIndexPtr(), cols + 1);
+    if (nnz > 0) {
+        _snapshot::io_n(ar, M.innerIndexPtr(), nnz);
+        _snapshot::io_n(ar, M.valuePtr(), nnz);
+    }
+}
+
 namespace linear {
 
 /** Return value of a sparse matrix */
@@ -62,6 +83,31 @@ struct Weighted_Eigen : public Weighted {
         bool force_conservation=true) const;     // Set if you want apply_e() to conserve, even if !M->conservative
 
 
+    /** Scratch space for apply(); keep one per thread and reuse it,
+    so repeated calls do not allocate. */
+    struct ApplyWorkspace {
+        /** After a conservation-corrected apply(): integral of each
+        variable's input and (uncorrected) output, for diagnostics */
+        EigenRowVectorT TA, TB;
+
+        /** Prints the conservation correction of the last apply() */
+        void report(std::ostream &os) const;
+    };
+
+    /** Applies the regrid matrix, writing into B_b; allocates nothing
+    (beyond work, the first time).  Conservation scaling and the fill
+    of cells not in BvA are done in one pass over B_b.
+    Arrays in other storage orders (eg Fortran) are copied through
+    C-order temporaries (see copy_blitz()), which are allocated.
+    @param A_b A_b{nj} One row per variable
+    @param B_b B_b{ni} Output, allocated by the caller (nvar, nB) */
+    void apply(
+        blitz::Array<double,2> const &A_b,
+        blitz::Array<double,2> &B_b,
+        double fill,
+        bool force_conservation,
+        ApplyWorkspace &work) const;
+
     /** Apply to multiple variables
     @return Blitz type */
     blitz::Array<double,2> apply(
@@ -106,6 +152,12 @@ struct Weighted_Eigen : public Weighted {
         AccumType accum_type=AccumType::REPLACE,
         bool force_conservation=true) const;
 
+    /** Computes out = M^T * Bs, using Eigen's transposed view of M */
+    void apply_MT(
+        blitz::Array<double,2> const &Bs,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE) const;
+
     void apply_M_inplace(
         blitz::Array<double,2> &As,
         AccumType accum_type=AccumType::REPLACE,
@@ -113,6 +165,35 @@ struct Weighted_Eigen : public Weighted {
 
     long nnz() const;
 
+    /** Includes dims, which may be shared with other matrices. */
+    MemoryFootprint memory_footprint(std::string const &name = "Weighted_Eigen") const;
+
+    /** Snapshots include dims.  On load, missing dims are allocated in
+    tmp; existing ones (eg shared with another matrix) are overwritten. */
+    template<class ArchiveT>
+    void serialize(ArchiveT &ar, const unsigned int file_version)
+    {
+        ar & conservative;
+        ar & scaled;
+        for (int i=0; i<2; ++i) {
+            bool has_dim = (dims[i] != nullptr);
+            ar & has_dim;
+            if (!has_dim) continue;
+            if (ArchiveT::is_loading::value && !dims[i]) dims[i] = tmp.newptr<SparseSetT>();
+            ar & *dims[i];
+        }
+        ar & wM;
+        if (ArchiveT::is_loading::value) M.reset(new EigenSparseMatrixT);
+        ar & *M;
+        ar & Mw;
+        if (ArchiveT::is_loading::value) changed();
+    }
+
+    /** Patches M, wM and Mw in place.  New rows and columns are added
+    to dims; if they are shared with other matrices, those see the
+    larger dense space too. */
+    void apply_patch(WeightedPatch const &patch);
+
 protected:
     void _to_coo(
         blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
@@ -122,8 +203,34 @@ protected:
     void _get_weights(
         int idim,    // 0=wM, 1=Mw
         blitz::Array<double,1> &w) const;
+
+    /** Active rows are where wM != 0 (dense indexing) */
+    void _build_active(std::vector<int> &active) const;
 };
 
+// ----------------------------------------------------------------
+// Renumbering dense spaces for locality (see spsparse/reorder.hpp)
+
+/** Renumbers the dense space of dim (see SparseSet::permute_dense()),
+and rewrites M, wM and Mw of each matrix in Ws that uses dim, as
+dims[0] and/or dims[1], to match.  Every matrix sharing dim must be
+listed, or it will be left with stale dense indices. */
+extern void permute_dense(
+    Weighted_Eigen::SparseSetT &dim,
+    std::vector<int> const &old_of_new,
+    std::vector<Weighted_Eigen *> const &Ws);
+
+/** Reverse Cuthill-McKee ordering of W.dims[idim], over the graph
+that links two indices sharing an element of M along the other
+dimension (the pattern of M*M^T for idim=0, M^T*M for idim=1). */
+extern std::vector<int> rcm_order(Weighted_Eigen const &W, int idim);
+
+/** Orders W.dims[idim] by the first index along the other dimension
+that touches it (ties, and indices not in M, keep their current
+order).  Eg after renumbering the rows of BvA along a Hilbert curve,
+this numbers the columns in the order the rows gather them. */
+extern std::vector<int> first_touch_order(Weighted_Eigen const &W, int idim);
+
 
 }}    // namespace
 #endif
@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <ibmisc/linear/family.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/profile.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+namespace {
+
+/** One member to apply: its values, and where the result goes */
+struct FamilyJob {
+    double const *vals;      // [nnz]
+    double const *wM;        // [windex[0].size()]
+    double const *Mw;        // [windex[1].size()]
+    blitz::Array<double,2> *out;
+};
+
+/** @return Position of x in [begin, end), which is sorted; or -1 */
+template<class IterT, class T>
+long find_sorted(IterT begin, IterT end, T const &x)
+{
+    auto ii(std::lower_bound(begin, end, x));
+    return (ii == end || *ii != x) ? -1 : ii - begin;
+}
+
+/** Shared kernel of the apply_M() variants */
+void apply_jobs(
+    Weighted_Family const &fam,
+    std::vector<FamilyJob> const &jobs,
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    AccumType accum_type,
+    bool force_conservation)
+{
+    IBMISC_SCOPED_TIMER("Weighted_Family::apply_M");
+    long const nvec = As.extent(0);
+    long const nq = jobs.size();
+    if (As.extent(1) != fam.shape()[1]) (*ibmisc_error)(-1,
+        "Input has %d columns; the family's matrices have %ld",
+        As.extent(1), fam.shape()[1]);
+    for (auto const &job : jobs) {
+        if (job.out->extent(0) != nvec || job.out->extent(1) != fam.shape()[0]) (*ibmisc_error)(-1,
+            "Output must have shape (%ld, %ld), not (%d, %d)",
+            nvec, fam.shape()[0], job.out->extent(0), job.out->extent(1));
+    }
+
+    // Prepare the active space; threads own disjoint sets of rows
+    auto const &active(fam.windex[0]);
+    parallel_for(0, active.size(), fam.nthreads, [&](long a0, long a1) {
+        for (auto const &job : jobs) {
+            auto &out(*job.out);
+            for (long a=a0; a<a1; ++a) {
+                int const i = active[a];
+                switch(accum_type.index()) {
+                    case AccumType::REPLACE :
+                        for (long k=0; k<nvec; ++k) out(k,i) = 0;
+                    break;
+                    case AccumType::REPLACE_OR_ACCUMULATE :
+                        for (long k=0; k<nvec; ++k) if (std::isnan(out(k,i))) out(k,i) = 0;
+                    break;
+                }
+            }
+        }
+    });
+
+    // Multiply: each entry of As is read once for all members
+    parallel_for(0, fam.rows.size(), fam.nthreads, [&](long r0, long r1) {
+        std::vector<double> sum(nq);
+        for (long r=r0; r<r1; ++r) {
+            int const i = fam.rows[r];
+            for (long k=0; k<nvec; ++k) {
+                std::fill(sum.begin(), sum.end(), 0.);
+                for (long jj=fam.row_ptr[r]; jj<fam.row_ptr[r+1]; ++jj) {
+                    double const a = As(k,fam.cols[jj]);
+                    for (long q=0; q<nq; ++q) sum[q] += jobs[q].vals[jj] * a;
+                }
+                for (long q=0; q<nq; ++q) (*jobs[q].out)(k,i) += sum[q];
+            }
+        }
+    });
+
+    if (!force_conservation || fam.conservative) return;
+
+    // Correction factor for each member and variable
+    auto const &index0(fam.windex[0]);
+    auto const &index1(fam.windex[1]);
+    std::vector<double> factor(nq * nvec);
+    parallel_for(0, nq * nvec, fam.nthreads, [&](long n0, long n1) {
+        for (long n=n0; n<n1; ++n) {
+            long const q = n / nvec;
+            long const k = n % nvec;
+            auto const &out(*jobs[q].out);
+            double wA = 0, wB = 0;
+            for (size_t j=0; j<index1.size(); ++j) wA += jobs[q].Mw[j] * As(k,index1[j]);
+            for (size_t j=0; j<index0.size(); ++j) wB += jobs[q].wM[j] * out(k,index0[j]);
+            factor[n] = wA / wB;
+        }
+    });
+
+    parallel_for(0, active.size(), fam.nthreads, [&](long a0, long a1) {
+        for (long q=0; q<nq; ++q) {
+            auto &out(*jobs[q].out);
+            for (long a=a0; a<a1; ++a) {
+                for (long k=0; k<nvec; ++k) out(k,active[a]) *= factor[q*nvec + k];
+            }
+        }
+    });
+}
+
+}    // anonymous namespace
+
+// ------------------------------------------------------
+int Weighted_Family::add(Weighted const &W)
+{
+    auto const shape(W.shape());
+    if (_nmembers == 0) {
+        _shape = shape;
+        scaled = W.scaled;
+    } else if (shape != _shape) (*ibmisc_error)(-1,
+        "Matrix has shape (%ld, %ld); the family has (%ld, %ld)",
+        shape[0], shape[1], _shape[0], _shape[1]);
+
+    blitz::Array<int,1> ii, jj;
+    blitz::Array<double,1> vv;
+    W.to_coo(ii, jj, vv);
+    std::array<blitz::Array<double,1>,2> w;
+    for (int idim=0; idim<2; ++idim) W.get_weights(idim, w[idim]);
+
+    // Elements in (row, col) order
+    std::vector<long> perm(vv.extent(0));
+    std::iota(perm.begin(), perm.end(), 0L);
+    std::sort(perm.begin(), perm.end(), [&](long a, long b)
+        { return ii(a) < ii(b) || (ii(a) == ii(b) && jj(a) < jj(b)); });
+
+    if (_nmembers == 0) {
+        // First member: its (distinct) elements are the pattern
+        for (long const n : perm) {
+            int const i = ii(n), j = jj(n);
+            if (rows.empty() || rows.back() != i) {
+                rows.push_back(i);
+                row_ptr.push_back(cols.size());
+            } else if (cols.back() == j) continue;
+            cols.push_back(j);
+        }
+        row_ptr.push_back(cols.size());
+
+        for (int idim=0; idim<2; ++idim) {
+            for (int i=0; i<w[idim].extent(0); ++i)
+                if (w[idim](i) != 0) windex[idim].push_back(i);
+        }
+    }
+
+    // Values of the new member, placed in the pattern.  (Checked
+    // completely before this family is changed.)
+    long const m = _nmembers;
+    std::vector<double> mvals(nnz(), 0.);
+    for (long const n : perm) {
+        int const i = ii(n), j = jj(n);
+        long const r = find_sorted(rows.begin(), rows.end(), i);
+        long const c = (r < 0 ? -1 :
+            find_sorted(cols.begin() + row_ptr[r], cols.begin() + row_ptr[r+1], j));
+        if (c < 0) (*ibmisc_error)(-1,
+            "Element (%d, %d) of member %ld is not in the family's sparsity pattern",
+            i, j, m);
+        mvals[row_ptr[r] + c] += vv(n);
+    }
+
+    std::array<std::vector<double>,2> mw;
+    for (int idim=0; idim<2; ++idim) {
+        auto const &index(windex[idim]);
+        mw[idim].assign(index.size(), 0.);
+        for (int i=0; i<w[idim].extent(0); ++i) {
+            if (w[idim](i) == 0) continue;
+            long const n = find_sorted(index.begin(), index.end(), i);
+            if (n < 0) (*ibmisc_error)(-1,
+                "Weight %d of member %ld has index %d, not in the family's sparsity pattern",
+                idim, m, i);
+            mw[idim][n] = w[idim](i);
+        }
+    }
+
+    vals.insert(vals.end(), mvals.begin(), mvals.end());
+    for (int idim=0; idim<2; ++idim)
+        wvalue[idim].insert(wvalue[idim].end(), mw[idim].begin(), mw[idim].end());
+    conservative = conservative && W.conservative;
+    ++_nmembers;
+    return m;
+}
+
+void Weighted_Family::apply_M(
+    int m,
+    blitz::Array<double,2> const &As,
+    blitz::Array<double,2> &out,
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    std::vector<blitz::Array<double,2>> outs {out};    // Shares out's data
+    apply_M(std::vector<int>{m}, As, outs, accum_type, force_conservation);
+}
+
+void Weighted_Family::apply_M(
+    std::vector<int> const &members,
+    blitz::Array<double,2> const &As,
+    std::vector<blitz::Array<double,2>> &outs,
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    if (members.size() != outs.size()) (*ibmisc_error)(-1,
+        "Need one output per member (%ld vs %ld)", (long)outs.size(), (long)members.size());
+
+    std::vector<FamilyJob> jobs;
+    for (size_t q=0; q<members.size(); ++q) {
+        long const m = members[q];
+        if (m < 0 || m >= _nmembers) (*ibmisc_error)(-1,
+            "Member %ld out of range [0, %ld)", m, _nmembers);
+        jobs.push_back(FamilyJob{
+            vals.data() + m*nnz(),
+            wvalue[0].data() + m*windex[0].size(),
+            wvalue[1].data() + m*windex[1].size(),
+            &outs[q]});
+    }
+    apply_jobs(*this, jobs, As, accum_type, force_conservation);
+}
+
+void Weighted_Family::apply_M(
+    std::vector<double> const &coeffs,
+    blitz::Array<double,2> const &As,
+    blitz::Array<double,2> &out,
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    if ((long)coeffs.size() != _nmembers) (*ibmisc_error)(-1,
+        "Need one coefficient per member (%ld vs %ld)", (long)coeffs.size(), _nmembers);
+
+    // Combine the values; the pattern is shared
+    long const nnz = this->nnz();
+    std::vector<double> cvals(nnz, 0.);
+    std::array<std::vector<double>,2> cw;
+    for (int idim=0; idim<2; ++idim) cw[idim].assign(windex[idim].size(), 0.);
+    for (long m=0; m<_nmembers; ++m) {
+        double const c = coeffs[m];
+        if (c == 0) continue;
+        double const * const mvals = &vals[m*nnz];
+        parallel_for(0, nnz, nthreads, [&](long j0, long j1) {
+            for (long j=j0; j<j1; ++j) cvals[j] += c * mvals[j];
+        });
+        for (int idim=0; idim<2; ++idim) {
+            long const nw = windex[idim].size();
+            for (long j=0; j<nw; ++j) cw[idim][j] += c * wvalue[idim][m*nw + j];
+        }
+    }
+
+    std::vector<FamilyJob> jobs {FamilyJob{cvals.data(), cw[0].data(), cw[1].data(), &out}};
+    apply_jobs(*this, jobs, As, accum_type, force_conservation);
+}
+
+void Weighted_Family::apply_weight(
+    int m,
+    int dim,    // 0=B, 1=A
+    blitz::Array<double,2> const &As,    // As(nvec, ndim)
+    blitz::Array<double,1> &out,          // out(nvec)
+    bool zero_out) const
+{
+    if (m < 0 || m >= _nmembers) (*ibmisc_error)(-1,
+        "Member %d out of range [0, %ld)", m, _nmembers);
+    auto const nvec(As.extent(0));
+    auto const &index(windex[dim]);
+    double const * const value = &wvalue[dim][m * index.size()];
+
+    if (zero_out) out = 0;
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        for (size_t n=0; n<index.size(); ++n) {
+            for (long k=k0; k<k1; ++k) out(k) += value[n] * As(k,index[n]);
+        }
+    });
+}
+
+void Weighted_Family::ncio(NcIO &ncio, std::string const &vname)
+{
+    auto info_v = get_or_add_var(ncio, vname + ".info", "int", {});
+    std::string format("WEIGHTED_FAMILY");
+    get_or_put_att(info_v, ncio.rw, "format", format);
+    get_or_put_att(info_v, ncio.rw, "shape", "int64", _shape);
+    get_or_put_att(info_v, ncio.rw, "nmembers", "int64", &_nmembers, 1);
+    get_or_put_att(info_v, ncio.rw, "conservative", conservative);
+    get_or_put_att(info_v, ncio.rw, "scaled", scaled);
+
+    // Sizes are ignored on read
+    ncio_vector(ncio, rows, true, vname + ".rows", "int",
+        get_or_add_dims(ncio, rows, {vname + ".nrows"}));
+    ncio_vector(ncio, row_ptr, true, vname + ".row_ptr", "int64",
+        get_or_add_dims(ncio, row_ptr, {vname + ".nrows_p1"}));
+    ncio_vector(ncio, cols, true, vname + ".cols", "int",
+        get_or_add_dims(ncio, cols, {vname + ".nnz"}));
+    ncio_vector(ncio, vals, true, vname + ".vals", "double",
+        get_or_add_dims(ncio, vals, {vname + ".nvals"}));
+
+    std::array<std::string,2> const wnames {"wM", "Mw"};
+    for (int idim=0; idim<2; ++idim) {
+        std::string const wname(vname + "." + wnames[idim]);
+        ncio_vector(ncio, windex[idim], true, wname + ".index", "int",
+            get_or_add_dims(ncio, windex[idim], {wname + ".nnz"}));
+        ncio_vector(ncio, wvalue[idim], true, wname + ".value", "double",
+            get_or_add_dims(ncio, wvalue[idim], {wname + ".nvals"}));
+    }
+}
+
+MemoryFootprint Weighted_Family::memory_footprint(std::string const &name) const
+{
+    MemoryFootprint ret(name);
+    MemoryFootprint pattern("pattern");
+    pattern.add(vector_footprint("rows", rows));
+    pattern.add(vector_footprint("row_ptr", row_ptr));
+    pattern.add(vector_footprint("cols", cols));
+    pattern.add(vector_footprint("wM.index", windex[0]));
+    pattern.add(vector_footprint("Mw.index", windex[1]));
+    ret.add(std::move(pattern));
+    ret.add(vector_footprint("vals", vals));
+    ret.add(vector_footprint("wM.value", wvalue[0]));
+    ret.add(vector_footprint("Mw.value", wvalue[1]));
+    return ret;
+}
+
+}}    // namespace
@@ -0,0 +1,116 @@
+#ifndef IBMISC_LINEAR_FAMILY_HPP
+#define IBMISC_LINEAR_FAMILY_HPP
+
+#include <array>
+#include <vector>
+#include <ibmisc/linear/linear.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+// ==================================================================
+/** A family of regrid matrices with one sparsity pattern, differing
+only in their values: eg one per elevation class, or per season.
+The pattern (rows and columns of M, indices of wM and Mw) is stored
+once, row-compressed; each member adds only its value arrays.
+
+Members may be applied one at a time, several at once (reading the
+pattern and As once for all of them), or as a weighted combination.
+
+    Weighted_Family fam;
+    for (auto &BvA : BvAs) fam.add(*BvA);
+    fam.apply_M(3, As, Bs);
+*/
+class Weighted_Family
+{
+    long _nmembers;
+
+public:
+    std::array<long,2> _shape;
+
+    /** True if every member is conservative */
+    bool conservative;
+    bool scaled;
+
+    /** Threads to use in apply_M() */
+    int nthreads;
+
+    // ------------ Shared pattern (sparse indexing)
+    /** Rows of M with entries, ascending */
+    std::vector<int> rows;
+    /** Entries of rows[r] are [row_ptr[r], row_ptr[r+1]) of cols */
+    std::vector<long> row_ptr;
+    /** Columns of each row, ascending */
+    std::vector<int> cols;
+    /** {wM, Mw} indices, ascending.  windex[0] is the active space:
+    the rows apply_M() zeroes and conservation-corrects. */
+    std::array<std::vector<int>,2> windex;
+
+    // ------------ Values; those of member m are [m*n, (m+1)*n)
+    /** n = nnz() */
+    std::vector<double> vals;
+    /** {wM, Mw}; n = windex[i].size() */
+    std::array<std::vector<double>,2> wvalue;
+
+    Weighted_Family() : _nmembers(0), _shape({0,0}),
+        conservative(true), scaled(false), nthreads(1) {}
+
+    /** Number of members */
+    long size() const
+        { return _nmembers; }
+
+    /** Entries of M in the shared pattern */
+    long nnz() const
+        { return cols.size(); }
+
+    std::array<long,2> const &shape() const
+        { return _shape; }
+
+    /** Adds a member.  The first one added sets the pattern; later
+    ones must fit inside it (elements outside are an error; elements
+    missing are taken as zero).
+    @return Index of the new member */
+    int add(Weighted const &W);
+
+    /** Computes out = W_m * As, like Weighted::apply_M() */
+    void apply_M(
+        int m,
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    /** Computes outs[q] = W_{members[q]} * As for several members at
+    once.  Each entry of the pattern, and of As, is read once for all
+    of them. */
+    void apply_M(
+        std::vector<int> const &members,
+        blitz::Array<double,2> const &As,
+        std::vector<blitz::Array<double,2>> &outs,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    /** Computes out = W * As, where W's M, wM and Mw are
+    sum_m coeffs[m] * those of member m. */
+    void apply_M(
+        std::vector<double> const &coeffs,
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    /** Computes out = As * weights[dim] of member m */
+    void apply_weight(
+        int m,
+        int dim,    // 0=B, 1=A
+        blitz::Array<double,2> const &As,    // As(nvec, ndim)
+        blitz::Array<double,1> &out,
+        bool zero_out=true) const;
+
+    void ncio(NcIO &ncio, std::string const &vname);
+
+    MemoryFootprint memory_footprint(std::string const &name = "Weighted_Family") const;
+};
+
+}}    // namespace
+#endif    // guard
@@ -0,0 +1,107 @@
+#include <map>
+#include <mutex>
+#include <ibmisc/linear/fortran.hpp>
+#include <ibmisc/profile.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+static std::mutex registry_mutex;
+static std::map<int, std::shared_ptr<Weighted const>> registry;
+static int next_handle = 0;
+
+int fortran_register(std::shared_ptr<Weighted const> const &W)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    int const handle = next_handle++;
+    registry.insert(std::make_pair(handle, W));
+    return handle;
+}
+
+void fortran_unregister(int handle)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.erase(handle);
+}
+
+/** Looks up a handle; the matrix stays alive while we use it, even if
+it is unregistered meanwhile. */
+static std::shared_ptr<Weighted const> lookup(int handle)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    auto ii(registry.find(handle));
+    if (ii == registry.end()) (*ibmisc_error)(-1,
+        "No Weighted matrix registered with handle %d", handle);
+    return ii->second;
+}
+
+blitz::Array<double,2> fortran_vectors(F90Array<double,2> const &arr_f)
+{
+    int const n = arr_f.ubounds[0] - arr_f.lbounds[0] + 1;
+    int const nvec = arr_f.ubounds[1] - arr_f.lbounds[1] + 1;
+    return blitz::Array<double,2>(arr_f.base,
+        blitz::shape(nvec, n),
+        blitz::shape(arr_f.deltas[1] - arr_f.base, arr_f.deltas[0] - arr_f.base),
+        blitz::neverDeleteData);
+}
+
+blitz::Array<double,2> fortran_vectors(F90Array<double,1> const &arr_f)
+{
+    int const n = arr_f.ubounds[0] - arr_f.lbounds[0] + 1;
+    int const stride = arr_f.deltas[0] - arr_f.base;
+    return blitz::Array<double,2>(arr_f.base,
+        blitz::shape(1, n),
+        blitz::shape(n * stride, stride),
+        blitz::neverDeleteData);
+}
+
+static void apply_m(int handle,
+    blitz::Array<double,2> const &As,
+    blitz::Array<double,2> &out,
+    int accum_type, int force_conservation)
+{
+    IBMISC_SCOPED_TIMER("ibmisc_linear_apply_m");
+    auto const W(lookup(handle));
+    auto const shape(W->shape());
+    if (As.extent(1) != shape[1] || out.extent(1) != shape[0]
+        || As.extent(0) != out.extent(0)) (*ibmisc_error)(-1,
+        "ibmisc_linear_apply_m(%d): matrix is (%ld, %ld) but As is (%d, %d) and out is (%d, %d) (Fortran order)",
+        handle, shape[0], shape[1],
+        As.extent(1), As.extent(0), out.extent(1), out.extent(0));
+
+    auto const accum(AccumType::get_by_value(accum_type));
+    if (!accum) (*ibmisc_error)(-1,
+        "ibmisc_linear_apply_m(%d): bad accum_type %d", handle, accum_type);
+
+    W->apply_M(As, out, *accum, force_conservation);
+}
+
+}}    // namespace
+
+using namespace ibmisc;
+using namespace ibmisc::linear;
+
+extern "C" void ibmisc_linear_shape(int handle, int *nB, int *nA)
+{
+    auto const shape(lookup(handle)->shape());
+    *nB = shape[0];
+    *nA = shape[1];
+}
+
+extern "C" void ibmisc_linear_apply_m_2(int handle,
+    F90Array<double,2> const &As_f,
+    F90Array<double,2> &out_f,
+    int accum_type, int force_conservation)
+{
+    blitz::Array<double,2> out(fortran_vectors(out_f));
+    apply_m(handle, fortran_vectors(As_f), out, accum_type, force_conservation);
+}
+
+extern "C" void ibmisc_linear_apply_m_1(int handle,
+    F90Array<double,1> const &As_f,
+    F90Array<double,1> &out_f,
+    int accum_type, int force_conservation)
+{
+    blitz::Array<double,2> out(fortran_vectors(out_f));
+    apply_m(handle, fortran_vectors(As_f), out, accum_type, force_conservation);
+}
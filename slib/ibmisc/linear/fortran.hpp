@@ -0,0 +1,54 @@
+#ifndef IBMISC_LINEAR_FORTRAN_HPP
+#define IBMISC_LINEAR_FORTRAN_HPP
+
+#include <memory>
+#include <ibmisc/f90blitz.hpp>
+#include <ibmisc/linear/linear.hpp>
+
+/** @file
+Lets Fortran apply a Weighted matrix directly to its own (assumed
+shape) arrays, described by F90Array dope vectors; no copies are made.
+The C++ side registers the matrix and hands the handle to Fortran.
+Vectors are laid out the Fortran way: As(nA, nvec), each vector
+contiguous, which is the (nvec, nA) layout apply_M() expects.
+Interfaces are generated by f90blitz_f.py. */
+
+namespace ibmisc {
+namespace linear {
+
+/** Makes W callable from Fortran, until unregistered.
+@return Handle to pass to ibmisc_linear_apply_m_*() */
+extern int fortran_register(std::shared_ptr<Weighted const> const &W);
+
+extern void fortran_unregister(int handle);
+
+/** The (nvec, n) view of Fortran memory declared arr(n, nvec);
+0-based, with the strides in the dope vector. */
+extern blitz::Array<double,2> fortran_vectors(F90Array<double,2> const &arr_f);
+
+/** The (1, n) view of Fortran memory declared arr(n) */
+extern blitz::Array<double,2> fortran_vectors(F90Array<double,1> const &arr_f);
+
+}}    // namespace
+
+extern "C" {
+
+/** Shape of a registered matrix, (nB, nA) */
+void ibmisc_linear_shape(int handle, int *nB, int *nA);
+
+/** out = M * As, on Fortran arrays As(nA, nvec) and out(nB, nvec)
+@param accum_type A value of AccumType */
+void ibmisc_linear_apply_m_2(int handle,
+    ibmisc::F90Array<double,2> const &As_f,
+    ibmisc::F90Array<double,2> &out_f,
+    int accum_type, int force_conservation);
+
+/** out = M * As, on Fortran arrays As(nA) and out(nB) */
+void ibmisc_linear_apply_m_1(int handle,
+    ibmisc::F90Array<double,1> const &As_f,
+    ibmisc::F90Array<double,1> &out_f,
+    int accum_type, int force_conservation);
+
+}
+
+#endif    // guard
@@ -0,0 +1,134 @@
+#ifndef IBMISC_LINEAR_INPLACE_HPP
+#define IBMISC_LINEAR_INPLACE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include <ibmisc/linear/linear.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+/** Max. doubles of scratch each thread keeps between apply_M_inplace()
+calls; larger buffers are freed by trim_inplace_scratch(). */
+static size_t const inplace_scratch_max = 1 << 20;
+
+/** Scratch space for apply_M_inplace(), at least n long.  One buffer
+per thread, kept between calls (up to inplace_scratch_max); so repeated
+in-place regrids do not allocate. */
+extern std::vector<double> &inplace_scratch(size_t n);
+
+/** Frees this thread's scratch if it grew past inplace_scratch_max */
+extern void trim_inplace_scratch();
+
+/** Computes As = M * As in place, for backends that stream their
+elements.  Results for the active space (rows with a wM weight) are
+accumulated in scratch of size (nactive, nvec), then written back over
+As.  Rows are matched to the active space by a merge walk, so streams
+in row order (or mostly so) cost no searching.
+
+Vectors are split among nthreads threads, each streaming M on its own;
+so for_each_M() must be safe to call concurrently.
+
+@param for_each_wM for_each_wM(fn): Calls fn(i, w) for each element of wM
+@param for_each_M for_each_M(fn): Calls fn(i, j, value) for each element of M
+@param for_each_Mw for_each_Mw(fn): Calls fn(j, w) for each element of Mw */
+template<class WMFnT, class MFnT, class MwFnT>
+void apply_M_inplace_stream(
+    std::array<long,2> const &shape,
+    bool conservative,
+    blitz::Array<double,2> &As,    // As(nvec, n)
+    AccumType accum_type,
+    bool force_conservation,
+    int nthreads,
+    WMFnT const &for_each_wM,
+    MFnT const &for_each_M,
+    MwFnT const &for_each_Mw)
+{
+    if (shape[0] != shape[1]) (*ibmisc_error)(-1,
+        "apply_M_inplace() needs a square matrix, not (%ld x %ld)", shape[0], shape[1]);
+    long const nvec = As.extent(0);
+
+    // Active space, sorted by row
+    std::vector<std::pair<long,double>> active;
+    for_each_wM([&](long i, double w) { active.push_back(std::make_pair(i, w)); });
+    std::stable_sort(active.begin(), active.end(),
+        [](std::pair<long,double> const &a, std::pair<long,double> const &b)
+        { return a.first < b.first; });
+    size_t nactive = 0;
+    for (size_t n=0; n<active.size(); ++n) {
+        if (nactive > 0 && active[nactive-1].first == active[n].first) {
+            active[nactive-1].second += active[n].second;
+        } else {
+            active[nactive++] = active[n];
+        }
+    }
+    active.resize(nactive);
+
+    bool const correct = (force_conservation && !conservative);
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        long const nk = k1 - k0;
+
+        // Input weight must be taken before As is overwritten
+        std::vector<double> wA(nk, 0.);
+        if (correct) {
+            for_each_Mw([&](long j, double w) {
+                for (long k=k0; k<k1; ++k) wA[k-k0] += w * As(k,j);
+            });
+        }
+
+        // Multiply into scratch
+        auto &scratch(inplace_scratch(nactive * nk));
+        std::fill(scratch.begin(), scratch.begin() + nactive*nk, 0.);
+        size_t s = 0;    // Merge cursor into active
+        for_each_M([&](long i, long j, double val) {
+            if (s < nactive && active[s].first <= i) {
+                while (s < nactive && active[s].first < i) ++s;
+            } else {
+                // Stream went back: search the rows behind us
+                s = std::lower_bound(active.begin(), active.begin() + s,
+                    std::make_pair(i, -HUGE_VAL)) - active.begin();
+            }
+            if (s == nactive || active[s].first != i) (*ibmisc_error)(-1,
+                "Row %ld of M has no weight in wM", i);
+            double * const row = &scratch[s * nk];
+            for (long k=k0; k<k1; ++k) row[k-k0] += val * As(k,j);
+        });
+
+        // Write back
+        for (size_t r=0; r<nactive; ++r) {
+            long const i = active[r].first;
+            double const * const row = &scratch[r * nk];
+            for (long k=k0; k<k1; ++k) {
+                auto &As_ki(As(k,i));
+                switch(accum_type.index()) {
+                    case AccumType::REPLACE :
+                        As_ki = row[k-k0];
+                    break;
+                    case AccumType::REPLACE_OR_ACCUMULATE :
+                        As_ki = (std::isnan(As_ki) ? row[k-k0] : As_ki + row[k-k0]);
+                    break;
+                    default :
+                        As_ki += row[k-k0];
+                    break;
+                }
+            }
+        }
+        trim_inplace_scratch();
+
+        if (correct) {
+            std::vector<double> wB(nk, 0.);
+            for (auto const &aa : active) {
+                for (long k=k0; k<k1; ++k) wB[k-k0] += aa.second * As(k,aa.first);
+            }
+            for (auto const &aa : active) {
+                for (long k=k0; k<k1; ++k) As(k,aa.first) *= wA[k-k0] / wB[k-k0];
+            }
+        }
+    });
+}
+
+}}    // namespace
+#endif    // guard
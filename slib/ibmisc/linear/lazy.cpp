@@ -0,0 +1,192 @@
+#include <ibmisc/linear/lazy.hpp>
+#include <ibmisc/linear/patch.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+void LazyPool::touch(Weighted_Lazy *W, size_t nbytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto ii(lru.begin()); ii != lru.end(); ++ii) {
+        if (ii->first == W) {
+            _resident -= ii->second;
+            lru.erase(ii);
+            break;
+        }
+    }
+    lru.push_front(std::make_pair(W, nbytes));
+    _resident += nbytes;
+
+    // Least recently used go first; but never W itself
+    while (_resident > _budget && lru.size() > 1) {
+        auto &victim(lru.back());
+        victim.first->_drop();
+        _resident -= victim.second;
+        lru.pop_back();
+    }
+}
+
+void LazyPool::remove(Weighted_Lazy *W)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto ii(lru.begin()); ii != lru.end(); ++ii) {
+        if (ii->first == W) {
+            _resident -= ii->second;
+            lru.erase(ii);
+            return;
+        }
+    }
+}
+
+// ======================================================
+Weighted_Lazy::Weighted_Lazy(std::string const &_fname, std::string const &_vname,
+    LazyPool *_pool)
+: Weighted(LinearType::EIGEN), fname(_fname), vname(_vname), pool(_pool),
+    _shape{{0,0}}, _nnz(-1), _patched(false)
+{
+    // Read just the header
+    NcIO ncio(fname, 'r');
+    auto info_v = get_or_add_var(ncio, vname + ".info", "int", {});
+    get_or_put_att_enum(info_v, ncio.rw, "type", type);
+    get_or_put_att(info_v, ncio.rw, "conservative", conservative);
+    get_or_put_att(info_v, ncio.rw, "scaled", scaled);
+
+    // Written by Weighted::ncio(); older files must be loaded for them
+    auto const atts(info_v.getAtts());
+    if (atts.count("shape") && atts.count("nnz")) {
+        get_or_put_att(info_v, ncio.rw, "shape", "int64", &_shape[0], 2);
+        get_or_put_att(info_v, ncio.rw, "nnz", "int64", &_nnz, 1);
+    }
+}
+
+Weighted_Lazy::~Weighted_Lazy()
+{
+    if (pool) pool->remove(this);
+}
+
+std::shared_ptr<Weighted> Weighted_Lazy::get() const
+{
+    std::shared_ptr<Weighted> ret;
+    {std::lock_guard<std::mutex> lock(mutex);
+        if (!_loaded.get()) {
+            NcIO ncio(fname, 'r');
+            _loaded.reset(nc_read_weighted(ncio.nc, vname).release());
+        }
+        ret = _loaded;
+    }
+    ret->nthreads = nthreads;
+
+    // Approximate: one (i, j, value) triplet per non-zero
+    if (pool && !_patched) pool->touch(const_cast<Weighted_Lazy *>(this),
+        ret->nnz() * (2*sizeof(int) + sizeof(double)));
+    return ret;
+}
+
+bool Weighted_Lazy::loaded() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return _loaded.get() != NULL;
+}
+
+void Weighted_Lazy::_drop()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    _loaded.reset();
+}
+
+void Weighted_Lazy::unload()
+{
+    if (_patched) return;
+    _drop();
+    if (pool) pool->remove(this);
+}
+
+void Weighted_Lazy::apply_weight(
+    int dim,    // 0=B, 1=A
+    blitz::Array<double,2> const &As,    // As(nvec, ndim)
+    blitz::Array<double,1> &out,
+    bool zero_out) const
+{
+    get()->apply_weight(dim, As, out, zero_out);
+}
+
+void Weighted_Lazy::apply_M(
+    blitz::Array<double,2> const &As,
+    blitz::Array<double,2> &out,
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    get()->apply_M(As, out, accum_type, force_conservation);
+}
+
+void Weighted_Lazy::apply_MT(
+    blitz::Array<double,2> const &Bs,
+    blitz::Array<double,2> &out,
+    AccumType accum_type) const
+{
+    get()->apply_MT(Bs, out, accum_type);
+}
+
+void Weighted_Lazy::apply_M_rows(
+    blitz::Array<double,2> const &As,
+    blitz::Array<double,2> &out,
+    long i0, long i1,
+    AccumType accum_type) const
+{
+    get()->apply_M_rows(As, out, i0, i1, accum_type);
+}
+
+void Weighted_Lazy::apply_M_inplace(
+    blitz::Array<double,2> &As,
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    get()->apply_M_inplace(As, accum_type, force_conservation);
+}
+
+MemoryFootprint Weighted_Lazy::memory_footprint(std::string const &name) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return _loaded.get() ? _loaded->memory_footprint(name) : MemoryFootprint(name);
+}
+
+void Weighted_Lazy::apply_patch(WeightedPatch const &patch)
+{
+    // Out of the pool's reach first: unloading would lose the patch
+    _patched = true;
+    if (pool) pool->remove(this);
+    auto W(get());
+    W->apply_patch(patch);
+    _shape = W->shape();
+    _nnz = W->nnz();
+    changed();
+}
+
+void Weighted_Lazy::ncio(NcIO &ncio, std::string const &vname)
+{
+    if (ncio.rw == 'r') (*ibmisc_error)(-1,
+        "Weighted_Lazy::ncio(%s): cannot read; construct a new Weighted_Lazy instead", vname.c_str());
+    get()->ncio(ncio, vname);
+}
+
+void Weighted_Lazy::_build_active(std::vector<int> &active) const
+{
+    active = get()->active_rows();
+}
+
+void Weighted_Lazy::_to_coo(
+    blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+    blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+    blitz::Array<double,1> &values) const      // Must bepre-allocated(nnz)
+{
+    get()->to_coo(indices0, indices1, values);
+}
+
+void Weighted_Lazy::_get_weights(
+    int idim,    // 0=wM, 1=Mw
+    blitz::Array<double,1> &w) const
+{
+    get()->get_weights(idim, w);
+}
+
+}}    // namespace
@@ -0,0 +1,155 @@
+#ifndef IBMISC_LINEAR_LAZY_HPP
+#define IBMISC_LINEAR_LAZY_HPP
+
+#include <array>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <ibmisc/linear/linear.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+class Weighted_Lazy;
+
+/** Keeps the total (approximate) size of loaded Weighted_Lazy matrices
+under a budget, unloading the least recently used ones first.
+Thread-safe. */
+class LazyPool {
+    friend class Weighted_Lazy;
+
+    std::mutex mutex;
+    size_t _budget;
+    size_t _resident;
+    std::list<std::pair<Weighted_Lazy *, size_t>> lru;    // Most recent first
+
+    /** Marks W as just used, with nbytes resident.  Unloads others
+    (not W), least recently used first, until back under budget. */
+    void touch(Weighted_Lazy *W, size_t nbytes);
+
+    /** Forgets W (it was unloaded) */
+    void remove(Weighted_Lazy *W);
+
+public:
+    /** @param budget Max. bytes of matrices to keep loaded */
+    LazyPool(size_t budget) : _budget(budget), _resident(0) {}
+
+    size_t budget() const { return _budget; }
+    size_t resident() const { return _resident; }
+};
+
+// ==================================================================
+/** Stands in for a Weighted matrix stored in a NetCDF file (see
+nc_read_weighted()).  Only the header is read at construction (as
+well as shape() and nnz(), if the file has them); the matrix itself is
+loaded on the first call that needs it (apply_M(), apply_weight(),
+to_coo(), ...), so startup cost is proportional to the matrices
+actually used.
+
+If a LazyPool is given, the matrix may be unloaded again when others
+are loaded; it is transparently re-read the next time it is used.
+Once patched (apply_patch()), it stays loaded. */
+class Weighted_Lazy : public Weighted
+{
+    friend class LazyPool;
+
+    std::string const fname;
+    std::string const vname;
+    LazyPool * const pool;
+
+    /** From the header; _nnz < 0 if the file did not have them */
+    std::array<long,2> _shape;
+    long _nnz;
+
+    mutable std::mutex mutex;
+    mutable std::shared_ptr<Weighted> _loaded;
+    /** Set by apply_patch(): the file is out of date, never unload */
+    bool _patched;
+
+    /** @return The loaded matrix; held by the caller for the duration
+    of its use, so unloading cannot pull it out from under it. */
+    std::shared_ptr<Weighted> get() const;
+
+    /** Frees the matrix without telling the pool (called by the pool) */
+    void _drop();
+
+public:
+    /** @param fname NetCDF file holding the matrix
+    @param vname Name of the matrix in the file
+    @param pool Memory budget to load under (NULL for none: never unload) */
+    Weighted_Lazy(std::string const &_fname, std::string const &_vname,
+        LazyPool *_pool = NULL);
+
+    ~Weighted_Lazy();
+
+    /** Is the matrix currently in memory? */
+    bool loaded() const;
+
+    /** Frees the matrix, if loaded.  It will be re-read on next use.
+    A no-op once patched. */
+    void unload();
+
+    /** @return The loaded matrix, held for as long as the pointer is */
+    std::shared_ptr<Weighted const> concrete() const
+        { return get(); }
+
+    // ================= Implements Weighted
+    std::array<long,2> shape() const
+        { return _nnz < 0 ? get()->shape() : _shape; }
+
+    void apply_weight(
+        int dim,    // 0=B, 1=A
+        blitz::Array<double,2> const &As,    // As(nvec, ndim)
+        blitz::Array<double,1> &out,
+        bool zero_out=true) const;
+
+    void apply_M(
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    /** Computes out = M^T * Bs */
+    void apply_MT(
+        blitz::Array<double,2> const &Bs,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE) const;
+
+    void apply_M_rows(
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        long i0, long i1,
+        AccumType accum_type=AccumType::REPLACE) const;
+
+    void apply_M_inplace(
+        blitz::Array<double,2> &As,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    long nnz() const
+        { return _nnz < 0 ? get()->nnz() : _nnz; }
+
+    /** That of the loaded matrix; nothing if not loaded */
+    MemoryFootprint memory_footprint(std::string const &name = "Weighted_Lazy") const;
+
+    /** Patches the loaded matrix, which then stays loaded */
+    void apply_patch(WeightedPatch const &patch);
+
+    /** Writes the underlying matrix (loading it first); cannot read. */
+    void ncio(NcIO &ncio, std::string const &vname);
+
+protected:
+    void _build_active(std::vector<int> &active) const;
+
+    void _to_coo(
+        blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+        blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+        blitz::Array<double,1> &values) const;      // Must bepre-allocated(nnz)
+
+    void _get_weights(
+        int idim,    // 0=wM, 1=Mw
+        blitz::Array<double,1> &w) const;
+};
+
+}}    // namespace
+#endif    // guard
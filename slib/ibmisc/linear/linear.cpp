@@ -1,10 +1,24 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <Eigen/Dense>
 #include <ibmisc/linear/linear.hpp>
 #include <ibmisc/linear/eigen.hpp>
 #include <ibmisc/linear/compressed.hpp>
+#include <ibmisc/linear/inplace.hpp>
+#include <ibmisc/linear/patch.hpp>
+#include <ibmisc/linear/runlength.hpp>
+#include <ibmisc/linear/sell.hpp>
 
 namespace ibmisc {
 namespace linear {
 
+uint64_t Generation::next()
+{
+    static std::atomic<uint64_t> counter(0);
+    return ++counter;
+}
+
 void Weighted::to_coo(
     blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
     blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
@@ -48,15 +62,240 @@ void Weighted::get_weights(
     _get_weights(idim, w);
 }
 
+void Weighted::apply_MT(
+    blitz::Array<double,2> const &Bs,    // Bs(nvec, nB)
+    blitz::Array<double,2> &out,         // out(nvec, nA)
+    AccumType accum_type) const
+{
+    auto const nvec(Bs.extent(0));
+
+    blitz::Array<double,1> w;
+    get_weights(1, w);
+    for (int j=0; j<w.extent(0); ++j) {
+        if (w(j) == 0) continue;
+        for (int k=0; k<nvec; ++k) {
+            switch(accum_type.index()) {
+                case AccumType::REPLACE :
+                    out(k,j) = 0;
+                break;
+                case AccumType::REPLACE_OR_ACCUMULATE :
+                    if (std::isnan(out(k,j))) out(k,j) = 0;
+                break;
+            }
+        }
+    }
+
+    blitz::Array<int,1> indices0, indices1;
+    blitz::Array<double,1> values;
+    to_coo(indices0, indices1, values);
+    for (int n=0; n<values.extent(0); ++n) {
+        for (int k=0; k<nvec; ++k) out(k,indices1(n)) += values(n) * Bs(k,indices0(n));
+    }
+}
+
+void check_rows(blitz::Array<double,2> const &out, long i0, long i1)
+{
+    if (i0 < 0 || i0 > i1 || i1 > out.extent(1)) (*ibmisc_error)(-1,
+        "Row range [%ld, %ld) out of range for output with %d rows",
+        i0, i1, out.extent(1));
+}
+
+/** Rows of As per GEMV; fixed, so results do not depend on nthreads */
+static long const gemv_block = 16;
+
+/** Shorter runs of consecutive indices are gathered instead */
+static long const gemv_min_run = 8;
+
+template<class ValueT>
+void apply_weight_gemv(
+    std::vector<int> const &windex,
+    std::vector<ValueT> const &wvalue,
+    blitz::Array<double,2> const &As,    // As(nvec, n)
+    blitz::Array<double,1> &out,         // out(nvec)
+    int nthreads)
+{
+    long const nvec = As.extent(0);
+    if (windex.empty() || nvec == 0) return;
+
+    if (nvec > 1 && As.stride(0) == 1) {
+        // Vectors are interleaved: contiguous AXPY per weight
+        for (size_t n=0; n<windex.size(); ++n) {
+            double const w = wvalue[n];
+            double const * const Asj = &As(0,windex[n]);
+            for (long k=0; k<nvec; ++k) out(k) += w * Asj[k];
+        }
+        return;
+    }
+
+    // Sort the weights by index, and find runs of consecutive indices.
+    // (Weights are not scattered over the gaps between runs: As may
+    // hold NaN there.)
+    std::vector<std::pair<int,double>> ws;
+    ws.reserve(windex.size());
+    for (size_t n=0; n<windex.size(); ++n) ws.push_back(std::make_pair(windex[n], (double)wvalue[n]));
+    std::stable_sort(ws.begin(), ws.end(),
+        [](std::pair<int,double> const &a, std::pair<int,double> const &b)
+        { return a.first < b.first; });
+    std::vector<int> idx;
+    std::vector<double> val;
+    std::vector<size_t> runs;    // Start of each run in idx, then idx.size()
+    for (auto const &w : ws) {
+        if (!idx.empty() && idx.back() == w.first) {
+            val.back() += w.second;
+            continue;
+        }
+        if (idx.empty() || idx.back() + 1 != w.first) runs.push_back(idx.size());
+        idx.push_back(w.first);
+        val.push_back(w.second);
+    }
+    runs.push_back(idx.size());
+
+    typedef Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor> RowMatrixT;
+    typedef Eigen::Stride<Eigen::Dynamic,Eigen::Dynamic> StrideT;
+    typedef Eigen::Map<RowMatrixT const, 0, StrideT> ConstMapT;
+    typedef Eigen::Map<Eigen::VectorXd const> ConstVecT;
+    typedef Eigen::Map<Eigen::VectorXd, 0, Eigen::InnerStride<>> OutMapT;
+
+    long const nblocks = (nvec + gemv_block - 1) / gemv_block;
+    parallel_for(0, nblocks, nthreads, [&](long b0, long b1) {
+        for (long b=b0; b<b1; ++b) {
+            long const k0 = b * gemv_block;
+            long const nk = std::min(gemv_block, nvec - k0);
+            OutMapT o(&out(k0), nk, Eigen::InnerStride<>(out.stride(0)));
+
+            for (size_t r=0; r+1 < runs.size(); ++r) {
+                size_t const n0 = runs[r];
+                long const len = runs[r+1] - n0;
+                if (len >= gemv_min_run) {
+                    ConstMapT const A(&As(k0,idx[n0]), nk, len,
+                        StrideT(As.stride(0), As.stride(1)));
+                    o.noalias() += A * ConstVecT(&val[n0], len);
+                } else {
+                    for (long k=k0; k<k0+nk; ++k) {
+                        double sum = 0;
+                        for (long n=n0; n<(long)n0+len; ++n) sum += val[n] * As(k,idx[n]);
+                        out(k) += sum;
+                    }
+                }
+            }
+        }
+    });
+}
+
+template void apply_weight_gemv<double>(std::vector<int> const &,
+    std::vector<double> const &, blitz::Array<double,2> const &,
+    blitz::Array<double,1> &, int);
+template void apply_weight_gemv<float>(std::vector<int> const &,
+    std::vector<float> const &, blitz::Array<double,2> const &,
+    blitz::Array<double,1> &, int);
+
+void Weighted::apply_M_rows(
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,2> &out,         // out(nvec, nB)
+    long i0, long i1,
+    AccumType accum_type) const
+{
+    check_rows(out, i0, i1);
+    blitz::Array<double,2> tmp(out.extent(0), out.extent(1));
+    tmp = out;
+    apply_M(As, tmp, accum_type, false);
+    for (int k=0; k<out.extent(0); ++k) {
+        for (long i=i0; i<i1; ++i) out(k,i) = tmp(k,i);
+    }
+}
+
+void Weighted::_build_active(std::vector<int> &active) const
+{
+    blitz::Array<double,1> w;
+    get_weights(0, w);
+    for (int i=0; i<w.extent(0); ++i) if (w(i) != 0) active.push_back(i);
+}
+
+std::vector<int> const &Weighted::active_rows() const
+{
+    std::lock_guard<std::mutex> lock(_active_mutex);
+    if (!_active_set) {
+        _active.clear();
+        _build_active(_active);
+        _active_set = true;
+    }
+    return _active;
+}
+
 void Weighted::ncio(NcIO &ncio, std::string const &vname)
 {
     auto info_v = get_or_add_var(ncio, vname + ".info", "int", {});
     if (ncio.rw == 'w') {
         LinearType _type = type;
         get_or_put_att_enum(info_v, ncio.rw, "type", _type);
+
+        // For Weighted_Lazy, which reads only this header
+        std::array<long,2> _shape(shape());
+        long _nnz = nnz();
+        get_or_put_att(info_v, ncio.rw, "shape", "int64", &_shape[0], 2);
+        get_or_put_att(info_v, ncio.rw, "nnz", "int64", &_nnz, 1);
     }
     get_or_put_att(info_v, ncio.rw, "conservative", conservative);
     get_or_put_att(info_v, ncio.rw, "scaled", scaled);
+
+    // Active rows (optional: otherwise rebuilt when needed)
+    std::string const active_vname(vname + ".active");
+    if (ncio.rw == 'w') {
+        if (!active_rows().empty()) {
+            auto dims(get_or_add_dims(ncio, {active_vname + ".size"}, {(long)_active.size()}));
+            ncio_vector(ncio, _active, false, active_vname, "int", dims);
+        }
+    } else {
+        changed();
+        if (!ncio.getVar(active_vname).isNull()) {
+            auto dims(get_or_add_dims(ncio, {active_vname + ".size"}, {0L}));    // Size ignored
+            ncio_vector(ncio, _active, true, active_vname, "int", dims);
+            ncio += [this]() {
+                std::lock_guard<std::mutex> lock(_active_mutex);
+                _active_set = true;
+            };
+        }
+    }
+}
+
+static thread_local std::vector<double> _inplace_scratch;
+
+std::vector<double> &inplace_scratch(size_t n)
+{
+    if (_inplace_scratch.size() < n) _inplace_scratch.resize(n);
+    return _inplace_scratch;
+}
+
+void trim_inplace_scratch()
+{
+    if (_inplace_scratch.capacity() > inplace_scratch_max)
+        std::vector<double>().swap(_inplace_scratch);
+}
+
+void WeightedPatch::check(std::array<long,2> const &shape) const
+{
+    PatchedSet const prows(rows), pcols(cols);
+    for (long const i : prows.sorted()) if (i < 0 || i >= shape[0]) (*ibmisc_error)(-1,
+        "Patched row %ld out of range [0, %ld)", i, shape[0]);
+    for (long const j : pcols.sorted()) if (j < 0 || j >= shape[1]) (*ibmisc_error)(-1,
+        "Patched column %ld out of range [0, %ld)", j, shape[1]);
+
+    for (auto ii=M.begin(); ii != M.end(); ++ii) {
+        long const i = ii->index(0);
+        long const j = ii->index(1);
+        if (i < 0 || i >= shape[0] || j < 0 || j >= shape[1]) (*ibmisc_error)(-1,
+            "Patch entry M(%ld, %ld) out of range (%ld x %ld)", i, j, shape[0], shape[1]);
+        if (!prows.contains(i) && !pcols.contains(j)) (*ibmisc_error)(-1,
+            "Patch entry M(%ld, %ld) is not in a changed row or column", i, j);
+    }
+    for (auto ii=wM.begin(); ii != wM.end(); ++ii) {
+        if (!prows.contains(ii->index(0))) (*ibmisc_error)(-1,
+            "Patch entry wM(%ld) is not in a changed row", ii->index(0));
+    }
+    for (auto ii=Mw.begin(); ii != Mw.end(); ++ii) {
+        if (!pcols.contains(ii->index(0))) (*ibmisc_error)(-1,
+            "Patch entry Mw(%ld) is not in a changed column", ii->index(0));
+    }
 }
 
 std::unique_ptr<Weighted> new_weighted(LinearType type)
@@ -66,6 +305,18 @@ std::unique_ptr<Weighted> new_weighted(LinearType type)
             return std::unique_ptr<Weighted>(new Weighted_Eigen);
         case LinearType::COMPRESSED :
             return std::unique_ptr<Weighted>(new Weighted_Compressed);
+        case LinearType::COMPRESSED_FLOAT :
+            return std::unique_ptr<Weighted>(new Weighted_Compressed_Float);
+        case LinearType::RUNLENGTH :
+            return std::unique_ptr<Weighted>(new Weighted_RL);
+        case LinearType::SELL :
+            return std::unique_ptr<Weighted>(new Weighted_SELL);
+        case LinearType::MPI :
+            (*ibmisc_error)(-1,
+                "Weighted_MPI must be constructed with a communicator; see Weighted_MPI::nc_read()");
+        case LinearType::CUDA :
+            (*ibmisc_error)(-1,
+                "Weighted_CUDA must be constructed from a matrix on the host");
         default:
             (*ibmisc_error)(-1,
                 "Unrecognized LinearType = %d", type.index());
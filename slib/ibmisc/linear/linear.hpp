@@ -1,9 +1,15 @@
 #ifndef IBMISC_LINEAR_LINEAR_HPP
 #define IBMISC_LINEAR_LINEAR_HPP
 
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
 #include <boost/enum.hpp>
 #include <blitz/array.h>
 #include <ibmisc/netcdf.hpp>
+#include <ibmisc/footprint.hpp>
+#include <ibmisc/parallel.hpp>
 
 namespace ibmisc {
 namespace linear {
@@ -12,6 +18,11 @@ BOOST_ENUM_VALUES(LinearType, int,
     (EIGEN) (0)
     (COMPRESSED) (1)
     (TUPLE) (2)
+    (RUNLENGTH) (3)
+    (MPI) (4)
+    (COMPRESSED_FLOAT) (5)
+    (SELL) (6)
+    (CUDA) (7)
 )
 
 // What do do with output values in the active space
@@ -23,6 +34,8 @@ BOOST_ENUM_VALUES(AccumType, int,
 
 
 
+struct WeightedPatch;
+
 #if 0
 /** Abstract sparse vector, just enough to multiply by. */
 class Vector {
@@ -54,6 +67,31 @@ class Matrix
 };
 #endif
 
+/** A number unique to each matrix, renewed each time it changes, for
+caches keyed on matrix contents (see ComposeCache).  Numbers increase
+monotonically and are never reused; copies get a fresh one. */
+class Generation {
+    uint64_t _val;
+    static uint64_t next();
+public:
+    Generation() : _val(next()) {}
+    Generation(Generation const &) : _val(next()) {}
+    Generation &operator=(Generation const &)
+        { _val = next(); return *this; }
+
+    void renew() { _val = next(); }
+    uint64_t value() const { return _val; }
+};
+
+/** A mutex for lazily built members of a copyable class: copies get
+a new, unlocked mutex of their own. */
+class CopyableMutex : public std::mutex {
+public:
+    CopyableMutex() {}
+    CopyableMutex(CopyableMutex const &) : std::mutex() {}
+    CopyableMutex &operator=(CopyableMutex const &) { return *this; }
+};
+
 /** Encapsulates a (possibly not conservative) regridding matrix with
 weight vectors for input and output vector space.  Implementations use
 either with Eigen matrices on a subspace, or with Zlib-compressed
@@ -71,13 +109,93 @@ public:
     /** True if this matrix is scaled */ 
     bool scaled;
 
+    /** Number of threads apply_M() and apply_weight() may use.  Work
+    is partitioned by output rows (or by vectors), so results are the
+    same as with nthreads=1.  Not stored in ncio(). */
+    int nthreads;
+
+    /** How reductions over threads' partial results are done, where a
+    backend has them (eg Weighted_Compressed::apply_MT()).  Set to
+    REPRODUCIBLE for results that do not depend on nthreads.  May be
+    changed between calls; not stored in ncio(). */
+    ReduceMode reduce_mode;
+
 protected:
     Weighted(LinearType _type, bool _conservative=true, bool _scaled=false)
-        : type(_type), conservative(_conservative), scaled(_scaled) {}
+        : type(_type), conservative(_conservative), scaled(_scaled), nthreads(1),
+        reduce_mode(ReduceMode::FAST), _active_set(false) {}
+
+    /** See active_rows(); guarded by _active_mutex */
+    mutable std::vector<int> _active;
+    mutable bool _active_set;
+    mutable CopyableMutex _active_mutex;
+
+    Generation _generation;
+
+    /** apply_M()'s conservation correction: unless the matrix is
+    conservative (or !force_conservation), scales the rows of Bs so
+    that, for each vector, wM . Bs == Mw . As.
+    @param rows Rows of Bs to scale: the active space, without duplicates */
+    template<class IndexT>
+    void correct_conservation(
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &Bs,
+        std::vector<IndexT> const &rows,
+        bool force_conservation) const
+    {
+        if (!force_conservation || conservative) return;
+        int const nvec = Bs.extent(0);
+        blitz::Array<double,1> wA(nvec), wB(nvec);
+        apply_weight(0, Bs, wB, true);
+        apply_weight(1, As, wA, true);
+        parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+            for (long k=k0; k<k1; ++k) {
+                double const factor = wA(k) / wB(k);
+                for (auto const i : rows) Bs(k,i) *= factor;
+            }
+        });
+    }
+
+    /** Builds the list for active_rows().  This default goes through
+    get_weights(0); backends override it with something cheaper. */
+    virtual void _build_active(std::vector<int> &active) const;
 
 public:
     virtual ~Weighted() {}
 
+    /** Rows of M with a non-zero wM weight, ascending: the rows
+    apply_M() zeroes, masks and conservation-corrects.  Indexing is
+    that of the backend's M (dense, for Weighted_Eigen).  Built on
+    first use, under a lock, so concurrent apply_M() calls are safe;
+    and stored by ncio(), so reading a matrix does not mean decoding wM
+    again. */
+    std::vector<int> const &active_rows() const;
+
+    /** Must be called if wM changes after active_rows() was built. */
+    void clear_active() const
+    {
+        std::lock_guard<std::mutex> lock(_active_mutex);
+        _active.clear();
+        _active_set = false;
+    }
+
+    /** Identifies this matrix's current contents; see Generation */
+    uint64_t generation() const
+        { return _generation.value(); }
+
+    /** Must be called after changing the matrix in place, other than
+    through set_shape(), apply_patch() or ncio(), which call it.
+    Renews generation() and does clear_active(). */
+    void changed()
+        { _generation.renew(); clear_active(); }
+
+    /** @return The matrix that does the work, for code that looks
+    for a particular backend (with dynamic_cast): *this, except for
+    wrappers such as Weighted_Lazy, which return what they wrap.
+    Valid for as long as the returned pointer is held. */
+    virtual std::shared_ptr<Weighted const> concrete() const
+        { return std::shared_ptr<Weighted const>(this, [](Weighted const *) {}); }
+
     /** Sparse shape of the matrix */
     virtual std::array<long,2> shape() const = 0;
 
@@ -102,9 +220,21 @@ public:
         AccumType accum_type=AccumType::REPLACE,
         bool force_conservation=true) const = 0;
 
-    /** Computes As = M * As, result put in place. */
-    virtual void apply_M_inplace(
+    /** Computes rows [i0, i1) of M * As (sparse indexing) into out,
+    leaving the other rows alone; eg the rows in one MPI rank's domain.
+    There is no conservation correction: its factor depends on every
+    row, so it must be applied once the pieces are gathered.  This
+    default multiplies everything into a copy of out; backends
+    override it to do only the work needed. */
+    virtual void apply_M_rows(
         blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        long i0, long i1,
+        AccumType accum_type=AccumType::REPLACE) const;
+
+    /** Computes As = M * As, result put in place.  M must be square. */
+    virtual void apply_M_inplace(
+        blitz::Array<double,2> &As,
         AccumType accum_type=AccumType::REPLACE,
         bool force_conservation=true) const
     {
@@ -113,9 +243,35 @@ public:
     }
 
 
+    /** Computes out = M^T * Bs (sparse indexing), without forming M^T.
+    Only the active part of out (elements with a Mw weight) is touched;
+    there is no conservation correction, since the transpose is used
+    for adjoints.  This default goes through to_coo(); backends
+    override it with native kernels.
+    @param Bs Bs(nvec, nB)
+    @param out out(nvec, nA) */
+    virtual void apply_MT(
+        blitz::Array<double,2> const &Bs,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE) const;
+
     /** @return {weights[0].nnz, M.nnz, weights[1].nnz} */
     virtual long nnz() const = 0;
 
+    /** Memory held by the matrix and its weights.  Backends that don't
+    override this report nothing. */
+    virtual MemoryFootprint memory_footprint(std::string const &name = "Weighted") const
+        { return MemoryFootprint(name); }
+
+    /** Replaces the changed rows and columns of M, wM and Mw with
+    those in patch (see linear/patch.hpp), in place.  The cost should
+    scale with the size of the change, not of the matrix. */
+    virtual void apply_patch(WeightedPatch const &patch)
+    {
+        (*ibmisc_error)(-1,
+            "apply_patch() not implemented for this linear::Weighted type!");
+    }
+
 protected:
     virtual void _to_coo(
         blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
@@ -147,6 +303,25 @@ public:
 
 extern std::unique_ptr<Weighted> new_weighted(LinearType type);
 
+/** Checks [i0, i1) is a valid row range for apply_M_rows() */
+extern void check_rows(blitz::Array<double,2> const &out, long i0, long i1);
+
+/** Inner products of a sparse weight vector with every vector in As,
+for apply_weight(): out(k) += sum_n wvalue[n] * As(k, windex[n]).
+The weights are split into runs of consecutive indices --- dense
+vectors over parts of the active space --- and each block of vectors
+is multiplied by each run as one GEMV (Eigen; which uses BLAS dgemv if
+built with EIGEN_USE_BLAS).  So As is read in one pass, however many
+vectors.  Results do not depend on nthreads.  Instantiated for
+ValueT = double, float. */
+template<class ValueT>
+extern void apply_weight_gemv(
+    std::vector<int> const &windex,
+    std::vector<ValueT> const &wvalue,
+    blitz::Array<double,2> const &As,    // As(nvec, n)
+    blitz::Array<double,1> &out,         // out(nvec)
+    int nthreads = 1);
+
 /** Read a Weighted matrix, either eigen OR compressed. */
 std::unique_ptr<Weighted> nc_read_weighted(netCDF::NcGroup *nc, std::string const &vname);
 
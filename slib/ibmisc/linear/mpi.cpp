@@ -0,0 +1,515 @@
+#include <algorithm>
+#include <cmath>
+#include <ibmisc/linear/mpi.hpp>
+#include <ibmisc/linear/compressed.hpp>
+#include <ibmisc/profile.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+static int const HALO_TAG = 7301;
+static int const HALO_T_TAG = 7302;    // apply_MT(): halo in reverse
+
+// ======================================================
+RunIndex::RunIndex(std::vector<IndexRun> &&runs) : _runs(std::move(runs))
+{
+    long off = 0;
+    _offsets.push_back(off);
+    for (auto const &run : _runs) {
+        off += run.end - run.begin;
+        _offsets.push_back(off);
+    }
+}
+
+long RunIndex::to_local(long ix) const
+{
+    // First run with begin > ix
+    auto ii(std::upper_bound(_runs.begin(), _runs.end(), ix,
+        [](long ix, IndexRun const &run) { return ix < run.begin; }));
+    if (ii == _runs.begin()) return -1;
+    --ii;
+    if (ix >= ii->end) return -1;
+    return _offsets[ii - _runs.begin()] + (ix - ii->begin);
+}
+
+long RunIndex::to_global(long local_ix) const
+{
+    auto ii(std::upper_bound(_offsets.begin(), _offsets.end(), local_ix));
+    size_t const r = (ii - _offsets.begin()) - 1;
+    if (local_ix < 0 || r >= _runs.size()) (*ibmisc_error)(-1,
+        "Local index %ld out of range [0, %ld)", local_ix, size());
+    return _runs[r].begin + (local_ix - _offsets[r]);
+}
+
+// ======================================================
+Weighted_MPI::Weighted_MPI(MPI_Comm _comm,
+    std::array<Indexing,2> const &indexing,
+    std::array<Domain,2> const &domain)
+: Weighted(LinearType::MPI), comm(_comm)
+{
+    MPI_Comm_rank(comm, &mpi_rank);
+    MPI_Comm_size(comm, &mpi_size);
+    for (int i=0; i<2; ++i) {
+        _shape[i] = indexing[i].extent();
+        local[i] = RunIndex(domain_runs(domain[i], indexing[i]));
+    }
+}
+
+/** Reads the blocks of a compressed matrix that hold this rank's rows
+(and weights); see ZArray::nc_read_rows(). */
+template<class ValueT>
+static void nc_read_compressed(
+    Weighted_CompressedT<ValueT> &W,
+    NcIO &ncio, std::string const &vname,
+    std::array<RunIndex,2> const &local)
+{
+    auto info_v = ncio.getVar(vname + ".info");
+    get_or_put_att(info_v, 'r', "conservative", W.conservative);
+    get_or_put_att(info_v, 'r', "scaled", W.scaled);
+
+    std::array<std::vector<std::array<int,2>>,2> ranges;    // {B, A}
+    for (int i=0; i<2; ++i) {
+        for (auto const &run : local[i].runs())
+            ranges[i].push_back({(int)run.begin, (int)run.end});
+    }
+    W.weights[0].nc_read_rows(ncio, vname + ".wM", ranges[0]);
+    W.M.nc_read_rows(ncio, vname + ".M", ranges[0]);
+    W.weights[1].nc_read_rows(ncio, vname + ".Mw", ranges[1]);
+}
+
+void Weighted_MPI::nc_read(netCDF::NcGroup *nc, std::string const &vname)
+{
+    NcIO ncio(nc, 'r');
+    LinearType type;
+    auto info_v = ncio.getVar(vname + ".info");
+    get_or_put_att_enum(info_v, ncio.rw, "type", type);
+
+    // Compressed matrices written with a skip table: read only the
+    // blocks holding our rows, never the whole matrix
+    switch(type.index()) {
+        case LinearType::COMPRESSED : {
+            Weighted_Compressed W;
+            nc_read_compressed(W, ncio, vname, local);
+            set_matrix(W);
+        } break;
+        case LinearType::COMPRESSED_FLOAT : {
+            Weighted_Compressed_Float W;
+            nc_read_compressed(W, ncio, vname, local);
+            set_matrix(W);
+        } break;
+        default :
+            set_matrix(*nc_read_weighted(nc, vname));
+    }
+}
+
+void Weighted_MPI::set_matrix(Weighted const &global)
+{
+    if (global.shape() != _shape) (*ibmisc_error)(-1,
+        "Matrix shape (%ld, %ld) does not match the Indexing (%ld, %ld)",
+        global.shape()[0], global.shape()[1], _shape[0], _shape[1]);
+    conservative = global.conservative;
+    scaled = global.scaled;
+
+    std::vector<Entry> entries;
+    for (int i=0; i<2; ++i) {
+        windex[i].clear();
+        wvalue[i].clear();
+    }
+
+    auto add_weight = [&](int idim, long ix, double val) {
+        long const lix = local[idim].to_local(ix);
+        if (lix < 0) return;
+        windex[idim].push_back(lix);
+        wvalue[idim].push_back(val);
+    };
+
+    auto const pinned(global.concrete());
+    auto const *compressed = dynamic_cast<Weighted_Compressed const *>(pinned.get());
+    if (compressed) {
+        // Decode on the fly; keep only what we own
+        for (auto ii(compressed->M.generator()); ++ii; ) {
+            if (local[0].to_local(ii->index(0)) < 0) continue;
+            entries.push_back(Entry{ii->index(0), ii->index(1), ii->value()});
+        }
+        for (int idim=0; idim<2; ++idim) {
+            for (auto ii(compressed->weights[idim].generator()); ++ii; ) {
+                add_weight(idim, ii->index(0), ii->value());
+            }
+        }
+    } else {
+        blitz::Array<int,1> indices0, indices1;
+        blitz::Array<double,1> values;
+        global.to_coo(indices0, indices1, values);
+        for (int n=0; n<values.extent(0); ++n) {
+            if (local[0].to_local(indices0(n)) < 0) continue;
+            entries.push_back(Entry{indices0(n), indices1(n), values(n)});
+        }
+
+        for (int idim=0; idim<2; ++idim) {
+            blitz::Array<double,1> w;
+            global.get_weights(idim, w);
+            for (int ix=0; ix<w.extent(0); ++ix) {
+                if (w(ix) != 0) add_weight(idim, ix, w(ix));
+            }
+        }
+    }
+
+    finalize(entries);
+}
+
+void Weighted_MPI::finalize(std::vector<Entry> &entries)
+{
+    long const nA_local = local[1].size();
+
+    // Sort by (i,j), combining duplicates
+    std::stable_sort(entries.begin(), entries.end());
+    size_t n = 0;
+    for (size_t e=0; e<entries.size(); ++e) {
+        if (n > 0 && entries[n-1].i == entries[e].i && entries[n-1].j == entries[e].j) {
+            entries[n-1].val += entries[e].val;
+        } else {
+            entries[n++] = entries[e];
+        }
+    }
+    entries.resize(n);
+
+    // ------------ Which rank owns each part of A?
+    struct OwnedRun { long begin, end; int rank; };
+    std::vector<OwnedRun> owners;
+    {
+        std::vector<long> mine;
+        for (auto const &run : local[1].runs()) {
+            mine.push_back(run.begin);
+            mine.push_back(run.end);
+        }
+        int const nmine = mine.size();
+        std::vector<int> counts(mpi_size), displs(mpi_size);
+        MPI_Allgather(&nmine, 1, MPI_INT, &counts[0], 1, MPI_INT, comm);
+        int total = 0;
+        for (int p=0; p<mpi_size; ++p) {
+            displs[p] = total;
+            total += counts[p];
+        }
+        std::vector<long> all(std::max(total,1));
+        MPI_Allgatherv(mine.data(), nmine, MPI_LONG,
+            &all[0], &counts[0], &displs[0], MPI_LONG, comm);
+        for (int p=0; p<mpi_size; ++p) {
+            for (int k=displs[p]; k<displs[p]+counts[p]; k += 2) {
+                owners.push_back(OwnedRun{all[k], all[k+1], p});
+            }
+        }
+        std::sort(owners.begin(), owners.end(),
+            [](OwnedRun const &a, OwnedRun const &b) { return a.begin < b.begin; });
+    }
+    auto owner_of = [&](long j) -> int {
+        auto ii(std::upper_bound(owners.begin(), owners.end(), j,
+            [](long j, OwnedRun const &run) { return j < run.begin; }));
+        if (ii == owners.begin() || j >= (--ii)->end) (*ibmisc_error)(-1,
+            "Column %ld of M is not in the A Domain of any rank", j);
+        return ii->rank;
+    };
+
+    // ------------ Halo: columns we need from others, by (owner, j)
+    std::vector<std::pair<int,long>> halo;
+    for (auto const &ent : entries) {
+        if (local[1].to_local(ent.j) < 0) halo.push_back(std::make_pair(0, ent.j));
+    }
+    std::sort(halo.begin(), halo.end(),
+        [](std::pair<int,long> const &a, std::pair<int,long> const &b) { return a.second < b.second; });
+    halo.erase(std::unique(halo.begin(), halo.end()), halo.end());
+    for (auto &hh : halo) hh.first = owner_of(hh.second);
+    std::stable_sort(halo.begin(), halo.end());
+
+    // Halo index of each column, looked up by j
+    std::vector<std::pair<long,int>> halo_of;
+    halo_cols.clear();
+    for (size_t h=0; h<halo.size(); ++h) {
+        halo_of.push_back(std::make_pair(halo[h].second, (int)h));
+        halo_cols.push_back(halo[h].second);
+    }
+    std::sort(halo_of.begin(), halo_of.end());
+
+    std::vector<int> nrecv(mpi_size, 0);
+    for (auto const &hh : halo) ++nrecv[hh.first];
+    recv_ranks.clear();
+    recv_ptr.assign(1, 0);
+    for (int p=0; p<mpi_size; ++p) {
+        if (nrecv[p] == 0) continue;
+        recv_ranks.push_back(p);
+        recv_ptr.push_back(recv_ptr.back() + nrecv[p]);
+    }
+
+    // ------------ Tell the owners what we need
+    std::vector<int> nsend(mpi_size);
+    MPI_Alltoall(&nrecv[0], 1, MPI_INT, &nsend[0], 1, MPI_INT, comm);
+
+    std::vector<int> rdispls(mpi_size), sdispls(mpi_size);
+    int nrecv_tot = 0, nsend_tot = 0;
+    for (int p=0; p<mpi_size; ++p) {
+        rdispls[p] = nrecv_tot;
+        nrecv_tot += nrecv[p];
+        sdispls[p] = nsend_tot;
+        nsend_tot += nsend[p];
+    }
+    std::vector<long> need(std::max(nrecv_tot,1));
+    for (size_t h=0; h<halo.size(); ++h) need[h] = halo[h].second;
+    std::vector<long> wanted(std::max(nsend_tot,1));
+    MPI_Alltoallv(&need[0], &nrecv[0], &rdispls[0], MPI_LONG,
+        &wanted[0], &nsend[0], &sdispls[0], MPI_LONG, comm);
+
+    send_ranks.clear();
+    send_ptr.assign(1, 0);
+    send_ix.clear();
+    for (int p=0; p<mpi_size; ++p) {
+        if (nsend[p] == 0) continue;
+        send_ranks.push_back(p);
+        for (int k=sdispls[p]; k<sdispls[p]+nsend[p]; ++k) {
+            long const lj = local[1].to_local(wanted[k]);
+            if (lj < 0) (*ibmisc_error)(-1,
+                "Rank %d asked rank %d for column %ld, which it does not own",
+                p, mpi_rank, wanted[k]);
+            send_ix.push_back(lj);
+        }
+        send_ptr.push_back(send_ix.size());
+    }
+
+    // ------------ Local CSR matrix
+    rows.clear();
+    row_ptr.assign(1, 0);
+    cols.clear();
+    vals.clear();
+    interior.clear();
+    boundary.clear();
+    bool row_has_halo = false;
+    for (size_t e=0; e<entries.size(); ++e) {
+        auto const &ent(entries[e]);
+        if (e == 0 || ent.i != entries[e-1].i) {
+            if (e > 0) {
+                (row_has_halo ? boundary : interior).push_back(rows.size()-1);
+                row_ptr.push_back(cols.size());
+            }
+            rows.push_back(local[0].to_local(ent.i));
+            row_has_halo = false;
+        }
+
+        long lj = local[1].to_local(ent.j);
+        if (lj < 0) {
+            auto ii(std::lower_bound(halo_of.begin(), halo_of.end(),
+                std::make_pair(ent.j, 0)));
+            lj = nA_local + ii->second;
+            row_has_halo = true;
+        }
+        cols.push_back(lj);
+        vals.push_back(ent.val);
+    }
+    if (entries.size() > 0) {
+        (row_has_halo ? boundary : interior).push_back(rows.size()-1);
+        row_ptr.push_back(cols.size());
+    }
+}
+
+// ------------------------------------------------------
+void Weighted_MPI::apply_weight(
+    int dim,    // 0=B, 1=A
+    blitz::Array<double,2> const &As,    // As(nvec, nlocal)
+    blitz::Array<double,1> &out,          // out(nvec)
+    bool zero_out) const
+{
+    int const nvec = As.extent(0);
+    if (As.extent(1) != local[dim].size()) (*ibmisc_error)(-1,
+        "As has %d local elements, expected %ld", As.extent(1), local[dim].size());
+
+    std::vector<double> part(nvec, 0.), sum(nvec);
+    for (size_t n=0; n<windex[dim].size(); ++n) {
+        int const ix = windex[dim][n];
+        double const w = wvalue[dim][n];
+        for (int k=0; k<nvec; ++k) part[k] += w * As(k,ix);
+    }
+    MPI_Allreduce(&part[0], &sum[0], nvec, MPI_DOUBLE, MPI_SUM, comm);
+
+    for (int k=0; k<nvec; ++k) {
+        out(k) = (zero_out ? 0. : out(k)) + sum[k];
+    }
+}
+
+void Weighted_MPI::apply_M(
+    blitz::Array<double,2> const &As,    // As(nvec, nA_local)
+    blitz::Array<double,2> &Bs,         // Bs(nvec, nB_local)
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    IBMISC_SCOPED_TIMER("Weighted_MPI::apply_M");
+    int const nvec = As.extent(0);
+    long const nA_local = local[1].size();
+    if (As.extent(1) != nA_local) (*ibmisc_error)(-1,
+        "As has %d local elements, expected %ld", As.extent(1), nA_local);
+    if (Bs.extent(1) != local[0].size()) (*ibmisc_error)(-1,
+        "Bs has %d local elements, expected %ld", Bs.extent(1), local[0].size());
+
+    // Start the halo exchange
+    std::vector<double> recvbuf(std::max(nhalo() * nvec, 1L));
+    std::vector<double> sendbuf(std::max((long)send_ix.size() * nvec, 1L));
+    std::vector<MPI_Request> requests;
+    requests.reserve(recv_ranks.size() + send_ranks.size());
+
+    for (size_t p=0; p<recv_ranks.size(); ++p) {
+        requests.push_back(MPI_Request());
+        MPI_Irecv(&recvbuf[recv_ptr[p] * nvec], (recv_ptr[p+1]-recv_ptr[p]) * nvec,
+            MPI_DOUBLE, recv_ranks[p], HALO_TAG, comm, &requests.back());
+    }
+    for (size_t n=0; n<send_ix.size(); ++n) {
+        for (int k=0; k<nvec; ++k) sendbuf[n*nvec + k] = As(k, send_ix[n]);
+    }
+    for (size_t p=0; p<send_ranks.size(); ++p) {
+        requests.push_back(MPI_Request());
+        MPI_Isend(&sendbuf[send_ptr[p] * nvec], (send_ptr[p+1]-send_ptr[p]) * nvec,
+            MPI_DOUBLE, send_ranks[p], HALO_TAG, comm, &requests.back());
+    }
+
+    // Prepare the active space of Bs
+    for (int const i : windex[0]) {
+        switch(accum_type.index()) {
+            case AccumType::REPLACE :
+                for (int k=0; k<nvec; ++k) Bs(k,i) = 0;
+            break;
+            case AccumType::REPLACE_OR_ACCUMULATE :
+                for (int k=0; k<nvec; ++k) {
+                    auto &Bs_ki(Bs(k,i));
+                    if (std::isnan(Bs_ki)) Bs_ki = 0;
+                }
+            break;
+        }
+    }
+
+    auto multiply_row = [&](int r) {
+        int const i = rows[r];
+        for (long e=row_ptr[r]; e<row_ptr[r+1]; ++e) {
+            int const j = cols[e];
+            if (j < nA_local) {
+                for (int k=0; k<nvec; ++k) Bs(k,i) += vals[e] * As(k,j);
+            } else {
+                double const *halo_j = &recvbuf[(j - nA_local) * nvec];
+                for (int k=0; k<nvec; ++k) Bs(k,i) += vals[e] * halo_j[k];
+            }
+        }
+    };
+
+    // Overlap: rows needing only local columns
+    for (int const r : interior) multiply_row(r);
+
+    // Rows that need halo elements
+    MPI_Waitall(recv_ranks.size(), requests.data(), MPI_STATUSES_IGNORE);
+    for (int const r : boundary) multiply_row(r);
+
+    MPI_Waitall(send_ranks.size(), requests.data() + recv_ranks.size(), MPI_STATUSES_IGNORE);
+
+    correct_conservation(As, Bs, windex[0], force_conservation);
+}
+
+void Weighted_MPI::apply_MT(
+    blitz::Array<double,2> const &Bs,    // Bs(nvec, nB_local)
+    blitz::Array<double,2> &As,          // As(nvec, nA_local)
+    AccumType accum_type) const
+{
+    int const nvec = Bs.extent(0);
+    long const nA_local = local[1].size();
+    if (Bs.extent(1) != local[0].size()) (*ibmisc_error)(-1,
+        "Bs has %d local elements, expected %ld", Bs.extent(1), local[0].size());
+    if (As.extent(1) != nA_local) (*ibmisc_error)(-1,
+        "As has %d local elements, expected %ld", As.extent(1), nA_local);
+
+    // Contributions to halo elements go back to their owners; and we
+    // receive contributions to the elements we usually send.
+    std::vector<double> hbuf(std::max(nhalo() * nvec, 1L), 0.);
+    std::vector<double> rbuf(std::max((long)send_ix.size() * nvec, 1L));
+    std::vector<MPI_Request> requests;
+    requests.reserve(recv_ranks.size() + send_ranks.size());
+
+    for (size_t p=0; p<send_ranks.size(); ++p) {
+        requests.push_back(MPI_Request());
+        MPI_Irecv(&rbuf[send_ptr[p] * nvec], (send_ptr[p+1]-send_ptr[p]) * nvec,
+            MPI_DOUBLE, send_ranks[p], HALO_T_TAG, comm, &requests.back());
+    }
+
+    // Prepare the active space of As
+    for (int const j : windex[1]) {
+        switch(accum_type.index()) {
+            case AccumType::REPLACE :
+                for (int k=0; k<nvec; ++k) As(k,j) = 0;
+            break;
+            case AccumType::REPLACE_OR_ACCUMULATE :
+                for (int k=0; k<nvec; ++k) {
+                    auto &As_kj(As(k,j));
+                    if (std::isnan(As_kj)) As_kj = 0;
+                }
+            break;
+        }
+    }
+
+    auto scatter_row = [&](int r) {
+        int const i = rows[r];
+        for (long e=row_ptr[r]; e<row_ptr[r+1]; ++e) {
+            int const j = cols[e];
+            if (j < nA_local) {
+                for (int k=0; k<nvec; ++k) As(k,j) += vals[e] * Bs(k,i);
+            } else {
+                double *halo_j = &hbuf[(j - nA_local) * nvec];
+                for (int k=0; k<nvec; ++k) halo_j[k] += vals[e] * Bs(k,i);
+            }
+        }
+    };
+
+    // Rows that touch the halo first, so it can be sent early
+    for (int const r : boundary) scatter_row(r);
+    for (size_t p=0; p<recv_ranks.size(); ++p) {
+        requests.push_back(MPI_Request());
+        MPI_Isend(&hbuf[recv_ptr[p] * nvec], (recv_ptr[p+1]-recv_ptr[p]) * nvec,
+            MPI_DOUBLE, recv_ranks[p], HALO_T_TAG, comm, &requests.back());
+    }
+
+    // Overlap: rows needing only local columns
+    for (int const r : interior) scatter_row(r);
+
+    // Add in contributions from other ranks, in rank order
+    MPI_Waitall(send_ranks.size(), requests.data(), MPI_STATUSES_IGNORE);
+    for (size_t n=0; n<send_ix.size(); ++n) {
+        for (int k=0; k<nvec; ++k) As(k, send_ix[n]) += rbuf[n*nvec + k];
+    }
+
+    MPI_Waitall(recv_ranks.size(), requests.data() + send_ranks.size(), MPI_STATUSES_IGNORE);
+}
+
+void Weighted_MPI::ncio(NcIO &ncio, std::string const &vname)
+{
+    (*ibmisc_error)(-1,
+        "Weighted_MPI::ncio(%s): distributed matrices cannot be written", vname.c_str());
+}
+
+void Weighted_MPI::_to_coo(
+    blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+    blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+    blitz::Array<double,1> &values) const      // Must bepre-allocated(nnz)
+{
+    long const nA_local = local[1].size();
+    long n = 0;
+    for (size_t r=0; r<rows.size(); ++r) {
+        long const i = local[0].to_global(rows[r]);
+        for (long e=row_ptr[r]; e<row_ptr[r+1]; ++e) {
+            indices0(n) = i;
+            indices1(n) = (cols[e] < nA_local ? local[1].to_global(cols[e]) : halo_cols[cols[e] - nA_local]);
+            values(n) = vals[e];
+            ++n;
+        }
+    }
+}
+
+void Weighted_MPI::_get_weights(
+    int idim,    // 0=wM, 1=Mw
+    blitz::Array<double,1> &w) const
+{
+    for (size_t n=0; n<windex[idim].size(); ++n) {
+        w(local[idim].to_global(windex[idim][n])) += wvalue[idim][n];
+    }
+}
+
+}}    // namespace
@@ -0,0 +1,169 @@
+#ifndef IBMISC_LINEAR_MPI_HPP
+#define IBMISC_LINEAR_MPI_HPP
+
+#include <mpi.h>
+#include <ibmisc/linear/linear.hpp>
+#include <ibmisc/indexing.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+/** Numbers the elements of a set of IndexRuns 0..size()-1, in order.
+This is the local (per-rank) indexing of a Domain. */
+class RunIndex {
+    std::vector<IndexRun> _runs;
+    std::vector<long> _offsets;    // _offsets[r] = local index of _runs[r].begin
+
+public:
+    RunIndex() {}
+    RunIndex(std::vector<IndexRun> &&runs);
+
+    std::vector<IndexRun> const &runs() const
+        { return _runs; }
+
+    long size() const
+        { return _offsets.size() == 0 ? 0 : _offsets.back(); }
+
+    /** @return Local index of global index ix; or -1 if not in the set */
+    long to_local(long ix) const;
+
+    long to_global(long local_ix) const;
+};
+
+// ==================================================================
+/** A Weighted matrix distributed over the ranks of an MPI
+communicator.  Each rank holds only the rows of M (and elements of wM)
+in its B Domain, and the elements of Mw in its A Domain.
+
+apply_M() and apply_weight() operate on vectors in local indexing:
+As(nvec, nA_local) holds the elements of A owned by this rank, in the
+order of domain_runs() (see RunIndex); likewise Bs(nvec, nB_local).
+Columns of M owned by other ranks are received in a halo exchange,
+whose pattern is computed once, when the matrix is loaded.
+
+All methods that communicate (apply_M(), apply_weight(), nc_read(),
+set_matrix()) are collective: every rank must call them. */
+class Weighted_MPI : public Weighted
+{
+    MPI_Comm comm;
+    int mpi_rank, mpi_size;
+    std::array<long,2> _shape;          // Global sparse shape
+    std::array<RunIndex,2> local;       // {B, A}: local <-> global indices
+
+    // Owned rows of M, CSR; entries in the same order as the serial
+    // matrix, so results are bitwise the same.
+    std::vector<int> rows;             // Local B index of each row
+    std::vector<long> row_ptr;         // Entries of rows[r] are [row_ptr[r], row_ptr[r+1])
+    std::vector<int> cols;             // Local A index, or nA_local + halo index
+    std::vector<double> vals;
+    std::vector<int> interior;         // Rows (r) that need no halo elements
+    std::vector<int> boundary;         // Rows (r) that do
+
+    std::array<std::vector<int>,2> windex;      // {wM, Mw}, local indexing
+    std::array<std::vector<double>,2> wvalue;
+
+    // Halo exchange pattern
+    std::vector<int> send_ranks;
+    std::vector<int> send_ptr;         // Elements for send_ranks[p] are send_ix[send_ptr[p] .. send_ptr[p+1])
+    std::vector<int> send_ix;          // Local A indices to send
+    std::vector<int> recv_ranks;
+    std::vector<int> recv_ptr;         // Halo elements from recv_ranks[p] are [recv_ptr[p], recv_ptr[p+1])
+    std::vector<long> halo_cols;       // Global A index of each halo element
+
+public:
+    /** @param indexing {B, A} Indexing of the sparse B and A vector spaces
+    @param domain {B, A} Part of B and A owned by this rank.  Domains of
+        different ranks must not overlap. */
+    Weighted_MPI(MPI_Comm _comm,
+        std::array<Indexing,2> const &indexing,
+        std::array<Domain,2> const &domain);
+
+    /** Number of elements of B (0) or A (1) owned by this rank */
+    long local_extent(int idim) const
+        { return local[idim].size(); }
+
+    /** Local <-> global indexing of B (0) or A (1) */
+    RunIndex const &run_index(int idim) const
+        { return local[idim]; }
+
+    /** Number of halo elements this rank receives in apply_M() */
+    long nhalo() const
+        { return recv_ptr.size() == 0 ? 0 : recv_ptr.back(); }
+
+    /** Loads a (serial) Weighted matrix of any type, written by ncio(),
+    keeping only the parts owned by this rank.  Compressed matrices
+    written framed and with a skip table (see ZArray::index_blocks())
+    are read a block at a time: each rank reads only the blocks holding
+    its own rows, so no rank reads the whole matrix.  Other matrices are
+    read whole, then trimmed. */
+    void nc_read(netCDF::NcGroup *nc, std::string const &vname);
+
+    /** Takes the parts owned by this rank from a (serial) matrix. */
+    void set_matrix(Weighted const &global);
+
+    // ================= Implements Weighted
+    /** Global sparse shape of the matrix */
+    std::array<long,2> shape() const
+        { return _shape; }
+
+    /** Computes out = As * weights[dim], summed over all ranks.  The
+    result is in out on every rank.
+    @param As As(nvec, local_extent(dim)) */
+    void apply_weight(
+        int dim,    // 0=B, 1=A
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,1> &out,
+        bool zero_out=true) const;
+
+    /** Computes out = M * As.  Rows that need no halo elements are
+    multiplied while the halo exchange is in flight.
+    @param As As(nvec, local_extent(1))
+    @param out out(nvec, local_extent(0)) */
+    void apply_M(
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    /** Computes out = M^T * Bs.  Contributions to A elements owned by
+    other ranks are sent back to them: the halo exchange in reverse.
+    @param Bs Bs(nvec, local_extent(0))
+    @param out out(nvec, local_extent(1)) */
+    void apply_MT(
+        blitz::Array<double,2> const &Bs,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE) const;
+
+    /** Number of elements of M held on this rank */
+    long nnz() const
+        { return vals.size(); }
+
+    /** Distributed matrices cannot be written; write the serial matrix. */
+    void ncio(NcIO &ncio, std::string const &vname);
+
+protected:
+    /** This rank's part of M, in global sparse indexing */
+    void _to_coo(
+        blitz::Array<int,1> &indices0,
+        blitz::Array<int,1> &indices1,
+        blitz::Array<double,1> &values) const;
+
+    /** Adds this rank's weights into w(global sparse index) */
+    void _get_weights(
+        int idim,    // 0=wM, 1=Mw
+        blitz::Array<double,1> &w) const;
+
+private:
+    struct Entry {
+        long i, j;    // Global sparse index
+        double val;
+        bool operator<(Entry const &other) const
+            { return (i < other.i) || (i == other.i && j < other.j); }
+    };
+
+    /** Builds the local CSR matrix and halo exchange pattern */
+    void finalize(std::vector<Entry> &entries);
+};
+
+}}    // namespace
+#endif    // guard
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <limits>
+#include <ibmisc/linear/overlap.hpp>
+#include <ibmisc/RTree.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/profile.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+typedef std::array<double,2> Point;
+
+/** Twice the signed area; positive if counter-clockwise */
+static double area2(Point const *p, long n)
+{
+    double ret = 0;
+    for (long k=0; k<n; ++k) {
+        Point const &a(p[k]);
+        Point const &b(p[k+1 < n ? k+1 : 0]);
+        ret += a[0]*b[1] - b[0]*a[1];
+    }
+    return ret;
+}
+
+void PolyGrid::add(long id, std::vector<Point> const &verts)
+{
+    if (verts.size() < 3) (*ibmisc_error)(-1,
+        "PolyGrid cell %ld has %ld vertices; need at least 3", id, (long)verts.size());
+    if (sparse_extent >= 0 && (id < 0 || id >= sparse_extent)) (*ibmisc_error)(-1,
+        "PolyGrid cell id %ld out of range [0, %ld)", id, sparse_extent);
+
+    ids.push_back(id);
+    if (area2(&verts[0], verts.size()) >= 0) {
+        vertices.insert(vertices.end(), verts.begin(), verts.end());
+    } else {
+        vertices.insert(vertices.end(), verts.rbegin(), verts.rend());
+    }
+    vptr.push_back(vertices.size());
+}
+
+double PolyGrid::area(long c) const
+    { return .5 * area2(&vertices[vptr[c]], vptr[c+1] - vptr[c]); }
+
+namespace _overlap {
+
+double clip_area(
+    Point const *subj, long nsubj,
+    Point const *clip, long nclip,
+    std::vector<Point> &work0,
+    std::vector<Point> &work1)
+{
+    work0.assign(subj, subj + nsubj);
+    for (long e=0; e<nclip && work0.size() >= 3; ++e) {
+        Point const &p0(clip[e]);
+        Point const &p1(clip[e+1 < nclip ? e+1 : 0]);
+        double const ex = p1[0] - p0[0];
+        double const ey = p1[1] - p0[1];
+
+        // Keep the part of work0 left of edge p0->p1
+        work1.clear();
+        long const n = work0.size();
+        double ds = ex*(work0[0][1] - p0[1]) - ey*(work0[0][0] - p0[0]);
+        for (long k=0; k<n; ++k) {
+            Point const &s(work0[k]);
+            Point const &t(work0[k+1 < n ? k+1 : 0]);
+            double const dt = ex*(t[1] - p0[1]) - ey*(t[0] - p0[0]);
+            if (ds >= 0) work1.push_back(s);
+            if ((ds >= 0) != (dt >= 0)) {
+                double const f = ds / (ds - dt);
+                work1.push_back({s[0] + f*(t[0] - s[0]), s[1] + f*(t[1] - s[1])});
+            }
+            ds = dt;
+        }
+        work0.swap(work1);
+    }
+    if (work0.size() < 3) return 0;
+    return std::max(0., .5 * area2(&work0[0], work0.size()));
+}
+
+}    // namespace ibmisc::linear::_overlap
+
+namespace {
+
+/** One overlap, by cell number in each grid */
+struct Overlap {
+    int i;    // gridB
+    int j;    // gridA
+    double area;
+};
+
+void bounding_boxes(PolyGrid const &grid, std::vector<double> &bmin, std::vector<double> &bmax)
+{
+    long const n = grid.size();
+    bmin.resize(2*n);
+    bmax.resize(2*n);
+    for (long c=0; c<n; ++c) {
+        for (int k=0; k<2; ++k) {
+            bmin[2*c+k] = std::numeric_limits<double>::max();
+            bmax[2*c+k] = std::numeric_limits<double>::lowest();
+        }
+        for (long v=grid.vptr[c]; v<grid.vptr[c+1]; ++v) {
+            for (int k=0; k<2; ++k) {
+                bmin[2*c+k] = std::min(bmin[2*c+k], grid.vertices[v][k]);
+                bmax[2*c+k] = std::max(bmax[2*c+k], grid.vertices[v][k]);
+            }
+        }
+    }
+}
+
+}    // anonymous namespace
+
+Weighted_Tuple overlap_tuple(
+    PolyGrid const &gridB, PolyGrid const &gridA,
+    int nthreads, bool scale, double min_area)
+{
+    IBMISC_SCOPED_TIMER("linear::overlap_tuple");
+    long const nA = gridA.size();
+    long const nB = gridB.size();
+
+    // Bulk-load an RTree over A, then flatten it for fast queries
+    std::vector<double> amin, amax, bmin, bmax;
+    bounding_boxes(gridA, amin, amax);
+    bounding_boxes(gridB, bmin, bmax);
+    FlatRTree<int,double,2> tree;
+    {
+        std::vector<int> aix(nA);
+        for (long j=0; j<nA; ++j) aix[j] = j;
+        RTree<int,double,2> rtree;
+        if (nA > 0) rtree.BulkLoad(nA, &amin[0], &amax[0], &aix[0]);
+        rtree.Freeze(tree);
+    }
+
+    // Chunks of B cells collect their overlaps separately; each
+    // chunk's RTree queries go as one batch
+    long const nchunks = std::max(1L, std::min(nB, 4L*nthreads));
+    std::vector<std::vector<Overlap>> parts(nchunks);
+    parallel_for(0, nchunks, nthreads, [&](long c0, long c1) {
+        std::vector<Point> work0, work1;
+        std::vector<long> offsets;
+        std::vector<int> hits;
+        for (long c=c0; c<c1; ++c) {
+            long const i0 = nB * c / nchunks;
+            long const i1 = nB * (c+1) / nchunks;
+            if (i1 == i0) continue;
+            tree.SearchBatch(i1-i0, &bmin[2*i0], &bmax[2*i0], offsets, hits, 1);
+
+            for (long i=i0; i<i1; ++i) {
+                Point const *clip = &gridB.vertices[gridB.vptr[i]];
+                long const nclip = gridB.vptr[i+1] - gridB.vptr[i];
+                for (long h=offsets[i-i0]; h<offsets[i-i0+1]; ++h) {
+                    int const j = hits[h];
+                    double const area = _overlap::clip_area(
+                        &gridA.vertices[gridA.vptr[j]], gridA.vptr[j+1] - gridA.vptr[j],
+                        clip, nclip, work0, work1);
+                    if (area > min_area) parts[c].push_back(Overlap{(int)i, j, area});
+                }
+            }
+        }
+    });
+
+    // Weights: areas covered
+    std::vector<double> wB(nB, 0), wA(nA, 0);
+    for (auto const &part : parts) {
+        for (auto const &ov : part) {
+            wB[ov.i] += ov.area;
+            wA[ov.j] += ov.area;
+        }
+    }
+
+    Weighted_Tuple ret(true);
+    ret.scaled = scale;
+    ret.set_shape({gridB.sparse_extent, gridA.sparse_extent});
+    for (long i=0; i<nB; ++i) if (wB[i] > 0) ret.wM.add({gridB.ids[i]}, wB[i]);
+    for (long j=0; j<nA; ++j) if (wA[j] > 0) ret.Mw.add({gridA.ids[j]}, wA[j]);
+
+    size_t nnz = 0;
+    for (auto const &part : parts) nnz += part.size();
+    ret.M.reserve(nnz);
+    for (auto &part : parts) {
+        for (auto const &ov : part) {
+            ret.M.add({gridB.ids[ov.i], gridA.ids[ov.j]},
+                scale ? ov.area / wB[ov.i] : ov.area);
+        }
+        std::vector<Overlap>().swap(part);
+    }
+    ret.consolidate(nthreads);
+    return ret;
+}
+
+std::unique_ptr<Weighted_Eigen> overlap_eigen(
+    PolyGrid const &gridB, PolyGrid const &gridA,
+    int nthreads, bool scale, double min_area)
+{
+    return to_eigen(overlap_tuple(gridB, gridA, nthreads, scale, min_area), nthreads);
+}
+
+}}    // namespace
@@ -0,0 +1,75 @@
+#ifndef IBMISC_LINEAR_OVERLAP_HPP
+#define IBMISC_LINEAR_OVERLAP_HPP
+
+#include <array>
+#include <memory>
+#include <vector>
+#include <ibmisc/linear/tuple.hpp>
+#include <ibmisc/linear/eigen.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+/** A grid of convex polygons in the plane, eg the cells of an ice
+grid and of a GCM grid, in the same map projection. */
+struct PolyGrid {
+    /** Cell ids are in [0, sparse_extent) */
+    long sparse_extent;
+
+    /** Sparse index of each cell */
+    std::vector<long> ids;
+
+    /** Vertices of cell c are vertices[vptr[c] : vptr[c+1]],
+    counter-clockwise */
+    std::vector<long> vptr;
+    std::vector<std::array<double,2>> vertices;
+
+    PolyGrid(long _sparse_extent = -1) : sparse_extent(_sparse_extent), vptr(1, 0) {}
+
+    long size() const
+        { return ids.size(); }
+
+    /** Adds a cell.  Vertices may go either way around; the cell must
+    be convex. */
+    void add(long id, std::vector<std::array<double,2>> const &verts);
+
+    /** @return Area of cell c */
+    double area(long c) const;
+};
+
+/** Computes the conservative regrid matrix BvA from the overlaps of
+two polygon grids.  An RTree is bulk-loaded over the bounding boxes of
+gridA, then chunks of gridB's cells are queried and clipped against
+their candidates on nthreads threads.  Results do not depend on
+nthreads.
+
+    wM(i) = area of B cell i covered by A
+    Mw(j) = area of A cell j covered by B
+    M(i,j) = overlap(i,j) / wM(i), or overlap(i,j) if !scale
+
+@param min_area Overlaps at or below this are dropped (eg slivers
+    from cells that only share an edge). */
+Weighted_Tuple overlap_tuple(
+    PolyGrid const &gridB, PolyGrid const &gridA,
+    int nthreads = 1, bool scale = true, double min_area = 0);
+
+/** Same as overlap_tuple(), converted to a Weighted_Eigen */
+std::unique_ptr<Weighted_Eigen> overlap_eigen(
+    PolyGrid const &gridB, PolyGrid const &gridA,
+    int nthreads = 1, bool scale = true, double min_area = 0);
+
+namespace _overlap {
+
+/** Area of the intersection of two convex, counter-clockwise polygons
+(Sutherland-Hodgman clipping of subj by each edge of clip).
+@param work0, work1 Scratch space, reused between calls */
+extern double clip_area(
+    std::array<double,2> const *subj, long nsubj,
+    std::array<double,2> const *clip, long nclip,
+    std::vector<std::array<double,2>> &work0,
+    std::vector<std::array<double,2>> &work1);
+
+}    // namespace ibmisc::linear::_overlap
+
+}}    // namespace
+#endif    // guard
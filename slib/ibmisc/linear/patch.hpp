@@ -0,0 +1,48 @@
+#ifndef IBMISC_LINEAR_PATCH_HPP
+#define IBMISC_LINEAR_PATCH_HPP
+
+#include <algorithm>
+#include <vector>
+#include <spsparse/tuplelist.hpp>
+#include <ibmisc/linear/linear.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+/** A change to a Weighted matrix, eg after the geometry of a few grid
+cells changed.  Applying it replaces everything in the changed rows of
+M and wM, and the changed columns of M and Mw, with the entries given
+here; the rest of the matrix is left alone.  (Sparse indexing.) */
+struct WeightedPatch {
+    std::vector<long> rows;    // Changed rows (B)
+    std::vector<long> cols;    // Changed columns (A)
+
+    /** New entries; each must lie in a changed row or column */
+    spsparse::TupleList<long,double,2> M;
+    /** New weights; in changed rows (wM) or columns (Mw) only */
+    spsparse::TupleList<long,double,1> wM, Mw;
+
+    /** Errors if an entry is out of range, or not in a changed row
+    or column. */
+    void check(std::array<long,2> const &shape) const;
+};
+
+/** Sorted set of changed rows (or columns) of a WeightedPatch */
+class PatchedSet {
+    std::vector<long> ix;
+public:
+    PatchedSet(std::vector<long> const &_ix) : ix(_ix)
+    {
+        std::sort(ix.begin(), ix.end());
+        ix.erase(std::unique(ix.begin(), ix.end()), ix.end());
+    }
+
+    std::vector<long> const &sorted() const
+        { return ix; }
+
+    bool contains(long i) const
+        { return std::binary_search(ix.begin(), ix.end(), i); }
+};
+
+}}    // namespace
+#endif    // guard
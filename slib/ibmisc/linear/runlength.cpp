@@ -0,0 +1,204 @@
+#include <spsparse/eigen.hpp>
+#include <spsparse/SparseSet.hpp>
+#include <ibmisc/linear/runlength.hpp>
+#include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/profile.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+void Weighted_RL::set_shape(std::array<long,2> _shape)
+{
+    changed();
+    M.set_shape(_shape);
+    weights[0].set_shape({_shape[0]});
+    weights[1].set_shape({_shape[1]});
+}
+
+void Weighted_RL::apply_weight(
+    int dim,    // 0=B, 1=A
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,1> &out,          // out(nvec)
+    bool zero_out) const
+{
+    auto const nvec(As.extent(0));
+
+    if (zero_out) out = 0;
+
+    // Each thread computes out(k) for its own range of vectors
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        for (auto ii(weights[dim].generator()); ++ii; ) {
+            for (long k=k0; k<k1; ++k) {
+                out(k) += ii->value() * As(k,ii->index(0));
+            }
+        }
+    });
+}
+
+/** y[0:n] += a * x[0:n]; written plainly so the compiler can vectorize */
+static inline void axpy(long const n, double const a,
+    double const * __restrict__ x, double * __restrict__ y)
+{
+    for (long k=0; k<n; ++k) y[k] += a * x[k];
+}
+
+void Weighted_RL::apply_M(
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,2> &Bs,         // Bs(nvec, nB)
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    IBMISC_SCOPED_TIMER("Weighted_RL::apply_M");
+    profile::work(M.nnz());
+    auto const nvec(As.extent(0));
+
+    // Are the vectors interleaved in memory?  (Vector-major layout)
+    bool const vcontig = (nvec > 1 && As.stride(0) == 1 && Bs.stride(0) == 1);
+
+    // Threads own disjoint sets of vectors k
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        // Prepare the active space of Bs
+        for (auto ii(weights[0].generator()); ++ii; ) {
+            auto const i(ii->index(0));
+            switch(accum_type.index()) {
+                case AccumType::REPLACE :
+                    for (long k=k0; k<k1; ++k) Bs(k,i) = 0;
+                break;
+                case AccumType::REPLACE_OR_ACCUMULATE :
+                    for (long k=k0; k<k1; ++k) {
+                        auto &Bs_ki(Bs(k,i));
+                        if (std::isnan(Bs_ki)) Bs_ki = 0;
+                    }
+                break;
+            }
+        }
+
+        for (auto ii(M.generator()); ++ii; ) {
+            auto const i(ii->index(0));
+            auto const j(ii->index(1));
+            if (vcontig) {
+                axpy(k1-k0, ii->value(), &As(k0,j), &Bs(k0,i));
+            } else {
+                for (long k=k0; k<k1; ++k) Bs(k,i) += ii->value() * As(k,j);
+            }
+        }
+    });
+
+    if (force_conservation && !conservative) {
+        // Compute correction factor for each variable
+        blitz::Array<double,1> wA(nvec);
+        blitz::Array<double,1> wB(nvec);
+
+        apply_weight(0, Bs, wB, true);
+        apply_weight(1, As, wA, true);
+
+        blitz::Array<double,1> factor(nvec);
+        for (int k=0; k<nvec; ++k) factor(k)=wA(k)/wB(k);
+
+        // Multiply by correction factor
+        parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+            for (auto ii(weights[0].generator()); ++ii; ) {
+                auto const i(ii->index(0));
+                for (long k=k0; k<k1; ++k) {
+                    Bs(k,i) *= factor(k);
+                }
+            }
+        });
+    }
+}
+
+void Weighted_RL::apply_MT(
+    blitz::Array<double,2> const &Bs,    // Bs(nvec, nB)
+    blitz::Array<double,2> &As,          // As(nvec, nA)
+    AccumType accum_type) const
+{
+    auto const nvec(Bs.extent(0));
+
+    // Threads own disjoint sets of vectors k
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        // Prepare the active space of As
+        for (auto ii(weights[1].generator()); ++ii; ) {
+            auto const j(ii->index(0));
+            switch(accum_type.index()) {
+                case AccumType::REPLACE :
+                    for (long k=k0; k<k1; ++k) As(k,j) = 0;
+                break;
+                case AccumType::REPLACE_OR_ACCUMULATE :
+                    for (long k=k0; k<k1; ++k) {
+                        auto &As_kj(As(k,j));
+                        if (std::isnan(As_kj)) As_kj = 0;
+                    }
+                break;
+            }
+        }
+
+        for (auto ii(M.generator()); ++ii; ) {
+            auto const i(ii->index(0));
+            auto const j(ii->index(1));
+            for (long k=k0; k<k1; ++k) As(k,j) += ii->value() * Bs(k,i);
+        }
+    });
+}
+
+void Weighted_RL::ncio(NcIO &ncio, std::string const &vname)
+{
+    // Call to superclass
+    Weighted::ncio(ncio, vname);
+
+    weights[0].ncio(ncio, vname + ".wM");
+    M.ncio(ncio, vname + ".M");
+    weights[1].ncio(ncio, vname + ".Mw");
+}
+
+void Weighted_RL::_to_coo(
+    blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+    blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+    blitz::Array<double,1> &values) const      // Must bepre-allocated(nnz)
+{
+    long j = 0;
+    for (auto ii(M.generator()); ++ii; ) {
+        indices0(j) = ii->index(0);
+        indices1(j) = ii->index(1);
+        values(j) = ii->value();
+        ++j;
+    }
+}
+
+void Weighted_RL::_get_weights(
+    int idim,    // 0=wM, 1=Mw
+    blitz::Array<double,1> &w) const
+{
+    for (auto ii(weights[idim].generator()); ++ii; ) {
+        w(ii->index(0)) += ii->value();
+    }
+}
+
+// ======================================================
+Weighted_RL to_runlength(Weighted_Eigen const &eigen)
+{
+    Weighted_RL ret;
+    ret.scaled = eigen.scaled;
+    ret.conservative = eigen.conservative;
+
+    spsparse::spcopy(
+        spsparse::accum::to_sparse(
+            std::array<Weighted_Eigen::SparseSetT *,1>{eigen.dims[0]},
+        ret.weights[0].accum()),
+        eigen.wM);
+
+    spsparse::spcopy(
+        spsparse::accum::to_sparse(eigen.dims,
+        ret.M.accum()),
+        *eigen.M);
+
+    spsparse::spcopy(
+        spsparse::accum::to_sparse(
+            std::array<Weighted_Eigen::SparseSetT *,1>{eigen.dims[1]},
+        ret.weights[1].accum()),
+        eigen.Mw);
+
+    return ret;
+}
+
+}}    // namespace
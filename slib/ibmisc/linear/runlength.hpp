@@ -0,0 +1,72 @@
+#ifndef IBMISC_LINEAR_RUNLENGTH_HPP
+#define IBMISC_LINEAR_RUNLENGTH_HPP
+
+#include <ibmisc/linear/linear.hpp>
+#include <ibmisc/rlarray.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+class Weighted_Eigen;
+
+// ==================================================================
+/** Like Weighted_Compressed, but stored as run-length encoded
+RLArrays rather than zlib-compressed ZArrays.  Regrid matrices with
+long runs of equal weights are nearly as small, and much cheaper to
+decode on each apply_M(). */
+class Weighted_RL : public Weighted
+{
+public:
+    std::array<RLArray<int,double,1>, 2> weights;    // {wM, Mw}
+    RLArray<int,double,2> M;
+
+    Weighted_RL() : Weighted(LinearType::RUNLENGTH) {}
+
+    void set_shape(std::array<long,2> _shape);
+
+    // ================= Implements Weighted
+    /** Sparse shape of the matrix */
+    std::array<long,2> shape() const
+        { return M.shape(); }
+
+    /** Computes out = As * weights[dim] */
+    void apply_weight(
+        int dim,    // 0=B, 1=A
+        blitz::Array<double,2> const &As,    // As(nvec, ndim)
+        blitz::Array<double,1> &out,
+        bool zero_out=true) const;
+
+    /** Computes out = M * As
+    NOTE: As and out cannot be the same! */
+    void apply_M(
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    /** Computes out = M^T * Bs */
+    void apply_MT(
+        blitz::Array<double,2> const &Bs,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE) const;
+
+    void ncio(NcIO &ncio, std::string const &vname);
+
+    long nnz() const
+        { return M.nnz(); }
+
+protected:
+    void _to_coo(
+        blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+        blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+        blitz::Array<double,1> &values) const;      // Must bepre-allocated(nnz)
+
+    void _get_weights(
+        int idim,    // 0=wM, 1=Mw
+        blitz::Array<double,1> &w) const;
+};
+
+extern Weighted_RL to_runlength(Weighted_Eigen const &eigen);
+
+}};    // namespace
+#endif    // guard
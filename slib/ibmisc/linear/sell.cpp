@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <ibmisc/linear/sell.hpp>
+#include <ibmisc/linear/tuple.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/profile.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+int const Weighted_SELL::C;
+
+namespace {
+
+/** acc[0:C] += val[0:C] * x[col[0:C] * stride]: one column of a slice.
+Written plainly over the lanes so the compiler can vectorize it (as a
+gather, with -mavx2 or -mavx512f). */
+inline void sell_column(
+    double const * __restrict__ val,
+    int const * __restrict__ col,
+    double const * __restrict__ x, long const stride,
+    double * __restrict__ acc)
+{
+    for (int r=0; r<Weighted_SELL::C; ++r) acc[r] += val[r] * x[col[r] * stride];
+}
+
+}    // namespace (anonymous)
+
+long Weighted_SELL::nnz() const
+{
+    return std::accumulate(lane_len.begin(), lane_len.end(), 0L);
+}
+
+void Weighted_SELL::apply_weight(
+    int dim,    // 0=B, 1=A
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,1> &out,          // out(nvec)
+    bool zero_out) const
+{
+    auto const nvec(As.extent(0));
+    auto const &index(windex[dim]);
+    auto const &value(wvalue[dim]);
+
+    if (zero_out) out = 0;
+
+    // Each thread computes out(k) for its own range of vectors
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        for (size_t n=0; n<index.size(); ++n) {
+            for (long k=k0; k<k1; ++k) {
+                out(k) += value[n] * As(k,index[n]);
+            }
+        }
+    });
+}
+
+void Weighted_SELL::apply_M(
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,2> &Bs,         // Bs(nvec, nB)
+    AccumType accum_type,
+    bool force_conservation) const
+{
+    IBMISC_SCOPED_TIMER("Weighted_SELL::apply_M");
+    if (profile::enabled()) profile::work(nnz());
+    auto const nvec(As.extent(0));
+    long const astride = As.stride(1);
+
+    // Each row is in just one slice: threads own disjoint sets of slices
+    parallel_for(0, nslices(), nthreads, [&](long s0, long s1) {
+        double acc[C];
+        for (long s=s0; s<s1; ++s) {
+            int const * const srows = &rows[s*C];
+            int const * const slen = &lane_len[s*C];
+            for (long k=0; k<nvec; ++k) {
+                double const * const Ak = &As(k,0);
+                std::fill(acc, acc+C, 0.);
+                for (long p=slice_ptr[s]; p<slice_ptr[s+1]; p += C) {
+                    sell_column(&vals[p], &cols[p], Ak, astride, acc);
+                }
+
+                for (int r=0; r<C; ++r) {
+                    int const i = srows[r];
+                    if (i < 0) continue;
+                    double const val = (slen[r] == 0 ? 0. : acc[r]);
+                    auto &Bs_ki(Bs(k,i));
+                    switch(accum_type.index()) {
+                        case AccumType::REPLACE :
+                            Bs_ki = val;
+                        break;
+                        case AccumType::REPLACE_OR_ACCUMULATE :
+                            Bs_ki = (std::isnan(Bs_ki) ? val : Bs_ki + val);
+                        break;
+                        default :
+                            Bs_ki += val;
+                        break;
+                    }
+                }
+            }
+        }
+    });
+
+    correct_conservation(As, Bs, windex[0], force_conservation);
+}
+
+void Weighted_SELL::apply_MT(
+    blitz::Array<double,2> const &Bs,    // Bs(nvec, nB)
+    blitz::Array<double,2> &As,          // As(nvec, nA)
+    AccumType accum_type) const
+{
+    auto const nvec(Bs.extent(0));
+
+    // Threads own disjoint sets of vectors k
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        // Prepare the active space of As
+        for (int const j : windex[1]) {
+            switch(accum_type.index()) {
+                case AccumType::REPLACE :
+                    for (long k=k0; k<k1; ++k) As(k,j) = 0;
+                break;
+                case AccumType::REPLACE_OR_ACCUMULATE :
+                    for (long k=k0; k<k1; ++k) {
+                        auto &As_kj(As(k,j));
+                        if (std::isnan(As_kj)) As_kj = 0;
+                    }
+                break;
+            }
+        }
+
+        for (long s=0; s<nslices(); ++s) {
+            for (int r=0; r<C; ++r) {
+                int const i = rows[s*C + r];
+                int const len = lane_len[s*C + r];
+                for (int e=0; e<len; ++e) {
+                    long const p = slice_ptr[s] + e*C + r;
+                    for (long k=k0; k<k1; ++k) As(k,cols[p]) += vals[p] * Bs(k,i);
+                }
+            }
+        }
+    });
+}
+
+void Weighted_SELL::ncio(NcIO &ncio, std::string const &vname)
+{
+    // Call to superclass
+    Weighted::ncio(ncio, vname);
+
+    auto info_v = get_or_add_var(ncio, vname + ".info", "int", {});
+    get_or_put_att(info_v, ncio.rw, "shape", "int64", _shape);
+    get_or_put_att(info_v, ncio.rw, "sigma", "int", &sigma, 1);
+    int slice_height = C;
+    get_or_put_att(info_v, ncio.rw, "slice_height", "int", &slice_height, 1);
+    if (slice_height != C) (*ibmisc_error)(-1,
+        "Weighted_SELL %s has slices of %d rows; this build uses %d",
+        vname.c_str(), slice_height, C);
+
+    // Sizes are ignored on read
+    auto lane_dims(get_or_add_dims(ncio, rows, {vname + ".nlanes"}));
+    ncio_vector(ncio, rows, true, vname + ".rows", "int", lane_dims);
+    ncio_vector(ncio, lane_len, true, vname + ".lane_len", "int", lane_dims);
+    ncio_vector(ncio, slice_ptr, true, vname + ".slice_ptr", "int64",
+        get_or_add_dims(ncio, slice_ptr, {vname + ".nslices_p1"}));
+
+    auto entry_dims(get_or_add_dims(ncio, cols, {vname + ".nentries"}));
+    ncio_vector(ncio, cols, true, vname + ".cols", "int", entry_dims);
+    ncio_vector(ncio, vals, true, vname + ".vals", "double", entry_dims);
+
+    std::array<std::string,2> const wnames {"wM", "Mw"};
+    for (int idim=0; idim<2; ++idim) {
+        std::string const wname(vname + "." + wnames[idim]);
+        auto wdims(get_or_add_dims(ncio, windex[idim], {wname + ".nnz"}));
+        ncio_vector(ncio, windex[idim], true, wname + ".index", "int", wdims);
+        ncio_vector(ncio, wvalue[idim], true, wname + ".value", "double", wdims);
+    }
+}
+
+void Weighted_SELL::_to_coo(
+    blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+    blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+    blitz::Array<double,1> &values) const      // Must bepre-allocated(nnz)
+{
+    long n = 0;
+    for (long s=0; s<nslices(); ++s) {
+        for (int r=0; r<C; ++r) {
+            int const len = lane_len[s*C + r];
+            for (int e=0; e<len; ++e) {
+                long const p = slice_ptr[s] + e*C + r;
+                indices0(n) = rows[s*C + r];
+                indices1(n) = cols[p];
+                values(n) = vals[p];
+                ++n;
+            }
+        }
+    }
+}
+
+void Weighted_SELL::_get_weights(
+    int idim,    // 0=wM, 1=Mw
+    blitz::Array<double,1> &w) const
+{
+    for (size_t n=0; n<windex[idim].size(); ++n) {
+        w(windex[idim][n]) += wvalue[idim][n];
+    }
+}
+
+// ======================================================
+Weighted_SELL to_sell(Weighted const &W, int sigma)
+{
+    int const C = Weighted_SELL::C;
+    if (sigma < 1) (*ibmisc_error)(-1,
+        "to_sell(): sigma=%d must be positive", sigma);
+
+    Weighted_SELL ret;
+    ret.conservative = W.conservative;
+    ret.scaled = W.scaled;
+    ret._shape = W.shape();
+    ret.sigma = sigma;
+
+    // ----------- Weights
+    std::array<blitz::Array<double,1>,2> w;
+    for (int idim=0; idim<2; ++idim) {
+        W.get_weights(idim, w[idim]);
+        for (int i=0; i<w[idim].extent(0); ++i) {
+            if (w[idim](i) == 0) continue;
+            ret.windex[idim].push_back(i);
+            ret.wvalue[idim].push_back(w[idim](i));
+        }
+    }
+
+    // ----------- Entries, by row (stable: keep the order within each row)
+    blitz::Array<int,1> indices0, indices1;
+    blitz::Array<double,1> values;
+    W.to_coo(indices0, indices1, values);
+    long const nnz = values.extent(0);
+    std::vector<long> perm(nnz);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::stable_sort(perm.begin(), perm.end(),
+        [&](long a, long b) { return indices0(a) < indices0(b); });
+
+    // Rows to store: those of M, plus (empty) rows in the active space
+    // of wM, which apply_M() must still set.
+    std::vector<int> urows(ret.windex[0]);
+    for (long n=0; n<nnz; ++n) urows.push_back(indices0(n));
+    std::sort(urows.begin(), urows.end());
+    urows.erase(std::unique(urows.begin(), urows.end()), urows.end());
+    long const nrows = urows.size();
+
+    std::vector<long> rptr(nrows+1, 0);    // Row r is perm[rptr[r]:rptr[r+1]]
+    for (long n=0; n<nnz; ++n) {
+        long const r = std::lower_bound(urows.begin(), urows.end(), indices0(n)) - urows.begin();
+        ++rptr[r+1];
+    }
+    std::partial_sum(rptr.begin(), rptr.end(), rptr.begin());
+
+    // ----------- Sort by length (longest first) within each window
+    std::vector<long> order(nrows);
+    std::iota(order.begin(), order.end(), 0);
+    for (long w0=0; w0<nrows; w0 += sigma) {
+        long const w1 = std::min(nrows, w0 + (long)sigma);
+        std::stable_sort(&order[0] + w0, &order[0] + w1, [&](long a, long b)
+            { return rptr[a+1]-rptr[a] > rptr[b+1]-rptr[b]; });
+    }
+
+    // ----------- Slices
+    long const nslices = (nrows + C - 1) / C;
+    ret.rows.assign(nslices * C, -1);
+    ret.lane_len.assign(nslices * C, 0);
+    ret.slice_ptr.push_back(0);
+    for (long s=0; s<nslices; ++s) {
+        long width = 0;
+        for (int r=0; r<C && s*C+r < nrows; ++r) {
+            long const row = order[s*C + r];
+            ret.rows[s*C + r] = urows[row];
+            ret.lane_len[s*C + r] = rptr[row+1] - rptr[row];
+            width = std::max(width, rptr[row+1] - rptr[row]);
+        }
+
+        long const p0 = ret.cols.size();
+        ret.cols.resize(p0 + width*C);
+        ret.vals.resize(p0 + width*C, 0.);
+        for (int r=0; r<C; ++r) {
+            long const len = ret.lane_len[s*C + r];
+            long const b = (len == 0 ? 0 : rptr[order[s*C + r]]);
+            for (long e=0; e<width; ++e) {
+                long const p = p0 + e*C + r;
+                if (e < len) {
+                    ret.cols[p] = indices1(perm[b + e]);
+                    ret.vals[p] = values(perm[b + e]);
+                } else {
+                    // Padding: re-read a column this lane reads anyway
+                    ret.cols[p] = (len == 0 ? ret.cols[p0] : ret.cols[p-C]);
+                }
+            }
+        }
+        ret.slice_ptr.push_back(ret.cols.size());
+    }
+
+    return ret;
+}
+
+Weighted_Tuple to_tuple(Weighted_SELL const &X)
+{
+    Weighted_Tuple ret(X.conservative);
+    ret.scaled = X.scaled;
+    ret.set_shape(X.shape());
+
+    blitz::Array<int,1> indices0, indices1;
+    blitz::Array<double,1> values;
+    X.to_coo(indices0, indices1, values);
+    for (int n=0; n<values.extent(0); ++n) {
+        ret.M.add({(long)indices0(n), (long)indices1(n)}, values(n));
+    }
+
+    for (size_t n=0; n<X.windex[0].size(); ++n)
+        ret.wM.add({(long)X.windex[0][n]}, X.wvalue[0][n]);
+    for (size_t n=0; n<X.windex[1].size(); ++n)
+        ret.Mw.add({(long)X.windex[1][n]}, X.wvalue[1][n]);
+
+    return ret;
+}
+
+}}    // namespace
@@ -0,0 +1,107 @@
+#ifndef IBMISC_LINEAR_SELL_HPP
+#define IBMISC_LINEAR_SELL_HPP
+
+#include <array>
+#include <vector>
+#include <ibmisc/linear/linear.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+struct Weighted_Tuple;
+
+// ==================================================================
+/** A regrid matrix stored in sliced ELLPACK (SELL-C-sigma) layout, for
+fast apply_M() on wide-vector CPUs.  Rows are grouped into slices of C
+rows, one per SIMD lane; each slice is padded to its longest row and
+stored column-major, so one step of the inner kernel reads C values
+(and C column indices) from contiguous memory.  To keep padding low,
+rows are first sorted by length within windows of sigma rows.
+
+Build with to_sell(); convert back with to_tuple(). */
+class Weighted_SELL : public Weighted
+{
+public:
+    /** Rows per slice.  8 doubles fill one AVX-512 register (or two
+    AVX2 registers). */
+    static int const C = 8;
+
+    std::array<long,2> _shape;
+
+    /** Rows were sorted by length within windows of this many rows */
+    int sigma;
+
+    /** Lane r of slice s holds sparse row rows[s*C + r] (-1 for padding) */
+    std::vector<int> rows;
+    /** Number of (non-padding) entries in each lane; same layout as rows */
+    std::vector<int> lane_len;
+    /** Slice s occupies [slice_ptr[s], slice_ptr[s+1]) of cols and vals */
+    std::vector<long> slice_ptr;
+    /** Entry e of lane r of slice s is at slice_ptr[s] + e*C + r.
+    Padding has value 0, and (where possible) the lane's last column. */
+    std::vector<int> cols;
+    std::vector<double> vals;
+
+    /** Non-zero weights: {wM, Mw} */
+    std::array<std::vector<int>, 2> windex;
+    std::array<std::vector<double>, 2> wvalue;
+
+    Weighted_SELL() : Weighted(LinearType::SELL), _shape({0,0}), sigma(1) {}
+
+    long nslices() const
+        { return slice_ptr.empty() ? 0 : slice_ptr.size() - 1; }
+
+    /** Fraction of stored entries that are padding */
+    double padding() const
+        { return cols.empty() ? 0 : 1. - (double)nnz() / cols.size(); }
+
+    // ================= Implements Weighted
+    /** Sparse shape of the matrix */
+    std::array<long,2> shape() const
+        { return _shape; }
+
+    /** Computes out = As * weights[dim] */
+    void apply_weight(
+        int dim,    // 0=B, 1=A
+        blitz::Array<double,2> const &As,    // As(nvec, ndim)
+        blitz::Array<double,1> &out,
+        bool zero_out=true) const;
+
+    /** Computes out = M * As
+    NOTE: As and out cannot be the same! */
+    void apply_M(
+        blitz::Array<double,2> const &As,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE,
+        bool force_conservation=true) const;
+
+    /** Computes out = M^T * Bs */
+    void apply_MT(
+        blitz::Array<double,2> const &Bs,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE) const;
+
+    void ncio(NcIO &ncio, std::string const &vname);
+
+    long nnz() const;
+
+protected:
+    void _to_coo(
+        blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
+        blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
+        blitz::Array<double,1> &values) const;      // Must bepre-allocated(nnz)
+
+    void _get_weights(
+        int idim,    // 0=wM, 1=Mw
+        blitz::Array<double,1> &w) const;
+};
+
+/** Converts any Weighted matrix to SELL-C-sigma layout.
+@param sigma Sorting window, in rows.  Larger windows mean less
+    padding, but scatter output rows further apart in memory. */
+extern Weighted_SELL to_sell(Weighted const &W, int sigma = 256);
+
+extern Weighted_Tuple to_tuple(Weighted_SELL const &X);
+
+}}    // namespace
+#endif    // guard
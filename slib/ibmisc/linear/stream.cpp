@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <ibmisc/linear/stream.hpp>
+#include <ibmisc/profile.hpp>
+
+using namespace netCDF;
+
+namespace ibmisc {
+namespace linear {
+
+void RegridStream::add(std::string const &ivname, std::string const &ovname,
+    Weighted const *W,
+    std::vector<std::string> const &odims,
+    std::vector<long> const &odim_lens)
+{
+    if (odims.size() != odim_lens.size()) (*ibmisc_error)(-1,
+        "RegridStream::add(%s): %ld output dimension names but %ld lengths",
+        ovname.c_str(), (long)odims.size(), (long)odim_lens.size());
+
+    RegridVar var{ivname, ovname, W, odims, odim_lens};
+    if (odims.empty()) {
+        var.odims = {ovname + ".n"};
+        var.odim_lens = {W->shape()[0]};
+    }
+    vars.push_back(std::move(var));
+}
+
+namespace {
+
+/** FIFO of at most cap items, passed between two threads */
+template<class T>
+class BoundedQueue {
+    std::mutex mtx;
+    std::condition_variable cv_push;    // Signalled when there's room (or closing)
+    std::condition_variable cv_pop;     // Signalled when an item is queued (or closing)
+    std::deque<T> queue;
+    size_t const cap;
+    bool closed;
+
+public:
+    explicit BoundedQueue(size_t _cap) : cap(std::max<size_t>(_cap, 1)), closed(false) {}
+
+    /** Blocks while full.
+    @return False if the queue was closed (item dropped) */
+    bool push(T &&item)
+    {
+        {std::unique_lock<std::mutex> lock(mtx);
+            cv_push.wait(lock, [this]{ return closed || queue.size() < cap; });
+            if (closed) return false;
+            queue.push_back(std::move(item));
+        }
+        cv_pop.notify_one();
+        return true;
+    }
+
+    /** Blocks while empty.
+    @return False once the queue is closed and drained */
+    bool pop(T &item)
+    {
+        {std::unique_lock<std::mutex> lock(mtx);
+            cv_pop.wait(lock, [this]{ return closed || !queue.empty(); });
+            if (queue.empty()) return false;
+            item = std::move(queue.front());
+            queue.pop_front();
+        }
+        cv_push.notify_one();
+        return true;
+    }
+
+    /** No more pushes.  If drop, pending items are thrown away too */
+    void close(bool drop = false)
+    {
+        {std::unique_lock<std::mutex> lock(mtx);
+            closed = true;
+            if (drop) queue.clear();
+        }
+        cv_push.notify_all();
+        cv_pop.notify_all();
+    }
+};
+
+/** Variables sharing a matrix, regridded in one apply_M() */
+struct Group {
+    Weighted const *W;
+    std::vector<int> ivars;    // Index into RegridStream::vars
+};
+
+/** Records [t0, t0+nrec) of every variable.  Variable k of group g
+is in data[g], rows [k*nrec, (k+1)*nrec). */
+struct Batch {
+    long t0;
+    long nrec;
+    std::vector<blitz::Array<double,2>> data;
+    std::vector<double> coord;    // Of the record dimension, if any
+};
+
+/** Reads or writes records [t0, t0+nrec) of ncvar, contiguous in
+buf, as doubles.  Holds netcdf_mutex. */
+void rw_records(NcVar &ncvar, char rw, size_t t0, size_t nrec, double *buf)
+{
+    int const rank = ncvar.getDimCount();
+    std::vector<size_t> start(rank, 0), count(rank);
+    std::vector<ptrdiff_t> stride(rank, 1), imap(rank);
+    start[0] = t0;
+    count[0] = nrec;
+
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+    for (int i=1; i<rank; ++i) count[i] = ncvar.getDim(i).getSize();
+    ptrdiff_t m = 1;
+    for (int i=rank-1; i>=0; --i) {
+        imap[i] = m;
+        m *= count[i];
+    }
+    get_or_put_var(ncvar, rw, start, count, stride, imap, buf);
+}
+
+/** Attributes worth copying to the output: not the reserved ones
+(eg _FillValue, whose type may not match) */
+std::vector<std::pair<std::string, NcAttValue>> copy_atts(NcVar const &ncvar)
+{
+    std::vector<std::pair<std::string, NcAttValue>> ret;
+    for (auto &att : get_all_atts(ncvar)) {
+        if (att.first.compare(0, 1, "_") != 0) ret.push_back(std::move(att));
+    }
+    return ret;
+}
+
+/** First error raised in any stage; raising one stops them all */
+class Errors {
+    std::mutex mtx;
+    std::string msg;
+public:
+    std::vector<std::function<void()>> on_error;
+
+    bool ok()
+        { std::lock_guard<std::mutex> lock(mtx); return msg.empty(); }
+
+    void set(char const *stage, char const *what)
+    {
+        {std::lock_guard<std::mutex> lock(mtx);
+            if (!msg.empty()) return;
+            msg = std::string(stage) + " stage: " + what;
+        }
+        for (auto &fn : on_error) fn();
+    }
+
+    /** Runs a stage, catching what it throws */
+    void run(char const *stage, std::function<void()> const &fn)
+    {
+        try {
+            fn();
+        } catch(std::exception const &e) {
+            set(stage, e.what());
+        } catch(...) {
+            set(stage, "unknown exception");
+        }
+    }
+
+    std::string const &what() const { return msg; }
+};
+
+}    // anonymous namespace
+
+long RegridStream::run(std::string const &ofname)
+{
+    IBMISC_SCOPED_TIMER("linear::RegridStream::run");
+    if (ifnames.empty()) (*ibmisc_error)(-1,
+        "RegridStream::run(%s): no input files", ofname.c_str());
+    if (vars.empty()) (*ibmisc_error)(-1,
+        "RegridStream::run(%s): no variables", ofname.c_str());
+    if (batch < 1) (*ibmisc_error)(-1,
+        "RegridStream::run(): batch must be positive, got %d", batch);
+
+    // Group the variables by matrix
+    std::vector<Group> groups;
+    for (int v=0; v<(int)vars.size(); ++v) {
+        auto &var(vars[v]);
+        long nB = 1;
+        for (long len : var.odim_lens) nB *= len;
+        if (nB != var.W->shape()[0]) (*ibmisc_error)(-1,
+            "RegridStream: output dimensions of %s have %ld cells, matrix has %ld rows",
+            var.ovname.c_str(), nB, var.W->shape()[0]);
+
+        auto gg(std::find_if(groups.begin(), groups.end(),
+            [&](Group const &g){ return g.W == var.W; }));
+        if (gg == groups.end()) groups.push_back(Group{var.W, {v}});
+        else gg->ivars.push_back(v);
+    }
+
+    // Metadata from the first input, for the output
+    bool has_coord = false;
+    std::vector<std::vector<std::pair<std::string, NcAttValue>>> atts(vars.size());
+    std::vector<std::pair<std::string, NcAttValue>> coord_atts;
+    {
+        std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+        NcIO ncio(ifnames[0], 'r');
+        for (size_t v=0; v<vars.size(); ++v) {
+            NcVar ncvar(ncio.getVar(vars[v].ivname));
+            if (!ncvar.isNull()) atts[v] = copy_atts(ncvar);
+        }
+        NcVar coord_v(ncio.getVar(rec_dim));
+        has_coord = (!coord_v.isNull() && coord_v.getDimCount() == 1
+            && coord_v.getDim(0).getName() == rec_dim);
+        if (has_coord) coord_atts = copy_atts(coord_v);
+    }
+
+    BoundedQueue<Batch> q_read(nqueue), q_done(nqueue);
+    Errors errors;
+    errors.on_error.push_back([&]{ q_read.close(true); q_done.close(true); });
+
+    // ---------- Read
+    std::thread reader([&]{ errors.run("read", [&]{
+        long t0 = 0;
+        for (auto const &ifname : ifnames) {
+            std::unique_ptr<NcIO> ncio;
+            std::vector<NcVar> ncvars(vars.size());
+            NcVar coord_v;
+            long nrec = -1;
+            {std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+                ncio.reset(new NcIO(ifname, 'r'));
+                for (size_t v=0; v<vars.size(); ++v) {
+                    auto &var(vars[v]);
+                    ncvars[v] = ncio->getVar(var.ivname);
+                    if (ncvars[v].isNull()) (*ibmisc_error)(-1,
+                        "Variable %s not found in %s", var.ivname.c_str(), ifname.c_str());
+                    if (ncvars[v].getDimCount() < 1
+                        || ncvars[v].getDim(0).getName() != rec_dim) (*ibmisc_error)(-1,
+                        "Variable %s in %s must have %s as its first dimension",
+                        var.ivname.c_str(), ifname.c_str(), rec_dim.c_str());
+
+                    long nA = 1;
+                    for (int i=1; i<ncvars[v].getDimCount(); ++i) nA *= ncvars[v].getDim(i).getSize();
+                    if (nA != var.W->shape()[1]) (*ibmisc_error)(-1,
+                        "Variable %s in %s has %ld values per record, matrix has %ld columns",
+                        var.ivname.c_str(), ifname.c_str(), nA, var.W->shape()[1]);
+                    long const n = ncvars[v].getDim(0).getSize();
+                    if (v > 0 && n != nrec) (*ibmisc_error)(-1,
+                        "Variables %s and %s in %s have different numbers of records",
+                        vars[0].ivname.c_str(), var.ivname.c_str(), ifname.c_str());
+                    nrec = n;
+                }
+                if (has_coord) coord_v = ncio->getVar(rec_dim);
+            }
+
+            for (long r0=0; r0<nrec; r0 += batch) {
+                Batch b;
+                b.t0 = t0 + r0;
+                b.nrec = std::min<long>(batch, nrec - r0);
+                for (auto const &g : groups) {
+                    b.data.push_back(blitz::Array<double,2>(
+                        g.ivars.size() * b.nrec, g.W->shape()[1]));
+                    for (size_t k=0; k<g.ivars.size(); ++k) {
+                        rw_records(ncvars[g.ivars[k]], 'r', r0, b.nrec,
+                            b.data.back().data() + k * b.nrec * g.W->shape()[1]);
+                    }
+                }
+                if (!coord_v.isNull()) {
+                    b.coord.resize(b.nrec);
+                    rw_records(coord_v, 'r', r0, b.nrec, &b.coord[0]);
+                }
+                if (!q_read.push(std::move(b))) return;    // Stopped
+            }
+            t0 += nrec;
+
+            std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+            ncio.reset();
+        }
+    }); q_read.close(); });
+
+    // ---------- Regrid
+    std::thread compute([&]{ errors.run("regrid", [&]{
+        Batch b;
+        while (q_read.pop(b)) {
+            for (size_t g=0; g<groups.size(); ++g) {
+                blitz::Array<double,2> out(b.data[g].extent(0), groups[g].W->shape()[0]);
+                out = fill;
+                groups[g].W->apply_M(b.data[g], out, AccumType::REPLACE, force_conservation);
+                b.data[g].reference(out);
+            }
+            if (!q_done.push(std::move(b))) return;
+        }
+    }); q_done.close(); });
+
+    // ---------- Write (here)
+    long nwritten = 0;
+    errors.run("write", [&]{
+        std::unique_ptr<NcIO> ncio;
+        std::vector<NcVar> ncvars(vars.size());
+        NcVar coord_v;
+        {std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+            ncio.reset(new NcIO(ofname, 'w', oformat, configure_var));
+            for (size_t v=0; v<vars.size(); ++v) {
+                auto &var(vars[v]);
+                std::vector<std::string> names {rec_dim};
+                std::vector<long> lens {-1};
+                names.insert(names.end(), var.odims.begin(), var.odims.end());
+                lens.insert(lens.end(), var.odim_lens.begin(), var.odim_lens.end());
+                ncvars[v] = get_or_add_var(*ncio, var.ovname, "double",
+                    get_or_add_dims(*ncio, names, lens));
+                get_or_put_all_atts(ncvars[v], 'w', atts[v]);
+            }
+            if (has_coord) {
+                coord_v = get_or_add_var(*ncio, rec_dim, "double",
+                    get_or_add_dims(*ncio, {rec_dim}, {-1}));
+                get_or_put_all_atts(coord_v, 'w', coord_atts);
+            }
+        }
+
+        Batch b;
+        while (q_done.pop(b)) {
+            for (size_t g=0; g<groups.size(); ++g) {
+                auto const &ivars(groups[g].ivars);
+                long const nB = groups[g].W->shape()[0];
+                for (size_t k=0; k<ivars.size(); ++k) {
+                    rw_records(ncvars[ivars[k]], 'w', b.t0, b.nrec,
+                        b.data[g].data() + k * b.nrec * nB);
+                }
+            }
+            if (!coord_v.isNull()) rw_records(coord_v, 'w', b.t0, b.nrec, &b.coord[0]);
+            nwritten = b.t0 + b.nrec;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+        ncio.reset();
+    });
+
+    reader.join();
+    compute.join();
+    if (!errors.ok()) (*ibmisc_error)(-1,
+        "RegridStream::run(%s): error in %s", ofname.c_str(), errors.what().c_str());
+    return nwritten;
+}
+
+}}    // namespace
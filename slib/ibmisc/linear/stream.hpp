@@ -0,0 +1,90 @@
+#ifndef IBMISC_LINEAR_STREAM_HPP
+#define IBMISC_LINEAR_STREAM_HPP
+
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+#include <ibmisc/linear/linear.hpp>
+
+namespace ibmisc {
+namespace linear {
+
+/** One variable regridded by a RegridStream */
+struct RegridVar {
+    /** Input variable, dimensions (rec_dim, ...); the non-record
+    dimensions hold the nA values of each record (sparse indexing). */
+    std::string ivname;
+
+    /** Output variable, dimensions (rec_dim, odims...) */
+    std::string ovname;
+
+    /** Matrix applied to each record; not owned */
+    Weighted const *W;
+
+    /** Output dimensions after rec_dim; their product must be nB.
+    Default: one dimension <ovname>.n */
+    std::vector<std::string> odims;
+    std::vector<long> odim_lens;
+};
+
+/** Regrids time series: reads records (eg timesteps) of variables
+from a sequence of files, applies Weighted matrices to batches of
+records, and appends the results to one output file along rec_dim.
+Reading, apply_M() and writing (including compression) run on three
+threads, connected by bounded queues, so each stage overlaps the
+others.  netCDF-C is not thread-safe, so reads and writes take turns
+on netcdf_mutex; apply_M() overlaps both.  Memory held is about
+(2*nqueue + 3) batches.  Variables sharing a matrix are regridded
+together, in one apply_M() per batch.
+
+Usage:
+    RegridStream rs;
+    rs.ifnames = {"T_1990.nc", "T_1991.nc"};
+    rs.add("T", "T_ice", W.get(), {"jm", "im"}, {jm, im});
+    rs.run("T_ice.nc");
+*/
+class RegridStream {
+public:
+    /** Input files; records are concatenated in this order */
+    std::vector<std::string> ifnames;
+    std::vector<RegridVar> vars;
+
+    /** Unlimited dimension of the input and output variables.  If
+    the first input has a coordinate variable of that name, it is
+    copied too. */
+    std::string rec_dim;
+
+    /** Records per apply_M() */
+    int batch;
+
+    /** Batches buffered between each pair of stages */
+    int nqueue;
+
+    /** Written to output cells outside the matrix's range */
+    double fill;
+
+    bool force_conservation;
+
+    /** Output file format and variable configuration (see NcIO) */
+    std::string oformat;
+    std::function<void(netCDF::NcVar)> configure_var;
+
+    RegridStream() : rec_dim("time"), batch(8), nqueue(2),
+        fill(std::numeric_limits<double>::quiet_NaN()),
+        force_conservation(true), oformat("nc4"),
+        configure_var(std::bind(NcIO::default_configure_var, std::placeholders::_1)) {}
+
+    void add(std::string const &ivname, std::string const &ovname,
+        Weighted const *W,
+        std::vector<std::string> const &odims = {},
+        std::vector<long> const &odim_lens = {});
+
+    /** Runs the pipeline, writing ofname.  Errors in any stage stop
+    all of them, and are raised here.
+    @return Number of records written */
+    long run(std::string const &ofname);
+};
+
+}}    // namespace
+#endif    // guard
@@ -1,41 +1,228 @@
+#include <algorithm>
 #include <ibmisc/linear/tuple.hpp>
 #include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/inplace.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/progress.hpp>
 
 using namespace spsparse;
 
 namespace ibmisc {
 namespace linear {
 
+MemoryFootprint Weighted_Tuple::memory_footprint(std::string const &name) const
+{
+    MemoryFootprint ret(name);
+    ret.add(wM.memory_footprint("wM"));
+    ret.add(M.memory_footprint("M"));
+    ret.add(Mw.memory_footprint("Mw"));
+    ret.add(MemoryFootprint("row_index",
+        (_index.rows.size() + _index.active.size()) * sizeof(long)
+        + _index.row_ptr.size() * sizeof(size_t)));
+    return ret;
+}
+
 void Weighted_Tuple::clear()
 {
     wM.clear();
     M.clear();
     Mw.clear();
+    _index = RowIndex();
 }
 
 void Weighted_Tuple::set_shape(std::array<long,2> _shape)
 {
+    changed();
     wM.set_shape({_shape[0]});
     M.set_shape(_shape);
     Mw.set_shape({_shape[1]});
 }
 
+void Weighted_Tuple::consolidate(int nthreads)
+{
+    // Tuple order is lexicographic on the index: row-major for M
+    spsparse::consolidate(wM, false, nthreads);
+    spsparse::consolidate(M, false, nthreads);
+    spsparse::consolidate(Mw, false, nthreads);
+    index_rows();
+}
+
+void Weighted_Tuple::index_rows()
+{
+    _index = RowIndex();
+
+    // Rows of M, if it is sorted that way
+    bool sorted = true;
+    for (size_t n=0; n<M.size(); ++n) {
+        long const i = M.tuples[n].index(0);
+        if (_index.rows.empty() || i != _index.rows.back()) {
+            if (!_index.rows.empty() && i < _index.rows.back()) {
+                sorted = false;
+                break;
+            }
+            _index.rows.push_back(i);
+            _index.row_ptr.push_back(n);
+        }
+    }
+    if (sorted) {
+        _index.row_ptr.push_back(M.size());
+        _index.nM = M.size();
+    } else {
+        _index.rows.clear();
+        _index.row_ptr.clear();
+    }
+
+    // Active space
+    for (auto ii=wM.begin(); ii != wM.end(); ++ii) _index.active.push_back(ii->index(0));
+    std::sort(_index.active.begin(), _index.active.end());
+    _index.active.erase(std::unique(_index.active.begin(), _index.active.end()), _index.active.end());
+    _index.nwM = wM.size();
+}
+
 void Weighted_Tuple::apply_weight(
     int dim,    // 0=B, 1=A
     blitz::Array<double,2> const &As,    // As(nvec, ndim)
     blitz::Array<double,1> &out,
     bool zero_out) const
 {
-    (*ibmisc_error)(-1, "linear::Weighted_Tuple::apply_weight() not yet implemented");
+    auto const nvec(As.extent(0));
+    auto const &weights(dim == 0 ? wM : Mw);
+
+    if (zero_out) out = 0;
+
+    // Each thread computes out(k) for its own range of vectors
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        for (auto ii=weights.begin(); ii != weights.end(); ++ii) {
+            auto const j(ii->index(0));
+            auto const w(ii->value());
+            for (long k=k0; k<k1; ++k) out(k) += w * As(k,j);
+        }
+    });
+}
+
+namespace {
+
+/** Prepares the active space of Bs for vectors [k0,k1), based on accum_type */
+void prepare_active(
+    blitz::Array<double,2> &Bs, long k0, long k1,
+    long const i, AccumType accum_type)
+{
+    switch(accum_type.index()) {
+        case AccumType::REPLACE :
+            for (long k=k0; k<k1; ++k) Bs(k,i) = 0;
+        break;
+        case AccumType::REPLACE_OR_ACCUMULATE :
+            for (long k=k0; k<k1; ++k) {
+                auto &Bs_ki(Bs(k,i));
+                if (std::isnan(Bs_ki)) Bs_ki = 0;
+            }
+        break;
+    }
+}
+
 }
 
 void Weighted_Tuple::apply_M(
-    blitz::Array<double,2> const &As,
-    blitz::Array<double,2> &out,
+    blitz::Array<double,2> const &As,    // As(nvec, nA)
+    blitz::Array<double,2> &Bs,          // Bs(nvec, nB)
     AccumType accum_type,
     bool force_conservation) const
 {
-    (*ibmisc_error)(-1, "linear::Weighted_Tuple::apply_M() not yet implemented");
+    auto const nvec(As.extent(0));
+
+    // The active space, without duplicates (or a copy of it, if stale)
+    std::vector<long> active_tmp;
+    std::vector<long> const *active = &_index.active;
+    if (_index.nwM != wM.size()) {
+        for (auto ii=wM.begin(); ii != wM.end(); ++ii) active_tmp.push_back(ii->index(0));
+        std::sort(active_tmp.begin(), active_tmp.end());
+        active_tmp.erase(std::unique(active_tmp.begin(), active_tmp.end()), active_tmp.end());
+        active = &active_tmp;
+    }
+
+    if (rows_indexed()) {
+        // Threads own disjoint sets of output rows i
+        parallel_for(0, active->size(), nthreads, [&](long j0, long j1) {
+            for (long j=j0; j<j1; ++j)
+                prepare_active(Bs, 0, nvec, (*active)[j], accum_type);
+        });
+
+        // Are the vectors interleaved in memory?  (Vector-major layout)
+        bool const vcontig = (nvec > 1 && As.stride(0) == 1 && Bs.stride(0) == 1);
+
+        auto const &rows(_index.rows);
+        auto const &row_ptr(_index.row_ptr);
+        parallel_for(0, rows.size(), nthreads, [&](long r0, long r1) {
+            for (long r=r0; r<r1; ++r) {
+                long const i = rows[r];
+                if (vcontig) {
+                    // Contiguous AXPY per non-zero
+                    double * const Bs_i = &Bs(0,i);
+                    for (size_t n=row_ptr[r]; n<row_ptr[r+1]; ++n) {
+                        auto const &t(M.tuples[n]);
+                        double const * const As_j = &As(0,t.index(1));
+                        for (long k=0; k<nvec; ++k) Bs_i[k] += t.value() * As_j[k];
+                    }
+                } else {
+                    // Sum each row in a register
+                    for (long k=0; k<nvec; ++k) {
+                        double sum = 0;
+                        for (size_t n=row_ptr[r]; n<row_ptr[r+1]; ++n) {
+                            auto const &t(M.tuples[n]);
+                            sum += t.value() * As(k,t.index(1));
+                        }
+                        Bs(k,i) += sum;
+                    }
+                }
+            }
+        });
+    } else {
+        // Rows in no particular order: threads own disjoint sets of vectors k
+        parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+            for (long const i : *active) prepare_active(Bs, k0, k1, i, accum_type);
+
+            for (auto ii=M.begin(); ii != M.end(); ++ii) {
+                auto const i(ii->index(0));
+                auto const j(ii->index(1));
+                for (long k=k0; k<k1; ++k) Bs(k,i) += ii->value() * As(k,j);
+            }
+        });
+    }
+
+    correct_conservation(As, Bs, *active, force_conservation);
+}
+
+void Weighted_Tuple::apply_MT(
+    blitz::Array<double,2> const &Bs,    // Bs(nvec, nB)
+    blitz::Array<double,2> &As,          // As(nvec, nA)
+    AccumType accum_type) const
+{
+    auto const nvec(Bs.extent(0));
+
+    // Threads own disjoint sets of vectors k
+    parallel_for(0, nvec, nthreads, [&](long k0, long k1) {
+        // Prepare the active space of As
+        for (auto ii=Mw.begin(); ii != Mw.end(); ++ii) {
+            auto const j(ii->index(0));
+            switch(accum_type.index()) {
+                case AccumType::REPLACE :
+                    for (long k=k0; k<k1; ++k) As(k,j) = 0;
+                break;
+                case AccumType::REPLACE_OR_ACCUMULATE :
+                    for (long k=k0; k<k1; ++k) {
+                        auto &As_kj(As(k,j));
+                        if (std::isnan(As_kj)) As_kj = 0;
+                    }
+                break;
+            }
+        }
+
+        for (auto ii=M.begin(); ii != M.end(); ++ii) {
+            auto const i(ii->index(0));
+            auto const j(ii->index(1));
+            for (long k=k0; k<k1; ++k) As(k,j) += ii->value() * Bs(k,i);
+        }
+    });
 }
 
 void Weighted_Tuple::apply_M_inplace(
@@ -43,7 +230,21 @@ void Weighted_Tuple::apply_M_inplace(
     AccumType accum_type,
     bool force_conservation) const
 {
-    (*ibmisc_error)(-1, "linear::Weighted_Tuple::apply_M_inplace() not yet implemented");
+    auto weights_fn = [](TupleListLT<1> const &weights) {
+        return [&weights](std::function<void(long,double)> const &fn) {
+            for (auto ii=weights.begin(); ii != weights.end(); ++ii)
+                fn(ii->index(0), ii->value());
+        };
+    };
+
+    apply_M_inplace_stream(shape(), conservative, As, accum_type, force_conservation,
+        nthreads,
+        weights_fn(wM),
+        [&](std::function<void(long,long,double)> const &fn) {
+            for (auto ii=M.begin(); ii != M.end(); ++ii)
+                fn(ii->index(0), ii->index(1), ii->value());
+        },
+        weights_fn(Mw));
 }
 
 void Weighted_Tuple::_to_coo(
@@ -51,14 +252,23 @@ void Weighted_Tuple::_to_coo(
     blitz::Array<int,1> &indices1,        // Must be pre-allocated(nnz)
     blitz::Array<double,1> &values) const      // Must bepre-allocated(nnz)
 {
-    (*ibmisc_error)(-1, "linear::Weighted_Tuple::to_coo() not yet implemented");
+    long j = 0;
+    for (auto ii=M.begin(); ii != M.end(); ++ii) {
+        indices0(j) = ii->index(0);
+        indices1(j) = ii->index(1);
+        values(j) = ii->value();
+        ++j;
+    }
 }
 
 void Weighted_Tuple::_get_weights(
     int idim,    // 0=wM, 1=Mw
     blitz::Array<double,1> &w) const
 {
-    (*ibmisc_error)(-1, "linear::Weighted_Tuple::get_weights() not yet implemented");
+    auto const &weights(idim == 0 ? wM : Mw);
+    for (auto ii=weights.begin(); ii != weights.end(); ++ii) {
+        w(ii->index(0)) += ii->value();
+    }
 }
 
 /** I/O */
@@ -68,18 +278,196 @@ void Weighted_Tuple::ncio(NcIO &ncio, std::string const &vname)
     M.ncio(ncio, vname+".M");
     Mw.ncio(ncio, vname+".Mw");
 
+    // Runs after the reads above
+    if (ncio.rw == 'r') ncio += [this]() { index_rows(); };
 }
 
-std::unique_ptr<linear::Weighted_Eigen> to_eigen(linear::Weighted_Tuple const &X)
+namespace {
+
+/** Presents the tuples of a Weighted_Tuple::M in dense indexing, for
+build_compressed().  Avoids making a dense copy of M first. */
+struct DenseTupleIter {
+    Weighted_Tuple::TupleListLT<2>::const_iterator ii;
+    std::array<Weighted_Eigen::SparseSetT *,2> const &dims;
+
+    DenseTupleIter(
+        Weighted_Tuple::TupleListLT<2>::const_iterator const &_ii,
+        std::array<Weighted_Eigen::SparseSetT *,2> const &_dims)
+    : ii(_ii), dims(_dims) {}
+
+    DenseTupleIter const *operator->() const { return this; }
+    DenseTupleIter &operator++() { ++ii; return *this; }
+    bool operator!=(DenseTupleIter const &other) const
+        { return ii != other.ii; }
+
+    int row() const { return dims[0]->to_dense(ii->index(0)); }
+    int col() const { return dims[1]->to_dense(ii->index(1)); }
+    double value() const { return ii->value(); }
+};
+
+/** Parallel version of spsparse::build_compressed() for X.M (in
+dense indexing): threads convert, count and place disjoint ranges of
+tuples, then sort and consolidate disjoint ranges of columns.
+Duplicates are summed in input order, as in build_compressed(). */
+void build_compressed_parallel(
+    Weighted_Eigen::EigenSparseMatrixT &M,
+    Weighted_Tuple::TupleListLT<2> const &XM,
+    std::array<Weighted_Eigen::SparseSetT *,2> const &dims,
+    int nthreads,
+    Progress &progress)
 {
-    (*ibmisc_error)(-1, "to_eigen() converting linear::Weighted_Tuple -> linear::Weighted_Eigen not yet implemented!");
-    // This should follow:
-    //     Weighted_Compressed compress(Weighted_Eigen &eigen)
-    // found in compressed.cpp
+    long const nrows = dims[0]->dense_extent();
+    long const ncols = dims[1]->dense_extent();
+    long const nnz = XM.tuples.size();
+    long const nchunks = std::max(1L, std::min(nnz, (long)nthreads));
+
+    M.resize(nrows, ncols);    // Compressed, all zero
+    M.resizeNonZeros(nnz);
+    int *outer = M.outerIndexPtr();
+    int *inner = M.innerIndexPtr();
+    double *vals = M.valuePtr();
+
+    // Convert to dense, and count entries in each column, by chunk
+    std::vector<int> rows(nnz), cols(nnz);
+    std::vector<std::vector<int>> pos(nchunks);
+    parallel_for(0, nchunks, nthreads, [&](long c0, long c1) {
+        for (long c=c0; c<c1; ++c) {
+            pos[c].assign(ncols, 0);
+            long const n0 = nnz * c / nchunks;
+            long const n1 = nnz * (c+1) / nchunks;
+            for (long n=n0; n<n1; ++n) {
+                auto const &t(XM.tuples[n]);
+                rows[n] = dims[0]->to_dense(t.index(0));
+                cols[n] = dims[1]->to_dense(t.index(1));
+                ++pos[c][cols[n]];
+            }
+        }
+    });
+
+    // Each chunk's entries go after those of earlier chunks
+    long p = 0;
+    for (long k=0; k<ncols; ++k) {
+        outer[k] = p;
+        for (long c=0; c<nchunks; ++c) {
+            long const count = pos[c][k];
+            pos[c][k] = p;
+            p += count;
+        }
+    }
+    outer[ncols] = p;
+
+    parallel_for(0, nchunks, nthreads, [&](long c0, long c1) {
+        for (long c=c0; c<c1; ++c) {
+            long const n0 = nnz * c / nchunks;
+            long const n1 = nnz * (c+1) / nchunks;
+            for (long n=n0; n<n1; ++n) {
+                int &q(pos[c][cols[n]]);
+                inner[q] = rows[n];
+                vals[q] = XM.tuples[n].value();
+                ++q;
+            }
+        }
+    });
+    progress.add(nnz / 2);
+
+    // Sort each column (only if needed) and sum duplicates, in place
+    std::vector<int> len(ncols);
+    parallel_for(0, ncols, nthreads, [&](long k0, long k1) {
+        std::vector<std::pair<int,double>> seg;
+        for (long k=k0; k<k1; ++k) {
+            int const b = outer[k];
+            int const e = outer[k+1];
+            if (!std::is_sorted(inner+b, inner+e)) {
+                seg.clear();
+                for (int q=b; q<e; ++q) seg.push_back(std::make_pair(inner[q], vals[q]));
+                std::stable_sort(seg.begin(), seg.end(),
+                    [](std::pair<int,double> const &x, std::pair<int,double> const &y)
+                    { return x.first < y.first; });
+                for (int q=b; q<e; ++q) {
+                    inner[q] = seg[q-b].first;
+                    vals[q] = seg[q-b].second;
+                }
+            }
+
+            int dst = b;
+            for (int q=b; q<e; ++q) {
+                if (dst > b && inner[dst-1] == inner[q]) {
+                    vals[dst-1] += vals[q];
+                } else {
+                    inner[dst] = inner[q];
+                    vals[dst] = vals[q];
+                    ++dst;
+                }
+            }
+            len[k] = dst - b;
+        }
+    });
+
+    // Close the gaps left by duplicates
+    int dst = 0;
+    for (long k=0; k<ncols; ++k) {
+        int const b = outer[k];
+        outer[k] = dst;
+        if (dst != b) {
+            std::copy(inner+b, inner+b+len[k], inner+dst);
+            std::copy(vals+b, vals+b+len[k], vals+dst);
+        }
+        dst += len[k];
+    }
+    outer[ncols] = dst;
+    M.resizeNonZeros(dst);
+    progress.add(nnz - nnz/2);
+}
+
+}
+
+/** Dense indices are assigned in order of first appearance: wM, M,
+Mw. */
+std::unique_ptr<linear::Weighted_Eigen> to_eigen(linear::Weighted_Tuple const &X, int nthreads)
+{
+    std::unique_ptr<Weighted_Eigen> ret(new Weighted_Eigen(X.conservative));
+    ret->scaled = X.scaled;
+    auto &dims(ret->dims);
+
+    // Set up the dense index spaces
+    for (int i=0; i<2; ++i)
+        if (X.M.shape(i) >= 0) dims[i]->set_sparse_extent(X.M.shape(i));
+    for (auto ii=X.wM.begin(); ii != X.wM.end(); ++ii)
+        dims[0]->add_dense(ii->index(0));
+    for (auto ii=X.M.begin(); ii != X.M.end(); ++ii) {
+        dims[0]->add_dense(ii->index(0));
+        dims[1]->add_dense(ii->index(1));
+    }
+    for (auto ii=X.Mw.begin(); ii != X.Mw.end(); ++ii)
+        dims[1]->add_dense(ii->index(0));
+
+    // Weights
+    std::array<blitz::Array<double,1> *,2> ws {&ret->wM, &ret->Mw};
+    std::array<Weighted_Tuple::TupleListLT<1> const *,2> Xws {&X.wM, &X.Mw};
+    for (int i=0; i<2; ++i) {
+        ws[i]->reference(blitz::Array<double,1>(dims[i]->dense_extent()));
+        *ws[i] = 0;
+        for (auto ii=Xws[i]->begin(); ii != Xws[i]->end(); ++ii)
+            (*ws[i])(dims[i]->to_dense(ii->index(0))) += ii->value();
+    }
+
+    // Matrix, straight into compressed form
+    Progress progress("linear::to_eigen", X.M.tuples.size());
+    ret->M.reset(new Weighted_Eigen::EigenSparseMatrixT());
+    if (nthreads <= 1) {
+        build_compressed(*ret->M,
+            DenseTupleIter(X.M.begin(), dims), DenseTupleIter(X.M.end(), dims),
+            dims[0]->dense_extent(), dims[1]->dense_extent());
+        progress.add(X.M.tuples.size());
+    } else {
+        build_compressed_parallel(*ret->M, X.M, dims, nthreads, progress);
+    }
+
+    return ret;
 }
 
 /** Code is same as compress(); see compressed.cpp */
-Weighted_Tuple to_tuple(Weighted_Eigen const &eigen)
+Weighted_Tuple to_tuple(Weighted_Eigen const &eigen, int nthreads)
 {
     Weighted_Tuple ret;
     ret.scaled = eigen.scaled;
@@ -91,10 +479,37 @@ Weighted_Tuple to_tuple(Weighted_Eigen const &eigen)
             accum::ref(ret.wM)),
         eigen.wM);
 
-    spsparse::spcopy(
-        spsparse::accum::to_sparse(eigen.dims,
-            accum::ref(ret.M)),
-        *eigen.M);
+    auto const &M(*eigen.M);
+    long const ncols = M.outerSize();
+    Progress progress("linear::to_tuple", ncols);
+    if (nthreads <= 1) {
+        spsparse::spcopy(
+            spsparse::accum::to_sparse(eigen.dims,
+                accum::ref(ret.M)),
+            M);
+        progress.add(ncols);
+    } else {
+        // Threads copy ranges of columns; then join them, in order
+        ret.M.set_shape({eigen.dims[0]->sparse_extent(), eigen.dims[1]->sparse_extent()});
+        long const nchunks = std::max(1L, std::min(ncols, 4L*nthreads));
+        std::vector<Weighted_Tuple::TupleListLT<2>::VectorT> parts(nchunks);
+        parallel_for(0, nchunks, nthreads, [&](long c0, long c1) {
+            for (long c=c0; c<c1; ++c) {
+                long const k0 = ncols * c / nchunks;
+                long const k1 = ncols * (c+1) / nchunks;
+                for (long k=k0; k<k1; ++k) {
+                for (Weighted_Eigen::EigenSparseMatrixT::InnerIterator ii(M,k); ii; ++ii) {
+                    parts[c].push_back(Tuple<long,double,2>(
+                        {eigen.dims[0]->to_sparse(ii.row()), eigen.dims[1]->to_sparse(ii.col())},
+                        ii.value()));
+                }}
+                progress.add(k1 - k0);
+            }
+        });
+        ret.M.tuples.reserve(M.nonZeros());
+        for (auto const &part : parts)
+            ret.M.tuples.insert(ret.M.tuples.end(), part.begin(), part.end());
+    }
 
     spsparse::spcopy(
         spsparse::accum::to_sparse(
@@ -14,7 +14,11 @@ namespace linear {
 
 class Weighted_Eigen;
 
-/** Return value of a sparse matrix */
+/** Return value of a sparse matrix.
+
+Also usable directly, without decoding: once consolidate() has
+sorted M by row, apply_M() runs row by row straight out of the
+tuples.  This is the fastest backend when memory is plentiful. */
 struct Weighted_Tuple : public Weighted {
 
     template<int RANK>
@@ -24,6 +28,20 @@ struct Weighted_Tuple : public Weighted {
     TupleListLT<2> M;
     TupleListLT<1> Mw;
 
+private:
+    /** Row structure of M, built by index_rows().  Not stored by
+    ncio(); rebuilt when read. */
+    struct RowIndex {
+        size_t nM;    // M.size() when built; -1 if M is not row-sorted
+        size_t nwM;   // wM.size() when built
+        std::vector<long> rows;       // Rows of M with elements, ascending
+        std::vector<size_t> row_ptr;  // Row rows[r] is M.tuples[row_ptr[r]:row_ptr[r+1]]
+        std::vector<long> active;     // Distinct indices of wM, ascending
+
+        RowIndex() : nM(-1), nwM(-1) {}
+    } _index;
+
+public:
 
     /** Construct with shared dimensions from elsewhere */
     Weighted_Tuple(bool conservative=true)
@@ -33,6 +51,20 @@ struct Weighted_Tuple : public Weighted {
 
     void set_shape(std::array<long,2> _shape);
 
+    /** Sorts M by row (and wM, Mw by index), sums duplicates and
+    drops zeros; then index_rows().  Call once M is complete.
+    @param nthreads Sort with up to this many threads. */
+    void consolidate(int nthreads=1);
+
+    /** Records the row structure of M, if it is sorted by row, for
+    apply_M().  Call again after changing M or wM by hand; until then,
+    apply_M() falls back to a slower path if their sizes changed. */
+    void index_rows();
+
+    /** @return True if apply_M() can go row by row */
+    bool rows_indexed() const
+        { return _index.nM == M.size() && _index.nwM == wM.size(); }
+
     /** Sparse shape of the matrix */
     std::array<long,2> shape() const
         { return M.shape(); }
@@ -58,6 +90,12 @@ struct Weighted_Tuple : public Weighted {
         AccumType accum_type=AccumType::REPLACE,
         bool force_conservation=true) const;
 
+    /** Computes out = M^T * Bs */
+    void apply_MT(
+        blitz::Array<double,2> const &Bs,
+        blitz::Array<double,2> &out,
+        AccumType accum_type=AccumType::REPLACE) const;
+
     /** Computes As = M * As, result put in place. */
     virtual void apply_M_inplace(
         blitz::Array<double,2> &As,
@@ -66,6 +104,8 @@ struct Weighted_Tuple : public Weighted {
 
     long nnz() const { return M.size(); }
 
+    MemoryFootprint memory_footprint(std::string const &name = "Weighted_Tuple") const;
+
 protected:
     virtual void _to_coo(
         blitz::Array<int,1> &indices0,        // Must be pre-allocated(nnz)
@@ -87,13 +127,18 @@ public:
         ar & wM;
         ar & M;
         ar & Mw;
+        if (ArchiveT::is_loading::value) index_rows();
     }
 
 };
 
-std::unique_ptr<Weighted_Eigen> to_eigen(Weighted_Tuple const &X);
+/** @param nthreads If >1, build the Eigen matrix in parallel.  (Dense
+    indices are still assigned serially, in order of appearance.)
+    Progress is reported to ibmisc_progress. */
+std::unique_ptr<Weighted_Eigen> to_eigen(Weighted_Tuple const &X, int nthreads = 1);
 
-Weighted_Tuple to_tuple(Weighted_Eigen const &X);
+/** @param nthreads If >1, copy ranges of columns of M in parallel */
+Weighted_Tuple to_tuple(Weighted_Eigen const &X, int nthreads = 1);
 
 }}    // namespace
 #endif
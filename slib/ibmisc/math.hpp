@@ -2,6 +2,7 @@
 #define IBMISC_MATH_HPP
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 
 namespace ibmisc {
@@ -29,5 +30,36 @@ inline double round_mantissa(double const x, int const ntruncate=3)
     return ldexp(std::round(ldexp(x, digits-ntruncate-exp)),  +exp+ntruncate-digits);
 }
 
+/** Division of non-negative 63-bit integers by a fixed divisor d,
+using a precomputed "magic number" (Granlund & Montgomery 1994, as in
+libdivide): n/d == (n*magic) >> (64 + shift).  This turns a 64-bit
+division (40-90 cycles) into a multiply and a shift. */
+class FastDivider {
+    uint64_t _d;
+    uint64_t _magic;
+    int _shift;
+public:
+    /** @param d Divisor, 0 < d < 2^63 */
+    explicit FastDivider(uint64_t d = 1) : _d(d), _magic(0), _shift(0)
+    {
+        if (d <= 1) return;
+        int l = 0;    // l = ceil(log2(d))
+        while (l < 63 && ((uint64_t)1 << l) < d) ++l;
+        // magic = ceil(2^(63+l) / d), which fits in 64 bits
+        _magic = (uint64_t)((((unsigned __int128)1 << (63+l)) + d - 1) / d);
+        _shift = l-1;
+    }
+
+    uint64_t divisor() const { return _d; }
+
+    /** @param n Dividend, < 2^63
+    @return n / d */
+    uint64_t divide(uint64_t n) const
+    {
+        if (_d <= 1) return n;
+        return (uint64_t)(((unsigned __int128)n * _magic) >> 64) >> _shift;
+    }
+};
+
 }    // namespace
 #endif
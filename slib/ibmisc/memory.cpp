@@ -1,13 +1,83 @@
 
+#include <algorithm>
+#include <cstdlib>
 #include <ibmisc/memory.hpp>
 
 namespace ibmisc {
 
+size_t const TmpAlloc::min_block_size;
+size_t const TmpAlloc::max_block_size;
+
+void *TmpAlloc::alloc_block(size_t size, size_t align)
+{
+    size_t const bsize = std::max(_next_block_size, size + align);
+    Block *block = (Block *)std::malloc(sizeof(Block) + bsize);
+    if (!block) throw std::bad_alloc();
+    block->next = _blocks;
+    block->size = bsize;
+    _blocks = block;
+    _cur = (uintptr_t)(block + 1);
+    _end = _cur + bsize;
+    _next_block_size = std::min(2*_next_block_size, max_block_size);
+
+    return alloc(size, align);
+}
+
+MemoryFootprint TmpAlloc::memory_footprint(std::string const &name) const
+{
+    size_t capacity = 0;
+    for (Block *block = _blocks; block; block = block->next)
+        capacity += sizeof(Block) + block->size;
+    return MemoryFootprint(name, capacity - (_end - _cur), capacity);
+}
+
+void TmpAlloc::steal(TmpAlloc &other)
+{
+    _blocks = other._blocks;
+    _cur = other._cur;
+    _end = other._end;
+    _dtors = other._dtors;
+    _dtors_tail = (_dtors ? other._dtors_tail : &_dtors);
+    _next_block_size = other._next_block_size;
+    other.reset();
+}
+
+void TmpAlloc::merge(TmpAlloc &&other)
+{
+    // Our blocks go on allocating from our current block; just keep
+    // other's blocks around, to be released with ours.
+    if (other._blocks) {
+        if (_blocks) {
+            Block *last = other._blocks;
+            while (last->next) last = last->next;
+            last->next = _blocks->next;
+            _blocks->next = other._blocks;
+        } else {
+            _blocks = other._blocks;
+            _cur = other._cur;
+            _end = other._end;
+            _next_block_size = other._next_block_size;
+        }
+    }
+    if (other._dtors) {
+        *_dtors_tail = other._dtors;
+        _dtors_tail = other._dtors_tail;
+    }
+    other.reset();
+}
+
 void TmpAlloc::free() {
-    for (auto ii(deleters.begin()); ii != deleters.end(); ++ii) {
-        (*ii)();
+    for (Dtor *dtor = _dtors; dtor; ) {
+        Dtor *next = dtor->next;    // dtor lives in the arena; it stays valid
+        dtor->fn(dtor->obj);
+        dtor = next;
+    }
+    for (Block *block = _blocks; block; ) {
+        Block *next = block->next;
+        std::free(block);
+        block = next;
     }
-    deleters.clear();
+    reset();
 }
 
 }   // namespace ibmisc
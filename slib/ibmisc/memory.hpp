@@ -19,11 +19,15 @@
 #pragma once
 
 // See: http://stackoverflow.com/questions/11002641/dynamic-casting-for-unique-ptr
+#include <cstdint>
 #include <functional>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <typeinfo>
 #include <vector>
 #include <boost/variant.hpp>
+#include <ibmisc/footprint.hpp>
 
 namespace ibmisc {
 
@@ -183,41 +187,110 @@ public:
 // --------------------------------------------------------------
 
 /** An allocatoer that retains ownership of everything it allocates;
-and de-allocates all those things when it is destroyed. */
+and de-allocates all those things when it is destroyed.
+
+Objects are bump-allocated from an arena of large blocks.  A
+destructor record (also in the arena) is kept only for objects that
+need one; free() runs them, in allocation order, then releases the
+blocks all at once. */
 class TmpAlloc {
-    std::vector<std::function<void()>> deleters;
+    /** Cleanup for one object; intrusive list, allocated in the arena */
+    struct Dtor {
+        Dtor *next;
+        void (*fn)(void *);
+        void *obj;
+    };
+
+    /** Header of one arena block; the block's memory follows it */
+    struct alignas(16) Block {
+        Block *next;
+        size_t size;
+    };
+
+    static size_t const min_block_size = 4096;
+    static size_t const max_block_size = 1024*1024;
+
+    Block *_blocks;        // Newest first
+    uintptr_t _cur, _end;  // Unused part of _blocks
+    Dtor *_dtors;          // In allocation order...
+    Dtor **_dtors_tail;    // ...appended here
+    size_t _next_block_size;
+
+    template<class T>
+    static void destroy(void *t)
+        { static_cast<T *>(t)->~T(); }
+
+    template<class T>
+    static void del(void *t)
+        { delete static_cast<T *>(t); }
+
+    /** Allocates raw memory in the arena */
+    void *alloc(size_t size, size_t align)
+    {
+        uintptr_t const p = (_cur + align - 1) & ~(uintptr_t)(align - 1);
+        if (!_blocks || p + size > _end) return alloc_block(size, align);
+        _cur = p + size;
+        return (void *)p;
+    }
+
+    /** Starts a new block, and allocates from it */
+    void *alloc_block(size_t size, size_t align);
+
+    /** Registers fn(obj) to be run by free() */
+    void add_dtor(void (*fn)(void *), void *obj)
+    {
+        Dtor *dtor = (Dtor *)alloc(sizeof(Dtor), alignof(Dtor));
+        dtor->next = 0;
+        dtor->fn = fn;
+        dtor->obj = obj;
+        *_dtors_tail = dtor;
+        _dtors_tail = &dtor->next;
+    }
 
     template<class T>
-    static void del(T *t)
-        { delete t; }
+    T *adopt(T *ptr)
+    {
+        if (!std::is_trivially_destructible<T>::value) add_dtor(&TmpAlloc::destroy<T>, ptr);
+        return ptr;
+    }
+
+    void reset()
+    {
+        _blocks = 0;
+        _cur = _end = 0;
+        _dtors = 0;
+        _dtors_tail = &_dtors;
+        _next_block_size = min_block_size;
+    }
+
+    void steal(TmpAlloc &other);
 
 public:
 
-    TmpAlloc() {}
+    TmpAlloc() { reset(); }
     /** Delete copy constructor; this would result in multiple de-allocations. */
     TmpAlloc(TmpAlloc const &) = delete;
 
-    TmpAlloc(TmpAlloc &&other) :
-        deleters(std::move(other.deleters)) {}
+    TmpAlloc(TmpAlloc &&other)
+        { steal(other); }
 
-    void merge(TmpAlloc &&other)
-    {
-        for (auto const &x : other.deleters) deleters.push_back(x);
-        other.deleters.clear();
-    }
+    /** Takes over everything allocated by other; it will be freed
+    along with our own allocations. */
+    void merge(TmpAlloc &&other);
+
+    /** Arena blocks allocated; the unused end of the newest block is
+    slack.  (Objects held by pointer are not followed.) */
+    MemoryFootprint memory_footprint(std::string const &name = "TmpAlloc") const;
 
     void operator=(TmpAlloc &&other)
     {
-        this->deleters = std::move(other.deleters);
+        free();
+        steal(other);
     }
 
     template<class T, typename... Args>
     T *newptr(Args... args)
-    {
-        T *ret = new T(args...);
-        deleters.push_back(std::bind(&TmpAlloc::del<T>, ret));
-        return ret;
-    }
+        { return adopt(new (alloc(sizeof(T), alignof(T))) T(args...)); }
 
     // ----------------------------------------------------
 
@@ -226,8 +299,7 @@ public:
     template<class T, typename... Args>
     T &make(T *&ptr, Args... args)
     {
-        ptr = new T(args...);
-        deleters.push_back(std::bind(&TmpAlloc::del<T>, ptr));
+        ptr = newptr<T>(args...);
         return *ptr;
     }
 
@@ -243,11 +315,7 @@ public:
     /** Move to allocated location from an rvalue reference */
     template<class T>
     T &take(T &&val)
-    {
-        T *ptr(new T(std::move(val)));
-        deleters.push_back(std::bind(&TmpAlloc::del<T>, ptr));
-        return *ptr;
-    }
+        { return *adopt(new (alloc(sizeof(T), alignof(T))) T(std::move(val))); }
 
 
     /** Move to allocated location from an rvalue reference.
@@ -256,8 +324,7 @@ public:
     template<class T>
     T &take(T *&ptr, T &&val)
     {
-        ptr = new T(std::move(val));
-        deleters.push_back(std::bind(&TmpAlloc::del<T>, ptr));
+        ptr = &take(std::move(val));
         return *ptr;
     }
 
@@ -265,9 +332,7 @@ public:
     template<class T>
     T const &take(T const *&ptr, T &&val)
     {
-        T *_ptr = new T(std::move(val));
-        deleters.push_back(std::bind(&TmpAlloc::del<T>, _ptr));
-        ptr = _ptr;
+        ptr = &take(std::move(val));
         return *ptr;
     }
 
@@ -279,7 +344,7 @@ public:
     T &take(std::unique_ptr<T> &&uptr)
     {
         T *ptr(uptr.release());
-        deleters.push_back(std::bind(&TmpAlloc::del<T>, ptr));
+        add_dtor(&TmpAlloc::del<T>, ptr);
         return *ptr;
     }
 
@@ -293,11 +358,11 @@ public:
     // ----------------------------------------------------
 
     ~TmpAlloc() { free(); }
+
+    /** Destroys everything allocated so far, and releases the arena */
     void free();
 
 };
-
-
 // -----------------------------------------------------
 /** A unique_ptr class with operator=() and copy constructors.
 A clonable_unique_ptr<TypeT>() is copied by calling
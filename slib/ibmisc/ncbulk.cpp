@@ -1,4 +1,12 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 #include <ibmisc/ncbulk.hpp>
+#include <ibmisc/profile.hpp>
 
 namespace ibmisc {
 
@@ -6,7 +14,7 @@ namespace ibmisc {
 NcBulkReader::NcBulkReader(
     FileLocator const *_files,
     std::vector<std::string> const &_vars)
-: files(_files)
+: files(_files), nthreads(1)
 {
     size_t n = _vars.size();
     if (3*(n/3) != n) (*ibmisc_error)(-1,
@@ -21,8 +29,53 @@ NcBulkReader::NcBulkReader(
     }
 }
 
+std::array<std::string,2> NcBulkReader::take_var(std::string const &varname)
+{
+    auto iix(varmap.find(varname));
+    if (iix == varmap.end()) (*ibmisc_error)(-1,
+        "User failed to include fname and vname for variable %s", varname.c_str());
+
+    std::array<std::string,2> ret(iix->second);
+    varmap.erase(iix);    // We've added once, can't add again
+    return ret;
+}
+
+NcBulkReader::FileTiming NcBulkReader::read_file(
+    std::vector<Action>::iterator a0,
+    std::vector<Action>::iterator a1)
+{
+    IBMISC_SCOPED_TIMER("NcBulkReader::read_file");
+    typedef std::chrono::steady_clock clock;
+    auto const t0 = clock::now();
+
+    FileTiming timing;
+    timing.fname = files->locate(a0->fname);
+    timing.nvars = a1 - a0;
+
+    // Ask the OS to start reading the file while we wait for the lock
+    int const fd = open(timing.fname.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+    auto const t1 = clock::now();
+
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+    auto const t2 = clock::now();
+    {NcIO ncio(timing.fname, 'r');
+        for (auto ii=a0; ii != a1; ++ii) ii->fn(ncio);
+    }
+    auto const t3 = clock::now();
+
+    timing.prefetch_s = std::chrono::duration<double>(t1 - t0).count();
+    timing.wait_s = std::chrono::duration<double>(t2 - t1).count();
+    timing.read_s = std::chrono::duration<double>(t3 - t2).count();
+    return timing;
+}
+
 void NcBulkReader::operator()()
 {
+    IBMISC_SCOPED_TIMER("NcBulkReader");
     // Check that every expected variable has been assigned.
     if (varmap.size() != 0) {
         for (auto ii=varmap.begin(); ii != varmap.end(); ++ii)
@@ -32,18 +85,42 @@ void NcBulkReader::operator()()
 
 
     // Read variables, grouped by file
-    std::sort(actions.begin(), actions.end());
-    std::unique_ptr<NcIO> ncio;
-    std::string last_fname = "";
+    std::stable_sort(actions.begin(), actions.end());
+    std::vector<std::vector<Action>::iterator> groups;
     for (auto ii=actions.begin(); ii != actions.end(); ++ii) {
-        if (ii->fname != last_fname) {
-            std::string located_fname(files->locate(ii->fname));
-//printf("Opening %s -> %s\n", ii->fname.c_str(), located_fname.c_str());
-            ncio.reset(new NcIO(located_fname, 'r'));
-        }
-        ii->fn(*ncio);
-        last_fname = ii->fname;
+        if (ii == actions.begin() || ii->fname != (ii-1)->fname)
+            groups.push_back(ii);
     }
+    groups.push_back(actions.end());
+    long const nfiles = groups.size() - 1;
+
+    timings.clear();
+    timings.resize(nfiles);
+    std::atomic<long> next(0);
+    int const nworkers = std::max(1, std::min(nthreads, (int)nfiles));
+    std::vector<std::exception_ptr> errors(nworkers);
+    auto worker = [&](int w) {
+        // Each worker takes the next unread file
+        try {
+            for (long i; (i = next++) < nfiles; ) {
+                timings[i] = read_file(groups[i], groups[i+1]);
+            }
+        } catch(...) {
+            errors[w] = std::current_exception();
+            next = nfiles;    // Others stop after their current file
+        }
+    };
+
+    // Workers block on I/O and netcdf_mutex, so they get threads of
+    // their own rather than tying up the shared compute pool
+    std::vector<std::thread> threads;
+    for (int w=1; w<nworkers; ++w) threads.push_back(std::thread(worker, w));
+    worker(0);
+    for (auto &th : threads) th.join();
+    for (auto &err : errors) if (err) std::rethrow_exception(err);
+
+    // Don't read again in the destructor
+    actions.clear();
 }
 
 }    // namespace ibmisc
@@ -4,6 +4,7 @@
 #include <map>
 #include <functional>
 #include <ibmisc/netcdf.hpp>
+#include <ibmisc/indexing.hpp>
 #include <ibmisc/filesystem.hpp>
 
 namespace ibmisc {
@@ -47,6 +48,22 @@ class NcBulkReader
     std::vector<Action> actions;
 
 public:
+    /** Number of files to work on at once, each on a thread of its own
+    (not the shared pool of parallel.hpp).  NetCDF calls themselves
+    are serialized (see netcdf_mutex); the gain comes from overlapping
+    file location, open latency and filesystem readahead, which
+    dominate on parallel filesystems like Lustre. */
+    int nthreads;
+
+    /** Time spent on each file, filled in by operator()() */
+    struct FileTiming {
+        std::string fname;     // Located filename
+        int nvars;             // Variables read from it
+        double prefetch_s;     // Locating + readahead hint (outside the lock)
+        double wait_s;         // Waiting for netcdf_mutex
+        double read_s;         // Open, read and close
+    };
+    std::vector<FileTiming> timings;
 
     /** @param _vars {varname=interal name, fname=NetCDF filename, vname = NetcDF variable name, ...} */
     NcBulkReader(
@@ -61,6 +78,9 @@ private:
         std::string const &fname,
         std::string const &vname);
 
+    /** Looks up (and removes) a variable given to the constructor.
+    @return {fname, vname} */
+    std::array<std::string,2> take_var(std::string const &varname);
 
 public:
 
@@ -72,9 +92,26 @@ public:
         std::string const &varname,
         blitz::Array<TypeT, RANK> &var);
 
-    /** Do the read! */
+    /** Add a variable to be read, but only the part inside domain (see
+    ncio_blitz_domain()).  var is allocated here to cover just the
+    domain, so each MPI rank reads and stores only what it owns.
+    @param indexing Layout of the whole NetCDF variable */
+    template<class TypeT, int RANK>
+    NcBulkReader &operator()(
+        std::string const &varname,
+        blitz::Array<TypeT, RANK> &var,
+        Indexing const &indexing,
+        Domain const &domain);
+
+    /** Do the read!  Files are read concurrently if nthreads > 1. */
     void operator()();
     ~NcBulkReader() { this->operator()(); }
+
+private:
+    /** Reads actions [a0, a1), which all come from one file */
+    FileTiming read_file(
+        std::vector<Action>::iterator a0,
+        std::vector<Action>::iterator a1);
 };
 
 // ----------------------------------------------------
@@ -99,16 +136,29 @@ NcBulkReader &NcBulkReader::operator()(
     std::string const &varname,
     blitz::Array<TypeT, RANK> &var)
 {
-    auto iix(varmap.find(varname));
-    if (iix == varmap.end()) (*ibmisc_error)(-1,
-        "User failed to include fname and vname for variable %s", varname.c_str());
+    auto const fv(take_var(varname));
+    _add_var(var, fv[0], fv[1]);
+    return *this;
+}
 
-    std::string const &fname(iix->second[0]);
-    std::string const &vname(iix->second[1]);
+template<class TypeT, int RANK>
+NcBulkReader &NcBulkReader::operator()(
+    std::string const &varname,
+    blitz::Array<TypeT, RANK> &var,
+    Indexing const &indexing,
+    Domain const &domain)
+{
+    auto const fv(take_var(varname));
+    var.reference(indexing.make_blitz<TypeT,RANK>(domain));
 
-    _add_var(var, fname, vname);
-    varmap.erase(iix);    // We've added once, can't add again
+    // Copies share memory with var; indexing and domain need not outlive us
+    blitz::Array<TypeT, RANK> arr(var);
+    std::string const vname(fv[1]);
+    ActionFn action([arr, vname, indexing, domain](NcIO &ncio) mutable {
+        return ncio_blitz_domain(ncio, arr, vname, "", indexing, domain);
+    });
 
+    actions.push_back(Action(fv[0], action));
     return *this;
 }
 
@@ -36,7 +36,7 @@ void ncio_timespan(NcIO &ncio, std::array<double,2> &timespan, ibmisc::TimeUnit
                 {(long)timespan.size(), iso8601_length}));
 
         // Add attributes
-        NcVar timespan_var(ncio.nc->getVar(vname));
+        NcVar timespan_var(ncio.getVar(vname));
         timespan_var.putAtt("units", time_unit.to_cf());
         timespan_var.putAtt("calendar", "365_day");
         timespan_var.putAtt("axis", "T");
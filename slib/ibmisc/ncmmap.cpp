@@ -0,0 +1,316 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ibmisc/ncmmap.hpp>
+#ifdef USE_HDF5
+#include <hdf5.h>
+#endif
+
+namespace ibmisc {
+
+static bool host_big_endian()
+{
+    uint16_t const one = 1;
+    return *(unsigned char const *)&one == 0;
+}
+
+// ---------------------------------------------------------
+// Classic (CDF-1), 64-bit offset (CDF-2) and CDF-5 files
+// https://docs.unidata.ucar.edu/netcdf-c/current/file_format_specifications.html
+
+namespace {
+
+/** Reads the big-endian header of a classic-format file */
+class ClassicHeader {
+    std::ifstream fin;
+public:
+    int version;    // 1, 2 or 5
+
+    ClassicHeader(std::string const &fname) : fin(fname.c_str(), std::ios::binary), version(0) {}
+
+    bool good() const { return fin.good(); }
+
+    uint64_t get(int nbytes)
+    {
+        unsigned char buf[8] = {0};
+        fin.read((char *)buf, nbytes);
+        uint64_t ret = 0;
+        for (int i=0; i<nbytes; ++i) ret = (ret << 8) | buf[i];
+        return ret;
+    }
+
+    /** Counts and sizes: 64-bit in CDF-5 */
+    uint64_t get_nelems()
+        { return get(version == 5 ? 8 : 4); }
+
+    void skip(uint64_t nbytes)
+        { fin.seekg(nbytes, std::ios::cur); }
+
+    /** Skips padding to a 4-byte boundary */
+    void skip_padded(uint64_t nbytes)
+        { skip((nbytes + 3) / 4 * 4); }
+
+    std::string get_name()
+    {
+        uint64_t const n = get_nelems();
+        if (!fin.good() || n > 1<<16) return "";
+        std::string ret(n, '\0');
+        fin.read(&ret[0], n);
+        skip((4 - n % 4) % 4);
+        return ret;
+    }
+};
+
+enum {NC_DIMENSION_TAG = 10, NC_VARIABLE_TAG = 11, NC_ATTRIBUTE_TAG = 12};
+
+/** Size and name of each classic nc_type */
+struct ClassicType {
+    int size;
+    char const *name;
+};
+ClassicType const classic_types[] = {
+    {0, ""}, {1, "byte"}, {1, "char"}, {2, "short"}, {4, "int"},
+    {4, "float"}, {8, "double"}, {1, "ubyte"}, {2, "ushort"},
+    {4, "uint"}, {8, "int64"}, {8, "uint64"}};
+int const nclassic_types = sizeof(classic_types) / sizeof(classic_types[0]);
+
+void skip_atts(ClassicHeader &hdr)
+{
+    uint64_t const tag = hdr.get(4);
+    uint64_t const n = hdr.get_nelems();
+    if (tag != NC_ATTRIBUTE_TAG) return;
+    for (uint64_t i=0; i<n && hdr.good(); ++i) {
+        hdr.get_name();
+        int const type = hdr.get(4);
+        uint64_t const nvals = hdr.get_nelems();
+        int const size = (type > 0 && type < nclassic_types ? classic_types[type].size : 1);
+        hdr.skip_padded(nvals * size);
+    }
+}
+
+bool locate_classic(std::string const &fname, std::string const &vname, NcVarLocation &loc)
+{
+    ClassicHeader hdr(fname);
+    char magic[3];
+    for (int i=0; i<3; ++i) magic[i] = hdr.get(1);
+    hdr.version = hdr.get(1);
+    if (memcmp(magic, "CDF", 3) != 0) return false;
+    if (hdr.version != 1 && hdr.version != 2 && hdr.version != 5) return false;
+
+    hdr.get_nelems();    // numrecs
+
+    // Dimensions (length 0 = unlimited)
+    std::vector<uint64_t> dims;
+    {
+        uint64_t const tag = hdr.get(4);
+        uint64_t const n = hdr.get_nelems();
+        if (tag == NC_DIMENSION_TAG) {
+            for (uint64_t i=0; i<n && hdr.good(); ++i) {
+                hdr.get_name();
+                dims.push_back(hdr.get_nelems());
+            }
+        }
+    }
+
+    skip_atts(hdr);    // Global attributes
+
+    uint64_t const tag = hdr.get(4);
+    uint64_t const nvars = hdr.get_nelems();
+    if (tag != NC_VARIABLE_TAG) return false;
+    for (uint64_t v=0; v<nvars && hdr.good(); ++v) {
+        std::string const name(hdr.get_name());
+        uint64_t const ndims = hdr.get_nelems();
+        std::vector<uint64_t> dimids;
+        for (uint64_t i=0; i<ndims && hdr.good(); ++i) dimids.push_back(hdr.get_nelems());
+        skip_atts(hdr);
+        int const type = hdr.get(4);
+        hdr.get_nelems();    // vsize
+        uint64_t const begin = hdr.get(hdr.version == 1 ? 4 : 8);
+        if (name != vname) continue;
+
+        if (!hdr.good() || type <= 0 || type >= nclassic_types) return false;
+        loc.nc_type = classic_types[type].name;
+        loc.shape.clear();
+        long n = 1;
+        for (uint64_t id : dimids) {
+            if (id >= dims.size()) return false;
+            if (dims[id] == 0) return false;    // Record variable: interleaved with the others
+            loc.shape.push_back(dims[id]);
+            n *= dims[id];
+        }
+        loc.offset = begin;
+        loc.nbytes = n * classic_types[type].size;
+        loc.native_order = (classic_types[type].size == 1 || host_big_endian());
+        return true;
+    }
+    return false;
+}
+
+// ---------------------------------------------------------
+// netCDF-4 (HDF5) files
+#ifdef USE_HDF5
+
+/** Closes an HDF5 handle at the end of a scope */
+class H5Handle {
+    hid_t const id;
+    herr_t (*const close)(hid_t);
+public:
+    H5Handle(hid_t _id, herr_t (*_close)(hid_t)) : id(_id), close(_close) {}
+    ~H5Handle() { if (id >= 0) close(id); }
+    operator hid_t() const { return id; }
+    bool ok() const { return id >= 0; }
+};
+
+/** @return netCDF name of an HDF5 datatype, or "" */
+std::string h5_nc_type(hid_t type)
+{
+    size_t const size = H5Tget_size(type);
+    switch(H5Tget_class(type)) {
+        case H5T_FLOAT :
+            return (size == 4 ? "float" : size == 8 ? "double" : "");
+        case H5T_STRING :
+            return (size == 1 && !H5Tis_variable_str(type) ? "char" : "");
+        case H5T_INTEGER : {
+            bool const sign = (H5Tget_sign(type) == H5T_SGN_2);
+            switch(size) {
+                case 1 : return sign ? "byte" : "ubyte";
+                case 2 : return sign ? "short" : "ushort";
+                case 4 : return sign ? "int" : "uint";
+                case 8 : return sign ? "int64" : "uint64";
+            }
+        }
+        default : return "";
+    }
+}
+
+/** Does the work of locate_hdf5() */
+bool locate_hdf5_quiet(std::string const &fname, std::string const &vname, NcVarLocation &loc)
+{
+    H5Handle file(H5Fopen(fname.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT), &H5Fclose);
+    if (!file.ok()) return false;
+
+    // netCDF-4 renames variables that clash with a dimension name
+    std::string::size_type const slash = vname.rfind('/');
+    std::string const dir(slash == std::string::npos ? "" : vname.substr(0, slash+1));
+    std::string const leaf(slash == std::string::npos ? vname : vname.substr(slash+1));
+    H5Handle dset0(H5Dopen2(file, ("/" + dir + leaf).c_str(), H5P_DEFAULT), &H5Dclose);
+    H5Handle dset1(dset0.ok() ? -1 :
+        H5Dopen2(file, ("/" + dir + "_nc4_non_coord_" + leaf).c_str(), H5P_DEFAULT), &H5Dclose);
+    hid_t const dset = (dset0.ok() ? (hid_t)dset0 : (hid_t)dset1);
+    if (dset < 0) return false;
+
+    H5Handle dcpl(H5Dget_create_plist(dset), &H5Pclose);
+    if (!dcpl.ok() || H5Pget_layout(dcpl) != H5D_CONTIGUOUS
+        || H5Pget_nfilters(dcpl) != 0) return false;
+
+    haddr_t const offset = H5Dget_offset(dset);
+    if (offset == HADDR_UNDEF) return false;    // Storage not allocated yet
+
+    H5Handle type(H5Dget_type(dset), &H5Tclose);
+    H5Handle space(H5Dget_space(dset), &H5Sclose);
+    if (!type.ok() || !space.ok()) return false;
+    std::string const nc_type(h5_nc_type(type));
+    if (nc_type == "") return false;
+
+    int const rank = H5Sget_simple_extent_ndims(space);
+    if (rank < 0) return false;
+    std::vector<hsize_t> dims(rank);
+    if (rank > 0) H5Sget_simple_extent_dims(space, &dims[0], nullptr);
+
+    size_t const size = H5Tget_size(type);
+    H5T_order_t const order = H5Tget_order(type);
+    loc.nc_type = nc_type;
+    loc.shape.assign(dims.begin(), dims.end());
+    long n = 1;
+    for (hsize_t d : dims) n *= d;
+    loc.offset = offset;
+    loc.nbytes = n * size;
+    loc.native_order = (size == 1 || order == H5T_ORDER_NONE
+        || (order == H5T_ORDER_BE) == host_big_endian());
+    return true;
+}
+
+/** Looks up vname, with HDF5 errors not printed */
+bool locate_hdf5(std::string const &fname, std::string const &vname, NcVarLocation &loc)
+{
+    bool ret = false;
+    H5E_BEGIN_TRY {
+        ret = locate_hdf5_quiet(fname, vname, loc);
+    } H5E_END_TRY;
+    return ret;
+}
+#endif
+
+}    // anonymous namespace
+
+// ---------------------------------------------------------
+bool nc_locate_var(
+    std::string const &fname, std::string const &vname,
+    NcVarLocation &loc)
+{
+    char magic[8] = {0};
+    {
+        std::ifstream fin(fname.c_str(), std::ios::binary);
+        fin.read(magic, sizeof(magic));
+        if (!fin.good()) return false;
+    }
+
+    if (memcmp(magic, "CDF", 3) == 0) return locate_classic(fname, vname, loc);
+#ifdef USE_HDF5
+    if (memcmp(magic, "\x89HDF\r\n\x1a\n", 8) == 0) return locate_hdf5(fname, vname, loc);
+#endif
+    return false;
+}
+
+std::shared_ptr<void const> mmap_file_range(
+    std::string const &fname, long offset, long nbytes,
+    char const *&data)
+{
+    data = nullptr;
+    if (nbytes <= 0) return std::shared_ptr<void const>();
+
+    int const fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return std::shared_ptr<void const>();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < offset + nbytes) {    // Truncated file
+        close(fd);
+        return std::shared_ptr<void const>();
+    }
+
+    // mmap() needs a page-aligned offset
+    long const page = sysconf(_SC_PAGESIZE);
+    long const start = offset / page * page;
+    size_t const len = nbytes + (offset - start);
+    void *addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, start);
+    close(fd);    // The mapping keeps the file open
+    if (addr == MAP_FAILED) return std::shared_ptr<void const>();
+
+    data = (char const *)addr + (offset - start);
+    return std::shared_ptr<void const>(addr, [len](void const *a) {
+        munmap(const_cast<void *>(a), len);
+    });
+}
+
+}    // namespace ibmisc
@@ -0,0 +1,189 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IBMISC_NCMMAP_HPP
+#define IBMISC_NCMMAP_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <blitz/array.h>
+#include <ibmisc/netcdf.hpp>
+
+/** Zero-copy reads of NetCDF variables: the variable's bytes are
+mapped into memory straight from the file, so "loading" a large matrix
+is instant, and pages come from the OS page cache as they are touched.
+
+This works for variables stored as one contiguous, unfiltered block in
+host byte order:
+  * Non-record variables of classic, 64-bit offset and CDF-5 files.
+    These are big-endian, so on most hosts only 1-byte types (eg the
+    .indices / .values of a ZArray) qualify.
+  * Contiguous, unfiltered datasets of netCDF-4 files (needs
+    USE_HDF5).  Variables written with compression off (eg with
+    NcIO::no_compress, or NcVarConfig::fast_write() and no chunking).
+Otherwise the nc_map_*() functions return false, and the variable must
+be read as usual, eg with ncio_blitz(). */
+namespace ibmisc {
+
+/** Where a variable's data sit in its file */
+struct NcVarLocation {
+    std::string nc_type;          // eg "double"; see get_nc_type()
+    std::vector<size_t> shape;
+    long offset;                  // Of the first element
+    long nbytes;
+    bool native_order;            // Stored in host byte order
+
+    NcVarLocation() : offset(-1), nbytes(0), native_order(false) {}
+};
+
+/** Looks up a variable that is stored in one contiguous, unfiltered
+block of a local file.
+@param vname Variable name; in netCDF-4 files, may have a group path
+    (eg "grp/var").
+@return False if the variable is not there, or not stored that way. */
+extern bool nc_locate_var(
+    std::string const &fname, std::string const &vname,
+    NcVarLocation &loc);
+
+/** Maps nbytes of a file, read-only, starting at offset.
+@param data Set to the first mapped byte
+@return Owner of the mapping (null on failure; or if nbytes == 0). */
+extern std::shared_ptr<void const> mmap_file_range(
+    std::string const &fname, long offset, long nbytes,
+    char const *&data);
+
+/** A read-only view of a variable, mapped from its file.  The view
+stays valid as long as any copy of map is held.  Do not write to it. */
+template<class TypeT, int RANK>
+struct NcMappedArray {
+    std::shared_ptr<void const> map;
+    blitz::Array<TypeT, RANK> arr;
+};
+
+/** A read-only, std::vector-like view of a variable, mapped from its
+file (see NcMappedArray). */
+template<class TypeT>
+class NcMappedVector {
+    std::shared_ptr<void const> _map;
+    TypeT const *_data;
+    size_t _size;
+
+public:
+    NcMappedVector() : _data(nullptr), _size(0) {}
+    NcMappedVector(std::shared_ptr<void const> const &map, TypeT const *data, size_t size)
+        : _map(map), _data(data), _size(size) {}
+
+    typedef TypeT value_type;
+    typedef TypeT const *const_iterator;
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    TypeT const *data() const { return _data; }
+    TypeT const &operator[](size_t i) const { return _data[i]; }
+    const_iterator begin() const { return _data; }
+    const_iterator end() const { return _data + _size; }
+
+    /** Copies into an ordinary vector */
+    std::vector<TypeT> to_vector() const
+        { return std::vector<TypeT>(begin(), end()); }
+};
+
+namespace _ncmmap {
+
+/** Locates vname and checks it can be viewed as TypeT: same type, or
+any 1-byte integer type for a 1-byte TypeT.  Maps it if so.
+@return False if not stored suitably */
+template<class TypeT>
+bool map_var(std::string const &fname, std::string const &vname,
+    NcVarLocation &loc, std::shared_ptr<void const> &map, TypeT const *&data)
+{
+    if (!nc_locate_var(fname, vname, loc)) return false;
+    if (!loc.native_order) return false;
+
+    bool const byte_types = (sizeof(TypeT) == 1 &&
+        (loc.nc_type == "byte" || loc.nc_type == "ubyte" || loc.nc_type == "char"));
+    if (!byte_types && loc.nc_type != get_nc_type<TypeT>()) return false;
+    if (loc.offset % alignof(TypeT) != 0) return false;
+
+    char const *p = nullptr;
+    map = mmap_file_range(fname, loc.offset, loc.nbytes, p);
+    if (!map && loc.nbytes > 0) return false;
+    data = (TypeT const *)p;
+    return true;
+}
+
+}    // namespace ibmisc::_ncmmap
+
+/** Views a variable in place, mapped from its file; in C order, like
+nc_read_blitz().
+@return False (leaving ret alone) if the variable cannot be mapped;
+    then read it as usual. */
+template<class TypeT, int RANK>
+bool nc_map_blitz(std::string const &fname, std::string const &vname,
+    NcMappedArray<TypeT, RANK> &ret)
+{
+    NcVarLocation loc;
+    std::shared_ptr<void const> map;
+    TypeT const *data;
+    if (!_ncmmap::map_var(fname, vname, loc, map, data)) return false;
+    if (loc.shape.size() != RANK) (*ibmisc_error)(-1,
+        "nc_map_blitz(%s): variable %s has rank %ld, expected %d",
+        fname.c_str(), vname.c_str(), (long)loc.shape.size(), RANK);
+
+    blitz::TinyVector<int, RANK> shape;
+    for (int i=0; i<RANK; ++i) shape[i] = loc.shape[i];
+    ret.map = map;
+    ret.arr.reference(blitz::Array<TypeT, RANK>(
+        const_cast<TypeT *>(data), shape, blitz::neverDeleteData));
+    return true;
+}
+
+/** Views a variable, of any rank, as a flat vector (see nc_map_blitz()) */
+template<class TypeT>
+bool nc_map_vector(std::string const &fname, std::string const &vname,
+    NcMappedVector<TypeT> &ret)
+{
+    NcVarLocation loc;
+    std::shared_ptr<void const> map;
+    TypeT const *data;
+    if (!_ncmmap::map_var(fname, vname, loc, map, data)) return false;
+    ret = NcMappedVector<TypeT>(map, data, loc.nbytes / sizeof(TypeT));
+    return true;
+}
+
+/** Same as above, for a variable of a file open for reading.  Returns
+false in other modes, since the file may still change. */
+template<class TypeT, int RANK>
+bool nc_map_blitz(NcIO &ncio, std::string const &vname,
+    NcMappedArray<TypeT, RANK> &ret)
+{
+    if (ncio.rw != 'r') return false;
+    return nc_map_blitz(ncio.fname, vname, ret);
+}
+
+template<class TypeT>
+bool nc_map_vector(NcIO &ncio, std::string const &vname,
+    NcMappedVector<TypeT> &ret)
+{
+    if (ncio.rw != 'r') return false;
+    return nc_map_vector(ncio.fname, vname, ret);
+}
+
+}    // namespace ibmisc
+#endif    // guard
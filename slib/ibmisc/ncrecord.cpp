@@ -0,0 +1,81 @@
+#include <ibmisc/ncrecord.hpp>
+#include <cstdio>
+
+namespace ibmisc {
+
+NcRecordWriter::NcRecordWriter(NcIO &_ncio, std::string const &_rec_dim,
+    bool background, int nbuffers)
+: ncio(_ncio), rec_dim(_rec_dim)
+{
+    if (ncio.rw != 'w') (*ibmisc_error)(-1,
+        "NcRecordWriter requires a file open for writing (%s)", ncio.fname.c_str());
+
+    // Append after any existing records
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+    netCDF::NcDim dim(get_or_add_dim(ncio, rec_dim));
+    irec = dim.getSize();
+
+    if (background) iothread.reset(new IOThread(nbuffers));
+}
+
+void NcRecordWriter::check_inflight(bool all)
+{
+    while (!inflight.empty() && (all ||
+        inflight.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+    {
+        std::future<void> fut(std::move(inflight.front()));
+        inflight.pop_front();
+        try {
+            fut.get();
+        } catch(std::exception const &e) {
+            (*ibmisc_error)(-1,
+                "Error writing to %s in background: %s", ncio.fname.c_str(), e.what());
+        }
+    }
+}
+
+void NcRecordWriter::end_record()
+{
+    std::shared_ptr<std::vector<std::function<void()>>> writes(
+        new std::vector<std::function<void()>>());
+    writes->swap(cur);
+    ncio.enddef();    // Once any new variables are defined
+    auto run = [writes]{
+        std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+        for (auto &fn : *writes) fn();
+        writes->clear();    // Free the buffers now
+    };
+
+    if (iothread) {
+        check_inflight(false);
+        inflight.push_back(iothread->submit(run));
+    } else {
+        run();
+    }
+    ++irec;
+}
+
+void NcRecordWriter::flush()
+{
+    if (iothread) iothread->wait();
+    check_inflight(true);
+}
+
+void NcRecordWriter::close()
+{
+    if (cur.size() > 0) end_record();
+    flush();
+    iothread.reset();
+}
+
+NcRecordWriter::~NcRecordWriter()
+{
+    // Never throw from a destructor (it may run during unwinding)
+    try {
+        close();
+    } catch(std::exception const &e) {
+        fprintf(stderr, "ERROR: NcRecordWriter(%s): %s\n", ncio.fname.c_str(), e.what());
+    }
+}
+
+}    // namespace ibmisc
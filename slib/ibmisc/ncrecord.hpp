@@ -0,0 +1,250 @@
+#ifndef IBMISC_NCRECORD_HPP
+#define IBMISC_NCRECORD_HPP
+
+#include <future>
+#include <memory>
+#include <deque>
+#include <algorithm>
+#include <ibmisc/netcdf.hpp>
+#include <ibmisc/iothread.hpp>
+
+namespace ibmisc {
+
+/** Appends records (eg one per timestep) of blitz::Arrays along an
+unlimited NetCDF dimension, at constant memory.
+
+Unlike ncio_blitz(), nothing is queued in the NcIO: each record is
+written when end_record() is called, and its buffers freed right
+away.  In background mode, the record is copied and written on an
+I/O thread while the caller carries on; at most nbuffers records are
+in flight at once (nbuffers=2 is classic double-buffering).  All
+netCDF calls made here hold netcdf_mutex; other code touching the same
+file while records are in flight must do the same.
+
+Usage:
+    NcIO ncio(fname, 'w');
+    NcRecordWriter out(ncio, "time", true);
+    out.define<double,2>("T", {"jm", "im"}, {jm, im});
+    for (...each timestep...) {
+        out.write("T", T);
+        out.end_record();
+    }
+    out.close();
+*/
+class NcRecordWriter {
+    NcIO &ncio;
+    std::string const rec_dim;
+    size_t irec;
+
+    std::unique_ptr<IOThread> iothread;
+    std::deque<std::future<void>> inflight;
+
+    // Writes queued for the current record
+    std::vector<std::function<void()>> cur;
+
+    void check_inflight(bool all);
+
+public:
+    /** @param _rec_dim Name of the unlimited dimension to append along.
+        Records are appended after any already in the file.
+    @param background Write on a background I/O thread
+    @param nbuffers Maximum records in flight (background mode) */
+    NcRecordWriter(NcIO &_ncio, std::string const &_rec_dim,
+        bool background = false, int nbuffers = 2);
+
+    /** Closes, but only logs errors: call close() to see them */
+    ~NcRecordWriter();
+
+    /** Index of the record currently being assembled */
+    size_t record() const { return irec; }
+
+    /** Defines a variable (rec_dim, dim_names...).  Call for all
+    variables before the first end_record(). */
+    template<class TypeT, int RANK>
+    netCDF::NcVar define(
+        std::string const &vname,
+        std::vector<std::string> const &dim_names,
+        std::vector<long> const &dim_lens,
+        std::string const &snc_type = "");
+
+    /** Adds arr to the current record.  In foreground mode, arr must
+    not change until end_record(); in background mode it is copied
+    right away. */
+    template<class TypeT, int RANK>
+    void write(std::string const &vname, blitz::Array<TypeT,RANK> const &arr);
+
+    /** Writes the current record and starts the next one. */
+    void end_record();
+
+    /** Waits for all records to be written */
+    void flush();
+
+    /** Flushes and stops the background thread, if any.  Errors
+    from background writes are raised here. */
+    void close();
+};
+
+// ----------------------------------------------------------
+template<class TypeT, int RANK>
+netCDF::NcVar NcRecordWriter::define(
+    std::string const &vname,
+    std::vector<std::string> const &dim_names,
+    std::vector<long> const &dim_lens,
+    std::string const &snc_type)
+{
+    if (dim_names.size() != RANK || dim_lens.size() != RANK) (*ibmisc_error)(-1,
+        "NcRecordWriter::define(%s): need %d dimensions", vname.c_str(), RANK);
+
+    std::vector<std::string> names {rec_dim};
+    std::vector<long> lens {-1};
+    names.insert(names.end(), dim_names.begin(), dim_names.end());
+    lens.insert(lens.end(), dim_lens.begin(), dim_lens.end());
+
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+    return get_or_add_var(ncio, vname,
+        snc_type == "" ? get_nc_type<TypeT>() : snc_type,
+        get_or_add_dims(ncio, names, lens));
+}
+
+template<class TypeT, int RANK>
+void NcRecordWriter::write(std::string const &vname, blitz::Array<TypeT,RANK> const &arr)
+{
+    std::vector<size_t> nc_start(RANK+1, 0);
+    nc_start[0] = irec;
+    std::array<int,RANK> b2n;
+    for (int i=0; i<RANK; ++i) b2n[i] = i+1;    // Record dimension comes first
+
+    // Background mode: hold our own copy until it's written
+    std::shared_ptr<blitz::Array<TypeT,RANK>> buf(iothread
+        ? new blitz::Array<TypeT,RANK>(arr.copy())
+        : new blitz::Array<TypeT,RANK>(arr));
+    netCDF::NcGroup *nc = ncio.nc;
+
+    cur.push_back([nc, buf, vname, nc_start, b2n]{
+        _ncio_blitz::nc_rw_blitz2<TypeT,RANK>(nc, 'w', buf.get(), vname, nc_start, b2n);
+    });
+}
+
+// ==========================================================
+/** Reads a NetCDF variable one record (eg timestep) at a time, along
+its first dimension.  While the caller works on record t, records
+t+1...t+nahead are read (and decompressed) on a background I/O
+thread, into a ring of nahead+1 buffers.  With nahead=0, each record
+is read when asked for.  All netCDF calls hold netcdf_mutex.
+
+Usage:
+    NcIO ncio(fname, 'r');
+    NcRecordReader<double,2> in(ncio, "T");
+    while (!in.done()) {
+        blitz::Array<double,2> const &T(in.next());
+        ...T is valid until the next call to next()...
+    }
+*/
+template<class TypeT, int RANK>
+class NcRecordReader {
+    std::string const fname;    // For error messages
+    netCDF::NcVar ncvar;
+    size_t const end;
+    size_t irec;     // Next record returned by next()
+    size_t iread;    // Next record to read
+
+    std::vector<blitz::Array<TypeT,RANK>> ring;    // Record t is in ring[t % ring.size()]
+    std::deque<std::future<void>> inflight;        // Reads of records irec...iread-1
+    std::unique_ptr<IOThread> iothread;            // Destroyed first
+
+    void read(size_t t);
+    void submit();
+
+public:
+    /** @param vname Variable to read; dimensions (rec_dim, ...)
+    @param nahead Records to read ahead of the one being processed
+    @param first First record to read */
+    NcRecordReader(NcIO &ncio, std::string const &vname,
+        int nahead = 1, size_t first = 0);
+
+    /** Number of records in the variable */
+    size_t size() const { return end; }
+
+    /** Index of the record next() will return */
+    size_t record() const { return irec; }
+
+    bool done() const { return irec >= end; }
+
+    /** Returns the next record; valid until the following call. */
+    blitz::Array<TypeT,RANK> const &next();
+};
+
+// ----------------------------------------------------------
+template<class TypeT, int RANK>
+NcRecordReader<TypeT,RANK>::
+    NcRecordReader(NcIO &ncio, std::string const &vname, int nahead, size_t first)
+: fname(ncio.fname), ncvar(ncio.getVar(vname)),
+    end(ncvar.isNull() || ncvar.getDimCount() == 0 ? 0 : ncvar.getDim(0).getSize()),
+    irec(first), iread(first)
+{
+    if (ncvar.isNull()) (*ibmisc_error)(-1,
+        "NcRecordReader: variable %s not found (file %s)", vname.c_str(), fname.c_str());
+    if (ncvar.getDimCount() != RANK+1) (*ibmisc_error)(-1,
+        "NcRecordReader: variable %s has rank %d, expected %d (file %s)",
+        vname.c_str(), ncvar.getDimCount(), RANK+1, fname.c_str());
+
+    blitz::TinyVector<int,RANK> extent;
+    for (int i=0; i<RANK; ++i) extent[i] = ncvar.getDim(i+1).getSize();
+    ring.resize(std::max(nahead,0) + 1);
+    for (auto &buf : ring) buf.reference(blitz::Array<TypeT,RANK>(extent));
+
+    if (nahead > 0) {
+        iothread.reset(new IOThread(nahead));
+        for (int i=0; i<nahead; ++i) submit();
+    }
+}
+
+template<class TypeT, int RANK>
+void NcRecordReader<TypeT,RANK>::read(size_t t)
+{
+    std::vector<size_t> nc_start(RANK+1, 0);
+    nc_start[0] = t;
+    std::array<int,RANK> b2n;
+    for (int i=0; i<RANK; ++i) b2n[i] = i+1;    // Record dimension comes first
+
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+    _ncio_blitz::nc_rw_blitz2<TypeT,RANK>(ncvar, 'r', &ring[t % ring.size()], nc_start, b2n);
+}
+
+template<class TypeT, int RANK>
+void NcRecordReader<TypeT,RANK>::submit()
+{
+    if (iread >= end) return;
+    size_t const t = iread++;
+    inflight.push_back(iothread->submit([this, t]{ read(t); }));
+}
+
+template<class TypeT, int RANK>
+blitz::Array<TypeT,RANK> const &NcRecordReader<TypeT,RANK>::next()
+{
+    if (done()) (*ibmisc_error)(-1,
+        "NcRecordReader: read past the last record %ld (file %s)",
+        (long)end, fname.c_str());
+
+    size_t const t = irec++;
+    if (!iothread) {
+        read(t);
+    } else {
+        std::future<void> fut(std::move(inflight.front()));
+        inflight.pop_front();
+        try {
+            fut.get();
+        } catch(std::exception const &e) {
+            (*ibmisc_error)(-1,
+                "Error reading record %ld from %s in background: %s",
+                (long)t, fname.c_str(), e.what());
+        }
+
+        // The caller is done with record t-1; re-use its buffer
+        submit();
+    }
+    return ring[t % ring.size()];
+}
+
+}    // namespace ibmisc
+#endif    // IBMISC_NCRECORD_HPP
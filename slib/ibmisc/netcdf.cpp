@@ -19,8 +19,15 @@
 #include <string>
 #include <netcdf>
 #include <sstream>
+#include <algorithm>
+#include <netcdf.h>
+#include <netcdf_mem.h>
+#ifdef USE_NETCDF_PAR
+#include <netcdf_par.h>
+#endif
 #include <boost/filesystem.hpp>
 #include <ibmisc/netcdf.hpp>
+#include <ibmisc/profile.hpp>
 
 
 using namespace netCDF;
@@ -28,6 +35,53 @@ using namespace netCDF;
 namespace ibmisc {
 
 bool netcdf_debug = false;
+std::recursive_mutex netcdf_mutex;
+size_t ncio_staging_bytes = 16*1024*1024;
+int ncio_copy_threads = 1;
+
+namespace _staging {
+thread_local bool single_call = false;
+
+int quantize_nsb(netCDF::NcVar const &ncvar)
+{
+    int const grpid = ncvar.getParentGroup().getId();
+    int nsb;
+    if (nc_get_att_int(grpid, ncvar.getId(), "quantization_nsb", &nsb) != NC_NOERR) return -1;
+    return nsb;
+}
+
+/** Fill value of ncvar, as TypeT */
+template<class TypeT>
+static TypeT fill_value(netCDF::NcVar const &ncvar)
+{
+    int const grpid = ncvar.getParentGroup().getId();
+    double fill;
+    if (nc_get_att_double(grpid, ncvar.getId(), "_FillValue", &fill) == NC_NOERR)
+        return (TypeT)fill;
+    return (ncvar.getType().getId() == NC_FLOAT ? (TypeT)NC_FILL_FLOAT : (TypeT)NC_FILL_DOUBLE);
+}
+
+void quantize(netCDF::NcVar const &ncvar, int nsb, float *buf, size_t n)
+    { bitround(buf, n, nsb, fill_value<float>(ncvar)); }
+
+void quantize(netCDF::NcVar const &ncvar, int nsb, double *buf, size_t n)
+    { bitround(buf, n, nsb, fill_value<double>(ncvar)); }
+}
+
+void set_quantize(netCDF::NcVar ncvar, int nsb)
+{
+    ncvar.putAtt("quantization_nsb", netCDF::ncInt, nsb);
+    ncvar.putAtt("quantization", "quantization_info");
+
+    // CF container variable, shared by the group's quantized variables
+    netCDF::NcGroup group(ncvar.getParentGroup());
+    if (group.getVar("quantization_info").isNull()) {
+        netCDF::NcVar info(group.addVar("quantization_info", netCDF::ncChar,
+            std::vector<netCDF::NcDim>{}));
+        info.putAtt("algorithm", "bitround");
+        info.putAtt("implementation", "ibmisc");
+    }
+}
 
 netCDF::NcType nc_type(netCDF::NcVar const &ncvar, std::string sntype)
 {
@@ -370,10 +424,98 @@ void NcIO::default_configure_var(netCDF::NcVar ncvar)
 
 void NcIO::no_compress(netCDF::NcVar ncvar)
 {
-    ncvar.setCompression(true, true, 4);
+    ncvar.setCompression(false, false, 0);
+}
 
-    // For some reason, this causes an HDF5 error
-    // ncvar.setChecksum(netCDF::NcVar::nc_FLETCHER32);
+// ---------------------------------------------------------
+NcVarConfig NcVarConfig::fast_write()
+{
+    NcVarConfig ret;
+    ret.shuffle = false;
+    ret.deflate_level = 0;
+    return ret;
+}
+
+NcVarConfig NcVarConfig::fast_read()
+{
+    NcVarConfig ret;
+    ret.shuffle = true;
+    ret.deflate_level = 1;
+    ret.cache_size = 64*1024*1024;
+    ret.cache_nelems = 10007;
+    return ret;
+}
+
+std::vector<size_t> NcVarConfig::chunk_shape(netCDF::NcVar const &ncvar) const
+{
+    int const rank = ncvar.getDimCount();
+
+    auto ii(var_chunks.find(ncvar.getName()));
+    if (ii != var_chunks.end()) {
+        if ((int)ii->second.size() != rank) (*ibmisc_error)(-1,
+            "Chunk shape for %s has rank %ld, variable has rank %d",
+            ncvar.getName().c_str(), ii->second.size(), rank);
+        return ii->second;
+    }
+
+    std::vector<size_t> chunks(rank);
+    for (int i=0; i<rank; ++i) {
+        netCDF::NcDim dim(ncvar.getDim(i));
+        size_t const len = dim.getSize();
+        auto jj(dim_chunks.find(dim.getName()));
+        if (jj != dim_chunks.end()) {
+            chunks[i] = (dim.isUnlimited() ? jj->second : std::min(len, jj->second));
+        } else {
+            chunks[i] = (dim.isUnlimited() ? 1 : len);
+        }
+        chunks[i] = std::max((size_t)1, chunks[i]);
+    }
+
+    // Keep chunks a reasonable size
+    size_t nbytes = ncvar.getType().getSize();
+    for (size_t c : chunks) nbytes *= c;
+    for (int i=0; i<rank && nbytes > max_chunk_bytes; ) {
+        if (chunks[i] == 1) {
+            ++i;
+            continue;
+        }
+        nbytes /= chunks[i];
+        chunks[i] = (chunks[i] + 1) / 2;
+        nbytes *= chunks[i];
+    }
+    return chunks;
+}
+
+void NcVarConfig::operator()(netCDF::NcVar ncvar) const
+{
+    if (set_chunking && ncvar.getDimCount() > 0) {
+        std::vector<size_t> chunks(chunk_shape(ncvar));
+        ncvar.setChunking(netCDF::NcVar::nc_CHUNKED, chunks);
+    }
+    ncvar.setCompression(shuffle, deflate_level > 0, deflate_level);
+
+    int const nsb = get_quantize(ncvar).bits();
+    int const type = ncvar.getType().getId();
+    if (nsb >= 0 && (type == NC_FLOAT || type == NC_DOUBLE)) set_quantize(ncvar, nsb);
+
+    configure_read(ncvar);
+}
+
+NcVarConfig::Quantize const &NcVarConfig::get_quantize(netCDF::NcVar const &ncvar) const
+{
+    auto ii(var_quantize.find(ncvar.getName()));
+    return (ii != var_quantize.end() ? ii->second : quantize);
+}
+
+void NcVarConfig::configure_read(netCDF::NcVar ncvar) const
+{
+    if (cache_size == 0) return;
+    int const err = nc_set_var_chunk_cache(
+        ncvar.getParentGroup().getId(), ncvar.getId(),
+        cache_size, cache_nelems, cache_preemption);
+    if (err != NC_NOERR) (*ibmisc_error)(-1,
+        "nc_set_var_chunk_cache(%s) failed: %s",
+        ncvar.getName().c_str(), nc_strerror(err));
 }
 
 inline std::unique_ptr<NcFile> open_netcdf(std::string const &filePath, char mode, std::string const &sformat)
@@ -404,26 +546,343 @@ NcIO::NcIO(std::string const &filePath, char mode,
 {
 }
 
+/** Converts a format string to nc_create() mode flags */
+static int _sformat_to_cmode(std::string const &sformat, std::string const &filePath)
+{
+    if (sformat == "classic") return 0;
+    if (sformat == "classic64") return NC_64BIT_OFFSET;
+    if (sformat == "nc4") return NC_NETCDF4;
+    if (sformat == "nc4classic") return NC_NETCDF4 | NC_CLASSIC_MODEL;
+    (*ibmisc_error)(-1,
+        "Unknown NetCDF format %s (file %s)", sformat.c_str(), filePath.c_str());
+}
+
+static std::unique_ptr<NcGroup> open_netcdf_memory(
+    NcMemory const &mem, std::string const &filePath, char mode, std::string const &sformat)
+{
+#ifdef NC_PERSIST
+    int const persist = (mem.persist ? NC_PERSIST : 0);
+#else
+    int const persist = 0;    // Older netCDF always persists
+#endif
+    int const cmode = _sformat_to_cmode(sformat, filePath);
+
+    int ncid;
+    int err;
+    switch(mode) {
+        case 'r' :
+            err = nc_open(filePath.c_str(), NC_DISKLESS | NC_NOWRITE, &ncid);
+        break;
+        case 'a' :
+            err = nc_open(filePath.c_str(), NC_DISKLESS | NC_WRITE | persist, &ncid);
+        break;
+        case 'w' :
+        case 'x' : {
+            int const clobber = (mode == 'w' ? NC_CLOBBER : NC_NOCLOBBER);
+            err = (mem.persist ?
+                nc_create(filePath.c_str(), cmode | clobber | NC_DISKLESS | persist, &ncid)
+                : nc_create_mem(filePath.c_str(), cmode, 0, &ncid));
+        } break;
+        default :
+            (*ibmisc_error)(-1, "Illegal filemode: '%c'", mode);
+    }
+    if (err != NC_NOERR) (*ibmisc_error)(-1,
+        "Cannot open %s in memory: %s", filePath.c_str(), nc_strerror(err));
+
+    return std::unique_ptr<NcGroup>(new NcGroup(ncid));
+}
+
+NcIO::NcIO(NcMemory const &mem, std::string const &filePath, char mode,
+    std::string const &sformat,
+    std::function<void(NcVar)> const &_configure_var) :
+    _c_nc(open_netcdf_memory(mem, filePath, mode, sformat)),
+    _memio(!mem.persist && (mode == 'w' || mode == 'x')),
+    fname(filePath),
+    nc(&*_c_nc),
+    rw(_filemode_to_rw(mode)),
+    define(rw == 'w'),
+    configure_var(_configure_var)
+{
+}
+
+static std::unique_ptr<NcGroup> open_netcdf_image(
+    std::vector<char> const &image, std::string const &name)
+{
+    int ncid;
+    int const err = nc_open_mem(name.c_str(), NC_NOWRITE, image.size(),
+        const_cast<char *>(image.data()), &ncid);    // Not written with NC_NOWRITE
+    if (err != NC_NOERR) (*ibmisc_error)(-1,
+        "Cannot open NetCDF image %s (%ld bytes): %s",
+        name.c_str(), (long)image.size(), nc_strerror(err));
+    return std::unique_ptr<NcGroup>(new NcGroup(ncid));
+}
+
+NcIO::NcIO(std::vector<char> const &image, std::string const &name) :
+    _c_nc(open_netcdf_image(image, name)),
+    fname(name),
+    nc(&*_c_nc),
+    rw('r'),
+    define(false),
+    configure_var(std::bind(NcIO::default_configure_var, std::placeholders::_1))
+{
+}
+
+#ifdef USE_NETCDF_PAR
+static std::unique_ptr<NcGroup> open_netcdf_par(
+    MPI_Comm comm, std::string const &filePath, char mode, std::string const &sformat)
+{
+    if (sformat != "nc4" && sformat != "nc4classic") (*ibmisc_error)(-1,
+        "Parallel I/O needs format nc4 or nc4classic, not %s (file %s)",
+        sformat.c_str(), filePath.c_str());
+    int const cmode = _sformat_to_cmode(sformat, filePath);
+
+    int ncid;
+    int err;
+    switch(mode) {
+        case 'r' :
+            err = nc_open_par(filePath.c_str(), NC_NOWRITE, comm, MPI_INFO_NULL, &ncid);
+        break;
+        case 'a' :
+            err = nc_open_par(filePath.c_str(), NC_WRITE, comm, MPI_INFO_NULL, &ncid);
+        break;
+        case 'w' :
+            err = nc_create_par(filePath.c_str(), cmode | NC_CLOBBER, comm, MPI_INFO_NULL, &ncid);
+        break;
+        case 'x' :
+            err = nc_create_par(filePath.c_str(), cmode | NC_NOCLOBBER, comm, MPI_INFO_NULL, &ncid);
+        break;
+        default :
+            (*ibmisc_error)(-1, "Illegal filemode: '%c'", mode);
+    }
+    if (err != NC_NOERR) (*ibmisc_error)(-1,
+        "Cannot open %s for parallel I/O: %s", filePath.c_str(), nc_strerror(err));
+
+    return std::unique_ptr<NcGroup>(new NcGroup(ncid));
+}
+
+NcIO::NcIO(MPI_Comm comm, std::string const &filePath, char mode,
+    std::string const &sformat,
+    std::function<void(NcVar)> const &_configure_var) :
+    _c_nc(open_netcdf_par(comm, filePath, mode, sformat)),
+    _parallel(true),
+    fname(filePath),
+    nc(&*_c_nc),
+    rw(_filemode_to_rw(mode)),
+    define(rw == 'w'),
+    configure_var(_configure_var)
+{
+    // Reads happen right away, in ncio_blitz() etc.
+    if (rw == 'r') set_collective();
+}
+#endif
+
+void NcIO::set_collective()
+{
+#ifdef USE_NETCDF_PAR
+    int const ncid = nc->getId();
+    for (auto const &ii : nc->getVars()) {
+        int const err = nc_var_par_access(ncid, ii.second.getId(), NC_COLLECTIVE);
+        if (err != NC_NOERR) (*ibmisc_error)(-1,
+            "nc_var_par_access(%s) failed in %s: %s",
+            ii.first.c_str(), fname.c_str(), nc_strerror(err));
+    }
+#endif
+}
+
 void NcIO::add(std::string const &tag, std::function<void ()> const &fn)
 {
-    if (rw == 'r') fn();
-    else _io.push_back(TaggedThunk(fn, tag));
+    if (rw == 'r') {
+        _staging::SingleCall single(is_parallel());
+        fn();
+    } else _io.push_back(TaggedThunk(fn, tag));
 }
 
-void NcIO::flush(bool debug) {
-    for (auto ii=_io.begin(); ii != _io.end(); ++ii) {
+static void run_thunks(std::vector<TaggedThunk> &io, bool debug)
+{
+    for (auto ii=io.begin(); ii != io.end(); ++ii) {
         if (debug) printf("NcIO::flush(%s)\n", ii->tag.c_str());
         ii->fn();
     }
-    _io.clear();
-    tmp.free();
+}
+
+void NcIO::set_async(bool async)
+{
+    if (async == is_async()) return;
+    if (async && is_parallel()) (*ibmisc_error)(-1,
+        "NcIO(%s): async mode is not available with parallel I/O", fname.c_str());
+    if (async) {
+        _iothread.reset(new IOThread(1));
+    } else {
+        wait();
+        _iothread.reset();
+    }
+}
+
+void NcIO::enddef()
+{
+    if (rw != 'w' || _parallel) return;    // Parallel I/O is netCDF-4 only
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+    int const ncid = nc->getId();
+    if (_format < 0) {
+        int err = nc_inq_format(ncid, &_format);
+        if (err != NC_NOERR) (*ibmisc_error)(-1,
+            "nc_inq_format(%s) failed: %s", fname.c_str(), nc_strerror(err));
+    }
+    if (_format == NC_FORMAT_NETCDF4 || _format == NC_FORMAT_NETCDF4_CLASSIC) return;
+
+    // Alignments are netCDF-C's defaults
+    int const err = nc__enddef(ncid, header_pad, 4, 0, 4);
+    if (err != NC_NOERR && err != NC_ENOTINDEFINE) (*ibmisc_error)(-1,
+        "nc__enddef(%s) failed: %s", fname.c_str(), nc_strerror(err));
+}
+
+std::shared_future<void> NcIO::flush(bool debug) {
+    IBMISC_SCOPED_TIMER("NcIO::flush");
+    if (!_iothread) {
+        enddef();
+        // Variables defined since the last flush need collective access too
+        if (is_parallel()) set_collective();
+        _staging::SingleCall single(is_parallel());
+        run_thunks(_io, debug);
+        _io.clear();
+        tmp.free();
+
+        std::promise<void> done;
+        done.set_value();
+        return done.get_future().share();
+    }
+
+    // One flush at a time: netCDF-C is not thread-safe
+    wait();
+    enddef();
+
+    // Hand off the writes, and the data they refer to
+    std::shared_ptr<std::vector<TaggedThunk>> io(new std::vector<TaggedThunk>());
+    io->swap(_io);
+    std::shared_ptr<TmpAlloc> data(new TmpAlloc(std::move(tmp)));
+    tmp = TmpAlloc();
+
+    _last_flush = _iothread->submit([io, data, debug]{
+        std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+        run_thunks(*io, debug);
+        io->clear();
+        data->free();
+    }).share();
+    return _last_flush;
+}
+
+void NcIO::wait()
+{
+    if (!_last_flush.valid()) return;
+    std::shared_future<void> fut(std::move(_last_flush));
+    _last_flush = std::shared_future<void>();
+    try {
+        fut.get();
+    } catch(std::exception const &e) {
+        (*ibmisc_error)(-1,
+            "Background flush of %s failed: %s", fname.c_str(), e.what());
+    }
 }
 
 void NcIO::close() {
-    if (_mync.get()) {
+    if (_mync.get() || _c_nc.get()) {
         (*this)();
+        wait();
         _mync.reset();
     }
+    if (_c_nc.get()) {
+        int const err = nc_close(_c_nc->getId());
+        _c_nc.reset();
+        if (err != NC_NOERR) (*ibmisc_error)(-1,
+            "nc_close(%s) failed: %s", fname.c_str(), nc_strerror(err));
+    }
+    wait();
+    _iothread.reset();
+    clear_cache();
+}
+
+void NcIO::close(std::vector<char> &image)
+{
+    if (!_memio) (*ibmisc_error)(-1,
+        "NcIO::close(image) needs NcIO(NcMemory(), ..., 'w') (file %s)", fname.c_str());
+
+    (*this)();
+    wait();
+    NC_memio mem;
+    int const err = nc_close_memio(_c_nc->getId(), &mem);
+    _c_nc.reset();
+    _memio = false;
+    if (err != NC_NOERR) (*ibmisc_error)(-1,
+        "nc_close_memio(%s) failed: %s", fname.c_str(), nc_strerror(err));
+
+    char const *memory = (char const *)mem.memory;
+    image.assign(memory, memory + mem.size);
+    free(mem.memory);
+    close();
+}
+
+// -----------------------------------------------------
+netCDF::NcType NcIO::nc_type(std::string const &sntype)
+{
+    auto ii(_types.find(sntype));
+    if (ii != _types.end()) return ii->second;
+
+    netCDF::NcType ret(ibmisc::nc_type(*nc, sntype));
+    _types.insert(std::make_pair(sntype, ret));
+    return ret;
+}
+
+netCDF::NcVar NcIO::getVar(std::string const &vname)
+{
+    auto ii(_vars.find(vname));
+    if (ii != _vars.end()) return ii->second;
+
+    // Same as nc->getVar(vname), without listing every variable
+    int varid;
+    if (nc_inq_varid(nc->getId(), vname.c_str(), &varid) != NC_NOERR)
+        return netCDF::NcVar();
+    netCDF::NcVar ncvar(*nc, varid);
+    _vars.insert(std::make_pair(vname, ncvar));
+    return ncvar;
+}
+
+netCDF::NcDim NcIO::getDim(std::string const &dim_name)
+{
+    auto ii(_dims.find(dim_name));
+    if (ii != _dims.end()) return ii->second;
+
+    netCDF::NcDim dim(nc->getDim(dim_name));
+    if (!dim.isNull()) _dims.insert(std::make_pair(dim_name, dim));
+    return dim;
+}
+
+netCDF::NcVar NcIO::addVar(std::string const &vname,
+    netCDF::NcType const &nctype, std::vector<netCDF::NcDim> const &dims)
+{
+    netCDF::NcVar ncvar(nc->addVar(vname, nctype, dims));
+    _vars[vname] = ncvar;
+    return ncvar;
+}
+
+netCDF::NcDim NcIO::addDim(std::string const &dim_name)
+{
+    netCDF::NcDim dim(nc->addDim(dim_name));
+    _dims[dim_name] = dim;
+    return dim;
+}
+
+netCDF::NcDim NcIO::addDim(std::string const &dim_name, size_t dim_size)
+{
+    netCDF::NcDim dim(nc->addDim(dim_name, dim_size));
+    _dims[dim_name] = dim;
+    return dim;
+}
+
+void NcIO::clear_cache()
+{
+    _vars.clear();
+    _dims.clear();
+    _types.clear();
 }
 
 
@@ -431,9 +890,10 @@ void NcIO::close() {
 /** Gets or creates an unlimited size dimension */
 netCDF::NcDim get_or_add_dim(NcIO &ncio, std::string const &dim_name)
 {
+    ncio.wait();    // Not while a background flush uses the file
     bool err = false;
 
-    NcDim dim = ncio.nc->getDim(dim_name);
+    NcDim dim = ncio.getDim(dim_name);
     if (dim.isNull()){
         // The dim does NOT exist!
         if (ncio.rw == 'r') {
@@ -441,7 +901,7 @@ netCDF::NcDim get_or_add_dim(NcIO &ncio, std::string const &dim_name)
                 "Dimension %s(unlimited) needs to exist when reading (file %s)", dim_name.c_str(), ncio.fname.c_str());
         } else {
             // We're in write mode; make this dimension.
-            return ncio.nc->addDim(dim_name);
+            return ncio.addDim(dim_name);
         }
     }
 
@@ -460,7 +920,7 @@ netCDF::NcDim get_or_add_dim(NcIO &ncio, std::string const &dim_name, size_t dim
     // dim_size < 0 means "unlimited"
     if (dim_size < 0) return get_or_add_dim(ncio, dim_name);
 
-    NcDim dim = ncio.nc->getDim(dim_name);
+    NcDim dim = ncio.getDim(dim_name);
     if (dim.isNull()){
         // The dim does NOT exist!
         if (ncio.rw == 'r') {
@@ -468,7 +928,7 @@ netCDF::NcDim get_or_add_dim(NcIO &ncio, std::string const &dim_name, size_t dim
                 "Dimension %s(%s) needs to exist when reading (file %s)", dim_name.c_str(), dim_size, ncio.fname.c_str());
         } else {
             // We're in write mode; make this dimension.
-            return ncio.nc->addDim(dim_name, dim_size);
+            return ncio.addDim(dim_name, dim_size);
         }
     }
 
@@ -489,7 +949,7 @@ std::vector<netCDF::NcDim> get_dims(
     size_t RANK = sdims.size();
     std::vector<netCDF::NcDim> ret(RANK);
     for (int k=0; k<RANK; ++k) {
-        ret[k] = ncio.nc->getDim(sdims[k]);
+        ret[k] = ncio.getDim(sdims[k]);
         if (ret[k].isNull()) {
             (*ibmisc_error)(-1,
                 "Dimension %s does not exist! (file %s)", sdims[k].c_str(), ncio.fname.c_str());
@@ -541,13 +1001,14 @@ netCDF::NcVar get_or_add_var(
     std::string const &snc_type,
     std::vector<netCDF::NcDim> const &dims)
 {
+    ncio.wait();    // Not while a background flush uses the file
     netCDF::NcVar ncvar;
     if (ncio.define) {
-        ncvar = ncio.nc->getVar(vname);
+        ncvar = ncio.getVar(vname);
 
         if (ncvar.isNull()) {
-            NcType nctype(nc_type(*ncio.nc, snc_type));
-            ncvar = ncio.nc->addVar(vname, nctype, dims);
+            NcType nctype(ncio.nc_type(snc_type));
+            ncvar = ncio.addVar(vname, nctype, dims);
             ncio.configure_var(ncvar);
         } else {
             // Check dimensions match
@@ -570,14 +1031,15 @@ netCDF::NcVar get_or_add_var(
             }
         }
     } else {
-        ncvar = ncio.nc->getVar(vname);
+        ncvar = ncio.getVar(vname);
         if (ncvar.isNull()) {
             (*ibmisc_error)(-1,
                 "Variable %s required but not found (file %s)", vname.c_str(), ncio.fname.c_str());
         }
+        if (ncio.configure_read_var) ncio.configure_read_var(ncvar);
 
         // Check that types match
-        NcType spec_type(nc_type(ncvar, snc_type));
+        NcType spec_type(ncio.nc_type(snc_type));
         NcType real_type(ncvar.getType());
         if (spec_type != real_type) (*ibmisc_error)(-1,
             "On-disk type of variable %s = %s does not match specified type %s (%s) (file %s)",
@@ -19,24 +19,50 @@
 #ifndef IBMISC_NETCDF_HPP
 #define IBMISC_NETCDF_HPP
 
+#include <algorithm>
+#include <cstdlib>
 #include <typeinfo>
 #include <netcdf>
 #include <ncException.h>
 #include <boost/any.hpp>
 #include <functional>
 #include <tuple>
+#include <unordered_map>
+#include <ibmisc/quantize.hpp>
 #include <memory>
 #include <blitz/array.h>
 #include <ibmisc/ibmisc.hpp>
 #include <ibmisc/blitz.hpp>
+#include <ibmisc/blitz_alloc.hpp>
 #include <ibmisc/enum.hpp>
 #include <ibmisc/memory.hpp>
+#include <ibmisc/iothread.hpp>
+#include <ibmisc/transpose.hpp>
 #include <type_traits>
+#include <mutex>
+#include <map>
+#ifdef USE_NETCDF_PAR
+#include <mpi.h>
+#endif
 
 namespace ibmisc {
 
 extern bool netcdf_debug;
 
+/** The netCDF-C library is not thread-safe.  Code that calls it from
+more than one thread must hold this lock around every call (including
+NcIO construction and close()). */
+extern std::recursive_mutex netcdf_mutex;
+
+/** Max. size of the buffer get_or_put_var() uses to read / write
+non-contiguous arrays (eg Fortran order) with one contiguous call per
+slab, rather than an imap call. */
+extern size_t ncio_staging_bytes;
+
+/** Threads get_or_put_var() uses to copy between a non-contiguous
+array and its staging buffer (see copy_strided()) */
+extern int ncio_copy_threads;
+
 // ---------------------------------------------------
 // Convert template types to NetCDF types
 
@@ -97,11 +123,107 @@ struct TaggedThunk {
         fn(_fn), tag(_tag) {}
 };
 
+/** Compression, chunking and chunk-cache policy for NetCDF
+variables.  Pass one as NcIO's configure_var (and, for the chunk
+cache when reading, as NcIO::configure_read_var).
+
+Chunk shapes are chosen per dimension: var_chunks (by variable name)
+takes priority, then dim_chunks (by dimension name).  Otherwise an
+unlimited dimension gets chunk length 1 and a fixed dimension its full
+length --- ie, one whole field per record, which suits writing a field
+per timestep and reading single records back.  Chunks are split
+(outermost dimension first) to stay under max_chunk_bytes.
+
+float and double variables may also be quantized: trimmed to some
+precision (see bitround()) as they are written, so they deflate much
+better.  var_quantize (by variable name) takes priority over quantize.
+The precision is recorded with CF quantization attributes, which
+get_or_put_var() then follows for every write to the variable. */
+struct NcVarConfig {
+    /** Precision to keep: nsd significant decimal digits, or else nsb
+    significant mantissa bits.  Both 0 = lossless. */
+    struct Quantize {
+        int nsd;
+        int nsb;
+        Quantize(int _nsd = 0, int _nsb = 0) : nsd(_nsd), nsb(_nsb) {}
+
+        /** @return Mantissa bits to keep, or -1 for lossless */
+        int bits() const
+            { return nsb > 0 ? nsb : nsd > 0 ? nsd_to_nsb(nsd) : -1; }
+    };
+
+    bool shuffle;
+    int deflate_level;     // 0 = no compression
+    bool set_chunking;     // false = leave chunk shapes to netCDF-C
+
+    Quantize quantize;
+    std::map<std::string, Quantize> var_quantize;
+
+    std::map<std::string, size_t> dim_chunks;
+    std::map<std::string, std::vector<size_t>> var_chunks;
+    size_t max_chunk_bytes;
+
+    // Per-variable chunk cache; cache_size == 0 leaves the library default
+    size_t cache_size;     // bytes
+    size_t cache_nelems;   // hash slots
+    float cache_preemption;
+
+    NcVarConfig() : shuffle(true), deflate_level(4), set_chunking(true),
+        max_chunk_bytes(16*1024*1024),
+        cache_size(0), cache_nelems(1009), cache_preemption(.75) {}
+
+    /** No compression: writes at disk speed */
+    static NcVarConfig fast_write();
+    /** Light compression, whole-field chunks and a large cache */
+    static NcVarConfig fast_read();
+
+    /** Chunk shape this policy would use for ncvar */
+    std::vector<size_t> chunk_shape(netCDF::NcVar const &ncvar) const;
+
+    /** Configures a newly created variable */
+    void operator()(netCDF::NcVar ncvar) const;
+
+    /** Sets only the chunk cache (for variables being read) */
+    void configure_read(netCDF::NcVar ncvar) const;
+
+    /** Quantization this policy would use for ncvar */
+    Quantize const &get_quantize(netCDF::NcVar const &ncvar) const;
+};
+
+/** Marks a float or double variable to be quantized to nsb mantissa
+bits when written (see get_or_put_var()), with CF attributes:
+quantization_nsb on the variable, and a container variable
+quantization_info (algorithm = "bitround").  Call in define mode. */
+extern void set_quantize(netCDF::NcVar ncvar, int nsb);
+
+/** Selects the in-memory NcIO constructor */
+struct NcMemory {
+    bool persist;    // Write the dataset to its filename on close()
+    explicit NcMemory(bool _persist = false) : persist(_persist) {}
+};
+
 /** Used to keep track of future writes on NcDefine */
 class NcIO {
     std::vector<TaggedThunk> _io;
 
+    // Async mode (see set_async())
+    std::unique_ptr<IOThread> _iothread;
+    std::shared_future<void> _last_flush;
+
     std::unique_ptr<netCDF::NcFile> _mync;  // NcFile lacks proper move constructor
+    std::unique_ptr<netCDF::NcGroup> _c_nc;    // Root group, if opened with the netCDF C API
+    bool _parallel = false;    // _c_nc is open for parallel I/O
+    bool _memio = false;       // _c_nc was made by nc_create_mem()
+
+    /** Sets every variable to collective access (parallel mode) */
+    void set_collective();
+
+    int _format = -1;    // nc_inq_format(), once known
+
+    // Handles looked up by name (see getVar())
+    std::unordered_map<std::string, netCDF::NcVar> _vars;
+    std::unordered_map<std::string, netCDF::NcDim> _dims;
+    std::unordered_map<std::string, netCDF::NcType> _types;
 
 public:
     static void default_configure_var(netCDF::NcVar ncvar);
@@ -120,6 +242,24 @@ public:
     // Used to configure a variable after it's been created
     std::function<void(netCDF::NcVar)> const configure_var;
 
+    // If set, used to configure each variable fetched for reading
+    // (eg chunk cache; see NcVarConfig::configure_read())
+    std::function<void(netCDF::NcVar)> configure_read_var;
+
+    /** Classic and 64-bit offset files keep all definitions in a
+    header ahead of the data; defining a variable after data have been
+    written makes netCDF-C rewrite the file if the header outgrows its
+    free space.  So each flush() leaves define mode just once, before
+    the queued writes, reserving this many bytes of header space for
+    variables added later (eg by later flushes, or in mode 'a').
+    Ignored for netCDF-4 files. */
+    size_t header_pad = 64*1024;
+
+    /** Leaves define mode, reserving header_pad (classic formats
+    only).  flush() does this itself; needed only before writing
+    directly to variables, bypassing the queue. */
+    void enddef();
+
     // mode can be (see https://docs.python.org/3/library/functions.html#open)
     // 'r' 	open for reading (default)
     // 'w' 	open for writing, truncating the file first
@@ -130,14 +270,65 @@ public:
         std::function<void(netCDF::NcVar)> const &_configure_var =
             std::bind(NcIO::default_configure_var, std::placeholders::_1));
 
+#ifdef USE_NETCDF_PAR
+    /** Opens one shared file on every rank of comm, for parallel I/O
+    (NetCDF-4 over MPI-IO).  All ranks must make the same calls, in the
+    same order: defining dims and variables, and each read/write, which
+    is collective.  Each rank usually reads/writes its own hyperslab,
+    eg with ncio_blitz_partial() and Domain::nc_start().  Not
+    available in async mode.
+    @param format "nc4" or "nc4classic" */
+    NcIO(MPI_Comm comm, std::string const &filePath, char mode = 'r',
+        std::string const &format = "nc4",
+        std::function<void(netCDF::NcVar)> const &_configure_var =
+            std::bind(NcIO::default_configure_var, std::placeholders::_1));
+#endif
+
+    /** Keeps the whole dataset in memory (netCDF "diskless" mode), for
+    intermediate products read back in the same workflow.  Modes 'r'
+    and 'a' first load filePath into memory.  Nothing is written to
+    filePath unless mem.persist, in which case it is written on close().
+    In mode 'w' or 'x' without persist, close(image) hands over the
+    final dataset instead. */
+    NcIO(NcMemory const &mem, std::string const &filePath, char mode = 'w',
+        std::string const &format = "nc4",
+        std::function<void(netCDF::NcVar)> const &_configure_var =
+            std::bind(NcIO::default_configure_var, std::placeholders::_1));
+
+    /** Opens a NetCDF image held in memory (eg from close(image)), for
+    reading.  image must stay alive and unchanged until close().
+    @param name Used in error messages only */
+    explicit NcIO(std::vector<char> const &image, std::string const &name = "<memory>");
+
+    /** True if opened for parallel I/O */
+    bool is_parallel() const { return _parallel; }
+
     /** Create a "dummy" NcIO from an already-opened NetCDF file */
     NcIO(netCDF::NcGroup *_nc, char _rw) : nc(_nc), rw(_rw), define(rw=='w') {}
 
     ~NcIO() { close(); }
 
-    /** Converts a string to a NetCDF type */
-    inline netCDF::NcType nc_type(std::string sntype)
-        { return nc->getType(sntype, netCDF::NcGroup::ParentsAndCurrent); }
+    /** Converts a string to a NetCDF type (cached) */
+    netCDF::NcType nc_type(std::string const &sntype);
+
+    /** By-name lookups of variables and dimensions in nc, cached for
+    the life of the NcIO.  netcdf-cxx4 builds a multimap of the whole
+    group for each lookup, which adds up in files with thousands of
+    variables.  Return null handles if not found (which are not
+    cached).  Variables are looked up in nc only; dimensions in
+    parent groups too, like netCDF::NcGroup. */
+    netCDF::NcVar getVar(std::string const &vname);
+    netCDF::NcDim getDim(std::string const &dim_name);
+
+    /** Define new variables and dimensions, and cache them */
+    netCDF::NcVar addVar(std::string const &vname,
+        netCDF::NcType const &nctype, std::vector<netCDF::NcDim> const &dims);
+    netCDF::NcDim addDim(std::string const &dim_name);    // Unlimited
+    netCDF::NcDim addDim(std::string const &dim_name, size_t dim_size);
+
+    /** Forgets cached handles; needed only if variables or dimensions
+    are renamed or defined without going through this NcIO. */
+    void clear_cache();
 
 
     void add(std::string const &tag, std::function<void ()> const &fn);
@@ -145,11 +336,34 @@ public:
     void operator+=(std::function<void ()> const &fn)
         { add("", fn); }
 
-    void flush(bool debug=false);
+    /** In async mode, flush() hands the queued writes (and the
+    TmpAlloc holding their data) to a background I/O thread and
+    returns right away, so computation can overlap with compression
+    and filesystem latency.  Until the flush is done (see wait()):
+      a) Arrays passed by reference to ncio_blitz() etc. must stay
+         alive and unchanged.
+      b) Nothing else may call netCDF for this file; the next flush(),
+         defining new variables, and close() all wait() first. */
+    void set_async(bool async=true);
+    bool is_async() const { return (bool)_iothread; }
+
+    /** Runs all queued writes, after all variables defined since the
+    last flush() (see header_pad).
+    @return Future that is ready once they are done (immediately,
+        unless in async mode). */
+    std::shared_future<void> flush(bool debug=false);
     void operator()()
         { flush(false); }
 
+    /** Waits for the last flush().  Errors it raised on the I/O thread
+    are reported here, through ibmisc_error. */
+    void wait();
+
     void close();
+
+    /** Closes an NcIO(NcMemory, ..., 'w') and stores the final dataset
+    in image, ready for NcIO(image) or writing to disk as-is. */
+    void close(std::vector<char> &image);
 };
 // ===========================================================
 // Dimension Wrangling
@@ -333,6 +547,142 @@ void get_or_put_var(netCDF::NcVar &ncvar, char rw,
     std::vector<ptrdiff_t> const &imap,
     TypeT *dataValues);
 
+namespace _staging {
+
+/** If set, get_or_put_var() makes exactly one netCDF call per array:
+collective parallel I/O needs every rank to make the same number of
+calls, whatever the size of its part. */
+extern thread_local bool single_call;
+
+/** Sets single_call for a scope */
+class SingleCall {
+    bool const old;
+public:
+    explicit SingleCall(bool on) : old(single_call) { single_call = on; }
+    ~SingleCall() { single_call = old; }
+};
+
+/** @return Mantissa bits to keep when writing to ncvar (its
+    quantization_nsb attribute), or -1 if it is not quantized */
+extern int quantize_nsb(netCDF::NcVar const &ncvar);
+
+template<class TypeT>
+inline int write_nsb(netCDF::NcVar const &ncvar)
+    { return -1; }    // Only float and double are quantized
+
+template<>
+inline int write_nsb<float>(netCDF::NcVar const &ncvar)
+    { return quantize_nsb(ncvar); }
+
+template<>
+inline int write_nsb<double>(netCDF::NcVar const &ncvar)
+    { return quantize_nsb(ncvar); }
+
+/** Quantizes n values, about to be written to ncvar, to nsb bits;
+skipping ncvar's fill value */
+extern void quantize(netCDF::NcVar const &ncvar, int nsb, float *buf, size_t n);
+extern void quantize(netCDF::NcVar const &ncvar, int nsb, double *buf, size_t n);
+
+template<class TypeT>
+inline void quantize(netCDF::NcVar const &ncvar, int nsb, TypeT *buf, size_t n) {}
+
+/** Reads / writes a non-contiguous array through a contiguous
+staging buffer of at most ncio_staging_bytes, one slab at a time.
+Slabs are the largest blocks of the variable (in netCDF order) that
+fit.
+@param nsb If >= 0, quantize to this many bits (see write_nsb())
+    while writing. */
+template<class TypeT>
+void get_or_put_staged(netCDF::NcVar &ncvar, char rw,
+    std::vector<size_t> const &start,
+    std::vector<size_t> const &count,
+    std::vector<ptrdiff_t> const &imap,
+    TypeT *dataValues, int nsb = -1)
+{
+    int const rank = count.size();
+    size_t budget = std::max((size_t)1, ncio_staging_bytes / sizeof(TypeT));
+    if (single_call) {
+        budget = 1;
+        for (size_t n : count) budget *= n;
+    }
+
+    // Split at dimension d: one index at a time on dims [0,d), and
+    // nd at a time on dim d
+    int d = rank-1;
+    size_t inner = 1;
+    while (d > 0 && inner * count[d] <= budget) inner *= count[d--];
+    size_t const nd = std::max((size_t)1, std::min(count[d], budget / inner));
+
+    // Reused between calls; one per thread.  Bigger than the budget
+    // only for single_call, and then freed on the way out.
+    static thread_local std::unique_ptr<TypeT[]> buf;
+    static thread_local size_t buf_size = 0;
+    if (buf_size < nd * inner) {
+        buf.reset();
+        buf.reset(new TypeT[nd * inner]);
+        buf_size = nd * inner;
+    }
+    struct Trim {
+        ~Trim() {
+            if (buf_size * sizeof(TypeT) > ncio_staging_bytes) {
+                buf.reset();
+                buf_size = 0;
+            }
+        }
+    } trim;
+
+    std::vector<size_t> slab_start(start);
+    std::vector<size_t> slab_count(count);
+    for (int i=0; i<d; ++i) slab_count[i] = 1;
+
+    // C-order strides of the staging buffer (dims [0,d) have length 1)
+    std::vector<ptrdiff_t> buf_stride(rank, 0);
+    ptrdiff_t cur = 1;
+    for (int i=rank-1; i>=d; --i) {
+        buf_stride[i] = cur;
+        cur *= count[i];
+    }
+
+    std::vector<size_t> ix(d+1, 0);
+    for (;;) {
+        slab_count[d] = std::min(nd, count[d] - ix[d]);
+        ptrdiff_t off = 0;
+        for (int i=0; i<=d; ++i) {
+            slab_start[i] = start[i] + ix[i];
+            off += ix[i] * imap[i];
+        }
+
+        switch(rw) {
+            case 'r' :
+                ncvar.getVar(slab_start, slab_count, buf.get());
+                copy_strided(dataValues + off, &imap[0],
+                    (TypeT const *)buf.get(), &buf_stride[0], &slab_count[0], rank,
+                    ncio_copy_threads);
+            break;
+            case 'w' :
+                copy_strided(buf.get(), &buf_stride[0],
+                    (TypeT const *)(dataValues + off), &imap[0], &slab_count[0], rank,
+                    ncio_copy_threads);
+                if (nsb >= 0) quantize(ncvar, nsb, buf.get(), slab_count[d] * inner);
+                ncvar.putVar(slab_start, slab_count, buf.get());
+            break;
+        }
+
+        // Next slab
+        ix[d] += nd;
+        if (ix[d] < count[d]) continue;
+        ix[d] = 0;
+        int i = d-1;
+        for (; i >= 0; --i) {
+            if (++ix[i] < count[i]) break;
+            ix[i] = 0;
+        }
+        if (i < 0) break;
+    }
+}
+
+}    // namespace _staging
+
 template<class TypeT>
 void get_or_put_var(netCDF::NcVar &ncvar, char rw,
     std::vector<size_t> const &start,
@@ -343,10 +693,51 @@ void get_or_put_var(netCDF::NcVar &ncvar, char rw,
 {
     // NetCDF library is really slow if stride or count is used.
     // See if we can do without...
+    bool contiguous = true;
+    bool unit_stride = true;
+    size_t n = 1;
     ptrdiff_t cur_imap = 1;
     for (int i=imap.size()-1; i >= 0; --i) {
-        if (imap[i] != cur_imap) {
-            // Non-contiguous array; must do with full imap
+        n *= count[i];
+        if (stride[i] != 1) unit_stride = false;
+        if (count[i] == 1) continue;    // imap doesn't matter here
+        if (imap[i] != cur_imap) contiguous = false;
+        cur_imap *= count[i];
+    }
+    if (n == 0) return;
+
+    // Quantized writes go through a buffer, leaving dataValues alone
+    int const nsb = (rw == 'w' ? _staging::write_nsb<TypeT>(ncvar) : -1);
+    if (nsb >= 0) {
+        if (count.empty()) {    // Scalar
+            TypeT val(*dataValues);
+            _staging::quantize(ncvar, nsb, &val, 1);
+            ncvar.putVar(&val);
+        } else if (unit_stride) {
+            _staging::get_or_put_staged(ncvar, rw, start, count, imap, dataValues, nsb);
+        } else {
+            std::vector<TypeT> buf(n);
+            std::vector<ptrdiff_t> buf_stride(count.size());
+            ptrdiff_t cur = 1;
+            for (int i=count.size()-1; i >= 0; --i) {
+                buf_stride[i] = cur;
+                cur *= count[i];
+            }
+            copy_strided(&buf[0], &buf_stride[0],
+                (TypeT const *)dataValues, &imap[0], &count[0], count.size(),
+                ncio_copy_threads);
+            _staging::quantize(ncvar, nsb, &buf[0], n);
+            ncvar.putVar(start, count, stride, &buf[0]);
+        }
+        return;
+    }
+
+    if (!contiguous) {
+        if (unit_stride) {
+            // Pack / unpack through a contiguous buffer
+            _staging::get_or_put_staged(ncvar, rw, start, count, imap, dataValues);
+        } else {
+            // Strided in the file too; must do with full imap
             switch(rw) {
                 case 'r' :
                     ncvar.getVar(start, count, stride, imap, dataValues);
@@ -355,9 +746,8 @@ void get_or_put_var(netCDF::NcVar &ncvar, char rw,
                     ncvar.putVar(start, count, stride, imap, dataValues);
                 break;
             }
-            return;
         }
-        cur_imap *= count[i];
+        return;
     }
 
     // Contiguous array; can omit stride and imap
@@ -836,24 +1226,34 @@ namespace _ncio_blitz {
 
 template<class TypeT, int RANK>
 void nc_rw_blitz2(
-    netCDF::NcGroup *nc,
+    netCDF::NcVar ncvar,
     char rw,
     blitz::Array<TypeT, RANK> *val,
-    std::string const &vname,
     std::vector<size_t> const &nc_start,        // Where to the NetCDF variable; could have more than RANK dimensions
     std::array<int,RANK> const &b2n)    // (Blitz dim i) corresponds to (NetCDF dim b2n[i])
 ;
 
+/** Looks up vname in nc, then reads/writes it */
 template<class TypeT, int RANK>
 void nc_rw_blitz2(
     netCDF::NcGroup *nc,
     char rw,
     blitz::Array<TypeT, RANK> *val,
     std::string const &vname,
+    std::vector<size_t> const &nc_start,
+    std::array<int,RANK> const &b2n)
+{
+    nc_rw_blitz2<TypeT,RANK>(nc->getVar(vname), rw, val, nc_start, b2n);
+}
+
+template<class TypeT, int RANK>
+void nc_rw_blitz2(
+    netCDF::NcVar ncvar,
+    char rw,
+    blitz::Array<TypeT, RANK> *val,
     std::vector<size_t> const &nc_start,        // Where to the NetCDF variable; could have more than RANK dimensions
     std::array<int,RANK> const &b2n)    // (Blitz dim i) corresponds to (NetCDF dim b2n[i])
 {
-    netCDF::NcVar ncvar = nc->getVar(vname);
     int const nc_rank = ncvar.getDimCount();
 
     // Set up vectors to be used in raw NetCDF call
@@ -978,12 +1378,12 @@ netCDF::NcVar ncio_blitz(
         info.dims.push_back(
             nd.extent < 0 ?
                 // We don't know what this dim should be; hopefully it exists on disk
-                ncio.nc->getDim(nd.name)
+                ncio.getDim(nd.name)
                 // We do know what the dim should be; create or get/verify it
                 : get_or_add_dim(ncio, nd.name, nd.extent));
     }
 
-    netCDF::NcVar ncvar(ncio.nc->getVar(vname));
+    netCDF::NcVar ncvar(ncio.getVar(vname));
 
     if (info.blitz_rank() != RANK) (*ibmisc_error)(-1,
         "Rank of Info=%d must match Blitz rank=%d",
@@ -1025,8 +1425,11 @@ netCDF::NcVar ncio_blitz(
     }
 
     // const_cast allows us to re-use nc_rw_blitz for read and write
-    ncio += std::bind(&nc_rw_blitz2<TypeT, RANK>,
-        ncio.nc, ncio.rw, &arr, vname, info.nc_start, to_array<int,int,RANK>(info.b2n));
+    // Bind the handle, so flush() need not look it up again
+    void (*rw_fn)(netCDF::NcVar, char, blitz::Array<TypeT,RANK> *,
+        std::vector<size_t> const &, std::array<int,RANK> const &) = &nc_rw_blitz2<TypeT, RANK>;
+    ncio += std::bind(rw_fn,
+        ncvar, ncio.rw, &arr, info.nc_start, to_array<int,int,RANK>(info.b2n));
 
     return ncvar;
 }
@@ -1069,7 +1472,7 @@ netCDF::NcVar ncio_blitz(
     bool ncdims_in_nc_order,
     std::vector<std::string> const &arr_sdims)
 {
-    netCDF::NcVar ncvar = ncio.nc->getVar(vname);
+    netCDF::NcVar ncvar = ncio.getVar(vname);
 
     if (ncio.rw == 'r' && ncvar.isNull()) (*ibmisc_error)(-1,
         "Trying to read from non-existant NetCDF variable %s", vname.c_str());
@@ -1126,7 +1529,7 @@ netCDF::NcVar ncio_blitz_alloc(
     blitz::GeneralArrayStorage<RANK> const &storage,
     std::vector<std::string> const &arr_sdims)
 {
-    netCDF::NcVar ncvar = ncio.nc->getVar(vname);
+    netCDF::NcVar ncvar = ncio.getVar(vname);
 //    // Array in memory must (will be allocated to) have same
 //    // memory layout as on disk.
 //    DimOrderMatch const match = DimOrderMatch::MEMORY;
@@ -1146,7 +1549,7 @@ netCDF::NcVar ncio_blitz_alloc(
 
         blitz::TinyVector<int,RANK> extent;
         for (int ib=0; ib<RANK; ++ib) extent[ib] = info.blitz[ib].extent;
-        arr.reference(blitz::Array<TypeT,RANK>(extent, storage));
+        arr.reference(alloc_blitz<TypeT,RANK>(extent, storage));
     }
 
 
@@ -1182,7 +1585,7 @@ netCDF::NcVar ncio_blitz_partial(
     std::vector<int> const &b2n,    // Where to slot each Blitz++ dimension
     std::vector<std::string> const &arr_sdims)
 {
-    netCDF::NcVar ncvar = ncio.nc->getVar(vname);
+    netCDF::NcVar ncvar = ncio.getVar(vname);
     // By necessity, we must list dimensions in NetCDF order, so we know
     // where Blitz++ dimensions slot in
     bool const ncdims_in_nc_order=true;
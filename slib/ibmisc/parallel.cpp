@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/error.hpp>
+
+namespace ibmisc {
+
+// ------------------------------------------------------------
+namespace {
+
+/** @return Integer value of the first of these environment variables
+    that is set; or dflt */
+int env_int(std::vector<char const *> const &names, int dflt)
+{
+    for (char const *name : names) {
+        char const *val = getenv(name);
+        if (val && *val) return atoi(val);    // "2(x3)" (SLURM) reads as 2
+    }
+    return dflt;
+}
+
+/** MPI ranks on this node, and our index among them, as told by the
+launcher (Open MPI, MPICH / Intel MPI, SLURM).  MPI need not be
+initialized. */
+int local_ranks()
+{
+    return std::max(1, env_int({"OMPI_COMM_WORLD_LOCAL_SIZE",
+        "MPI_LOCALNRANKS", "SLURM_NTASKS_PER_NODE"}, 1));
+}
+
+int local_rank()
+{
+    return std::max(0, env_int({"OMPI_COMM_WORLD_LOCAL_RANK",
+        "MPI_LOCALRANKID", "SLURM_LOCALID"}, 0));
+}
+
+void pin_to_core(int core)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+}
+
+typedef std::function<void()> Task;
+
+/** Work-stealing scheduler behind TaskGroup.  Each worker has its own
+queue: it runs its newest task first (the one most likely still in
+cache), while idle threads steal the oldest ones (the biggest pieces
+of work, for nested parallelism).  Threads that are not workers queue
+their tasks on a shared queue. */
+class Pool {
+    struct Queue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> _queues;    // [0] is the shared queue
+    std::vector<std::thread> _threads;
+
+    std::mutex _sleep_mtx;
+    std::condition_variable _sleep_cv;
+    std::atomic<long> _nqueued;
+    bool _stop;
+
+    static thread_local Pool *tl_pool;
+    static thread_local int tl_queue;    // Our queue in tl_pool
+
+    int my_queue() const
+        { return (tl_pool == this ? tl_queue : 0); }
+
+    void work(int q, int core);
+
+public:
+    int const nthreads;
+
+    /** @param core First core to pin to; or -1 */
+    Pool(int _nthreads, int core);
+    ~Pool();
+
+    void push(Task &&task);
+
+    /** Runs one queued task, if there is any.
+    @return True if it ran one. */
+    bool run_one();
+};
+
+thread_local Pool *Pool::tl_pool = nullptr;
+thread_local int Pool::tl_queue = 0;
+
+Pool::Pool(int _nthreads, int core) : _nqueued(0), _stop(false), nthreads(_nthreads)
+{
+    // Queue q > 0 belongs to worker q; outside threads (which help
+    // while they wait) make up the last thread of the budget
+    for (int i=0; i<nthreads; ++i) _queues.push_back(
+        std::unique_ptr<Queue>(new Queue));
+    for (int q=1; q<nthreads; ++q) _threads.push_back(std::thread(
+        &Pool::work, this, q, (core < 0 ? -1 : (core + q) % hardware_threads())));
+}
+
+Pool::~Pool()
+{
+    {std::lock_guard<std::mutex> lock(_sleep_mtx);
+        _stop = true;
+    }
+    _sleep_cv.notify_all();
+    for (auto &th : _threads) th.join();
+}
+
+void Pool::push(Task &&task)
+{
+    Queue &queue(*_queues[my_queue()]);
+    {std::lock_guard<std::mutex> lock(queue.mtx);
+        queue.tasks.push_back(std::move(task));
+    }
+    ++_nqueued;
+
+    // Taking the lock orders this against a worker about to sleep
+    {std::lock_guard<std::mutex> lock(_sleep_mtx);}
+    _sleep_cv.notify_one();
+}
+
+bool Pool::run_one()
+{
+    if (_nqueued.load() == 0) return false;
+
+    int const me = my_queue();
+    Task task;
+    for (int i=0; i<(int)_queues.size() && !task; ++i) {
+        int const q = (me + i) % _queues.size();
+        Queue &queue(*_queues[q]);
+        std::lock_guard<std::mutex> lock(queue.mtx);
+        if (queue.tasks.empty()) continue;
+        if (q == me && me != 0) {    // Our own: newest first
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {                     // Steal the oldest
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+    if (!task) return false;
+
+    --_nqueued;
+    task();
+    return true;
+}
+
+void Pool::work(int q, int core)
+{
+    tl_pool = this;
+    tl_queue = q;
+    if (core >= 0) pin_to_core(core);
+
+    for (;;) {
+        if (run_one()) continue;
+        std::unique_lock<std::mutex> lock(_sleep_mtx);
+        _sleep_cv.wait(lock, [this]{ return _stop || _nqueued.load() > 0; });
+        if (_stop && _nqueued.load() == 0) return;
+    }
+}
+
+// ------------------------------------------------------------
+std::atomic<int> budget(0);    // 0 = not decided yet
+std::mutex pool_mutex;
+std::unique_ptr<Pool> the_pool;
+
+int default_budget()
+{
+    return std::max(1, env_int({"IBMISC_NUM_THREADS"},
+        hardware_threads() / local_ranks()));
+}
+
+Pool &pool()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!the_pool) the_pool.reset(new Pool(thread_budget(), -1));
+    return *the_pool;
+}
+
+}    // anonymous namespace
+
+// ------------------------------------------------------------
+void configure_threads(int nthreads, bool pin)
+{
+    int const n = (nthreads > 0 ? nthreads : default_budget());
+
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    budget = n;
+    the_pool.reset();    // Joins the old workers
+    the_pool.reset(new Pool(n, pin ? (local_rank() * n) % hardware_threads() : -1));
+}
+
+int thread_budget()
+{
+    int expected = 0;
+    budget.compare_exchange_strong(expected, default_budget());
+    return budget.load();
+}
+
+// ------------------------------------------------------------
+struct TaskGroup::State {
+    Pool *pool;
+    std::mutex mtx;
+    std::condition_variable done_cv;
+    long pending;
+
+    // Outcome of each task, in order of run()
+    std::vector<std::exception_ptr> errors;
+    std::vector<DeferredError> deferred;
+
+    State(Pool *_pool) : pool(_pool), pending(0) {}
+
+    /** Helps run queued tasks until ours are all done */
+    void join()
+    {
+        for (;;) {
+            if (pool->run_one()) continue;
+            std::unique_lock<std::mutex> lock(mtx);
+            long const n = pending;
+            if (n == 0) return;
+            done_cv.wait(lock, [this, n]{ return pending < n; });
+        }
+    }
+};
+
+TaskGroup::TaskGroup() : _state(new State(&pool())) {}
+
+TaskGroup::~TaskGroup()
+    { _state->join(); }
+
+void TaskGroup::run(std::function<void()> fn)
+{
+    std::shared_ptr<State> st(_state);
+    size_t ix;
+    {std::lock_guard<std::mutex> lock(st->mtx);
+        ix = st->errors.size();
+        st->errors.push_back(std::exception_ptr());
+        st->deferred.push_back(DeferredError());
+        ++st->pending;
+    }
+
+    st->pool->push([st, ix, fn]{
+        // Keep this thread's own deferred error (eg of the task it is
+        // waiting in) out of this task's
+        DeferredError const outer(take_deferred_error());
+        std::exception_ptr err;
+        try {
+            fn();
+        } catch(...) {
+            err = std::current_exception();
+        }
+        DeferredError const mine(take_deferred_error());
+        if (outer.set) defer_error(outer.retcode, "%s", outer.msg);
+
+        {std::lock_guard<std::mutex> lock(st->mtx);
+            st->errors[ix] = err;
+            st->deferred[ix] = mine;
+            --st->pending;
+        }
+        st->done_cv.notify_all();
+    });
+}
+
+void TaskGroup::wait()
+{
+    _state->join();
+
+    std::vector<std::exception_ptr> errors;
+    std::vector<DeferredError> deferred;
+    {std::lock_guard<std::mutex> lock(_state->mtx);
+        errors.swap(_state->errors);
+        deferred.swap(_state->deferred);
+    }
+    for (auto &err : errors) if (err) std::rethrow_exception(err);
+
+    // Pass deferred errors on to this thread; the first one is kept
+    for (auto &err : deferred) if (err.set) defer_error(err.retcode, "%s", err.msg);
+}
+
+// ------------------------------------------------------------
+void parallel_for(
+    long begin, long end, int nthreads,
+    std::function<void(long, long)> const &fn,
+    long grain)
+{
+    long const n = end - begin;
+    if (n <= 0) return;
+
+    // Don't create chunks smaller than grain
+    long const max_chunks = std::max(1L, n / std::max(1L, grain));
+    long const nchunk = std::min((long)std::max(1, nthreads), max_chunks);
+    if (nchunk <= 1) {
+        fn(begin, end);
+        return;
+    }
+
+    // Chunk i covers [begin + i*n/nchunk, begin + (i+1)*n/nchunk)
+    TaskGroup tg;
+    for (long i=0; i<nchunk; ++i) {
+        long const b = begin + (i*n)/nchunk;
+        long const e = begin + ((i+1)*n)/nchunk;
+        tg.run([&fn, b, e]{ fn(b, e); });
+    }
+    tg.wait();
+}
+
+long reduce_pieces(long n, int nthreads, ReduceMode mode, long grain)
+{
+    long const npieces = (mode == ReduceMode::REPRODUCIBLE ? reproducible_pieces : nthreads);
+    return std::max(1L, std::min(npieces, n / std::max(1L, grain)));
+}
+
+int hardware_threads()
+{
+    int const n = std::thread::hardware_concurrency();
+    return (n > 0 ? n : 1);
+}
+
+}    // namespace ibmisc
@@ -0,0 +1,128 @@
+#ifndef IBMISC_PARALLEL_HPP
+#define IBMISC_PARALLEL_HPP
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace ibmisc {
+
+/**@file All parallel code of ibmisc runs on one process-wide pool of
+worker threads, so that nested and concurrent parallel_for()s share
+the cores instead of each starting threads of their own (which
+oversubscribes nodes shared by several MPI ranks).  The pool is
+started on first use, with thread_budget() threads in all (the pool's
+workers, plus the thread waiting for the work); configure_threads()
+changes that.  Idle workers steal tasks from busy ones.
+
+Long-lived pipeline stages (IOThread, RegridStream, Fortran
+prefetching) and NcBulkReader's file workers block, so they keep
+threads of their own. */
+
+/** Sets up the shared pool; call it before any parallel work (eg
+right after MPI_Init()), not while a parallel_for() is running.
+@param nthreads Threads in all, including the caller's; <= 0 means
+    the default budget (see thread_budget()).
+@param pin Pin worker i to core (first core of this rank) + i, where
+    ranks on one node get consecutive, disjoint sets of cores.
+    Linux only; ignored elsewhere. */
+extern void configure_threads(int nthreads = 0, bool pin = false);
+
+/** @return Threads the shared pool runs on (workers + caller).  By
+    default, the environment variable IBMISC_NUM_THREADS; or else the
+    hardware threads of this node, divided among the MPI ranks on it
+    (as told by the launcher: OMPI_COMM_WORLD_LOCAL_SIZE,
+    MPI_LOCALNRANKS or SLURM_NTASKS_PER_NODE). */
+extern int thread_budget();
+
+/** A set of tasks run on the shared pool.  wait() runs queued tasks
+itself while it waits, so tasks may create (and wait for) groups of
+their own.
+
+    TaskGroup tg;
+    tg.run([&]{ ... });
+    tg.run([&]{ ... });
+    tg.wait();
+*/
+class TaskGroup {
+public:
+    struct State;
+private:
+    std::shared_ptr<State> _state;
+public:
+    TaskGroup();
+
+    /** Waits for the tasks; their errors are dropped.  Call wait()
+    first to see them. */
+    ~TaskGroup();
+
+    TaskGroup(TaskGroup const &) = delete;
+    TaskGroup &operator=(TaskGroup const &) = delete;
+
+    /** Queues fn to run on the pool */
+    void run(std::function<void()> fn);
+
+    /** Returns once all tasks run so far are done.  Re-throws the
+    exception of the first task (in order of run()) that threw one;
+    errors deferred by the tasks (defer_error()) become deferred
+    errors of the calling thread, also in order of run(). */
+    void wait();
+};
+
+/** Splits [begin, end) into (up to) nthreads contiguous chunks, and
+calls fn(chunk_begin, chunk_end) on each one, as tasks on the shared
+pool.  Returns once all chunks are done.  If nthreads <= 1 (or the
+range is too small to split), fn(begin, end) is called in the current
+thread.  Chunks depend only on nthreads, not on the pool's size; at
+most thread_budget() of them run at once.  Any exception thrown by fn
+is re-thrown here, once all chunks are done; errors deferred by fn
+(defer_error()) become deferred errors of the calling thread.
+
+@param grain Minimum number of items per chunk. */
+extern void parallel_for(
+    long begin, long end, int nthreads,
+    std::function<void(long, long)> const &fn,
+    long grain = 1);
+
+/** How parallel reductions combine their partial results.
+    FAST: one partial per thread, added in order.  The last bits of
+        the result may depend on nthreads.
+    REPRODUCIBLE: the work is split into a fixed number of pieces
+        (reproducible_pieces), whatever nthreads is, and their partials
+        are added pairwise, in a fixed order.  Results are bit-identical
+        for any nthreads (eg across restarts on different node counts). */
+enum class ReduceMode {FAST, REPRODUCIBLE};
+
+/** Number of partials in ReduceMode::REPRODUCIBLE */
+int const reproducible_pieces = 16;
+
+/** @return Number of pieces to split n items into for a parallel
+    reduction, each with at least grain items */
+extern long reduce_pieces(long n, int nthreads, ReduceMode mode, long grain = 1);
+
+/** out[i] += sum of parts[p][i] over p, for i in [0, n).  Parts are
+added pairwise, ((p0+p1) + (p2+p3)) + ..., the same way for any
+nthreads; they are overwritten in the process. */
+template<class T>
+void pairwise_reduce(std::vector<std::vector<T>> &parts, long n, T *out, int nthreads = 1)
+{
+    long const nparts = parts.size();
+    parallel_for(0, n, nthreads, [&](long i0, long i1) {
+        for (long stride=1; stride < nparts; stride *= 2) {
+            for (long p=0; p+stride < nparts; p += 2*stride) {
+                T * const dst = &parts[p][0];
+                T const * const src = &parts[p+stride][0];
+                for (long i=i0; i<i1; ++i) dst[i] += src[i];
+            }
+        }
+        if (nparts > 0) {
+            for (long i=i0; i<i1; ++i) out[i] += parts[0][i];
+        }
+    }, 1024);
+}
+
+/** @return Number of hardware threads on this machine (at least 1) */
+extern int hardware_threads();
+
+}    // namespace ibmisc
+#endif    // IBMISC_PARALLEL_HPP
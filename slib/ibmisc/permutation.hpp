@@ -1,10 +1,53 @@
+#ifndef IBMISC_PERMUTATION_HPP
+#define IBMISC_PERMUTATION_HPP
+
 #include <algorithm>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+#include <ibmisc/radix_sort.hpp>
 
 namespace ibmisc {
 
-template<class RandomIt, class IndexT, class Comp = std::less<typename RandomIt::value_type>>
-void sorted_permutation(RandomIt in0, RandomIt in1, std::vector<IndexT> &perm, Comp comp = Comp())
+namespace _permutation {
+
+template<class RandomIt, class IndexT, class Comp>
+void sort(RandomIt in0, std::vector<IndexT> &perm, Comp comp, int nthreads, std::false_type)
+{
+    std::sort(perm.begin(), perm.end(),
+        [&](IndexT a, IndexT b)
+            { return comp(in0[a], in0[b]); }
+    );
+}
+
+/** Integer keys in their natural order: radix sort a copy of the
+keys, carrying the permutation along. */
+template<class RandomIt, class IndexT, class Comp>
+void sort(RandomIt in0, std::vector<IndexT> &perm, Comp comp, int nthreads, std::true_type)
 {
+    typedef typename std::iterator_traits<RandomIt>::value_type KeyT;
+    size_t const N = perm.size();
+    if (N < _radix::min_radix) {
+        sort(in0, perm, comp, nthreads, std::false_type());
+        return;
+    }
+
+    std::vector<KeyT> keys(in0, in0 + N);
+    _radix::sort(&keys[0], &perm[0], N, nthreads);
+}
+
+}    // namespace _permutation
+
+/** Computes perm, such that in0[perm[0]], in0[perm[1]], ... is sorted.
+Integer values with the default comparison are radix sorted (see
+radix_sort.hpp); anything else goes through std::sort(). */
+template<class RandomIt, class IndexT,
+    class Comp = std::less<typename std::iterator_traits<RandomIt>::value_type>>
+void sorted_permutation(RandomIt in0, RandomIt in1, std::vector<IndexT> &perm,
+    Comp comp = Comp(), int nthreads = 1)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type ValT;
     size_t const N = in1 - in0;
     perm.clear();
     perm.reserve(N);
@@ -15,10 +58,10 @@ void sorted_permutation(RandomIt in0, RandomIt in1, std::vector<IndexT> &perm, C
         perm.push_back(i);
 
     // Sort it
-    std::sort(perm.begin(), perm.end(),
-        [&](IndexT a, IndexT b)
-            { return comp(in0[a], in0[b]); }
-    );
+    _permutation::sort(in0, perm, comp, nthreads,
+        std::integral_constant<bool, _radix::is_radix_key<ValT>::value &&
+            std::is_same<Comp, std::less<ValT>>::value>());
 }
 
 }    // namespace
+#endif    // guard
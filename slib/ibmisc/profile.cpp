@@ -0,0 +1,381 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <ibmisc/profile.hpp>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace ibmisc {
+namespace profile {
+
+std::atomic<bool> _enabled(false);
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+enum {CYCLES, INSTRUCTIONS, LLC_MISSES, NHW};
+
+/** Hardware counters of one thread, read together as a perf_event
+group.  Counts user-space only, which needs no privileges. */
+class HwGroup {
+    int fds[NHW];
+public:
+    int state = 0;    // 0 = not opened yet; 1 = open; -1 = unavailable
+
+    HwGroup() { for (int &fd : fds) fd = -1; }
+    ~HwGroup() { close(); }
+
+    bool open();
+    void close();
+
+    /** @return False if the counters could not be read */
+    bool read(uint64_t *vals) const;
+};
+
+#ifdef __linux__
+bool HwGroup::open()
+{
+    uint64_t const configs[NHW] = {PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    for (int i=0; i<NHW; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+            i == 0 ? -1 : fds[0], 0);
+        if (fds[i] < 0) {
+            close();
+            state = -1;
+            return false;
+        }
+    }
+    state = 1;
+    return true;
+}
+
+void HwGroup::close()
+{
+    for (int &fd : fds) {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+}
+
+bool HwGroup::read(uint64_t *vals) const
+{
+    struct { uint64_t nr; uint64_t vals[NHW]; } buf;
+    if (::read(fds[0], &buf, sizeof(buf)) != sizeof(buf)) return false;
+    for (int i=0; i<NHW; ++i) vals[i] = buf.vals[i];
+    return true;
+}
+#else
+bool HwGroup::open() { state = -1; return false; }
+void HwGroup::close() {}
+bool HwGroup::read(uint64_t *vals) const { return false; }
+#endif
+
+struct Frame {
+    char const *name;
+    Clock::time_point t0;
+    double child_s;    // Time in nested regions
+    long nnz;          // Declared with work(), including nested regions
+    bool has_hw;
+    uint64_t hw0[NHW];
+};
+
+/** Region stack of the current thread */
+struct ThreadState {
+    int tid;
+    std::vector<Frame> stack;
+    HwGroup hw;
+};
+
+struct Event {
+    char const *name;
+    int tid;
+    double ts_us, dur_us;
+};
+
+struct Stats {
+    int depth = 0;
+    long calls = 0;
+    double total_s = 0, self_s = 0, max_s = 0;
+    long hw_calls = 0;
+    double hw_s = 0;
+    uint64_t hw[NHW] = {};
+    long nnz = 0;
+};
+
+std::mutex mutex;    // Protects everything below
+std::map<std::string, Stats> stats;
+std::map<std::string, long> counts;
+std::vector<Event> events;
+bool trace = false;
+Clock::time_point epoch(Clock::now());
+
+std::atomic<int> next_tid(0);
+std::atomic<bool> hw_enabled(false);
+
+ThreadState &thread_state()
+{
+    static thread_local ThreadState state {next_tid++, {}, {}};
+    return state;
+}
+
+void write_string(std::ostream &os, std::string const &str)
+{
+    os << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') os << '\\';
+        os << c;
+    }
+    os << '"';
+}
+
+}    // anonymous namespace
+
+void enable(bool on, bool _trace)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    trace = on && _trace;
+    _enabled = on;
+}
+
+bool enable_hw_counters(bool on)
+{
+    if (!on) {
+        hw_enabled = false;
+        return false;
+    }
+
+    // Try this thread's counters, to see whether we have any
+    HwGroup &hw(thread_state().hw);
+    if (hw.state == 0) hw.open();
+    hw_enabled = (hw.state > 0);
+    return hw_enabled;
+}
+
+void reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.clear();
+    counts.clear();
+    events.clear();
+    epoch = Clock::now();
+}
+
+void ScopedTimer::start(char const *name)
+{
+    ThreadState &state(thread_state());
+    state.stack.push_back(Frame{name, Clock::time_point(), 0., 0, false, {}});
+    Frame &frame(state.stack.back());
+
+    if (hw_enabled.load(std::memory_order_relaxed)) {
+        if (state.hw.state == 0) state.hw.open();
+        frame.has_hw = (state.hw.state > 0 && state.hw.read(frame.hw0));
+    }
+    frame.t0 = Clock::now();
+}
+
+void ScopedTimer::stop()
+{
+    auto const t1 = Clock::now();
+    ThreadState &state(thread_state());
+    Frame const frame(state.stack.back());
+    double const dur = std::chrono::duration<double>(t1 - frame.t0).count();
+
+    uint64_t hw1[NHW];
+    bool const has_hw = frame.has_hw && state.hw.read(hw1);
+
+    std::string path;
+    for (auto const &f : state.stack) {
+        if (!path.empty()) path += '/';
+        path += f.name;
+    }
+    int const depth = state.stack.size() - 1;
+    state.stack.pop_back();
+    if (!state.stack.empty()) {
+        state.stack.back().child_s += dur;
+        state.stack.back().nnz += frame.nnz;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats &st(stats[path]);
+    st.depth = depth;
+    ++st.calls;
+    st.total_s += dur;
+    st.self_s += dur - frame.child_s;
+    st.max_s = std::max(st.max_s, dur);
+    st.nnz += frame.nnz;
+    if (has_hw) {
+        ++st.hw_calls;
+        st.hw_s += dur;
+        for (int i=0; i<NHW; ++i) st.hw[i] += hw1[i] - frame.hw0[i];
+    }
+
+    if (trace && events.size() < max_events) {
+        double const ts = std::chrono::duration<double,std::micro>(frame.t0 - epoch).count();
+        events.push_back(Event{frame.name, state.tid, ts, dur * 1e6});
+    }
+}
+
+void _work(long nnz)
+{
+    ThreadState &state(thread_state());
+    if (!state.stack.empty()) state.stack.back().nnz += nnz;
+}
+
+void _count(char const *name, long n)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    counts[name] += n;
+}
+
+std::vector<RegionStats> regions()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<RegionStats> ret;
+    for (auto const &ii : stats) {
+        Stats const &st(ii.second);
+        ret.push_back(RegionStats{ii.first, st.depth, st.calls, st.total_s, st.self_s, st.max_s,
+            st.hw_calls, st.hw_s, (long)st.hw[CYCLES], (long)st.hw[INSTRUCTIONS],
+            (long)st.hw[LLC_MISSES], st.nnz});
+    }
+
+    // Compare paths component by component, so children follow parents
+    auto key = [](std::string path) {
+        std::replace(path.begin(), path.end(), '/', '\001');
+        return path;
+    };
+    std::sort(ret.begin(), ret.end(),
+        [&](RegionStats const &a, RegionStats const &b)
+            { return key(a.path) < key(b.path); });
+    return ret;
+}
+
+std::map<std::string, long> counters()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counts;
+}
+
+void report(std::ostream &os)
+{
+    char buf[512];
+    auto const regs(regions());
+    bool counted = false;
+    os << "       calls      total_s       self_s        max_s  region\n";
+    for (auto const &reg : regs) {
+        std::string const leaf(reg.path.substr(reg.path.rfind('/') + 1));
+        snprintf(buf, sizeof(buf), "%12ld %12.6f %12.6f %12.6f  %*s%s\n",
+            reg.calls, reg.total_s, reg.self_s, reg.max_s,
+            2*reg.depth, "", leaf.c_str());
+        os << buf;
+        counted = counted || reg.hw_calls > 0;
+    }
+
+    if (counted) {
+        os << "      cycles instructions    IPC   LLC_misses mem_GB/s"
+            "          nnz   B/nnz cyc/nnz  region\n";
+        for (auto const &reg : regs) {
+            if (reg.hw_calls == 0) continue;
+            std::string const leaf(reg.path.substr(reg.path.rfind('/') + 1));
+            snprintf(buf, sizeof(buf),
+                "%12ld %12ld %6.2f %12ld %8.3f %12ld %7.2f %7.2f  %*s%s\n",
+                reg.cycles, reg.instructions, reg.ipc(), reg.llc_misses,
+                reg.mem_gbps(), reg.nnz, reg.bytes_per_nnz(), reg.cycles_per_nnz(),
+                2*reg.depth, "", leaf.c_str());
+            os << buf;
+        }
+    }
+
+    auto const cnts(counters());
+    if (cnts.empty()) return;
+    os << "       count  counter\n";
+    for (auto const &ii : cnts) {
+        snprintf(buf, sizeof(buf), "%12ld  %s\n", ii.second, ii.first.c_str());
+        os << buf;
+    }
+}
+
+void write_json(std::ostream &os)
+{
+    os << "{\"regions\": [";
+    bool first = true;
+    for (auto const &reg : regions()) {
+        os << (first ? "\n" : ",\n") << "  {\"path\": ";
+        write_string(os, reg.path);
+        os << ", \"calls\": " << reg.calls
+            << ", \"total_s\": " << reg.total_s
+            << ", \"self_s\": " << reg.self_s
+            << ", \"max_s\": " << reg.max_s;
+        if (reg.nnz) os << ", \"nnz\": " << reg.nnz;
+        if (reg.hw_calls) {
+            os << ", \"hw_calls\": " << reg.hw_calls
+                << ", \"cycles\": " << reg.cycles
+                << ", \"instructions\": " << reg.instructions
+                << ", \"llc_misses\": " << reg.llc_misses
+                << ", \"ipc\": " << reg.ipc()
+                << ", \"mem_gbps\": " << reg.mem_gbps();
+        }
+        os << "}";
+        first = false;
+    }
+    os << "],\n \"counters\": {";
+    first = true;
+    for (auto const &ii : counters()) {
+        os << (first ? "\n  " : ",\n  ");
+        write_string(os, ii.first);
+        os << ": " << ii.second;
+        first = false;
+    }
+    os << "}}\n";
+}
+
+void write_chrome_trace(std::ostream &os)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    os << "{\"traceEvents\": [";
+    for (size_t i=0; i<events.size(); ++i) {
+        Event const &ev(events[i]);
+        os << (i == 0 ? "\n" : ",\n") << "  {\"name\": ";
+        write_string(os, ev.name);
+        os << ", \"ph\": \"X\", \"pid\": 0, \"tid\": " << ev.tid
+            << ", \"ts\": " << ev.ts_us << ", \"dur\": " << ev.dur_us << "}";
+    }
+    os << "]}\n";
+}
+
+}}    // namespace
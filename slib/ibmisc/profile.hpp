@@ -0,0 +1,169 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IBMISC_PROFILE_HPP
+#define IBMISC_PROFILE_HPP
+
+#include <atomic>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ibmisc {
+
+/** Scoped timers and counters, for finding where time goes in
+production runs.
+
+Regions nest: a timer started while another is running (in the same
+thread) is recorded under "outer/inner".  Each thread has its own
+stack of regions; totals are shared.  Everything is off until
+enable() is called, and costs one relaxed atomic load per timer while
+off.  Compiling with IBMISC_NO_PROFILE removes the timers altogether.
+
+Region and counter names must be string literals (or otherwise live
+forever): only the pointer is kept while timing.
+
+With enable_hw_counters(), regions also count CPU cycles, instructions
+and last-level cache misses (Linux perf_event); and kernels declare
+the non-zeros they process with work().  report() then shows IPC and
+memory bandwidth, to tell compute-bound regions from memory-bound
+ones.  Counters follow the thread that runs the region: work done by
+parallel_for() workers is not included, so measure kernels with
+nthreads=1 (or give the workers regions of their own). */
+namespace profile {
+
+extern std::atomic<bool> _enabled;
+
+inline bool enabled()
+    { return _enabled.load(std::memory_order_relaxed); }
+
+/** Turns timing on or off.
+@param trace Also record every region instance, for
+    write_chrome_trace(); at most max_events are kept. */
+void enable(bool on = true, bool trace = false);
+
+/** Turns hardware counters on or off, for regions started from now
+on.  Needs Linux, and hardware counters visible to this process (they
+are often missing in VMs and containers; and see
+/proc/sys/kernel/perf_event_paranoid).
+@return True if counters are available; if not, regions are only
+    timed. */
+bool enable_hw_counters(bool on = true);
+
+/** Forgets everything recorded so far */
+void reset();
+
+/** Max. events kept for write_chrome_trace() */
+size_t const max_events = 1 << 20;
+
+/** Times the enclosing scope, as a region called name. */
+class ScopedTimer {
+    bool const active;
+    void start(char const *name);
+    void stop();
+public:
+    explicit ScopedTimer(char const *name) : active(enabled())
+        { if (active) start(name); }
+    ~ScopedTimer()
+        { if (active) stop(); }
+
+    ScopedTimer(ScopedTimer const &) = delete;
+    void operator=(ScopedTimer const &) = delete;
+};
+
+void _count(char const *name, long n);
+
+/** Adds n to a named counter */
+inline void count(char const *name, long n = 1)
+    { if (enabled()) _count(name, n); }
+
+void _work(long nnz);
+
+/** Declares that the innermost running region (of this thread)
+processed nnz non-zeros; included in its parents' totals too. */
+inline void work(long nnz)
+    { if (enabled()) _work(nnz); }
+
+/** Assumed bytes moved per last-level cache miss */
+int const cache_line = 64;
+
+/** Totals for one region, by full path */
+struct RegionStats {
+    std::string path;    // eg "apply_M/consolidate"
+    int depth;           // Number of enclosing regions
+    long calls;
+    double total_s;      // Wall time, summed over calls (and threads)
+    double self_s;       // total_s, less time in nested regions
+    double max_s;        // Longest single call
+
+    // Hardware counters (see enable_hw_counters()), summed over the
+    // hw_calls calls that were counted; and declared work()
+    long hw_calls;
+    double hw_s;         // total_s of those calls
+    long cycles, instructions, llc_misses;
+    long nnz;
+
+    double ipc() const
+        { return cycles ? (double)instructions / cycles : 0; }
+
+    /** Estimated from LLC misses */
+    double mem_bytes() const
+        { return (double)llc_misses * cache_line; }
+    double mem_gbps() const
+        { return hw_s > 0 ? mem_bytes() / hw_s * 1e-9 : 0; }
+
+    /** Per non-zero, over the counted calls */
+    double bytes_per_nnz() const
+        { return nnz && hw_calls ? mem_bytes() / nnz * ((double)calls / hw_calls) : 0; }
+    double cycles_per_nnz() const
+        { return nnz && hw_calls ? (double)cycles / nnz * ((double)calls / hw_calls) : 0; }
+};
+
+/** Recorded regions, sorted by path (so children follow parents) */
+std::vector<RegionStats> regions();
+
+/** Recorded counters */
+std::map<std::string, long> counters();
+
+/** Writes regions and counters as a table; and, if any regions were
+counted, their hardware counters and derived metrics */
+void report(std::ostream &os);
+
+/** Writes regions and counters as a JSON object:
+{"regions": [{"path":..., "calls":..., ...}], "counters": {...}} */
+void write_json(std::ostream &os);
+
+/** Writes recorded events (see enable()) in the Chrome trace event
+format; load the file in chrome://tracing or Perfetto. */
+void write_chrome_trace(std::ostream &os);
+
+}}    // namespace
+
+#define IBMISC_PROFILE_CAT2(a,b) a##b
+#define IBMISC_PROFILE_CAT(a,b) IBMISC_PROFILE_CAT2(a,b)
+
+#ifdef IBMISC_NO_PROFILE
+#define IBMISC_SCOPED_TIMER(name)
+#else
+/** Times the rest of the enclosing scope */
+#define IBMISC_SCOPED_TIMER(name) \
+    ibmisc::profile::ScopedTimer IBMISC_PROFILE_CAT(_ibmisc_timer_, __LINE__)(name)
+#endif
+
+#endif    // guard
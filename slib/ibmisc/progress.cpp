@@ -0,0 +1,20 @@
+#include <ibmisc/progress.hpp>
+
+namespace ibmisc {
+
+progress_fn_ptr ibmisc_progress = 0;
+
+Progress::Progress(char const *_what, long _total)
+    : what(_what), total(_total), done(0)
+{
+    if (ibmisc_progress) (*ibmisc_progress)(what, 0, total);
+}
+
+void Progress::add(long n)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    done += n;
+    if (ibmisc_progress) (*ibmisc_progress)(what, done, total);
+}
+
+}    // namespace ibmisc
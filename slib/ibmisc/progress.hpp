@@ -0,0 +1,33 @@
+#ifndef IBMISC_PROGRESS_HPP
+#define IBMISC_PROGRESS_HPP
+
+#include <mutex>
+
+namespace ibmisc {
+
+/** Receives progress reports from long-running operations (eg
+linear::compress()), as units of work done out of total.  Called once
+with done == 0, and once with done == total when the operation
+finishes.  Calls are serialized, but may come from any thread. */
+typedef void (*progress_fn_ptr)(char const *what, long done, long total);
+
+/** Where progress reports go.  NULL (the default) ignores them. */
+extern progress_fn_ptr ibmisc_progress;
+
+/** Counts units of work done by one operation, reporting each step
+to ibmisc_progress.  Thread-safe. */
+class Progress {
+    char const * const what;
+    long const total;
+    long done;
+    std::mutex mutex;
+
+public:
+    Progress(char const *_what, long _total);
+
+    /** Records n more units done */
+    void add(long n);
+};
+
+}    // namespace ibmisc
+#endif    // guard
@@ -0,0 +1,73 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IBMISC_QUANTIZE_HPP
+#define IBMISC_QUANTIZE_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/** Lossy precision trimming of floating point data (BitRound, Klöwer
+et al 2021): mantissa bits below the ones that matter are rounded away
+and zeroed, so the data compress much better. */
+namespace ibmisc {
+
+/** @return Number of explicit mantissa bits that keep nsd significant
+    decimal digits */
+inline int nsd_to_nsb(int nsd)
+    { return (int)std::ceil(nsd * 3.3219280948873623); }    // log2(10)
+
+namespace _quantize {
+
+template<class FloatT, class UIntT, int MANT_BITS, UIntT EXP_MASK>
+inline void bitround(FloatT *data, size_t n, int nsb, FloatT fill_value)
+{
+    if (nsb >= MANT_BITS) return;
+    int const drop = MANT_BITS - (nsb < 1 ? 1 : nsb);
+    UIntT const mask = ~((UIntT(1) << drop) - 1);
+    UIntT const half_minus_1 = (UIntT(1) << (drop-1)) - 1;
+    UIntT fill;
+    memcpy(&fill, &fill_value, sizeof(fill));
+
+    // Branch-free, so the loop vectorizes
+    for (size_t i=0; i<n; ++i) {
+        UIntT u;
+        memcpy(&u, &data[i], sizeof(u));
+        // Round half to even
+        UIntT const r = (u + half_minus_1 + ((u >> drop) & 1)) & mask;
+        bool const keep = ((u & EXP_MASK) == EXP_MASK) | (u == fill);    // Inf, NaN, fill
+        u = (keep ? u : r);
+        memcpy(&data[i], &u, sizeof(u));
+    }
+}
+
+}    // namespace ibmisc::_quantize
+
+/** Rounds (half to even) each value to nsb explicit mantissa bits,
+and zeros the rest.  Inf, NaN and fill_value are left alone.
+@param nsb Bits to keep; at least 1 is kept */
+inline void bitround(float *data, size_t n, int nsb, float fill_value)
+    { _quantize::bitround<float, uint32_t, 23, 0x7f800000u>(data, n, nsb, fill_value); }
+
+inline void bitround(double *data, size_t n, int nsb, double fill_value)
+    { _quantize::bitround<double, uint64_t, 52, 0x7ff0000000000000ull>(data, n, nsb, fill_value); }
+
+}    // namespace ibmisc
+#endif    // guard
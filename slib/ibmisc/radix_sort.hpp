@@ -0,0 +1,154 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IBMISC_RADIX_SORT_HPP
+#define IBMISC_RADIX_SORT_HPP
+
+#include <algorithm>
+#include <array>
+#include <type_traits>
+#include <vector>
+#include <ibmisc/parallel.hpp>
+
+namespace ibmisc {
+
+namespace _radix {
+
+/** Below this many keys, std::sort() wins */
+size_t const min_radix = 256;
+
+/** Minimum number of keys per thread */
+size_t const min_grain = (size_t)1 << 16;
+
+template<class KeyT>
+struct is_radix_key : public std::integral_constant<bool,
+    std::is_integral<KeyT>::value && !std::is_same<KeyT,bool>::value> {};
+
+/** Maps a key to an unsigned one with the same order: flips the sign
+bit of signed types. */
+template<class KeyT>
+inline typename std::make_unsigned<KeyT>::type ukey(KeyT k)
+{
+    typedef typename std::make_unsigned<KeyT>::type UKeyT;
+    UKeyT const sign = (std::is_signed<KeyT>::value
+        ? (UKeyT)((UKeyT)1 << (8*sizeof(KeyT)-1)) : (UKeyT)0);
+    return (UKeyT)((UKeyT)k ^ sign);
+}
+
+template<class KeyT>
+inline unsigned digit(KeyT k, int shift)
+    { return (unsigned)((ukey(k) >> shift) & 0xff); }
+
+/** Stable LSD radix sort of keys[0..n), one byte per pass.  If
+payload is not null, payload[i] is moved along with keys[i].  Passes
+in which every key has the same digit are skipped. */
+template<class KeyT, class PayloadT>
+void sort(KeyT *keys, PayloadT *payload, size_t n, int nthreads)
+{
+    typedef std::array<size_t,256> HistT;
+
+    long const nchunk = std::max(1L,
+        std::min((long)nthreads, (long)(n / min_grain)));
+    auto chunk0 = [&](long c) -> size_t { return n * c / nchunk; };
+
+    std::vector<KeyT> kbuf(n);
+    std::vector<PayloadT> pbuf(payload ? n : 0);
+    KeyT *ksrc = keys;
+    KeyT *kdst = &kbuf[0];
+    PayloadT *psrc = payload;
+    PayloadT *pdst = (payload ? &pbuf[0] : nullptr);
+
+    std::vector<HistT> hist(nchunk);
+    for (int shift=0; shift < 8*(int)sizeof(KeyT); shift += 8) {
+
+        // Per-chunk histograms of this digit
+        parallel_for(0, nchunk, nchunk, [&](long c0, long c1) {
+            for (long c=c0; c<c1; ++c) {
+                HistT &h(hist[c]);
+                h.fill(0);
+                for (size_t i=chunk0(c); i<chunk0(c+1); ++i) ++h[digit(ksrc[i], shift)];
+            }
+        });
+
+        // Turn them into starting offsets: digit-major, then chunk
+        bool trivial = false;
+        size_t offset = 0;
+        for (int d=0; d<256; ++d) {
+            size_t total = 0;
+            for (long c=0; c<nchunk; ++c) {
+                size_t const count = hist[c][d];
+                hist[c][d] = offset;
+                offset += count;
+                total += count;
+            }
+            if (total == n) trivial = true;
+        }
+        if (trivial) continue;
+
+        // Scatter; each chunk writes its own slots, so this is stable
+        parallel_for(0, nchunk, nchunk, [&](long c0, long c1) {
+            for (long c=c0; c<c1; ++c) {
+                HistT &h(hist[c]);
+                for (size_t i=chunk0(c); i<chunk0(c+1); ++i) {
+                    size_t const j = h[digit(ksrc[i], shift)]++;
+                    kdst[j] = ksrc[i];
+                    if (psrc) pdst[j] = psrc[i];
+                }
+            }
+        });
+        std::swap(ksrc, kdst);
+        std::swap(psrc, pdst);
+    }
+
+    if (ksrc != keys) {
+        std::copy(ksrc, ksrc+n, keys);
+        if (payload) std::copy(psrc, psrc+n, payload);
+    }
+}
+
+template<class T>
+void fast_sort(std::vector<T> &vec, int nthreads, std::true_type)
+{
+    if (vec.size() < min_radix) std::sort(vec.begin(), vec.end());
+    else sort(&vec[0], (char *)nullptr, vec.size(), nthreads);
+}
+
+template<class T>
+void fast_sort(std::vector<T> &vec, int nthreads, std::false_type)
+    { std::sort(vec.begin(), vec.end()); }
+
+}    // namespace _radix
+
+/** Sorts a vector of integer keys with an LSD radix sort: linear
+time, and parallel over nthreads when there are enough keys. */
+template<class KeyT>
+void radix_sort(std::vector<KeyT> &keys, int nthreads = 1)
+{
+    static_assert(_radix::is_radix_key<KeyT>::value,
+        "radix_sort() needs integer keys");
+    if (keys.size() > 0) _radix::sort(&keys[0], (char *)nullptr, keys.size(), nthreads);
+}
+
+/** Sorts vec in ascending order: radix_sort() for integer types,
+std::sort() for everything else (and for short vectors). */
+template<class T>
+void fast_sort(std::vector<T> &vec, int nthreads = 1)
+    { _radix::fast_sort(vec, nthreads, _radix::is_radix_key<T>()); }
+
+}    // namespace
+#endif    // guard
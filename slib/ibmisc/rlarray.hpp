@@ -1,230 +1,246 @@
 #ifndef IBMISC_RLARRAY_HPP
 #define IBMISC_RLARRAY_HPP
 
-#include <cmath>
-#include <blitz/array.h>
-#include <spsparse/vector.hpp>
+#include <array>
+#include <vector>
 #include <spsparse/runlength.hpp>
-#include <spsparse/sparsearray.hpp>
 #include <ibmisc/netcdf.hpp>
 #include <ibmisc/stdio.hpp>
 
 namespace ibmisc {
 
-// ---------------------------------------------------------
-// Yields an integer type, of the same size as the template type
+// ======================================================================
 
+/** One run-length encoded column of an RLArray: counts[r] copies of
+values[r] (or, for RLAlgo::DIFFS, of the difference from the previous
+element). */
 template<class TypeT>
-struct ToIntType {
-    typedef TypeT int_type;
-};
-
-template<>
-struct ToIntType<float>
-{
-    typedef uint32_t int_type;
-};
+struct RLColumn {
+    spsparse::RLAlgo algo;
+    std::vector<int> counts;
+    std::vector<TypeT> values;
 
-template<>
-struct ToIntType<double>
-{
-    typedef uint64_t int_type;
-};
-// ---------------------------------------------------------
+    RLColumn(spsparse::RLAlgo _algo = spsparse::RLAlgo::PLAIN) : algo(_algo) {}
 
+    void clear()
+    {
+        counts.clear();
+        values.clear();
+    }
 
+    /** Number of runs */
+    size_t nruns() const
+        { return counts.size(); }
 
-template<class ValueT, int RANK>
-class ZVector_Vaccum_Int {
-public:
-    typedef ValueT val_type;
+    /** Decodes the whole column at once (see rl_decode_bulk()) */
+    void decode(std::vector<TypeT> &out) const
+    {
+        out.resize(spsparse::rl_decoded_size(counts.data(), counts.size()));
+        spsparse::rl_decode_bulk(counts.data(), values.data(), counts.size(),
+            out.data(), algo);
+    }
 
-private:
-    typedef ToIntType<ValueT> int_type;
+    void ncio(NcIO &ncio, std::string const &vname,
+        std::string const &snc_type = get_nc_type<TypeT>());
+};
 
-    std::vector<char> &zbuf;
-    RLAlgo algo;
-    std::array<ValueT,RANK> last_raws;
+template<class TypeT>
+void RLColumn<TypeT>::
+    ncio(NcIO &ncio, std::string const &vname, std::string const &snc_type)
+    {
+        auto dims(get_or_add_dims(ncio, counts, {vname + ".rlsize"}));    // size ignored on read
+        ncio_vector(ncio, counts, true, vname + ".counts", "int", dims);
+        ncio_vector(ncio, values, true, vname + ".values", snc_type, dims);
+    }
 
-    basic_ovectorstream<std::vector<char>> os;
-    zstr::ostream zos;
+// ----------------------------------------------------------------------
+/** Online encoder for one RLColumn.  Runs are appended to the column
+as they end; the last one on flush(). */
+template<class TypeT>
+class RLColumn_Encoder {
+    RLColumn<TypeT> *col;
+    spsparse::DefaultRLEqual<TypeT> eq;
+    TypeT last_raw;     // Used only for difference encoding
+    TypeT run_val;
+    int count;
 
 public:
-    ZVector_Accum((std::vector<char> &_zbuf, RLAlgo _algo)
-        : zbuf(_zbuf),
-        algo(_algo),
-        os(std::ios_base::out | std::ios_base::binary),
-        zos(os)
-    {
-        // Write the algo to the stream!
-        int ialgo = boost::endian::native_to_big(algo.index());
-        zos.write(&ialgo, sizeof(ialgo);
+    RLColumn_Encoder(RLColumn<TypeT> &_col)
+        : col(&_col), last_raw(0), run_val(0), count(0) {}
 
-        for (int i=0; i<RANK; ++i) last_raws[i] = 0;
-    }
+    RLColumn_Encoder(RLColumn_Encoder const &) = delete;
+    RLColumn_Encoder(RLColumn_Encoder &&other)
+        : col(other.col), last_raw(other.last_raw), run_val(other.run_val), count(other.count)
+        { other.count = 0; }
 
-    void add(std::array<ValueT,RANK> const &raws)
+    void add(TypeT raw)
     {
-        std::array<ValueT,RANK> vals;
-        int_type * const ivals((int_type *)&vals[0]);    // Alternative view into vals
-
-        switch(algo.index()) {
-            case RLAlgo::PLAIN :
-                for (int i=0; i<RANK; ++i) {
-                    ivals[i] = boost::endian::native_to_big(*(int_type *)&raws[i]);
-                }
-            break;
-            case RLAlgo::DIFFS :
-                for (int i=0; i<RANK; ++i) {
-                    vals[i] = raws[i] - last_raws[i];
-                    boost::endian::native_to_big_inplace(ivals[i]);
-                    last_raws[i] = raws[i]
-                }
-            break;
+        TypeT const val = (col->algo.index() == spsparse::RLAlgo::DIFFS ? TypeT(raw - last_raw) : raw);
+        last_raw = raw;
+        if (count > 0 && eq(val, run_val)) {
+            ++count;
+        } else {
+            flush();
+            run_val = val;
+            count = 1;
         }
-        zos.write(ivals, sizeof(int_type)*RANK);
     }
 
-    ~ZVector_Accum()
+    void flush()
     {
-        // Make output available to the user
-        os.swap_vector(zbuf);
+        if (count == 0) return;
+        col->counts.push_back(count);
+        col->values.push_back(run_val);
+        count = 0;
     }
 };
 
-// --------------------------------------------------------------------------
-template<class ValueT, int RANK>
-class ZVector_Generator {
-    typedef ValueT val_type;
+// ----------------------------------------------------------------------
+/** Online decoder for one RLColumn */
+template<class TypeT>
+class RLColumn_Decoder {
+    RLColumn<TypeT> const *col;
+    size_t run;     // Next run to read
+    int left;       // Elements left in the current run
+    TypeT val;      // Value of the current run
+    TypeT cur;      // Current decoded value
 
-private:
-    typedef ToIntType<ValueT> int_type;
+public:
+    RLColumn_Decoder(RLColumn<TypeT> const &_col)
+        : col(&_col), run(0), left(0), val(0), cur(0) {}
 
-    std::vector<char> &zbuf;
+    bool operator++()
+    {
+        while (left == 0) {
+            if (run == col->counts.size()) return false;
+            left = col->counts[run];
+            val = col->values[run];
+            ++run;
+        }
+        --left;
+        cur = (col->algo.index() == spsparse::RLAlgo::DIFFS ? TypeT(cur + val) : val);
+        return true;
+    }
 
-    // Read buffer
-    std::array<ValueT,RANK> vals;
-    int_type * const ivals((int_type *)&vals[0]);    // Alternative view into vals
+    TypeT const &operator*() const
+        { return cur; }
+};
 
-    std::array<ValueT,RANK> cur_raws;
-    RLAlgo algo;
+// ======================================================================
+template<class IndexT, class ValueT, int RANK>
+class RLArray;
 
-    basic_ivectorstream<std::vector<char>> is;
-    zstr::istream zis;
+/** Output is flushed once the RLArray_Accum object is destroyed. */
+template<class IndexT, class ValueT, int RANK>
+class RLArray_Accum {
+public:
+    typedef ValueT val_type;
+    typedef IndexT index_type;
+    static int const rank = RANK;
 
-    ZVector_Generator()
-    {
-        for (int i=0; i<RANK; ++i) cur_raws[i] = 0;
-    }
+private:
+    RLArray<IndexT,ValueT,RANK> *arr;
+    std::vector<RLColumn_Encoder<IndexT>> indices;
+    RLColumn_Encoder<ValueT> values;
 
+public:
+    RLArray_Accum(RLArray<IndexT,ValueT,RANK> &_arr);
+    RLArray_Accum(RLArray_Accum &&other) = default;
 
-    bool operator++()
+    ~RLArray_Accum()
     {
-        // Read a value
-        zos.read(ivals, sizeof(int_type)*RANK);
-        for (int i=0; i<RANK; ++i)
-            boost::endian::native_to_big_inplace(ivals[i]);
-
-        // Do difference encoding
-        switch(algo.index()) {
-            case RLAlgo::DIFFS :
-                for (int i=0; i<RANK; ++i) cur_raw[i] += vals[i];
-            break;
-        }
+        for (auto &ix : indices) ix.flush();
+        values.flush();
     }
 
-    std::array<VaulT,RANK> const &operator*() const
-    {
-        switch(algo.index()) {
-            case RLAlgo::PLAIN :
-                return cur_vals;
-            case RLAlgo::DIFFS:
-                return cur_raws;
-        }
-    }
+    void add(std::array<IndexT,RANK> const &index, ValueT const &value);
+
+    void set_shape(std::array<long,RANK> const &_shape);
 };
-// --------------------------------------------------------------------------
-template<class CountT, class IndexT, class ValueT, int RANK>
-class RLSparseArray;
 
-template<class CountT, class IndexT, class ValueT, int RANK>
-class RLSparseArray_Generator {
-    std::vector<typename RLVector<CountT,IndexT>::generator_type> indices_ii;
-    typename RLVector<CountT,ValueT>::generator_type value_ii;
-
-    static std::vector<typename RLVector<CountT,IndexT>::generator_type> make_indices_ii(RLSparseArray<CountT,IndexT,ValueT,RANK> const &arr)
-    {
-        std::vector<typename RLVector<CountT,IndexT>::generator_type> ret;
-        for (int i=0; i<RANK; ++i) ret.push_back(arr.indices[i].generator());
-        return ret;
-    }
+// ======================================================================
+template<class IndexT, class ValueT, int RANK>
+class RLArray_Generator {
+    std::vector<RLColumn_Decoder<IndexT>> indices;
+    RLColumn_Decoder<ValueT> values;
+    std::array<IndexT,RANK> _index;
 
 public:
-    RLSparseArray_Generator(RLSparseArray<CountT,IndexT,ValueT,RANK> const &arr);
+    RLArray_Generator(RLArray<IndexT,ValueT,RANK> const &arr);
 
     bool operator++();
 
     IndexT index(int ix) const
-        { return *indices_ii[ix]; }
+        { return _index[ix]; }
 
-    std::array<IndexT,RANK> index() const;
+    std::array<IndexT,RANK> const &index() const
+        { return _index; }
 
     ValueT value() const
-        { return *value_ii; }
+        { return *values; }
 
+    RLArray_Generator<IndexT,ValueT,RANK> const *operator->() const { return this; }
 };
 
+// ======================================================================
 
-/** NOTE: Singular used for template parameters, plural used for
-    vectors holding plural things (or accumulators).
-TODO: Add a ValueEqualT template parameter, to allow the user to change it if needed (it's not needed). */
-template<class CountT, class IndexT, class ValueT, int RANK>
-class RLSparseArray {
+/** A run-length encoded sparse array format; a peer of ZArray.
+Indices are difference encoded, then run-length encoded; values are
+run-length encoded.  Sorted matrices with long runs of equal weights
+(eg regrid matrices) compress well, and decode much faster than
+zlib.
 
-    friend class RLSparseArray_Generator<CountT,IndexT,ValueT,RANK>;
+NOTE: Singular used for template parameters, plural used for
+    vectors holding plural things (or accumulators). */
+template<class IndexT, class ValueT, int RANK>
+class RLArray {
 
-    std::vector<RLVector<CountT,IndexT>> indices;
-    RLVector<CountT,ValueT> values;
-    int _nnz;    // Number of elements added to this RLSparseArray
-    std::array<long, RANK> _shape;
+    friend class RLArray_Accum<IndexT,ValueT,RANK>;
+    friend class RLArray_Generator<IndexT,ValueT,RANK>;
 
+    std::array<RLColumn<IndexT>, RANK> indices;
+    RLColumn<ValueT> values;
+    long _nnz;    // Number of elements added to this RLArray
+    std::array<long, RANK> _shape;
 
-    static std::vector<RLVector<CountT,IndexT>> make_indices()
+public:
+    RLArray() : values(spsparse::RLAlgo::PLAIN), _nnz(0)
     {
-        std::vector<RLVector<CountT,IndexT>> ret;
-        for (int i=0; i<RANK; ++i) ret.push_back(RLVector<CountT,IndexT>(spsparse::RLAlgo::DIFFS));
-        return ret;
+        for (int i=0; i<RANK; ++i) {
+            indices[i].algo = spsparse::RLAlgo::DIFFS;
+            _shape[i] = 0;
+        }
     }
 
-public:
-    RLSparseArray(std::array<long, RANK> shape) :
-        indices(make_indices()),
-        values(RLVector<CountT,ValueT>(spsparse::RLAlgo::PLAIN)),
-        _nnz(0), _shape(shape)
-    {}
+    RLArray(std::array<long, RANK> const &shape) : RLArray()
+        { _shape = shape; }
 
-
-    int nnz() const { return _nnz; }
+    long nnz() const { return _nnz; }
     std::array<long,RANK> const &shape() const { return _shape; }
 
-    void ncio(NcIO &ncio, std::string const &vname,
-        std::string const &count_snc_type=get_nc_type<CountT>(),
-        std::string const &index_snc_type=get_nc_type<IndexT>(),
-        std::string const &value_snc_type=get_nc_type<ValueT>());
+    void set_shape(std::array<long,RANK> const &shape)
+        { _shape = shape; }
 
-    typedef spsparse::accum::SparseArrayAgg<
-        typename RLVector<CountT,IndexT>::vaccum_type,
-        typename RLVector<CountT,ValueT>::vaccum_type,
-        RANK> accum_type;
+    /** Total number of runs stored, over all columns */
+    long nruns() const;
 
-    /** Creates an encoder */
-    accum_type accum();
+    void ncio(NcIO &ncio, std::string const &vname);
 
-    typedef RLSparseArray_Generator<CountT,IndexT,ValueT,RANK> generator_type;
+    typedef RLArray_Accum<IndexT,ValueT,RANK> accum_type;
+    /** Creates an encoder.  Any elements already in the array are
+    discarded. */
+    accum_type accum()
+        { return accum_type(*this); }
 
+    typedef RLArray_Generator<IndexT,ValueT,RANK> generator_type;
     generator_type generator() const
         { return generator_type(*this); }
 
+    /** Decodes everything at once, column by column; faster than
+    generator() when the whole array is needed. */
+    void decode(
+        std::array<std::vector<IndexT>,RANK> &_indices,
+        std::vector<ValueT> &_values) const;
 
     template<class AccumT>
     void spcopy(AccumT &&ret) const
@@ -236,107 +252,104 @@ public:
 
 };
 
-// ==================================================================
-template<class CountT, class ValueT, class EqualT>
-void RLVector<CountT,ValueT,EqualT>::
-    ncio(NcIO &ncio, std::string const &vname,
-        std::string const &count_snc_type,
-        std::string const &value_snc_type)
+// ======================================================================
+template<class IndexT, class ValueT, int RANK>
+RLArray_Accum<IndexT,ValueT,RANK>::
+    RLArray_Accum(RLArray<IndexT,ValueT,RANK> &_arr)
+    : arr(&_arr), values(_arr.values)
     {
-        auto dims(get_or_add_dims(ncio, count, {vname + ".rlsize"}));    // size ignored on read
-
-        // No need to track and record nnz; but if we do, this is how
-        auto info_v = get_or_add_var(ncio, vname + ".info", "int", {});
-        get_or_put_att_enum(info_v, ncio.rw, "algo", algo);
-
-        netCDF::NcVar ncv;
-        ncio_vector(ncio, count, true, vname+".count", count_snc_type, dims);
-
-        netCDF::NcVar value_v(ncio_vector(ncio, value, true, vname+".value", value_snc_type, dims));
+        arr->_nnz = 0;
+        arr->values.clear();
+        for (int i=0; i<RANK; ++i) {
+            arr->indices[i].clear();
+            indices.push_back(RLColumn_Encoder<IndexT>(arr->indices[i]));
+        }
     }
 
+template<class IndexT, class ValueT, int RANK>
+void RLArray_Accum<IndexT,ValueT,RANK>::
+    add(std::array<IndexT,RANK> const &index, ValueT const &value)
+    {
+        ++arr->_nnz;
+        for (int i=0; i<RANK; ++i) indices[i].add(index[i]);
+        values.add(value);
+    }
 
-// ==================================================================
-
-
-template<class CountT, class IndexT, class ValueT, int RANK>
-RLSparseArray_Generator<CountT,IndexT,ValueT,RANK>::
-    RLSparseArray_Generator(RLSparseArray<CountT,IndexT,ValueT,RANK> const &arr) :
-        indices_ii(make_indices_ii(arr)),
-        value_ii(arr.values.generator())
-//        value_ii(typename RLVector<CountT,ValueT>::generator_type())
-    {}
+template<class IndexT, class ValueT, int RANK>
+void RLArray_Accum<IndexT,ValueT,RANK>::
+    set_shape(std::array<long,RANK> const &_shape)
+    { arr->_shape = _shape; }
 
+// ----------------------------------------------------------------------
+template<class IndexT, class ValueT, int RANK>
+RLArray_Generator<IndexT,ValueT,RANK>::
+    RLArray_Generator(RLArray<IndexT,ValueT,RANK> const &arr)
+    : values(arr.values)
+    {
+        for (int i=0; i<RANK; ++i) indices.push_back(RLColumn_Decoder<IndexT>(arr.indices[i]));
+    }
 
-template<class CountT, class IndexT, class ValueT, int RANK>
-bool RLSparseArray_Generator<CountT,IndexT,ValueT,RANK>::
+template<class IndexT, class ValueT, int RANK>
+bool RLArray_Generator<IndexT,ValueT,RANK>::
     operator++()
     {
-        // Increment the iterators
-        bool good = ++value_ii;
+        bool const good = ++values;
         for (int i=0; i<RANK; ++i) {
-            bool this_good = ++indices_ii[i];
-            if (this_good != good) (*ibmisc_error)(-1,
-                "All iterators should be of same length (more debugging needed here)");
+            if (++indices[i] != good) (*ibmisc_error)(-1,
+                "All iterators should be of same length");
+            _index[i] = *indices[i];
         }
         return good;
     }
 
-template<class CountT, class IndexT, class ValueT, int RANK>
-std::array<IndexT,RANK> RLSparseArray_Generator<CountT,IndexT,ValueT,RANK>::
-    index() const
+// ----------------------------------------------------------------------
+template<class IndexT, class ValueT, int RANK>
+long RLArray<IndexT,ValueT,RANK>::
+    nruns() const
     {
-        std::array<IndexT,RANK> ret;
-        for (int i=0; i<RANK; ++i) ret[i] = index(i);
-        return ret;
+        long n = values.nruns();
+        for (int i=0; i<RANK; ++i) n += indices[i].nruns();
+        return n;
     }
 
-// ===================================================================
-template<class CountT, class IndexT, class ValueT, int RANK>
-void RLSparseArray<CountT,IndexT,ValueT,RANK>::
-    ncio(NcIO &ncio, std::string const &vname,
-        std::string const &count_snc_type,
-        std::string const &index_snc_type,
-        std::string const &value_snc_type)
+template<class IndexT, class ValueT, int RANK>
+void RLArray<IndexT,ValueT,RANK>::
+    decode(
+        std::array<std::vector<IndexT>,RANK> &_indices,
+        std::vector<ValueT> &_values) const
     {
-        auto info_v = get_or_add_var(ncio, vname + ".info", "int", {});
-        get_or_put_att(info_v, ncio.rw, "nnz", "int64", &_nnz, 1);
-        get_or_put_att(info_v, ncio.rw, "shape", "int64", &_shape[0], RANK);
-
+        for (int i=0; i<RANK; ++i) indices[i].decode(_indices[i]);
+        values.decode(_values);
         for (int i=0; i<RANK; ++i) {
-            indices[i].ncio(ncio,
-                ibmisc::strprintf("%s.indices_%d", vname.c_str(), i),
-                count_snc_type, index_snc_type);
+            if (_indices[i].size() != _values.size()) (*ibmisc_error)(-1,
+                "RLArray index column %d has %ld elements, expected %ld",
+                i, _indices[i].size(), _values.size());
         }
-        values.ncio(ncio, vname+".values",
-            count_snc_type, value_snc_type);
     }
 
-
-template<class CountT, class IndexT, class ValueT, int RANK>
-typename RLSparseArray<CountT,IndexT,ValueT,RANK>::accum_type
-RLSparseArray<CountT,IndexT,ValueT,RANK>::
-    accum()
+template<class IndexT, class ValueT, int RANK>
+void RLArray<IndexT,ValueT,RANK>::
+    ncio(NcIO &ncio, std::string const &vname)
     {
-        std::vector<typename RLVector<CountT,IndexT>::vaccum_type> vaccum_indices;
+        auto info_v = get_or_add_var(ncio, vname + ".info", "int", {});
+        std::string format("RLARRAY");
+        get_or_put_att(info_v, ncio.rw, "format", format);
+        if (ncio.rw == 'r' && format != "RLARRAY") (*ibmisc_error)(-1,
+            "Variable %s has format %s, expected RLARRAY", vname.c_str(), format.c_str());
+        int rank = RANK;
+        get_or_put_att(info_v, ncio.rw, "rank", "int", &rank, 1);
+        get_or_put_att(info_v, ncio.rw, "nnz", "int64", &_nnz, 1);
+        get_or_put_att(info_v, ncio.rw, "shape", "int64", &_shape[0], RANK);
+        get_or_put_att_enum(info_v, ncio.rw, "index_algo", indices[0].algo);
+        get_or_put_att_enum(info_v, ncio.rw, "value_algo", values.algo);
+        for (int i=1; i<RANK; ++i) indices[i].algo = indices[0].algo;
+
         for (int i=0; i<RANK; ++i) {
-            vaccum_indices.push_back(indices[i].vaccum());
+            indices[i].ncio(ncio, ibmisc::strprintf("%s.indices_%d", vname.c_str(), i));
         }
-
-        return accum_type(std::move(vaccum_indices),
-            values.vaccum(),
-            _nnz);
+        values.ncio(ncio, vname + ".values");
     }
 
-// ==================================================================
-
-
-
-
-
-
-
-
 // ---------------------------------------------------------------------
 } // namespace ibmisc
 #endif
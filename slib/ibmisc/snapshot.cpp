@@ -0,0 +1,162 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ibmisc/snapshot.hpp>
+
+namespace ibmisc {
+
+namespace {
+
+/** Start of every snapshot image */
+struct SnapshotHeader {
+    char magic[8];          // "IBSNAP01"
+    int32_t version;
+    uint32_t byte_order;    // byte_order_mark, as written
+    int64_t nsections;
+    int64_t toc_offset;     // Start of table of contents
+};
+
+char const snapshot_magic[8] = {'I','B','S','N','A','P','0','1'};
+int32_t const snapshot_version = 1;
+uint32_t const byte_order_mark = 0x01020304;
+
+}
+
+// ------------------------------------------------------------
+SnapshotWriter::SnapshotWriter(std::string const &_fname)
+    : fname(_fname), tmp_fname(_fname + ".tmp" + std::to_string(getpid())),
+    out(tmp_fname, std::ios::binary | std::ios::out | std::ios::trunc),
+    offset(0)
+{
+    if (!out) (*ibmisc_error)(-1,
+        "Cannot open snapshot %s for writing", tmp_fname.c_str());
+
+    // Placeholder; the real header is written by close()
+    SnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    out.write((char const *)&hdr, sizeof(hdr));
+    offset = sizeof(hdr);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (out.is_open()) close();
+}
+
+void SnapshotWriter::pad_to(int64_t align)
+{
+    static char const zeros[SnapshotWriter::align] = {};
+    int64_t const npad = (align - offset % align) % align;
+    out.write(zeros, npad);
+    offset += npad;
+}
+
+void SnapshotWriter::add_bytes(std::string const &name, char const *data, size_t nbytes)
+{
+    for (auto const &entry : toc) if (entry.name == name) (*ibmisc_error)(-1,
+        "Snapshot %s already has a section named %s", fname.c_str(), name.c_str());
+
+    pad_to(align);
+    toc.push_back(Entry{name, offset, (int64_t)nbytes});
+    if (nbytes > 0) out.write(data, nbytes);
+    offset += nbytes;
+}
+
+void SnapshotWriter::close()
+{
+    pad_to(sizeof(int64_t));
+    SnapshotHeader hdr;
+    memcpy(hdr.magic, snapshot_magic, sizeof(hdr.magic));
+    hdr.version = snapshot_version;
+    hdr.byte_order = byte_order_mark;
+    hdr.nsections = toc.size();
+    hdr.toc_offset = offset;
+
+    for (auto const &entry : toc) {
+        int64_t const name_len = entry.name.size();
+        out.write((char const *)&entry.offset, sizeof(entry.offset));
+        out.write((char const *)&entry.size, sizeof(entry.size));
+        out.write((char const *)&name_len, sizeof(name_len));
+        out.write(entry.name.data(), name_len);
+    }
+
+    out.seekp(0);
+    out.write((char const *)&hdr, sizeof(hdr));
+    out.close();
+    if (!out) {
+        ::unlink(tmp_fname.c_str());
+        (*ibmisc_error)(-1, "Error writing snapshot %s", tmp_fname.c_str());
+    }
+    if (::rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+        ::unlink(tmp_fname.c_str());
+        (*ibmisc_error)(-1, "Cannot rename snapshot %s to %s: %s",
+            tmp_fname.c_str(), fname.c_str(), strerror(errno));
+    }
+}
+
+// ------------------------------------------------------------
+Snapshot::Snapshot(std::string const &_fname)
+    : fname(_fname), base(nullptr), nbytes(0)
+{
+    int const fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) (*ibmisc_error)(-1,
+        "Cannot open snapshot %s: %s", fname.c_str(), strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        (*ibmisc_error)(-1, "Cannot stat snapshot %s", fname.c_str());
+    }
+    nbytes = st.st_size;
+    if (nbytes >= sizeof(SnapshotHeader)) {
+        void *p = mmap(nullptr, nbytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) base = (char const *)p;
+    }
+    ::close(fd);
+    if (!base) (*ibmisc_error)(-1,
+        "Cannot map snapshot %s (%ld bytes)", fname.c_str(), (long)nbytes);
+
+    // Parse header and table of contents
+    SnapshotHeader hdr;
+    memcpy(&hdr, base, sizeof(hdr));
+    if (memcmp(hdr.magic, snapshot_magic, sizeof(hdr.magic)) != 0) (*ibmisc_error)(-1,
+        "%s is not an ibmisc snapshot", fname.c_str());
+    if (hdr.byte_order != byte_order_mark) (*ibmisc_error)(-1,
+        "Snapshot %s was written on a machine of the other byte order", fname.c_str());
+    if (hdr.version != snapshot_version) (*ibmisc_error)(-1,
+        "Snapshot %s has version %d; expected %d", fname.c_str(), hdr.version, snapshot_version);
+
+    SnapshotIArchive ar(base + std::min((size_t)hdr.toc_offset, nbytes), base + nbytes);
+    for (int64_t i=0; i<hdr.nsections; ++i) {
+        int64_t offset, size;
+        std::string name;
+        ar & offset & size & name;
+        if (offset < 0 || size < 0 || (size_t)(offset + size) > nbytes) (*ibmisc_error)(-1,
+            "Snapshot %s: section %s is out of range", fname.c_str(), name.c_str());
+        sections[name] = std::make_pair(base + offset, (size_t)size);
+    }
+}
+
+Snapshot::~Snapshot()
+{
+    if (base) munmap(const_cast<char *>(base), nbytes);
+}
+
+std::vector<std::string> Snapshot::names() const
+{
+    std::vector<std::string> ret;
+    for (auto const &sec : sections) ret.push_back(sec.first);
+    return ret;
+}
+
+std::pair<char const *, size_t> Snapshot::bytes(std::string const &name) const
+{
+    auto ii(sections.find(name));
+    if (ii == sections.end()) (*ibmisc_error)(-1,
+        "Snapshot %s has no section named %s", fname.c_str(), name.c_str());
+    return ii->second;
+}
+
+}    // namespace ibmisc
@@ -0,0 +1,321 @@
+#ifndef IBMISC_SNAPSHOT_HPP
+#define IBMISC_SNAPSHOT_HPP
+
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <blitz/array.h>
+#include <ibmisc/error.hpp>
+
+/** Binary snapshots of fully initialized ibmisc objects (SparseSet,
+Weighted_Eigen, Weighted_Tuple, Indexing, Domain, ConstantSet...), so
+a restarted run can skip rebuilding them.
+
+Objects are written through their boost-style serialize() hooks:
+
+    template<class ArchiveT>
+    void serialize(ArchiveT &ar, const unsigned int file_version)
+        { ar & a; ar & b; ... }
+
+Snapshot archives are much simpler than boost::archive: native
+endian, no object tracking or class versioning.  Trivially copyable
+vectors and blitz::Arrays are stored as raw bytes, so loading them is
+one memcpy out of the memory-mapped image.
+
+    {SnapshotWriter snap("state.snap");
+        snap.add("gridA", gridA);
+        snap.add("AvE", *AvE);
+    }
+    Snapshot snap("state.snap");
+    snap.get("gridA", gridA);
+
+Images are meant for restarting on the same kind of machine; loading
+an image written with the other byte order is an error. */
+namespace ibmisc {
+
+/** Appends serialized objects to a byte buffer */
+class SnapshotOArchive {
+    std::vector<char> &buf;
+public:
+    typedef std::false_type is_loading;
+    typedef std::true_type is_saving;
+
+    SnapshotOArchive(std::vector<char> &_buf) : buf(_buf) {}
+
+    void write(void const *src, size_t nbytes)
+        { buf.insert(buf.end(), (char const *)src, (char const *)src + nbytes); }
+
+    template<class T>
+    SnapshotOArchive &operator&(T const &x);
+
+    template<class T>
+    SnapshotOArchive &operator<<(T const &x)
+        { return *this & x; }
+};
+
+/** Reads serialized objects back out of [begin, end) */
+class SnapshotIArchive {
+    char const *cur;
+    char const *end;
+public:
+    typedef std::true_type is_loading;
+    typedef std::false_type is_saving;
+
+    SnapshotIArchive(char const *_begin, char const *_end) : cur(_begin), end(_end) {}
+
+    /** @return Pointer to the next nbytes, which are consumed */
+    char const *take(size_t nbytes)
+    {
+        if (nbytes > (size_t)(end - cur)) (*ibmisc_error)(-1,
+            "Snapshot section is truncated: need %ld more bytes, have %ld",
+            (long)nbytes, (long)(end - cur));
+        char const *ret = cur;
+        cur += nbytes;
+        return ret;
+    }
+
+    void read(void *dest, size_t nbytes)
+        { if (nbytes > 0) memcpy(dest, take(nbytes), nbytes); }
+
+    /** Bytes not yet read */
+    size_t remaining() const
+        { return end - cur; }
+
+    template<class T>
+    SnapshotIArchive &operator&(T &x);
+
+    template<class T>
+    SnapshotIArchive &operator>>(T &x)
+        { return *this & x; }
+};
+
+// ------------------------------------------------------------
+// snapshot_io() overloads do the work for each type.  Overloads for
+// other types may be added in namespace ibmisc (found by ADL on the
+// archive), eg for Eigen::SparseMatrix in linear/eigen.hpp.
+
+/** Scalars: raw bytes */
+template<class T>
+typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type
+snapshot_io(SnapshotOArchive &ar, T &x)
+    { ar.write(&x, sizeof(T)); }
+
+template<class T>
+typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type
+snapshot_io(SnapshotIArchive &ar, T &x)
+    { ar.read(&x, sizeof(T)); }
+
+/** Classes: through their serialize() hook */
+template<class ArchiveT, class T>
+typename std::enable_if<std::is_class<T>::value>::type
+snapshot_io(ArchiveT &ar, T &x)
+    { x.serialize(ar, 0); }
+
+inline void snapshot_io(SnapshotOArchive &ar, std::string &x)
+{
+    int64_t n = x.size();
+    ar.write(&n, sizeof(n));
+    ar.write(x.data(), n);
+}
+
+inline void snapshot_io(SnapshotIArchive &ar, std::string &x)
+{
+    int64_t n;
+    ar.read(&n, sizeof(n));
+    char const *p = ar.take(n);
+    x.assign(p, n);
+}
+
+namespace _snapshot {
+
+/** Raw bulk copy for trivially copyable elements; one at a time otherwise */
+template<class T>
+void io_n(SnapshotOArchive &ar, T *x, size_t n, std::true_type)
+    { ar.write(x, n * sizeof(T)); }
+
+template<class T>
+void io_n(SnapshotIArchive &ar, T *x, size_t n, std::true_type)
+    { ar.read(x, n * sizeof(T)); }
+
+template<class ArchiveT, class T>
+void io_n(ArchiveT &ar, T *x, size_t n, std::false_type)
+    { for (size_t i=0; i<n; ++i) ar & x[i]; }
+
+template<class ArchiveT, class T>
+void io_n(ArchiveT &ar, T *x, size_t n)
+{
+    io_n(ar, x, n, std::integral_constant<bool,
+        std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value>());
+}
+
+}    // namespace ibmisc::_snapshot
+
+template<class ArchiveT, class T, size_t N>
+void snapshot_io(ArchiveT &ar, std::array<T,N> &x)
+    { _snapshot::io_n(ar, &x[0], N); }
+
+template<class ArchiveT, class T, class AllocT>
+void snapshot_io(ArchiveT &ar, std::vector<T,AllocT> &x)
+{
+    int64_t n = x.size();
+    ar & n;
+    if (ArchiveT::is_loading::value) x.resize(n);
+    if (n > 0) _snapshot::io_n(ar, &x[0], n);
+}
+
+/** blitz::Array: bounds and storage order, then the elements in
+storage order.  Loaded arrays are always contiguous, ascending. */
+template<class T, int RANK>
+void snapshot_io(SnapshotOArchive &ar, blitz::Array<T,RANK> &x)
+{
+    for (int i=0; i<RANK; ++i) {
+        int32_t lbound = x.lbound(i), extent = x.extent(i), ordering = x.ordering(i);
+        ar & lbound & extent & ordering;
+    }
+    if (x.numElements() == 0) return;
+
+    bool ascending = true;
+    for (int i=0; i<RANK; ++i) ascending = ascending && x.isRankStoredAscending(i);
+    if (x.isStorageContiguous() && ascending) {
+        _snapshot::io_n(ar, x.dataFirst(), x.numElements());
+    } else {
+        blitz::GeneralArrayStorage<RANK> stor;
+        for (int i=0; i<RANK; ++i) stor.ordering()[i] = x.ordering(i);
+        stor.base() = x.lbound();
+        blitz::Array<T,RANK> tmp(x.extent(), stor);
+        tmp = x;
+        _snapshot::io_n(ar, tmp.dataFirst(), tmp.numElements());
+    }
+}
+
+template<class T, int RANK>
+void snapshot_io(SnapshotIArchive &ar, blitz::Array<T,RANK> &x)
+{
+    blitz::GeneralArrayStorage<RANK> stor;
+    blitz::TinyVector<int,RANK> extent;
+    for (int i=0; i<RANK; ++i) {
+        int32_t lbound, ext, ordering;
+        ar & lbound & ext & ordering;
+        stor.base()[i] = lbound;
+        stor.ordering()[i] = ordering;
+        extent[i] = ext;
+    }
+    x.reference(blitz::Array<T,RANK>(extent, stor));
+    if (x.numElements() > 0) _snapshot::io_n(ar, x.dataFirst(), x.numElements());
+}
+
+
+template<class T>
+SnapshotOArchive &SnapshotOArchive::operator&(T const &x)
+{
+    // Saving does not change x; the const_cast lets one serialize()
+    // hook serve for both directions (as in boost::serialization)
+    snapshot_io(*this, const_cast<T &>(x));
+    return *this;
+}
+
+template<class T>
+SnapshotIArchive &SnapshotIArchive::operator&(T &x)
+{
+    snapshot_io(*this, x);
+    return *this;
+}
+
+// ------------------------------------------------------------
+/** Writes a snapshot image: named sections, each holding one
+serialized object.  Layout:
+    SnapshotHeader
+    Sections, each starting on an align-byte boundary
+    Table of contents, nsections * {int64 offset, int64 size,
+        int64 name_len, name_len bytes name}
+The image is written under a temporary name and renamed on close(),
+so readers never see a partial snapshot. */
+class SnapshotWriter {
+    std::string fname;
+    std::string tmp_fname;
+    std::ofstream out;
+    std::string current;    // Name of section being built, for errors
+
+    struct Entry {
+        std::string name;
+        int64_t offset;
+        int64_t size;
+    };
+    std::vector<Entry> toc;
+    int64_t offset;    // Bytes written so far
+
+    void pad_to(int64_t align);
+
+public:
+    /** Sections start on multiples of this, so raw arrays in a
+    mapped image are suitably aligned. */
+    static int const align = 64;
+
+    SnapshotWriter(std::string const &_fname);
+    ~SnapshotWriter();
+
+    /** Adds a section holding raw bytes */
+    void add_bytes(std::string const &name, char const *data, size_t nbytes);
+
+    /** Adds a section holding one object: anything an archive can
+    serialize (an object with a serialize() hook, std::vector,
+    blitz::Array...) */
+    template<class T>
+    SnapshotWriter &add(std::string const &name, T const &obj)
+    {
+        std::vector<char> buf;
+        SnapshotOArchive ar(buf);
+        ar & obj;
+        add_bytes(name, buf.empty() ? nullptr : &buf[0], buf.size());
+        return *this;
+    }
+
+    /** Writes the table of contents and makes the snapshot visible
+    under its final name. */
+    void close();
+};
+
+/** A snapshot image, memory-mapped read-only.  Opening it only parses
+the table of contents; each object is decoded when get() asks for it. */
+class Snapshot {
+    std::string fname;
+    char const *base;
+    size_t nbytes;
+
+    std::map<std::string, std::pair<char const *, size_t>> sections;
+
+public:
+    Snapshot(std::string const &_fname);
+    ~Snapshot();
+
+    Snapshot(Snapshot const &) = delete;
+    Snapshot &operator=(Snapshot const &) = delete;
+
+    bool has(std::string const &name) const
+        { return sections.find(name) != sections.end(); }
+
+    /** Section names, in sorted order */
+    std::vector<std::string> names() const;
+
+    /** Raw bytes of a section, valid while this Snapshot is open */
+    std::pair<char const *, size_t> bytes(std::string const &name) const;
+
+    /** Loads obj out of section name, which it must use completely */
+    template<class T>
+    void get(std::string const &name, T &obj) const
+    {
+        auto const sec(bytes(name));
+        SnapshotIArchive ar(sec.first, sec.first + sec.second);
+        ar & obj;
+        if (ar.remaining() != 0) (*ibmisc_error)(-1,
+            "Snapshot %s: section %s has %ld bytes left over; wrong type?",
+            fname.c_str(), name.c_str(), (long)ar.remaining());
+    }
+};
+
+}    // namespace ibmisc
+#endif    // IBMISC_SNAPSHOT_HPP
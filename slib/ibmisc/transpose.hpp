@@ -0,0 +1,167 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IBMISC_TRANSPOSE_HPP
+#define IBMISC_TRANSPOSE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+#include <blitz/array.h>
+#include <ibmisc/error.hpp>
+#include <ibmisc/parallel.hpp>
+
+namespace ibmisc {
+
+/** Side of the tiles copy_strided() transposes through: a 32x32 tile
+of doubles (8KB) stays in L1 while it is read by one side and written
+by the other. */
+int const transpose_tile = 32;
+
+/** Copies an N-d box of elements between two strided layouts
+(strides in elements; count[i] elements along dimension i).  If the
+fastest-varying dimensions of src and dst differ (eg C vs. Fortran
+order), the copy goes through tiles of those two dimensions, so that
+both sides are read / written in runs.
+@param nthreads Rows of tiles are copied concurrently.  dst must not
+    overlap src. */
+template<class TypeT>
+void copy_strided(
+    TypeT *dst, ptrdiff_t const *dst_stride,
+    TypeT const *src, ptrdiff_t const *src_stride,
+    size_t const *count, int rank, int nthreads = 1)
+{
+    if (rank == 0) {
+        *dst = *src;
+        return;
+    }
+    long ntotal = 1;
+    for (int i=0; i<rank; ++i) ntotal *= count[i];
+    if (ntotal == 0) return;
+
+    // Fastest-varying dimension of each side (ignoring length-1 dims)
+    int a = -1, b = -1;
+    for (int i=0; i<rank; ++i) {
+        if (count[i] <= 1) continue;
+        if (a < 0 || std::abs(dst_stride[i]) < std::abs(dst_stride[a])) a = i;
+        if (b < 0 || std::abs(src_stride[i]) < std::abs(src_stride[b])) b = i;
+    }
+    if (a < 0) a = b = rank-1;
+
+    // The other dimensions, run through as an odometer
+    std::vector<int> outer;
+    long nouter = 1;
+    for (int i=0; i<rank; ++i) {
+        if (i == a || i == b) continue;
+        outer.push_back(i);
+        nouter *= count[i];
+    }
+
+    // Work items: one row of tiles (or, if a == b, one run of a) in
+    // one box of the outer dimensions
+    long const nrun = (a == b ? transpose_tile * transpose_tile : transpose_tile);
+    long const nrows = (count[b] + nrun - 1) / nrun;
+    long const row_size = ntotal / (nouter * nrows) + 1;
+
+    parallel_for(0, nouter * nrows, nthreads, [&](long w0, long w1) {
+        for (long w=w0; w<w1; ++w) {
+            long const kb0 = (w % nrows) * nrun;
+            long const kb1 = std::min((long)count[b], kb0 + nrun);
+            ptrdiff_t doff = 0, soff = 0;
+            long io = w / nrows;
+            for (int oi=outer.size()-1; oi >= 0; --oi) {
+                int const i = outer[oi];
+                long const ix = io % count[i];
+                io /= count[i];
+                doff += ix * dst_stride[i];
+                soff += ix * src_stride[i];
+            }
+            TypeT * const d = dst + doff;
+            TypeT const * const s = src + soff;
+
+            if (a == b) {
+                for (long k=kb0; k<kb1; ++k)
+                    d[k*dst_stride[a]] = s[k*src_stride[a]];
+                continue;
+            }
+            for (long ka0=0; ka0<(long)count[a]; ka0 += transpose_tile) {
+                long const ka1 = std::min((long)count[a], ka0 + transpose_tile);
+                for (long kb=kb0; kb<kb1; ++kb) {
+                    for (long ka=ka0; ka<ka1; ++ka) {
+                        d[ka*dst_stride[a] + kb*dst_stride[b]] =
+                            s[ka*src_stride[a] + kb*src_stride[b]];
+                    }
+                }
+            }
+        }
+    }, std::max(1L, (64L*1024) / row_size));
+}
+
+/** dst = src, for arrays of the same extents with any storage orders
+(eg a Fortran-order array from f90blitz into a C-order one), through
+copy_strided().  Elements correspond by position; lower bounds may
+differ.  Much faster than Blitz assignment when the orders differ. */
+template<class TypeT, int RANK>
+void copy_blitz(
+    blitz::Array<TypeT,RANK> &dst,
+    blitz::Array<TypeT,RANK> const &src,
+    int nthreads = 1)
+{
+    std::array<ptrdiff_t,RANK> dst_stride, src_stride;
+    std::array<size_t,RANK> count;
+    for (int i=0; i<RANK; ++i) {
+        if (dst.extent(i) != src.extent(i)) (*ibmisc_error)(-1,
+            "copy_blitz(): extent mismatch in dimension %d: dst=%d, src=%d",
+            i, dst.extent(i), src.extent(i));
+        dst_stride[i] = dst.stride(i);
+        src_stride[i] = src.stride(i);
+        count[i] = src.extent(i);
+    }
+    copy_strided(dst.data(), &dst_stride[0], src.data(), &src_stride[0],
+        &count[0], RANK, nthreads);
+}
+
+/** @return True if arr is contiguous in C order */
+template<class TypeT, int RANK>
+bool is_c_contiguous(blitz::Array<TypeT,RANK> const &arr)
+{
+    long cur = 1;
+    for (int i=RANK-1; i>=0; --i) {
+        if (arr.extent(i) != 1 && arr.stride(i) != cur) return false;
+        cur *= arr.extent(i);
+    }
+    return true;
+}
+
+/** @return A C-order copy of arr, or arr itself if it is already
+    C-contiguous. */
+template<class TypeT, int RANK>
+blitz::Array<TypeT,RANK> c_contiguous(
+    blitz::Array<TypeT,RANK> const &arr, int nthreads = 1)
+{
+    if (is_c_contiguous(arr)) return arr;
+
+    blitz::Array<TypeT,RANK> ret(arr.lbound(), arr.extent());
+    copy_blitz(ret, arr, nthreads);
+    return ret;
+}
+
+}    // namespace ibmisc
+#endif    // guard
@@ -18,6 +18,8 @@
 
 #include <cstdio>
 #include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <exception>
 #include <ibmisc/udunits2.hpp>
 #include <ibmisc/ibmisc.hpp>
@@ -39,6 +41,34 @@ namespace ibmisc {
     UTSystem::~UTSystem()
         { if (_self && _free_me) ut_free_system(_self); }
 
+    namespace {
+        std::mutex shared_mtx;
+        std::string shared_path;
+        bool shared_loaded = false;
+    }
+
+    UTSystem const &UTSystem::shared()
+    {
+        // Leaked on purpose: destructors of other statics may still use it
+        static UTSystem const *ret = [] {
+            std::lock_guard<std::mutex> lock(shared_mtx);
+            std::unique_ptr<UTSystem> sys(new UTSystem(shared_path));
+            if (!sys->_self) (*ibmisc_error)(-1,
+                "UTSystem::shared(): Cannot read unit database '%s'", shared_path.c_str());
+            shared_loaded = true;
+            return sys.release();
+        }();
+        return *ret;
+    }
+
+    void UTSystem::set_shared_path(std::string const &path)
+    {
+        std::lock_guard<std::mutex> lock(shared_mtx);
+        if (shared_loaded) (*ibmisc_error)(-1,
+            "UTSystem::set_shared_path(%s): shared() has already been read", path.c_str());
+        shared_path = path;
+    }
+
     UTUnit UTSystem::get_unit_by_name(std::string const &name) const
     {
         UTUnit ret(ut_get_unit_by_name(_self, name.c_str()), false, name);
@@ -146,5 +176,51 @@ namespace ibmisc {
     }
 
 
+    // ---------------------------------------------------------------
+    UnitConverter::UnitConverter(UTUnit const &from, UTUnit const &to)
+        : cv(from, to), _linear(true)
+    {
+        // udunits2 does not say what kind of converter it built; so
+        // probe it.  Logarithmic (etc) ones fail, NaN included.
+        _offset = cv.convert(0.);
+        _scale = cv.convert(1.) - _offset;
+        for (double const x : {-1e3, -1., .5, 2., 1e3, 1e6}) {
+            double const y = cv.convert(x);
+            double const lin = _scale*x + _offset;
+            double const tol = 1e-12 * std::max(std::abs(y),
+                std::max(std::abs(_offset), std::abs(_scale*x)));
+            if (!(std::abs(y - lin) <= tol)) {
+                _linear = false;
+                break;
+            }
+        }
+    }
+
+    void UnitConverter::convert(double const *in, size_t count, double *out) const
+    {
+        if (!_linear) {
+            cv.convert(in, count, out);
+            return;
+        }
+        double const scale = _scale, offset = _offset;
+        for (size_t i=0; i<count; ++i) out[i] = scale*in[i] + offset;
+    }
+
+    UnitConverter const &ConverterCache::get(std::string const &from, std::string const &to)
+    {
+        // udunits2 parsing is not thread-safe, so the lock also covers it.
+        std::lock_guard<std::mutex> lock(mtx);
+        auto key(std::make_pair(from, to));
+        auto ii(cache.find(key));
+        if (ii != cache.end()) return *ii->second;
+
+        UTUnit ufrom(ut_system->parse(from));
+        UTUnit uto(ut_system->parse(to));
+        std::unique_ptr<UnitConverter> conv(new UnitConverter(ufrom, uto));
+        UnitConverter const &ret(*conv);
+        cache.insert(std::make_pair(std::move(key), std::move(conv)));
+        return ret;
+    }
+
 }   // namespace ibmisc
 
@@ -20,10 +20,17 @@
 
 #include <udunits2.h>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <ibmisc/blitz.hpp>
+#include <ibmisc/error.hpp>
 
 namespace ibmisc {
 
 class UTSystem;
+template<class TypeT, int RANK> class ArrayBundle;
 
 class UTUnit
 {
@@ -114,6 +121,18 @@ public:
 
     ~UTSystem();
 
+    /** The process-wide unit system, read from the XML database on
+    first use (from any thread) and kept until exit.  Parsing the full
+    database takes a while; share this one rather than constructing
+    more.  To start faster, point it to a trimmed database holding
+    just the units in use (see set_shared_path()). */
+    static UTSystem const &shared();
+
+    /** Sets the XML database shared() reads; must be called before
+    shared() is first used.  Default "": the udunits2 default, or
+    $UDUNITS2_XML_PATH if set. */
+    static void set_shared_path(std::string const &path);
+
     UTUnit get_unit_by_name(std::string const &name) const;
 
     UTUnit get_unit_by_symbol(std::string const &symbol) const;
@@ -129,11 +148,13 @@ public:
 
     UTSystem(UTSystem &&src) {
         _self = src._self;
+        _free_me = src._free_me;
         src._self = 0;
     }
 
     UTSystem &operator=(UTSystem &&src) {
         _self = src._self;
+        _free_me = src._free_me;
         src._self = 0;
         return *this;
     }
@@ -174,6 +195,103 @@ public:
 
 };
 
+// =================================================
+/** A CVConverter that, if the conversion is linear (scale*x + offset,
+as nearly all are), converts arrays with a plain multiply-add loop
+that the compiler vectorises; others go through cv_convert_doubles(). */
+class UnitConverter
+{
+    CVConverter cv;
+    bool _linear;
+    double _scale, _offset;
+
+public:
+    UnitConverter(UTUnit const &from, UTUnit const &to);
+
+    bool is_linear() const { return _linear; }
+    double scale() const { return _scale; }
+    double offset() const { return _offset; }
+
+    double convert(double const val) const
+        { return _linear ? _scale*val + _offset : cv.convert(val); }
+
+    /** out may be the same as in */
+    void convert(double const *in, size_t count, double *out) const;
+
+    /** Converts in to out, which must have the same shape. */
+    template<int RANK>
+    void convert(blitz::Array<double,RANK> const &in, blitz::Array<double,RANK> &out) const;
+
+    /** Converts in place */
+    template<int RANK>
+    void convert(blitz::Array<double,RANK> &arr) const
+        { convert(arr, arr); }
+};
+
+template<int RANK>
+void UnitConverter::convert(blitz::Array<double,RANK> const &in, blitz::Array<double,RANK> &out) const
+{
+    for (int i=0; i<RANK; ++i) {
+        if (in.extent(i) != out.extent(i)) (*ibmisc_error)(-1,
+            "UnitConverter: extent mismatch in dimension %d: %d vs %d",
+            i, in.extent(i), out.extent(i));
+    }
+
+    // Same layout in memory: convert in one go
+    bool flat = in.isStorageContiguous() && out.isStorageContiguous();
+    for (int i=0; i<RANK; ++i) {
+        flat = flat && in.isRankStoredAscending(i) && out.isRankStoredAscending(i)
+            && in.ordering(i) == out.ordering(i);
+    }
+    if (flat) {
+        convert(in.dataFirst(), in.size(), out.dataFirst());
+        return;
+    }
+
+    auto ii(in.begin());
+    for (auto jj(out.begin()); jj != out.end(); ++ii, ++jj) *jj = convert(*ii);
+}
+
+/** Thread-safe cache of UnitConverters, keyed on the (from, to) unit
+strings, so each conversion is parsed and built only once. */
+class ConverterCache
+{
+    UTSystem const *ut_system;
+    std::mutex mtx;
+    std::map<std::pair<std::string, std::string>, std::unique_ptr<UnitConverter>> cache;
+
+public:
+    ConverterCache(UTSystem const *_ut_system = &UTSystem::shared()) : ut_system(_ut_system) {}
+
+    /** Returns the converter, building it on first use.  The
+    reference is valid as long as the cache. */
+    UnitConverter const &get(std::string const &from, std::string const &to);
+
+    double convert(std::string const &from, std::string const &to, double val)
+        { return get(from, to).convert(val); }
+
+    /** Converts a bundle variable in place, from its "units"
+    attribute to to_units; and updates the attribute. */
+    template<int RANK>
+    void convert(ArrayBundle<double,RANK> &bundle,
+        std::string const &vname, std::string const &to_units);
+};
+
+template<int RANK>
+void ConverterCache::convert(ArrayBundle<double,RANK> &bundle,
+    std::string const &vname, std::string const &to_units)
+{
+    auto &data(bundle.at(vname));
+    for (auto &kv : data.meta.attr) {
+        if (kv.first != "units") continue;
+        get(kv.second, to_units).convert(*data.arr);
+        kv.second = to_units;
+        return;
+    }
+    (*ibmisc_error)(-1,
+        "Bundle variable %s has no units attribute", vname.c_str());
+}
+
 // =================================================
 #if 0
 inline UTSystem UTUnit::get_system()
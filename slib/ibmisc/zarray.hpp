@@ -5,7 +5,9 @@
 #include <blitz/array.h>
 #include <spsparse/zvector.hpp>
 #include <spsparse/sparsearray.hpp>
+#include <ibmisc/footprint.hpp>
 #include <ibmisc/netcdf.hpp>
+#include <ibmisc/parallel.hpp>
 #include <ibmisc/stdio.hpp>
 
 namespace ibmisc {
@@ -27,11 +29,27 @@ private:
     long &nnz;
 
 public:
+    /** @param block_size If >0, write block-framed ZVectors that can be
+        decoded in pieces (see spsparse::zvblock).
+    @param codec Compressor for the indices and values
+    @param level Codec-specific compression level (<0 = default)
+    @param packed Encode indices as ZVAlgo::PACKED and values as
+        ZVAlgo::XORSHUF, rather than DIFFS / PLAIN.
+    @param nthreads Compress blocks on this many threads (implies the
+        block-framed format).
+    @param native_endian Store in the host's byte order (see
+        spsparse::vaccum::ZVector). */
     ZArray_Accum(
         std::vector<char> &_indices,    // Holds std::array<IndexT,RANK>
         std::vector<char> &_values,     // Holds std::array<ValueT,1>
         std::array<long,RANK> &_shape,
-        long &_nnz);
+        long &_nnz,
+        long block_size = 0,
+        spsparse::ZVCodec codec = spsparse::ZVCodec::ZLIB,
+        int level = -1,
+        bool packed = false,
+        int nthreads = 1,
+        bool native_endian = false);
 
     void add(std::array<IndexT,RANK> const &index, ValueT const &value)
     {
@@ -51,16 +69,26 @@ ZArray_Accum<IndexT,ValueT,RANK>::
         std::vector<char> &_indices,    // Holds std::array<IndexT,RANK>
         std::vector<char> &_values,     // Holds std::array<ValueT,1>
         std::array<long,RANK> &_shape,
-        long &_nnz)
-    : indices(_indices, spsparse::ZVAlgo::DIFFS),
-        values(_values, spsparse::ZVAlgo::PLAIN),
+        long &_nnz,
+        long block_size,
+        spsparse::ZVCodec codec,
+        int level,
+        bool packed,
+        int nthreads,
+        bool native_endian)
+    : indices(_indices, packed ? spsparse::ZVAlgo::PACKED : spsparse::ZVAlgo::DIFFS,
+            block_size, codec, level, nthreads, native_endian),
+        values(_values, packed ? spsparse::ZVAlgo::XORSHUF : spsparse::ZVAlgo::PLAIN,
+            block_size, codec, level, nthreads, native_endian),
         shape(_shape), nnz(_nnz)
     {}
 
 
 // ========================================================================
 
-template<class IndexT, class ValueT, int RANK>
+/** Iterates over a ZArray's elements.
+@param CHECKED Check that indices and values come out the same length? */
+template<class IndexT, class ValueT, int RANK, bool CHECKED = checked_default>
 class ZArray_Generator {
     spsparse::vgen::ZVector<IndexT,RANK> indices;
     spsparse::vgen::ZVector<ValueT,1> values;
@@ -71,8 +99,20 @@ public:
         std::vector<char> &_values)     // Holds std::array<ValueT,1>
     : indices(_indices), values(_values) {}
 
+    /** Generate only blocks [block0, block1) */
+    ZArray_Generator(
+        std::vector<char> &_indices,
+        std::vector<char> &_values,
+        long block0, long block1)
+    : indices(_indices, block0, block1), values(_values, block0, block1) {}
+
     bool operator++();
 
+    /** Decodes up to nmax elements at once; faster than operator++()
+    for callers that can consume batches.
+    @return Number decoded; <nmax only at the end. */
+    long next_batch(std::array<IndexT,RANK> *_indices, ValueT *_values, long nmax);
+
     IndexT index(int ix) const
         { return (*indices)[ix]; }
 
@@ -83,17 +123,30 @@ public:
         { return (*values)[0]; }
 
 
-    ZArray_Generator<IndexT,ValueT,RANK> const *operator->() const { return this; }
+    ZArray_Generator<IndexT,ValueT,RANK,CHECKED> const *operator->() const { return this; }
 };
 
-template<class IndexT, class ValueT, int RANK>
-bool ZArray_Generator<IndexT,ValueT,RANK>::
+template<class IndexT, class ValueT, int RANK, bool CHECKED>
+long ZArray_Generator<IndexT,ValueT,RANK,CHECKED>::
+    next_batch(std::array<IndexT,RANK> *_indices, ValueT *_values, long nmax)
+    {
+        static_assert(sizeof(std::array<ValueT,1>) == sizeof(ValueT),
+            "std::array<ValueT,1> must be layout-compatible with ValueT");
+        long const ni = indices.next_batch(_indices, nmax);
+        long const nv = values.next_batch((std::array<ValueT,1> *)_values, nmax);
+        if (CHECKED && ni != nv) (*ibmisc_error)(-1,
+            "All iterators should be of same length (%ld vs %ld)", ni, nv);
+        return ni;
+    }
+
+template<class IndexT, class ValueT, int RANK, bool CHECKED>
+bool ZArray_Generator<IndexT,ValueT,RANK,CHECKED>::
     operator++()
     {
         // Increment the iterators
         bool good_indices = ++indices;
         bool good_values = ++values;
-        if (good_indices != good_values) (*ibmisc_error)(-1,
+        if (CHECKED && good_indices != good_values) (*ibmisc_error)(-1,
             "All iterators should be of same length (more debugging needed here)");
 		// if (good_indices) printf("   ++  (%d, %d) %g\n", (*indices)[0], (*indices)[1], (*values)[0]);
         return good_indices;
@@ -111,13 +164,20 @@ TODO: Add a ValueEqualT template parameter, to allow the user to change it if ne
 template<class IndexT, class ValueT, int RANK>
 class ZArray {
 
-    friend class ZArray_Generator<IndexT,ValueT,RANK>;
+    template<class, class, int, bool> friend class ZArray_Generator;
 
     std::vector<char> indices;    // Holds std::array<IndexT,RANK>
     std::vector<char> values;     // Holds std::array<ValueT,1>
     long _nnz;    // Number of elements added to this ZArray
     std::array<long, RANK> _shape;
 
+    /** Skip table: [min, max] of index 0 in each block (empty if not
+    built, or if elements were added since).  See index_blocks(). */
+    std::vector<std::array<IndexT,2>> _block_rows;
+
+    /** Range of index 0 in block b; {max,min} if the block is empty */
+    std::array<IndexT,2> block_rows(long b) const;
+
 public:
     ZArray() : _nnz(0)
     {
@@ -134,19 +194,120 @@ public:
     void ncio(NcIO &ncio, std::string const &vname);
 
     typedef ZArray_Accum<IndexT,ValueT,RANK> accum_type;
-    /** Creates an encoder */
-    accum_type accum()
-        { return accum_type(indices, values, _shape, _nnz); }
+    /** Creates an encoder
+    @param block_size If >0, encode in independently decodable blocks
+        of this many elements.
+    @param codec Compressor to use; stored as the "codec" attribute
+        when written to NetCDF.
+    @param packed Use bit-packed indices and byte-shuffled values
+        (see ZVAlgo::PACKED, ZVAlgo::XORSHUF).
+    @param nthreads Compress on this many threads; the result decodes
+        the same as a single-threaded encoding.
+    @param native_endian Skip byte swapping, for scratch copies read
+        back on the same kind of machine; eg with codec=NONE. */
+    accum_type accum(long block_size = 0,
+        spsparse::ZVCodec codec = spsparse::ZVCodec::ZLIB, int level = -1,
+        bool packed = false, int nthreads = 1, bool native_endian = false)
+    {
+        _block_rows.clear();
+        return accum_type(indices, values, _shape, _nnz, block_size, codec, level,
+            packed, nthreads, native_endian);
+    }
+
+    /** Compressed buffers; raw_bytes is what the same elements would
+    take uncompressed. */
+    MemoryFootprint memory_footprint(std::string const &name = "ZArray") const
+    {
+        MemoryFootprint ret(name);
+        ret.add(compressed_footprint("indices", indices, _nnz * RANK * sizeof(IndexT)));
+        ret.add(compressed_footprint("values", values, _nnz * sizeof(ValueT)));
+        ret.add(vector_footprint("block_rows", _block_rows));
+        return ret;
+    }
+
+    /** Codec this ZArray was encoded with */
+    spsparse::ZVCodec codec() const
+        { return spsparse::zvblock::codec(indices); }
 
 
     typedef ZArray_Generator<IndexT,ValueT,RANK> generator_type;
-    generator_type generator() const
+
+    /** @param CHECKED See ZArray_Generator */
+    template<bool CHECKED = checked_default>
+    ZArray_Generator<IndexT,ValueT,RANK,CHECKED> generator() const
     {
-        return generator_type(
+        return ZArray_Generator<IndexT,ValueT,RANK,CHECKED>(
             *const_cast<std::vector<char> *>(&indices),
             *const_cast<std::vector<char> *>(&values));
     }
 
+    /** Number of independently decodable blocks (1 unless encoded
+    with a block_size) */
+    long nblocks() const
+        { return spsparse::zvblock::nblocks(indices); }
+
+    /** Generates elements in blocks [block0, block1) only.  Different
+    block ranges may be generated concurrently, by separate threads. */
+    template<bool CHECKED = checked_default>
+    ZArray_Generator<IndexT,ValueT,RANK,CHECKED> generator(long block0, long block1) const
+    {
+        return ZArray_Generator<IndexT,ValueT,RANK,CHECKED>(
+            *const_cast<std::vector<char> *>(&indices),
+            *const_cast<std::vector<char> *>(&values),
+            block0, block1);
+    }
+
+
+    /** True if encoded in independently decodable blocks, which
+    splice() can replace one at a time. */
+    bool framed() const
+        { return spsparse::zvblock::is_framed(indices); }
+
+    /** Builds the skip table used by blocks_for_rows(): the range of
+    index 0 ("rows") in each block.  Decodes the indices only.  It is
+    kept up to date by splice(), concat() and ncio(); adding elements
+    with accum() drops it.
+    Useful for framed arrays encoded in row order, where each block
+    covers a narrow range of rows. */
+    void index_blocks(int nthreads = 1);
+
+    /** True if index_blocks() is up to date */
+    bool blocks_indexed() const
+        { return !_block_rows.empty() && (long)_block_rows.size() == nblocks(); }
+
+    /** @return Blocks that might hold elements with index 0 in [i0, i1),
+    ascending.  All blocks, unless blocks_indexed(). */
+    std::vector<long> blocks_for_rows(IndexT i0, IndexT i1) const;
+
+    /** Reads, from a file written by ncio(), only the blocks that might
+    hold elements with index 0 in any of row_ranges (according to the
+    skip table; see blocks_for_rows()), each with a hyperslab read.  So
+    each MPI rank, say, can load just the rows it owns: elements in
+    other rows may come along, but the rest of the array is never read.
+    If the array was not written framed and with a skip table, reads it
+    all (as ncio()).
+    @param row_ranges Half-open ranges {i0, i1} of index 0 */
+    void nc_read_rows(NcIO &ncio, std::string const &vname,
+        std::vector<std::array<IndexT,2>> const &row_ranges);
+
+private:
+    /** Reads the listed blocks of a block-framed buffer stored in ncvar,
+    and assembles them into zbuf.  (Helper for nc_read_rows()) */
+    static void nc_read_blocks(netCDF::NcVar ncvar,
+        std::vector<long> const &blocks, long nblocks, std::vector<char> &zbuf);
+
+public:
+    /** Replaces blocks [block0, block1) with new elements, encoded the
+    same way as the rest of this ZArray.  Blocks outside the range are
+    not decoded or re-encoded.  Requires framed(). */
+    void splice(long block0, long block1,
+        std::vector<std::array<IndexT,RANK>> const &new_indices,
+        std::vector<ValueT> const &new_values);
+
+    /** Joins framed ZArrays, encoded alike, end to end; eg pieces of
+    one array encoded in parallel.  Blocks are copied, not re-encoded. */
+    static ZArray<IndexT,ValueT,RANK> concat(
+        std::vector<ZArray<IndexT,ValueT,RANK>> const &parts);
 
     template<class AccumT>
     void spcopy(AccumT &&ret) const
@@ -159,6 +320,119 @@ public:
 };
 
 
+template<class IndexT, class ValueT, int RANK>
+void ZArray<IndexT,ValueT,RANK>::
+    splice(long block0, long block1,
+        std::vector<std::array<IndexT,RANK>> const &new_indices,
+        std::vector<ValueT> const &new_values)
+    {
+        if (new_indices.size() != new_values.size()) (*ibmisc_error)(-1,
+            "Indices and values must have the same length (%ld vs %ld)",
+            (long)new_indices.size(), (long)new_values.size());
+        spsparse::zvblock::Index const ix(spsparse::zvblock::read_index(indices));
+        if (block0 < 0 || block0 > block1 || block1 > (long)ix.blocks.size()) (*ibmisc_error)(-1,
+            "Block range [%ld, %ld) out of range for %ld blocks",
+            block0, block1, (long)ix.blocks.size());
+
+        long removed = 0;
+        for (long b=block0; b<block1; ++b) removed += ix.blocks[b].n;
+
+        // Encode the replacement blocks like the originals
+        ZArray<IndexT,ValueT,RANK> repl(_shape);
+        {
+            auto accum(repl.accum(ix.block_size, ix.codec, -1,
+                ix.algo == spsparse::ZVAlgo::PACKED, 1,
+                ix.byte_order != spsparse::zvblock::ByteOrder::BIG));
+            for (size_t i=0; i<new_indices.size(); ++i)
+                accum.add(new_indices[i], new_values[i]);
+        }
+
+        bool const indexed = blocks_indexed();
+        if (indexed) {
+            repl.index_blocks();
+            _block_rows.erase(_block_rows.begin() + block0, _block_rows.begin() + block1);
+            _block_rows.insert(_block_rows.begin() + block0,
+                repl._block_rows.begin(), repl._block_rows.end());
+        } else {
+            _block_rows.clear();
+        }
+
+        spsparse::zvblock::splice(indices, block0, block1, repl.indices);
+        spsparse::zvblock::splice(values, block0, block1, repl.values);
+        _nnz += repl._nnz - removed;
+    }
+
+template<class IndexT, class ValueT, int RANK>
+std::array<IndexT,2> ZArray<IndexT,ValueT,RANK>::
+    block_rows(long b) const
+    {
+        std::array<IndexT,2> ret {
+            std::numeric_limits<IndexT>::max(), std::numeric_limits<IndexT>::lowest()};
+        spsparse::vgen::ZVector<IndexT,RANK> gen(indices, b, b+1);
+        while (++gen) {
+            IndexT const i = (*gen)[0];
+            if (i < ret[0]) ret[0] = i;
+            if (i > ret[1]) ret[1] = i;
+        }
+        return ret;
+    }
+
+template<class IndexT, class ValueT, int RANK>
+void ZArray<IndexT,ValueT,RANK>::
+    index_blocks(int nthreads)
+    {
+        long const nb = nblocks();
+        std::vector<std::array<IndexT,2>> rows(nb);
+        parallel_for(0, nb, nthreads, [&](long b0, long b1) {
+            for (long b=b0; b<b1; ++b) rows[b] = block_rows(b);
+        });
+        _block_rows = std::move(rows);
+    }
+
+template<class IndexT, class ValueT, int RANK>
+std::vector<long> ZArray<IndexT,ValueT,RANK>::
+    blocks_for_rows(IndexT i0, IndexT i1) const
+    {
+        std::vector<long> ret;
+        if (!blocks_indexed()) {
+            long const nb = nblocks();
+            ret.reserve(nb);
+            for (long b=0; b<nb; ++b) ret.push_back(b);
+        } else {
+            for (size_t b=0; b<_block_rows.size(); ++b) {
+                if (_block_rows[b][0] < i1 && _block_rows[b][1] >= i0) ret.push_back(b);
+            }
+        }
+        return ret;
+    }
+
+template<class IndexT, class ValueT, int RANK>
+ZArray<IndexT,ValueT,RANK> ZArray<IndexT,ValueT,RANK>::
+    concat(std::vector<ZArray<IndexT,ValueT,RANK>> const &parts)
+    {
+        if (parts.empty()) (*ibmisc_error)(-1,
+            "ZArray::concat() needs at least one part");
+
+        ZArray<IndexT,ValueT,RANK> ret(parts[0]._shape);
+        std::vector<std::vector<char> const *> pindices, pvalues;
+        bool indexed = true;
+        for (auto const &part : parts) {
+            if (part._shape != ret._shape) (*ibmisc_error)(-1,
+                "ZArray::concat(): parts must have the same shape");
+            pindices.push_back(&part.indices);
+            pvalues.push_back(&part.values);
+            ret._nnz += part._nnz;
+            indexed = indexed && part.blocks_indexed();
+        }
+        spsparse::zvblock::concat(ret.indices, pindices);
+        spsparse::zvblock::concat(ret.values, pvalues);
+        if (indexed) {
+            for (auto const &part : parts) ret._block_rows.insert(
+                ret._block_rows.end(), part._block_rows.begin(), part._block_rows.end());
+        }
+        return ret;
+    }
+
 template<class IndexT, class ValueT, int RANK>
 void ZArray<IndexT,ValueT,RANK>::
     ncio(NcIO &ncio, std::string const &vname)
@@ -171,6 +445,46 @@ void ZArray<IndexT,ValueT,RANK>::
         get_or_put_att(info_v, ncio.rw, "nnz", "int64", &_nnz, 1);
         get_or_put_att(info_v, ncio.rw, "shape", "int64", &_shape[0], RANK);
 
+        // Absent in older files, which are always zlib
+        std::string scodec(spsparse::to_string(codec()));
+        if (ncio.rw == 'w' || info_v.getAtts().count("codec") > 0)
+            get_or_put_att(info_v, ncio.rw, "codec", scodec, false);
+        else
+            scodec = spsparse::to_string(spsparse::ZVCodec::ZLIB);
+        if (ncio.rw == 'r' && !spsparse::have_zvcodec(spsparse::parse_zvcodec(scodec)))
+            (*ibmisc_error)(-1,
+                "ZArray %s uses codec %s, which is not available in this build",
+                vname.c_str(), scodec.c_str());
+
+        // Block layout, for the convenience of readers that split up
+        // the work.  (The buffers' own index is authoritative.)
+        if (ncio.rw == 'w' && framed()) {
+            spsparse::zvblock::Index const ix(spsparse::zvblock::read_index(indices));
+            std::vector<int64_t> block_nnz;
+            block_nnz.reserve(ix.blocks.size());
+            for (auto const &blk : ix.blocks) block_nnz.push_back(blk.n);
+            int64_t block_size = ix.block_size;
+            get_or_put_att(info_v, ncio.rw, "block_size", "int64", &block_size, 1);
+            if (!block_nnz.empty())
+                get_or_put_att(info_v, ncio.rw, "block_nnz", "int64", block_nnz);
+        }
+
+        // Skip table (optional), as {min0, max0, min1, max1, ...}
+        std::vector<IndexT> block_rows;
+        if (ncio.rw == 'w') {
+            if (blocks_indexed()) {
+                for (auto const &rr : _block_rows) block_rows.insert(block_rows.end(), rr.begin(), rr.end());
+                get_or_put_att(info_v, ncio.rw, "block_rows", get_nc_type<IndexT>(), block_rows);
+            }
+        } else {
+            _block_rows.clear();
+            if (info_v.getAtts().count("block_rows") > 0) {
+                get_or_put_att(info_v, ncio.rw, "block_rows", get_nc_type<IndexT>(), block_rows);
+                for (size_t b=0; b+1 < block_rows.size(); b += 2)
+                    _block_rows.push_back({block_rows[b], block_rows[b+1]});
+            }
+        }
+
         netCDF::NcVar ncvar;
         ncvar = ncio_vector<char,uint8_t>(
             ncio, indices, true, vname+".indices", "ubyte",
@@ -185,6 +499,97 @@ void ZArray<IndexT,ValueT,RANK>::
             ncvar.setCompression(false, false, 0);    // We're already compressing, NetCDF should not also compress
     }
 
+template<class IndexT, class ValueT, int RANK>
+void ZArray<IndexT,ValueT,RANK>::
+    nc_read_rows(NcIO &ncio, std::string const &vname,
+        std::vector<std::array<IndexT,2>> const &row_ranges)
+    {
+        auto info_v = ncio.getVar(vname + ".info");
+        if (info_v.isNull() || info_v.getAtts().count("block_rows") == 0) {
+            // No skip table: read it all
+            this->ncio(ncio, vname);
+            ncio();
+            return;
+        }
+
+        int rank;
+        get_or_put_att(info_v, 'r', "rank", "int", &rank, 1);
+        if (rank != RANK) (*ibmisc_error)(-1,
+            "ZArray %s has rank %d, expected %d", vname.c_str(), rank, RANK);
+        get_or_put_att(info_v, 'r', "shape", "int64", &_shape[0], RANK);
+
+        std::vector<IndexT> block_rows;
+        get_or_put_att(info_v, 'r', "block_rows", get_nc_type<IndexT>(), block_rows);
+        long const nb = block_rows.size() / 2;
+
+        // Blocks overlapping any of the ranges, ascending
+        std::vector<long> blocks;
+        _block_rows.clear();
+        for (long b=0; b<nb; ++b) {
+            for (auto const &rr : row_ranges) {
+                if (block_rows[2*b] < rr[1] && block_rows[2*b+1] >= rr[0]) {
+                    blocks.push_back(b);
+                    _block_rows.push_back({block_rows[2*b], block_rows[2*b+1]});
+                    break;
+                }
+            }
+        }
+
+        nc_read_blocks(ncio.getVar(vname + ".indices"), blocks, nb, indices);
+        nc_read_blocks(ncio.getVar(vname + ".values"), blocks, nb, values);
+        _nnz = spsparse::zvblock::read_index(indices).ntuples;
+        if (spsparse::zvblock::read_index(values).ntuples != _nnz) (*ibmisc_error)(-1,
+            "ZArray %s: indices and values blocks do not match", vname.c_str());
+    }
+
+template<class IndexT, class ValueT, int RANK>
+void ZArray<IndexT,ValueT,RANK>::
+    nc_read_blocks(netCDF::NcVar ncvar,
+        std::vector<long> const &blocks, long nblocks, std::vector<char> &zbuf)
+    {
+        namespace zvblock = spsparse::zvblock;
+
+        long const len = ncvar.getDim(0).getSize();
+        auto read = [&ncvar](long start, long count, char *out) {
+            if (count > 0) ncvar.getVar(
+                std::vector<size_t>{(size_t)start}, std::vector<size_t>{(size_t)count},
+                (unsigned char *)out);
+        };
+
+        // Header, then the whole index
+        std::vector<char> head(std::min(len, zvblock::max_header_nbytes));
+        read(0, head.size(), head.data());
+        long const nindex = zvblock::index_nbytes(head.data(), head.data() + head.size());
+        if (nindex > len) (*ibmisc_error)(-1,
+            "ZArray variable %s is truncated", ncvar.getName().c_str());
+        head.resize(nindex);
+        read(0, nindex, head.data());
+        zvblock::Index const ix(zvblock::read_index(
+            head.data(), head.data() + nindex, len - nindex));
+        if ((long)ix.blocks.size() != nblocks) (*ibmisc_error)(-1,
+            "ZArray variable %s has %ld blocks, but its skip table has %ld",
+            ncvar.getName().c_str(), (long)ix.blocks.size(), nblocks);
+
+        // Just the blocks we want, still compressed
+        size_t const base_size = ix.rank * ix.int_size;
+        std::vector<zvblock::Block> out_blocks;
+        std::vector<char> bases, payload;
+        long ntuples = 0;
+        for (long b : blocks) {
+            zvblock::Block blk(ix.blocks[b]);
+            long const offset = payload.size();
+            payload.resize(offset + blk.zsize);
+            read(nindex + blk.offset, blk.zsize, payload.data() + offset);
+            blk.offset = offset;
+            out_blocks.push_back(blk);
+            bases.insert(bases.end(), ix.bases.begin() + b*base_size,
+                ix.bases.begin() + (b+1)*base_size);
+            ntuples += blk.n;
+        }
+        zvblock::write_framed(zbuf, ix.algo, ix.rank, ix.int_size, ix.codec,
+            ix.byte_order, ix.block_size, ntuples, out_blocks, bases, payload);
+    }
+
 // ---------------------------------------------------------------------
 } // namespace ibmisc
 #endif
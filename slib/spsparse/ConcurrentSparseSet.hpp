@@ -0,0 +1,223 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSPARSE_CONCURRENT_SPARSE_SET_HPP
+#define SPSPARSE_CONCURRENT_SPARSE_SET_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <spsparse/SparseSet.hpp>
+
+namespace spsparse {
+
+/** A SparseSet that many threads may add_dense() to at once, eg
+through one ADD_DENSE Sparsify per thread.
+
+Sparse indices are spread by hash over nstripes independently locked
+stripes, each with its own FlatIndexMap; dense indices come from one
+atomic counter.  Dense numbering therefore depends on thread timing;
+to_sparse_set() can renumber it canonically (by ascending sparse
+index), with a map to fix up anything already built with the raw
+numbering (see accum::renumber()).
+
+    ConcurrentSparseSet<long,int> cdim(nB);
+    ParallelAccum<int,double,2> pacc(nthreads);
+    parallel_for(0, n, nthreads, [&](long i0, long i1) {
+        auto acc(accum::add_dense({&cdim, &cdim_A}, accum::ref(pacc.part(...))));
+        ...
+    });
+    std::vector<int> new_of_old;
+    SparseSet<long,int> dim(cdim.to_sparse_set(true, &new_of_old));
+*/
+template<class SparseT, class DenseT>
+class ConcurrentSparseSet {
+    struct Stripe {
+        std::mutex mtx;
+        FlatIndexMap<SparseT, DenseT> s2d;
+        std::vector<SparseT> sparse;    // Sparse indices added here...
+        std::vector<DenseT> dense;      // ...and their dense indices
+    };
+
+    SparseT _sparse_extent;
+    std::vector<std::unique_ptr<Stripe>> _stripes;
+    size_t _mask;    // _stripes.size() - 1
+    std::atomic<DenseT> _next;
+
+    /** Low bits of the mixed key; FlatIndexMap takes the top bits, so
+    keys of one stripe don't all land in the same part of its table */
+    Stripe &stripe(SparseT const &sval) const
+        { return *_stripes[(size_t)ibmisc::hash_mix((uint64_t)sval) & _mask]; }
+
+public:
+    typedef SparseT sparse_type;
+    typedef DenseT dense_type;
+
+    /** @param nstripes Number of locks; rounded up to a power of 2.
+        A few times the number of threads keeps contention low. */
+    ConcurrentSparseSet(SparseT sparse_extent = -1, int nstripes = 64)
+        : _sparse_extent(sparse_extent), _next(0)
+    {
+        int bits = 0;
+        while ((1 << bits) < nstripes) ++bits;
+        _mask = ((size_t)1 << bits) - 1;
+        for (int i=0; i < (1 << bits); ++i) _stripes.push_back(
+            std::unique_ptr<Stripe>(new Stripe));
+    }
+
+    SparseT sparse_extent() const
+        { return _sparse_extent; }
+
+    /** Number of dense indices handed out so far */
+    DenseT dense_extent() const
+        { return _next.load(); }
+
+    DenseT add_dense(SparseT const &sval)
+    {
+        Stripe &st(stripe(sval));
+        std::lock_guard<std::mutex> lock(st.mtx);
+        DenseT ix = st.s2d.find(sval);
+        if (ix < 0) {
+            ix = _next++;
+            st.s2d.insert(sval, ix);
+            st.sparse.push_back(sval);
+            st.dense.push_back(ix);
+        }
+        return ix;
+    }
+
+    bool to_dense_ignore_missing(SparseT const &sval, DenseT &dense_ix)
+    {
+        Stripe &st(stripe(sval));
+        std::lock_guard<std::mutex> lock(st.mtx);
+        DenseT const ix = st.s2d.find(sval);
+        if (ix < 0) return false;
+        dense_ix = ix;
+        return true;
+    }
+
+    DenseT to_dense(SparseT const &sval)
+    {
+        DenseT ix;
+        if (!to_dense_ignore_missing(sval, ix)) (*ibmisc::ibmisc_error)(-1,
+            "Sparse value %ld not found in ConcurrentSparseSet", (long)sval);
+        return ix;
+    }
+
+    /** Not kept while adding; use to_sparse_set() first. */
+    SparseT to_sparse(DenseT const &dval) const
+    {
+        (*ibmisc::ibmisc_error)(-1,
+            "ConcurrentSparseSet::to_sparse() is not available; use to_sparse_set()");
+        return -1;
+    }
+
+    /** Collects the set into an ordinary SparseSet.  Not thread-safe:
+    call once all threads are done adding.
+    @param canonicalize If true, renumber the dense space by ascending
+        sparse index, so the result does not depend on thread timing.
+    @param new_of_old If not null, set to the new dense index of each
+        dense index handed out by add_dense(). */
+    SparseSet<SparseT, DenseT> to_sparse_set(
+        bool canonicalize = true,
+        std::vector<DenseT> *new_of_old = nullptr) const;
+};
+
+template<class SparseT, class DenseT>
+SparseSet<SparseT, DenseT> ConcurrentSparseSet<SparseT, DenseT>::to_sparse_set(
+    bool canonicalize,
+    std::vector<DenseT> *new_of_old) const
+{
+    size_t const n = dense_extent();
+    std::vector<SparseT> d2s(n);
+    for (auto const &st : _stripes) {
+        for (size_t k=0; k<st->dense.size(); ++k) d2s[st->dense[k]] = st->sparse[k];
+    }
+
+    if (!canonicalize) {
+        if (new_of_old) {
+            new_of_old->resize(n);
+            for (size_t i=0; i<n; ++i) (*new_of_old)[i] = i;
+        }
+        return SparseSet<SparseT, DenseT>(_sparse_extent, std::move(d2s));
+    }
+
+    std::vector<DenseT> old_of_new(n);
+    for (size_t i=0; i<n; ++i) old_of_new[i] = i;
+    std::sort(old_of_new.begin(), old_of_new.end(),
+        [&d2s](DenseT a, DenseT b) { return d2s[a] < d2s[b]; });
+
+    std::vector<SparseT> sorted;
+    sorted.reserve(n);
+    for (DenseT const old : old_of_new) sorted.push_back(d2s[old]);
+    if (new_of_old) {
+        new_of_old->resize(n);
+        for (size_t i=0; i<n; ++i) (*new_of_old)[old_of_new[i]] = i;
+    }
+    return SparseSet<SparseT, DenseT>(_sparse_extent, std::move(sorted));
+}
+
+// -----------------------------------------------------------
+namespace accum {
+
+/** Renumbers indices, in the dimensions that have a map, by
+index2[i] = (*new_of_old[i])[index[i]]; eg to move a matrix built with
+a ConcurrentSparseSet onto the canonical numbering. */
+template<class AccumT>
+class Renumber : public Filter<AccumT>
+{
+    typedef Filter<AccumT> super;
+    typedef typename super::index_type index_type;
+    std::array<std::vector<index_type> const *, super::rank> new_of_old;
+    std::vector<std::array<index_type, super::rank>> _bindices;
+
+public:
+    Renumber(
+        std::array<std::vector<index_type> const *, super::rank> const &_new_of_old,
+        AccumT &&_sub)
+        : super(std::move(_sub)), new_of_old(_new_of_old) {}
+
+    void add(std::array<index_type, super::rank> index, typename super::val_type const &val)
+    {
+        for (int i=0; i<super::rank; ++i)
+            if (new_of_old[i]) index[i] = (*new_of_old[i])[index[i]];
+        super::sub.add(index, val);
+    }
+
+    void add_batch(
+        std::array<index_type, super::rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        _bindices.assign(indices, indices+n);
+        for (auto &index : _bindices) {
+            for (int i=0; i<super::rank; ++i)
+                if (new_of_old[i]) index[i] = (*new_of_old[i])[index[i]];
+        }
+        if (n > 0) accum::add_batch(super::sub, &_bindices[0], vals, n);
+    }
+};
+
+template<class AccumT>
+inline Renumber<AccumT> renumber(
+    std::array<std::vector<typename AccumT::index_type> const *, AccumT::rank> const &new_of_old,
+    AccumT &&sub)
+    { return Renumber<AccumT>(new_of_old, std::move(sub)); }
+
+}    // namespace accum
+}    // namespace spsparse
+#endif    // guard
@@ -18,28 +18,103 @@
 
 #pragma once
 
-#include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <ibmisc/array.hpp>
+#include <ibmisc/footprint.hpp>
 #include <ibmisc/netcdf.hpp>
 #include <ibmisc/permutation.hpp>
+#include <ibmisc/profile.hpp>
+#include <ibmisc/radix_sort.hpp>
 #include <spsparse/accum.hpp>
 #include <spsparse/blitz.hpp>
+#include <spsparse/flatmap.hpp>
 #include <ibmisc/bundle.hpp>
 
 //using namespace netCDF;
 
 namespace spsparse {
 
+namespace _sparse_set {
+
+/** An atomic flag that may be copied (the copy gets its current value) */
+class Flag {
+    std::atomic<bool> _val;
+public:
+    Flag(bool val = false) : _val(val) {}
+    Flag(Flag const &other) : _val(other.load()) {}
+    Flag &operator=(Flag const &other)
+        { store(other.load()); return *this; }
+
+    bool load() const
+        { return _val.load(std::memory_order_acquire); }
+    void store(bool val)
+        { _val.store(val, std::memory_order_release); }
+};
+
+/** Serializes lazy builds of SparseSet::_s2d */
+inline std::mutex &build_mutex()
+{
+    static std::mutex mtx;
+    return mtx;
+}
+
+}    // namespace spsparse::_sparse_set
+
 /** Translates between a sparse set (say, the set of indices used in a
-SparseVector) and a dense set numbered [0...n) */
-template<class SparseT, class DenseT>
+SparseVector) and a dense set numbered [0...n)
+@param CHECKED Raise an error on unknown values in to_dense() and
+    to_sparse()?  Unchecked, to_dense() returns -1 for them. */
+template<class SparseT, class DenseT, bool CHECKED = ibmisc::checked_default>
 class SparseSet {
     SparseT _sparse_extent;
-    std::unordered_map<SparseT, DenseT> _s2d;
     std::vector<SparseT> _d2s;
     std::string name;    // OPTIONAL: For debugging, and ncio()
 
+    /** Sparse-to-dense lookup.  Built lazily, on the first query that
+    needs it: sets whose _d2s is ascending are searched directly
+    instead, and never build it. */
+    mutable FlatIndexMap<SparseT, DenseT> _s2d;
+    mutable _sparse_set::Flag _s2d_built;
+    bool _sorted;    // _d2s is strictly ascending
+
+    /** Forgets _s2d, after _d2s has been replaced wholesale */
+    void reset_s2d()
+    {
+        _s2d.clear();
+        _s2d_built.store(false);
+        _sorted = std::is_sorted(_d2s.begin(), _d2s.end(), std::less_equal<SparseT>());
+    }
+
+    /** Builds _s2d from _d2s, if not already built.  Safe to call
+    from several threads at once. */
+    void build_s2d() const
+    {
+        if (_s2d_built.load()) return;
+        std::lock_guard<std::mutex> lock(_sparse_set::build_mutex());
+        if (_s2d_built.load()) return;
+
+        _s2d.clear();
+        _s2d.set_key_extent(_sparse_extent);
+        _s2d.reserve(_d2s.size());
+        for (size_t ix=0; ix<_d2s.size(); ++ix) _s2d.insert(_d2s[ix], (DenseT)ix);
+        _s2d_built.store(true);
+    }
+
+    /** @return Dense index of sval, or -1 */
+    DenseT find(SparseT const &sval) const
+    {
+        if (!_s2d_built.load()) {
+            if (_sorted) {
+                auto ii(std::lower_bound(_d2s.begin(), _d2s.end(), sval));
+                return (ii != _d2s.end() && *ii == sval) ? DenseT(ii - _d2s.begin()) : DenseT(-1);
+            }
+            build_s2d();
+        }
+        return _s2d.find(sval);
+    }
+
 public:
     typedef SparseT sparse_type;
     typedef DenseT dense_type;
@@ -47,15 +122,17 @@ public:
 
     netCDF::NcVar ncio(ibmisc::NcIO &ncio, std::string const &vname_prefix);
 
-    SparseSet() : _sparse_extent(-1) {}
-    SparseSet(SparseT sparse_extent) : _sparse_extent(sparse_extent) {}
+    SparseSet() : _sparse_extent(-1), _s2d_built(true), _sorted(true) {}
+    SparseSet(SparseT sparse_extent)
+        : _sparse_extent(sparse_extent), _s2d_built(true), _sorted(true)
+        { _s2d.set_key_extent(sparse_extent); }
 
     SparseSet(SparseT sparse_extent, std::vector<SparseT> &&d2s);
 
     void clear();
 
     bool in_sparse(SparseT const &sparse_ix) const
-        { return _s2d.find(sparse_ix) != _s2d.end(); }
+        { return find(sparse_ix) >= 0; }
 
     bool in_dense(DenseT dense_ix) const
         { return (dense_ix >= 0 && dense_ix < dense_extent()); }
@@ -68,12 +145,25 @@ public:
     DenseT dense_extent() const
         { return _d2s.size(); }
 
+    /** Memory held by both directions of the mapping */
+    ibmisc::MemoryFootprint memory_footprint(std::string const &name = "SparseSet") const
+    {
+        ibmisc::MemoryFootprint ret(name);
+        ret.add(_s2d.memory_footprint("s2d"));
+        ret.add(ibmisc::vector_footprint("d2s", _d2s));
+        return ret;
+    }
+
+    /** Dense-to-sparse mapping: d2s()[dense_ix] = sparse_ix */
+    std::vector<SparseT> const &d2s() const
+        { return _d2s; }
+
     /** Helper function used by Sparsify to maintain encapsulation */
     bool to_dense_ignore_missing(SparseT const &sparse_ix, DenseT &dense_ix)
     {
-        auto ii(_s2d.find(sparse_ix));
-        if (ii == _s2d.end()) return false;    // An index was missing; ignore this element in the sparse matrix
-        dense_ix = ii->second;
+        DenseT const ix = find(sparse_ix);
+        if (ix < 0) return false;    // An index was missing; ignore this element in the sparse matrix
+        dense_ix = ix;
         return true;
 
     }
@@ -81,10 +171,7 @@ public:
 private:
     void add(SparseT sparse_index)
     {
-        if (_s2d.find(sparse_index) == _s2d.end()) {
-            _s2d.insert(std::pair<SparseT,DenseT>(sparse_index, dense_extent()));
-            _d2s.push_back(sparse_index);
-        }
+        add_dense(sparse_index);
     }
 
     template<class IterT>
@@ -95,74 +182,94 @@ private:
 
 public:
 
+    /** Adds a range of sparse indices, in sorted order.  Integer
+    indices are radix sorted, over nthreads when there are many. */
     template<class IterT>
-    void add_sorted(IterT sparsei, IterT const &sparse_end)
+    void add_sorted(IterT sparsei, IterT const &sparse_end, int nthreads=1)
     {
         std::vector<SparseT> sorted;
         for (; sparsei != sparse_end; ++sparsei) sorted.push_back(*sparsei);
-        std::sort(sorted.begin(), sorted.end());
+        ibmisc::fast_sort(sorted, nthreads);
 
         add(sorted.begin(), sorted.end());
     }
 
     DenseT add_dense(SparseT const &sval)
     {
-        auto ii(_s2d.find(sval));
-        if (ii == _s2d.end()) {
-            auto densei(dense_extent());
-            _s2d.insert(std::pair<SparseT,DenseT>(sval, densei));
+        DenseT const densei = dense_extent();
+        bool const ascending = (_d2s.empty() || sval > _d2s.back());
+        if (!_s2d_built.load()) {
+            // Appending in order keeps _d2s searchable without a map
+            if (_sorted && ascending) {
+                _d2s.push_back(sval);
+                return densei;
+            }
+            DenseT const ix = find(sval);
+            if (ix >= 0) return ix;
+            build_s2d();
+        }
+
+        DenseT const ix = _s2d.insert(sval, densei);
+        if (ix == densei) {
             _d2s.push_back(sval);
-            return densei;
-        } else {
-            return ii->second;
+            _sorted = _sorted && ascending;
         }
+        return ix;
     }
 
     DenseT to_dense(SparseT const &sval) const
     {
-        auto ii(_s2d.find(sval));
-        if (ii == _s2d.end()) {
-            std::stringstream sval_s;
-            sval_s << sval;
-            (*ibmisc::ibmisc_error)(-1,
-                "Sparse value %s not found in SparseSet", sval_s.str().c_str());
-        }
-        return ii->second;
+        DenseT const ix = find(sval);
+        if (CHECKED && ix < 0) (*ibmisc::ibmisc_error)(-1,
+            "Sparse value %ld not found in SparseSet", (long)sval);
+        return ix;
     }
 
     SparseT to_sparse(DenseT const &dval) const
     {
-        if (dval < 0 || dval >= _d2s.size()) {
+        if (CHECKED && (dval < 0 || dval >= _d2s.size())) {
             (*ibmisc::ibmisc_error)(-1,
                 "Value %ld is out of range (0, %ld)", (long)dval, _d2s.size());
         }
         return _d2s[dval];
     }
 
-    bool operator==(SparseSet<SparseT, DenseT> const &other) const
+    /** Renumbers the dense space: dense index n becomes what was
+    dense index old_of_new[n] (which must be a permutation of
+    [0, dense_extent())).  Anything indexed densely by this set must be
+    renumbered to match; see eg linear::permute_dense(). */
+    void permute_dense(std::vector<DenseT> const &old_of_new);
+
+    bool operator==(SparseSet<SparseT, DenseT, CHECKED> const &other) const
     {
         if (_sparse_extent != other._sparse_extent) return false;
         return _d2s == other._d2s;
     }
 
+    /** Serializes the dense-to-sparse mapping; _s2d is rebuilt
+    lazily after load */
+    template<class ArchiveT>
+    void serialize(ArchiveT &ar, const unsigned int file_version)
+    {
+        ar & _sparse_extent;
+        ar & _d2s;
+        ar & name;
+        if (ArchiveT::is_loading::value) reset_s2d();
+    }
+
 };
 
 
-template<class SparseT, class DenseT>
-SparseSet<SparseT, DenseT>::SparseSet(SparseT sparse_extent, std::vector<SparseT> &&d2s)
+template<class SparseT, class DenseT, bool CHECKED>
+SparseSet<SparseT, DenseT, CHECKED>::SparseSet(SparseT sparse_extent, std::vector<SparseT> &&d2s)
     : _sparse_extent(sparse_extent), _d2s(std::move(d2s))
 {
-    // Setup 2ds
-    for (size_t ix=0; ix<_d2s.size(); ++ix) {
-        DenseT const id = ix;
-        SparseT const is = _d2s[ix];
-        _s2d.insert(std::make_pair(is,id));
-    }
+    reset_s2d();
 }
 
 
-template<class SparseT, class DenseT>
-netCDF::NcVar SparseSet<SparseT, DenseT>::ncio(ibmisc::NcIO &ncio, std::string const &vname_prefix)
+template<class SparseT, class DenseT, bool CHECKED>
+netCDF::NcVar SparseSet<SparseT, DenseT, CHECKED>::ncio(ibmisc::NcIO &ncio, std::string const &vname_prefix)
 {
     std::string vname(vname_prefix + name);
 //printf("ncio %s: dense_extent=%d\n", vname.c_str(), dense_extent());
@@ -178,27 +285,43 @@ netCDF::NcVar SparseSet<SparseT, DenseT>::ncio(ibmisc::NcIO &ncio, std::string c
 
     ibmisc::get_or_put_att(ncvar, ncio.rw, "sparse_extent", &_sparse_extent, 1);
 
-    // Set up redundant data structure _s2d
-    if (ncio.rw == 'r') {
-        for (size_t ix=0; ix<_d2s.size(); ++ix) {
-            DenseT const id = ix;
-            SparseT const is = _d2s[ix];
-            _s2d.insert(std::make_pair(is,id));
-        }
-    }
+    // Redundant data structure _s2d is set up when first needed
+    if (ncio.rw == 'r') reset_s2d();
 
     return ncvar;
 }
 
-template<class SparseT, class DenseT>
-void SparseSet<SparseT, DenseT>::clear() {
+template<class SparseT, class DenseT, bool CHECKED>
+void SparseSet<SparseT, DenseT, CHECKED>::permute_dense(std::vector<DenseT> const &old_of_new)
+{
+    size_t const n = _d2s.size();
+    if (old_of_new.size() != n) (*ibmisc::ibmisc_error)(-1,
+        "Permutation has %ld elements; SparseSet has %ld", (long)old_of_new.size(), (long)n);
+
+    std::vector<char> seen(n, 0);
+    std::vector<SparseT> d2s;
+    d2s.reserve(n);
+    for (DenseT const old : old_of_new) {
+        if (old < 0 || (size_t)old >= n || seen[old]) (*ibmisc::ibmisc_error)(-1,
+            "Not a permutation of [0, %ld): %ld", (long)n, (long)old);
+        seen[old] = 1;
+        d2s.push_back(_d2s[old]);
+    }
+    _d2s = std::move(d2s);
+    reset_s2d();
+}
+
+template<class SparseT, class DenseT, bool CHECKED>
+void SparseSet<SparseT, DenseT, CHECKED>::clear() {
     _sparse_extent = -1;
     _s2d.clear();
+    _s2d_built.store(true);
+    _sorted = true;
     _d2s.clear();
 }
 
-template<class SparseT, class DenseT>
-void SparseSet<SparseT, DenseT>::set_sparse_extent(SparseT extent)
+template<class SparseT, class DenseT, bool CHECKED>
+void SparseSet<SparseT, DenseT, CHECKED>::set_sparse_extent(SparseT extent)
 {
     std::stringstream buf;
     if (_sparse_extent != -1 && _sparse_extent != extent) {
@@ -206,6 +329,7 @@ void SparseSet<SparseT, DenseT>::set_sparse_extent(SparseT extent)
         (*ibmisc::ibmisc_error)(-1, "%s", buf.str().c_str());
     }
     _sparse_extent = extent;
+    _s2d.set_key_extent(extent);
 }
 // ==================================================================
 /** Creates a SparseSet instances that is intentionally an
@@ -387,7 +511,7 @@ public:
         super::sub.set_shape(shape2);
     }
 
-    void add(std::array<index_type,super::rank> index, typename super::val_type const &val)
+    SPSPARSE_INLINE void add(std::array<index_type,super::rank> const &index, typename super::val_type const &val)
     {
         std::array<out_index_type, super::rank> index2;
 
@@ -427,6 +551,106 @@ public:
         }
         super::sub.add(index2, val);
     }
+
+private:
+    std::vector<std::array<out_index_type, super::rank>> _bindices;
+    std::vector<typename super::val_type> _bvals;
+    std::vector<char> _bkeep;
+
+    /** True if a SparseSet being added to (ADD_DENSE) is also looked up
+    in another dimension: then tuple order matters, and add_batch()
+    must go one tuple at a time. */
+    bool batch_order_matters() const
+    {
+        for (int i=0; i<super::rank; ++i) {
+            if (transforms[i] != SparsifyTransform::ADD_DENSE) continue;
+            for (int j=0; j<super::rank; ++j) {
+                if (j != i && sparse_sets[j] == sparse_sets[i]
+                    && transforms[j] != SparsifyTransform::ADD_DENSE) return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    /** Same result as calling add() on each element; but each
+    transform is dispatched once per batch, and the result is passed
+    on as a batch. */
+    void add_batch(
+        std::array<index_type,super::rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        IBMISC_SCOPED_TIMER("Sparsify::add_batch");
+        if (batch_order_matters()) {
+            for (size_t k=0; k<n; ++k) add(indices[k], vals[k]);
+            return;
+        }
+
+        _bindices.resize(n);
+        _bkeep.assign(n, 1);
+        bool dropped = false;
+
+        for (int ix=0; ix<super::rank; ++ix) {
+            int const i = process_order[ix];
+            SparseSetT *ss = sparse_sets[i];
+            switch(transforms[i]) {
+                case SparsifyTransform::ID:
+                case SparsifyTransform::KEEP_DENSE:
+                case SparsifyTransform::KEEP_SPARSE:
+                    for (size_t k=0; k<n; ++k) _bindices[k][i] = indices[k][i];
+                    break;
+                case SparsifyTransform::ADD_DENSE: {
+                    // Consecutive ADD_DENSE dims go tuple-by-tuple, so
+                    // dense indices are assigned in the same order as add()
+                    int ix1 = ix+1;
+                    while (ix1 < super::rank
+                        && transforms[process_order[ix1]] == SparsifyTransform::ADD_DENSE) ++ix1;
+                    for (size_t k=0; k<n; ++k) {
+                        if (!_bkeep[k]) continue;
+                        for (int jx=ix; jx<ix1; ++jx) {
+                            int const j = process_order[jx];
+                            _bindices[k][j] = sparse_sets[j]->add_dense(indices[k][j]);
+                        }
+                    }
+                    ix = ix1-1;
+                } break;
+                case SparsifyTransform::TO_DENSE_IGNORE_MISSING:
+                    for (size_t k=0; k<n; ++k) {
+                        typename SparseSetT::dense_type dense_ix;
+                        if (_bkeep[k] && ss->to_dense_ignore_missing(indices[k][i], dense_ix)) {
+                            _bindices[k][i] = dense_ix;
+                        } else {
+                            _bkeep[k] = 0;
+                            dropped = true;
+                        }
+                    }
+                    break;
+                case SparsifyTransform::TO_DENSE:
+                    for (size_t k=0; k<n; ++k)
+                        if (_bkeep[k]) _bindices[k][i] = ss->to_dense(indices[k][i]);
+                    break;
+                case SparsifyTransform::TO_SPARSE:
+                    for (size_t k=0; k<n; ++k)
+                        if (_bkeep[k]) _bindices[k][i] = ss->to_sparse(indices[k][i]);
+                    break;
+            }
+        }
+
+        if (!dropped) {
+            if (n > 0) spsparse::accum::add_batch(super::sub, &_bindices[0], vals, n);
+            return;
+        }
+
+        // Squeeze out the elements we dropped
+        _bvals.clear();
+        size_t m = 0;
+        for (size_t k=0; k<n; ++k) {
+            if (!_bkeep[k]) continue;
+            _bindices[m++] = _bindices[k];
+            _bvals.push_back(vals[k]);
+        }
+        if (m > 0) spsparse::accum::add_batch(super::sub, &_bindices[0], &_bvals[0], m);
+    }
 };
 
 // ----------------------------------------------------------------
@@ -518,6 +742,184 @@ inline ToSparseT to_sparse(
 #undef ToDenseT
 #undef SPARSIFY_TPARAMS
 
+// ----------------------------------------------------------------
+namespace _static_sparsify {
+
+/** One dimension's transform, chosen at compile time.
+@return False if the element should be dropped. */
+template<SparsifyTransform T>
+struct Dim {    // ID, KEEP_DENSE, KEEP_SPARSE
+    template<class SparseSetT, class InT, class OutT>
+    static bool apply(SparseSetT *ss, InT const &in, OutT &out)
+        { out = in; return true; }
+};
+
+template<>
+struct Dim<SparsifyTransform::ADD_DENSE> {
+    template<class SparseSetT, class InT, class OutT>
+    static bool apply(SparseSetT *ss, InT const &in, OutT &out)
+        { out = ss->add_dense(in); return true; }
+};
+
+template<>
+struct Dim<SparsifyTransform::TO_DENSE_IGNORE_MISSING> {
+    template<class SparseSetT, class InT, class OutT>
+    static bool apply(SparseSetT *ss, InT const &in, OutT &out)
+    {
+        typename SparseSetT::dense_type dense_ix;
+        if (!ss->to_dense_ignore_missing(in, dense_ix)) return false;
+        out = dense_ix;
+        return true;
+    }
+};
+
+template<>
+struct Dim<SparsifyTransform::TO_DENSE> {
+    template<class SparseSetT, class InT, class OutT>
+    static bool apply(SparseSetT *ss, InT const &in, OutT &out)
+        { out = ss->to_dense(in); return true; }
+};
+
+template<>
+struct Dim<SparsifyTransform::TO_SPARSE> {
+    template<class SparseSetT, class InT, class OutT>
+    static bool apply(SparseSetT *ss, InT const &in, OutT &out)
+        { out = ss->to_sparse(in); return true; }
+};
+
+}    // namespace _static_sparsify
+
+/** Like Sparsify, but with the transforms fixed at compile time, eg:
+
+    static_sparsify<SparsifyTransform::ADD_DENSE, SparsifyTransform::TO_DENSE_IGNORE_MISSING>(
+        in_index_type<long>(), dims, sub)
+
+Dimensions are processed in the same order as Sparsify (by transform
+priority), but the ordering and the per-dimension switch are resolved
+by the compiler, leaving straight-line lookups.
+Unlike Sparsify, the transforms are used as given: a dimension without
+a SparseSet must use ID, KEEP_DENSE or KEEP_SPARSE. */
+template<class AccumT, class SparseSetT, class InIndexT, SparsifyTransform... TRANSFORMS>
+class StaticSparsify : public Filter<AccumT>
+{
+    typedef Filter<AccumT> super;
+    typedef typename super::index_type out_index_type;
+    static const int RANK = sizeof...(TRANSFORMS);
+    static_assert(RANK == super::rank, "Need one transform per dimension");
+    static const int NPRIORITY = (int)SparsifyTransform::ID + 1;
+public:
+    typedef InIndexT index_type;    // Override super
+    static constexpr SparsifyTransform transforms[RANK] = {TRANSFORMS...};
+    std::array<SparseSetT *, RANK> sparse_sets;
+
+    StaticSparsify(
+        std::array<SparseSetT *, RANK> const &_sparse_sets,
+        AccumT &&_sub)
+    : super(std::move(_sub)), sparse_sets(_sparse_sets)
+    {
+        for (int i=0; i<RANK; ++i) {
+            switch(transforms[i]) {
+                case SparsifyTransform::ID:
+                case SparsifyTransform::KEEP_DENSE:
+                case SparsifyTransform::KEEP_SPARSE:
+                    break;
+                default:
+                    if (!sparse_sets[i]) (*ibmisc::ibmisc_error)(-1,
+                        "StaticSparsify: dimension %d needs a SparseSet", i);
+            }
+        }
+    }
+
+    void set_shape(std::array<long, super::rank> const &shape)
+    {
+        std::array<long, super::rank> shape2;
+        for (int i=0; i<RANK; ++i) {
+            switch(transforms[i]) {
+                case SparsifyTransform::ID:
+                case SparsifyTransform::KEEP_DENSE:
+                case SparsifyTransform::KEEP_SPARSE:
+                    shape2[i] = shape[i];
+                    break;
+                case SparsifyTransform::ADD_DENSE:
+                    shape2[i] = -1;
+                    break;
+                case SparsifyTransform::TO_DENSE_IGNORE_MISSING:
+                case SparsifyTransform::TO_DENSE:
+                    shape2[i] = sparse_sets[i]->dense_extent();
+                    break;
+                case SparsifyTransform::TO_SPARSE:
+                    shape2[i] = sparse_sets[i]->sparse_extent();
+                    break;
+            }
+        }
+        super::sub.set_shape(shape2);
+    }
+
+private:
+    // Step K handles dimension K%RANK, if its transform has priority K/RANK
+    template<int K>
+    bool transform(
+        std::array<index_type,RANK> const &index,
+        std::array<out_index_type,RANK> &index2,
+        std::integral_constant<int,K>)
+    {
+        if ((int)transforms[K % RANK] == K / RANK
+            && !_static_sparsify::Dim<transforms[K % RANK]>::apply(
+                sparse_sets[K % RANK], index[K % RANK], index2[K % RANK]))
+        {
+            return false;
+        }
+        return transform(index, index2, std::integral_constant<int,K+1>());
+    }
+
+    bool transform(
+        std::array<index_type,RANK> const &index,
+        std::array<out_index_type,RANK> &index2,
+        std::integral_constant<int,NPRIORITY*RANK>)
+        { return true; }
+
+    std::vector<std::array<out_index_type, RANK>> _bindices;
+    std::vector<typename super::val_type> _bvals;
+
+public:
+    SPSPARSE_INLINE void add(std::array<index_type,RANK> const &index, typename super::val_type const &val)
+    {
+        std::array<out_index_type,RANK> index2;
+        if (transform(index, index2, std::integral_constant<int,0>()))
+            super::sub.add(index2, val);
+    }
+
+    void add_batch(
+        std::array<index_type,RANK> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        IBMISC_SCOPED_TIMER("StaticSparsify::add_batch");
+        _bindices.resize(n);
+        _bvals.clear();
+        size_t m = 0;
+        for (size_t k=0; k<n; ++k) {
+            if (transform(indices[k], _bindices[m], std::integral_constant<int,0>())) {
+                _bvals.push_back(vals[k]);
+                ++m;
+            }
+        }
+        if (m > 0) spsparse::accum::add_batch(super::sub, &_bindices[0], &_bvals[0], m);
+    }
+};
+
+template<class AccumT, class SparseSetT, class InIndexT, SparsifyTransform... TRANSFORMS>
+constexpr SparsifyTransform StaticSparsify<AccumT,SparseSetT,InIndexT,TRANSFORMS...>::transforms[];
+
+template<SparsifyTransform... TRANSFORMS, class InIndexT, class SparseSetT, class AccumT>
+inline StaticSparsify<AccumT,SparseSetT,InIndexT,TRANSFORMS...> static_sparsify(
+    in_index_type<InIndexT> const dummy,
+    std::array<SparseSetT *, AccumT::rank> const &sparse_sets,
+    AccumT &&sub)
+{
+    return StaticSparsify<AccumT,SparseSetT,InIndexT,TRANSFORMS...>(
+        sparse_sets, std::move(sub));
+}
+
 // ----------------------------------------------------------------
 
 template<class SparseT, class DenseT, class BundleT, int RANK>
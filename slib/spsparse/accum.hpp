@@ -45,6 +45,32 @@ it called / not called?
 @{
 */
 
+// -----------------------------------------------------------
+namespace _add_batch {
+    template<class AccumT, class IndexT, class ValT>
+    auto call(AccumT &sub, IndexT const *indices, ValT const *vals, size_t n, int)
+        -> decltype(sub.add_batch(indices, vals, n))
+        { return sub.add_batch(indices, vals, n); }
+
+    template<class AccumT, class IndexT, class ValT>
+    void call(AccumT &sub, IndexT const *indices, ValT const *vals, size_t n, long)
+        { for (size_t i=0; i<n; ++i) sub.add(indices[i], vals[i]); }
+}
+
+/** Adds n elements to an accumulator at once: add(indices[i], vals[i]).
+Uses the accumulator's own add_batch() if it has one, otherwise calls
+add() on each element.  Accumulators that have add_batch() pass whole
+batches on down the chain.
+NOTE: Call as accum::add_batch() from inside a class with an
+      add_batch() member. */
+template<class AccumT, class IndexT, class ValT>
+inline void add_batch(AccumT &sub, IndexT const *indices, ValT const *vals, size_t n)
+    { _add_batch::call(sub, indices, vals, n, 0); }
+
+/** Number of elements producers (eg spcopy()) collect before calling
+add_batch() */
+static size_t const batch_size = 4096;
+
 // -----------------------------------------------------------
 template<class AccumT>
 class Filter : public AccumTraits<AccumT>
@@ -59,7 +85,7 @@ public:
     void set_shape(std::array<long, super::rank> const &_shape)
         { sub.set_shape(_shape); }
 
-    void add(
+    SPSPARSE_INLINE void add(
         std::array<typename super::index_type, super::rank> const &index,
         typename super::val_type const &val)
         { sub.add(index, val); }
@@ -127,6 +153,29 @@ public:
     {
         boost::fusion::for_each(subs, _add(index, val));
     }
+    // ----------------------------------------------
+private:
+    struct _add_many
+    {
+        std::array<typename super::index_type, super::rank> const *indices;
+        typename super::val_type const *vals;
+        size_t n;
+
+        _add_many(std::array<typename super::index_type, super::rank> const *_indices,
+            typename super::val_type const *_vals, size_t _n)
+        : indices(_indices), vals(_vals), n(_n) {}
+
+        template<class typei>
+        void operator()(typei &sub) const
+            { accum::add_batch(sub, indices, vals, n); }
+    };
+public:
+    void add_batch(
+        std::array<typename super::index_type, super::rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        boost::fusion::for_each(subs, _add_many(indices, vals, n));
+    }
 };
 
 template<class AccumT0, class ...AccumTs>
@@ -167,10 +216,15 @@ public:
     void set_shape(std::array<long, super::rank> const &_shape)
         { sub.set_shape(_shape); }
 
-    void add(
+    SPSPARSE_INLINE void add(
         std::array<typename super::index_type, super::rank> const &index,
         typename super::val_type const &val)
         { sub.add(index, val); }
+
+    void add_batch(
+        std::array<typename super::index_type, super::rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+        { accum::add_batch(sub, indices, vals, n); }
 };
 
 template<class AccumT>
@@ -191,12 +245,36 @@ public:
     void set_shape(std::array<long, super::rank> const &_shape)
         { super::sub.set_shape(_shape); }
 
-    void add(
+    SPSPARSE_INLINE void add(
         std::array<typename super::index_type, super::rank> const &index,
         typename super::val_type const &val)
     {
         if (include_zero || val != 0) super::sub.add(index, val);
     }
+
+private:
+    std::vector<std::array<typename super::index_type, super::rank>> _bindices;
+    std::vector<typename super::val_type> _bvals;
+public:
+    void add_batch(
+        std::array<typename super::index_type, super::rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        if (include_zero) {
+            accum::add_batch(super::sub, indices, vals, n);
+            return;
+        }
+
+        _bindices.clear();
+        _bvals.clear();
+        for (size_t i=0; i<n; ++i) {
+            if (vals[i] == 0) continue;
+            _bindices.push_back(indices[i]);
+            _bvals.push_back(vals[i]);
+        }
+        if (!_bvals.empty())
+            accum::add_batch(super::sub, &_bindices[0], &_bvals[0], _bvals.size());
+    }
 };
 
 template<class AccumT>
@@ -228,7 +306,6 @@ public:
 
 private:
     std::array<int,out_rank> perm;
-    std::array<int, out_rank> out_idx;
 
 public:
     Permute(std::array<int,out_rank> const _perm, AccumT &&_sub)
@@ -241,13 +318,28 @@ public:
         super::sub.set_shape(oshape);
     }
 
-    void add(
+    SPSPARSE_INLINE void add(
         std::array<typename super::index_type,rank> const &index,
         typename super::val_type const &val)
     {
+        std::array<typename super::index_type, out_rank> out_idx;
         for (int i=0; i<out_rank; ++i) out_idx[i] = index[perm[i]];
         super::sub.add(out_idx, val);
     }
+
+private:
+    std::vector<std::array<typename super::index_type, out_rank>> _bindices;
+public:
+    void add_batch(
+        std::array<typename super::index_type,rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        _bindices.resize(n);
+        for (size_t j=0; j<n; ++j) {
+            for (int i=0; i<out_rank; ++i) _bindices[j][i] = indices[j][perm[i]];
+        }
+        if (n > 0) accum::add_batch(super::sub, &_bindices[0], vals, n);
+    }
 };
 
 // Helper used to specify template arguments
@@ -264,13 +356,62 @@ permute(
     AccumT &&_sub)
     { return Permute<AccumT,IN_RANK>(_perm, std::move(_sub)); }
 
+// -----------------------------------------------------------
+/** Like Permute, but with the permutation fixed at compile time: each
+output index is built directly from the input, with no lookups, eg:
+
+    static_permute<1,0>(in_rank<2>(), sub)
+*/
+template<class AccumT, size_t IN_RANK, int... PERM>
+class StaticPermute : public Filter<AccumT>
+{
+    typedef Filter<AccumT> super;
+public:
+    static const size_t rank = IN_RANK;
+    static const size_t out_rank = AccumT::rank;
+    static_assert(sizeof...(PERM) == out_rank, "Need one input dimension per output dimension");
+
+    StaticPermute(AccumT &&_sub)
+        : super(std::move(_sub)) {}
+
+    void set_shape(std::array<long, rank> const &_shape)
+        { super::sub.set_shape(std::array<long, out_rank>{{_shape[PERM]...}}); }
+
+    SPSPARSE_INLINE void add(
+        std::array<typename super::index_type,rank> const &index,
+        typename super::val_type const &val)
+    {
+        super::sub.add(
+            std::array<typename super::index_type, out_rank>{{index[PERM]...}}, val);
+    }
+
+private:
+    std::vector<std::array<typename super::index_type, out_rank>> _bindices;
+public:
+    void add_batch(
+        std::array<typename super::index_type,rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        _bindices.resize(n);
+        for (size_t j=0; j<n; ++j) _bindices[j] = {{indices[j][PERM]...}};
+        if (n > 0) accum::add_batch(super::sub, &_bindices[0], vals, n);
+    }
+};
+
+template<int... PERM, class AccumT, size_t IN_RANK>
+inline StaticPermute<AccumT,IN_RANK,PERM...>
+static_permute(
+    in_rank<IN_RANK> const in_rank_dummy,
+    AccumT &&_sub)
+    { return StaticPermute<AccumT,IN_RANK,PERM...>(std::move(_sub)); }
+
 // -----------------------------------------------------------
 template<class AccumT>
-class Transpose : public Permute<AccumT,2>
+class Transpose : public StaticPermute<AccumT,2,1,0>
 {
 public:
     Transpose(AccumT &&_sub) :
-        Permute<AccumT,2>({1,0}, std::move(_sub)) {}
+        StaticPermute<AccumT,2,1,0>(std::move(_sub)) {}
 };
 
 
@@ -289,15 +430,59 @@ public:
 
     TransformAccum(TransformFn &&_transform_fn, AccumT &&_sub)
         : super(std::move(_sub)), transform_fn(std::move(_transform_fn)) {}
-    void add(
+    SPSPARSE_INLINE void add(
         std::array<typename super::index_type,super::rank> const &index,
         typename super::val_type const &val)
     {
         super::sub.add(index, transform_fn(val));
     }
 
+private:
+    std::vector<typename super::val_type> _bvals;
+public:
+    void add_batch(
+        std::array<typename super::index_type,super::rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        _bvals.resize(n);
+        for (size_t i=0; i<n; ++i) _bvals[i] = transform_fn(vals[i]);
+        if (n > 0) accum::add_batch(super::sub, indices, &_bvals[0], n);
+    }
 };
 
+// -----------------------------------------------------------
+/** Collapses a chain of filters into one loop: add_batch() runs the
+whole chain's add() on each element, inlined (see SPSPARSE_INLINE),
+rather than passing each batch down the chain, which copies the
+indices into a new buffer at every filter.  Best for chains of cheap
+filters, eg:
+
+    spcopy(accum::fuse(
+        accum::static_permute<1,0>(accum::in_rank<2>(),
+        accum::include_zero(false,
+        accum::ref(M)))), A);
+
+Leave out for chains whose add_batch() does better than one element
+at a time (eg Sparsify, which dispatches its transforms per batch). */
+template<class AccumT>
+class Fuse : public Filter<AccumT>
+{
+    typedef Filter<AccumT> super;
+public:
+    Fuse(AccumT &&_sub)
+        : super(std::move(_sub)) {}
+
+    void add_batch(
+        std::array<typename super::index_type,super::rank> const *indices,
+        typename super::val_type const *vals, size_t n)
+    {
+        for (size_t i=0; i<n; ++i) super::sub.add(indices[i], vals[i]);
+    }
+};
+
+template<class AccumT>
+inline Fuse<AccumT> fuse(AccumT &&sub)
+    { return Fuse<AccumT>(std::move(sub)); }
 // -----------------------------------------------------------
 struct InvertFn{
     char invert;
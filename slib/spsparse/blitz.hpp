@@ -1,9 +1,11 @@
 #ifndef SPSPARSE_BLITZ_HPP
 #define SPSPARSE_BLITZ_HPP
 
+#include <algorithm>
 #include <ibmisc/ibmisc.hpp>
 #include <spsparse/spsparse.hpp>
 #include <ibmisc/blitz.hpp>
+#include <ibmisc/blitz_alloc.hpp>
 
 namespace spsparse {
 
@@ -25,8 +27,9 @@ Blitz<decltype(A)> Baccum(B);
 spcopy(Baccum, A);
 @endcode
 
+@param CHECKED Bounds-check each index in add()?
 */
-template<class ValT, int RANK>
+template<class ValT, int RANK, bool CHECKED = ibmisc::checked_default>
 struct Blitz
 {
     static const int rank = RANK;
@@ -55,27 +58,27 @@ public:
     inline void add(std::array<index_type,rank> const &index, val_type const &val);
 };
 
-template<class ValT, int RANK>
-void Blitz<ValT,RANK>::set_shape(std::array<long, RANK> const &_shape)
+template<class ValT, int RANK, bool CHECKED>
+void Blitz<ValT,RANK,CHECKED>::set_shape(std::array<long, RANK> const &_shape)
 {
     if (!shape_is_set) {
         blitz::TinyVector<int,rank> shape_t;
         for (int i=0; i<RANK; ++i) shape_t[i] = _shape[i];
-        result.reference(blitz::Array<val_type,rank>(shape_t));
+        result.reference(ibmisc::alloc_blitz<val_type,rank>(shape_t));
         result = fill_value;
         shape_is_set = true;
     }
 }
 
 
-template<class ValT, int RANK>
-inline void Blitz<ValT,RANK>::add(std::array<index_type,rank> const &index, val_type const &val)
+template<class ValT, int RANK, bool CHECKED>
+inline void Blitz<ValT,RANK,CHECKED>::add(std::array<index_type,rank> const &index, val_type const &val)
 {
     // Check bounds...
     blitz::TinyVector<int, rank> bidx;
     for (unsigned int i=0; i<rank; ++i) {
         auto &ix(index[i]);
-        if (ix < result.lbound(i) || ix > result.ubound(i)) (*ibmisc::ibmisc_error)(-1,
+        if (CHECKED && (ix < result.lbound(i) || ix > result.ubound(i))) (*ibmisc::ibmisc_error)(-1,
             "Index %d out of bounds: %d vs [%d, %d]",
             i, ix, result.lbound(i), result.ubound(i));
         bidx[i] = index[i];
@@ -102,18 +105,198 @@ inline void Blitz<ValT,RANK>::add(std::array<index_type,rank> const &index, val_
 
 
 
-template<class ValT, int RANK>
-inline Blitz<ValT, RANK> blitz_new(
+template<bool CHECKED = ibmisc::checked_default, class ValT, int RANK>
+inline Blitz<ValT, RANK, CHECKED> blitz_new(
     blitz::Array<ValT, RANK> &_dense,
     ValT _fill_value=0,
     DuplicatePolicy _duplicate_policy = DuplicatePolicy::ADD)
-{ return Blitz<ValT,RANK>(_dense, true, _fill_value, _duplicate_policy); }
+{ return Blitz<ValT,RANK,CHECKED>(_dense, true, _fill_value, _duplicate_policy); }
 
-template<class ValT, int RANK>
-inline Blitz<ValT, RANK> blitz_existing(
+template<bool CHECKED = ibmisc::checked_default, class ValT, int RANK>
+inline Blitz<ValT, RANK, CHECKED> blitz_existing(
     blitz::Array<ValT, RANK> &_dense,
     DuplicatePolicy _duplicate_policy = DuplicatePolicy::ADD)
-{ return Blitz<ValT,RANK>(_dense, false, 0, _duplicate_policy); }
+{ return Blitz<ValT,RANK,CHECKED>(_dense, false, 0, _duplicate_policy); }
+
+// ----------------------------------------------------------
+namespace _blitz {
+
+/** Stores val into oval according to a DuplicatePolicy; same
+semantics as Blitz::add() */
+template<DuplicatePolicy POLICY>
+struct Combine;
+
+template<> struct Combine<DuplicatePolicy::LEAVE_ALONE> {
+    template<class ValT>
+    static void apply(ValT &oval, ValT const &val)
+        { if (!std::isnan(oval)) oval = val; }
+};
+template<> struct Combine<DuplicatePolicy::ADD> {
+    template<class ValT>
+    static void apply(ValT &oval, ValT const &val)
+        { oval += val; }
+};
+template<> struct Combine<DuplicatePolicy::REPLACE> {
+    template<class ValT>
+    static void apply(ValT &oval, ValT const &val)
+        { oval = val; }
+};
+template<> struct Combine<DuplicatePolicy::REPLACE_THEN_ADD> {
+    template<class ValT>
+    static void apply(ValT &oval, ValT const &val)
+        { if (std::isnan(oval)) oval = val; else oval += val; }
+};
+
+}    // namespace _blitz
+
+/** @brief Fast version of Blitz, for bulk output to dense arrays.
+
+The duplicate policy is fixed at compile time, elements are located
+directly from the array's strides, and add_batch() checks bounds once
+per batch (on the range of the indices), rather than once per element.
+Accepts indices of any integer type.
+
+The array's storage must not be reallocated (except via set_shape())
+while it is being used as an accumulator.
+
+Usage Example:
+@code
+blitz::Array<double,2> B;
+spcopy(accum::blitz_fast_new(B), A);
+@endcode
+
+@param CHECKED Bounds-check in add() and add_batch()?
+*/
+template<class ValT, int RANK, DuplicatePolicy POLICY = DuplicatePolicy::ADD,
+    bool CHECKED = ibmisc::checked_default>
+class BlitzFast
+{
+public:
+    static const int rank = RANK;
+    typedef int index_type;
+    typedef ValT val_type;
+
+private:
+    blitz::Array<val_type,rank> &result;
+    bool shape_is_set;
+    ValT fill_value;
+
+    // Cached from result
+    val_type *data0;    // Address of element (0,0,...)
+    std::array<long,RANK> stride, lbound, ubound;
+
+    void cache_layout();
+
+    template<class IndexT>
+    void bounds_error(std::array<IndexT,RANK> const &lo, std::array<IndexT,RANK> const &hi) const;
+
+    template<class IndexT>
+    long offset(std::array<IndexT,RANK> const &index) const
+    {
+        long off = 0;
+        for (int i=0; i<RANK; ++i) off += (long)index[i] * stride[i];
+        return off;
+    }
+
+public:
+    BlitzFast(
+        blitz::Array<val_type,rank> &_dense,
+        bool reset_shape,    // Should we re-allocate on set_shape() call?
+        ValT _fill_value)
+    : result(_dense), shape_is_set(!reset_shape), fill_value(_fill_value)
+        { cache_layout(); }
+
+    void set_shape(std::array<long, RANK> const &_shape);
+
+    template<class IndexT>
+    void add(std::array<IndexT,rank> const &index, val_type const &val)
+    {
+        if (CHECKED) for (int i=0; i<RANK; ++i) {
+            if (index[i] < lbound[i] || index[i] > ubound[i]) bounds_error(index, index);
+        }
+        _blitz::Combine<POLICY>::apply(data0[offset(index)], val);
+    }
+
+    template<class IndexT>
+    void add_batch(std::array<IndexT,rank> const *indices, val_type const *vals, size_t n);
+};
+
+template<class ValT, int RANK, DuplicatePolicy POLICY, bool CHECKED>
+void BlitzFast<ValT,RANK,POLICY,CHECKED>::cache_layout()
+{
+    data0 = result.dataZero();
+    for (int i=0; i<RANK; ++i) {
+        stride[i] = result.stride(i);
+        lbound[i] = result.lbound(i);
+        ubound[i] = result.ubound(i);
+    }
+}
+
+template<class ValT, int RANK, DuplicatePolicy POLICY, bool CHECKED>
+template<class IndexT>
+void BlitzFast<ValT,RANK,POLICY,CHECKED>::bounds_error(
+    std::array<IndexT,RANK> const &lo, std::array<IndexT,RANK> const &hi) const
+{
+    for (int i=0; i<RANK; ++i) {
+        if (lo[i] < lbound[i]) (*ibmisc::ibmisc_error)(-1,
+            "Index %d out of bounds: %ld vs [%ld, %ld]",
+            i, (long)lo[i], lbound[i], ubound[i]);
+        if (hi[i] > ubound[i]) (*ibmisc::ibmisc_error)(-1,
+            "Index %d out of bounds: %ld vs [%ld, %ld]",
+            i, (long)hi[i], lbound[i], ubound[i]);
+    }
+}
+
+template<class ValT, int RANK, DuplicatePolicy POLICY, bool CHECKED>
+void BlitzFast<ValT,RANK,POLICY,CHECKED>::set_shape(std::array<long, RANK> const &_shape)
+{
+    if (!shape_is_set) {
+        blitz::TinyVector<int,rank> shape_t;
+        for (int i=0; i<RANK; ++i) shape_t[i] = _shape[i];
+        result.reference(ibmisc::alloc_blitz<val_type,rank>(shape_t));
+        result = fill_value;
+        shape_is_set = true;
+        cache_layout();
+    }
+}
+
+template<class ValT, int RANK, DuplicatePolicy POLICY, bool CHECKED>
+template<class IndexT>
+void BlitzFast<ValT,RANK,POLICY,CHECKED>::add_batch(
+    std::array<IndexT,rank> const *indices, val_type const *vals, size_t n)
+{
+    if (n == 0) return;
+
+    // Check the range of the whole batch at once
+    if (CHECKED) {
+        std::array<IndexT,RANK> lo(indices[0]), hi(indices[0]);
+        for (size_t k=1; k<n; ++k) {
+            for (int i=0; i<RANK; ++i) {
+                lo[i] = std::min(lo[i], indices[k][i]);
+                hi[i] = std::max(hi[i], indices[k][i]);
+            }
+        }
+        for (int i=0; i<RANK; ++i) {
+            if (lo[i] < lbound[i] || hi[i] > ubound[i]) bounds_error(lo, hi);
+        }
+    }
+
+    for (size_t k=0; k<n; ++k)
+        _blitz::Combine<POLICY>::apply(data0[offset(indices[k])], vals[k]);
+}
+
+template<DuplicatePolicy POLICY = DuplicatePolicy::ADD,
+    bool CHECKED = ibmisc::checked_default, class ValT, int RANK>
+inline BlitzFast<ValT, RANK, POLICY, CHECKED> blitz_fast_new(
+    blitz::Array<ValT, RANK> &_dense,
+    ValT _fill_value=0)
+{ return BlitzFast<ValT,RANK,POLICY,CHECKED>(_dense, true, _fill_value); }
+
+template<DuplicatePolicy POLICY = DuplicatePolicy::ADD,
+    bool CHECKED = ibmisc::checked_default, class ValT, int RANK>
+inline BlitzFast<ValT, RANK, POLICY, CHECKED> blitz_fast_existing(
+    blitz::Array<ValT, RANK> &_dense)
+{ return BlitzFast<ValT,RANK,POLICY,CHECKED>(_dense, false, 0); }
 
 }    // namespace spsparse::accum
 // ----------------------------------------------------------
@@ -152,7 +335,7 @@ extern blitz::Array<typename SourceT::val_type, SourceT::rank>
 to_blitz(SourceT const &M)
 {
     blitz::Array<typename SourceT::val_type, SourceT::rank> ret;
-    spcopy(accum::blitz_new(ret), M, true);
+    spcopy(accum::blitz_fast_new(ret), M, true);
     return ret;
 }
 
@@ -18,11 +18,14 @@
 
 #pragma once
 
+#include <algorithm>
 #include <Eigen/SparseCore>
 #include <ibmisc/error.hpp>
 #include <ibmisc/iter.hpp>
 #include <ibmisc/netcdf.hpp>
 #include <ibmisc/memory.hpp>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/profile.hpp>
 #include <spsparse/accum.hpp>
 #include <spsparse/blitz.hpp>
 #include <spsparse/SparseSet.hpp>
@@ -39,6 +42,63 @@ namespace spsparse {
 
 // --------------------------------------------------------------
 #define ARGS _Scalar,_Options,_StorageIndex
+/** Calls fn(row, col, value) on each stored entry of M with outer
+index (column, for column-major M) in [k0, k1).  Reads M's
+outer/inner/value arrays directly; works whether or not M is
+compressed. */
+template<class FnT, class _Scalar, int _Options, class _StorageIndex>
+void visit(
+    Eigen::SparseMatrix<ARGS> const &M,
+    FnT &&fn, long k0, long k1)
+{
+    bool const row_major = Eigen::SparseMatrix<ARGS>::IsRowMajor;
+    _StorageIndex const *outer = M.outerIndexPtr();
+    _StorageIndex const *nnz = M.innerNonZeroPtr();    // Null if compressed
+    _StorageIndex const *inner = M.innerIndexPtr();
+    _Scalar const *vals = M.valuePtr();
+
+    for (long k=k0; k<k1; ++k) {
+        long const p1 = (nnz ? outer[k] + nnz[k] : outer[k+1]);
+        for (long p=outer[k]; p<p1; ++p) {
+            if (row_major) fn((long)k, (long)inner[p], vals[p]);
+            else fn((long)inner[p], (long)k, vals[p]);
+        }
+    }
+}
+
+/** Calls fn(row, col, value) on each stored entry of M */
+template<class FnT, class _Scalar, int _Options, class _StorageIndex>
+void visit(Eigen::SparseMatrix<ARGS> const &M, FnT &&fn)
+    { visit(M, std::forward<FnT>(fn), 0, M.outerSize()); }
+
+namespace _eigen {
+
+/** Copies the entries of M in outer indices [k0, k1) into ret, in
+batches. */
+template<class AccumT, class _Scalar, int _Options, class _StorageIndex>
+void spcopy_outer(AccumT &ret, Eigen::SparseMatrix<ARGS> const &M, long k0, long k1)
+{
+    typedef typename std::remove_reference<AccumT>::type::index_type IndexT;
+    typedef typename std::remove_reference<AccumT>::type::val_type ValT;
+
+    std::vector<std::array<IndexT,2>> indices;
+    std::vector<ValT> vals;
+    indices.reserve(accum::batch_size);
+    vals.reserve(accum::batch_size);
+    visit(M, [&](long i, long j, _Scalar const &val) {
+        indices.push_back({(IndexT)i, (IndexT)j});
+        vals.push_back(val);
+        if (vals.size() == accum::batch_size) {
+            accum::add_batch(ret, &indices[0], &vals[0], vals.size());
+            indices.clear();
+            vals.clear();
+        }
+    }, k0, k1);
+    if (vals.size() > 0) accum::add_batch(ret, &indices[0], &vals[0], vals.size());
+}
+
+}    // namespace _eigen
+
 /** Copies an Eigen SparseMatrix into a rank-2 Spsparse accumulator. */
 template<class AccumT, class _Scalar, int _Options, class _StorageIndex>
 extern void spcopy(
@@ -53,13 +113,26 @@ void spcopy(
     bool set_shape)
 {
     if (set_shape) ret.set_shape(std::array<long,2>{M.rows(), M.cols()});
+    _eigen::spcopy_outer(ret, M, 0, M.outerSize());
+}
 
-    // See here for note on iterating through Eigen::SparseMatrix
-    // http://eigen.tuxfamily.org/bz/show_bug.cgi?id=1104
-    for (int k=0; k<M.outerSize(); ++k) {
-    for (typename Eigen::SparseMatrix<ARGS>::InnerIterator ii(M,k); ii; ++ii) {
-        ret.add({ii.row(), ii.col()}, ii.value());
-    }}
+/** Same as spcopy(), but copies ranges of outer indices (columns, for
+column-major M) concurrently, with up to nthreads threads.  Entries
+arrive in no particular order.  ret.add_batch() (or add()) must be
+safe to call from several threads at once: for example, a
+BlitzFast on the whole matrix, since each entry of M has its own
+element. */
+template<class AccumT, class _Scalar, int _Options, class _StorageIndex>
+void spcopy_parallel(
+    AccumT &&ret,
+    Eigen::SparseMatrix<ARGS> const &M,
+    int nthreads,
+    bool set_shape=true)
+{
+    if (set_shape) ret.set_shape(std::array<long,2>{M.rows(), M.cols()});
+    ibmisc::parallel_for(0, M.outerSize(), nthreads, [&](long k0, long k1) {
+        _eigen::spcopy_outer(ret, M, k0, k1);
+    }, 64);
 }
 #undef ARGS
 // --------------------------------------------------------------
@@ -87,18 +160,118 @@ void spcopy(
 // --------------------------------------------------------------
 
 // --------------------------------------------------------
-template<class AccumT, class IndexT, class ValT, int RANK>
-extern void spcopy(AccumT &&ret, TupleList<IndexT,ValT,RANK> const &A, bool set_shape = true);
+template<class AccumT, class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+extern void spcopy(AccumT &&ret, TupleList<IndexT,ValT,RANK,StorageT,CHECKED> const &A, bool set_shape = true);
 
-template<class AccumT, class IndexT, class ValT, int RANK>
-void spcopy(AccumT &&ret, TupleList<IndexT,ValT,RANK> const &A, bool set_shape)
+template<class AccumT, class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+void spcopy(AccumT &&ret, TupleList<IndexT,ValT,RANK,StorageT,CHECKED> const &A, bool set_shape)
 {
     if (set_shape) ret.set_shape(A.shape());
-    for (auto ii=A.begin(); ii != A.end(); ++ii) {
-        ret.add(ii->index(), ii->value());
+
+    // Feed the accumulator in batches
+    std::vector<std::array<IndexT,RANK>> indices;
+    std::vector<ValT> vals;
+    for (size_t i0=0; i0 < A.size(); i0 += accum::batch_size) {
+        size_t const i1 = std::min(A.size(), i0 + accum::batch_size);
+        indices.clear();
+        vals.clear();
+        for (size_t i=i0; i<i1; ++i) {
+            indices.push_back(A.tuples[i].index());
+            vals.push_back(A.tuples[i].value());
+        }
+        accum::add_batch(ret, &indices[0], &vals[0], i1-i0);
     }
 }
 // ---------------------------------------------
+#define ARGS _Scalar,_Options,_StorageIndex
+/** Builds M (compressed) straight from COO entries; a replacement for
+Eigen's setFromTriplets() that doesn't make a transposed copy first.
+Entries may be anything with row(), col() and value(): Tuple,
+Eigen::Triplet, etc.  Duplicates are summed in input order; explicit
+zeros are kept.  If the input is sorted (eg: a consolidated TupleList),
+this is one counting pass and one filling pass, with no storage beyond
+M itself. */
+template<class IterT, class _Scalar, int _Options, class _StorageIndex>
+void build_compressed(
+    Eigen::SparseMatrix<ARGS> &M,
+    IterT const &begin, IterT const &end,
+    long nrows, long ncols);
+
+template<class IterT, class _Scalar, int _Options, class _StorageIndex>
+void build_compressed(
+    Eigen::SparseMatrix<ARGS> &M,
+    IterT const &begin, IterT const &end,
+    long nrows, long ncols)
+{
+    bool const row_major = Eigen::SparseMatrix<ARGS>::IsRowMajor;
+
+    M.resize(nrows, ncols);    // Compressed, all zero
+    long const nouter = M.outerSize();
+    _StorageIndex *outer = M.outerIndexPtr();
+
+    // Count entries in each outer vector
+    size_t nnz = 0;
+    for (IterT ii(begin); ii != end; ++ii, ++nnz) {
+        long const row = ii->row();
+        long const col = ii->col();
+        if (row < 0 || row >= nrows || col < 0 || col >= ncols) {
+            (*ibmisc::ibmisc_error)(-1,
+                "build_compressed(): index (%ld, %ld) out of bounds (%ld, %ld)",
+                row, col, nrows, ncols);
+        }
+        ++outer[(row_major ? row : col) + 1];
+    }
+    for (long k=0; k<nouter; ++k) outer[k+1] += outer[k];
+
+    // Drop each entry into place
+    M.resizeNonZeros(nnz);
+    _StorageIndex *inner = M.innerIndexPtr();
+    _Scalar *vals = M.valuePtr();
+    {std::vector<_StorageIndex> pos(outer, outer + nouter);
+        for (IterT ii(begin); ii != end; ++ii) {
+            long const row = ii->row();
+            long const col = ii->col();
+            _StorageIndex &p(pos[row_major ? row : col]);
+            inner[p] = (row_major ? col : row);
+            vals[p] = ii->value();
+            ++p;
+        }
+    }
+
+    // Sort each outer vector (only if needed) and sum duplicates
+    std::vector<std::pair<_StorageIndex,_Scalar>> seg;
+    _StorageIndex dst = 0;
+    for (long k=0; k<nouter; ++k) {
+        _StorageIndex const b = outer[k];
+        _StorageIndex const e = outer[k+1];
+        outer[k] = dst;
+
+        if (!std::is_sorted(inner+b, inner+e)) {
+            seg.clear();
+            for (_StorageIndex p=b; p<e; ++p) seg.push_back(std::make_pair(inner[p], vals[p]));
+            std::stable_sort(seg.begin(), seg.end(),
+                [](std::pair<_StorageIndex,_Scalar> const &x, std::pair<_StorageIndex,_Scalar> const &y)
+                { return x.first < y.first; });
+            for (_StorageIndex p=b; p<e; ++p) {
+                inner[p] = seg[p-b].first;
+                vals[p] = seg[p-b].second;
+            }
+        }
+
+        for (_StorageIndex p=b; p<e; ++p) {
+            if (dst > outer[k] && inner[dst-1] == inner[p]) {
+                vals[dst-1] += vals[p];
+            } else {
+                inner[dst] = inner[p];
+                vals[dst] = vals[p];
+                ++dst;
+            }
+        }
+    }
+    outer[nouter] = dst;
+    M.resizeNonZeros(dst);
+}
+#undef ARGS
 // =========================================================
 
 #define ARGS _Scalar,_Options,_StorageIndex
@@ -218,29 +391,68 @@ blitz::Array<_Scalar,1> sum(
 
 template<class _Scalar, int _Options, class _StorageIndex>
 std::array<blitz::Array<_Scalar,1>,2> sums(
-    Eigen::SparseMatrix<ARGS> const &M, char invert='+');
-
-/** Sum the rows or columns of an Eigen SparseMatrix.
-@param dimi 0: sum rows, 1: sum columns */
+    Eigen::SparseMatrix<ARGS> const &M, char invert='+', int nthreads=1,
+    ibmisc::ReduceMode mode=ibmisc::ReduceMode::FAST);
+
+/** Sums the rows and the columns of an Eigen SparseMatrix, in one pass.
+@param nthreads Ranges of outer indices are summed concurrently, each
+    with its own partial sums along the inner dimension.
+@param mode FAST: one range per thread, partials added in order;
+    results can differ from nthreads=1 by roundoff.  REPRODUCIBLE:
+    the same for any nthreads (see ReduceMode).
+@return {row sums (a column vector), column sums (a row vector)} */
 template<class _Scalar, int _Options, class _StorageIndex>
 std::array<blitz::Array<_Scalar,1>,2> sums(
-    Eigen::SparseMatrix<ARGS> const &M, char invert)
+    Eigen::SparseMatrix<ARGS> const &M, char invert, int nthreads,
+    ibmisc::ReduceMode mode)
 {
-    // Get our weight vector (in dense coordinate space)
+    // Dimension of the outer index (0=rows, 1=cols), and of the inner
+    int const od = (Eigen::SparseMatrix<ARGS>::IsRowMajor ? 0 : 1);
+    int const id = 1 - od;
+
     std::array<blitz::Array<_Scalar,1>,2> rets;
     rets[0].reference(blitz::Array<_Scalar,1>(M.rows()));
     rets[1].reference(blitz::Array<_Scalar,1>(M.cols()));
-
     rets[0] = 0;
     rets[1] = 0;
 
-    // See here for note on iterating through Eigen::SparseMatrix
-    // http://eigen.tuxfamily.org/bz/show_bug.cgi?id=1104
-    for (int k=0; k<M.outerSize(); ++k) {
-    for (typename Eigen::SparseMatrix<ARGS>::InnerIterator ii(M,k); ii; ++ii) {
-        rets[0](ii.row()) += ii.value();
-        rets[1](ii.col()) += ii.value();
-    }}
+    long const nouter = M.outerSize();
+    long const ninner = M.innerSize();
+    long const nchunk = ibmisc::reduce_pieces(nouter, nthreads, mode, 64);
+    std::vector<std::vector<_Scalar>> partials(nchunk);
+
+    ibmisc::parallel_for(0, nchunk, nthreads, [&](long c0, long c1) {
+        for (long c=c0; c<c1; ++c) {
+            std::vector<_Scalar> &part(partials[c]);
+            part.assign(ninner, 0);
+            long const k0 = nouter * c / nchunk;
+            long const k1 = nouter * (c+1) / nchunk;
+
+            // Each outer sum belongs to one chunk: no sharing
+            blitz::Array<_Scalar,1> &osum(rets[od]);
+            long kcur = k0;
+            _Scalar ocur = 0;
+            visit(M, [&](long i, long j, _Scalar const &val) {
+                long const k = (od == 0 ? i : j);
+                if (k != kcur) {
+                    osum(kcur) = ocur;
+                    kcur = k;
+                    ocur = 0;
+                }
+                ocur += val;
+                part[od == 0 ? j : i] += val;
+            }, k0, k1);
+            if (kcur < k1) osum(kcur) = ocur;
+        }
+    });
+
+    if (mode == ibmisc::ReduceMode::REPRODUCIBLE) {
+        ibmisc::pairwise_reduce(partials, ninner, rets[id].data(), nthreads);
+    } else {
+        for (long c=0; c<nchunk; ++c) {
+            for (long i=0; i<ninner; ++i) rets[id](i) += partials[c][i];
+        }
+    }
 
     if (invert == '-') {
         for (int j=0; j<2; ++j) {
@@ -336,6 +548,14 @@ public:
     }
 
     EigenSparseMatrixT to_eigen();
+
+    /** Same as to_eigen(), and also computes the matrix's row and
+    column sums (see sums()).
+    @param weights Output: {row sums, column sums} */
+    EigenSparseMatrixT to_eigen(
+        std::array<blitz::Array<_Scalar,1>,2> &weights,
+        int nthreads=1,
+        ibmisc::ReduceMode mode=ibmisc::ReduceMode::FAST);
 };
 
 
@@ -365,8 +585,19 @@ typename MakeDenseEigen<ARGS>::EigenSparseMatrixT MakeDenseEigen<ARGS>::to_eigen
         extent(permute[0]),
         extent(permute[1]));
 
-    // This segfaults if indices are out of bounds
-    Matrix.setFromTriplets(M.begin(), M.end());
+    build_compressed(Matrix, M.begin(), M.end(), Matrix.rows(), Matrix.cols());
+    return Matrix;
+}
+
+template<class SparseIndexT, class _Scalar, int _Options, class _StorageIndex>
+typename MakeDenseEigen<ARGS>::EigenSparseMatrixT MakeDenseEigen<ARGS>::to_eigen(
+    std::array<blitz::Array<_Scalar,1>,2> &weights,
+    int nthreads,
+    ibmisc::ReduceMode mode)
+{
+    auto Matrix(to_eigen());
+    auto w(sums(Matrix, '+', nthreads, mode));
+    for (int i=0; i<2; ++i) weights[i].reference(w[i]);
     return Matrix;
 }
 #undef ARGS
@@ -400,19 +631,19 @@ static void nc_rw_eigen(
         // Create in-memory data structure amenable to writing to disk quickly
         {std::vector<int> indices;
             indices.reserve(N*2);
-            for (auto ii = begin(*A); ii != end(*A); ++ii) {
-                indices.push_back(ii->row());
-                indices.push_back(ii->col());
-            }
+            visit(*A, [&](long i, long j, _Scalar const &) {
+                indices.push_back(i);
+                indices.push_back(j);
+            });
             indices_v.putVar(&indices[0]);
         }
 
         // Write it out!
         {std::vector<double> vals;
             vals.reserve(N);
-            for (auto ii = begin(*A); ii != end(*A); ++ii) {
-                vals.push_back(ii->value());
-            }
+            visit(*A, [&](long, long, _Scalar const &val) {
+                vals.push_back(val);
+            });
             vals_v.putVar(&vals[0]);    // Write to entire NetCDF variable directly from RAM
         }
     } else {    // rw == 'r'
@@ -445,11 +676,9 @@ static void nc_rw_eigen(
         vals.clear();
 
         A->setZero();
-        A->resize(shape[0], shape[1]);
-        A->reserve(tuples.tuples.size());
 
         // Convert to Eigen
-        A->setFromTriplets(tuples.begin(), tuples.end());
+        build_compressed(*A, tuples.begin(), tuples.end(), shape[0], shape[1]);
     }
 }
 
@@ -673,44 +902,121 @@ Eigen::Map<Eigen::Matrix<Scalar,Eigen::Dynamic,1>> const
 
 // ==============================================================
 // --------------------------------------------------------
-template<class TupleT>
-void consolidate(std::vector<TupleT> &A, bool zero_nan)
-{
+namespace _consolidate {
 
-    // Sort the Tuples
-    std::stable_sort(A.begin(), A.end());
+/** Smallest number of tuples worth giving a thread of its own */
+static size_t const min_grain = 1 << 16;
 
-    // Eliminate duplicates
-    enum {NORUN, INRUN} state = NORUN;
+/** Same result as std::stable_sort(A), using up to nthreads threads:
+sorts contiguous chunks, then merges neighbours pairwise (left before
+right, so equal elements keep their original order). */
+template<class VectorT>
+void stable_sort(VectorT &A, int nthreads)
+{
+    size_t const n = A.size();
+    long const nchunk = std::max(1L, std::min((long)nthreads, (long)(n / min_grain)));
+    if (nchunk <= 1) {
+        std::stable_sort(A.begin(), A.end());
+        return;
+    }
 
-    size_t dst=0;        // Where we're writing
-    size_t start = 0;    // Start of run
-    for (size_t i=0; i<A.size(); ++i) {
-        switch(state) {
-            case NORUN : {
-                if (!isnone(A[i])) {
-                    start = i;
-                    state = INRUN;
-                    A[dst] = A[i];
-                }
-            } break;
-            case INRUN : {
-                if (A[i].index() == A[start].index()) {
-                    // Skip 0 and NaN
-                    if (isnone(A[i].index(), zero_nan)) continue;
-
-                    // Continue a run
-                    A[dst].value += A[i].value;
-                } else {
-                    // Finish this run
-                    ++dst;
-                    state = NORUN;
-                }
-            } break;
+    std::vector<size_t> bounds(nchunk+1);
+    for (long k=0; k<=nchunk; ++k) bounds[k] = n * k / nchunk;
+
+    ibmisc::parallel_for(0, nchunk, nthreads, [&](long k0, long k1) {
+        for (long k=k0; k<k1; ++k)
+            std::stable_sort(A.begin()+bounds[k], A.begin()+bounds[k+1]);
+    });
+
+    for (long width=1; width < nchunk; width *= 2) {
+        long const npair = (nchunk + 2*width - 1) / (2*width);
+        ibmisc::parallel_for(0, npair, nthreads, [&](long p0, long p1) {
+            for (long p=p0; p<p1; ++p) {
+                long const lo = p * 2*width;
+                long const mid = std::min(lo + width, nchunk);
+                long const hi = std::min(lo + 2*width, nchunk);
+                if (mid < hi) std::inplace_merge(
+                    A.begin()+bounds[lo], A.begin()+bounds[mid], A.begin()+bounds[hi]);
+            }
+        });
+    }
+}
+
+/** Compacts sorted A[begin:end) in place: drops none values and sums
+runs of equal index.
+@return End of the compacted range. */
+template<class VectorT>
+size_t reduce(VectorT &A, size_t begin, size_t end, bool zero_nan)
+{
+    size_t dst = begin;    // One past the last tuple written
+    for (size_t i=begin; i<end; ++i) {
+        // Skip 0 and NaN
+        if (isnone(A[i].value(), zero_nan)) continue;
+
+        if (dst > begin && A[dst-1].index() == A[i].index()) {
+            // Continue a run
+            A[dst-1].value() += A[i].value();
+        } else {
+            // Start a new run
+            if (dst != i) A[dst] = A[i];
+            ++dst;
         }
     }
+    return dst;
 }
 
+/** Implements consolidate(), for std::vector or SegmentedVector */
+template<class VectorT>
+void consolidate(VectorT &A, bool zero_nan, int nthreads)
+{
+    IBMISC_SCOPED_TIMER("spsparse::consolidate");
+    _consolidate::stable_sort(A, nthreads);
+
+    // Split into chunks that don't cut through a run of equal indices
+    size_t const n = A.size();
+    long const nchunk = std::max(1L, std::min((long)nthreads, (long)(n / _consolidate::min_grain)));
+    std::vector<size_t> bounds(nchunk+1);
+    bounds[0] = 0;
+    for (long k=1; k<nchunk; ++k) {
+        size_t b = std::max(n * k / nchunk, bounds[k-1]);
+        while (b > 0 && b < n && A[b].index() == A[b-1].index()) ++b;
+        bounds[k] = b;
+    }
+    bounds[nchunk] = n;
+
+    // Reduce each chunk in place
+    std::vector<size_t> ends(nchunk);
+    ibmisc::parallel_for(0, nchunk, nthreads, [&](long k0, long k1) {
+        for (long k=k0; k<k1; ++k)
+            ends[k] = _consolidate::reduce(A, bounds[k], bounds[k+1], zero_nan);
+    });
+
+    // Close the gaps between chunks
+    size_t dst = ends[0];
+    for (long k=1; k<nchunk; ++k) {
+        dst = std::move(A.begin()+bounds[k], A.begin()+ends[k], A.begin()+dst) - A.begin();
+    }
+    A.erase(A.begin()+dst, A.end());
+}
+
+}    // namespace _consolidate
+
+/** Sorts A by index and sums duplicate entries (in their original
+order).  Entries whose value is 0 (or NaN, if zero_nan) are dropped.
+@param nthreads Sort and reduce with up to this many threads.  The
+    result is identical for any value. */
+template<class TupleT>
+void consolidate(std::vector<TupleT> &A, bool zero_nan=false, int nthreads=1)
+    { _consolidate::consolidate(A, zero_nan, nthreads); }
+
+template<class TupleT, int PAGE_BITS>
+void consolidate(SegmentedVector<TupleT,PAGE_BITS> &A, bool zero_nan=false, int nthreads=1)
+    { _consolidate::consolidate(A, zero_nan, nthreads); }
+
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+void consolidate(TupleList<IndexT,ValT,RANK,StorageT,CHECKED> &A, bool zero_nan=false, int nthreads=1)
+    { consolidate(A.tuples, zero_nan, nthreads); }
+
 
 /** @} */
 
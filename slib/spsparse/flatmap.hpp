@@ -0,0 +1,214 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <ibmisc/footprint.hpp>
+#include <ibmisc/hash.hpp>
+
+namespace spsparse {
+
+/** Insert-only map from integer keys to dense indices (>= 0), used as
+the sparse-to-dense lookup of SparseSet.
+
+Keys live in one flat open-addressing table (linear probing), so a
+lookup is usually a single cache line.  Once the keys are known to lie
+in [0, key_extent) and that range is small compared to the number of
+keys (see direct_ratio), the table is swapped for a direct lookup
+array indexed by key. */
+template<class KeyT, class ValT>
+class FlatIndexMap {
+    static_assert(std::is_integral<KeyT>::value, "FlatIndexMap needs integer keys");
+    static_assert(std::is_signed<ValT>::value, "FlatIndexMap uses ValT(-1) as a marker");
+
+    struct Slot {
+        KeyT key;
+        ValT val;    // <0 for an empty slot
+    };
+
+    std::vector<Slot> _slots;     // Hash mode; size is a power of 2
+    std::vector<ValT> _direct;    // Direct mode: _direct[key], <0 if absent
+    size_t _size;
+    int _shift;                   // 64 - log2(_slots.size())
+    KeyT _key_extent;             // Keys are in [0, _key_extent); -1 if unknown
+
+public:
+    /** Use the direct array once key_extent <= direct_ratio * size().
+    (A direct entry costs sizeof(ValT); a hash entry, about 3x
+    sizeof(Slot).) */
+    static long const direct_ratio = 8;
+
+    FlatIndexMap() : _size(0), _shift(64), _key_extent(-1) {}
+
+    size_t size() const
+        { return _size; }
+
+    bool is_direct() const
+        { return !_direct.empty(); }
+
+    /** Memory held by the table; unused slots count as slack. */
+    ibmisc::MemoryFootprint memory_footprint(std::string const &name = "FlatIndexMap") const
+    {
+        size_t const entry = (is_direct() ? sizeof(ValT) : sizeof(Slot));
+        return ibmisc::MemoryFootprint(name, _size * entry,
+            _slots.capacity() * sizeof(Slot) + _direct.capacity() * sizeof(ValT));
+    }
+
+    void clear()
+    {
+        _slots.clear();
+        _direct.clear();
+        _size = 0;
+        _shift = 64;
+        _key_extent = -1;
+    }
+
+    /** Declares that all keys will be in [0, extent). */
+    void set_key_extent(KeyT extent)
+    {
+        _key_extent = extent;
+        maybe_direct();
+    }
+
+    /** Makes room for n keys without rehashing. */
+    void reserve(size_t n)
+    {
+        if (!is_direct() && n*10 > _slots.size()*7) rehash(n);
+        maybe_direct(n);
+    }
+
+    /** @return Value for key, or -1 if there is none. */
+    ValT find(KeyT key) const
+    {
+        if (is_direct()) {
+            return (key >= 0 && (size_t)key < _direct.size()) ? _direct[key] : ValT(-1);
+        }
+        if (_slots.empty()) return -1;
+
+        size_t const mask = _slots.size() - 1;
+        for (size_t i = hash(key);; i = (i+1) & mask) {
+            Slot const &slot(_slots[i]);
+            if (slot.val < 0) return -1;
+            if (slot.key == key) return slot.val;
+        }
+    }
+
+    /** Inserts (key, val) if key is not there yet.
+    @return The value now stored under key. */
+    ValT insert(KeyT key, ValT val)
+    {
+        if (is_direct()) {
+            if (key >= 0 && (size_t)key < _direct.size()) {
+                ValT &dval(_direct[key]);
+                if (dval < 0) {
+                    dval = val;
+                    ++_size;
+                }
+                return dval;
+            }
+            to_hash();    // Key outside the declared extent
+        }
+
+        if ((_size+1)*10 > _slots.size()*7) {
+            rehash(_size+1);
+            if (maybe_direct()) return insert(key, val);
+        }
+
+        size_t const mask = _slots.size() - 1;
+        for (size_t i = hash(key);; i = (i+1) & mask) {
+            Slot &slot(_slots[i]);
+            if (slot.val < 0) {
+                slot.key = key;
+                slot.val = val;
+                ++_size;
+                return val;
+            }
+            if (slot.key == key) return slot.val;
+        }
+    }
+
+private:
+    /** Top bits of the mixed key: linearized grid indices (i*nj + j,
+    often with power-of-two strides) do not pile up in a few runs. */
+    size_t hash(KeyT key) const
+        { return (size_t)(ibmisc::hash_mix((uint64_t)key) >> _shift); }
+
+    /** Resizes the hash table to hold n keys below 70% load. */
+    void rehash(size_t n)
+    {
+        size_t cap = 16;
+        int bits = 4;
+        while (cap*7 < n*10) {
+            cap *= 2;
+            ++bits;
+        }
+        if (cap <= _slots.size()) return;
+
+        std::vector<Slot> old;
+        old.swap(_slots);
+        _slots.assign(cap, Slot{KeyT(0), ValT(-1)});
+        _shift = 64 - bits;
+        _size = 0;
+        for (auto &slot : old) if (slot.val >= 0) insert(slot.key, slot.val);
+    }
+
+    /** Switches to the direct array, if the key range is small enough.
+    @param n Number of keys expected.
+    @return True if now in direct mode. */
+    bool maybe_direct(size_t n = 0)
+    {
+        if (is_direct()) return true;
+        if (_key_extent <= 0) return false;
+        long const nkeys = std::max(std::max(n, _size), (size_t)64);
+        if (_key_extent > direct_ratio * nkeys) return false;
+
+        std::vector<ValT> direct(_key_extent, ValT(-1));
+        for (auto &slot : _slots) {
+            if (slot.val < 0) continue;
+            if (slot.key < 0 || slot.key >= _key_extent) return false;
+            direct[slot.key] = slot.val;
+        }
+        _direct.swap(direct);
+        std::vector<Slot>().swap(_slots);
+        return true;
+    }
+
+    /** Leaves direct mode (a key fell outside the key extent) */
+    void to_hash()
+    {
+        std::vector<ValT> direct;
+        direct.swap(_direct);
+        _key_extent = -1;
+        _size = 0;
+        size_t n = 0;
+        for (auto val : direct) if (val >= 0) ++n;
+        rehash(n+1);
+        for (size_t key=0; key<direct.size(); ++key)
+            if (direct[key] >= 0) insert(key, direct[key]);
+    }
+};
+
+template<class KeyT, class ValT>
+long const FlatIndexMap<KeyT,ValT>::direct_ratio;
+
+}    // namespace spsparse
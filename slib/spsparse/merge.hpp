@@ -0,0 +1,299 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSPARSE_MERGE_HPP
+#define SPSPARSE_MERGE_HPP
+
+#include <array>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <Eigen/SparseCore>
+#include <ibmisc/error.hpp>
+#include <spsparse/accum.hpp>
+#include <spsparse/tuplelist.hpp>
+
+namespace spsparse {
+
+/** @defgroup merge merge.hpp
+@brief Linear-time elementwise operations on sorted sparse arrays.
+
+Each operation walks two sorted, consolidated sources side by side
+(a merge-join), and emits the result, also sorted, into an accumulator
+(via add_batch()).  Nothing is sorted, and there are no intermediate
+copies.
+
+A source is a cursor, in the style of ZArray_Generator: operator++()
+moves to the next (or first) element, returning false at the end; and
+index() and value() give the current element.  cursor() makes one for
+a TupleList or an Eigen::SparseMatrix; an ibmisc::ZArray_Generator is
+one already.
+
+Both sources must be in the same order, described by CompareT:
+LexLess (the order of a consolidated TupleList, or a row-major Eigen
+matrix), or ColMajorLess (a column-major Eigen matrix, or a ZArray
+compressed from one).  An unsorted source, or one with duplicates, is
+an error.  The shape of the accumulator is not set.
+
+@{ */
+
+/** Row-major order on indices: same as consolidate() */
+struct LexLess {
+    template<class IndexT, size_t RANK>
+    bool operator()(std::array<IndexT,RANK> const &a, std::array<IndexT,RANK> const &b) const
+        { return a < b; }
+};
+
+/** Column-major order on indices: the last index varies slowest */
+struct ColMajorLess {
+    template<class IndexT, size_t RANK>
+    bool operator()(std::array<IndexT,RANK> const &a, std::array<IndexT,RANK> const &b) const
+    {
+        for (int i=RANK-1; i>=0; --i) {
+            if (a[i] != b[i]) return a[i] < b[i];
+        }
+        return false;
+    }
+};
+
+// -----------------------------------------------------------
+/** Cursor over a TupleList */
+template<class TupleListT>
+class TupleListCursor {
+    TupleListT const &A;
+    size_t ix;
+public:
+    static const int rank = TupleListT::rank;
+    typedef typename TupleListT::index_type index_type;
+    typedef typename TupleListT::val_type val_type;
+
+    explicit TupleListCursor(TupleListT const &_A) : A(_A), ix(-1) {}
+
+    bool operator++()
+        { return ++ix < A.size(); }
+    std::array<index_type,rank> const &index() const
+        { return A[ix].index(); }
+    val_type value() const
+        { return A[ix].value(); }
+};
+
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+TupleListCursor<TupleList<IndexT,ValT,RANK,StorageT,CHECKED>> cursor(
+    TupleList<IndexT,ValT,RANK,StorageT,CHECKED> const &A)
+    { return TupleListCursor<TupleList<IndexT,ValT,RANK,StorageT,CHECKED>>(A); }
+
+#define ARGS _Scalar,_Options,_StorageIndex
+/** Cursor over an Eigen::SparseMatrix, in its storage order: use
+ColMajorLess for column-major matrices. */
+template<class _Scalar, int _Options, class _StorageIndex>
+class EigenCursor {
+    Eigen::SparseMatrix<ARGS> const &M;
+    long k, p, p1;    // Outer index; position in inner arrays
+    std::array<_StorageIndex,2> ix;
+public:
+    static const int rank = 2;
+    typedef _StorageIndex index_type;
+    typedef _Scalar val_type;
+
+    explicit EigenCursor(Eigen::SparseMatrix<ARGS> const &_M)
+        : M(_M), k(-1), p(0), p1(0) {}
+
+    bool operator++()
+    {
+        ++p;
+        while (p >= p1) {
+            if (++k >= M.outerSize()) return false;
+            p = M.outerIndexPtr()[k];
+            p1 = (M.innerNonZeroPtr()
+                ? p + M.innerNonZeroPtr()[k]
+                : M.outerIndexPtr()[k+1]);
+        }
+        bool const row_major = Eigen::SparseMatrix<ARGS>::IsRowMajor;
+        ix[row_major ? 0 : 1] = k;
+        ix[row_major ? 1 : 0] = M.innerIndexPtr()[p];
+        return true;
+    }
+
+    std::array<_StorageIndex,2> const &index() const
+        { return ix; }
+    _Scalar value() const
+        { return M.valuePtr()[p]; }
+};
+
+template<class _Scalar, int _Options, class _StorageIndex>
+EigenCursor<ARGS> cursor(Eigen::SparseMatrix<ARGS> const &M)
+    { return EigenCursor<ARGS>(M); }
+#undef ARGS
+
+// -----------------------------------------------------------
+namespace _merge {
+
+template<class CursorT>
+using index_array = typename std::decay<decltype(std::declval<CursorT>().index())>::type;
+template<class CursorT>
+using value = typename std::decay<decltype(std::declval<CursorT>().value())>::type;
+
+/** Wraps a cursor; checks that it stays strictly increasing. */
+template<class CursorT, class CompareT>
+class Checked {
+    CursorT &cur;
+    CompareT const &less;
+    char const *name;
+public:
+    typedef index_array<CursorT> IndexArrayT;
+
+    bool valid;
+    IndexArrayT last;
+
+    Checked(CursorT &_cur, CompareT const &_less, char const *_name)
+        : cur(_cur), less(_less), name(_name)
+        { valid = ++cur; if (valid) last = cur.index(); }
+
+    void next()
+    {
+        valid = ++cur;
+        if (!valid) return;
+        if (!less(last, cur.index())) (*ibmisc::ibmisc_error)(-1,
+            "Source %s is not sorted and consolidated", name);
+        last = cur.index();
+    }
+
+    IndexArrayT const &index() const { return cur.index(); }
+    _merge::value<CursorT> value() const { return cur.value(); }
+};
+
+/** Collects output, and passes it on in batches */
+template<class AccumT, class IndexArrayT, class ValT>
+class Emitter {
+    AccumT &ret;
+    std::vector<IndexArrayT> indices;
+    std::vector<ValT> vals;
+public:
+    explicit Emitter(AccumT &_ret) : ret(_ret)
+    {
+        indices.reserve(accum::batch_size);
+        vals.reserve(accum::batch_size);
+    }
+
+    void operator()(IndexArrayT const &index, ValT const &val)
+    {
+        indices.push_back(index);
+        vals.push_back(val);
+        if (vals.size() == accum::batch_size) flush();
+    }
+
+    void flush()
+    {
+        if (vals.size() > 0) accum::add_batch(ret, &indices[0], &vals[0], vals.size());
+        indices.clear();
+        vals.clear();
+    }
+};
+
+}    // namespace _merge
+
+/** Merge-joins two sorted sources, calling
+fn(index, a, b) for every index in either one.  a (or b) is a pointer
+to the value in A (or B), or null if that source has no element
+there.  B's values are converted to the type of A's. */
+template<class CursorA, class CursorB, class FnT, class CompareT = LexLess>
+void merge_join(CursorA &&A, CursorB &&B, FnT &&fn, CompareT const &less = CompareT())
+{
+    typedef typename std::remove_reference<CursorA>::type CursorAT;
+    typedef typename std::remove_reference<CursorB>::type CursorBT;
+    typedef _merge::value<CursorAT> ValT;
+    _merge::Checked<CursorAT, CompareT> a(A, less, "A");
+    _merge::Checked<CursorBT, CompareT> b(B, less, "B");
+
+    while (a.valid || b.valid) {
+        if (b.valid && (!a.valid || less(b.index(), a.index()))) {
+            ValT const bv = b.value();
+            fn(b.index(), (ValT const *)nullptr, &bv);
+            b.next();
+        } else if (a.valid && (!b.valid || less(a.index(), b.index()))) {
+            ValT const av = a.value();
+            fn(a.index(), &av, (ValT const *)nullptr);
+            a.next();
+        } else {
+            ValT const av = a.value();
+            ValT const bv = b.value();
+            fn(a.index(), &av, &bv);
+            a.next();
+            b.next();
+        }
+    }
+}
+
+/** ret = alpha*A + beta*B: the union of the two patterns.  Sums that
+come out zero are kept (they are in the pattern). */
+template<class AccumT, class CursorA, class CursorB, class CompareT = LexLess>
+void merge_add(AccumT &&ret, CursorA &&A, CursorB &&B,
+    double alpha = 1.0, double beta = 1.0, CompareT const &less = CompareT())
+{
+    typedef typename std::remove_reference<AccumT>::type AccumTT;
+    typedef _merge::index_array<typename std::remove_reference<CursorA>::type> IndexArrayT;
+    typedef _merge::value<typename std::remove_reference<CursorA>::type> ValT;
+    _merge::Emitter<AccumTT, IndexArrayT, typename AccumTT::val_type> emit(ret);
+
+    merge_join(A, B, [&](IndexArrayT const &index, ValT const *a, ValT const *b) {
+        ValT val = 0;
+        if (a) val += alpha * *a;
+        if (b) val += beta * *b;
+        emit(index, val);
+    }, less);
+    emit.flush();
+}
+
+/** ret = A .* B (elementwise product): the intersection of the two
+patterns. */
+template<class AccumT, class CursorA, class CursorB, class CompareT = LexLess>
+void merge_multiply(AccumT &&ret, CursorA &&A, CursorB &&B,
+    CompareT const &less = CompareT())
+{
+    typedef typename std::remove_reference<AccumT>::type AccumTT;
+    typedef _merge::index_array<typename std::remove_reference<CursorA>::type> IndexArrayT;
+    typedef _merge::value<typename std::remove_reference<CursorA>::type> ValT;
+    _merge::Emitter<AccumTT, IndexArrayT, typename AccumTT::val_type> emit(ret);
+
+    merge_join(A, B, [&](IndexArrayT const &index, ValT const *a, ValT const *b) {
+        if (a && b) emit(index, *a * *b);
+    }, less);
+    emit.flush();
+}
+
+/** Emits the elements of A where B has (keep=true), or does not have
+(keep=false), an element.  B's values are ignored. */
+template<class AccumT, class CursorA, class CursorB, class CompareT = LexLess>
+void merge_mask(AccumT &&ret, CursorA &&A, CursorB &&B,
+    bool keep = true, CompareT const &less = CompareT())
+{
+    typedef typename std::remove_reference<AccumT>::type AccumTT;
+    typedef _merge::index_array<typename std::remove_reference<CursorA>::type> IndexArrayT;
+    typedef _merge::value<typename std::remove_reference<CursorA>::type> ValT;
+    _merge::Emitter<AccumTT, IndexArrayT, typename AccumTT::val_type> emit(ret);
+
+    merge_join(A, B, [&](IndexArrayT const &index, ValT const *a, ValT const *b) {
+        if (a && (b != nullptr) == keep) emit(index, *a);
+    }, less);
+    emit.flush();
+}
+
+/** @} */
+
+}    // namespace spsparse
+#endif    // guard
@@ -19,9 +19,11 @@
 #ifndef SPSPARSE_NETCDF_HPP
 #define SPSPARSE_NETCDF_HPP
 
+#include <algorithm>
 #include <functional>
 #include <ibmisc/ibmisc.hpp>
 #include <ibmisc/netcdf.hpp>
+#include <spsparse/accum.hpp>
 
 namespace spsparse {
 
@@ -31,6 +33,10 @@ namespace spsparse {
 @{
 */
 
+/** Number of tuples moved per NetCDF call by nc_write_spsparse() and
+nc_read_spsparse() */
+static size_t const nc_batch_size = 65536;
+
 template<class ArrayT>
 void nc_write_spsparse(
     netCDF::NcGroup *nc,
@@ -38,25 +44,39 @@ void nc_write_spsparse(
     std::string const &vname);
 
 
+/** Writes through a staging buffer, nc_batch_size tuples per call. */
 template<class ArrayT>
 void nc_write_spsparse(
     netCDF::NcGroup *nc,
     ArrayT *A,
     std::string const &vname)
 {
-    std::array<size_t, ArrayT::rank> shape;     // Extent of each dimension
+    int const rank = ArrayT::rank;
     netCDF::NcVar indices_v = nc->getVar(vname + ".indices");
     netCDF::NcVar vals_v = nc->getVar(vname + ".vals");
 
-    std::vector<size_t> startp = {0, 0};        // SIZE, RANK
-    std::vector<size_t> countp = {1, A->rank};  // Write RANK elements at a time
-    for (auto ii = A->begin(); ii != A->end(); ++ii, ++startp[0]) {
-        auto index(ii->index());
-        auto val(ii->value());
-
-        indices_v.putVar(startp, countp, &index[0]);
-        vals_v.putVar(startp, countp, &val);
+    std::vector<typename ArrayT::index_type> indices;
+    std::vector<typename ArrayT::val_type> vals;
+    indices.reserve(nc_batch_size * rank);
+    vals.reserve(nc_batch_size);
+
+    size_t start = 0;
+    auto flush = [&]() {
+        if (vals.size() == 0) return;
+        indices_v.putVar({start, 0}, {vals.size(), (size_t)rank}, &indices[0]);
+        vals_v.putVar({start}, {vals.size()}, &vals[0]);
+        start += vals.size();
+        indices.clear();
+        vals.clear();
+    };
+
+    for (auto ii = A->begin(); ii != A->end(); ++ii) {
+        auto const &index(ii->index());
+        for (int k=0; k<rank; ++k) indices.push_back(index[k]);
+        vals.push_back(ii->value());
+        if (vals.size() == nc_batch_size) flush();
     }
+    flush();
 }
 // --------------------------------------------------------
 
@@ -66,29 +86,32 @@ void nc_read_spsparse(
     AccumulatorT *A,
     std::string const &vname);
 
+/** Reads through a staging buffer, nc_batch_size tuples per call;
+each batch goes to A via accum::add_batch(). */
 template<class AccumulatorT>
 void nc_read_spsparse(
     netCDF::NcGroup *nc,
     AccumulatorT *A,
     std::string const &vname)
 {
-    std::array<size_t, AccumulatorT::rank> shape;       // Extent of each dimension
+    int const rank = AccumulatorT::rank;
+    typedef std::array<typename AccumulatorT::index_type, AccumulatorT::rank> IndexT;
+    static_assert(sizeof(IndexT) == rank * sizeof(typename AccumulatorT::index_type),
+        "std::array<index_type,rank> must be contiguous");
 
     netCDF::NcVar indices_v = nc->getVar(vname + ".indices");
     netCDF::NcVar vals_v = nc->getVar(vname + ".vals");
 
     size_t size = vals_v.getDim(0).getSize();   // # non-zero elements
 
-    std::vector<size_t> startp = {0, 0};        // SIZE, RANK
-    std::vector<size_t> countp = {1, AccumulatorT::rank};   // Write RANK elements at a time
-    std::array<typename AccumulatorT::index_type, AccumulatorT::rank> index;
-    typename AccumulatorT::val_type val;
-
-    for (; startp[0]<size; ++startp[0]) {
-        indices_v.getVar(startp, countp, &index[0]);
-        vals_v.getVar(startp, countp, &val);
+    std::vector<IndexT> indices(std::min(size, nc_batch_size));
+    std::vector<typename AccumulatorT::val_type> vals(indices.size());
+    for (size_t start=0; start<size; start += nc_batch_size) {
+        size_t const n = std::min(nc_batch_size, size - start);
+        indices_v.getVar({start, 0}, {n, (size_t)rank}, &indices[0][0]);
+        vals_v.getVar({start}, {n}, &vals[0]);
 
-        A->add(index, val);
+        accum::add_batch(*A, &indices[0], &vals[0], n);
     }
 }
 
@@ -128,7 +151,7 @@ void ncio_spsparse(
         dims = ibmisc::get_dims(ncio, dim_names);
 
         // Read
-        netCDF::NcVar info_v = ncio.nc->getVar(vname + ".info");
+        netCDF::NcVar info_v = ncio.getVar(vname + ".info");
         auto shape_a = info_v.getAtt("shape");
 
         // Check the rank in NetCDF matches SpSparse rank
@@ -149,7 +172,7 @@ void ncio_spsparse(
             // Reserve space for the non-zero elements
             A.clear();
             A.set_shape(shape);
-            A.reserve(ncio.nc->getDim(vname + ".size").getSize());
+            A.reserve(ncio.getDim(vname + ".size").getSize());
         }
 
         ncio += std::bind(&nc_read_spsparse<ArrayT>, ncio.nc, &A, vname);
@@ -0,0 +1,134 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSPARSE_PARALLEL_ACCUM_HPP
+#define SPSPARSE_PARALLEL_ACCUM_HPP
+
+#include <vector>
+#include <functional>
+#include <ibmisc/parallel.hpp>
+#include <spsparse/accum.hpp>
+#include <spsparse/tuplelist.hpp>
+
+namespace spsparse {
+namespace accum {
+
+/** @brief Lets several threads feed one (single-writer) accumulator chain.
+
+Each thread adds into its own private TupleList, part(i); merge() then
+replays the parts, in order, into the real destination chain.  Nothing
+is shared while the threads run, so the chain itself (including any
+ADD_DENSE Sparsify) runs on one thread, and every part sees the same
+dense indices.
+
+Parts are merged in index order: if part i gets the i'th contiguous
+chunk of the work (as run() does), the result is identical to running
+the loop serially, for any number of parts.
+
+Usage Example (on the shared pool of ibmisc/parallel.hpp):
+@code
+ParallelAccum<long,double,2> pacc(nthreads);
+ibmisc::parallel_for(0, nthreads, nthreads, [&](long t0, long t1) {
+    for (long i=t0*n/nthreads; i<t1*n/nthreads; ++i) pacc.part(t0).add(...);
+});
+pacc.merge(accum::sparsify(..., accum::ref(M)));
+@endcode
+*/
+template<class IndexT, class ValT, int RANK>
+class ParallelAccum {
+public:
+    typedef TupleList<IndexT,ValT,RANK> TupleListT;
+
+    std::vector<TupleListT> parts;
+
+    /** @param nparts Number of private accumulators; usually the
+        number of threads. */
+    ParallelAccum(int nparts, std::array<long,RANK> const &shape)
+        : parts(nparts, TupleListT(shape)) {}
+
+    ParallelAccum(int nparts)
+        : parts(nparts) {}
+
+    int nparts() const
+        { return parts.size(); }
+
+    /** Private accumulator for thread / chunk i */
+    TupleListT &part(int i)
+        { return parts[i]; }
+
+    void set_shape(std::array<long,RANK> const &shape)
+        { for (auto &p : parts) p.set_shape(shape); }
+
+    /** Total number of elements held */
+    size_t size() const
+    {
+        size_t n = 0;
+        for (auto &p : parts) n += p.size();
+        return n;
+    }
+
+    /** Splits [begin, end) into nparts() contiguous chunks, and runs
+    fn(chunk_begin, chunk_end, part(i)) on the i'th chunk, each in its
+    own thread. */
+    void run(long begin, long end,
+        std::function<void(long, long, TupleListT &)> const &fn);
+
+    /** Replays all parts, in order, into sub (via add_batch()), then
+    empties them.  Each part's memory is released once it is merged. */
+    template<class AccumT>
+    void merge(AccumT &&sub);
+};
+
+template<class IndexT, class ValT, int RANK>
+void ParallelAccum<IndexT,ValT,RANK>::
+    run(long begin, long end,
+        std::function<void(long, long, TupleListT &)> const &fn)
+    {
+        long const n = end - begin;
+        long const np = nparts();
+        ibmisc::parallel_for(0, np, np, [&](long p0, long p1) {
+            for (long p=p0; p<p1; ++p) {
+                fn(begin + n*p/np, begin + n*(p+1)/np, parts[p]);
+            }
+        });
+    }
+
+template<class IndexT, class ValT, int RANK>
+template<class AccumT>
+void ParallelAccum<IndexT,ValT,RANK>::
+    merge(AccumT &&sub)
+    {
+        std::vector<std::array<IndexT,RANK>> indices;
+        std::vector<ValT> vals;
+        for (auto &p : parts) {
+            for (size_t i0=0; i0 < p.size(); i0 += batch_size) {
+                size_t const i1 = std::min(p.size(), i0 + batch_size);
+                indices.clear();
+                vals.clear();
+                for (size_t i=i0; i<i1; ++i) {
+                    indices.push_back(p.tuples[i].index());
+                    vals.push_back(p.tuples[i].value());
+                }
+                accum::add_batch(sub, &indices[0], &vals[0], i1-i0);
+            }
+            typename TupleListT::VectorT().swap(p.tuples);
+        }
+    }
+
+}}    // namespace
+#endif    // guard
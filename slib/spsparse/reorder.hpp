@@ -0,0 +1,137 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSPARSE_REORDER_HPP
+#define SPSPARSE_REORDER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/** Locality-improving orderings of a dense index space, for
+SparseSet::permute_dense().  Each returns old_of_new: the n'th index
+of the new ordering is old_of_new[n] in the old one. */
+namespace spsparse {
+
+/** @return Position of cell (x,y) along the Hilbert curve that fills
+    a 2^order x 2^order grid */
+inline uint64_t hilbert_index(uint32_t x, uint32_t y, int order)
+{
+    uint64_t d = 0;
+    for (uint32_t s = uint32_t(1) << (order-1); s > 0; s >>= 1) {
+        uint32_t const rx = (x & s) ? 1 : 0;
+        uint32_t const ry = (y & s) ? 1 : 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        // Rotate the quadrant
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s-1 - (x & (s-1));
+                y = s-1 - (y & (s-1));
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+/** Orders points (eg cell centers, in any 2D coordinates) along a
+Hilbert curve over their bounding box, so nearby points get nearby
+indices. */
+template<class DenseT = int>
+std::vector<DenseT> hilbert_order(std::vector<std::array<double,2>> const &centers)
+{
+    int const order = 16;
+    std::array<double,2> lo {std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+    std::array<double,2> hi {std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest()};
+    for (auto const &c : centers) {
+        for (int k=0; k<2; ++k) {
+            lo[k] = std::min(lo[k], c[k]);
+            hi[k] = std::max(hi[k], c[k]);
+        }
+    }
+
+    double const ncells = (double)((1 << order) - 1);
+    std::vector<uint64_t> keys;
+    keys.reserve(centers.size());
+    for (auto const &c : centers) {
+        std::array<uint32_t,2> ix;
+        for (int k=0; k<2; ++k) {
+            double const span = hi[k] - lo[k];
+            ix[k] = (span > 0 ? (uint32_t)((c[k] - lo[k]) / span * ncells) : 0);
+        }
+        keys.push_back(hilbert_index(ix[0], ix[1], order));
+    }
+
+    std::vector<DenseT> ret(centers.size());
+    for (size_t i=0; i<ret.size(); ++i) ret[i] = i;
+    std::stable_sort(ret.begin(), ret.end(),
+        [&keys](DenseT a, DenseT b) { return keys[a] < keys[b]; });
+    return ret;
+}
+
+/** Reverse Cuthill-McKee ordering of a symmetric graph, which keeps
+neighbors close together (low bandwidth).
+@param adj_ptr Neighbors of node v are adj[adj_ptr[v] : adj_ptr[v+1]]
+@param adj Neighbors; self-loops are ignored. */
+template<class DenseT = int, class PtrT>
+std::vector<DenseT> rcm_order(
+    std::vector<PtrT> const &adj_ptr,
+    std::vector<DenseT> const &adj)
+{
+    long const n = (adj_ptr.empty() ? 0 : adj_ptr.size() - 1);
+    std::vector<long> degree(n);
+    for (long v=0; v<n; ++v) degree[v] = adj_ptr[v+1] - adj_ptr[v];
+
+    // Start each connected component from an unvisited node of least degree
+    std::vector<DenseT> by_degree(n);
+    for (long v=0; v<n; ++v) by_degree[v] = v;
+    std::stable_sort(by_degree.begin(), by_degree.end(),
+        [&degree](DenseT a, DenseT b) { return degree[a] < degree[b]; });
+
+    std::vector<char> visited(n, 0);
+    std::vector<DenseT> order;    // Cuthill-McKee order; doubles as the BFS queue
+    order.reserve(n);
+    std::vector<DenseT> nbrs;
+    for (DenseT const start : by_degree) {
+        if (visited[start]) continue;
+        visited[start] = 1;
+        order.push_back(start);
+        for (size_t q=order.size()-1; q < order.size(); ++q) {
+            DenseT const v = order[q];
+            nbrs.clear();
+            for (PtrT p=adj_ptr[v]; p<adj_ptr[v+1]; ++p) {
+                DenseT const w = adj[p];
+                if (!visited[w]) {
+                    visited[w] = 1;
+                    nbrs.push_back(w);
+                }
+            }
+            std::stable_sort(nbrs.begin(), nbrs.end(),
+                [&degree](DenseT a, DenseT b) { return degree[a] < degree[b]; });
+            order.insert(order.end(), nbrs.begin(), nbrs.end());
+        }
+    }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+}    // namespace spsparse
+#endif    // guard
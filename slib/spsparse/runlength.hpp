@@ -2,6 +2,8 @@
 #define SPSPARSE_RUNLENGTH_HPP
 
 #include <cmath>
+#include <vector>
+#include <algorithm>
 #include <blitz/array.h>
 #include <boost/enum.hpp>
 
@@ -22,7 +24,7 @@ struct DefaultRLEqual {
 };
 
 template<>
-bool DefaultRLEqual<double>::operator()(double const &a, double const &b) const
+inline bool DefaultRLEqual<double>::operator()(double const &a, double const &b) const
 {
     switch(
         (std::isnan(a) ? 2 : 0) +
@@ -39,7 +41,7 @@ bool DefaultRLEqual<double>::operator()(double const &a, double const &b) const
 }
 
 template<>
-bool DefaultRLEqual<float>::operator()(float const &a, float const &b) const
+inline bool DefaultRLEqual<float>::operator()(float const &a, float const &b) const
 {
     switch(
         (std::isnan(a) ? 2 : 0) +
@@ -230,10 +232,108 @@ RLDecode<CountsIterT, ValuesIterT> rl_decode(
 }
 
 // ===========================================================================
+// Bulk encode/decode of contiguous spans
 
+namespace _runlength {
 
+/** a == b, optionally also true if both are NaN (see DefaultRLEqual).
+Written with bitwise ops, so a loop of them has no branches. */
+template<class TypeT>
+inline bool rl_eq(TypeT a, TypeT b, bool nan_equal)
+    { return (a == b) | (nan_equal & (a != a) & (b != b)); }
 
+/** @return First i in [i0, n) with val(i) != v, or n */
+template<class TypeT, class ValFn>
+inline size_t run_end(size_t i0, size_t n, TypeT v, bool nan_equal, ValFn const &val)
+{
+    size_t i = i0;
+
+    // Compare 8 at a time into a bitmask; stop at the first mismatch
+    while (i + 8 <= n) {
+        unsigned mask = 0;
+        for (int k=0; k<8; ++k) mask |= (unsigned)(!rl_eq(val(i+k), v, nan_equal)) << k;
+        if (mask) return i + __builtin_ctz(mask);
+        i += 8;
+    }
+    while (i < n && rl_eq(val(i), v, nan_equal)) ++i;
+    return i;
+}
 
+template<class TypeT, class CountT, class ValFn>
+size_t rl_encode_runs(size_t n, std::vector<CountT> &counts, std::vector<TypeT> &values,
+    bool nan_equal, ValFn const &val)
+{
+    size_t nruns = 0;
+    for (size_t i=0; i<n; ++nruns) {
+        TypeT const v = val(i);
+        size_t const j = run_end(i+1, n, v, nan_equal, val);
+        counts.push_back(j - i);
+        values.push_back(v);
+        i = j;
+    }
+    return nruns;
+}
+
+}    // namespace _runlength
+
+/** Runlength encodes a span of values in one pass; produces the same
+runs as vaccum::rl_encode(), with the runs appended to counts and values.
+@param raw Values to encode
+@param n Number of values
+@param nan_equal Treat NaN as equal to NaN (as DefaultRLEqual does)
+@return Number of runs added */
+template<class TypeT, class CountT>
+size_t rl_encode_bulk(
+    TypeT const *raw, size_t n,
+    std::vector<CountT> &counts,
+    std::vector<TypeT> &values,
+    RLAlgo algo = RLAlgo::PLAIN,
+    bool nan_equal = true)
+{
+    switch(algo.index()) {
+        case RLAlgo::DIFFS :
+            // The first value is kept raw (difference from 0)
+            return _runlength::rl_encode_runs(n, counts, values, nan_equal,
+                [raw](size_t i) { return i == 0 ? raw[0] : TypeT(raw[i] - raw[i-1]); });
+        default :
+            return _runlength::rl_encode_runs(n, counts, values, nan_equal,
+                [raw](size_t i) { return raw[i]; });
+    }
+}
+
+/** @return Number of values encoded in a set of runs */
+template<class CountT>
+size_t rl_decoded_size(CountT const *counts, size_t nruns)
+{
+    size_t n = 0;
+    for (size_t i=0; i<nruns; ++i) n += counts[i];
+    return n;
+}
+
+/** Decodes runs from rl_encode_bulk() (or vaccum::rl_encode()) into a
+span of rl_decoded_size(counts, nruns) values.
+@return Number of values written to out */
+template<class CountT, class TypeT>
+size_t rl_decode_bulk(
+    CountT const *counts, TypeT const *values, size_t nruns,
+    TypeT *out,
+    RLAlgo algo = RLAlgo::PLAIN)
+{
+    TypeT * const out0 = out;
+    switch(algo.index()) {
+        case RLAlgo::DIFFS : {
+            TypeT raw = 0;
+            for (size_t r=0; r<nruns; ++r) {
+                TypeT const v = values[r];
+                for (CountT k=0; k<counts[r]; ++k) *out++ = (raw += v);
+            }
+        } break;
+        default :
+            for (size_t r=0; r<nruns; ++r) out = std::fill_n(out, counts[r], values[r]);
+        break;
+    }
+    return out - out0;
+}
 
 // ---------------------------------------------------------------------
 } // namespace spsparse
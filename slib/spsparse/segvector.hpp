@@ -0,0 +1,253 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSPARSE_SEGVECTOR_HPP
+#define SPSPARSE_SEGVECTOR_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace spsparse {
+
+template<class T, int PAGE_BITS>
+class SegmentedVector;
+
+namespace _segvector {
+
+/** Random-access iterator over a SegmentedVector; good for std::sort
+and friends. */
+template<class VectorT, class ValueT>
+class Iterator {
+    template<class, class> friend class Iterator;
+
+    VectorT *vec;
+    size_t ix;
+public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef typename std::remove_const<ValueT>::type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef ValueT *pointer;
+    typedef ValueT &reference;
+
+    Iterator() : vec(0), ix(0) {}
+    Iterator(VectorT *_vec, size_t _ix) : vec(_vec), ix(_ix) {}
+
+    /** iterator converts to const_iterator */
+    template<class V2, class T2>
+    Iterator(Iterator<V2,T2> const &other) : vec(other.vec), ix(other.ix) {}
+
+    reference operator*() const { return (*vec)[ix]; }
+    pointer operator->() const { return &(*vec)[ix]; }
+    reference operator[](difference_type n) const { return (*vec)[ix+n]; }
+
+    Iterator &operator++() { ++ix; return *this; }
+    Iterator &operator--() { --ix; return *this; }
+    Iterator operator++(int) { Iterator ret(*this); ++ix; return ret; }
+    Iterator operator--(int) { Iterator ret(*this); --ix; return ret; }
+    Iterator &operator+=(difference_type n) { ix += n; return *this; }
+    Iterator &operator-=(difference_type n) { ix -= n; return *this; }
+    Iterator operator+(difference_type n) const { return Iterator(vec, ix+n); }
+    Iterator operator-(difference_type n) const { return Iterator(vec, ix-n); }
+    friend Iterator operator+(difference_type n, Iterator const &it)
+        { return it + n; }
+
+    template<class V2, class T2>
+    difference_type operator-(Iterator<V2,T2> const &other) const
+        { return (difference_type)ix - (difference_type)other.ix; }
+
+    template<class V2, class T2>
+    bool operator==(Iterator<V2,T2> const &other) const { return ix == other.ix; }
+    template<class V2, class T2>
+    bool operator!=(Iterator<V2,T2> const &other) const { return ix != other.ix; }
+    template<class V2, class T2>
+    bool operator<(Iterator<V2,T2> const &other) const { return ix < other.ix; }
+    template<class V2, class T2>
+    bool operator>(Iterator<V2,T2> const &other) const { return ix > other.ix; }
+    template<class V2, class T2>
+    bool operator<=(Iterator<V2,T2> const &other) const { return ix <= other.ix; }
+    template<class V2, class T2>
+    bool operator>=(Iterator<V2,T2> const &other) const { return ix >= other.ix; }
+};
+
+}    // namespace _segvector
+
+/** @brief A std::vector look-alike stored in fixed-size pages.
+
+Growing never moves what's already stored: it just adds a page.  So
+peak memory is the contents plus one page (not ~3x the contents, as
+when a std::vector doubles), and there are no big copies on append.
+Elements are not contiguous; but iterators are random-access, and
+references stay valid until the element is erased.
+
+Supports the subset of std::vector used by TupleList, consolidate(),
+ncio() and boost serialization.  T must be default-constructible.
+
+@param PAGE_BITS log2 of the number of elements per page */
+template<class T, int PAGE_BITS = 16>
+class SegmentedVector {
+public:
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef T &reference;
+    typedef T const &const_reference;
+    typedef _segvector::Iterator<SegmentedVector, T> iterator;
+    typedef _segvector::Iterator<SegmentedVector const, T const> const_iterator;
+
+    static size_t const page_size = (size_t)1 << PAGE_BITS;
+
+private:
+    static size_t const page_mask = page_size - 1;
+
+    std::vector<std::unique_ptr<T[]>> pages;
+    size_t _size;
+
+public:
+    SegmentedVector() : _size(0) {}
+
+    SegmentedVector(SegmentedVector const &other) : _size(0)
+        { *this = other; }
+
+    SegmentedVector(SegmentedVector &&other)
+        : pages(std::move(other.pages)), _size(other._size)
+        { other._size = 0; }
+
+    SegmentedVector &operator=(SegmentedVector const &other)
+    {
+        if (&other == this) return *this;
+        clear();
+        reserve(other.size());
+        for (size_t p=0; p*page_size < other.size(); ++p) {
+            size_t const n = std::min(page_size, other.size() - p*page_size);
+            std::copy(&other.pages[p][0], &other.pages[p][0] + n, &pages[p][0]);
+        }
+        _size = other.size();
+        return *this;
+    }
+
+    SegmentedVector &operator=(SegmentedVector &&other)
+    {
+        pages = std::move(other.pages);
+        _size = other._size;
+        other._size = 0;
+        return *this;
+    }
+
+    void swap(SegmentedVector &other)
+    {
+        pages.swap(other.pages);
+        std::swap(_size, other._size);
+    }
+
+    // ------------------------------------------------
+    size_t size() const
+        { return _size; }
+    bool empty() const
+        { return _size == 0; }
+    size_t capacity() const
+        { return pages.size() * page_size; }
+
+    T &operator[](size_t i)
+        { return pages[i >> PAGE_BITS][i & page_mask]; }
+    T const &operator[](size_t i) const
+        { return pages[i >> PAGE_BITS][i & page_mask]; }
+
+    T &front() { return (*this)[0]; }
+    T const &front() const { return (*this)[0]; }
+    T &back() { return (*this)[_size-1]; }
+    T const &back() const { return (*this)[_size-1]; }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, _size); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, _size); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    // ------------------------------------------------
+    /** Allocates pages for at least n elements; nothing is moved. */
+    void reserve(size_t n)
+    {
+        while (capacity() < n) pages.push_back(std::unique_ptr<T[]>(new T[page_size]));
+    }
+
+    /** Frees pages beyond size() */
+    void shrink_to_fit()
+        { pages.resize((_size + page_mask) >> PAGE_BITS); }
+
+    /** Keeps pages allocated, like std::vector::clear() */
+    void clear()
+        { _size = 0; }
+
+    void resize(size_t n)
+    {
+        reserve(n);
+        for (size_t i=_size; i<n; ++i) (*this)[i] = T();
+        _size = n;
+    }
+
+    void push_back(T const &val)
+    {
+        if (_size == capacity()) reserve(_size+1);
+        (*this)[_size++] = val;
+    }
+
+    void push_back(T &&val)
+    {
+        if (_size == capacity()) reserve(_size+1);
+        (*this)[_size++] = std::move(val);
+    }
+
+    void pop_back()
+        { --_size; }
+
+    /** Removes [first, last), moving the tail down.  Erasing a tail,
+    as consolidate() does, moves nothing. */
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        size_t const i0 = first - cbegin();
+        size_t const i1 = last - cbegin();
+        std::move(begin()+i1, end(), begin()+i0);
+        _size -= (i1 - i0);
+        return begin()+i0;
+    }
+
+    // ------------------------------------------------
+    /** Boost serialization: the size, then each element. */
+    template<class ArchiveT>
+    void serialize(ArchiveT &ar, const unsigned int file_version)
+    {
+        size_t n = _size;
+        ar & n;
+        if (ArchiveT::is_loading::value) resize(n);
+        for (size_t i=0; i<n; ++i) ar & (*this)[i];
+    }
+};
+
+template<class T, int PAGE_BITS>
+size_t const SegmentedVector<T,PAGE_BITS>::page_size;
+
+template<class T, int PAGE_BITS>
+size_t const SegmentedVector<T,PAGE_BITS>::page_mask;
+
+}   // namespace
+#endif    // guard
@@ -0,0 +1,314 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSPARSE_SPILL_HPP
+#define SPSPARSE_SPILL_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <spsparse/accum.hpp>
+#include <spsparse/eigen.hpp>
+#include <spsparse/tuplelist.hpp>
+#include <spsparse/zvector.hpp>
+
+namespace spsparse {
+namespace accum {
+
+namespace _spill {
+
+/** Reads back one run written by Spill::spill(), a chunk at a time */
+template<class IndexT, class ValT, int RANK>
+class RunReader {
+    std::ifstream fin;
+    std::vector<std::array<IndexT,RANK>> indices;
+    std::vector<ValT> vals;
+    size_t ix;
+
+    bool read_zbuf(std::vector<char> &zbuf)
+    {
+        int64_t size;
+        if (!fin.read((char *)&size, sizeof(size))) return false;
+        zbuf.resize(size);
+        if (size > 0 && !fin.read(&zbuf[0], size)) (*ibmisc::ibmisc_error)(-1,
+            "Truncated spill file");
+        return true;
+    }
+
+    /** Loads the next chunk; false at the end of the run */
+    bool fill()
+    {
+        std::vector<char> zindices, zvals;
+        if (!read_zbuf(zindices)) return false;
+        if (!read_zbuf(zvals)) (*ibmisc::ibmisc_error)(-1,
+            "Truncated spill file");
+
+        indices.clear();
+        vals.clear();
+        for (vgen::ZVector<IndexT,RANK> gen(zindices); ++gen; ) indices.push_back(*gen);
+        for (vgen::ZVector<ValT,1> gen(zvals); ++gen; ) vals.push_back((*gen)[0]);
+        if (indices.size() != vals.size()) (*ibmisc::ibmisc_error)(-1,
+            "Corrupt spill file: %ld indices vs. %ld values",
+            (long)indices.size(), (long)vals.size());
+        ix = 0;
+        return true;
+    }
+
+public:
+    explicit RunReader(std::string const &fname)
+        : fin(fname.c_str(), std::ios::binary), ix(0)
+    {
+        if (!fin) (*ibmisc::ibmisc_error)(-1,
+            "Cannot open spill file %s", fname.c_str());
+    }
+
+    /** Moves to the next (first) tuple.  @return false at the end of the run */
+    bool next()
+    {
+        ++ix;
+        while (ix >= indices.size()) {
+            if (!fill()) return false;
+        }
+        return true;
+    }
+
+    std::array<IndexT,RANK> const &index() const
+        { return indices[ix]; }
+    ValT value() const
+        { return vals[ix]; }
+};
+
+}    // namespace _spill
+
+/** @brief Out-of-core accumulator: bounded RAM, for more tuples than fit in memory.
+
+Tuples are collected in RAM, up to max_tuples.  Then they are
+consolidated into a sorted run, which is spilled (ZVector-compressed)
+to a file in scratch_dir.  merge() k-way merges the runs, summing
+duplicates, into any accumulator.  While merging, RAM use is
+chunk_size tuples per run.
+
+Duplicates are summed within each run, then across runs, so results
+can differ from consolidate() on the whole list by roundoff.
+Entries with value 0 (or NaN, if zero_nan) are dropped, as in
+consolidate().  Run files are removed when the Spill is destroyed.
+
+Usage Example:
+@code
+accum::Spill<long,double,2> spill("/scratch", 1L<<26);
+spill.set_shape({nB, nA});
+for (...) spill.add({i,j}, val);
+TupleList<long,double,2> M;
+spill.merge(accum::ref(M));
+@endcode
+*/
+template<class IndexT, class ValT, int RANK>
+class Spill {
+public:
+    static const int rank = RANK;
+    typedef IndexT index_type;
+    typedef ValT val_type;
+
+    /** Tuples per compressed chunk of a run file */
+    static size_t const chunk_size = 1 << 16;
+
+private:
+    std::string const scratch_dir;
+    size_t const max_tuples;
+    bool const zero_nan;
+    int const nthreads;
+    TupleList<IndexT,ValT,RANK> buf;
+    std::vector<std::string> runs;
+
+    void write_zbuf(std::ofstream &fout, std::vector<char> const &zbuf)
+    {
+        int64_t const size = zbuf.size();
+        fout.write((char const *)&size, sizeof(size));
+        if (size > 0) fout.write(&zbuf[0], size);
+    }
+
+public:
+    /** @param _scratch_dir Directory for run files
+    @param _max_tuples Spill once this many tuples are in RAM
+    @param _zero_nan Drop NaN values, as well as 0
+    @param _nthreads Threads used to consolidate each run */
+    Spill(std::string const &_scratch_dir, size_t _max_tuples = 1 << 24,
+        bool _zero_nan = false, int _nthreads = 1)
+    : scratch_dir(_scratch_dir), max_tuples(_max_tuples),
+        zero_nan(_zero_nan), nthreads(_nthreads) {}
+
+    ~Spill()
+    {
+        for (auto const &fname : runs) ::remove(fname.c_str());
+    }
+
+    Spill(Spill const &) = delete;
+    Spill &operator=(Spill const &) = delete;
+
+    void set_shape(std::array<long,RANK> const &shape)
+        { buf.set_shape(shape); }
+
+    std::array<long,RANK> const &shape() const
+        { return buf.shape(); }
+
+    void add(std::array<IndexT,RANK> const &index, ValT const &value)
+    {
+        buf.add(index, value);
+        if (buf.size() >= max_tuples) spill();
+    }
+
+    void add_batch(std::array<IndexT,RANK> const *indices, ValT const *vals, size_t n)
+    {
+        while (n > 0) {
+            size_t const m = std::min(n, max_tuples - std::min(max_tuples, buf.size()));
+            buf.add_batch(indices, vals, m);
+            indices += m;
+            vals += m;
+            n -= m;
+            if (buf.size() >= max_tuples) spill();
+        }
+    }
+
+    /** Number of runs spilled so far */
+    size_t nruns() const
+        { return runs.size(); }
+
+    /** Consolidates the tuples in RAM and writes them to a new run file. */
+    void spill();
+
+    /** Merges everything added so far into out, sorted by index, with
+    duplicates summed.  The Spill is empty afterwards.
+    @param set_shape Call out.set_shape() first */
+    template<class AccumT>
+    void merge(AccumT &&out, bool set_shape = true);
+};
+
+template<class IndexT, class ValT, int RANK>
+size_t const Spill<IndexT,ValT,RANK>::chunk_size;
+
+template<class IndexT, class ValT, int RANK>
+void Spill<IndexT,ValT,RANK>::spill()
+{
+    if (buf.size() == 0) return;
+    consolidate(buf.tuples, zero_nan, nthreads);
+
+    std::string fname(scratch_dir + "/spsparse_spill_XXXXXX");
+    int const fd = mkstemp(&fname[0]);
+    if (fd < 0) (*ibmisc::ibmisc_error)(-1,
+        "Cannot create spill file in %s", scratch_dir.c_str());
+    ::close(fd);
+    runs.push_back(fname);
+
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    for (size_t i0=0; i0 < buf.size(); i0 += chunk_size) {
+        size_t const i1 = std::min(buf.size(), i0 + chunk_size);
+        std::vector<char> zindices, zvals;
+        {
+            vaccum::ZVector<IndexT,RANK> aindices(zindices, ZVAlgo::DIFFS);
+            vaccum::ZVector<ValT,1> avals(zvals, ZVAlgo::PLAIN);
+            for (size_t i=i0; i<i1; ++i) {
+                aindices.add(buf[i].index());
+                avals.add({buf[i].value()});
+            }
+        }
+        write_zbuf(fout, zindices);
+        write_zbuf(fout, zvals);
+    }
+    fout.close();
+    if (!fout) (*ibmisc::ibmisc_error)(-1,
+        "Error writing spill file %s", fname.c_str());
+
+    buf.clear();    // Keep the capacity for the next run
+}
+
+template<class IndexT, class ValT, int RANK>
+template<class AccumT>
+void Spill<IndexT,ValT,RANK>::merge(AccumT &&out, bool set_shape)
+{
+    if (set_shape) out.set_shape(buf.shape());
+
+    std::vector<std::array<IndexT,RANK>> bindices;
+    std::vector<ValT> bvals;
+    bindices.reserve(batch_size);
+    bvals.reserve(batch_size);
+    auto emit = [&](std::array<IndexT,RANK> const &index, ValT const &value) {
+        bindices.push_back(index);
+        bvals.push_back(value);
+        if (bvals.size() == batch_size) {
+            accum::add_batch(out, &bindices[0], &bvals[0], bvals.size());
+            bindices.clear();
+            bvals.clear();
+        }
+    };
+
+    if (runs.empty()) {
+        // Everything fit in RAM
+        consolidate(buf.tuples, zero_nan, nthreads);
+        for (size_t i=0; i<buf.size(); ++i) emit(buf[i].index(), buf[i].value());
+        buf.clear();
+    } else {
+        spill();
+
+        typedef _spill::RunReader<IndexT,ValT,RANK> ReaderT;
+        std::vector<std::unique_ptr<ReaderT>> readers;
+        for (auto const &fname : runs) readers.push_back(
+            std::unique_ptr<ReaderT>(new ReaderT(fname)));
+
+        // Heap of runs, by current index (then by run, for a stable order)
+        auto greater = [&readers](size_t a, size_t b) {
+            if (readers[a]->index() != readers[b]->index())
+                return readers[b]->index() < readers[a]->index();
+            return b < a;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+        for (size_t r=0; r<readers.size(); ++r) {
+            if (readers[r]->next()) heap.push(r);
+        }
+
+        while (!heap.empty()) {
+            size_t r = heap.top();
+            heap.pop();
+            std::array<IndexT,RANK> const index(readers[r]->index());
+            ValT value = readers[r]->value();
+            if (readers[r]->next()) heap.push(r);
+
+            // Sum the same index from other runs
+            while (!heap.empty() && readers[heap.top()]->index() == index) {
+                r = heap.top();
+                heap.pop();
+                value += readers[r]->value();
+                if (readers[r]->next()) heap.push(r);
+            }
+            if (!isnone(value, zero_nan)) emit(index, value);
+        }
+
+        readers.clear();
+        for (auto const &fname : runs) ::remove(fname.c_str());
+        runs.clear();
+    }
+
+    if (bvals.size() > 0) accum::add_batch(out, &bindices[0], &bvals[0], bvals.size());
+}
+
+}}    // namespace spsparse::accum
+#endif    // guard
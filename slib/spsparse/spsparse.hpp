@@ -32,6 +32,15 @@ namespace spsparse {
 */
 
 
+/** Marks the add() of accumulator filters, so a whole chain of them
+compiles into one loop body, with the index kept in registers (see
+accum::fuse()). */
+#ifdef __GNUC__
+#define SPSPARSE_INLINE inline __attribute__((always_inline))
+#else
+#define SPSPARSE_INLINE inline
+#endif
+
 /** @brief What to do in algorithms when duplicate entries are encountered.
 
 - ADD (default): Sum them together.
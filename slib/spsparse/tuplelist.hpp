@@ -3,7 +3,19 @@
 
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <ibmisc/error.hpp>
+#include <ibmisc/footprint.hpp>
 #include <ibmisc/netcdf.hpp>
+#include <spsparse/segvector.hpp>
+#ifdef USE_BOOST
+#include <boost/mpl/bool.hpp>
+#include <boost/serialization/array.hpp>
+#include <boost/serialization/is_bitwise_serializable.hpp>
+#endif
+#if defined(USE_BOOST) && defined(USE_MPI)
+#include <boost/mpi/datatype_fwd.hpp>
+#endif
 
 namespace spsparse {
 
@@ -43,9 +55,9 @@ public:
         : _index(index), _value(value) {}
 
     // ----- For Eigen::SparseMatrix::setFromTriplets()
-    ValT row() const
+    IndexT row() const
         { return index(0); }
-    ValT col() const
+    IndexT col() const
         { return index(1); }
 
     /** Used to sort */
@@ -61,12 +73,18 @@ public:
 
 };
 
-/** Serves as accumulator and iterable storage */
-template<class IndexT, class ValT, int RANK>
+/** Serves as accumulator and iterable storage
+@param StorageT Container for the tuples: std::vector (default), or
+    SegmentedVector for very long lists (see SegmentedTupleList).
+@param CHECKED Bounds-check each index in add() and add_batch()?
+    (check_bounds() and ncio() always check.) */
+template<class IndexT, class ValT, int RANK,
+    class StorageT = std::vector<Tuple<IndexT,ValT,RANK>>,
+    bool CHECKED = ibmisc::checked_default>
 class TupleList {
 public:
     // https://stackoverflow.com/questions/4353203/thou-shalt-not-inherit-from-stdvector
-    typedef std::vector<Tuple<IndexT,ValT,RANK>> VectorT;
+    typedef StorageT VectorT;
     VectorT tuples;
 
     // Stuff to make it an accumulator
@@ -134,6 +152,9 @@ public:
 
     void add(std::array<index_type,rank> const &index, ValT const &value);
 
+    /** Same as add() on each element, with one bounds check pass. */
+    void add_batch(std::array<index_type,rank> const *indices, ValT const *vals, size_t n);
+
     // Forward methods to std::vector
     size_t size() const { return tuples.size(); }
     void clear() { tuples.clear(); }
@@ -141,92 +162,169 @@ public:
     Tuple<IndexT,ValT,RANK> &operator[](int ix) { return tuples[ix]; }
     Tuple<IndexT,ValT,RANK> const &operator[](int ix) const { return tuples[ix]; }
 
+    /** Checks bounds of tuples[begin:end) in one pass, e.g. after a
+    bulk load; raises an error on the first bad index. */
+    void check_bounds(size_t begin, size_t end) const;
+
+    /** @return True if every index in tuples[begin:end) is within shape(). */
+    bool in_bounds(size_t begin, size_t end) const;
+
     void ncio(ibmisc::NcIO &ncio, std::string const &vname);
+
+    /** Memory held by the tuples */
+    ibmisc::MemoryFootprint memory_footprint(std::string const &name = "TupleList") const
+    {
+        return ibmisc::MemoryFootprint(name,
+            tuples.size() * sizeof(Tuple<IndexT,ValT,RANK>),
+            tuples.capacity() * sizeof(Tuple<IndexT,ValT,RANK>));
+    }
+
+    /** Number of tuples read/written per netCDF call in ncio() */
+    static size_t const nc_slab = 1 << 20;
 private:
+    void bounds_error(std::array<index_type,rank> const &index) const;
     void nc_rw(netCDF::NcGroup *nc, char rw, std::string const &vname);
 };
 
-template<class IndexT, class ValT, int RANK>
-void TupleList<IndexT,ValT,RANK>::add(std::array<index_type,rank> const &index, ValT const &value)
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+void TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::bounds_error(std::array<index_type,rank> const &index) const
+{
+    char sindex[256], sshape[256];
+    (*ibmisc::ibmisc_error)(-1,
+        "Sparse index out of bounds: index=%s vs. shape=%s",
+        ibmisc::format_index(sindex, sizeof(sindex), index),
+        ibmisc::format_index(sshape, sizeof(sshape), _shape));
+}
+
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+void TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::add(std::array<index_type,rank> const &index, ValT const &value)
 {
     // Check bounds
-    for (int i=0; i<RANK; ++i) {
-        if (_shape[i] >= 0 && (index[i] < 0 || index[i] >= _shape[i])) {
-            std::ostringstream buf;
-            buf << "Sparse index out of bounds: index=(";
-            for (int j=0; j<RANK; ++j) {
-                buf << index[j];
-                buf << " ";
-            }
-            buf << ") vs. shape=(";
-            for (int j=0; j<RANK; ++j) {
-                buf << _shape[j];
-                buf << " ";
-            }
-            buf << ")";
-            (*ibmisc::ibmisc_error)(-1, buf.str().c_str());
-        }
+    if (CHECKED) for (int i=0; i<RANK; ++i) {
+        if (_shape[i] >= 0 && (index[i] < 0 || index[i] >= _shape[i]))
+            bounds_error(index);
     }
 
     tuples.push_back(Tuple<IndexT,ValT,RANK>(index, value));
 }
 
-template<class IndexT, class ValT, int RANK>
-void TupleList<IndexT,ValT,RANK>::nc_rw(
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+void TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::add_batch(
+    std::array<index_type,rank> const *indices, ValT const *vals, size_t n)
+{
+    size_t const base = tuples.size();
+    tuples.reserve(base + n);
+    for (size_t i=0; i<n; ++i)
+        tuples.push_back(Tuple<IndexT,ValT,RANK>(indices[i], vals[i]));
+
+    // On a bad index, redo one at a time to stop at the culprit, like add()
+    if (CHECKED && !in_bounds(base, base+n)) {
+        tuples.erase(tuples.begin()+base, tuples.end());
+        for (size_t i=0; i<n; ++i) add(indices[i], vals[i]);
+    }
+}
+
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+bool TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::in_bounds(size_t begin, size_t end) const
+{
+    if (begin >= end) return true;
+
+    // Per-dimension range of the indices
+    std::array<IndexT,RANK> lo(tuples[begin].index());
+    std::array<IndexT,RANK> hi(lo);
+    for (size_t i=begin+1; i<end; ++i) {
+        auto const &ix(tuples[i].index());
+        for (int k=0; k<RANK; ++k) {
+            lo[k] = std::min(lo[k], ix[k]);
+            hi[k] = std::max(hi[k], ix[k]);
+        }
+    }
+
+    for (int k=0; k<RANK; ++k) {
+        if (_shape[k] >= 0 && (lo[k] < 0 || hi[k] >= _shape[k])) return false;
+    }
+    return true;
+}
+
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+void TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::check_bounds(size_t begin, size_t end) const
+{
+    if (in_bounds(begin, end)) return;
+
+    // Find the culprit
+    for (size_t i=begin; i<end; ++i) {
+        auto const &ix(tuples[i].index());
+        for (int k=0; k<RANK; ++k) {
+            if (_shape[k] >= 0 && (ix[k] < 0 || ix[k] >= _shape[k])) bounds_error(ix);
+        }
+    }
+}
+
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+size_t const TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::nc_slab;
+
+/** Reads/writes in slabs of nc_slab tuples, staged through one small
+buffer, so peak memory is the TupleList itself.  (Strided imap I/O
+would avoid even that, but netCDF-C services it one row at a time.) */
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+void TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::nc_rw(
     netCDF::NcGroup *nc,
     char rw, std::string const &vname)
 {
     netCDF::NcVar indices_v = nc->getVar(vname + ".indices");
     netCDF::NcVar vals_v = nc->getVar(vname + ".values");
 
-    if (rw == 'w') {
-        int const N = size();
+    size_t const N = (rw == 'w' ? size() : vals_v.getDim(0).getSize());
+    if (N == 0) return;
+    size_t const nslab = std::min(N, (size_t)nc_slab);
 
-        // Create in-memory data structure amenable to writing to disk quickly
-        {std::vector<IndexT> indices;
-            indices.reserve(N*RANK);
-            for (auto &ii : tuples) {
-                for (int k=0; k<RANK; ++k) indices.push_back(ii.index(k));
-            }
-            indices_v.putVar(&indices[0]);
-        }
+    std::vector<IndexT> indices(nslab*RANK);
+    std::vector<ValT> vals(nslab);
+    std::vector<size_t> startp = {0, 0};
+    std::vector<size_t> countp = {0, RANK};
+    std::vector<size_t> vstartp = {0};
+    std::vector<size_t> vcountp = {0};
 
-        // Write it out!
-        {std::vector<ValT> vals;
-            vals.reserve(N);
-            for (auto &ii : tuples) {
-                vals.push_back(ii.value());
+    if (rw == 'w') {
+        for (size_t i0=0; i0<N; i0 += nslab) {
+            size_t const n = std::min(nslab, N-i0);
+            for (size_t i=0; i<n; ++i) {
+                auto const &tp(tuples[i0+i]);
+                for (int k=0; k<RANK; ++k) indices[i*RANK+k] = tp.index(k);
+                vals[i] = tp.value();
             }
-            vals_v.putVar(&vals[0]);    // Write to entire NetCDF variable directly from RAM
+
+            startp[0] = vstartp[0] = i0;
+            countp[0] = vcountp[0] = n;
+            indices_v.putVar(startp, countp, &indices[0]);
+            vals_v.putVar(vstartp, vcountp, &vals[0]);
         }
     } else {    // rw == 'r'
-        int const N = vals_v.getDim(0).getSize();
-
-        // Create in-memory data structure amenable to writing to disk quickly
-        std::vector<IndexT> indices;
-        std::vector<ValT> vals;
-
-        // Read it
-        indices.resize(N*RANK);
-        indices_v.getVar(&indices[0]);
-        vals.resize(N);
-        vals_v.getVar(&vals[0]);    // Write to entire NetCDF variable directly from RAM
-
-        // Convert to TupleList
-        // TODO: If we are more clever with iterators, we don't have to copy to
-        //       a TupleList first.
-        std::array<IndexT,RANK> ix;
-        for (size_t i=0; i<vals.size(); ++i) {
-            for (int k=0; k<RANK; ++k) ix[k] = indices[i*RANK+k];
-            add(ix, vals[i]);
+        // Append to what's already here, like add()
+        size_t const base = size();
+        tuples.resize(base + N);
+
+        for (size_t i0=0; i0<N; i0 += nslab) {
+            size_t const n = std::min(nslab, N-i0);
+
+            startp[0] = vstartp[0] = i0;
+            countp[0] = vcountp[0] = n;
+            indices_v.getVar(startp, countp, &indices[0]);
+            vals_v.getVar(vstartp, vcountp, &vals[0]);
+
+            for (size_t i=0; i<n; ++i) {
+                auto &tp(tuples[base+i0+i]);
+                for (int k=0; k<RANK; ++k) tp.index(k) = indices[i*RANK+k];
+                tp.value() = vals[i];
+            }
         }
-        indices.clear();
-        vals.clear();
+
+        check_bounds(base, base+N);
     }
 }
 
-template<class IndexT, class ValT, int RANK>
-void TupleList<IndexT,ValT,RANK>::ncio(ibmisc::NcIO &ncio, std::string const &vname)
+template<class IndexT, class ValT, int RANK, class StorageT, bool CHECKED>
+void TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::ncio(ibmisc::NcIO &ncio, std::string const &vname)
 {
     std::vector<std::string> const dim_names();
     std::vector<netCDF::NcDim> dims;        // Dimensions in NetCDF
@@ -240,11 +338,46 @@ void TupleList<IndexT,ValT,RANK>::ncio(ibmisc::NcIO &ncio, std::string const &vn
 
     get_or_add_var(ncio, vname + ".indices", ibmisc::get_nc_type<IndexT>(), dims);
     get_or_add_var(ncio, vname + ".values", ibmisc::get_nc_type<ValT>(), {dims[0]});
-    ncio += std::bind(&TupleList<IndexT,ValT,RANK>::nc_rw, this, ncio.nc, ncio.rw, vname);
+    ncio += std::bind(&TupleList<IndexT,ValT,RANK,StorageT,CHECKED>::nc_rw, this, ncio.nc, ncio.rw, vname);
 
 }
 
-
+/** A TupleList that grows a page at a time, without reallocating.
+Use it for lists of hundreds of millions of tuples, where doubling a
+std::vector costs ~3x peak memory and long copies. */
+template<class IndexT, class ValT, int RANK, int PAGE_BITS = 16>
+using SegmentedTupleList = TupleList<IndexT,ValT,RANK,
+    SegmentedVector<Tuple<IndexT,ValT,RANK>, PAGE_BITS>>;
 
 }   // namespace
+
+#ifdef USE_BOOST
+namespace boost {
+namespace serialization {
+
+/** Tuples of plain numbers are raw bytes.  Archives that can (binary
+archives, Boost.MPI) then save and load a std::vector<Tuple> (eg
+TupleList::tuples) in one block, instead of field by field. */
+template<class IndexT, class ValT, int RANK>
+struct is_bitwise_serializable<spsparse::Tuple<IndexT,ValT,RANK>>
+    : public boost::mpl::bool_<
+        std::is_arithmetic<IndexT>::value && std::is_arithmetic<ValT>::value> {};
+
+}}    // namespace boost::serialization
+#endif
+
+#if defined(USE_BOOST) && defined(USE_MPI)
+namespace boost {
+namespace mpi {
+
+/** Lets Boost.MPI send Tuples (and arrays of them) as a derived MPI
+datatype, built once from Tuple::serialize(), without packing. */
+template<class IndexT, class ValT, int RANK>
+struct is_mpi_datatype<spsparse::Tuple<IndexT,ValT,RANK>>
+    : public boost::mpl::bool_<
+        std::is_arithmetic<IndexT>::value && std::is_arithmetic<ValT>::value> {};
+
+}}    // namespace boost::mpi
+#endif
+
 #endif    // guard
@@ -1,12 +1,29 @@
 #ifndef SPSPARSE_ZVECTOR_HPP
 #define SPSPARSE_ZVECTOR_HPP
 
+#include <array>
+#include <memory>
 #include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
 #include <boost/interprocess/streams/vectorstream.hpp>
 #include <boost/endian/conversion.hpp>
 #include <boost/enum.hpp>
 #include <zstr.hpp>        // https://github.com/mateidavid/zstr
 #include <prettyprint.hpp>
+#include <ibmisc/error.hpp>
+#include <ibmisc/parallel.hpp>
 
 namespace spsparse {
 
@@ -77,7 +94,62 @@ public:
 
 
 
-enum class ZVAlgo {PLAIN, DIFFS};
+/** Encoding of tuples before compression.
+    PLAIN: Values as-is
+    DIFFS: Difference from the previous tuple
+    PACKED: (integers only) Differences, bit-packed per component in
+        frames of zvblock::pack_frame values, each frame offset by its
+        minimum (frame-of-reference).  Much smaller than DIFFS for
+        sorted indices, and cheap to decode.
+    XORSHUF: XOR with the previous tuple's bits, then byte-shuffled per
+        component so the (usually zero) high-order bytes of slowly
+        varying doubles compress together.
+PACKED and XORSHUF always use the block-framed format. */
+enum class ZVAlgo {PLAIN, DIFFS, PACKED, XORSHUF};
+
+/** Compressor used for the blocks of a block-framed ZVector.  ZSTD
+and LZ4 are only available if built with USE_ZSTD / USE_LZ4.
+Roughly: LZ4 decodes fastest, ZSTD gives ZLIB's ratio (or better) at
+several times the decode speed, NONE skips compression entirely. */
+enum class ZVCodec {ZLIB, NONE, ZSTD, LZ4};
+
+inline std::string to_string(ZVCodec codec)
+{
+    switch(codec) {
+        case ZVCodec::ZLIB : return "zlib";
+        case ZVCodec::NONE : return "none";
+        case ZVCodec::ZSTD : return "zstd";
+        case ZVCodec::LZ4 : return "lz4";
+    }
+    return "";
+}
+
+inline ZVCodec parse_zvcodec(std::string const &name)
+{
+    if (name == "zlib") return ZVCodec::ZLIB;
+    if (name == "none") return ZVCodec::NONE;
+    if (name == "zstd") return ZVCodec::ZSTD;
+    if (name == "lz4") return ZVCodec::LZ4;
+    (*ibmisc::ibmisc_error)(-1, "Unknown ZVector codec: %s", name.c_str());
+    return ZVCodec::ZLIB;
+}
+
+/** @return True if this build can encode/decode codec */
+inline bool have_zvcodec(ZVCodec codec)
+{
+    switch(codec) {
+        case ZVCodec::ZLIB :
+        case ZVCodec::NONE :
+            return true;
+#ifdef USE_ZSTD
+        case ZVCodec::ZSTD : return true;
+#endif
+#ifdef USE_LZ4
+        case ZVCodec::LZ4 : return true;
+#endif
+        default: return false;
+    }
+}
 
 // ---------------------------------------------------------
 // Yields an integer type, of the same size as the template type
@@ -99,10 +171,649 @@ struct ToIntType<double>
     typedef uint64_t int_type;
 };
 // ---------------------------------------------------------
+/** Block-framed ZVector format.
+
+The plain format is a single zlib stream, which can only be decoded
+serially from the start.  The block-framed format instead compresses
+each run of block_size tuples independently, and stores an index up
+front giving each block's location and (for DIFFS) the tuple it is
+differenced against.  Blocks may therefore be decoded in any order,
+or by several threads at once.
+
+Layout (header integers big-endian):
+    char[4] magic = "ZVBF"   (never the first byte of a zlib/gzip stream)
+    int32 version, algo, rank, int_size
+    int32 codec              (version >= 2; version 1 is always ZLIB)
+    int32 byte_order         (version >= 4; earlier versions are BIG)
+    int64 block_size, ntuples, nblocks
+    nblocks * {int64 offset, int64 zsize, int64 n,
+        int64 rawsize (version >= 3); int_size bytes * rank base}
+    Compressed blocks; offset is relative to the first one.
+byte_order applies to the bases and to PLAIN / DIFFS tuples (PACKED
+and XORSHUF blocks are byte-order neutral).
+*/
+namespace zvblock {
+
+static char const magic[4] = {'Z','V','B','F'};
+static int const version = 4;
+
+/** Byte order of a block-framed ZVector's data.  BIG is portable;
+the host's order (see ZVector's native_endian) saves byte-swapping
+scratch data that will be read back on the same kind of machine.
+Either decodes anywhere. */
+enum class ByteOrder {BIG, LITTLE};
+
+inline ByteOrder host_byte_order()
+{
+    return (boost::endian::order::native == boost::endian::order::little
+        ? ByteOrder::LITTLE : ByteOrder::BIG);
+}
+
+/** Values per frame-of-reference frame in the PACKED algo */
+static int const pack_frame = 128;
+
+/** Upper bound on the decompressed size of zsize bytes of codec
+output (deflate expands at most 1032:1, LZ4 about 255:1, and a ZSTD
+RLE block 32768:1); so a corrupt rawsize cannot drive an arbitrarily
+large allocation. */
+inline long max_rawsize(ZVCodec codec, long zsize)
+{
+    switch(codec) {
+        case ZVCodec::NONE : return zsize;
+        case ZVCodec::ZLIB : return zsize * 1032 + 64;
+        case ZVCodec::LZ4 : return zsize * 256 + 64;
+        default : return zsize * 32768 + 64;
+    }
+}
+
+struct Block {
+    long offset;    // Start of compressed block, relative to payload
+    long zsize;     // Compressed size of block (bytes)
+    long n;         // Number of tuples in block
+    long rawsize;   // Uncompressed size of block (bytes)
+};
+
+/** Parsed header + index of a block-framed ZVector buffer */
+struct Index {
+    ZVAlgo algo;
+    ZVCodec codec;
+    ByteOrder byte_order;
+    int rank;
+    int int_size;
+    long block_size;
+    long ntuples;
+    std::vector<Block> blocks;
+    std::vector<char> bases;    // Raw (byte_order) base tuple of each block
+    char const *payload;        // Start of compressed blocks
+};
+
+/** @return True if zbuf is in the block-framed format */
+inline bool is_framed(std::vector<char> const &zbuf)
+    { return zbuf.size() >= 4 && memcmp(&zbuf[0], magic, 4) == 0; }
+
+inline void put_be32(std::vector<char> &out, int32_t val)
+{
+    val = boost::endian::native_to_big(val);
+    out.insert(out.end(), (char *)&val, (char *)&val + sizeof(val));
+}
+
+inline void put_be64(std::vector<char> &out, int64_t val)
+{
+    val = boost::endian::native_to_big(val);
+    out.insert(out.end(), (char *)&val, (char *)&val + sizeof(val));
+}
+
+inline int32_t get_be32(char const *&p)
+{
+    int32_t val;
+    memcpy(&val, p, sizeof(val));
+    p += sizeof(val);
+    return boost::endian::big_to_native(val);
+}
+
+inline int64_t get_be64(char const *&p)
+{
+    int64_t val;
+    memcpy(&val, p, sizeof(val));
+    p += sizeof(val);
+    return boost::endian::big_to_native(val);
+}
+
+/** Size of the largest header (before the block table) */
+static long const max_header_nbytes = 4 + 4*6 + 8*3;
+
+/** Size (bytes) of the header and block table of a block-framed
+buffer, given (at least) its first max_header_nbytes bytes in [begin,
+end); so a reader can fetch the index before any of the payload. */
+inline long index_nbytes(char const *begin, char const *end)
+{
+    if (end - begin < 8 || memcmp(begin, magic, 4) != 0) (*ibmisc::ibmisc_error)(-1,
+        "ZVector buffer is not block-framed");
+    char const *p = begin + 4;
+    int const ver = get_be32(p);
+    if (ver < 1 || ver > version) (*ibmisc::ibmisc_error)(-1,
+        "Unsupported block-framed ZVector version %d", ver);
+    long const header = 4 + 4*(4 + (ver >= 2) + (ver >= 4)) + 8*3;
+    if (end - begin < header) (*ibmisc::ibmisc_error)(-1,
+        "Block-framed ZVector buffer is truncated (in header)");
+    p += 4;    // algo
+    int const rank = get_be32(p);
+    int const int_size = get_be32(p);
+    if (rank < 1 || int_size < 1 || int_size > 8) (*ibmisc::ibmisc_error)(-1,
+        "Corrupt ZVector: rank=%d, int_size=%d", rank, int_size);
+    p = begin + header - 8;
+    long const nblocks = get_be64(p);
+    long const entry_size = 8*(ver >= 3 ? 4 : 3) + (long)rank * int_size;
+    if (nblocks < 0 || nblocks > (std::numeric_limits<long>::max() - header) / entry_size)
+        (*ibmisc::ibmisc_error)(-1,
+        "Corrupt ZVector: %ld blocks", nblocks);
+    return header + nblocks * entry_size;
+}
+
+/** Reads the header and index of a block-framed buffer in [begin,
+end).  Every field is bounds-checked, so a truncated or corrupt buffer
+raises an error rather than reading past it.
+@param payload_size Size of the payload, if [begin, end) holds only
+    the header and block table (see index_nbytes()); or -1 if the
+    payload follows them in [begin, end). */
+inline Index read_index(char const *begin, char const *end, long payload_size = -1)
+{
+    if (end - begin < 4 || memcmp(begin, magic, 4) != 0) (*ibmisc::ibmisc_error)(-1,
+        "ZVector buffer is not block-framed");
+
+    char const *p = begin + 4;
+    auto need = [&p, end](size_t nbytes, char const *what) {
+        if ((size_t)(end - p) < nbytes) (*ibmisc::ibmisc_error)(-1,
+            "Block-framed ZVector buffer is truncated (in %s)", what);
+    };
+
+    Index ix;
+    need(4, "header");
+    int const ver = get_be32(p);
+    if (ver < 1 || ver > version) (*ibmisc::ibmisc_error)(-1,
+        "Unsupported block-framed ZVector version %d", ver);
+    need(4*(3 + (ver >= 2) + (ver >= 4)) + 8*3, "header");
+    ix.algo = (ZVAlgo)get_be32(p);
+    if (ix.algo < ZVAlgo::PLAIN || ix.algo > ZVAlgo::XORSHUF) (*ibmisc::ibmisc_error)(-1,
+        "Corrupt ZVector: unknown algo %d", (int)ix.algo);
+    ix.rank = get_be32(p);
+    ix.int_size = get_be32(p);
+    if (ix.rank < 1 || ix.int_size < 1 || ix.int_size > 8) (*ibmisc::ibmisc_error)(-1,
+        "Corrupt ZVector: rank=%d, int_size=%d", ix.rank, ix.int_size);
+    ix.codec = (ver >= 2 ? (ZVCodec)get_be32(p) : ZVCodec::ZLIB);
+    if (!have_zvcodec(ix.codec)) (*ibmisc::ibmisc_error)(-1,
+        "ZVector codec %s is not available in this build", to_string(ix.codec).c_str());
+    ix.byte_order = (ver >= 4 ? (ByteOrder)get_be32(p) : ByteOrder::BIG);
+    if (ix.byte_order != ByteOrder::BIG && ix.byte_order != ByteOrder::LITTLE) (*ibmisc::ibmisc_error)(-1,
+        "Corrupt ZVector: unknown byte order %d", (int)ix.byte_order);
+    ix.block_size = get_be64(p);
+    ix.ntuples = get_be64(p);
+    long const nblocks = get_be64(p);
+
+    // Check the whole block table fits before reserving for it
+    size_t const base_size = (size_t)ix.rank * ix.int_size;
+    size_t const entry_size = 8*(ver >= 3 ? 4 : 3) + base_size;
+    if (nblocks < 0 || (size_t)nblocks > (size_t)(end - p) / entry_size) (*ibmisc::ibmisc_error)(-1,
+        "Block-framed ZVector buffer is truncated (in block table of %ld blocks)", nblocks);
+
+    ix.blocks.reserve(nblocks);
+    ix.bases.reserve(nblocks * base_size);
+    for (long i=0; i<nblocks; ++i) {
+        Block blk;
+        blk.offset = get_be64(p);
+        blk.zsize = get_be64(p);
+        blk.n = get_be64(p);
+        if (blk.n < 0 || blk.n > std::numeric_limits<long>::max() / (long)base_size)
+            (*ibmisc::ibmisc_error)(-1,
+            "Corrupt ZVector: block %ld has n=%ld", i, blk.n);
+        blk.rawsize = (ver >= 3 ? get_be64(p) : blk.n * base_size);
+        if (blk.offset < 0 || blk.zsize < 0 || blk.rawsize < 0)
+            (*ibmisc::ibmisc_error)(-1,
+            "Corrupt ZVector: block %ld has offset=%ld zsize=%ld n=%ld rawsize=%ld",
+            i, blk.offset, blk.zsize, blk.n, blk.rawsize);
+        ix.blocks.push_back(blk);
+        ix.bases.insert(ix.bases.end(), p, p + base_size);
+        p += base_size;
+    }
+    ix.payload = p;
+
+    // Every block must lie within the payload
+    if (payload_size < 0) payload_size = end - p;
+    for (long i=0; i<nblocks; ++i) {
+        Block const &blk(ix.blocks[i]);
+        if (blk.offset > payload_size || blk.zsize > payload_size - blk.offset)
+            (*ibmisc::ibmisc_error)(-1,
+            "Block-framed ZVector buffer is truncated: block %ld is [%ld, %ld) of a %ld-byte payload",
+            i, blk.offset, blk.offset + blk.zsize, payload_size);
+    }
+
+    // Bound n and rawsize (what decoding allocates) by what zsize can
+    // hold: rawsize by the codec, n by the algo's encoded size
+    long ntuples = 0;
+    for (long i=0; i<nblocks; ++i) {
+        Block const &blk(ix.blocks[i]);
+        bool const ok = (blk.rawsize <= max_rawsize(ix.codec, blk.zsize)) && (
+            ix.algo == ZVAlgo::PACKED
+            // At least a width byte and a varint per frame and component
+            ? (blk.n + pack_frame - 1) / pack_frame <= blk.rawsize / (2 * ix.rank)
+            : blk.n * (long)base_size == blk.rawsize);
+        if (!ok || blk.n > ix.ntuples - ntuples) (*ibmisc::ibmisc_error)(-1,
+            "Corrupt ZVector: block %ld has n=%ld rawsize=%ld zsize=%ld",
+            i, blk.n, blk.rawsize, blk.zsize);
+        ntuples += blk.n;
+    }
+    if (ntuples != ix.ntuples) (*ibmisc::ibmisc_error)(-1,
+        "Corrupt ZVector: blocks hold %ld tuples, header says %ld", ntuples, ix.ntuples);
+    return ix;
+}
+
+inline Index read_index(std::vector<char> const &zbuf)
+    { return read_index(zbuf.data(), zbuf.data() + zbuf.size()); }
+
+/** Compresses nbytes at src, appending to out.
+@param level Codec-specific compression level; <0 for codec default. */
+inline void compress_block(ZVCodec codec, int level,
+    char const *src, size_t nbytes, std::vector<char> &out)
+{
+    size_t const offset = out.size();
+    switch(codec) {
+        case ZVCodec::NONE :
+            out.insert(out.end(), src, src + nbytes);
+        break;
+        case ZVCodec::ZLIB : {
+            uLongf zsize = compressBound(nbytes);
+            out.resize(offset + zsize);
+            int const err = compress2((Bytef *)&out[offset], &zsize,
+                (Bytef const *)src, nbytes, level < 0 ? Z_DEFAULT_COMPRESSION : level);
+            if (err != Z_OK) (*ibmisc::ibmisc_error)(-1,
+                "zlib compress2() failed with error %d", err);
+            out.resize(offset + zsize);
+        } break;
+#ifdef USE_ZSTD
+        case ZVCodec::ZSTD : {
+            size_t const bound = ZSTD_compressBound(nbytes);
+            out.resize(offset + bound);
+            size_t const zsize = ZSTD_compress(&out[offset], bound,
+                src, nbytes, level < 0 ? 3 : level);
+            if (ZSTD_isError(zsize)) (*ibmisc::ibmisc_error)(-1,
+                "ZSTD_compress() failed: %s", ZSTD_getErrorName(zsize));
+            out.resize(offset + zsize);
+        } break;
+#endif
+#ifdef USE_LZ4
+        case ZVCodec::LZ4 : {
+            int const bound = LZ4_compressBound(nbytes);
+            out.resize(offset + bound);
+            int const zsize = LZ4_compress_default(src, &out[offset], nbytes, bound);
+            if (zsize <= 0) (*ibmisc::ibmisc_error)(-1,
+                "LZ4_compress_default() failed");
+            out.resize(offset + zsize);
+        } break;
+#endif
+        default :
+            (*ibmisc::ibmisc_error)(-1,
+                "ZVector codec %s is not available in this build", to_string(codec).c_str());
+    }
+}
+
+/** Decompresses zsize bytes at src, which must expand to exactly
+nbytes at dest. */
+inline void decompress_block(ZVCodec codec,
+    char const *src, size_t zsize, char *dest, size_t nbytes)
+{
+    bool ok = false;
+    switch(codec) {
+        case ZVCodec::NONE :
+            ok = (zsize == nbytes);
+            if (ok) memcpy(dest, src, nbytes);
+        break;
+        case ZVCodec::ZLIB : {
+            uLongf len = nbytes;
+            int const err = uncompress((Bytef *)dest, &len, (Bytef const *)src, zsize);
+            ok = (err == Z_OK && len == nbytes);
+        } break;
+#ifdef USE_ZSTD
+        case ZVCodec::ZSTD : {
+            size_t const len = ZSTD_decompress(dest, nbytes, src, zsize);
+            ok = (!ZSTD_isError(len) && len == nbytes);
+        } break;
+#endif
+#ifdef USE_LZ4
+        case ZVCodec::LZ4 : {
+            int const len = LZ4_decompress_safe(src, dest, zsize, nbytes);
+            ok = (len >= 0 && (size_t)len == nbytes);
+        } break;
+#endif
+        default : break;
+    }
+    if (!ok) (*ibmisc::ibmisc_error)(-1,
+        "Error decompressing ZVector block (codec %s)", to_string(codec).c_str());
+}
+
+// ---------------------------------------------------------
+// Bit-packing and byte-shuffling, for the PACKED and XORSHUF algos
+
+inline void put_varint(std::vector<char> &out, uint64_t val)
+{
+    while (val >= 0x80) {
+        out.push_back((char)(val | 0x80));
+        val >>= 7;
+    }
+    out.push_back((char)val);
+}
+
+/** Reads a put_varint() value from [p, end) */
+inline uint64_t get_varint(char const *&p, char const *end)
+{
+    uint64_t val = 0;
+    for (int shift=0; ; shift += 7) {
+        if (p >= end || shift >= 64) (*ibmisc::ibmisc_error)(-1,
+            "Corrupt varint in ZVector block");
+        uint8_t const b = *p++;
+        val |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return val;
+    }
+}
+
+/** Appends w-bit values, least significant bits first, to a byte
+(little-endian) stream. */
+class BitWriter {
+    std::vector<char> &out;
+    uint64_t acc;
+    int nbits;    // Bits used in acc; always < 64
+
+    void emit(int nbytes)
+    {
+        for (int i=0; i<nbytes; ++i) out.push_back((char)(acc >> (8*i)));
+    }
+public:
+    BitWriter(std::vector<char> &_out) : out(_out), acc(0), nbits(0) {}
+
+    void put(uint64_t val, int w)
+    {
+        acc |= val << nbits;
+        int const total = nbits + w;
+        if (total >= 64) {
+            emit(8);
+            acc = (nbits == 0 ? 0 : val >> (64 - nbits));
+            nbits = total - 64;
+        } else {
+            nbits = total;
+        }
+    }
+
+    /** Pads out to a byte boundary */
+    void flush()
+    {
+        emit((nbits + 7) / 8);
+        acc = 0;
+        nbits = 0;
+    }
+};
+
+/** Reads back a BitWriter stream in [p, end) */
+class BitReader {
+    char const *p;
+    char const *end;
+    uint64_t acc;
+    int avail;    // Unread bits in acc
+
+public:
+    BitReader(char const *_p, char const *_end) : p(_p), end(_end), acc(0), avail(0) {}
+
+    uint64_t get(int w)
+    {
+        if (w == 0) return 0;
+        uint64_t const mask = (w == 64 ? ~(uint64_t)0 : ((uint64_t)1 << w) - 1);
+        if (avail >= w) {
+            uint64_t const val = acc & mask;
+            acc = (w == 64 ? 0 : acc >> w);
+            avail -= w;
+            return val;
+        }
+
+        // Load up to 8 more bytes
+        uint64_t next = 0;
+        int const nbytes = std::min((long)8, (long)(end - p));
+        for (int i=0; i<nbytes; ++i) next |= (uint64_t)(uint8_t)p[i] << (8*i);
+        p += nbytes;
+
+        uint64_t const val = (avail == 0 ? next : acc | (next << avail)) & mask;
+        int const need = w - avail;
+        acc = (need == 64 ? 0 : next >> need);
+        avail = 8*nbytes - need;
+        return val;
+    }
+};
+
+inline int bit_width(uint64_t val)
+    { return val == 0 ? 0 : 64 - __builtin_clzll(val); }
+
+/** Bit-packs n deltas of one component (stride apart in d), in
+frames of pack_frame values.  Each frame is:
+    uint8 w; varint zigzag(min); n_frame values (d-min), w bits each */
+template<class IntT>
+void pack_deltas(IntT const *d, long n, int stride, std::vector<char> &out)
+{
+    typedef typename std::make_unsigned<IntT>::type UIntT;
+    typedef typename std::make_signed<IntT>::type SIntT;
+    for (long i0=0; i0<n; i0 += pack_frame) {
+        long const i1 = std::min(n, i0 + pack_frame);
+
+        SIntT lo = (SIntT)d[i0*stride];
+        for (long i=i0+1; i<i1; ++i) lo = std::min(lo, (SIntT)d[i*stride]);
+        UIntT hi = 0;
+        for (long i=i0; i<i1; ++i) hi = std::max(hi, (UIntT)((UIntT)d[i*stride] - (UIntT)lo));
+        int const w = bit_width(hi);
+
+        out.push_back((char)w);
+        int64_t const lo64 = lo;
+        put_varint(out, ((uint64_t)lo64 << 1) ^ (uint64_t)(lo64 >> 63));
+        BitWriter bits(out);
+        for (long i=i0; i<i1; ++i) bits.put((UIntT)((UIntT)d[i*stride] - (UIntT)lo), w);
+        bits.flush();
+    }
+}
+
+/** Inverse of pack_deltas() */
+template<class IntT>
+char const *unpack_deltas(char const *p, char const *end, long n, int stride, IntT *d)
+{
+    typedef typename std::make_unsigned<IntT>::type UIntT;
+    for (long i0=0; i0<n; i0 += pack_frame) {
+        long const i1 = std::min(n, i0 + pack_frame);
+
+        if (p >= end) (*ibmisc::ibmisc_error)(-1,
+            "Corrupt PACKED ZVector block");
+        int const w = (uint8_t)*p++;
+        uint64_t const zz = get_varint(p, end);
+        UIntT const lo = (UIntT)(int64_t)((zz >> 1) ^ (~(zz & 1) + 1));
+
+        char const *frame_end = p + ((i1-i0)*w + 7) / 8;
+        if (w > (int)(8*sizeof(IntT)) || frame_end > end) (*ibmisc::ibmisc_error)(-1,
+            "Corrupt PACKED ZVector block");
+        BitReader bits(p, frame_end);
+        for (long i=i0; i<i1; ++i) d[i*stride] = (IntT)(lo + (UIntT)bits.get(w));
+        p = frame_end;
+    }
+    return p;
+}
+
+/** Byte-shuffles n values of one component (stride apart in x):
+    byte k (little-endian order) of every value goes in plane k. */
+template<class IntT>
+void shuffle_bytes(IntT const *x, long n, int stride, std::vector<char> &out)
+{
+    size_t const offset = out.size();
+    out.resize(offset + n*sizeof(IntT));
+    char *planes = &out[offset];
+    for (int k=0; k<(int)sizeof(IntT); ++k) {
+        char * const plane = planes + k*n;
+        for (long i=0; i<n; ++i) plane[i] = (char)((uint64_t)x[i*stride] >> (8*k));
+    }
+}
+
+/** Inverse of shuffle_bytes(); reads from [p, end) */
+template<class IntT>
+char const *unshuffle_bytes(char const *p, char const *end, long n, int stride, IntT *x)
+{
+    if ((size_t)(end - p) < n*sizeof(IntT)) (*ibmisc::ibmisc_error)(-1,
+        "Corrupt XORSHUF ZVector block");
+    for (long i=0; i<n; ++i) x[i*stride] = 0;
+    for (int k=0; k<(int)sizeof(IntT); ++k) {
+        uint8_t const * const plane = (uint8_t const *)p + k*n;
+        for (long i=0; i<n; ++i) x[i*stride] |= (IntT)((uint64_t)plane[i] << (8*k));
+    }
+    return p + n*sizeof(IntT);
+}
+
+// ---------------------------------------------------------
+/** Assembles header + index + payload into zbuf (replacing what was there).
+@param bases Raw (byte_order) base tuple of each block, concatenated */
+inline void write_framed(std::vector<char> &zbuf,
+    ZVAlgo algo, int rank, int int_size, ZVCodec codec, ByteOrder byte_order,
+    long block_size, long ntuples,
+    std::vector<Block> const &blocks,
+    std::vector<char> const &bases,
+    std::vector<char> const &payload)
+{
+    size_t const base_size = rank * int_size;
+    std::vector<char> out;
+    out.reserve(56 + blocks.size()*(32 + base_size) + payload.size());
+    out.insert(out.end(), magic, magic+4);
+    put_be32(out, version);
+    put_be32(out, (int)algo);
+    put_be32(out, rank);
+    put_be32(out, int_size);
+    put_be32(out, (int)codec);
+    put_be32(out, (int)byte_order);
+    put_be64(out, block_size);
+    put_be64(out, ntuples);
+    put_be64(out, blocks.size());
+    for (size_t i=0; i<blocks.size(); ++i) {
+        put_be64(out, blocks[i].offset);
+        put_be64(out, blocks[i].zsize);
+        put_be64(out, blocks[i].n);
+        put_be64(out, blocks[i].rawsize);
+        char const *base = &bases[i*base_size];
+        out.insert(out.end(), base, base + base_size);
+    }
+    out.insert(out.end(), payload.begin(), payload.end());
+
+    zbuf.swap(out);
+}
+
+/** Builds a block-framed buffer out of blocks of other block-framed
+buffers, copying them still compressed.  (Each block decodes from its
+own base tuple, so blocks can move freely between buffers.) */
+class FramedBuilder {
+    Index const *first;
+    long ntuples;
+    std::vector<Block> blocks;
+    std::vector<char> bases;
+    std::vector<char> payload;
+
+public:
+    FramedBuilder() : first(0), ntuples(0) {}
+
+    /** Appends blocks [b0, b1) of x; all must be encoded alike */
+    void append(Index const &x, long b0, long b1)
+    {
+        if (!first) first = &x;
+        else if (x.algo != first->algo || x.codec != first->codec
+            || x.byte_order != first->byte_order
+            || x.rank != first->rank || x.int_size != first->int_size) (*ibmisc::ibmisc_error)(-1,
+            "Cannot join ZVector blocks encoded differently");
+
+        size_t const base_size = x.rank * x.int_size;
+        for (long b=b0; b<b1; ++b) {
+            Block blk(x.blocks[b]);
+            char const *src = x.payload + blk.offset;
+            blk.offset = payload.size();
+            payload.insert(payload.end(), src, src + blk.zsize);
+            blocks.push_back(blk);
+            bases.insert(bases.end(), x.bases.begin() + b*base_size,
+                x.bases.begin() + (b+1)*base_size);
+            ntuples += blk.n;
+        }
+    }
+
+    /** Writes the result to zbuf; header fields (algo, codec,
+    byte_order, block_size) come from the first buffer appended. */
+    void write(std::vector<char> &zbuf) const
+    {
+        write_framed(zbuf, first->algo, first->rank, first->int_size, first->codec,
+            first->byte_order, first->block_size, ntuples, blocks, bases, payload);
+    }
+};
+
+/** Replaces blocks [block0, block1) of a block-framed buffer with all
+the blocks of repl, which must be encoded with the same algo, codec,
+byte order and tuple type.  The other blocks are copied, not re-encoded: the cost
+is a memcpy of the buffer, plus encoding repl. */
+inline void splice(std::vector<char> &zbuf, long block0, long block1,
+    std::vector<char> const &repl)
+{
+    Index const ix(read_index(zbuf));
+    Index const rx(read_index(repl));
+    long const nblocks = ix.blocks.size();
+    if (block0 < 0 || block0 > block1 || block1 > nblocks) (*ibmisc::ibmisc_error)(-1,
+        "Block range [%ld, %ld) out of range for %ld blocks", block0, block1, nblocks);
+
+    FramedBuilder out;
+    out.append(ix, 0, block0);
+    out.append(rx, 0, rx.blocks.size());
+    out.append(ix, block1, nblocks);
+    out.write(zbuf);
+}
+
+/** Joins block-framed buffers (encoded alike) end to end, eg pieces
+of one vector encoded in parallel. */
+inline void concat(std::vector<char> &zbuf, std::vector<std::vector<char> const *> const &parts)
+{
+    if (parts.empty()) (*ibmisc::ibmisc_error)(-1,
+        "concat() needs at least one ZVector buffer");
+    std::vector<Index> ixs;
+    ixs.reserve(parts.size());
+    for (auto part : parts) ixs.push_back(read_index(*part));
+
+    FramedBuilder out;
+    for (auto const &ix : ixs) out.append(ix, 0, ix.blocks.size());
+    out.write(zbuf);
+}
+
+// ---------------------------------------------------------
+/** @return Number of independently decodable blocks in a ZVector
+    buffer.  Plain (non-framed) buffers count as one block. */
+inline long nblocks(std::vector<char> const &zbuf)
+    { return is_framed(zbuf) ? read_index(zbuf).blocks.size() : 1; }
+
+/** @return Codec used to compress a ZVector buffer.  Plain
+    (non-framed) buffers are always ZLIB. */
+inline ZVCodec codec(std::vector<char> const &zbuf)
+{
+    if (!is_framed(zbuf) || zbuf.size() < 24) return ZVCodec::ZLIB;
+    char const *p = &zbuf[4];
+    int const ver = get_be32(p);
+    if (ver < 2) return ZVCodec::ZLIB;
+    p += 3*4;    // algo, rank, int_size
+    return (ZVCodec)get_be32(p);
+}
+
+}    // namespace spsparse::zvblock
+// ---------------------------------------------------------
 
 namespace vaccum {
+
+template<class ValueT, int RANK>
+class _ZVectorBase {
+public:
+    virtual ~_ZVectorBase() {}
+    virtual void add(std::array<ValueT,RANK> const &raws) = 0;
+};
+
 template<class ValueT, int RANK>
-class _ZVector {
+class _ZVector : public _ZVectorBase<ValueT,RANK> {
 public:
     typedef ValueT val_type;
 
@@ -122,16 +833,106 @@ public:
     ~_ZVector();
 };
 
+/** Block-framed encoder; see spsparse::zvblock.
+
+With nthreads > 1, blocks are compressed pigz-style: encoded blocks
+queue up (up to pending_per_thread * nthreads of them), then are
+compressed concurrently and appended to the payload in order.  The
+output is identical to the single-threaded encoder's. */
+template<class ValueT, int RANK>
+class _ZVectorBlocked : public _ZVectorBase<ValueT,RANK> {
+public:
+    typedef ValueT val_type;
+
+private:
+    typedef typename ToIntType<ValueT>::int_type int_type;
+
+    /** Blocks queued per thread before compressing them */
+    static int const pending_per_thread = 4;
+
+    /** An encoded block, waiting to be compressed */
+    struct Pending {
+        std::vector<char> raw;
+        long n;
+        std::array<int_type,RANK> base;
+    };
+
+    std::vector<char> &zbuf;
+    ZVAlgo algo;
+    long block_size;
+    ZVCodec codec;
+    int level;
+    int nthreads;
+    bool native_endian;
+    long ntuples;
+    std::array<ValueT,RANK> last_raws;
+
+    std::vector<int_type> cur;       // Current block: native, PLAIN, DIFFS or XOR
+    std::array<int_type,RANK> cur_base;
+    std::vector<zvblock::Block> blocks;
+    std::vector<char> bases;
+    std::vector<char> payload;
+    std::vector<Pending> pending;
+
+    void flush_block();
+    void compress_pending();
+    /** Records a block just compressed onto the end of payload */
+    void add_block(size_t offset, long n, size_t rawsize,
+        std::array<int_type,RANK> const &base);
+
+public:
+    _ZVectorBlocked(std::vector<char> &_zbuf, ZVAlgo _algo, long _block_size,
+        ZVCodec _codec = ZVCodec::ZLIB, int _level = -1, int _nthreads = 1,
+        bool _native_endian = false);
+    void add(std::array<ValueT,RANK> const &raws);
+    ~_ZVectorBlocked();
+};
+
 /** Wrap the guts in a std::unique_ptr<> so ZVector is fully C++11
     compliant (and moveable) */
 template<class ValueT, int RANK>
 class ZVector {
-    std::unique_ptr<_ZVector<ValueT,RANK>> self;
+    std::unique_ptr<_ZVectorBase<ValueT,RANK>> self;
 public:
     typedef ValueT val_type;
 
-    ZVector(std::vector<char> &_zbuf, ZVAlgo _algo) :
-        self(new _ZVector<ValueT,RANK>(_zbuf, _algo)) {}
+    /** @param block_size If >0, write the block-framed format with
+        this many tuples per block.  Otherwise, write a single stream.
+    @param codec Compressor to use.  Anything but ZLIB (or algos
+        PACKED and XORSHUF) implies the block-framed format (as a
+        single block, if block_size <= 0).
+    @param level Codec-specific compression level (<0 = default)
+    @param nthreads Compress blocks on this many threads.  Implies the
+        block-framed format, with default_parallel_block_size
+        tuples per block if block_size <= 0.
+    @param native_endian Store tuples in the host's byte order rather
+        than big-endian (implies the block-framed format).  With
+        codec=NONE, this makes a node-local scratch cache: the writer
+        never swaps or compresses, and PLAIN / DIFFS blocks are read
+        in place. */
+    ZVector(std::vector<char> &_zbuf, ZVAlgo _algo, long block_size=0,
+        ZVCodec codec = ZVCodec::ZLIB, int level = -1, int nthreads = 1,
+        bool native_endian = false)
+    {
+        if (block_size <= 0 && codec == ZVCodec::ZLIB && level < 0 && nthreads <= 1
+            && !native_endian
+            && (_algo == ZVAlgo::PLAIN || _algo == ZVAlgo::DIFFS))
+        {
+            self.reset(new _ZVector<ValueT,RANK>(_zbuf, _algo));
+        } else {
+            if (block_size <= 0) {
+                if (nthreads > 1) block_size = default_parallel_block_size;
+                else block_size = std::numeric_limits<long>::max();
+            }
+            self.reset(new _ZVectorBlocked<ValueT,RANK>(_zbuf, _algo, block_size,
+                codec, level, nthreads, native_endian));
+        }
+    }
+
+    /** Tuples per block when compressing in parallel, unless
+    the user says otherwise */
+    static long const default_parallel_block_size = 1L<<16;
+
     void add(std::array<ValueT,RANK> const &raws)
         { self->add(raws); }
 };
@@ -147,6 +948,9 @@ _ZVector<ValueT,RANK>::
         os(std::ios_base::out | std::ios_base::binary),
         zos(os, zstr::ostreambuf::default_buff_size, Z_DEFAULT_COMPRESSION)
     {
+        if (algo != ZVAlgo::PLAIN && algo != ZVAlgo::DIFFS) (*ibmisc::ibmisc_error)(-1,
+            "Plain ZVector format supports only ZVAlgo::PLAIN and DIFFS");
+
         // Write the algo to the stream!
         int ialgo = boost::endian::native_to_big((int)algo);
         zos.write((char *)&ialgo, sizeof(ialgo));
@@ -176,6 +980,7 @@ void _ZVector<ValueT,RANK>::
                     last_raws[i] = raws[i];
                 }
             break;
+            default : break;    // Excluded by the constructor
         }
         zos.write((char *)ivals, sizeof(int_type)*RANK);
     }
@@ -189,6 +994,145 @@ _ZVector<ValueT,RANK>::
         os.swap_vector(zbuf);
     }
 
+// -------------------------------------------------------------
+template<class ValueT, int RANK>
+_ZVectorBlocked<ValueT,RANK>::
+    _ZVectorBlocked(std::vector<char> &_zbuf, ZVAlgo _algo, long _block_size,
+        ZVCodec _codec, int _level, int _nthreads, bool _native_endian)
+        : zbuf(_zbuf), algo(_algo), block_size(_block_size),
+        codec(_codec), level(_level), nthreads(_nthreads),
+        native_endian(_native_endian), ntuples(0)
+    {
+        if (!have_zvcodec(codec)) (*ibmisc::ibmisc_error)(-1,
+            "ZVector codec %s is not available in this build", to_string(codec).c_str());
+        if (algo == ZVAlgo::PACKED && !std::is_integral<ValueT>::value) (*ibmisc::ibmisc_error)(-1,
+            "ZVAlgo::PACKED requires an integer type; use XORSHUF for floating point");
+        cur.reserve(std::min(block_size, 1L<<16) * RANK);
+        for (int i=0; i<RANK; ++i) last_raws[i] = 0;
+    }
+
+template<class ValueT, int RANK>
+void _ZVectorBlocked<ValueT,RANK>::
+    add(std::array<ValueT,RANK> const &raws)
+    {
+        // Remember what this block is differenced against
+        if (cur.size() == 0) {
+            int_type const * const ilast((int_type const *)&last_raws[0]);
+            for (int i=0; i<RANK; ++i) cur_base[i] = (native_endian
+                ? ilast[i] : boost::endian::native_to_big(ilast[i]));
+        }
+
+        std::array<ValueT,RANK> vals;
+        int_type * const ivals((int_type *)&vals[0]);    // Alternative view into vals
+
+        switch(algo) {
+            case ZVAlgo::PLAIN :
+                for (int i=0; i<RANK; ++i) vals[i] = raws[i];
+            break;
+            case ZVAlgo::DIFFS :
+            case ZVAlgo::PACKED :
+                for (int i=0; i<RANK; ++i) {
+                    vals[i] = raws[i] - last_raws[i];
+                    last_raws[i] = raws[i];
+                }
+            break;
+            case ZVAlgo::XORSHUF : {
+                int_type const * const iraws((int_type const *)&raws[0]);
+                int_type * const ilast((int_type *)&last_raws[0]);
+                for (int i=0; i<RANK; ++i) {
+                    ivals[i] = iraws[i] ^ ilast[i];
+                    ilast[i] = iraws[i];
+                }
+            } break;
+        }
+        for (int i=0; i<RANK; ++i) cur.push_back(ivals[i]);
+
+        ++ntuples;
+        if ((long)cur.size() / RANK == block_size) flush_block();
+    }
+
+template<class ValueT, int RANK>
+void _ZVectorBlocked<ValueT,RANK>::
+    flush_block()
+    {
+        if (cur.size() == 0) return;
+        long const n = cur.size() / RANK;
+
+        std::vector<char> raw;
+        switch(algo) {
+            case ZVAlgo::PLAIN :
+            case ZVAlgo::DIFFS :
+                if (!native_endian)
+                    for (auto &x : cur) boost::endian::native_to_big_inplace(x);
+                raw.assign((char const *)&cur[0], (char const *)&cur[0] + cur.size()*sizeof(int_type));
+            break;
+            case ZVAlgo::PACKED :
+                for (int i=0; i<RANK; ++i) zvblock::pack_deltas(&cur[i], n, RANK, raw);
+            break;
+            case ZVAlgo::XORSHUF :
+                for (int i=0; i<RANK; ++i) zvblock::shuffle_bytes(&cur[i], n, RANK, raw);
+            break;
+        }
+
+        cur.clear();
+
+        if (nthreads > 1) {
+            pending.push_back(Pending{std::move(raw), n, cur_base});
+            if ((long)pending.size() >= (long)pending_per_thread * nthreads)
+                compress_pending();
+            return;
+        }
+
+        size_t const offset = payload.size();
+        zvblock::compress_block(codec, level, &raw[0], raw.size(), payload);
+        add_block(offset, n, raw.size(), cur_base);
+    }
+
+template<class ValueT, int RANK>
+void _ZVectorBlocked<ValueT,RANK>::
+    compress_pending()
+    {
+        std::vector<std::vector<char>> zs(pending.size());
+        ibmisc::parallel_for(0, pending.size(), nthreads, [&](long i0, long i1) {
+            for (long i=i0; i<i1; ++i) zvblock::compress_block(codec, level,
+                &pending[i].raw[0], pending[i].raw.size(), zs[i]);
+        });
+
+        // Concatenate in order
+        for (size_t i=0; i<pending.size(); ++i) {
+            size_t const offset = payload.size();
+            payload.insert(payload.end(), zs[i].begin(), zs[i].end());
+            add_block(offset, pending[i].n, pending[i].raw.size(), pending[i].base);
+        }
+        pending.clear();
+    }
+
+template<class ValueT, int RANK>
+void _ZVectorBlocked<ValueT,RANK>::
+    add_block(size_t offset, long n, size_t rawsize,
+        std::array<int_type,RANK> const &base)
+    {
+        zvblock::Block blk;
+        blk.offset = offset;
+        blk.zsize = payload.size() - offset;
+        blk.n = n;
+        blk.rawsize = rawsize;
+        blocks.push_back(blk);
+        bases.insert(bases.end(), (char const *)&base[0], (char const *)&base[0] + sizeof(base));
+    }
+
+template<class ValueT, int RANK>
+_ZVectorBlocked<ValueT,RANK>::
+    ~_ZVectorBlocked()
+    {
+        flush_block();
+        compress_pending();
+
+        zvblock::write_framed(zbuf, algo, RANK, sizeof(int_type), codec,
+            native_endian ? zvblock::host_byte_order() : zvblock::ByteOrder::BIG,
+            block_size, ntuples, blocks, bases, payload);
+    }
+
 // -------------------------------------------------------------
 
 }    // namespace vaccum
@@ -210,28 +1154,122 @@ public:
 // --------------------------------------------------------------------------
 namespace vgen {
 
+/** Common decoder state.  Subclasses refill buf (fill()) a batch at a
+time with native-endian encoded tuples; decoding the algo then
+happens here, without any per-tuple virtual calls or stream I/O. */
 template<class ValueT, int RANK>
-class _ZVector {
+class _ZVectorBase {
+protected:
+    typedef typename ToIntType<ValueT>::int_type int_type;
+
+    std::array<ValueT,RANK> cur_raws;
+    ZVAlgo algo;
+    std::vector<int_type> buf;    // Current batch, native PLAIN/DIFFS/XOR tuples
+    int_type const *data;         // Current batch: &buf[0], or in place in the input
+    long ix;            // Next tuple in data
+    long n;             // Tuples in data
+
+    /** Loads the next batch into data, setting n and ix=0.
+    @return false at the end of the vector. */
+    virtual bool fill() = 0;
+
+    /** Decodes tuple ix of data into cur_raws */
+    void decode(long ix)
+    {
+        int_type const * const ivals(&data[ix*RANK]);
+        ValueT const * const vals((ValueT const *)ivals);    // Alternative view into ivals
+        switch(algo) {
+            case ZVAlgo::PLAIN :
+                for (int i=0; i<RANK; ++i) cur_raws[i] = vals[i];
+            break;
+            case ZVAlgo::DIFFS :
+            case ZVAlgo::PACKED :
+                for (int i=0; i<RANK; ++i) cur_raws[i] += vals[i];
+            break;
+            case ZVAlgo::XORSHUF : {
+                int_type * const icur((int_type *)&cur_raws[0]);
+                for (int i=0; i<RANK; ++i) icur[i] ^= ivals[i];
+            } break;
+        }
+    }
+
+public:
+    _ZVectorBase() : data(0), ix(0), n(0) {}
+    virtual ~_ZVectorBase() {}
+
+    bool operator++()
+    {
+        while (ix >= n) {
+            if (!fill()) return false;
+        }
+        decode(ix++);
+        return true;
+    }
+
+    std::array<ValueT,RANK> const &operator*() const
+        { return cur_raws; }
+
+    /** Decodes up to nmax tuples into out.
+    @return Number of tuples decoded; <nmax only at the end. */
+    long next_batch(std::array<ValueT,RANK> *out, long nmax)
+    {
+        long nout = 0;
+        while (nout < nmax) {
+            if (ix >= n) {
+                if (!fill()) break;
+                continue;
+            }
+            long const m = std::min(nmax - nout, n - ix);
+            for (long j=0; j<m; ++j) {
+                decode(ix++);
+                out[nout++] = cur_raws;
+            }
+        }
+        return nout;
+    }
+};
+
+/** Decodes the plain (single zlib stream) format */
+template<class ValueT, int RANK>
+class _ZVector : public _ZVectorBase<ValueT,RANK> {
     typedef ValueT val_type;
 
 private:
     typedef typename ToIntType<ValueT>::int_type int_type;
 
-    vectorwrapbuf<char> databuf;
+    /** Tuples inflated per batch */
+    static long const batch_size = 4096;
 
-    std::array<ValueT,RANK> cur_raws;
-    ZVAlgo algo;
+    vectorwrapbuf<char> databuf;
 
     std::istream is;
     zstr::istream zis;
 
+protected:
+    bool fill();
+
 public:
     explicit _ZVector(std::vector<char> const &_zbuf);
+};
 
-    bool operator++();
+/** Decodes blocks [block0, block1) of a block-framed ZVector */
+template<class ValueT, int RANK>
+class _ZVectorBlocked : public _ZVectorBase<ValueT,RANK> {
+    typedef ValueT val_type;
 
-    std::array<ValueT,RANK> const &operator*() const
-        { return cur_raws; }
+private:
+    typedef typename ToIntType<ValueT>::int_type int_type;
+
+    zvblock::Index index;
+    long iblock;        // Next block to load
+    long block1;        // End of our block range
+    std::vector<char> raw;        // Current decompressed block
+
+protected:
+    bool fill();
+
+public:
+    _ZVectorBlocked(std::vector<char> const &_zbuf, long _block0, long _block1);
 };
 
 // -------------------------------------------------------------
@@ -239,19 +1277,44 @@ public:
     compliant (and moveable) */
 template<class ValueT, int RANK>
 class ZVector {
-    std::unique_ptr<_ZVector<ValueT,RANK>> self;
+    std::unique_ptr<_ZVectorBase<ValueT,RANK>> self;
 public:
     typedef ValueT val_type;
 
+    /** Decodes the whole vector; plain or block-framed format. */
     explicit ZVector(std::vector<char> const &_zbuf) :
-        self(new _ZVector<ValueT,RANK>(_zbuf)) {}
+        self(zvblock::is_framed(_zbuf)
+            ? (_ZVectorBase<ValueT,RANK> *)new _ZVectorBlocked<ValueT,RANK>(_zbuf, 0, -1)
+            : (_ZVectorBase<ValueT,RANK> *)new _ZVector<ValueT,RANK>(_zbuf)) {}
+
+    /** Decodes only blocks [block0, block1) of a block-framed vector.
+    For a plain vector, the single block 0 is the whole thing.
+    @param block1 -1 means through the last block. */
+    ZVector(std::vector<char> const &_zbuf, long block0, long block1);
 
     bool operator++()
         { return self->operator++(); }
 
     std::array<ValueT,RANK> const &operator*() const
         { return self->operator*(); }
+
+    /** Decodes up to nmax tuples into out; see _ZVectorBase::next_batch() */
+    long next_batch(std::array<ValueT,RANK> *out, long nmax)
+        { return self->next_batch(out, nmax); }
 };
+
+template<class ValueT, int RANK>
+ZVector<ValueT,RANK>::
+    ZVector(std::vector<char> const &_zbuf, long block0, long block1)
+    {
+        if (zvblock::is_framed(_zbuf)) {
+            self.reset(new _ZVectorBlocked<ValueT,RANK>(_zbuf, block0, block1));
+        } else {
+            if (block0 != 0 || (block1 != 1 && block1 != -1)) (*ibmisc::ibmisc_error)(-1,
+                "Plain ZVector has only one block; cannot read blocks [%ld, %ld)", block0, block1);
+            self.reset(new _ZVector<ValueT,RANK>(_zbuf));
+        }
+    }
 // -------------------------------------------------------------
 template<class ValueT, int RANK>
 _ZVector<ValueT,RANK>::
@@ -262,42 +1325,114 @@ _ZVector<ValueT,RANK>::
         int ialgo;
         zis.read((char *)&ialgo, sizeof(ialgo));
         boost::endian::big_to_native_inplace(ialgo);
-        algo = (ZVAlgo)ialgo;
+        this->algo = (ZVAlgo)ialgo;
+        if (this->algo != ZVAlgo::PLAIN && this->algo != ZVAlgo::DIFFS) (*ibmisc::ibmisc_error)(-1,
+            "Corrupt ZVector: unknown algo %d", ialgo);
 
-        for (int i=0; i<RANK; ++i) cur_raws[i] = 0;
+        for (int i=0; i<RANK; ++i) this->cur_raws[i] = 0;
     }
 
 
 template<class ValueT, int RANK>
 bool _ZVector<ValueT,RANK>::
-    operator++()
+    fill()
     {
-        std::array<ValueT,RANK> vals;
-        int_type * const ivals((int_type *)&vals[0]);    // Alternative view into vals
+        // Inflate a whole batch at once
+        this->buf.resize(batch_size * RANK);
+        zis.read((char *)&this->buf[0], batch_size * RANK * sizeof(int_type));
+        this->n = zis.gcount() / (RANK * sizeof(int_type));
+        this->ix = 0;
+        this->data = &this->buf[0];
+        if (this->n == 0) return false;
+
+        int_type * const __restrict__ b(&this->buf[0]);
+        long const nb = this->n * RANK;
+        for (long i=0; i<nb; ++i) b[i] = boost::endian::big_to_native(b[i]);
+        return true;
+    }
 
-        // Read a value
-        zis.read((char *)ivals, sizeof(int_type)*RANK);
-        if (zis.eof()) return false;
 
-        // Do difference encoding
-        switch(algo) {
+// -------------------------------------------------------------
+template<class ValueT, int RANK>
+_ZVectorBlocked<ValueT,RANK>::
+    _ZVectorBlocked(std::vector<char> const &_zbuf, long _block0, long _block1)
+        : index(zvblock::read_index(_zbuf)), iblock(_block0)
+    {
+        this->algo = index.algo;
+        long const nblocks = index.blocks.size();
+        block1 = (_block1 < 0 ? nblocks : _block1);
+        if (index.rank != RANK || index.int_size != sizeof(int_type)) (*ibmisc::ibmisc_error)(-1,
+            "Block-framed ZVector has rank=%d int_size=%d; expected rank=%d int_size=%d",
+            index.rank, index.int_size, RANK, (int)sizeof(int_type));
+        if (iblock < 0 || iblock > block1 || block1 > nblocks) (*ibmisc::ibmisc_error)(-1,
+            "Block range [%ld, %ld) out of range for %ld blocks", _block0, _block1, nblocks);
+    }
+
+template<class ValueT, int RANK>
+bool _ZVectorBlocked<ValueT,RANK>::
+    fill()
+    {
+        if (iblock >= block1) return false;
+
+        zvblock::Block const &blk(index.blocks[iblock]);
+        std::vector<int_type> &buf(this->buf);
+        bool const swap = (index.byte_order != zvblock::host_byte_order());
+        switch(index.algo) {
             case ZVAlgo::PLAIN :
-                for (int i=0; i<RANK; ++i) {
-                    boost::endian::big_to_native_inplace(ivals[i]);
-                    cur_raws[i] = vals[i];
+            case ZVAlgo::DIFFS : {
+                if (blk.rawsize != (long)(blk.n * RANK * sizeof(int_type))) (*ibmisc::ibmisc_error)(-1,
+                    "Corrupt ZVector block %ld", iblock);
+                char const *src = index.payload + blk.offset;
+                if (index.codec == ZVCodec::NONE && !swap
+                    && (uintptr_t)src % alignof(int_type) == 0)
+                {
+                    // Uncompressed, in our byte order: use it in place
+                    if (blk.zsize != blk.rawsize) (*ibmisc::ibmisc_error)(-1,
+                        "Corrupt ZVector block %ld", iblock);
+                    this->data = (int_type const *)src;
+                    break;
                 }
-            break;
-            case ZVAlgo::DIFFS :
+                buf.resize(blk.n * RANK);
+                this->data = &buf[0];
+                zvblock::decompress_block(index.codec, src, blk.zsize,
+                    (char *)&buf[0], blk.rawsize);
+                if (swap) {
+                    int_type * const __restrict__ b(&buf[0]);
+                    long const nb = blk.n * RANK;
+                    for (long i=0; i<nb; ++i) boost::endian::endian_reverse_inplace(b[i]);
+                }
+            } break;
+            case ZVAlgo::PACKED :
+            case ZVAlgo::XORSHUF : {
+                buf.resize(blk.n * RANK);
+                this->data = &buf[0];
+                raw.resize(blk.rawsize);
+                zvblock::decompress_block(index.codec,
+                    index.payload + blk.offset, blk.zsize,
+                    raw.data(), blk.rawsize);
+                char const *p = raw.data();
+                char const *end = p + raw.size();
                 for (int i=0; i<RANK; ++i) {
-                    boost::endian::big_to_native_inplace(ivals[i]);
-                    cur_raws[i] += vals[i];
+                    p = (index.algo == ZVAlgo::PACKED
+                        ? zvblock::unpack_deltas(p, end, blk.n, RANK, &buf[i])
+                        : zvblock::unshuffle_bytes(p, end, blk.n, RANK, &buf[i]));
                 }
-            break;
+                if (p != end) (*ibmisc::ibmisc_error)(-1,
+                    "Corrupt ZVector block %ld", iblock);
+            } break;
         }
+
+        // Start from this block's base tuple
+        int_type * const icur((int_type *)&this->cur_raws[0]);
+        memcpy(icur, &index.bases[iblock * sizeof(int_type) * RANK], sizeof(int_type) * RANK);
+        if (swap) for (int i=0; i<RANK; ++i) boost::endian::endian_reverse_inplace(icur[i]);
+
+        this->n = blk.n;
+        this->ix = 0;
+        ++iblock;
         return true;
     }
 
-
 }    // namespace spsparse::vgen
 
 
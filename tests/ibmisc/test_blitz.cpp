@@ -20,6 +20,8 @@
 
 #include <gtest/gtest.h>
 #include <ibmisc/blitz.hpp>
+#include <ibmisc/blitz_alloc.hpp>
+#include <ibmisc/transpose.hpp>
 #include <iostream>
 #include <cstdio>
 
@@ -92,6 +94,41 @@ TEST_F(BlitzTest, blitz_conv_array)
 
 }
 
+TEST_F(BlitzTest, alloc_blitz)
+{
+    ArrayAllocPolicy const policy(64, true, 4);
+    for (int fortran=0; fortran<2; ++fortran) {
+        blitz::GeneralArrayStorage<2> stor;
+        if (fortran) stor = blitz::fortranArray;
+
+        blitz::Array<double,2> arr;
+        {auto tmp(alloc_blitz<double,2>(blitz::shape(37,5), stor, policy));
+            arr.reference(tmp);
+        }    // arr still owns the memory
+        EXPECT_EQ(0, (uintptr_t)arr.dataFirst() % 64);
+        EXPECT_TRUE(arr.isStorageContiguous());
+        EXPECT_EQ(stor.base()[0], arr.lbound(0));
+        EXPECT_EQ(stor.base()[1], arr.lbound(1));
+        EXPECT_EQ(stor.ordering()[0], arr.ordering(0));
+        EXPECT_EQ(37, arr.extent(0));
+        EXPECT_EQ(5, arr.extent(1));
+        EXPECT_EQ(0., arr(arr.lbound(0), arr.lbound(1)));    // First-touched
+
+        int const b = stor.base()[0];
+        for (int i=b; i<b+37; ++i)
+        for (int j=b; j<b+5; ++j) arr(i,j) = 10*i + j;
+        double sum = 0;
+        for (int i=b; i<b+37; ++i)
+        for (int j=b; j<b+5; ++j) sum += arr(i,j);
+        EXPECT_EQ(blitz::sum(arr), sum);
+    }
+
+    // With lbounds, as in Indexing::make_blitz()
+    auto arr(alloc_blitz<float,1>(blitz::shape(-3), blitz::shape(10), blitz::GeneralArrayStorage<1>()));
+    EXPECT_EQ(-3, arr.lbound(0));
+    EXPECT_EQ(0, (uintptr_t)arr.dataFirst() % array_alloc_policy().alignment);
+}
+
 TEST_F(BlitzTest, blitz_reshape1)
 {
     blitz::Array<int,2> arr(3,4);
@@ -130,6 +167,43 @@ TEST_F(BlitzTest, blitz_reshape1)
 
 
 
+}
+TEST_F(BlitzTest, copy_blitz)
+{
+    // ModelE-like (im,jm,ihc), in Fortran order
+    int const im=67, jm=45, ihc=3;
+    blitz::Array<double,3> arrf(im, jm, ihc, blitz::fortranArray);
+    for (int i=1; i<=im; ++i)
+    for (int j=1; j<=jm; ++j)
+    for (int k=1; k<=ihc; ++k) arrf(i,j,k) = i*10000 + j*10 + k;
+
+    // Elements correspond by position, whatever the lbounds
+    auto same([&](blitz::Array<double,3> const &arr) {
+        for (int i=0; i<im; ++i)
+        for (int j=0; j<jm; ++j)
+        for (int k=0; k<ihc; ++k) {
+            if (arr(arr.lbound(0)+i, arr.lbound(1)+j, arr.lbound(2)+k) != arrf(i+1,j+1,k+1))
+                return false;
+        }
+        return true;
+    });
+
+    for (int nthreads : {1, 3}) {
+        blitz::Array<double,3> arrc(im, jm, ihc);
+        ibmisc::copy_blitz(arrc, arrf, nthreads);
+        EXPECT_TRUE(same(arrc));
+
+        // And back
+        blitz::Array<double,3> arrf2(im, jm, ihc, blitz::fortranArray);
+        ibmisc::copy_blitz(arrf2, arrc, nthreads);
+        EXPECT_TRUE(same(arrf2));
+    }
+
+    // Copies only when needed
+    blitz::Array<double,3> arrc(ibmisc::c_contiguous(arrf));
+    EXPECT_TRUE(ibmisc::is_c_contiguous(arrc));
+    EXPECT_TRUE(same(arrc));
+    EXPECT_EQ(arrc.data(), ibmisc::c_contiguous(arrc).data());
 }
 
 
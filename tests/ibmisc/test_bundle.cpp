@@ -20,6 +20,7 @@
 
 #include <gtest/gtest.h>
 #include <ibmisc/bundle.hpp>
+#include <everytrace.h>
 
 using namespace std;
 using namespace ibmisc;
@@ -159,6 +160,176 @@ TEST_F(BundleTest, construct_alloc)
 
 #endif
 }
+// -----------------------------------------------------------
+TEST_F(BundleTest, slab_alloc)
+{
+    for (auto layout : {SlabLayout::VAR_MAJOR, SlabLayout::INTERLEAVED}) {
+        MyClass_Bundle bundle;
+        bundle.allocate_slab(true, layout);
+        auto &a1(bundle.array("a1"));
+        auto &a2(bundle.array("a2"));
+
+        blitz::Array<int,2> slab(bundle.slab());
+        EXPECT_EQ(12, slab.size());
+        if (layout == SlabLayout::VAR_MAJOR) {
+            EXPECT_EQ(2, slab.extent(0));
+            EXPECT_EQ(a1.data() + 6, a2.data());
+            EXPECT_EQ(1, a1.stride(1));
+        } else {
+            EXPECT_EQ(2, slab.extent(1));
+            EXPECT_EQ(a1.data() + 1, a2.data());
+            EXPECT_EQ(2, a1.stride(1));
+        }
+
+        // Writes through the slab show up in the variables
+        for (int i=0; i<slab.extent(0); ++i)
+        for (int j=0; j<slab.extent(1); ++j) slab(i,j) = i*10+j;
+        for (int i=0; i<2; ++i)
+        for (int j=0; j<3; ++j) {
+            int const k = i*3+j;
+            if (layout == SlabLayout::VAR_MAJOR) {
+                EXPECT_EQ(k, a1(i,j));
+                EXPECT_EQ(10+k, a2(i,j));
+            } else {
+                EXPECT_EQ(k*10, a1(i,j));
+                EXPECT_EQ(k*10+1, a2(i,j));
+            }
+        }
+
+        EXPECT_THROW(bundle.allocate_slab(true, layout), ibmisc::Exception);
+    }
+
+    // The variables and slab share the slab's memory, so they outlive
+    // the bundle
+    blitz::Array<int,2> a1, slab;
+    {MyClass_Bundle bundle;
+        bundle.allocate_slab(true);
+        a1.reference(bundle.array("a1"));
+        slab.reference(bundle.slab());
+        bundle.array("a2") = 17;
+        bundle.free();
+    }
+    a1 = 3;
+    EXPECT_TRUE(blitz::all(slab(0, blitz::Range::all()) == 3));
+    EXPECT_TRUE(blitz::all(slab(1, blitz::Range::all()) == 17));
+}
+// -----------------------------------------------------------
+TEST_F(BundleTest, ncio_stacked)
+{
+    std::string fname("__bundle_ncio_stacked.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    // Write in place from a slab
+    {
+        MyClass rec;
+        rec.bundle.allocate_slab(true);
+        for (int i=0; i<2; ++i)
+        for (int j=0; j<3; ++j) {
+            rec.a1(i,j) = i*3+j;
+            rec.a2(i,j) = 10 + i*3+j;
+        }
+        NcIO ncio(fname, 'w');
+        rec.bundle.ncio_stacked(ncio, {}, "stacked", "int");
+    }
+
+    // Read back into separately allocated variables
+    {
+        MyClass rec;
+        rec.bundle.allocate(true);
+        {NcIO ncio(fname, 'r');
+            rec.bundle.ncio_stacked(ncio, {}, "stacked", "int");
+            auto ncvar(ncio.nc->getVar("stacked"));
+            EXPECT_EQ(3, ncvar.getDimCount());
+            EXPECT_EQ("var", ncvar.getDim(0).getName());
+            EXPECT_EQ(2, ncvar.getDim(0).getSize());
+        }
+        for (int i=0; i<2; ++i)
+        for (int j=0; j<3; ++j) {
+            EXPECT_EQ(i*3+j, rec.a1(i,j));
+            EXPECT_EQ(10 + i*3+j, rec.a2(i,j));
+        }
+        EXPECT_EQ("Aye two", rec.bundle.at("a2").meta.attr[0].second);
+    }
+
+    // Variables must match the file
+    {
+        MyClass rec;
+        rec.bundle.allocate(true);
+        NcIO ncio(fname, 'r');
+        EXPECT_THROW(rec.bundle.ncio_stacked(ncio, {"a2", "a1"}, "stacked", "int"),
+            ibmisc::Exception);
+    }
+}
+// -----------------------------------------------------------
+TEST_F(BundleTest, view)
+{
+    MyClass_Bundle bundle;
+    bundle.add("a3", {2,3}, {"two", "three"}, {"units", "m"});
+    bundle.allocate_slab(true);
+    for (int v=0; v<3; ++v) {
+        auto &arr(bundle.array(v));
+        for (int i=0; i<2; ++i)
+        for (int j=0; j<3; ++j) arr(i,j) = v*100 + i*3+j;
+    }
+
+    // A selection shares memory and metadata; no copies
+    BundleView<int,2> view(bundle, {"a3", "a1"});
+    EXPECT_EQ(2, view.size());
+    EXPECT_EQ("a3", view.meta(0).name);
+    EXPECT_EQ(&bundle.at("a1").meta, &view.meta(1));
+    EXPECT_EQ(bundle.array("a1").data(), view.array("a1").data());
+    EXPECT_TRUE(view.contains("a3"));
+    EXPECT_FALSE(view.contains("a2"));
+    EXPECT_THROW(view.array("a2"), ibmisc::Exception);
+    view.array("a1")(1,2) = -1;
+    EXPECT_EQ(-1, bundle.array("a1")(1,2));
+    bundle.array("a1")(1,2) = 5;
+
+    // Evenly spaced variables make a matrix...
+    blitz::Array<int,2> M;
+    BundleView<int,2> const all(bundle);
+    EXPECT_TRUE(all.matrix(M));
+    EXPECT_EQ(3, M.extent(0));
+    EXPECT_EQ(6, M.extent(1));
+    EXPECT_EQ(204, M(2,4));
+    EXPECT_TRUE(view.select({"a1", "a3"}).matrix(M));
+    EXPECT_EQ(2, M.extent(0));
+    EXPECT_EQ(204, M(1,4));
+
+    // ...but not out of order, or hyperslabs
+    EXPECT_FALSE(view.matrix(M));
+    Domain const domain({1,1}, {2,3});
+    auto const sub(view.slice(domain));
+    EXPECT_FALSE(sub.matrix(M));
+
+    // Hyperslabs keep the global index space
+    EXPECT_EQ(1, sub.array("a3").lbound(0));
+    EXPECT_EQ(1, sub.array("a3").lbound(1));
+    EXPECT_EQ(2, sub.array("a3").extent(1));
+    EXPECT_EQ(205, sub.array("a3")(1,2));
+    EXPECT_EQ(bundle.array("a3").data() + 4, sub.array("a3").data());
+    EXPECT_THROW(view.slice(Domain({0,0}, {3,3})), ibmisc::Exception);
+
+    // ncio writes just the view
+    std::string fname("__bundle_view.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+    {NcIO ncio(fname, 'w');
+        view.ncio(ncio, "v_", "int");
+    }
+    {NcIO ncio(fname, 'r');
+        EXPECT_TRUE(ncio.nc->getVar("v_a2").isNull());
+        MyClass_Bundle bundle2;
+        bundle2.allocate(true);
+        BundleView<int,2> view2(bundle2, {"a1"});
+        view2.ncio(ncio, "v_", "int");
+        ncio.flush();
+        EXPECT_EQ(5, bundle2.array("a1")(1,2));
+        EXPECT_EQ("Aye one", bundle2.at("a1").meta.attr[0].second);
+    }
+}
+
 #if 0
 // -----------------------------------------------------------
 struct MyClass2_Bundle : public ArrayBundle<int,2> {
@@ -201,6 +372,10 @@ TEST_F(BundleTest, late_shape)
 #endif
 
 int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }
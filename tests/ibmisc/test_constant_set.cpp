@@ -98,6 +98,32 @@ TEST_F(ConstantSetTest, constant_set)
     EXPECT_DOUBLE_EQ(4., width_m);
 }
 
+TEST_F(ConstantSetTest, bind)
+{
+    UTSystem ut_system("");
+
+    ConstantSet cs;
+    cs.init(&ut_system);
+    cs.set("length", 1700., "cm", "Length of our thing");
+    cs.set("width", 4., "m", "Width of our thing");
+
+    BoundConstants bc(cs.bind({{"width", "cm"}, {"length", "m"}}));
+    EXPECT_EQ(2, bc.size());
+    EXPECT_DOUBLE_EQ(400., bc[0]);
+    EXPECT_DOUBLE_EQ(17., bc[bc.handle(1)]);
+
+    auto const WIDTH_KM(bc.add("width", "km"));
+    EXPECT_EQ(2, WIDTH_KM.index());
+    EXPECT_DOUBLE_EQ(.004, bc[WIDTH_KM]);
+
+    // Values change: refresh picks them up
+    cs.data[cs.index.at("width")].val = 8.;
+    EXPECT_DOUBLE_EQ(.004, bc[WIDTH_KM]);
+    bc.refresh();
+    EXPECT_DOUBLE_EQ(.008, bc[WIDTH_KM]);
+    EXPECT_DOUBLE_EQ(800., bc.data()[0]);
+}
+
 #if 0
 TEST_F(ConstantSetTestNcIO, constant_set)
 {
@@ -90,6 +90,46 @@ TEST_F(DatetimeTest, time_unit)
 //    tu2 = std::move(tu);
 }
 
+TEST_F(DatetimeTest, batch)
+{
+    // Array-wise Cal365 matches one-at-a-time
+    std::vector<long> jdays;
+    for (long j=0; j < 100000; j += 7) jdays.push_back(j);
+    std::vector<Date> da(jdays.size());
+    cal365.to_dates(jdays.data(), jdays.size(), da.data());
+    std::vector<long> jdays2(jdays.size());
+    cal365.to_jdates(da.data(), da.size(), jdays2.data());
+    for (size_t i=0; i<jdays.size(); ++i) {
+        EXPECT_EQ(cal365.to_date(JDate(jdays[i])), da[i]);
+        EXPECT_EQ(jdays[i], jdays2[i]);
+    }
+
+    // Days before year 0
+    long const jneg = -1;
+    Date dneg;
+    cal365.to_dates(&jneg, 1, &dneg);
+    EXPECT_EQ(Date(-1,12,31), dneg);
+
+    // A time axis, and back
+    TimeUnit tu(&cal365, Datetime(2015,3,1, 23,0,0,0), TimeUnit::SECOND);
+    std::vector<double> axis;
+    for (int i=0; i<1000; ++i) axis.push_back(i * 3600. + .5);
+    std::vector<Datetime> dts(axis.size());
+    tu.to_datetimes(axis.data(), axis.size(), dts.data());
+    std::vector<double> axis2(axis.size());
+    tu.to_doubles(dts.data(), dts.size(), axis2.data());
+    for (size_t i=0; i<axis.size(); ++i) {
+        EXPECT_EQ(tu.to_datetime(axis[i]), dts[i]);
+        EXPECT_DOUBLE_EQ(axis[i], axis2[i]);
+    }
+    EXPECT_EQ(Datetime(2015,3,2, 1,0,0,500000), dts[2]);
+
+    EXPECT_EQ(-1, find_record(tu, axis, Datetime(2015,3,1, 22,0,0,0)));
+    EXPECT_EQ(0, find_record(tu, axis, Datetime(2015,3,1, 23,30,0,0)));
+    EXPECT_EQ(2, find_record(tu, axis, Datetime(2015,3,2, 1,0,0,500000)));
+    EXPECT_EQ(999, find_record(tu, axis, Datetime(2016,1,1)));
+}
+
 // -----------------------------------------------------------
 
 int main(int argc, char **argv) {
@@ -0,0 +1,87 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <ibmisc/error.hpp>
+#include <ibmisc/parallel.hpp>
+#include <cstring>
+#include <string>
+#include <everytrace.h>
+
+using namespace ibmisc;
+
+class ErrorTest : public ::testing::Test {
+protected:
+    ErrorTest() { take_deferred_error(); }
+};
+
+TEST_F(ErrorTest, format_index)
+{
+    char buf[64];
+    EXPECT_EQ(std::string("(3 -1 17)"),
+        format_index(buf, sizeof(buf), std::array<int,3>{3, -1, 17}));
+    EXPECT_EQ(std::string("(4)"),
+        format_index(buf, sizeof(buf), std::array<long,1>{4}));
+
+    // Truncates without overrunning
+    char small[5];
+    format_index(small, sizeof(small), std::array<int,3>{100, 200, 300});
+    EXPECT_EQ(std::string("(100"), small);
+}
+
+TEST_F(ErrorTest, defer)
+{
+    EXPECT_FALSE(has_deferred_error());
+    raise_deferred_error();    // No-op
+
+    defer_error(-1, "first %d", 1);
+    defer_error(-1, "second %d", 2);
+    EXPECT_TRUE(has_deferred_error());
+
+    try {
+        raise_deferred_error();
+        FAIL() << "Expected ibmisc::Exception";
+    } catch(ibmisc::Exception const &err) {
+    }
+    EXPECT_FALSE(has_deferred_error());
+
+    defer_error(-1, "%s", std::string(2*DeferredError::max_len, 'x').c_str());
+    DeferredError const err(take_deferred_error());
+    EXPECT_TRUE(err.set);
+    EXPECT_EQ(DeferredError::max_len-1, strlen(err.msg));
+    EXPECT_FALSE(has_deferred_error());
+}
+
+TEST_F(ErrorTest, parallel_for)
+{
+    // Errors deferred on worker threads reach the calling thread
+    parallel_for(0, 100, 4, [&](long i0, long i1) {
+        for (long i=i0; i<i1; ++i) if (i == 77) defer_error(-1, "bad item %ld", i);
+    });
+    ASSERT_TRUE(has_deferred_error());
+    EXPECT_EQ(std::string("bad item 77"), take_deferred_error().msg);
+}
+
+int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -19,9 +19,13 @@
 // https://github.com/google/googletest/blob/master/googletest/docs/Primer.md
 
 #include <ibmisc/Test.hpp>
+#include <ibmisc/error.hpp>
 #include <ibmisc/filesystem.hpp>
+#include <boost/filesystem.hpp>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <everytrace.h>
 
 using namespace ibmisc;
 
@@ -39,9 +43,51 @@ TEST_F(FilesystemTest, filesystem_simple)
     EXPECT_EQ("/bin/ls", search_path.locate("ls"));
 }
 
+TEST_F(FilesystemTest, cached_search_path)
+{
+    boost::filesystem::path const dir0("__filesystem_test0"), dir1("__filesystem_test1");
+    boost::filesystem::create_directory(dir0);
+    boost::filesystem::create_directory(dir1);
+    auto touch = [](boost::filesystem::path const &p) { std::ofstream out(p.string()); };
+    touch(dir0 / "a.nc");
+    touch(dir1 / "a.nc");
+    touch(dir1 / "b.nc");
+
+    for (bool prescan : {false, true}) {
+        CachedSearchPath files("test", {dir0.string(), dir1.string()}, prescan);
+        EXPECT_EQ((dir0 / "a.nc").string(), files.locate("a.nc"));    // First in path wins
+        EXPECT_EQ((dir1 / "b.nc").string(), files.locate("b.nc"));
+        EXPECT_EQ("", files.find("c.nc"));
+        EXPECT_THROW(files.locate("c.nc"), ibmisc::Exception);
+
+        // Misses are remembered too
+        touch(dir0 / "c.nc");
+        EXPECT_EQ("", files.find("c.nc"));
+        files.clear();
+        EXPECT_EQ((dir0 / "c.nc").string(), files.locate("c.nc"));
+        boost::filesystem::remove(dir0 / "c.nc");
+
+        auto const found(files.locate({"b.nc", "a.nc", "b.nc"}, 3));
+        EXPECT_EQ((dir1 / "b.nc").string(), found[0]);
+        EXPECT_EQ((dir0 / "a.nc").string(), found[1]);
+        EXPECT_EQ((dir1 / "b.nc").string(), found[2]);
+    }
+
+    EnvSearchPath const env("PATH");
+    CachedSearchPath path(env, true);
+    EXPECT_EQ(env.locate("ls"), path.locate("ls"));
+
+    boost::filesystem::remove_all(dir0);
+    boost::filesystem::remove_all(dir1);
+}
+
 // -----------------------------------------------------------
 
 int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }
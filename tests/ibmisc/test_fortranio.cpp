@@ -21,6 +21,8 @@
 #include <gtest/gtest.h>
 #include <ibmisc/fortranio.hpp>
 #include <cstdio>
+#include <cstring>
+#include <fstream>
 
 using namespace std;
 using namespace ibmisc;
@@ -203,6 +205,220 @@ TEST_F(FortranIOTest, cast_le)
 }
 
 
+void test_mmap(std::string const &fname, ibmisc::Endian endian)
+{
+    std::array<char, 80> str0, str1;
+    blitz::Array<int, 1> vals(17);
+
+    for (bool use_mmap : {false, true}) {
+        fortran::UnformattedInput fin(fname, endian, use_mmap);
+        EXPECT_EQ(use_mmap, fin.is_mmap());
+        EXPECT_EQ(4, fin.nrecords());
+
+        // Random access, out of order
+        fin.seek_record(2);
+        fortran::read(fin) >> str1 >> vals >> str0 >> fortran::endr;
+        EXPECT_EQ("Goodbye World", fortran::trim(str0));
+        EXPECT_EQ(16, vals(0));
+
+        fin.seek_record(0);
+        blitz::Array<int,1> view;
+        fortran::read(fin) >> str0
+            >> fortran::view<int,1>(view, blitz::shape(17))
+            >> fortran::endr;
+        EXPECT_EQ("Hello World", fortran::trim(str0));
+        EXPECT_EQ(1, view.lbound(0));
+        for (int i=1; i<=17; ++i) EXPECT_EQ(i, view(i));
+
+        // Read through to the end
+        int n = 1;
+        for (;; ++n) {
+            fortran::read(fin) >> fortran::endr;
+            if (fin.eof()) break;
+        }
+        EXPECT_EQ(4, n);
+    }
+}
+
+TEST_F(FortranIOTest, mmap_be)
+    { test_mmap("sample_fortranio_be", ibmisc::Endian::BIG); }
+TEST_F(FortranIOTest, mmap_le)
+    { test_mmap("sample_fortranio_le", ibmisc::Endian::LITTLE); }
+
+void test_prefetch(std::string const &fname, ibmisc::Endian endian)
+{
+    std::array<char, 80> str0, str1;
+    blitz::Array<int, 1> vals(17);
+
+    for (int nahead : {1, 2, 10}) {
+        fortran::UnformattedInput fin(fname, endian, fortran::Prefetch(nahead));
+        EXPECT_FALSE(fin.is_mmap());
+
+        fortran::read(fin) >> str0 >> vals >> fortran::endr;
+        EXPECT_EQ("Hello World", fortran::trim(str0));
+        for (int i=0; i<17; ++i) EXPECT_EQ(i+1, vals(i));
+
+        // Scanning does not disturb the read-ahead
+        EXPECT_EQ(4, fin.nrecords());
+        fortran::read(fin) >> fortran::endr;    // skip
+        fortran::read(fin) >> str1 >> vals >> str0 >> fortran::endr;
+        EXPECT_EQ("Goodbye World", fortran::trim(str0));
+        EXPECT_EQ(16, vals(0));
+
+        fin.seek_record(0);
+        blitz::Array<double,1> dvals(17);
+        fortran::read(fin) >> str0 >> fortran::blitz_cast<int,double,1>(dvals) >> fortran::endr;
+        EXPECT_EQ(17., dvals(16));
+
+        int n = 1;
+        for (;; ++n) {
+            fortran::read(fin) >> fortran::endr;
+            if (fin.eof()) break;
+        }
+        EXPECT_EQ(4, n);
+    }
+
+    // Stop with records still queued
+    fortran::UnformattedInput fin(fname, endian, fortran::Prefetch(1));
+    fortran::read(fin) >> str0 >> vals >> fortran::endr;
+}
+
+TEST_F(FortranIOTest, prefetch_be)
+    { test_prefetch("sample_fortranio_be", ibmisc::Endian::BIG); }
+TEST_F(FortranIOTest, prefetch_le)
+    { test_prefetch("sample_fortranio_le", ibmisc::Endian::LITTLE); }
+
+void test_write(std::string const &fname, ibmisc::Endian endian)
+{
+    std::string const oname(fname + ".out");
+    std::array<char, 80> str0, str1;
+    blitz::Array<int, 1> vals(17);
+    for (int i=0; i<17; ++i) vals(i) = i+1;
+    for (size_t i=0; i<str0.size(); ++i) str0[i] = ' ';
+    memcpy(&str0[0], "Hello World", 11);
+
+    blitz::Array<double, 2> dvals(3, 4, blitz::fortranArray);
+    for (int i=1; i<=3; ++i)
+    for (int j=1; j<=4; ++j) dvals(i,j) = i + j*.5;
+
+    // Tiny buffer: payloads straddle flushes
+    {fortran::UnformattedOutput fout(oname, endian, 13);
+        fortran::write(fout) << str0 << vals << fortran::endr;
+        fortran::write(fout) << 3 << fortran::endr;
+        fortran::write(fout) << fortran::write_cast<float>(dvals)
+            << dvals(blitz::Range::all(), 2) << 17 << fortran::endr;
+    }
+
+    // First record is byte-for-byte what Fortran wrote
+    {std::ifstream f0(fname, std::ios::binary), f1(oname, std::ios::binary);
+        std::vector<char> b0(4+80+17*4+4), b1(b0.size());
+        f0.read(&b0[0], b0.size());
+        f1.read(&b1[0], b1.size());
+        EXPECT_TRUE(b0 == b1);
+    }
+
+    {fortran::UnformattedInput fin(oname, endian);
+        EXPECT_EQ(3, fin.nrecords());
+        vals = 0;
+        fortran::read(fin) >> str1 >> vals >> fortran::endr;
+        EXPECT_EQ("Hello World", fortran::trim(str1));
+        for (int i=0; i<17; ++i) EXPECT_EQ(i+1, vals(i));
+        fortran::read(fin) >> fortran::endr;
+
+        blitz::Array<float, 2> fvals(3, 4, blitz::fortranArray);
+        blitz::Array<double, 1> col(3);
+        int n;
+        fortran::read(fin) >> fvals >> col >> n >> fortran::endr;
+        for (int i=1; i<=3; ++i) {
+            EXPECT_EQ(dvals(i,2), col(i-1));
+            for (int j=1; j<=4; ++j) EXPECT_EQ((float)dvals(i,j), fvals(i,j));
+        }
+        EXPECT_EQ(17, n);
+    }
+    remove(oname.c_str());
+}
+
+TEST_F(FortranIOTest, write_be)
+    { test_write("sample_fortranio_be", ibmisc::Endian::BIG); }
+TEST_F(FortranIOTest, write_le)
+    { test_write("sample_fortranio_le", ibmisc::Endian::LITTLE); }
+
+void test_index(std::string const &fname, ibmisc::Endian endian)
+{
+    std::string const iname(fname + ".idx");
+    remove(iname.c_str());
+    std::array<char, 80> str0, str1;
+    blitz::Array<int, 1> vals(17);
+
+    std::vector<fortran::UnformattedInput::Record> recs0;
+    {fortran::UnformattedInput fin(fname, endian);
+        EXPECT_FALSE(fin.use_index());    // Scanned and saved
+        recs0 = fin.records();
+    }
+
+    for (bool use_mmap : {false, true}) {
+        fortran::UnformattedInput fin(fname, endian, use_mmap);
+        EXPECT_TRUE(fin.use_index());     // Loaded
+        ASSERT_EQ(recs0.size(), fin.records().size());
+        for (size_t i=0; i<recs0.size(); ++i) {
+            EXPECT_EQ(recs0[i].offset, fin.records()[i].offset);
+            EXPECT_EQ(recs0[i].nbytes, fin.records()[i].nbytes);
+        }
+
+        // Out of order
+        fortran::read_record(fin, 2) >> str1 >> vals >> str0 >> fortran::endr;
+        EXPECT_EQ("Goodbye World", fortran::trim(str0));
+        EXPECT_EQ(16, vals(0));
+        fortran::read_record(fin, 0) >> str0 >> vals >> fortran::endr;
+        EXPECT_EQ("Hello World", fortran::trim(str0));
+        EXPECT_EQ(1, vals(0));
+    }
+
+    // Index for the other byte order is not used
+    {fortran::UnformattedInput fin(fname,
+            endian == Endian::BIG ? Endian::LITTLE : Endian::BIG);
+        EXPECT_FALSE(fin.load_index());
+    }
+
+    // Changing the file invalidates the index
+    {std::ofstream fout(fname, std::ios::binary | std::ios::app);
+        fout.write("\0\0\0\0", 4);
+    }
+    {fortran::UnformattedInput fin(fname, endian);
+        EXPECT_FALSE(fin.load_index());
+    }
+    remove(iname.c_str());
+}
+
+TEST_F(FortranIOTest, index_be)
+    { test_index("sample_fortranio_be", ibmisc::Endian::BIG); }
+TEST_F(FortranIOTest, index_le)
+    { test_index("sample_fortranio_le", ibmisc::Endian::LITTLE); }
+
+TEST_F(FortranIOTest, swap_bytes)
+{
+    // Odd lengths exercise the SIMD kernels' scalar tails
+    for (int item_size : {2, 4, 8}) {
+    for (long nitem : {1, 3, 17, 1001}) {
+        std::vector<char> orig(item_size * nitem);
+        for (size_t i=0; i<orig.size(); ++i) orig[i] = (char)(7*i + 1);
+
+        std::vector<char> buf(orig);
+        swap_bytes(&buf[0], item_size, nitem);
+        for (long k=0; k<nitem; ++k) {
+        for (int j=0; j<item_size; ++j) {
+            EXPECT_EQ(orig[k*item_size + j], buf[k*item_size + item_size-1-j]);
+        }}
+    }}
+
+    std::vector<char> src {0,0,0,5, 0,0,1,0};
+    std::array<long,2> dest;
+    endian_cast<int,long>(&src[0], &dest[0], 2, Endian::BIG);
+    EXPECT_EQ(5, dest[0]);
+    EXPECT_EQ(256, dest[1]);
+}
+
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
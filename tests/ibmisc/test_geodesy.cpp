@@ -0,0 +1,130 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// https://github.com/google/googletest/blob/master/googletest/docs/Primer.md
+
+#include <gtest/gtest.h>
+#include <ibmisc/geodesy.hpp>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace ibmisc;
+
+/** Error bound claimed for the batch distances (degrees) */
+static double const tol = 1e-11;
+
+// The fixture for testing class Foo.
+class GeodesyTest : public ::testing::Test {
+protected:
+    GeodesyTest() {}
+
+    static void random_points(int seed, long n, std::vector<double> &lon, std::vector<double> &lat)
+    {
+        std::mt19937 gen(seed);
+        std::uniform_real_distribution<double> ulon(-180., 180.);
+        std::uniform_real_distribution<double> usinlat(-1., 1.);
+        lon.resize(n);
+        lat.resize(n);
+        for (long i=0; i<n; ++i) {
+            lon[i] = ulon(gen);
+            lat[i] = asin(usinlat(gen)) * 180. / M_PI;
+        }
+    }
+
+    /** Reference great circle distance (degrees), by the Vincenty
+    formula in long double; accurate at all distances. */
+    static double reference_distance(double lon1, double lat1, double lon2, double lat2)
+    {
+        long double const d2r = M_PI / 180.;
+        long double const p1 = lat1 * d2r, p2 = lat2 * d2r;
+        long double const dl = (lon2 - lon1) * d2r;
+        long double const a = cosl(p2) * sinl(dl);
+        long double const b = cosl(p1) * sinl(p2) - sinl(p1) * cosl(p2) * cosl(dl);
+        long double const c = sinl(p1) * sinl(p2) + cosl(p1) * cosl(p2) * cosl(dl);
+        return atan2l(sqrtl(a*a + b*b), c) / d2r;
+    }
+};
+
+TEST_F(GeodesyTest, known_distances)
+{
+    EXPECT_EQ(0., haversine_distance(10., 20., 10., 20.));
+    EXPECT_NEAR(90., haversine_distance(0., 0., 0., 90.), tol);
+    EXPECT_NEAR(90., haversine_distance(0., 0., 90., 0.), tol);
+    EXPECT_NEAR(180., haversine_distance(0., 0., 180., 0.), tol);
+
+    double const lon2[] = {10., 0., 90., 180., -170.};
+    double const lat2[] = {20., 90., 0., 0., 0.};
+    double out[5];
+    haversine_distance(0., 0., 5, lon2, lat2, out);
+    EXPECT_NEAR(haversine_distance(0., 0., 10., 20.), out[0], tol);
+    EXPECT_NEAR(90., out[1], tol);
+    EXPECT_NEAR(90., out[2], tol);
+    EXPECT_NEAR(180., out[3], tol);
+    EXPECT_NEAR(170., out[4], tol);
+}
+
+TEST_F(GeodesyTest, batch_matches_scalar)
+{
+    long const n1 = 50, n2 = 400;
+    std::vector<double> lon1, lat1, lon2, lat2;
+    random_points(1, n1, lon1, lat1);
+    random_points(2, n2, lon2, lat2);
+
+    // Include near-coincident and near-antipodal pairs
+    for (int k=0; k<20; ++k) {
+        lon2[k] = lon1[k] + 1e-7 * k;
+        lat2[k] = lat1[k] - 1e-7 * k;
+        lon2[20+k] = lon1[k] + 180. - 1e-6 * k;
+        lat2[20+k] = -lat1[k] + 1e-6 * k;
+    }
+
+    std::vector<double> many(n1*n2);
+    haversine_distance(n1, &lon1[0], &lat1[0], n2, &lon2[0], &lat2[0], &many[0]);
+
+    SpherePoints const p1(n1, &lon1[0], &lat1[0]);
+    SpherePoints const p2(n2, &lon2[0], &lat2[0]);
+    std::vector<double> sphere(n1*n2);
+    sphere_distance(p1, p2, &sphere[0]);
+
+    std::vector<double> one(n2);
+    for (long i=0; i<n1; ++i) {
+        haversine_distance(lon1[i], lat1[i], n2, &lon2[0], &lat2[0], &one[0]);
+        for (long j=0; j<n2; ++j) {
+            double const batch = many[i*n2+j];
+            ASSERT_EQ(batch, sphere[i*n2+j]);
+            ASSERT_EQ(batch, one[j]);
+
+            // Within the claimed bound of an accurate reference...
+            double const ref = reference_distance(lon1[i], lat1[i], lon2[j], lat2[j]);
+            ASSERT_NEAR(ref, batch, tol) << i << " " << j;
+
+            // ...and of the scalar haversine, except near antipodes
+            // (where haversine itself loses accuracy)
+            if (ref < 170.) {
+                ASSERT_NEAR(haversine_distance(lon1[i], lat1[i], lon2[j], lat2[j]), batch, tol)
+                    << i << " " << j;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
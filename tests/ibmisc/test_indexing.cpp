@@ -21,9 +21,12 @@
 #include <gtest/gtest.h>
 #include <ibmisc/indexing.hpp>
 #include <ibmisc/IndexSet.hpp>
+#include <ibmisc/hash.hpp>
 #include <ibmisc/Test.hpp>
+#include <algorithm>
 #include <iostream>
 #include <memory>
+#include <unordered_map>
 #include <everytrace.h>
 
 using namespace ibmisc;
@@ -171,6 +174,37 @@ TEST_F(IndexingTest, to_blitzrow_major)
 
 }
 
+TEST_F(IndexingTest, compiled_indexing)
+{
+    for (auto const &order : std::vector<std::vector<int>>{{0,1,2}, {2,1,0}, {1,2,0}}) {
+        Indexing ind(
+            {"d0", "d1", "d2"},
+            {1,0,-3},    // Base
+            {7,5,3},     // Extent
+            std::vector<int>(order));
+        CompiledIndexing<3> cind(ind);
+
+        std::vector<long> ixs;
+        std::vector<int> tuples;
+        for (long ix=0; ix<ind.extent(); ++ix) {
+            auto tuple(ind.index_to_tuple<int,3>(ix));
+            EXPECT_EQ(ix, ind.tuple_to_index(tuple));
+            EXPECT_EQ(tuple, cind.index_to_tuple<int>(ix));
+            EXPECT_EQ(ix, cind.tuple_to_index(tuple));
+            ixs.push_back(ix);
+            for (int k=0; k<3; ++k) tuples.push_back(tuple[k]);
+        }
+
+        // Batch conversion
+        std::vector<int> tuples2(tuples.size());
+        cind.index_to_tuple(ixs.size(), &ixs[0], &tuples2[0]);
+        EXPECT_EQ(tuples, tuples2);
+        std::vector<long> ixs2(ixs.size());
+        cind.tuple_to_index(ixs.size(), &tuples[0], &ixs2[0]);
+        EXPECT_EQ(ixs, ixs2);
+    }
+}
+
 // -----------------------------------------------------------
 TEST_F(IndexingTest, domain)
 {
@@ -194,6 +228,40 @@ TEST_F(IndexingTest, domain)
 
 }
 
+TEST_F(IndexingTest, domain_runs)
+{
+    for (auto const &order : std::vector<std::vector<int>>{{0,1,2}, {2,1,0}}) {
+        Indexing ind(
+            {"d0", "d1", "d2"},
+            {1,0,0},    // Base
+            {6,5,4},    // Extent
+            std::vector<int>(order));
+
+        for (auto const &domain : std::vector<Domain>{
+            Domain({2,1,1}, {5,3,3}),
+            Domain({0,0,0}, {10,10,10}),    // Everything: one run
+            Domain({3,0,0}, {4,5,4}),       // One slab
+            Domain({2,3,0}, {2,4,4})})      // Empty
+        {
+            // Brute force
+            std::vector<long> expected;
+            for (long ix=0; ix<ind.extent(); ++ix)
+                if (in_domain(&domain, &ind, ix)) expected.push_back(ix);
+
+            std::vector<long> got;
+            auto runs(domain_runs(domain, ind));
+            for (size_t i=0; i<runs.size(); ++i) {
+                EXPECT_LT(runs[i].begin, runs[i].end);
+                if (i > 0) EXPECT_LT(runs[i-1].end, runs[i].begin);    // Merged
+                for (long ix=runs[i].begin; ix<runs[i].end; ++ix) got.push_back(ix);
+            }
+            EXPECT_EQ(expected, got);
+        }
+
+        EXPECT_EQ(1, domain_runs(Domain({0,0,0}, {10,10,10}), ind).size());
+    }
+}
+
 TEST_F(IndexingTest, domain_netcdf)
 {
     std::string fname(tmp_fname("__netcdf_domain_test.nc"));
@@ -217,6 +285,48 @@ TEST_F(IndexingTest, domain_netcdf)
 
 }
 
+TEST_F(IndexingTest, blitz_domain)
+{
+    std::string fname(tmp_fname("__netcdf_blitz_domain_test.nc"));
+
+    Indexing ind(
+        {"d0", "d1"},
+        {1,2},      // Base
+        {4,5},      // Extent
+        {1,0});     // Column major
+
+    {
+        NcIO ncio(fname, 'w');
+        auto arr(ind.make_blitz<double,2>());
+        for (int i=1; i<5; ++i)
+        for (int j=2; j<7; ++j) arr(i,j) = i*10 + j;
+        ncio_blitz_domain(ncio, arr, "arr", "double", ind, Domain({1,2}, {5,7}));
+        ncio.close();
+    }
+
+    Domain domain({2,3}, {4,6});
+    blitz::Array<double,2> arr;
+    {
+        NcIO ncio(fname, 'r');
+        ncio_blitz_domain(ncio, arr, "arr", "double", ind, domain);
+        ncio.close();
+    }
+
+    EXPECT_EQ(2, arr.lbound(0));
+    EXPECT_EQ(3, arr.lbound(1));
+    EXPECT_EQ(2, arr.extent(0));
+    EXPECT_EQ(3, arr.extent(1));
+    EXPECT_EQ(1, &arr(3,3) - &arr(2,3));    // Storage order of ind
+    for (int i=2; i<4; ++i)
+    for (int j=3; j<6; ++j) EXPECT_EQ(i*10 + j, arr(i,j));
+
+    // Domain outside of the indexing
+    NcIO ncio(fname, 'r');
+    blitz::Array<double,2> arr2;
+    EXPECT_THROW(ncio_blitz_domain(ncio, arr2, "arr", "double", ind, Domain({0,2}, {2,4})),
+        ibmisc::Exception);
+}
+
 
 // -----------------------------------------------------------
 
@@ -252,6 +362,35 @@ TEST_F(IndexingTest, index_set)
     EXPECT_THROW(names[17], ibmisc::Exception);
 }
 
+TEST_F(IndexingTest, index_set_freeze)
+{
+    IndexSet<std::string> names;
+    for (int i=0; i<1000; ++i) names.insert("var" + std::to_string(i));
+    EXPECT_FALSE(names.frozen());
+    EXPECT_TRUE(names.freeze());
+    EXPECT_TRUE(names.frozen());
+
+    for (int i=0; i<1000; ++i) EXPECT_EQ(i, names.at("var" + std::to_string(i)));
+    EXPECT_FALSE(names.contains("var1000"));
+    EXPECT_EQ((size_t)-1, names.at("var1000", false));
+    EXPECT_THROW(names.at("ZZTOP"), ibmisc::Exception);
+
+    // Inserting unfreezes
+    names.insert("var1000");
+    EXPECT_FALSE(names.frozen());
+    EXPECT_EQ(1000, names.at("var1000"));
+
+    IndexSet<std::string> one;
+    one.insert("A");
+    EXPECT_TRUE(one.freeze());
+    EXPECT_EQ(0, one.at("A"));
+    EXPECT_FALSE(one.contains("B"));
+
+    IndexSet<std::string> none;
+    EXPECT_FALSE(none.freeze());
+    EXPECT_FALSE(none.contains("A"));
+}
+
 
 TEST_F(IndexingTest, indexed_vector)
 {
@@ -271,6 +410,54 @@ TEST_F(IndexingTest, indexed_vector)
     EXPECT_EQ(2, values.at("C"));
 }
 
+/** Fraction of 2^bits buckets (top bits of the hash) left empty */
+template<class HashT, class KeyT>
+static double empty_fraction(std::vector<KeyT> const &keys, int bits)
+{
+    std::vector<int> count(1 << bits, 0);
+    for (auto const &key : keys) ++count[(uint64_t)HashT()(key) >> (64-bits)];
+    return (double)std::count(count.begin(), count.end(), 0) / count.size();
+}
+
+TEST_F(IndexingTest, composite_hash)
+{
+    typedef std::pair<int,int> PairT;
+    typedef std::array<int,2> ArrayT;
+    typedef std::tuple<int,int> TupleT;
+
+    // A 256x256 grid into 2^16 buckets: a random hash leaves e^-1 empty
+    std::vector<PairT> pairs;
+    std::vector<ArrayT> arrays;
+    std::vector<TupleT> tuples;
+    std::vector<long> linear, shifted;
+    for (int i=0; i<256; ++i) for (int j=0; j<256; ++j) {
+        pairs.push_back(std::make_pair(i,j));
+        arrays.push_back({{i,j}});
+        tuples.push_back(std::make_tuple(i,j));
+        linear.push_back((long)i*1024 + j);    // Power-of-two stride
+        shifted.push_back((long)(i*256 + j) << 20);
+    }
+    EXPECT_NEAR(0.368, empty_fraction<std::hash<PairT>>(pairs, 16), .02);
+    EXPECT_NEAR(0.368, empty_fraction<std::hash<ArrayT>>(arrays, 16), .02);
+    EXPECT_NEAR(0.368, empty_fraction<std::hash<TupleT>>(tuples, 16), .02);
+    EXPECT_NEAR(0.368, empty_fraction<ibmisc::Hash<long>>(linear, 16), .02);
+    EXPECT_NEAR(0.368, empty_fraction<ibmisc::Hash<long>>(shifted, 16), .02);
+
+    // Order matters
+    EXPECT_NE(std::hash<PairT>()(PairT(1,2)), std::hash<PairT>()(PairT(2,1)));
+
+    std::unordered_map<std::array<int,3>, int> map;
+    for (int i=0; i<100; ++i) map[{{i, 2*i, 3*i}}] = i;
+    EXPECT_EQ(100, map.size());
+    EXPECT_EQ(42, map.at({{42, 84, 126}}));
+    EXPECT_EQ(0, map.count({{1, 1, 1}}));
+
+    std::unordered_map<std::tuple<std::string,int>, int> tmap;
+    tmap[std::make_tuple(std::string("A"), 1)] = 1;
+    tmap[std::make_tuple(std::string("A"), 2)] = 2;
+    EXPECT_EQ(2, tmap.at(std::make_tuple(std::string("A"), 2)));
+}
+
 // -----------------------------------------------------------
 
 int main(int argc, char **argv) {
@@ -22,11 +22,26 @@
 #include <cstdio>
 #include <fstream>
 #include <cstdlib>
+#include <thread>
 #include <gtest/gtest.h>
 #include <ibmisc/fortranio.hpp>
 #include <spsparse/eigen.hpp>
 #include <ibmisc/linear/eigen.hpp>
 #include <ibmisc/linear/compressed.hpp>
+#include <ibmisc/linear/runlength.hpp>
+#include <ibmisc/linear/tuple.hpp>
+#include <ibmisc/linear/compose.hpp>
+#include <ibmisc/linear/lazy.hpp>
+#include <ibmisc/linear/sell.hpp>
+#include <ibmisc/linear/family.hpp>
+#include <ibmisc/linear/patch.hpp>
+#include <ibmisc/linear/fortran.hpp>
+#include <ibmisc/linear/overlap.hpp>
+#include <ibmisc/linear/stream.hpp>
+#include <ibmisc/linear/cache.hpp>
+#include <boost/filesystem.hpp>
+#include <atomic>
+#include <ibmisc/progress.hpp>
 
 using namespace std;
 using namespace ibmisc;
@@ -322,6 +337,179 @@ for (auto ii(BvA3.M.generator()); ++ii; ) {
                 EXPECT_DOUBLE_EQ(bb1(k,i), bb3(k,i));
             }
         }
+
+        // Same thing, with the decoded cache enabled
+        BvA3.set_cache_budget(1L<<20);
+        for (int pass=0; pass<2; ++pass) {    // Build the cache, then reuse it
+            bb3 = -17;
+            BvA3p->apply_M(aa, bb3, linear::AccumType::REPLACE, force_conservation);
+            EXPECT_GT(BvA3.cache_nbytes(), 0);
+            for (int k=0; k<nk; ++k) {
+                for (int i=0; i<bb1.extent(1); ++i) {
+                    EXPECT_DOUBLE_EQ(bb1(k,i), bb3(k,i));
+                }
+            }
+        }
+        BvA3.set_cache_budget(0);
+        EXPECT_EQ(0, BvA3.cache_nbytes());
+    }
+
+    // ================== Many vectors, in both memory layouts
+    for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+        int const nk = 5;
+        blitz::Array<double,2> aa(nk,shape1[1]);
+        blitz::Array<double,2> aa_v(nk,shape1[1], blitz::ColumnMajorArray<2>());
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<aa.extent(1); ++i) aa(k,i) = 32*i*i - 17 + k;
+        aa_v = aa;
+
+        blitz::Array<double,2> bb1(nk,shape1[0]);
+        blitz::Array<double,2> bb3(nk,shape1[0]);
+        blitz::Array<double,2> bb3_v(nk,shape1[0], blitz::ColumnMajorArray<2>());
+        bb1 = -17;
+        bb3 = -17;
+        bb3_v = -17;
+
+        BvA3.set_cache_budget(1L<<20);
+        BvA1p->apply_M(aa, bb1, linear::AccumType::REPLACE, force_conservation);
+        BvA3p->apply_M(aa, bb3, linear::AccumType::REPLACE, force_conservation);
+        BvA3p->apply_M(aa_v, bb3_v, linear::AccumType::REPLACE, force_conservation);
+        BvA3.set_cache_budget(0);
+
+        for (int k=0; k<nk; ++k) {
+            for (int i=0; i<bb1.extent(1); ++i) {
+                EXPECT_DOUBLE_EQ(bb1(k,i), bb3(k,i));
+                EXPECT_DOUBLE_EQ(bb1(k,i), bb3_v(k,i));
+            }
+        }
+    }
+
+    // ================== BvA4: Run-length encoded round trip
+    {
+        linear::Weighted_RL BvA4x(to_runlength(BvA2));
+        EXPECT_EQ(xvalues.size(), BvA4x.nnz());
+
+        std::string fname4("__linear4.nc");
+        tmpfiles.push_back(fname4);
+        ::remove(fname4.c_str());
+        {NcIO ncio(fname4, 'w');
+            BvA4x.ncio(ncio, "BvA");
+        }
+
+        auto BvA4(linear::new_weighted(linear::LinearType::RUNLENGTH));
+        {NcIO ncio(fname4, 'r');
+            BvA4->ncio(ncio, "BvA");
+        }
+        EXPECT_EQ(BvA1p->conservative, BvA4->conservative);
+        EXPECT_EQ(shape1, BvA4->shape());
+
+        for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+            int const nk = 3;
+            blitz::Array<double,2> aa(nk,shape1[1]);
+            for (int k=0; k<nk; ++k)
+            for (int i=0; i<aa.extent(1); ++i) aa(k,i) = 32*i*i - 17 + k;
+
+            blitz::Array<double,2> bb1(nk,shape1[0]);
+            blitz::Array<double,2> bb4(nk,shape1[0]);
+            bb1 = -17;
+            bb4 = -17;
+
+            BvA1p->apply_M(aa, bb1, linear::AccumType::REPLACE, force_conservation);
+            BvA4->apply_M(aa, bb4, linear::AccumType::REPLACE, force_conservation);
+
+            for (int k=0; k<nk; ++k) {
+                for (int i=0; i<bb1.extent(1); ++i) {
+                    EXPECT_DOUBLE_EQ(bb1(k,i), bb4(k,i));
+                }
+            }
+        }
+    }
+
+    // ================== BvA5: Float storage
+    std::string fname5("__linear5.nc");
+    tmpfiles.push_back(fname5);
+    ::remove(fname5.c_str());
+    {
+        linear::Weighted_Compressed_Float BvA5x(linear::compress<float>(BvA2));
+        EXPECT_EQ(xvalues.size(), BvA5x.nnz());
+        {NcIO ncio(fname5, 'w');
+            BvA5x.ncio(ncio, "BvA");
+        }
+
+        auto BvA5(linear::new_weighted(linear::LinearType::COMPRESSED_FLOAT));
+        {NcIO ncio(fname5, 'r');
+            BvA5->ncio(ncio, "BvA");
+        }
+        EXPECT_EQ(shape1, BvA5->shape());
+
+        for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+            int const nk = 3;
+            blitz::Array<double,2> aa(nk,shape1[1]);
+            for (int k=0; k<nk; ++k)
+            for (int i=0; i<aa.extent(1); ++i) aa(k,i) = 32*i*i - 17 + k;
+
+            blitz::Array<double,2> bb1(nk,shape1[0]);
+            blitz::Array<double,2> bb5(nk,shape1[0]);
+            bb1 = -17;
+            bb5 = -17;
+
+            BvA1p->apply_M(aa, bb1, linear::AccumType::REPLACE, force_conservation);
+            BvA5->apply_M(aa, bb5, linear::AccumType::REPLACE, force_conservation);
+
+            // Weights are rounded to float; sums are still in double
+            for (int k=0; k<nk; ++k) {
+                for (int i=0; i<bb1.extent(1); ++i) {
+                    EXPECT_NEAR(bb1(k,i), bb5(k,i), 1e-6 * std::abs(bb1(k,i)));
+                }
+            }
+        }
+    }
+
+    // ================== Lazy loading of BvA3 (fname3) and BvA5 (fname5)
+    {
+        linear::LazyPool pool(xvalues.size() * 16 + 1);    // Room for one
+        linear::Weighted_Lazy lazy3(fname3, "BvA", &pool);
+        linear::Weighted_Lazy lazy5(fname5, "BvA", &pool);
+        EXPECT_FALSE(lazy3.loaded());
+        EXPECT_EQ(linear::LinearType::COMPRESSED, lazy3.type.index());
+        EXPECT_EQ(linear::LinearType::COMPRESSED_FLOAT, lazy5.type.index());
+        EXPECT_EQ(BvA1p->conservative, lazy3.conservative);
+
+        // Shape and size come from the header
+        EXPECT_EQ(shape1, lazy3.shape());
+        EXPECT_EQ(BvA1p->nnz(), lazy3.nnz());
+        EXPECT_FALSE(lazy3.loaded());
+        EXPECT_EQ(0, lazy3.memory_footprint().bytes);
+
+        int const nk = 2;
+        blitz::Array<double,2> aa(nk,shape1[1]);
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<aa.extent(1); ++i) aa(k,i) = 32*i*i - 17 + k;
+        blitz::Array<double,2> bb1(nk,shape1[0]);
+        blitz::Array<double,2> bb3(nk,shape1[0]);
+        bb1 = -17;
+        bb3 = -17;
+        BvA1p->apply_M(aa, bb1);
+
+        lazy3.apply_M(aa, bb3);
+        EXPECT_TRUE(lazy3.loaded());
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<bb1.extent(1); ++i) EXPECT_DOUBLE_EQ(bb1(k,i), bb3(k,i));
+
+        // Loading lazy5 pushes lazy3 out of the pool
+        blitz::Array<double,2> bb5(nk,shape1[0]);
+        bb5 = -17;
+        lazy5.apply_M_rows(aa, bb5, 0, shape1[0]);
+        EXPECT_TRUE(lazy5.loaded());
+        EXPECT_FALSE(lazy3.loaded());
+        EXPECT_GE(pool.budget(), pool.resident());
+
+        // ...and it is re-read on demand
+        bb3 = -17;
+        lazy3.apply_M(aa, bb3);
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<bb1.extent(1); ++i) EXPECT_DOUBLE_EQ(bb1(k,i), bb3(k,i));
+        EXPECT_FALSE(lazy5.loaded());
     }
 
     // NOT TESTED:
@@ -356,11 +544,1222 @@ TEST_F(LinearTest, tuple_list)
 
 }
 
+TEST_F(LinearTest, tuple_to_eigen)
+{
+    linear::Weighted_Tuple BvA;
+    BvA.set_shape({17,34});
+    BvA.M.add({3,6}, 3.0);
+    BvA.M.add({1,2}, 1.0);
+    BvA.M.add({3,6}, 0.5);    // Duplicate: summed
+    BvA.M.add({2,4}, 2.0);
+    BvA.wM.add({1}, 1.0);
+    BvA.wM.add({2}, 2.0);
+    BvA.wM.add({3}, 3.5);
+    BvA.Mw.add({2}, 1.0);
+    BvA.Mw.add({4}, 2.0);
+    BvA.Mw.add({6}, 3.5);
+
+    auto eigen(to_eigen(BvA));
+    auto &dims(eigen->dims);
+    EXPECT_EQ(17, dims[0]->sparse_extent());
+    EXPECT_EQ(3, dims[0]->dense_extent());
+    EXPECT_EQ(3, dims[1]->dense_extent());
+    EXPECT_EQ(3, eigen->M->nonZeros());
+    EXPECT_EQ(3.5, eigen->M->coeff(dims[0]->to_dense(3), dims[1]->to_dense(6)));
+    EXPECT_EQ(1.0, eigen->M->coeff(dims[0]->to_dense(1), dims[1]->to_dense(2)));
+    EXPECT_EQ(3.5, eigen->wM(dims[0]->to_dense(3)));
+    EXPECT_EQ(1.0, eigen->Mw(dims[1]->to_dense(2)));
+
+    // Round trip
+    auto BvA2(to_tuple(*eigen));
+    consolidate(BvA2.M);
+    consolidate(BvA.M);
+    ASSERT_EQ(BvA.M.size(), BvA2.M.size());
+    for (size_t i=0; i<BvA.M.size(); ++i)
+        EXPECT_TRUE(BvA.M.tuples[i] == BvA2.M.tuples[i]);
+}
+
+TEST_F(LinearTest, compose)
+{
+    // BvA (4x6) and AvC (6x5), non-conservative
+    linear::Weighted_Tuple BvA(false), AvC(true);
+    BvA.set_shape({4,6});
+    AvC.set_shape({6,5});
+    double dBvA[4][6] = {{1,2,0,0,0,0}, {0,0,3,0,0,1}, {0,0,0,0,0,0}, {.5,0,0,0,4,0}};
+    double dAvC[6][5] = {{1,0,0,2,0}, {0,1,0,0,0}, {0,0,1,1,0}, {0,0,0,0,7}, {0,0,0,0,0}, {3,0,0,0,0}};
+    for (int i=0; i<4; ++i) for (int j=0; j<6; ++j)
+        if (dBvA[i][j] != 0) BvA.M.add({i,j}, dBvA[i][j]);
+    for (int i=0; i<6; ++i) for (int j=0; j<5; ++j)
+        if (dAvC[i][j] != 0) AvC.M.add({i,j}, dAvC[i][j]);
+    for (int i=0; i<4; ++i) BvA.wM.add({i}, 1.+i);
+    for (int j=0; j<5; ++j) AvC.Mw.add({j}, 10.+j);
+
+    auto BvA_e(to_eigen(BvA));
+    auto AvC_e(to_eigen(AvC));
+
+    for (int nthreads : {1, 3}) {
+        auto BvC(linear::compose(*BvA_e, *AvC_e, nthreads));
+        EXPECT_FALSE(BvC->conservative);
+        EXPECT_EQ(4, BvC->shape()[0]);
+        EXPECT_EQ(5, BvC->shape()[1]);
+
+        blitz::Array<int,1> ii, jj;
+        blitz::Array<double,1> vv;
+        BvC->to_coo(ii, jj, vv);
+        double dBvC[4][5] = {};
+        for (int n=0; n<vv.extent(0); ++n) dBvC[ii(n)][jj(n)] += vv(n);
+        for (int i=0; i<4; ++i) for (int j=0; j<5; ++j) {
+            double sum = 0;
+            for (int k=0; k<6; ++k) sum += dBvA[i][k] * dAvC[k][j];
+            EXPECT_DOUBLE_EQ(sum, dBvC[i][j]);
+        }
+
+        // Weights come from the outer operands
+        blitz::Array<double,1> wB, wC;
+        BvC->get_weights(0, wB);
+        BvC->get_weights(1, wC);
+        for (int i=0; i<4; ++i) EXPECT_EQ(1.+i, wB(i));
+        for (int j=0; j<5; ++j) EXPECT_EQ(10.+j, wC(j));
+    }
+
+    // Cache
+    linear::ComposeCache cache;
+    auto BvC1(cache.get(*BvA_e, *AvC_e));
+    auto BvC2(cache.get(*BvA_e, *AvC_e));
+    EXPECT_EQ(BvC1.get(), BvC2.get());
+    EXPECT_EQ(1, cache.size());
+
+    // A changed operand is a new key
+    AvC_e->changed();
+    auto BvC3(cache.get(*BvA_e, *AvC_e));
+    EXPECT_NE(BvC1.get(), BvC3.get());
+    EXPECT_EQ(2, cache.size());
+
+    cache.invalidate(AvC_e.get());
+    EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(LinearTest, apply_M_inplace)
+{
+    // Square, non-conservative smoothing-like matrix; row 3 inactive
+    int const n = 8;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({n,n});
+    for (int i=0; i<n; ++i) {
+        if (i == 3) continue;
+        for (int j=std::max(0,i-1); j<=std::min(n-1,i+1); ++j) BvA.M.add({i,j}, .25*(1+i+j));
+        BvA.wM.add({i}, 1.+.1*i);
+    }
+    for (int j=0; j<n; ++j) BvA.Mw.add({j}, 1.+.05*j);
+    linear::Weighted_Compressed BvAc(compress(*to_eigen(BvA)));
+
+    for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+        int const nk = 3;
+        blitz::Array<double,2> aa(nk,n);
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<n; ++i) aa(k,i) = 3*i*i - 2 + k;
+
+        // Reference: out-of-place
+        blitz::Array<double,2> bb(nk,n);
+        bb = aa;
+        BvAc.apply_M(aa, bb, linear::AccumType::REPLACE, force_conservation);
+
+        for (int cached=0; cached<2; ++cached)
+        for (int nthreads=1; nthreads<=3; nthreads+=2) {
+            BvAc.set_cache_budget(cached ? 1L<<20 : 0);
+            BvAc.nthreads = nthreads;
+            BvA.nthreads = nthreads;
+            blitz::Array<double,2> cc(nk,n);
+            cc = aa;
+            BvAc.apply_M_inplace(cc, linear::AccumType::REPLACE, force_conservation);
+
+            blitz::Array<double,2> tt(nk,n);
+            tt = aa;
+            BvA.apply_M_inplace(tt, linear::AccumType::REPLACE, force_conservation);
+
+            for (int k=0; k<nk; ++k)
+            for (int i=0; i<n; ++i) {
+                EXPECT_NEAR(bb(k,i), cc(k,i), 1e-12 * std::abs(bb(k,i)));
+                EXPECT_NEAR(bb(k,i), tt(k,i), 1e-12 * std::abs(bb(k,i)));
+            }
+            EXPECT_EQ(aa(0,3), cc(0,3));    // Not in the active space
+        }
+    }
+}
+
+TEST_F(LinearTest, active_rows)
+{
+    // Rows 3 and 6 inactive
+    int const n = 8;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({n,n});
+    for (int i=0; i<n; ++i) {
+        if (i == 3 || i == 6) continue;
+        for (int j=std::max(0,i-1); j<=std::min(n-1,i+1); ++j) BvA.M.add({i,j}, .25*(1+i+j));
+        BvA.wM.add({i}, 1.+.1*i);
+    }
+    for (int j=0; j<n; ++j) BvA.Mw.add({j}, 1.+.05*j);
+    linear::Weighted_Compressed BvAc(compress(*to_eigen(BvA)));
+
+    std::vector<int> const xactive {0,1,2,4,5,7};
+    EXPECT_EQ(xactive, BvA.active_rows());
+    EXPECT_EQ(xactive, BvAc.active_rows());
+
+    // Safe to build from several threads at once
+    BvAc.clear_active();
+    std::vector<std::vector<int>> got(4);
+    {std::vector<std::thread> threads;
+        for (size_t t=0; t<got.size(); ++t)
+            threads.emplace_back([&BvAc, &got, t]() { got[t] = BvAc.active_rows(); });
+        for (auto &th : threads) th.join();
+    }
+    for (auto const &g : got) EXPECT_EQ(xactive, g);
+
+    // Persisted by ncio
+    std::string fname("__active_rows.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+    {NcIO ncio(fname, 'w');
+        BvAc.ncio(ncio, "BvA");
+    }
+    linear::Weighted_Compressed BvAc2;
+    {NcIO ncio(fname, 'r');
+        BvAc2.ncio(ncio, "BvA");
+        EXPECT_FALSE(ncio.getVar("BvA.active").isNull());
+    }
+    EXPECT_EQ(xactive, BvAc2.active_rows());
+
+    // REPLACE leaves inactive rows alone
+    blitz::Array<double,2> aa(1,n), bb(1,n);
+    for (int i=0; i<n; ++i) aa(0,i) = i+1;
+    bb = -17;
+    BvAc2.apply_M(aa, bb, linear::AccumType::REPLACE, true);
+    EXPECT_EQ(-17., bb(0,3));
+    EXPECT_EQ(-17., bb(0,6));
+    EXPECT_NE(-17., bb(0,4));
+}
+
+TEST_F(LinearTest, apply_M_rows)
+{
+    int const nB = 40, nA = 30;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int i=0; i<nB; ++i) {
+        if (i % 7 == 3) continue;
+        for (int j=0; j<nA; ++j) if ((i+2*j) % 5 == 0) BvA.M.add({i,j}, .5 + .01*i*j);
+        BvA.wM.add({i}, 1.+.1*i);
+    }
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 1.+.05*j);
+    auto BvA_e(to_eigen(BvA));
+
+    // Two threads encode 8 pieces of 5 rows each
+    linear::Weighted_Compressed BvAc(compress(*BvA_e, 2, true));
+    EXPECT_TRUE(BvAc.M.blocks_indexed());
+    EXPECT_EQ(8, BvAc.M.nblocks());
+    EXPECT_EQ((std::vector<long>{2,3}), BvAc.M.blocks_for_rows(10, 20));
+
+    int const nk = 2;
+    blitz::Array<double,2> aa(nk,nA);
+    for (int k=0; k<nk; ++k)
+    for (int j=0; j<nA; ++j) aa(k,j) = j*j - 3 + k;
+
+    blitz::Array<double,2> full(nk,nB);
+    full = -17;
+    BvAc.apply_M(aa, full, linear::AccumType::REPLACE, false);
+
+    for (auto const &range : std::vector<std::array<long,2>>{{0,nB}, {10,20}, {17,18}, {5,5}}) {
+        for (int cached=0; cached<2; ++cached) {
+            BvAc.set_cache_budget(cached ? 1L<<20 : 0);
+            for (linear::Weighted const *W : {(linear::Weighted const *)&BvAc, (linear::Weighted const *)&BvA}) {
+                blitz::Array<double,2> part(nk,nB);
+                part = -17;
+                W->apply_M_rows(aa, part, range[0], range[1]);
+                for (int k=0; k<nk; ++k)
+                for (int i=0; i<nB; ++i) {
+                    if (i >= range[0] && i < range[1]) {
+                        EXPECT_NEAR(full(k,i), part(k,i), 1e-12 * (1+std::abs(full(k,i))));
+                    } else {
+                        EXPECT_EQ(-17., part(k,i));
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_F(LinearTest, family)
+{
+    // Three non-conservative matrices with one pattern; the last one
+    // lacks an element, which is stored as zero.
+    int const nB = 12, nA = 9, nmem = 3;
+    std::vector<std::unique_ptr<linear::Weighted_Tuple>> Ws;
+    linear::Weighted_Family fam;
+    for (int m=0; m<nmem; ++m) {
+        Ws.push_back(std::unique_ptr<linear::Weighted_Tuple>(new linear::Weighted_Tuple(false)));
+        auto &W(*Ws.back());
+        W.set_shape({nB,nA});
+        for (int i=0; i<nB; ++i) {
+            if (i == 4) continue;
+            for (int j=0; j<nA; ++j) {
+                if ((i+j) % 3 != 0 || (m == 2 && i == 0 && j == 0)) continue;
+                W.M.add({i,j}, 1. + .1*i - .05*j + .3*m);
+            }
+            W.wM.add({i}, 1. + .01*i*m);
+        }
+        for (int j=0; j<nA; ++j) W.Mw.add({j}, 2. - .1*j + .2*m);
+        EXPECT_EQ(m, fam.add(W));
+    }
+    EXPECT_EQ(nmem, fam.size());
+    EXPECT_EQ(Ws[0]->nnz(), fam.nnz());
+
+    int const nk = 2;
+    blitz::Array<double,2> aa(nk,nA);
+    for (int k=0; k<nk; ++k)
+    for (int j=0; j<nA; ++j) aa(k,j) = j*j + 3*k - 1;
+
+    auto expect_near = [&](blitz::Array<double,2> const &x, blitz::Array<double,2> const &y) {
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<nB; ++i) EXPECT_NEAR(x(k,i), y(k,i), 1e-12 * (1+std::abs(x(k,i))));
+    };
+
+    for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+        // One at a time, and all at once
+        std::vector<blitz::Array<double,2>> outs;
+        for (int m=0; m<nmem; ++m) {
+            outs.push_back(blitz::Array<double,2>(nk,nB));
+            outs.back() = -17;
+        }
+        fam.apply_M({0,1,2}, aa, outs, linear::AccumType::REPLACE, force_conservation);
+        for (int m=0; m<nmem; ++m) {
+            blitz::Array<double,2> bb_w(nk,nB), bb_f(nk,nB);
+            bb_w = -17;
+            bb_f = -17;
+            Ws[m]->apply_M(aa, bb_w, linear::AccumType::REPLACE, force_conservation);
+            fam.apply_M(m, aa, bb_f, linear::AccumType::REPLACE, force_conservation);
+            expect_near(bb_w, bb_f);
+            expect_near(bb_w, outs[m]);
+            EXPECT_EQ(-17., bb_f(0,4));
+        }
+
+        // Weighted combination
+        std::vector<double> const coeffs {.5, .25, -1.};
+        linear::Weighted_Tuple Wc(false);
+        Wc.set_shape({nB,nA});
+        for (int m=0; m<nmem; ++m) {
+            for (auto ii=Ws[m]->M.begin(); ii != Ws[m]->M.end(); ++ii) Wc.M.add(ii->index(), coeffs[m]*ii->value());
+            for (auto ii=Ws[m]->wM.begin(); ii != Ws[m]->wM.end(); ++ii) Wc.wM.add(ii->index(), coeffs[m]*ii->value());
+            for (auto ii=Ws[m]->Mw.begin(); ii != Ws[m]->Mw.end(); ++ii) Wc.Mw.add(ii->index(), coeffs[m]*ii->value());
+        }
+        blitz::Array<double,2> bb_w(nk,nB), bb_f(nk,nB);
+        Wc.apply_M(aa, bb_w, linear::AccumType::REPLACE, force_conservation);
+        fam.apply_M(coeffs, aa, bb_f, linear::AccumType::REPLACE, force_conservation);
+        expect_near(bb_w, bb_f);
+    }
+
+    // Pattern mismatch
+    linear::Weighted_Tuple Wx(false);
+    Wx.set_shape({nB,nA});
+    Wx.M.add({1,1}, 1.);
+    EXPECT_THROW(fam.add(Wx), ibmisc::Exception);
+
+    // NetCDF round trip
+    std::string fname("__family.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+    {NcIO ncio(fname, 'w');
+        fam.ncio(ncio, "fam");
+    }
+    linear::Weighted_Family fam2;
+    {NcIO ncio(fname, 'r');
+        fam2.ncio(ncio, "fam");
+    }
+    EXPECT_EQ(fam.size(), fam2.size());
+    blitz::Array<double,2> bb1(nk,nB), bb2(nk,nB);
+    fam.apply_M(1, aa, bb1);
+    fam2.apply_M(1, aa, bb2);
+    expect_near(bb1, bb2);
+}
+
+TEST_F(LinearTest, permute_dense)
+{
+    int const nB = 15, nA = 11;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int i=0; i<nB; ++i) {
+        if (i == 6) continue;
+        for (int j=0; j<nA; ++j) if ((5*i+j) % 4 == 0) BvA.M.add({i,j}, 1. + .1*i + .01*j);
+        BvA.wM.add({i}, 1.+.1*i);
+    }
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 1.+.05*j);
+    auto BvA_e(to_eigen(BvA));
+
+    int const nk = 2;
+    blitz::Array<double,2> aa(nk,nA);
+    for (int k=0; k<nk; ++k)
+    for (int j=0; j<nA; ++j) aa(k,j) = j*j - 4 + k;
+    blitz::Array<double,2> bb0(nk,nB);
+    bb0 = -17;
+    BvA_e->apply_M(aa, bb0);
+
+    // Renumber rows by RCM, then columns by first touch; results (in
+    // sparse indexing) must not change.
+    std::vector<linear::Weighted_Eigen *> const Ws {BvA_e.get()};
+    linear::permute_dense(*BvA_e->dims[0], linear::rcm_order(*BvA_e, 0), Ws);
+    linear::permute_dense(*BvA_e->dims[1], linear::first_touch_order(*BvA_e, 1), Ws);
+
+    blitz::Array<double,2> bb1(nk,nB);
+    bb1 = -17;
+    BvA_e->apply_M(aa, bb1);
+    for (int k=0; k<nk; ++k)
+    for (int i=0; i<nB; ++i) EXPECT_NEAR(bb0(k,i), bb1(k,i), 1e-12 * (1+std::abs(bb0(k,i))));
+
+    // First-touch order: columns' first rows are non-decreasing
+    auto const &M(*BvA_e->M);
+    int last = -1;
+    for (int j=0; j<M.outerSize(); ++j) {
+        Eigen::SparseMatrix<double,0,int>::InnerIterator ii(M,j);
+        if (!ii) continue;
+        EXPECT_LE(last, ii.row());
+        last = ii.row();
+    }
+}
+
+TEST_F(LinearTest, apply_MT)
+{
+    int const nB = 6, nA = 9;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    double dM[nB][nA] = {};
+    for (int i=0; i<nB; ++i) {
+        if (i == 2) continue;    // Nullspace
+        for (int j=i; j<nA; j += 3) {
+            dM[i][j] = .5 + .25*i - .125*j;
+            BvA.M.add({i,j}, dM[i][j]);
+        }
+        BvA.wM.add({i}, 1.);
+    }
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 2.);
+
+    auto BvA_e(to_eigen(BvA));
+    linear::Weighted_Compressed BvA_c(compress(*BvA_e));
+    linear::Weighted_RL BvA_r(to_runlength(*BvA_e));
+    std::vector<linear::Weighted *> Ws {BvA_e.get(), &BvA_c, &BvA_r, &BvA};
+
+    for (int nk : {1, 4}) {
+        blitz::Array<double,2> bb(nk,nB);
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<nB; ++i) bb(k,i) = 1 + i*i + 10*k;
+
+        for (auto W : Ws) {
+        for (int cached=0; cached<2; ++cached) {
+        for (int nthreads : {1, 3}) {
+            BvA_c.set_cache_budget(cached ? 1L<<20 : 0);
+            W->nthreads = nthreads;
+            blitz::Array<double,2> aa(nk,nA);
+            aa = -17;
+            W->apply_MT(bb, aa);
+            for (int k=0; k<nk; ++k)
+            for (int j=0; j<nA; ++j) {
+                double sum = 0;
+                for (int i=0; i<nB; ++i) sum += dM[i][j] * bb(k,i);
+                EXPECT_NEAR(sum, aa(k,j), 1e-12 * (1+std::abs(sum)));
+            }
+            W->nthreads = 1;
+        }}}
+    }
+}
+
+TEST_F(LinearTest, apply_patch)
+{
+    int const nB = 20, nA = 30;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    double dM[nB][nA] = {};
+    double wM[nB] = {};
+    double Mw[nA] = {};
+    for (int i=0; i<nB; ++i) {
+        if (i % 7 == 6) continue;    // Nullspace
+        for (int n=0; n<3; ++n) {
+            int const j = (2*i + 11*n) % nA;
+            dM[i][j] += .5 + .25*i - .125*n;
+            BvA.M.add({i,j}, .5 + .25*i - .125*n);
+        }
+        wM[i] = 1. + .1*i;
+        BvA.wM.add({i}, wM[i]);
+    }
+    for (int j=0; j<nA; ++j) {
+        Mw[j] = 2.;
+        BvA.Mw.add({j}, Mw[j]);
+    }
+
+    auto BvA_e(to_eigen(BvA));
+    linear::Weighted_Compressed BvA_c(compress(*BvA_e));
+    // Same, but encoded in small blocks
+    linear::Weighted_Compressed BvA_b(compress(*BvA_e));
+    {
+        ZArray<int,double,2> Mb(BvA_b.M.shape());
+        {
+            auto accum(Mb.accum(8));
+            for (auto ii(BvA_b.M.generator()); ++ii; ) accum.add(ii->index(), ii->value());
+        }
+        BvA_b.M = std::move(Mb);
+    }
+    BvA_b.nthreads = 3;
+    EXPECT_TRUE(BvA_b.M.framed());
+    EXPECT_LT(1, BvA_b.M.nblocks());
+    std::vector<linear::Weighted *> Ws {BvA_e.get(), &BvA_c, &BvA_b};
+
+    auto expect_same = [&](linear::Weighted const &W) {
+        blitz::Array<int,1> ii, jj;
+        blitz::Array<double,1> vv;
+        W.to_coo(ii, jj, vv);
+        double M2[nB][nA] = {};
+        for (int n=0; n<vv.extent(0); ++n) M2[ii(n)][jj(n)] += vv(n);
+        for (int i=0; i<nB; ++i)
+        for (int j=0; j<nA; ++j) EXPECT_NEAR(dM[i][j], M2[i][j], 1e-14);
+
+        blitz::Array<double,1> wB, wA;
+        W.get_weights(0, wB);
+        W.get_weights(1, wA);
+        for (int i=0; i<nB; ++i) EXPECT_DOUBLE_EQ(wM[i], wB(i));
+        for (int j=0; j<nA; ++j) EXPECT_DOUBLE_EQ(Mw[j], wA(j));
+    };
+
+    // Applies patch to the reference, and the matrices under test
+    auto apply = [&](linear::WeightedPatch &patch) {
+        for (long const i : patch.rows) {
+            for (int j=0; j<nA; ++j) dM[i][j] = 0;
+            wM[i] = 0;
+        }
+        for (long const j : patch.cols) {
+            for (int i=0; i<nB; ++i) dM[i][j] = 0;
+            Mw[j] = 0;
+        }
+        for (auto ii=patch.M.begin(); ii != patch.M.end(); ++ii)
+            dM[ii->index(0)][ii->index(1)] += ii->value();
+        for (auto ii=patch.wM.begin(); ii != patch.wM.end(); ++ii)
+            wM[ii->index(0)] += ii->value();
+        for (auto ii=patch.Mw.begin(); ii != patch.Mw.end(); ++ii)
+            Mw[ii->index(0)] += ii->value();
+
+        for (auto W : Ws) {
+            W->apply_patch(patch);
+            expect_same(*W);
+        }
+    };
+
+    // Rows 4 and 6 (from the nullspace) and column 2 change
+    linear::WeightedPatch p1;
+    p1.rows = {4, 6};
+    p1.cols = {2};
+    for (int i : {4, 6}) {
+        for (int j : {1, 2, 17}) p1.M.add({i,j}, .1*i + .01*j);
+        p1.wM.add({i}, 3. + i);
+    }
+    for (int i : {0, 10}) p1.M.add({i,2}, 7.);
+    p1.Mw.add({2}, 3.5);
+    apply(p1);
+
+    // BvA_c is now in blocks too; patch the end of the matrix
+    EXPECT_TRUE(BvA_c.M.framed());
+    linear::WeightedPatch p2;
+    p2.rows = {19};
+    p2.cols = {25, 29};
+    p2.M.add({19,0}, 1.5);
+    p2.M.add({3,29}, -2.);
+    p2.Mw.add({25}, 1.);
+    apply(p2);
+
+    // Bad patch: entry in an unchanged row and column
+    linear::WeightedPatch p3;
+    p3.rows = {1};
+    p3.M.add({2,2}, 1.);
+    for (auto W : Ws) EXPECT_THROW(W->apply_patch(p3), ibmisc::Exception);
+}
+
+static long progress_done, progress_total;
+static void record_progress(char const *what, long done, long total)
+{
+    progress_done = done;
+    progress_total = total;
+}
+
+TEST_F(LinearTest, parallel_conversions)
+{
+    int const nB = 50, nA = 70;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int n=0; n<1000; ++n) {
+        // Unsorted, with duplicates
+        BvA.M.add({(n*37) % nB, (n*11 + n/7) % nA}, .5 + .001*n);
+    }
+    for (int i=0; i<nB; ++i) BvA.wM.add({i}, 1. + .1*i);
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 2.);
+
+    auto BvA_e(to_eigen(BvA));
+    linear::Weighted_Tuple BvA_t(to_tuple(*BvA_e));
+    linear::Weighted_Compressed BvA_c(compress(*BvA_e));
+
+    int const nk = 2;
+    blitz::Array<double,2> aa(nk,nA);
+    for (int k=0; k<nk; ++k)
+    for (int j=0; j<nA; ++j) aa(k,j) = 3*j - 2 + k;
+    blitz::Array<double,2> bb(nk,nB);
+    BvA_c.apply_M(aa, bb);
+
+    ibmisc_progress = &record_progress;
+    for (int nthreads : {2, 5}) {
+        progress_done = progress_total = -1;
+        auto BvA_e2(to_eigen(BvA, nthreads));
+        EXPECT_EQ(progress_total, progress_done);
+        Eigen::MatrixXd diff(Eigen::MatrixXd(*BvA_e->M) - Eigen::MatrixXd(*BvA_e2->M));
+        EXPECT_EQ(0., diff.cwiseAbs().maxCoeff());
+        EXPECT_EQ(BvA_e->M->nonZeros(), BvA_e2->M->nonZeros());
+
+        // Same tuples, in the same order
+        linear::Weighted_Tuple BvA_t2(to_tuple(*BvA_e, nthreads));
+        ASSERT_EQ(BvA_t.M.tuples.size(), BvA_t2.M.tuples.size());
+        for (size_t n=0; n<BvA_t.M.tuples.size(); ++n)
+            EXPECT_TRUE(BvA_t.M.tuples[n] == BvA_t2.M.tuples[n]);
+        EXPECT_EQ(BvA_t.M.shape(), BvA_t2.M.shape());
+
+        progress_done = progress_total = -1;
+        linear::Weighted_Compressed BvA_c2(compress(*BvA_e, nthreads));
+        EXPECT_EQ(progress_total, progress_done);
+        EXPECT_TRUE(BvA_c2.M.framed());
+        EXPECT_LT(1, BvA_c2.M.nblocks());
+        EXPECT_EQ(BvA_c.M.nnz(), BvA_c2.M.nnz());
+        EXPECT_EQ(BvA_c.shape(), BvA_c2.shape());
+        blitz::Array<double,2> bb2(nk,nB);
+        BvA_c2.apply_M(aa, bb2);
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<nB; ++i) EXPECT_EQ(bb(k,i), bb2(k,i));
+    }
+    ibmisc_progress = 0;
+}
+
+TEST_F(LinearTest, compressed_builder)
+{
+    int const nB = 50, nA = 70;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    std::vector<double> wM(nB, 0.), Mw(nA, 0.);
+    for (int i=0; i<nB; i += 2) {
+    for (int j=i%3; j<nA; j += 3) {
+        double const val = .5 + .01*i + .001*j;
+        BvA.M.add({i,j}, val);
+        wM[i] += val;
+        Mw[j] += val;
+    }}
+    for (int i=0; i<nB; ++i) if (wM[i] != 0) BvA.wM.add({i}, wM[i]);
+    for (int j=0; j<nA; ++j) if (Mw[j] != 0) BvA.Mw.add({j}, Mw[j]);
+    linear::Weighted_Compressed BvA_c(compress(*to_eigen(BvA)));
+
+    int const nk = 2;
+    blitz::Array<double,2> aa(nk,nA);
+    for (int k=0; k<nk; ++k)
+    for (int j=0; j<nA; ++j) aa(k,j) = 3*j - 2 + k;
+    blitz::Array<double,2> bb(nk,nB);
+    BvA_c.apply_M(aa, bb);
+
+    for (bool by_rows : {false, true}) {
+        // Sorted output, each element split in two
+        linear::CompressedBuilder<> builder({nB,nA}, by_rows, 1, false);
+        {auto accum(builder.accum());
+            for (auto const &tp : BvA.M.tuples) {
+                std::array<int,2> const ix {{(int)tp.index(0), (int)tp.index(1)}};
+                accum.add(ix, .25*tp.value());
+                accum.add(ix, .75*tp.value());
+            }
+        }
+        linear::Weighted_Compressed BvA_b(builder.finish());
+        EXPECT_EQ(BvA_c.M.nnz(), BvA_b.M.nnz());
+        EXPECT_EQ(BvA_c.shape(), BvA_b.shape());
+        EXPECT_EQ(by_rows, BvA_b.M.blocks_indexed());
+        EXPECT_FALSE(BvA_b.conservative);
+
+        for (int d=0; d<2; ++d) {
+            auto ii(BvA_c.weights[d].generator());
+            auto jj(BvA_b.weights[d].generator());
+            for (; ++ii; ) {
+                ASSERT_TRUE(++jj);
+                EXPECT_EQ(ii->index(0), jj->index(0));
+                EXPECT_NEAR(ii->value(), jj->value(), 1e-12);
+            }
+            EXPECT_FALSE(++jj);
+        }
+
+        blitz::Array<double,2> bb2(nk,nB);
+        BvA_b.apply_M(aa, bb2);
+        for (int k=0; k<nk; ++k)
+        for (int i=0; i<nB; ++i) EXPECT_NEAR(bb(k,i), bb2(k,i), 1e-10);
+    }
+
+    // Weights given explicitly
+    linear::CompressedBuilder<float> builder({nB,nA});
+    builder.add({3,4}, 2.);
+    builder.add_weight(0, 3, 10.);
+    linear::Weighted_Compressed_Float BvA_f(builder.finish());
+    EXPECT_EQ(1, BvA_f.M.nnz());
+    auto ii(BvA_f.weights[0].generator());
+    ASSERT_TRUE(++ii);
+    EXPECT_EQ(10., ii->value());
+    auto jj(BvA_f.weights[1].generator());
+    ASSERT_TRUE(++jj);
+    EXPECT_EQ(4, jj->index(0));
+    EXPECT_EQ(2., jj->value());
+
+    // by_rows needs row order
+    linear::CompressedBuilder<> unsorted({nB,nA}, true);
+    unsorted.add({5,1}, 1.);
+    unsorted.add({4,1}, 1.);
+    EXPECT_THROW(unsorted.finish(), ibmisc::Exception);
+}
+
+TEST_F(LinearTest, sell)
+{
+    // Rows of varying length, spanning several slices and windows
+    int const nB = 29, nA = 40;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int i=0; i<nB; ++i) {
+        if (i % 7 == 3) continue;    // Nullspace
+        int const len = (i == 10 ? 0 : 1 + (i*5) % 11);    // Row 10 is active but empty
+        for (int n=0; n<len; ++n) {
+            BvA.M.add({i, (3*i + 7*n) % nA}, .5 + .25*i - .125*n);
+        }
+        BvA.wM.add({i}, 1. + .1*i);
+    }
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 2.);
+    auto BvA_e(to_eigen(BvA));
+
+    for (int sigma : {1, 8, 20, 256}) {
+        linear::Weighted_SELL BvA_s(linear::to_sell(*BvA_e, sigma));
+        EXPECT_EQ(BvA_e->nnz(), BvA_s.nnz());
+        EXPECT_EQ(BvA_e->shape(), BvA_s.shape());
+        EXPECT_EQ(0, BvA_s.slice_ptr[BvA_s.nslices()] % linear::Weighted_SELL::C);
+
+        for (int nk : {1, 5}) {
+            blitz::Array<double,2> aa(nk,nA);
+            for (int k=0; k<nk; ++k)
+            for (int j=0; j<nA; ++j) aa(k,j) = 32*j*j - 17 + k;
+            blitz::Array<double,2> bb(nk,nB);
+            for (int k=0; k<nk; ++k)
+            for (int i=0; i<nB; ++i) bb(k,i) = 1 + i*i + 10*k;
+
+            for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+            for (int nthreads : {1, 3}) {
+                BvA_s.nthreads = nthreads;
+                blitz::Array<double,2> bb_e(nk,nB), bb_s(nk,nB);
+                bb_e = -17;
+                bb_s = -17;
+                BvA_e->apply_M(aa, bb_e, linear::AccumType::REPLACE, force_conservation);
+                BvA_s.apply_M(aa, bb_s, linear::AccumType::REPLACE, force_conservation);
+                for (int k=0; k<nk; ++k)
+                for (int i=0; i<nB; ++i) {
+                    EXPECT_NEAR(bb_e(k,i), bb_s(k,i), 1e-12 * (1+std::abs(bb_e(k,i))));
+                }
+
+                blitz::Array<double,2> aa_e(nk,nA), aa_s(nk,nA);
+                aa_e = -17;
+                aa_s = -17;
+                BvA_e->apply_MT(bb, aa_e);
+                BvA_s.apply_MT(bb, aa_s);
+                for (int k=0; k<nk; ++k)
+                for (int j=0; j<nA; ++j) {
+                    EXPECT_NEAR(aa_e(k,j), aa_s(k,j), 1e-12 * (1+std::abs(aa_e(k,j))));
+                }
+            }}
+        }
+    }
+
+    // ---------- Round trip through NetCDF, and back to Eigen
+    linear::Weighted_SELL BvA_s(linear::to_sell(*BvA_e, 16));
+    std::string fname("__linear_sell.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+    {NcIO ncio(fname, 'w');
+        BvA_s.ncio(ncio, "BvA");
+    }
+    auto BvA_r(linear::new_weighted(linear::LinearType::SELL));
+    {NcIO ncio(fname, 'r');
+        BvA_r->ncio(ncio, "BvA");
+    }
+    EXPECT_EQ(BvA_e->conservative, BvA_r->conservative);
+    EXPECT_EQ(BvA_e->shape(), BvA_r->shape());
+
+    auto BvA_e2(to_eigen(to_tuple(dynamic_cast<linear::Weighted_SELL &>(*BvA_r))));
+    blitz::Array<int,1> i1, j1, i2, j2;
+    blitz::Array<double,1> v1, v2;
+    BvA_e->to_coo(i1, j1, v1);
+    BvA_e2->to_coo(i2, j2, v2);
+    ASSERT_EQ(v1.extent(0), v2.extent(0));
+    for (int n=0; n<v1.extent(0); ++n) {
+        EXPECT_EQ(i1(n), i2(n));
+        EXPECT_EQ(j1(n), j2(n));
+        EXPECT_EQ(v1(n), v2(n));
+    }
+}
+
+
+TEST_F(LinearTest, tuple_apply)
+{
+    // Added column-first, with a duplicate, so consolidate() has work
+    int const nB = 13, nA = 17;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int j=0; j<nA; ++j) {
+        for (int i=0; i<nB; ++i) {
+            if (i % 5 == 2 || (i+j) % 3 != 0) continue;
+            BvA.M.add({i,j}, .5 + .25*i - .125*j);
+        }
+    }
+    BvA.M.add({0,0}, 1.);
+    for (int i=0; i<nB; ++i) if (i % 5 != 2) BvA.wM.add({i}, 1. + .1*i);
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 2. - .05*j);
+    auto BvA_e(to_eigen(BvA));
+
+    for (int sorted=0; sorted<2; ++sorted) {
+        if (sorted) BvA.consolidate();
+        EXPECT_EQ(sorted, BvA.rows_indexed());
+
+        for (int nk : {1, 4}) {
+            blitz::Array<double,2> aa(nk,nA);
+            for (int k=0; k<nk; ++k)
+            for (int j=0; j<nA; ++j) aa(k,j) = 32*j*j - 17 + k;
+
+            for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+            for (int nthreads : {1, 3}) {
+                BvA.nthreads = nthreads;
+                blitz::Array<double,2> bb_e(nk,nB), bb_t(nk,nB);
+                bb_e = -17;
+                bb_t = -17;
+                BvA_e->apply_M(aa, bb_e, linear::AccumType::REPLACE, force_conservation);
+                BvA.apply_M(aa, bb_t, linear::AccumType::REPLACE, force_conservation);
+                for (int k=0; k<nk; ++k)
+                for (int i=0; i<nB; ++i) {
+                    EXPECT_NEAR(bb_e(k,i), bb_t(k,i), 1e-12 * (1+std::abs(bb_e(k,i))));
+                }
+
+                blitz::Array<double,1> w_e(nk), w_t(nk);
+                BvA_e->apply_weight(1, aa, w_e);
+                BvA.apply_weight(1, aa, w_t);
+                for (int k=0; k<nk; ++k) EXPECT_NEAR(w_e(k), w_t(k), 1e-12 * std::abs(w_e(k)));
+            }}
+        }
+        BvA.nthreads = 1;
+    }
+
+    // to_coo() and get_weights()
+    blitz::Array<int,1> ii, jj;
+    blitz::Array<double,1> vv, wB;
+    BvA.to_coo(ii, jj, vv);
+    EXPECT_EQ(BvA.nnz(), vv.extent(0));
+    BvA.get_weights(0, wB);
+    EXPECT_EQ(0., wB(2));
+    EXPECT_DOUBLE_EQ(1.3, wB(3));
+}
+
+TEST_F(LinearTest, eigen_apply_workspace)
+{
+    // Dense row 2 has no weight: it must come out as fill
+    int const nB = 5, nA = 7, nvar = 3;
+    linear::Weighted_Tuple BvA_t(false);
+    BvA_t.set_shape({nB,nA});
+    for (int i=0; i<nB; ++i) {
+        for (int j=i; j<nA; j += 2) BvA_t.M.add({i,j}, .5 + .25*i - .125*j);
+        if (i != 2) BvA_t.wM.add({i}, 1. + .1*i);
+    }
+    for (int j=0; j<nA; ++j) BvA_t.Mw.add({j}, 2. + .05*j);
+    auto BvA(to_eigen(BvA_t));
+    int const nBd = BvA->M->rows(), nAd = BvA->M->cols();
+
+    blitz::Array<double,2> aa(nvar, nAd);
+    for (int n=0; n<nvar; ++n)
+    for (int j=0; j<nAd; ++j) aa(n,j) = 1 + j*j + 10*n;
+
+    double const fill = -99;
+    linear::Weighted_Eigen::ApplyWorkspace work;
+    blitz::Array<double,2> bb(nvar, nBd);
+    for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+    for (int rep=0; rep<2; ++rep) {    // Workspace is reused
+        bb = 17;
+        BvA->apply(aa, bb, fill, force_conservation, work);
+        auto const ref(BvA->apply_e(aa, fill, force_conservation));
+        for (int n=0; n<nvar; ++n)
+        for (int i=0; i<nBd; ++i) {
+            if (BvA->wM(i) == 0) EXPECT_EQ(fill, bb(n,i));
+            EXPECT_NEAR(ref(i,n), bb(n,i), 1e-12 * std::abs(ref(i,n)));
+        }
+    }}
+
+    // Conservation holds, and the workspace keeps the integrals
+    blitz::Array<double,1> wA(nvar), wB(nvar);
+    for (int n=0; n<nvar; ++n) {
+        wA(n) = 0; wB(n) = 0;
+        for (int j=0; j<nAd; ++j) wA(n) += BvA->Mw(j) * aa(n,j);
+        for (int i=0; i<nBd; ++i) if (BvA->wM(i) != 0) wB(n) += BvA->wM(i) * bb(n,i);
+        EXPECT_NEAR(wA(n), wB(n), 1e-12 * std::abs(wA(n)));
+        EXPECT_NEAR(wA(n), work.TA(n), 1e-12 * std::abs(wA(n)));
+    }
+}
+
+TEST_F(LinearTest, fortran)
+{
+    int const nB = 5, nA = 7, nvec = 3;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int i=0; i<nB; ++i) {
+        for (int j=i; j<nA; j += 2) BvA.M.add({i,j}, .5 + .25*i - .125*j);
+        BvA.wM.add({i}, 1.+.1*i);
+    }
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 1.+.05*j);
+    std::shared_ptr<linear::Weighted const> W(
+        new linear::Weighted_Compressed(compress(*to_eigen(BvA))));
+    int const handle = linear::fortran_register(W);
+
+    int nB_f, nA_f;
+    ibmisc_linear_shape(handle, &nB_f, &nA_f);
+    EXPECT_EQ(nB, nB_f);
+    EXPECT_EQ(nA, nA_f);
+
+    // Fortran arrays As(nA, nvec), out(nB, nvec), 1-based
+    blitz::Array<double,2> As_f(nA, nvec, blitz::fortranArray);
+    blitz::Array<double,2> out_f(nB, nvec, blitz::fortranArray);
+    blitz::Array<double,2> As(nvec, nA);
+    for (int k=0; k<nvec; ++k)
+    for (int j=0; j<nA; ++j) As(k,j) = As_f(j+1,k+1) = 3*j*j - 2 + k;
+
+    for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+        blitz::Array<double,2> out(nvec, nB);
+        W->apply_M(As, out, linear::AccumType::REPLACE, force_conservation);
+
+        F90Array<double,2> As_d(As_f), out_d(out_f);
+        ibmisc_linear_apply_m_2(handle, As_d, out_d,
+            linear::AccumType::REPLACE, force_conservation);
+        for (int k=0; k<nvec; ++k)
+        for (int i=0; i<nB; ++i)
+            EXPECT_NEAR(out(k,i), out_f(i+1,k+1), 1e-12 * std::abs(out(k,i)));
+
+        // Rank 1: a single column of the Fortran array
+        blitz::Array<double,1> a1(As_f(blitz::Range::all(), 2));
+        blitz::Array<double,1> o1(nB, blitz::fortranArray);
+        F90Array<double,1> a1_d(a1), o1_d(o1);
+        ibmisc_linear_apply_m_1(handle, a1_d, o1_d,
+            linear::AccumType::REPLACE, force_conservation);
+        for (int i=0; i<nB; ++i)
+            EXPECT_NEAR(out(1,i), o1(i+1), 1e-12 * std::abs(out(1,i)));
+    }
+
+    linear::fortran_unregister(handle);
+    EXPECT_THROW(ibmisc_linear_shape(handle, &nB_f, &nA_f), ibmisc::Exception);
+}
+
+TEST_F(LinearTest, overlap_grids)
+{
+    // A: 2x2 unit squares; B: 3x3 squares of side 2/3 over the same area
+    auto square = [](double x0, double y0, double dx) {
+        return std::vector<std::array<double,2>>
+            {{x0,y0}, {x0+dx,y0}, {x0+dx,y0+dx}, {x0,y0+dx}};
+    };
+    linear::PolyGrid gridA(10), gridB(20);
+    for (int j=0; j<4; ++j) gridA.add(9-j, square(j%2, j/2, 1.));
+    for (int i=0; i<9; ++i) {
+        auto verts(square((i%3)*2./3., (i/3)*2./3., 2./3.));
+        if (i == 4) std::reverse(verts.begin(), verts.end());    // Clockwise
+        gridB.add(2*i, verts);
+    }
+    EXPECT_NEAR(4./9., gridB.area(4), 1e-14);
+    EXPECT_THROW(gridA.add(11, square(0,0,1)), ibmisc::Exception);
+
+    auto BvA(linear::overlap_tuple(gridB, gridA, 1, false));
+    EXPECT_EQ(20, BvA.shape()[0]);
+    EXPECT_EQ(10, BvA.shape()[1]);
+
+    // Cells that only share an edge do not overlap
+    EXPECT_EQ(4+2*4+4*1, BvA.M.size());
+    EXPECT_EQ(9, BvA.wM.size());
+    EXPECT_EQ(4, BvA.Mw.size());
+    for (auto ii=BvA.wM.begin(); ii != BvA.wM.end(); ++ii)
+        EXPECT_NEAR(4./9., ii->value(), 1e-14);
+    for (auto ii=BvA.Mw.begin(); ii != BvA.Mw.end(); ++ii)
+        EXPECT_NEAR(1., ii->value(), 1e-14);
+    for (auto ii=BvA.M.begin(); ii != BvA.M.end(); ++ii) {
+        if (ii->index(0) == 8) EXPECT_NEAR(1./9., ii->value(), 1e-14);
+    }
+
+    // Scaled rows sum to 1; threading does not change the result
+    auto BvA1(linear::overlap_tuple(gridB, gridA, 1));
+    auto BvA4(linear::overlap_tuple(gridB, gridA, 4));
+    std::vector<double> rowsum(20, 0);
+    for (auto ii=BvA1.M.begin(); ii != BvA1.M.end(); ++ii)
+        rowsum[ii->index(0)] += ii->value();
+    for (int i=0; i<9; ++i) EXPECT_NEAR(1., rowsum[2*i], 1e-14);
+    ASSERT_EQ(BvA1.M.size(), BvA4.M.size());
+    for (size_t k=0; k<BvA1.M.size(); ++k) {
+        EXPECT_EQ(BvA1.M.tuples[k].index(), BvA4.M.tuples[k].index());
+        EXPECT_EQ(BvA1.M.tuples[k].value(), BvA4.M.tuples[k].value());
+    }
+}
+
+TEST_F(LinearTest, regrid_stream)
+{
+    int const nB = 12, nA = 10;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int i=0; i<nB; ++i) {
+        if (i % 5 == 2) continue;
+        for (int j=0; j<nA; ++j) if ((i+j) % 3 == 0) BvA.M.add({i,j}, .5 + .1*j);
+        BvA.wM.add({i}, 1.+.1*i);
+    }
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 1.);
+    auto BvA_e(to_eigen(BvA));
+    linear::Weighted_Compressed BvAc(compress(*BvA_e));
+
+    // Two input files of 5 and 3 records: T(time,ny,nx), P(time,na)
+    std::vector<int> const nrecs {5, 3};
+    int const ntime = 8;
+    auto value = [](int v, int t, int j) { return 100*v + 10*t + j; };
+    std::vector<std::string> ifnames;
+    for (int f=0, t0=0; f<(int)nrecs.size(); t0 += nrecs[f++]) {
+        std::string const fname("__regrid_stream_in" + std::to_string(f) + ".nc");
+        tmpfiles.push_back(fname);
+        ifnames.push_back(fname);
+
+        NcIO ncio(fname, 'w');
+        auto dims(get_or_add_dims(ncio, {"time", "ny", "nx", "na"}, {-1, 2, 5, nA}));
+        auto time_v(get_or_add_var(ncio, "time", "double", {dims[0]}));
+        auto T_v(get_or_add_var(ncio, "T", "double", {dims[0], dims[1], dims[2]}));
+        auto P_v(get_or_add_var(ncio, "P", "double", {dims[0], dims[3]}));
+        T_v.putAtt("units", "K");
+        for (int t=0; t<nrecs[f]; ++t) {
+            std::vector<double> T(nA), P(nA);
+            for (int j=0; j<nA; ++j) {
+                T[j] = value(0, t0+t, j);
+                P[j] = value(1, t0+t, j);
+            }
+            double const time = t0 + t;
+            time_v.putVar({(size_t)t}, {1}, &time);
+            T_v.putVar({(size_t)t, 0, 0}, {1, 2, 5}, &T[0]);
+            P_v.putVar({(size_t)t, 0}, {1, (size_t)nA}, &P[0]);
+        }
+        ncio.close();
+    }
+
+    linear::RegridStream rs;
+    rs.ifnames = ifnames;
+    rs.batch = 2;
+    rs.nqueue = 1;
+    rs.add("T", "T_B", BvA_e.get(), {"jm", "im"}, {3, 4});
+    rs.add("P", "P_B", &BvAc);
+    rs.add("P", "P_B2", BvA_e.get());
+
+    std::string const ofname("__regrid_stream_out.nc");
+    tmpfiles.push_back(ofname);
+    EXPECT_EQ(ntime, rs.run(ofname));
+
+    // Same as regridding the whole series at once
+    NcIO ncio(ofname, 'r');
+    std::vector<double> time(ntime);
+    ncio.getVar("time").getVar(&time[0]);
+    for (int t=0; t<ntime; ++t) EXPECT_EQ(t, time[t]);
+    netCDF::NcVar T_v(ncio.getVar("T_B"));
+    std::string units;
+    get_or_put_att(T_v, 'r', "units", units);
+    EXPECT_EQ("K", units);
+    EXPECT_EQ(4, T_v.getDim(2).getSize());
+
+    for (int v=0; v<3; ++v) {
+        blitz::Array<double,2> in(ntime, nA), expected(ntime, nB), got(ntime, nB);
+        for (int t=0; t<ntime; ++t)
+        for (int j=0; j<nA; ++j) in(t,j) = value(v == 0 ? 0 : 1, t, j);
+        expected = std::numeric_limits<double>::quiet_NaN();
+        BvA_e->apply_M(in, expected);
+
+        ncio.getVar(std::vector<std::string>{"T_B", "P_B", "P_B2"}[v]).getVar(got.data());
+        for (int t=0; t<ntime; ++t)
+        for (int i=0; i<nB; ++i) {
+            if (std::isnan(expected(t,i))) EXPECT_TRUE(std::isnan(got(t,i)));
+            else EXPECT_NEAR(expected(t,i), got(t,i), 1e-12 * std::abs(expected(t,i)));
+        }
+    }
+
+    // Errors in a stage stop the pipeline, and come out of run()
+    rs.ifnames.push_back("__regrid_stream_missing.nc");
+    EXPECT_THROW(rs.run(ofname), ibmisc::Exception);
+}
+
+
+TEST_F(LinearTest, matrix_cache)
+{
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({10, 20});
+    BvA.M.add({1,3}, 2.);
+    BvA.M.add({8,19}, 4.);
+    BvA.wM.add({1}, 2.);
+    BvA.wM.add({8}, 4.);
+    for (int j : {3,19}) BvA.Mw.add({j}, 1.);
+    auto BvA_e(to_eigen(BvA));
+
+    // Keys depend on content and labels, not on object identity
+    auto make_key = [&](std::string const &sproj, int opt) {
+        linear::MatrixKey key;
+        key.add("dimB", *BvA_e->dims[0]).add("dimA", *BvA_e->dims[1])
+            .add("sproj", sproj).add("opt", opt);
+        return key;
+    };
+    std::string const sproj("+proj=stere +lat_0=90 +lat_ts=71 +lon_0=-39");
+    EXPECT_TRUE(make_key(sproj, 1) == make_key(sproj, 1));
+    EXPECT_EQ(32, make_key(sproj, 1).hex().size());
+    EXPECT_NE(make_key(sproj, 1).hex(), make_key(sproj, 2).hex());
+    EXPECT_NE(make_key(sproj, 1).hex(), make_key(sproj + " ", 1).hex());
+    EXPECT_NE(make_key(sproj, 1).hex(),
+        linear::MatrixKey().add("dimA", *BvA_e->dims[1]).add("dimB", *BvA_e->dims[0])
+            .add("sproj", sproj).add("opt", 1).hex());
+
+    std::string const dir("__matrix_cache");
+    boost::filesystem::remove_all(dir);
+    for (auto format : {linear::MatrixCache::Format::NETCDF, linear::MatrixCache::Format::SNAPSHOT}) {
+        linear::MatrixCache cache(dir, format);
+        auto const key(make_key(sproj, (int)format));
+        EXPECT_FALSE(cache.has(key));
+        EXPECT_FALSE(cache.get(key));
+
+        // Concurrent callers: one builds, the rest wait for it
+        std::atomic<int> nbuilt(0);
+        std::vector<std::unique_ptr<linear::Weighted>> got(4);
+        parallel_for(0, (long)got.size(), 4, [&](long i0, long i1) {
+            for (long i=i0; i<i1; ++i) got[i] = cache.get_or_build(key, [&]{
+                ++nbuilt;
+                auto W(to_eigen(BvA));
+                return std::unique_ptr<linear::Weighted>(W.release());
+            });
+        });
+        EXPECT_EQ(1, nbuilt);
+        EXPECT_TRUE(cache.has(key));
+        EXPECT_FALSE(boost::filesystem::exists(cache.path(key) + ".lock"));
+
+        blitz::Array<double,2> aa(1,20), bb0(1,10), bb1(1,10);
+        for (int j=0; j<20; ++j) aa(0,j) = j;
+        bb0 = 0;
+        BvA_e->apply_M(aa, bb0);
+        for (auto &W : got) {
+            bb1 = 0;
+            W->apply_M(aa, bb1);
+            for (int i=0; i<10; ++i) EXPECT_DOUBLE_EQ(bb0(0,i), bb1(0,i));
+        }
+    }
+    boost::filesystem::remove_all(dir);
+}
+
+
+TEST_F(LinearTest, reproducible)
+{
+    // Values with roundoff, so summation order shows in the last bits
+    int const nB = 300, nA = 200;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int i=0; i<nB; ++i) {
+        for (int j=i % 7; j<nA; j += 7) BvA.M.add({i,j}, std::sin(.1*i + .37*j) / 3.);
+        BvA.wM.add({i}, 1.);
+    }
+    for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 1.);
+    auto BvA_e(to_eigen(BvA));
+    linear::Weighted_Compressed BvA_c(compress(*BvA_e));
+    BvA_c.set_cache_budget(1L<<24);
+    BvA_c.reduce_mode = ReduceMode::REPRODUCIBLE;
+
+    blitz::Array<double,2> bb(2,nB);
+    for (int k=0; k<2; ++k)
+    for (int i=0; i<nB; ++i) bb(k,i) = std::cos(.3*i + k) * 1e3 / 7.;
+
+    blitz::Array<double,2> aa1(2,nA);
+    std::array<blitz::Array<double,1>,2> w1;
+    for (int nthreads : {1, 2, 3, 8, 16}) {
+        BvA_c.nthreads = nthreads;
+        blitz::Array<double,2> aa(2,nA);
+        aa = 0;
+        BvA_c.apply_MT(bb, aa);
+        auto w(sums(*BvA_e->M, '+', nthreads, ReduceMode::REPRODUCIBLE));
+        if (nthreads == 1) {
+            aa1.reference(aa);
+            for (int d=0; d<2; ++d) w1[d].reference(w[d]);
+        }
+
+        // Bit-identical
+        for (int k=0; k<2; ++k)
+        for (int j=0; j<nA; ++j) EXPECT_EQ(aa1(k,j), aa(k,j));
+        for (int d=0; d<2; ++d)
+        for (int i=0; i<w[d].extent(0); ++i) EXPECT_EQ(w1[d](i), w[d](i));
+    }
+
+    // ...and close to the plain serial answer
+    BvA_c.reduce_mode = ReduceMode::FAST;
+    BvA_c.nthreads = 1;
+    blitz::Array<double,2> aa(2,nA);
+    aa = 0;
+    BvA_c.apply_MT(bb, aa);
+    for (int k=0; k<2; ++k)
+    for (int j=0; j<nA; ++j) EXPECT_NEAR(aa(k,j), aa1(k,j), 1e-10 * (1+std::abs(aa(k,j))));
+}
+
+TEST_F(LinearTest, apply_weight_gemv)
+{
+    // Weights in runs (long and short) over A, with gaps
+    int const nB = 40, nA = 300;
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({nB,nA});
+    for (int j=0; j<nA; ++j) {
+        if ((j / 50) % 2 == 1 && j % 50 > 3) continue;
+        BvA.M.add({j % nB, j}, 1.);
+        BvA.Mw.add({j}, 1. + .01*j);
+    }
+    for (int i=0; i<nB; ++i) BvA.wM.add({i}, 2. - .01*i);
+    auto BvA_e(to_eigen(BvA));
+    linear::Weighted_Compressed BvA_c(compress(*BvA_e));
+    BvA_c.set_cache_budget(1L<<24);
+
+    // 50 fields, NaN outside the weights (eg fill values)
+    int const nvec = 50;
+    blitz::Array<double,2> aa(nvec,nA);
+    for (int k=0; k<nvec; ++k)
+    for (int j=0; j<nA; ++j) aa(k,j) = std::sin(.1*j + k);
+    blitz::Array<double,1> wA;
+    BvA.get_weights(1, wA);
+    for (int j=0; j<nA; ++j) if (wA(j) == 0) aa(blitz::Range::all(), j) = NAN;
+
+    std::vector<double> expected(nvec, 0.);
+    for (int k=0; k<nvec; ++k)
+    for (int j=0; j<nA; ++j) if (wA(j) != 0) expected[k] += wA(j) * aa(k,j);
+
+    blitz::Array<double,1> w1;
+    for (int nthreads : {1, 3}) {
+        for (linear::Weighted *W : {(linear::Weighted *)BvA_e.get(), (linear::Weighted *)&BvA_c}) {
+            W->nthreads = nthreads;
+            blitz::Array<double,1> w(nvec);
+            W->apply_weight(1, aa, w);
+            for (int k=0; k<nvec; ++k) EXPECT_NEAR(expected[k], w(k), 1e-12 * (1+std::abs(expected[k])));
+
+            // Does not depend on nthreads
+            if (!w1.data()) w1.reference(w);
+            if (W == BvA_e.get()) for (int k=0; k<nvec; ++k) EXPECT_EQ(w1(k), w(k));
+        }
+    }
+
+    // Vector-major layout
+    blitz::Array<double,2> aa_t(nA, nvec);
+    aa_t = aa.transpose(1,0);
+    blitz::Array<double,2> aa_v(aa_t.transpose(1,0));
+    blitz::Array<double,1> w(nvec);
+    BvA_c.apply_weight(1, aa_v, w);
+    for (int k=0; k<nvec; ++k) EXPECT_NEAR(expected[k], w(k), 1e-12 * (1+std::abs(expected[k])));
+}
+
 
 int main(int argc, char **argv) {
     // For test, configure Everytrace to silently throw exceptions (which we can catch)
     everytrace_init();
-//    everytrace_exit = &everytrace_exit_silent_exception;
+    everytrace_exit = &everytrace_exit_silent_exception;
 
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,140 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Needs a CUDA device
+
+#include <cmath>
+#include <map>
+#include <gtest/gtest.h>
+#include <ibmisc/linear/tuple.hpp>
+#include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/cuda.hpp>
+
+using namespace ibmisc;
+using namespace blitz;
+
+class LinearCUDATest : public ::testing::Test {
+protected:
+    static int const nB = 29, nA = 40;
+    linear::Weighted_Tuple BvA;
+    std::unique_ptr<linear::Weighted_Eigen> BvA_e;
+
+    LinearCUDATest() : BvA(false)    // Not conservative: exercise apply_weight()
+    {
+        BvA.set_shape({nB,nA});
+        for (int i=0; i<nB; ++i) {
+            if (i % 7 == 3) continue;    // Nullspace
+            int const len = (i == 10 ? 0 : 1 + (i*5) % 11);    // Row 10 is active but empty
+            for (int n=0; n<len; ++n) {
+                BvA.M.add({i, (3*i + 7*n) % nA}, .5 + .25*i - .125*n);
+            }
+            BvA.wM.add({i}, 1. + .1*i);
+        }
+        for (int j=0; j<nA; ++j) BvA.Mw.add({j}, 2.);
+        BvA_e = to_eigen(BvA);
+    }
+};
+
+TEST_F(LinearCUDATest, apply_M)
+{
+    // Batches of 4: several batches, the last one partial
+    linear::Weighted_CUDA BvA_d(*BvA_e, 4);
+    EXPECT_EQ(BvA_e->nnz(), BvA_d.nnz());
+    EXPECT_EQ(BvA_e->shape(), BvA_d.shape());
+
+    for (int nk : {1, 4, 11}) {
+        blitz::Array<double,2> aa(nk,nA);
+        for (int k=0; k<nk; ++k)
+        for (int j=0; j<nA; ++j) aa(k,j) = 32*j*j - 17 + k;
+
+        for (int force_conservation=0; force_conservation<2; ++force_conservation) {
+            blitz::Array<double,2> bb_e(nk,nB), bb_d(nk,nB);
+            bb_e = -17;
+            bb_d = -17;
+            BvA_e->apply_M(aa, bb_e, linear::AccumType::REPLACE, force_conservation);
+            BvA_d.apply_M(aa, bb_d, linear::AccumType::REPLACE, force_conservation);
+            for (int k=0; k<nk; ++k)
+            for (int i=0; i<nB; ++i) {
+                EXPECT_NEAR(bb_e(k,i), bb_d(k,i), 1e-12 * (1+std::abs(bb_e(k,i))));
+            }
+        }
+    }
+}
+
+TEST_F(LinearCUDATest, device_buffers)
+{
+    linear::Weighted_CUDA BvA_d(*BvA_e);
+    int const nk = 3;
+    auto const &rows(BvA_d.active_rows());
+
+    blitz::Array<double,2> aa(nk,nA);
+    for (int k=0; k<nk; ++k)
+    for (int j=0; j<nA; ++j) aa(k,j) = 32*j*j - 17 + k;
+
+    double *d_aa, *d_bc, *d_w;
+    ASSERT_EQ(cudaSuccess, cudaMalloc((void **)&d_aa, nk*nA*sizeof(double)));
+    ASSERT_EQ(cudaSuccess, cudaMalloc((void **)&d_bc, nk*rows.size()*sizeof(double)));
+    ASSERT_EQ(cudaSuccess, cudaMalloc((void **)&d_w, nk*sizeof(double)));
+    cudaMemcpy(d_aa, aa.data(), nk*nA*sizeof(double), cudaMemcpyHostToDevice);
+
+    BvA_d.apply_M_device(d_aa, nk, d_bc);
+    std::vector<double> bc(nk*rows.size());
+    cudaStreamSynchronize(BvA_d.stream());
+    cudaMemcpy(&bc[0], d_bc, bc.size()*sizeof(double), cudaMemcpyDeviceToHost);
+
+    BvA_d.apply_weight_device(1, d_aa, nk, d_w);
+    std::vector<double> wA_d(nk);
+    cudaStreamSynchronize(BvA_d.stream());
+    cudaMemcpy(&wA_d[0], d_w, nk*sizeof(double), cudaMemcpyDeviceToHost);
+
+    blitz::Array<double,2> bb_e(nk,nB);
+    BvA_e->apply_M(aa, bb_e, linear::AccumType::REPLACE, false);
+    blitz::Array<double,1> wA_e(nk);
+    BvA_e->apply_weight(1, aa, wA_e);
+    for (int k=0; k<nk; ++k) {
+        for (size_t r=0; r<rows.size(); ++r) {
+            EXPECT_NEAR(bb_e(k,rows[r]), bc[k*rows.size() + r], 1e-12 * (1+std::abs(bb_e(k,rows[r]))));
+        }
+        EXPECT_NEAR(wA_e(k), wA_d[k], 1e-12 * std::abs(wA_e(k)));
+    }
+
+    cudaFree(d_w);
+    cudaFree(d_bc);
+    cudaFree(d_aa);
+}
+
+TEST_F(LinearCUDATest, to_coo)
+{
+    linear::Weighted_CUDA BvA_d(*BvA_e);
+    blitz::Array<int,1> i1, j1, i2, j2;
+    blitz::Array<double,1> v1, v2;
+    BvA_e->to_coo(i1, j1, v1);
+    BvA_d.to_coo(i2, j2, v2);
+    ASSERT_EQ(v1.extent(0), v2.extent(0));
+
+    // Entries may come out in a different order
+    std::map<std::pair<int,int>, double> M1, M2;
+    for (int n=0; n<v1.extent(0); ++n) M1[std::make_pair(i1(n), j1(n))] += v1(n);
+    for (int n=0; n<v2.extent(0); ++n) M2[std::make_pair(i2(n), j2(n))] += v2(n);
+    EXPECT_EQ(M1, M2);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,258 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Run with: mpirun -np 3 ibmisc_linear_mpi
+
+#include <mpi.h>
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <ibmisc/netcdf.hpp>
+#include <ibmisc/linear/tuple.hpp>
+#include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/compressed.hpp>
+#include <ibmisc/linear/mpi.hpp>
+
+using namespace ibmisc;
+using namespace blitz;
+
+// B is a 2x coarsening of A; both row-major
+static int const nBi = 6, nBj = 5;
+static int const nAi = 2*nBi, nAj = 2*nBj;
+
+class LinearMPITest : public ::testing::Test {
+protected:
+    int rank, size;
+    Indexing indexingB, indexingA;
+    linear::Weighted_Tuple BvA;
+
+    LinearMPITest() :
+        indexingB({"i", "j"}, {0,0}, {nBi,nBj}, {0,1}),
+        indexingA({"i", "j"}, {0,0}, {nAi,nAj}, {0,1}),
+        BvA(false)    // Not conservative: exercise apply_weight()
+    {
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+        BvA.set_shape({nBi*nBj, nAi*nAj});
+        for (int ib=0; ib<nBi; ++ib) {
+        for (int jb=0; jb<nBj; ++jb) {
+            long const iB = ib*nBj + jb;
+            if (iB % 7 == 3) continue;    // Some of B is in the nullspace
+            double wsum = 0;
+            for (int di=0; di<2; ++di) {
+            for (int dj=0; dj<2; ++dj) {
+                long const jA = (2*ib+di)*nAj + (2*jb+dj);
+                double const w = .2 + .1*di + .05*dj;
+                BvA.M.add({iB, jA}, w);
+                BvA.Mw.add({jA}, w);
+                wsum += w;
+            }}
+            BvA.wM.add({iB}, wsum * 1.01);
+        }}
+    }
+
+    /** Partition of B by rows of B; of A by columns, so most of M needs a halo */
+    std::array<Domain,2> domains() const
+    {
+        return std::array<Domain,2>{
+            Domain({rank*nBi/size, 0}, {(rank+1)*nBi/size, nBj}),
+            Domain({0, rank*nAj/size}, {nAi, (rank+1)*nAj/size})};
+    }
+};
+
+/** Re-encodes Z in row order, in blocks of block_size, with a skip table */
+template<int RANK>
+static void reblock(ZArray<int,double,RANK> &Z, long block_size)
+{
+    std::vector<std::pair<std::array<int,RANK>,double>> tuples;
+    for (auto gen(Z.generator()); ++gen;) tuples.push_back({gen.index(), gen.value()});
+    std::sort(tuples.begin(), tuples.end());
+
+    ZArray<int,double,RANK> Z2(Z.shape());
+    {auto accum(Z2.accum(block_size));
+        for (auto const &t : tuples) accum.add(t.first, t.second);
+    }
+    Z2.index_blocks();
+    Z = std::move(Z2);
+}
+
+TEST_F(LinearMPITest, apply_matches_serial)
+{
+    // Serial reference; set_matrix() streams the compressed matrix
+    linear::Weighted_Compressed BvA_c(compress(*to_eigen(BvA)));
+    linear::Weighted_MPI BvA_mpi(MPI_COMM_WORLD, {indexingB, indexingA}, domains());
+    BvA_mpi.set_matrix(BvA_c);
+
+    int const nvec = 3;
+    long const nA = nAi*nAj, nB = nBi*nBj;
+    auto const &runA(BvA_mpi.run_index(1));
+    auto const &runB(BvA_mpi.run_index(0));
+
+    // Global and local inputs
+    blitz::Array<double,2> As(nvec, nA);
+    for (int k=0; k<nvec; ++k)
+    for (int j=0; j<nA; ++j) As(k,j) = (k+1) * 100. + j * .37;
+
+    blitz::Array<double,2> As_local(nvec, BvA_mpi.local_extent(1));
+    for (int k=0; k<nvec; ++k)
+    for (int lj=0; lj<As_local.extent(1); ++lj) As_local(k,lj) = As(k, runA.to_global(lj));
+
+    // Serial results
+    blitz::Array<double,2> Bs(nvec, nB);
+    Bs = 0;
+    BvA_c.apply_M(As, Bs);
+    blitz::Array<double,1> wA(nvec);
+    BvA_c.apply_weight(1, As, wA);
+
+    // Distributed results
+    blitz::Array<double,2> Bs_local(nvec, BvA_mpi.local_extent(0));
+    Bs_local = 0;
+    BvA_mpi.apply_M(As_local, Bs_local);
+    blitz::Array<double,1> wA_mpi(nvec);
+    BvA_mpi.apply_weight(1, As_local, wA_mpi);
+
+    if (size > 1) EXPECT_GT(BvA_mpi.nhalo(), 0);
+    for (int k=0; k<nvec; ++k) {
+        for (int li=0; li<Bs_local.extent(1); ++li) {
+            EXPECT_DOUBLE_EQ(Bs(k, runB.to_global(li)), Bs_local(k,li));
+        }
+        EXPECT_DOUBLE_EQ(wA(k), wA_mpi(k));
+    }
+
+    // Every row of M lives on exactly one rank
+    long nnz = BvA_mpi.nnz(), nnz_total;
+    MPI_Allreduce(&nnz, &nnz_total, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    EXPECT_EQ(BvA_c.nnz(), nnz_total);
+}
+
+TEST_F(LinearMPITest, apply_MT_matches_serial)
+{
+    linear::Weighted_Compressed BvA_c(compress(*to_eigen(BvA)));
+    linear::Weighted_MPI BvA_mpi(MPI_COMM_WORLD, {indexingB, indexingA}, domains());
+    BvA_mpi.set_matrix(BvA_c);
+
+    int const nvec = 2;
+    long const nA = nAi*nAj, nB = nBi*nBj;
+    auto const &runA(BvA_mpi.run_index(1));
+    auto const &runB(BvA_mpi.run_index(0));
+
+    blitz::Array<double,2> Bs(nvec, nB);
+    for (int k=0; k<nvec; ++k)
+    for (int i=0; i<nB; ++i) Bs(k,i) = (k+1) * 10. + i * .5;
+    blitz::Array<double,2> Bs_local(nvec, BvA_mpi.local_extent(0));
+    for (int k=0; k<nvec; ++k)
+    for (int li=0; li<Bs_local.extent(1); ++li) Bs_local(k,li) = Bs(k, runB.to_global(li));
+
+    blitz::Array<double,2> As(nvec, nA);
+    As = 0;
+    BvA_c.apply_MT(Bs, As);
+
+    blitz::Array<double,2> As_local(nvec, BvA_mpi.local_extent(1));
+    As_local = 0;
+    BvA_mpi.apply_MT(Bs_local, As_local);
+
+    for (int k=0; k<nvec; ++k)
+    for (int lj=0; lj<As_local.extent(1); ++lj) {
+        double const xval = As(k, runA.to_global(lj));
+        EXPECT_NEAR(xval, As_local(k,lj), 1e-12 * std::abs(xval));
+    }
+}
+
+TEST_F(LinearMPITest, nc_read_own_blocks)
+{
+    linear::Weighted_Compressed BvA_c(compress(*to_eigen(BvA)));
+    reblock(BvA_c.M, 8);
+    reblock(BvA_c.weights[0], 4);
+    reblock(BvA_c.weights[1], 4);
+
+    std::string const fname("__linear_mpi_nc_read.nc");
+    if (rank == 0) {
+        ::remove(fname.c_str());
+        NcIO ncio(fname, 'w');
+        BvA_c.ncio(ncio, "BvA");
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    linear::Weighted_MPI BvA_mpi(MPI_COMM_WORLD, {indexingB, indexingA}, domains());
+    auto const &runB(BvA_mpi.run_index(0));
+    std::vector<std::array<int,2>> rowsB;
+    for (auto const &run : runB.runs()) rowsB.push_back({(int)run.begin, (int)run.end});
+    ZArray<int,double,2> M_local;
+    {NcIO ncio(fname, 'r');
+        BvA_mpi.nc_read(ncio.nc, "BvA");
+        M_local.nc_read_rows(ncio, "BvA.M", rowsB);
+    }
+
+    // Only the blocks overlapping our rows came off disk
+    if (size > 1) EXPECT_LT(M_local.nnz(), BvA_c.nnz());
+
+    // Each rank holds exactly its own rows of M
+    long const nnz = BvA_mpi.nnz();
+    blitz::Array<int,1> ii(nnz), jj(nnz);
+    blitz::Array<double,1> vv(nnz);
+    BvA_mpi.to_coo(ii, jj, vv);
+    for (long n=0; n<nnz; ++n) EXPECT_LE(0, runB.to_local(ii(n)));
+    long nnz_total;
+    MPI_Allreduce(&nnz, &nnz_total, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    EXPECT_EQ(BvA_c.nnz(), nnz_total);
+
+    // ...and computes the same as the serial matrix
+    int const nvec = 2;
+    long const nA = nAi*nAj, nB = nBi*nBj;
+    auto const &runA(BvA_mpi.run_index(1));
+    blitz::Array<double,2> As(nvec, nA);
+    for (int k=0; k<nvec; ++k)
+    for (int j=0; j<nA; ++j) As(k,j) = (k+1) * 10. - j * .13;
+    blitz::Array<double,2> As_local(nvec, BvA_mpi.local_extent(1));
+    for (int k=0; k<nvec; ++k)
+    for (int lj=0; lj<As_local.extent(1); ++lj) As_local(k,lj) = As(k, runA.to_global(lj));
+
+    blitz::Array<double,2> Bs(nvec, nB);
+    Bs = 0;
+    BvA_c.apply_M(As, Bs);
+    blitz::Array<double,2> Bs_local(nvec, BvA_mpi.local_extent(0));
+    Bs_local = 0;
+    BvA_mpi.apply_M(As_local, Bs_local);
+    for (int k=0; k<nvec; ++k)
+    for (int li=0; li<Bs_local.extent(1); ++li)
+        EXPECT_DOUBLE_EQ(Bs(k, runB.to_global(li)), Bs_local(k,li));
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (rank == 0) ::remove(fname.c_str());
+}
+
+TEST_F(LinearMPITest, run_index)
+{
+    linear::RunIndex ri({IndexRun(3,5), IndexRun(10,13)});
+    EXPECT_EQ(5, ri.size());
+    EXPECT_EQ(-1, ri.to_local(2));
+    EXPECT_EQ(1, ri.to_local(4));
+    EXPECT_EQ(-1, ri.to_local(5));
+    EXPECT_EQ(2, ri.to_local(10));
+    EXPECT_EQ(4, ri.to_local(12));
+    EXPECT_EQ(-1, ri.to_local(13));
+    for (int l=0; l<ri.size(); ++l) EXPECT_EQ(l, ri.to_local(ri.to_global(l)));
+}
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+    ::testing::InitGoogleTest(&argc, argv);
+    int const ret = RUN_ALL_TESTS();
+    MPI_Finalize();
+    return ret;
+}
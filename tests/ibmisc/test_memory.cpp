@@ -20,11 +20,15 @@
 
 #include <gtest/gtest.h>
 #include <ibmisc/memory.hpp>
+#include <ibmisc/DynArray.hpp>
 #include <ibmisc/string.hpp>
 #include <iostream>
 #include <cstdio>
 #include <memory>
 #include <map>
+#include <array>
+#include <string>
+#include <vector>
 
 using namespace std;
 using namespace ibmisc;
@@ -61,6 +65,56 @@ string *get_hello()
 unique_ptr<string> new_hello()
     { return unique_ptr<string>(new string("hello")); }
 
+struct SMBMsg {
+    int sheetno;
+    double vals[1];     // Always at least one, could be more
+};
+
+TEST_F(MemoryTest, dyn_array)
+{
+    size_t const ele_size = sizeof(SMBMsg) + 2*sizeof(double);    // 3 vals
+    DynArray<SMBMsg> msgs(ele_size);
+    EXPECT_EQ(0, msgs.size);
+
+    for (int i=0; i<100; ++i) {
+        SMBMsg &msg(msgs.push_back());
+        EXPECT_EQ(0, msg.vals[2]);    // Zeroed
+        msg.sheetno = i;
+        for (int j=0; j<3; ++j) msg.vals[j] = i + j*.5;
+    }
+    EXPECT_EQ(100, msgs.size);
+    EXPECT_LE(100, msgs.capacity());
+    EXPECT_EQ(0, (uintptr_t)msgs.buf % DynArray<SMBMsg>::ALIGN);
+    EXPECT_EQ(100 * ele_size, msgs.nbytes());
+
+    int n = 0;
+    for (auto ii=msgs.begin(); ii != msgs.end(); ++ii, ++n) {
+        EXPECT_EQ(n, ii->sheetno);
+        EXPECT_EQ(n + 1., ii->vals[2]);
+    }
+    EXPECT_EQ(100, n);
+
+    // Pack / unpack
+    std::vector<char> wire(msgs.nbytes());
+    EXPECT_EQ(&wire[0] + wire.size(), msgs.pack(&wire[0]));
+    DynArray<SMBMsg> msgs2(ele_size);
+    msgs2.unpack(&wire[0], msgs.size);
+    EXPECT_EQ(99, msgs2[99].sheetno);
+    EXPECT_EQ(99.5, msgs2[99].vals[1]);
+
+    // Move; clear keeps the storage
+    char const *buf = msgs.buf;
+    DynArray<SMBMsg> msgs3(std::move(msgs));
+    EXPECT_EQ(buf, msgs3.buf);
+    EXPECT_EQ(0, msgs.size);
+    msgs3.clear();
+    EXPECT_EQ(0, msgs3.size);
+    msgs3.push_back();
+    EXPECT_EQ(buf, msgs3.buf);
+    msgs = std::move(msgs2);
+    EXPECT_EQ(100, msgs.size);
+}
+
 TEST_F(MemoryTest, lazy_ptr_test)
 {
     LazyPtr<string> p0(get_hello());
@@ -104,6 +158,47 @@ TEST_F(MemoryTest, tmp_alloc)
 
 
 }
+
+struct alignas(32) Aligned32 {
+    double x[4];
+};
+
+TEST_F(MemoryTest, tmp_alloc_arena)
+{
+    ndestroy = 0;
+    std::vector<std::string *> strings;
+    {
+        TmpAlloc tmp;
+        for (int i=0; i<10000; ++i) {
+            strings.push_back(&tmp.make<std::string>(std::to_string(i)));
+            tmp.make<int>(i);
+            Aligned32 &a(tmp.make<Aligned32>());
+            EXPECT_EQ(0, (uintptr_t)&a % 32);
+        }
+        tmp.newptr<MyClass>();
+        tmp.take(std::unique_ptr<MyClass>(new MyClass));
+        for (int i=0; i<10000; ++i) EXPECT_EQ(std::to_string(i), *strings[i]);
+
+        // Large objects get blocks of their own
+        auto &big(tmp.make<std::array<double, 1000000>>());
+        big[999999] = 17;
+
+        // merge() and move
+        TmpAlloc tmp2;
+        tmp2.newptr<MyClass>();
+        tmp.merge(std::move(tmp2));
+        EXPECT_EQ(0, ndestroy);
+        tmp2.newptr<MyClass>();
+
+        TmpAlloc tmp3(std::move(tmp));
+        tmp = std::move(tmp2);
+        EXPECT_EQ(0, ndestroy);
+        tmp3.free();
+        EXPECT_EQ(3, ndestroy);
+        tmp3.newptr<MyClass>();    // Usable after free()
+    }
+    EXPECT_EQ(5, ndestroy);
+}
 // -----------------------------------------------------------
 struct MyClass2 {
     int const x;
@@ -117,6 +212,35 @@ TEST_F(MemoryTest, reset_ptr)
     EXPECT_EQ(17, ptr->x);
 }
 // -----------------------------------------------------------
+TEST_F(MemoryTest, memory_footprint)
+{
+    TmpAlloc tmp;
+    EXPECT_EQ(0, tmp.memory_footprint().capacity);
+    tmp.make<double>(17.);
+    auto const tf(tmp.memory_footprint("tmp"));
+    EXPECT_GE(tf.bytes, sizeof(double));
+    EXPECT_GE(tf.capacity, 4096);
+    EXPECT_EQ(tf.capacity, tf.bytes + tf.slack());
+
+    std::vector<int> vec;
+    vec.reserve(100);
+    vec.resize(10);
+    std::vector<char> zbuf(50);
+
+    MemoryFootprint root("root");
+    root.add(vector_footprint("vec", vec));
+    root.add(compressed_footprint("zbuf", zbuf, 200));
+    root.add(MemoryFootprint(tf));
+    EXPECT_EQ(10*sizeof(int) + 50 + tf.bytes, root.bytes);
+    EXPECT_EQ(90*sizeof(int) + tf.slack(), root.slack());
+    EXPECT_DOUBLE_EQ(4.0, root.children[1].compression_ratio());
+    EXPECT_DOUBLE_EQ(1.0, root.children[0].compression_ratio());
+
+    std::string const rep(root.report());
+    EXPECT_NE(std::string::npos, rep.find("  zbuf"));
+    EXPECT_EQ(std::string::npos, root.report(0).find("zbuf"));
+}
+// -----------------------------------------------------------
 
 
 int main(int argc, char **argv) {
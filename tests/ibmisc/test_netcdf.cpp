@@ -22,8 +22,12 @@
 #include <iostream>
 #include <cstdio>
 #include <netcdf>
+#include <boost/filesystem.hpp>
 #include <everytrace.h>
 #include <ibmisc/netcdf.hpp>
+#include <ibmisc/ncrecord.hpp>
+#include <ibmisc/ncmmap.hpp>
+#include <ibmisc/ncbulk.hpp>
 
 using namespace ibmisc;
 using namespace netCDF;
@@ -99,6 +103,68 @@ TEST_F(NetcdfTest, get_or_add_dim) {
 
 }
 
+TEST_F(NetcdfTest, in_memory) {
+    std::string fname("__netcdf_in_memory_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    blitz::Array<double,1> A(4);
+    for (int i=0; i<4; ++i) A(i) = i*i;
+
+    // Write to memory, and take the image
+    std::vector<char> image;
+    {NcIO ncio(NcMemory(), fname, 'w');
+        ncio_blitz(ncio, A, "A", "double", get_or_add_dims(ncio, A, {"n"}));
+        ncio.close(image);
+    }
+    EXPECT_FALSE(boost::filesystem::exists(fname));
+    EXPECT_LT(0, image.size());
+
+    {NcIO ncio(image);
+        auto A2(nc_read_blitz<double,1>(ncio.nc, "A"));
+        EXPECT_EQ(A(3), A2(3));
+    }
+
+    // Persisted on close
+    {NcIO ncio(NcMemory(true), fname, 'w');
+        ncio_blitz(ncio, A, "A", "double", get_or_add_dims(ncio, A, {"n"}));
+    }
+    {NcIO ncio(NcMemory(), fname, 'r');
+        auto A2(nc_read_blitz<double,1>(ncio.nc, "A"));
+        EXPECT_EQ(A(2), A2(2));
+        EXPECT_THROW(ncio.close(image), ibmisc::Exception);
+    }
+}
+
+TEST_F(NetcdfTest, handle_cache) {
+    std::string fname("__netcdf_handle_cache_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    {NcIO ncio(fname, 'w');
+        EXPECT_TRUE(ncio.getVar("var1").isNull());
+        EXPECT_TRUE(ncio.getDim("dim1").isNull());
+
+        NcDim dim1 = get_or_add_dim(ncio, "dim1", 3);
+        NcVar var1 = get_or_add_var(ncio, "var1", "int", {dim1});
+        EXPECT_TRUE(ncio.getDim("dim1") == dim1);
+        EXPECT_TRUE(ncio.getVar("var1") == var1);
+        EXPECT_TRUE(ncio.getVar("var1") == ncio.nc->getVar("var1"));
+
+        // Defined behind the NcIO's back
+        ncio.nc->addVar("var2", ncInt, {dim1});
+        EXPECT_FALSE(ncio.getVar("var2").isNull());
+        ncio.close();
+    }
+
+    {NcIO ncio(fname, 'r');
+        NcVar var1 = get_or_add_var(ncio, "var1", "int", {});
+        EXPECT_EQ("var1", var1.getName());
+        EXPECT_EQ(3, ncio.getDim("dim1").getSize());
+        EXPECT_THROW(get_or_add_var(ncio, "var3", "int", {}), ibmisc::Exception);
+    }
+}
+
 #if 0
 // Why is this test here?  Is it redundant?  Is it a speed test, rather than functionality?
 TEST_F(NetcdfTest, netcdf_imap)
@@ -248,6 +314,60 @@ TEST_F(NetcdfTest, blitz)
 
 }
 
+TEST_F(NetcdfTest, staged)
+{
+    std::string fname("__netcdf_staged_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    // Tiny staging buffer: many slabs, splitting dimensions
+    size_t const old_staging_bytes = ncio_staging_bytes;
+    ncio_staging_bytes = 3 * sizeof(double);
+
+    // Fortran order, and every other column of a C-order array
+    blitz::Array<double,2> F(4,5, blitz::fortranArray);
+    blitz::Array<double,2> wide(4,10);
+    for (int i=0; i<4; ++i)
+    for (int j=0; j<10; ++j) wide(i,j) = 100*i + j;
+    blitz::Array<double,2> S(wide(blitz::Range::all(), blitz::Range(0,8,2)));
+    for (int i=1; i<=4; ++i)
+    for (int j=1; j<=5; ++j) F(i,j) = 10*i + j;
+
+    {NcIO ncio(fname, 'w');
+        auto dims(get_or_add_dims(ncio, {"dim4", "dim5"}, {4, 5}));
+        ncio_blitz(ncio, F, "F", "double", dims, DimOrderMatch::LEXICAL);
+        ncio_blitz(ncio, S, "S", "double", dims);
+    }
+
+    {NcIO ncio(fname, 'r');
+        auto dims(get_dims(ncio, {"dim4", "dim5"}));
+
+        // Back into contiguous arrays...
+        blitz::Array<double,2> F2(4,5), S2(4,5);
+        ncio_blitz(ncio, F2, "F", "double", dims);
+        ncio_blitz(ncio, S2, "S", "double", dims);
+
+        // ...and into non-contiguous ones
+        blitz::Array<double,2> F4(4,5, blitz::fortranArray);
+        blitz::Array<double,2> wide5(4,10);
+        wide5 = -1;
+        blitz::Array<double,2> S5(wide5(blitz::Range::all(), blitz::Range(1,9,2)));
+        ncio_blitz(ncio, F4, "F", "double", dims, DimOrderMatch::LEXICAL);
+        ncio_blitz(ncio, S5, "S", "double", dims);
+        ncio.close();
+
+        for (int i=0; i<4; ++i)
+        for (int j=0; j<5; ++j) {
+            EXPECT_EQ(F(i+1,j+1), F2(i,j));
+            EXPECT_EQ(F(i+1,j+1), F4(i+1,j+1));
+            EXPECT_EQ(S(i,j), S2(i,j));
+            EXPECT_EQ(S(i,j), S5(i,j));
+            EXPECT_EQ(-1, wide5(i,2*j));    // Gaps untouched
+        }
+    }
+    ncio_staging_bytes = old_staging_bytes;
+}
+
 TEST_F(NetcdfTest, vector)
 {
     std::string fname("__netcdf_vector_test.nc");
@@ -278,6 +398,370 @@ TEST_F(NetcdfTest, vector)
 
 }
 
+TEST_F(NetcdfTest, var_config)
+{
+    std::string fname("__netcdf_var_config_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    blitz::Array<double,2> A(40,50);
+    for (int i=0; i<A.extent(0); ++i) {
+    for (int j=0; j<A.extent(1); ++j) {
+      A(i,j) = i*j;
+    }}
+
+    NcVarConfig config(NcVarConfig::fast_write());
+    config.dim_chunks["dim40"] = 8;
+    {
+        ibmisc::NcIO ncio(fname, 'w', "nc4", config);
+        auto dims = ibmisc::get_or_add_dims(ncio, {"time", "dim40", "dim50"}, {-1, 40, 50});
+        auto ncvar = get_or_add_var(ncio, "A", "double", dims);
+
+        std::vector<size_t> chunks;
+        netCDF::NcVar::ChunkMode mode;
+        ncvar.getChunkingParameters(mode, chunks);
+        EXPECT_EQ(netCDF::NcVar::nc_CHUNKED, mode);
+        EXPECT_EQ((std::vector<size_t>{1, 8, 50}), chunks);
+
+        bool shuffle, deflate;
+        int level;
+        ncvar.getCompressionParameters(shuffle, deflate, level);
+        EXPECT_FALSE(deflate);
+
+        // Oversized chunks get split
+        NcVarConfig small;
+        small.max_chunk_bytes = 40*50*8/4;
+        EXPECT_EQ((std::vector<size_t>{1, 10, 50}), small.chunk_shape(ncvar));
+    }
+
+    // Read back with a chunk cache
+    {
+        ibmisc::NcIO ncio(fname, 'r');
+        ncio.configure_read_var = std::bind(&NcVarConfig::configure_read,
+            NcVarConfig::fast_read(), std::placeholders::_1);
+        get_or_add_var(ncio, "A", "double", {});
+    }
+}
+
+TEST_F(NetcdfTest, quantize)
+{
+    std::string fname("__netcdf_quantize_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    blitz::Array<double,2> A(20,30);
+    blitz::Array<float,1> B(30);
+    blitz::Array<int,1> C(30);
+    for (int j=0; j<30; ++j) {
+        for (int i=0; i<20; ++i) A(i,j) = std::sin(i + .1*j) * 1000.;
+        B(j) = std::exp(.3*j);
+        C(j) = j;
+    }
+    B(3) = -1e30;    // Fill value is left alone
+    blitz::Array<double,2> const A0(A.copy());
+    blitz::Array<float,1> const B0(B.copy());
+
+    NcVarConfig config;
+    config.quantize.nsd = 3;
+    config.var_quantize["B"] = NcVarConfig::Quantize(0, 7);
+    {
+        ibmisc::NcIO ncio(fname, 'w', "nc4", config);
+        ncio_blitz(ncio, A, "A", "double", get_or_add_dims(ncio, A, {"dim20", "dim30"}));
+        auto ncvar(ncio_blitz(ncio, B, "B", "float", get_or_add_dims(ncio, B, {"dim30"})));
+        ncvar.putAtt("_FillValue", netCDF::ncFloat, -1e30f);
+        ncio_blitz(ncio, C, "C", "int", get_or_add_dims(ncio, C, {"dim30"}));
+    }
+
+    // Written arrays are not changed
+    for (int j=0; j<30; ++j) {
+        for (int i=0; i<20; ++i) EXPECT_EQ(A0(i,j), A(i,j));
+        EXPECT_EQ(B0(j), B(j));
+    }
+
+    ibmisc::NcIO ncio(fname, 'r');
+    auto A2(nc_read_blitz<double,2>(ncio.nc, "A"));
+    auto B2(nc_read_blitz<float,1>(ncio.nc, "B"));
+    auto C2(nc_read_blitz<int,1>(ncio.nc, "C"));
+    for (int j=0; j<30; ++j) {
+        for (int i=0; i<20; ++i) {
+            double expected = A0(i,j);
+            bitround(&expected, 1, nsd_to_nsb(3), NC_FILL_DOUBLE);
+            EXPECT_EQ(expected, A2(i,j));
+            EXPECT_NEAR(A0(i,j), A2(i,j), 5e-4 * std::abs(A0(i,j)));
+        }
+        float expected = B0(j);
+        bitround(&expected, 1, 7, -1e30f);
+        EXPECT_EQ(expected, B2(j));
+        EXPECT_EQ(j, C2(j));
+    }
+    EXPECT_EQ(-1e30f, B2(3));
+
+    // CF attributes
+    int nsb;
+    netCDF::NcVar ncA(ncio.nc->getVar("A"));
+    get_or_put_att(ncA, 'r', "quantization_nsb", "int", &nsb, 1);
+    EXPECT_EQ(nsd_to_nsb(3), nsb);
+    std::string algorithm;
+    netCDF::NcVar ncinfo(ncio.nc->getVar("quantization_info"));
+    get_or_put_att(ncinfo, 'r', "algorithm", algorithm);
+    EXPECT_EQ("bitround", algorithm);
+    EXPECT_EQ(0, ncio.nc->getVar("C").getAtts().count("quantization_nsb"));
+}
+
+TEST_F(NetcdfTest, mmap)
+{
+    blitz::Array<double,2> A(4,5);
+    std::vector<char> bytes;
+    for (int i=0; i<4; ++i)
+    for (int j=0; j<5; ++j) A(i,j) = i*10 + j;
+    for (int i=0; i<37; ++i) bytes.push_back(i*7);
+
+    for (std::string format : {"classic", "classic64", "nc4"}) {
+        std::string fname("__netcdf_mmap_test_" + format + ".nc");
+        tmpfiles.push_back(fname);
+        ::remove(fname.c_str());
+        {
+            ibmisc::NcIO ncio(fname, 'w', format, &NcIO::no_compress);
+            ncio_blitz(ncio, A, "A", "double", get_or_add_dims(ncio, A, {"dim4", "dim5"}));
+            ncio_vector(ncio, bytes, true, "bytes", "char",
+                get_or_add_dims(ncio, {"nbytes"}, {(long)bytes.size()}));
+        }
+
+        NcMappedVector<char> mbytes;
+#ifndef USE_HDF5
+        if (format == "nc4") {    // Needs HDF5 to find the data
+            EXPECT_FALSE(nc_map_vector(fname, "bytes", mbytes));
+            continue;
+        }
+#endif
+        EXPECT_TRUE(nc_map_vector(fname, "bytes", mbytes));
+        EXPECT_EQ(bytes, mbytes.to_vector());
+
+        // Classic files are big-endian: doubles can be viewed only in nc4
+        ibmisc::NcIO ncio(fname, 'r');
+        NcMappedArray<double,2> mA;
+        bool const mapped = nc_map_blitz(ncio, "A", mA);
+        NcVarLocation loc;
+        EXPECT_TRUE(nc_locate_var(fname, "A", loc));
+        EXPECT_EQ(loc.native_order, mapped);
+        if (mapped) {
+            EXPECT_EQ(4, mA.arr.extent(0));
+            EXPECT_EQ(5, mA.arr.extent(1));
+            for (int i=0; i<4; ++i)
+            for (int j=0; j<5; ++j) EXPECT_EQ(A(i,j), mA.arr(i,j));
+        }
+
+        // Wrong type, or not there
+        NcMappedVector<float> mfloat;
+        EXPECT_FALSE(nc_map_vector(fname, "A", mfloat));
+        EXPECT_FALSE(nc_map_vector(fname, "nonexistent", mbytes));
+    }
+}
+
+TEST_F(NetcdfTest, header_pad)
+{
+    blitz::Array<double,1> A(1000), B(10);
+    for (int i=0; i<1000; ++i) A(i) = i;
+    B = 17;
+
+    for (std::string format : {"classic", "classic64"}) {
+        std::string fname("__netcdf_header_pad_" + format + ".nc");
+        tmpfiles.push_back(fname);
+        ::remove(fname.c_str());
+
+        NcVarLocation loc0, loc1;
+        {ibmisc::NcIO ncio(fname, 'w', format);
+            ncio_blitz(ncio, A, "A", "double", get_or_add_dims(ncio, A, {"nA"}));
+        }
+        EXPECT_TRUE(nc_locate_var(fname, "A", loc0));
+        EXPECT_GE(loc0.offset, 64*1024);    // Header space reserved
+
+        // Variables added later fit in that space: A stays put
+        {ibmisc::NcIO ncio(fname, 'a', format);
+            for (int i=0; i<20; ++i) {
+                std::string const vname("B" + std::to_string(i));
+                ncio_blitz(ncio, B, vname, "double", get_or_add_dims(ncio, B, {"nB"}));
+                ncio.flush();
+            }
+        }
+        EXPECT_TRUE(nc_locate_var(fname, "A", loc1));
+        EXPECT_EQ(loc0.offset, loc1.offset);
+
+        {ibmisc::NcIO ncio(fname, 'r');
+            blitz::Array<double,1> A2(1000), B2(10);
+            ncio_blitz(ncio, A2, "A", "double", {});
+            ncio_blitz(ncio, B2, "B19", "double", {});
+            EXPECT_EQ(999., A2(999));
+            EXPECT_EQ(17., B2(9));
+        }
+    }
+}
+
+TEST_F(NetcdfTest, record_writer)
+{
+    for (bool background : {false, true}) {
+        std::string fname("__netcdf_record_writer_test.nc");
+        tmpfiles.push_back(fname);
+        ::remove(fname.c_str());
+
+        int const nrec = 5;
+        blitz::Array<double,2> T(3,4);
+        {
+            ibmisc::NcIO ncio(fname, 'w');
+            NcRecordWriter out(ncio, "time", background);
+            out.define<double,2>("T", {"jm", "im"}, {3, 4});
+            for (int t=0; t<nrec; ++t) {
+                T = t * 100 + blitz::tensor::i * 10 + blitz::tensor::j;
+                out.write("T", T);
+                out.end_record();    // T may be overwritten right after this
+            }
+            out.close();
+        }
+
+        ibmisc::NcIO ncio(fname, 'r');
+        auto T2(nc_read_blitz<double,3>(ncio.nc, "T"));
+        EXPECT_EQ(nrec, T2.extent(0));
+        for (int t=0; t<nrec; ++t) {
+        for (int j=0; j<3; ++j) {
+        for (int i=0; i<4; ++i) {
+            EXPECT_EQ(t*100 + j*10 + i, T2(t,j,i));
+        }}}
+    }
+}
+
+TEST_F(NetcdfTest, record_reader)
+{
+    std::string fname("__netcdf_record_reader_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    int const nrec = 6;
+    {
+        ibmisc::NcIO ncio(fname, 'w');
+        NcRecordWriter out(ncio, "time");
+        out.define<double,2>("T", {"jm", "im"}, {3, 4});
+        blitz::Array<double,2> T(3,4);
+        for (int t=0; t<nrec; ++t) {
+            T = t * 100 + blitz::tensor::i * 10 + blitz::tensor::j;
+            out.write("T", T);
+            out.end_record();
+        }
+        out.close();
+    }
+
+    for (int nahead : {0, 1, 3, 10}) {
+        ibmisc::NcIO ncio(fname, 'r');
+        NcRecordReader<double,2> in(ncio, "T", nahead, 1);
+        EXPECT_EQ(nrec, in.size());
+        int t = 1;
+        for (; !in.done(); ++t) {
+            EXPECT_EQ(t, in.record());
+            blitz::Array<double,2> const &T(in.next());
+            ASSERT_EQ(3, T.extent(0));
+            ASSERT_EQ(4, T.extent(1));
+            for (int j=0; j<3; ++j) {
+            for (int i=0; i<4; ++i) {
+                EXPECT_EQ(t*100 + j*10 + i, T(j,i));
+            }}
+        }
+        EXPECT_EQ(nrec, t);
+        EXPECT_THROW(in.next(), ibmisc::Exception);
+    }
+
+    // Stopping early leaves reads in flight; they finish on destruction
+    {
+        ibmisc::NcIO ncio(fname, 'r');
+        NcRecordReader<double,2> in(ncio, "T", 4);
+        EXPECT_EQ(0, in.next()(0,0));
+    }
+}
+
+TEST_F(NetcdfTest, async_flush)
+{
+    std::string fname("__netcdf_async_flush_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    blitz::Array<double,2> A(4,5);
+    for (int i=0; i<A.extent(0); ++i) {
+    for (int j=0; j<A.extent(1); ++j) {
+      A(i,j) = i*j;
+    }}
+    blitz::Array<double,1> C(17);
+    for (int i=0; i<C.extent(0); ++i) C(i) = 52 + i*2;
+
+    {
+        ibmisc::NcIO ncio(fname, 'w');
+        ncio.set_async();
+        EXPECT_TRUE(ncio.is_async());
+
+        auto dims = ibmisc::get_or_add_dims(ncio, A, {"dim4", "dim5"});
+        ncio_blitz(ncio, A, "A", "double", dims);
+        auto done(ncio.flush());
+
+        // Defining more variables waits for the flush in flight
+        auto dimsC = ibmisc::get_or_add_dims(ncio, C, {"dim17"});
+        EXPECT_EQ(std::future_status::ready, done.wait_for(std::chrono::seconds(0)));
+        ncio_blitz(ncio, C, "C", "double", dimsC);
+        ncio.close();
+    }
+
+    ibmisc::NcIO ncio(fname, 'r');
+    EXPECT_TRUE(blitz::all(A == nc_read_blitz<double,2>(ncio.nc, "A")));
+    EXPECT_TRUE(blitz::all(C == nc_read_blitz<double,1>(ncio.nc, "C")));
+}
+
+TEST_F(NetcdfTest, bulk_reader)
+{
+    // Two variables in each of three files
+    int const nfiles = 3;
+    std::vector<std::string> vars;
+    for (int f=0; f<nfiles; ++f) {
+        std::string fname("__netcdf_bulk_reader_test" + std::to_string(f) + ".nc");
+        tmpfiles.push_back(fname);
+        ::remove(fname.c_str());
+
+        blitz::Array<double,2> A(4,5);
+        blitz::Array<int,1> B(7);
+        A = f*1000 + blitz::tensor::i * 10 + blitz::tensor::j;
+        B = f*100 + blitz::tensor::i;
+        {ibmisc::NcIO ncio(fname, 'w');
+            ncio_blitz(ncio, A, "A", "double", get_or_add_dims(ncio, A, {"dim4", "dim5"}));
+            ncio_blitz(ncio, B, "B", "int", get_or_add_dims(ncio, B, {"dim7"}));
+        }
+        std::string const sf(std::to_string(f));
+        vars.insert(vars.end(), {"A"+sf, fname, "A", "B"+sf, fname, "B"});
+    }
+
+    CachedSearchPath const files("bulk_reader", {"."});
+    std::array<std::vector<blitz::Array<double,2>>, 2> As;
+    std::array<std::vector<blitz::Array<int,1>>, 2> Bs;
+    for (int k=0; k<2; ++k) {
+        // Preallocated: NcBulkReader binds a (shared-memory) copy of each array
+        for (int f=0; f<nfiles; ++f) {
+            As[k].push_back(blitz::Array<double,2>(4,5));
+            Bs[k].push_back(blitz::Array<int,1>(7));
+        }
+        NcBulkReader bulk(&files, vars);
+        bulk.nthreads = (k == 0 ? 1 : nfiles);
+        for (int f=0; f<nfiles; ++f) {
+            std::string const sf(std::to_string(f));
+            bulk("A"+sf, As[k][f])("B"+sf, Bs[k][f]);
+        }
+        bulk();
+        EXPECT_EQ(nfiles, bulk.timings.size());
+    }
+
+    // Concurrent read is identical to the serial one
+    for (int f=0; f<nfiles; ++f) {
+        EXPECT_TRUE(blitz::all(As[0][f] == As[1][f]));
+        EXPECT_TRUE(blitz::all(Bs[0][f] == Bs[1][f]));
+        EXPECT_EQ(f*1000 + 3*10 + 4, As[1][f](3,4));
+        EXPECT_EQ(f*100 + 6, Bs[1][f](6));
+    }
+}
+
+
 
 int main(int argc, char **argv) {
     // For test, configure Everytrace to silently throw exceptions (which we can catch)
@@ -0,0 +1,107 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Run with: mpirun -np 3 ibmisc_netcdf_par
+
+#include <mpi.h>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <ibmisc/netcdf.hpp>
+#include <ibmisc/indexing.hpp>
+
+using namespace ibmisc;
+
+static int const nj = 5;
+
+class NetcdfParTest : public ::testing::Test {
+protected:
+    int rank, size;
+    std::string const fname;
+
+    NetcdfParTest() : fname("__netcdf_par_test.nc")
+    {
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+    }
+
+    ~NetcdfParTest()
+    {
+        MPI_Barrier(MPI_COMM_WORLD);
+        if (rank == 0) ::remove(fname.c_str());
+    }
+
+    /** Uneven split of the rows: rank r has r+2 of them */
+    Domain domain(int r) const
+    {
+        long const i0 = r*(r+3)/2;
+        return Domain({i0, 0}, {i0 + r+2, nj});
+    }
+
+    long ni() const
+        { return domain(size-1)[0].end; }
+
+    static double val(int i, int j)
+        { return i*100 + j; }
+};
+
+TEST_F(NetcdfParTest, write_domains)
+{
+    Domain const dom(domain(rank));
+    int const nlocal = dom[0].end - dom[0].begin;
+
+    // Each rank writes its own rows, in Fortran order (staged)
+    {NcIO ncio(MPI_COMM_WORLD, fname, 'w');
+        EXPECT_TRUE(ncio.is_parallel());
+        auto dims(get_or_add_dims(ncio, {"i", "j"}, {ni(), nj}));
+        get_or_add_var(ncio, "A", "double", dims);
+
+        blitz::Array<double,2> A(nlocal, nj, blitz::fortranArray);
+        for (int i=0; i<nlocal; ++i)
+        for (int j=0; j<nj; ++j) A(i+1,j+1) = val(dom[0].begin + i, j);
+        ncio_blitz_partial(ncio, A, "A", "double", {}, dom.nc_start({0,1}, 2), {0,1});
+        ncio.close();
+    }
+
+    // Every rank reads back its neighbour's rows
+    Domain const dom2(domain((rank+1) % size));
+    int const nlocal2 = dom2[0].end - dom2[0].begin;
+    {NcIO ncio(MPI_COMM_WORLD, fname, 'r');
+        blitz::Array<double,2> A(nlocal2, nj);
+        ncio_blitz_partial(ncio, A, "A", "double", {}, dom2.nc_start({0,1}, 2), {0,1});
+        for (int i=0; i<nlocal2; ++i)
+        for (int j=0; j<nj; ++j) EXPECT_EQ(val(dom2[0].begin + i, j), A(i,j));
+    }
+
+    // And the whole thing, serially
+    if (rank == 0) {
+        NcIO ncio(fname, 'r');
+        blitz::Array<double,2> A;
+        ncio_blitz_alloc(ncio, A, "A", "double");
+        EXPECT_EQ(ni(), A.extent(0));
+        for (int i=0; i<ni(); ++i)
+        for (int j=0; j<nj; ++j) EXPECT_EQ(val(i,j), A(i,j));
+    }
+}
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+    ::testing::InitGoogleTest(&argc, argv);
+    int const ret = RUN_ALL_TESTS();
+    MPI_Finalize();
+    return ret;
+}
@@ -0,0 +1,99 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <ibmisc/parallel.hpp>
+#include <ibmisc/error.hpp>
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace ibmisc;
+
+class ParallelTest : public ::testing::Test {
+protected:
+    ~ParallelTest() { configure_threads(4); }
+};
+
+TEST_F(ParallelTest, task_group)
+{
+    std::vector<int> done(100, 0);
+    TaskGroup tg;
+    for (int i=0; i<100; ++i) tg.run([&done, i]{ done[i] = i; });
+    tg.wait();
+    for (int i=0; i<100; ++i) EXPECT_EQ(i, done[i]);
+
+    // The first task (in order of run()) that threw wins
+    for (int i=0; i<10; ++i) tg.run([i]{
+        if (i >= 3) throw std::runtime_error("task " + std::to_string(i));
+    });
+    try {
+        tg.wait();
+        FAIL();
+    } catch(std::runtime_error const &err) {
+        EXPECT_EQ(std::string("task 3"), err.what());
+    }
+
+    // Deferred errors too
+    for (int i=0; i<10; ++i) tg.run([i]{
+        if (i == 5 || i == 7) defer_error(-1, "task %d", i);
+    });
+    tg.wait();
+    EXPECT_EQ(std::string("task 5"), take_deferred_error().msg);
+    EXPECT_FALSE(has_deferred_error());
+}
+
+TEST_F(ParallelTest, nested)
+{
+    // Waiting tasks help run the inner loops, rather than deadlock
+    std::vector<long> sums(16, 0);
+    parallel_for(0, 16, 16, [&](long i0, long i1) {
+        for (long i=i0; i<i1; ++i) {
+            std::vector<long> part(1000, 0);
+            parallel_for(0, 1000, 8, [&](long j0, long j1) {
+                for (long j=j0; j<j1; ++j) part[j] = i*j;
+            });
+            sums[i] = std::accumulate(part.begin(), part.end(), 0L);
+        }
+    });
+    for (long i=0; i<16; ++i) EXPECT_EQ(i * 999*1000/2, sums[i]);
+}
+
+TEST_F(ParallelTest, budget)
+{
+    // Chunks depend on nthreads only; on one thread, all run here
+    for (int nthreads : {1, 3}) {
+        configure_threads(nthreads);
+        EXPECT_EQ(nthreads, thread_budget());
+
+        std::atomic<int> nchunks(0), nitems(0);
+        parallel_for(0, 1000, 8, [&](long i0, long i1) {
+            ++nchunks;
+            nitems += i1 - i0;
+        });
+        EXPECT_EQ(8, nchunks.load());
+        EXPECT_EQ(1000, nitems.load());
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -20,6 +20,7 @@
 
 #include <ibmisc/Test.hpp>
 #include <ibmisc/permutation.hpp>
+#include <ibmisc/radix_sort.hpp>
 #include <iostream>
 #include <memory>
 #include <random>
@@ -68,6 +69,50 @@ TEST_F(PermutationTest, sort_permutation)
     }
 }
 
+template<class KeyT>
+void check_radix_sort(std::mt19937 &engine, KeyT lo, KeyT hi, size_t N, int nthreads)
+{
+    std::uniform_int_distribution<long long> dist(lo, hi);
+    std::vector<KeyT> vec(N);
+    for (auto &v : vec) v = (KeyT)dist(engine);
+
+    std::vector<KeyT> expected(vec);
+    std::sort(expected.begin(), expected.end());
+    std::vector<KeyT> got(vec);
+    radix_sort(got, nthreads);
+    EXPECT_EQ(expected, got);
+
+    // The permutation comes out stable
+    std::vector<long> perm;
+    sorted_permutation(vec.begin(), vec.end(), perm, std::less<KeyT>(), nthreads);
+    ASSERT_EQ(N, perm.size());
+    for (size_t i=0; i<N; ++i) EXPECT_EQ(expected[i], vec[perm[i]]);
+    for (size_t i=1; i<N; ++i) {
+        if (vec[perm[i-1]] == vec[perm[i]]) EXPECT_LT(perm[i-1], perm[i]);
+    }
+}
+
+TEST_F(PermutationTest, radix_sort)
+{
+    std::mt19937 engine(17);
+    check_radix_sort<int>(engine, -1000, 1000, 5000, 1);
+    check_radix_sort<unsigned>(engine, 0, 4000000000u, 5000, 1);
+    check_radix_sort<long>(engine, -(1L<<40), 1L<<40, 5000, 1);
+    check_radix_sort<short>(engine, -30000, 30000, 5000, 1);
+
+    // Several chunks
+    check_radix_sort<long>(engine, -(1L<<50), 1L<<20, 300000, 4);
+    check_radix_sort<int>(engine, 0, 9, 300000, 3);
+
+    // Short vectors and other types fall back to std::sort()
+    std::vector<double> dvec {3., -1., 2.5, 0.};
+    fast_sort(dvec);
+    EXPECT_EQ(std::vector<double>({-1., 0., 2.5, 3.}), dvec);
+    std::vector<int> ivec {3, -1, 2, 0};
+    fast_sort(ivec);
+    EXPECT_EQ(std::vector<int>({-1, 0, 2, 3}), ivec);
+}
+
 // -----------------------------------------------------------
 
 int main(int argc, char **argv) {
@@ -0,0 +1,136 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <ibmisc/profile.hpp>
+#include <ibmisc/parallel.hpp>
+#include <sstream>
+
+using namespace ibmisc;
+
+class ProfileTest : public ::testing::Test {
+protected:
+    ProfileTest() { profile::reset(); }
+    ~ProfileTest() { profile::enable(false); profile::enable_hw_counters(false); }
+};
+
+static void inner()
+{
+    IBMISC_SCOPED_TIMER("inner");
+    profile::count("inner_calls");
+}
+
+static void outer()
+{
+    IBMISC_SCOPED_TIMER("outer");
+    inner();
+    inner();
+}
+
+TEST_F(ProfileTest, disabled)
+{
+    outer();
+    EXPECT_EQ(0, profile::regions().size());
+    EXPECT_EQ(0, profile::counters().size());
+}
+
+TEST_F(ProfileTest, nested)
+{
+    profile::enable(true, true);
+    outer();
+    {IBMISC_SCOPED_TIMER("outer.nop");}
+    inner();
+
+    auto const regs(profile::regions());
+    ASSERT_EQ(4, regs.size());
+    EXPECT_EQ("inner", regs[0].path);
+    EXPECT_EQ("outer", regs[1].path);
+    EXPECT_EQ("outer/inner", regs[2].path);    // Children follow parents
+    EXPECT_EQ("outer.nop", regs[3].path);
+    EXPECT_EQ(1, regs[1].calls);
+    EXPECT_EQ(2, regs[2].calls);
+    EXPECT_EQ(1, regs[2].depth);
+    EXPECT_LE(regs[2].total_s, regs[1].total_s);
+    EXPECT_NEAR(regs[1].total_s - regs[2].total_s, regs[1].self_s, 1e-9);
+    EXPECT_EQ(3, profile::counters().at("inner_calls"));
+
+    std::stringstream table, json, trace;
+    profile::report(table);
+    profile::write_json(json);
+    profile::write_chrome_trace(trace);
+    EXPECT_NE(std::string::npos, table.str().find("  inner"));
+    EXPECT_NE(std::string::npos, json.str().find("\"path\": \"outer/inner\""));
+    EXPECT_NE(std::string::npos, json.str().find("\"inner_calls\": 3"));
+    EXPECT_NE(std::string::npos, trace.str().find("\"ph\": \"X\""));
+}
+
+TEST_F(ProfileTest, threads)
+{
+    profile::enable();
+    parallel_for(0, 64, 4, [&](long i0, long i1) {
+        for (long i=i0; i<i1; ++i) outer();
+    });
+    auto const regs(profile::regions());
+    ASSERT_EQ(2, regs.size());
+    EXPECT_EQ(64, regs[0].calls);
+    EXPECT_EQ(128, regs[1].calls);
+    EXPECT_EQ(128, profile::counters().at("inner_calls"));
+}
+
+TEST_F(ProfileTest, hw_counters)
+{
+    profile::enable();
+    bool const hw = profile::enable_hw_counters();    // Often unavailable in VMs
+
+    std::vector<double> x(1 << 16, 1.0);
+    double sum = 0;
+    {IBMISC_SCOPED_TIMER("outer");
+        {IBMISC_SCOPED_TIMER("kernel");
+            for (double v : x) sum += v;
+            profile::work(x.size());
+        }
+        profile::work(10);
+    }
+    EXPECT_EQ(x.size(), sum);
+
+    auto const regs(profile::regions());
+    ASSERT_EQ(2, regs.size());
+    EXPECT_EQ(x.size() + 10, regs[0].nnz);    // Includes nested regions
+    EXPECT_EQ(x.size(), regs[1].nnz);
+
+    std::stringstream table, json;
+    profile::report(table);
+    profile::write_json(json);
+    EXPECT_NE(std::string::npos, json.str().find("\"nnz\": 65536"));
+    if (hw) {
+        EXPECT_EQ(1, regs[1].hw_calls);
+        EXPECT_GT(regs[1].instructions, x.size());
+        EXPECT_GT(regs[1].cycles, 0);
+        EXPECT_LE(regs[1].instructions, regs[0].instructions);
+        EXPECT_NE(std::string::npos, table.str().find("IPC"));
+        EXPECT_NE(std::string::npos, json.str().find("\"ipc\": "));
+    } else {
+        EXPECT_EQ(0, regs[1].hw_calls);
+        EXPECT_EQ(std::string::npos, table.str().find("IPC"));
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,147 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// https://github.com/google/googletest/blob/master/googletest/docs/Primer.md
+
+#include <gtest/gtest.h>
+#include <everytrace.h>
+#include <ibmisc/Proj2.hpp>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace ibmisc;
+
+static std::string const sproj("+proj=stere +lat_0=90 +lat_ts=71 +lon_0=-39 +k=1 +x_0=0 +y_0=0 +ellps=WGS84 +datum=WGS84 +units=m +no_defs");
+
+// The fixture for testing class Foo.
+class Proj2Test : public ::testing::Test {
+protected:
+    Proj2Test() {}
+
+    /** Random lon/lat points (degrees) over Greenland */
+    static void random_lonlat(long n, std::vector<double> &lon, std::vector<double> &lat)
+    {
+        std::mt19937 gen(17);
+        std::uniform_real_distribution<double> ulon(-75., -10.);
+        std::uniform_real_distribution<double> ulat(58., 84.);
+        lon.resize(n);
+        lat.resize(n);
+        for (long i=0; i<n; ++i) {
+            lon[i] = ulon(gen);
+            lat[i] = ulat(gen);
+        }
+    }
+};
+
+TEST_F(Proj2Test, batch_matches_scalar)
+{
+    Proj2 const ll2xy(sproj, Proj2::Direction::LL2XY);
+    Proj2 const xy2ll(sproj, Proj2::Direction::XY2LL);
+
+    // Large enough that nthreads > 1 really splits the points
+    long const n = 20000;
+    std::vector<double> lon, lat;
+    random_lonlat(n, lon, lat);
+
+    for (int nthreads : {1, 4}) {
+        std::vector<double> x(n), y(n);
+        EXPECT_EQ(0, ll2xy.transform(n, &lon[0], &lat[0], &x[0], &y[0], nthreads));
+
+        std::vector<double> lon1(x), lat1(y);    // In place
+        EXPECT_EQ(0, xy2ll.transform(n, &lon1[0], &lat1[0], &lon1[0], &lat1[0], nthreads));
+
+        for (long i=0; i<n; ++i) {
+            double xs, ys, lons, lats;
+            EXPECT_EQ(0, ll2xy.transform(lon[i], lat[i], xs, ys));
+            EXPECT_EQ(0, xy2ll.transform(xs, ys, lons, lats));
+            ASSERT_EQ(xs, x[i]);
+            ASSERT_EQ(ys, y[i]);
+            ASSERT_EQ(lons, lon1[i]);
+            ASSERT_EQ(lats, lat1[i]);
+
+            // And round trips
+            ASSERT_NEAR(lon[i], lon1[i], 1e-8);
+            ASSERT_NEAR(lat[i], lat1[i], 1e-8);
+        }
+    }
+
+    // blitz::Array version, with strided input
+    blitz::Array<double,2> ll(2, 100);
+    for (int i=0; i<100; ++i) {
+        ll(0,i) = lon[i];
+        ll(1,i) = lat[i];
+    }
+    blitz::Array<double,1> bx, by;
+    EXPECT_EQ(0, ll2xy.transform(ll(0, blitz::Range::all()), ll(1, blitz::Range::all()), bx, by));
+    ASSERT_EQ(100, bx.extent(0));
+    for (int i=0; i<100; ++i) {
+        double xs, ys;
+        ll2xy.transform(lon[i], lat[i], xs, ys);
+        EXPECT_EQ(xs, bx(i));
+        EXPECT_EQ(ys, by(i));
+    }
+}
+
+TEST_F(Proj2Test, concurrent_copies)
+{
+    long const n = 2000;
+    std::vector<double> lon, lat;
+    random_lonlat(n, lon, lat);
+
+    Proj2 const ll2xy(sproj, Proj2::Direction::LL2XY);
+    std::vector<double> x0(n), y0(n);
+    for (long i=0; i<n; ++i) ll2xy.transform(lon[i], lat[i], x0[i], y0[i]);
+
+    // Copies of one Proj2 (and the original) used on many threads at
+    // once, with scalar calls; each thread must get its own proj.4 state
+    int const nthreads = 8;
+    std::vector<Proj2> copies(nthreads, ll2xy);
+    std::vector<std::vector<double>> xs(nthreads, std::vector<double>(n)), ys(xs);
+    std::vector<int> errs(nthreads, 0);
+    std::vector<std::thread> threads;
+    for (int t=0; t<nthreads; ++t) threads.push_back(std::thread([&,t]() {
+        Proj2 const &proj(t % 2 == 0 ? ll2xy : copies[t]);
+        for (int rep=0; rep<5; ++rep) {
+            for (long i=0; i<n; ++i) {
+                errs[t] |= proj.transform(lon[i], lat[i], xs[t][i], ys[t][i]);
+            }
+        }
+    }));
+    for (auto &th : threads) th.join();
+
+    for (int t=0; t<nthreads; ++t) {
+        EXPECT_EQ(0, errs[t]);
+        EXPECT_EQ(x0, xs[t]);
+        EXPECT_EQ(y0, ys[t]);
+    }
+
+    // A Proj2 without a projection is an error, not a crash
+    Proj2 const none("", Proj2::Direction::LL2XY);
+    double x, y;
+    EXPECT_THROW(none.transform(0., 0., x, y), ibmisc::Exception);
+}
+
+int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,401 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// https://github.com/google/googletest/blob/master/googletest/docs/Primer.md
+
+#include <ibmisc/Test.hpp>
+#include <ibmisc/RTree.hpp>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <vector>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+
+using namespace ibmisc;
+
+// The fixture for testing class Foo.
+class RTreeTest : public ibmisc::Test {
+protected:
+
+    // You can do set-up work for each test here.
+    RTreeTest() : ibmisc::Test(false) {}    // keep=true
+
+    /** Random boxes in [0,100)^2 */
+    static std::vector<std::array<double,4>> random_boxes(int n)
+    {
+        std::mt19937 gen(17);
+        std::uniform_real_distribution<double> pos(0., 100.);
+        std::uniform_real_distribution<double> size(0., 3.);
+        std::vector<std::array<double,4>> boxes;
+        for (int i=0; i<n; ++i) {
+            double x = pos(gen), y = pos(gen);
+            boxes.push_back({x, y, x + size(gen), y + size(gen)});
+        }
+        return boxes;
+    }
+
+    /** Brute-force answer to a search */
+    static std::vector<long> brute_search(
+        std::vector<std::array<double,4>> const &boxes,
+        std::array<double,2> const &min, std::array<double,2> const &max)
+    {
+        std::vector<long> ret;
+        for (int i=0; i<boxes.size(); ++i) {
+            auto &b(boxes[i]);
+            if (b[0] <= max[0] && min[0] <= b[2] && b[1] <= max[1] && min[1] <= b[3])
+                ret.push_back(i);
+        }
+        return ret;
+    }
+};
+
+template<class RTreeT>
+static std::vector<long> tree_search(RTreeT &tree,
+    std::array<double,2> const &min, std::array<double,2> const &max)
+{
+    std::vector<long> ret;
+    tree.Search(min, max, [&](long id) { ret.push_back(id); return true; });
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+template<class RTreeT>
+static void insert_boxes(RTreeT &tree, std::vector<std::array<double,4>> const &boxes)
+{
+    for (int i=0; i<boxes.size(); ++i) {
+        auto &b(boxes[i]);
+        tree.Insert(&b[0], &b[2], i);
+    }
+}
+
+TEST_F(RTreeTest, pool_allocator)
+{
+    auto boxes(random_boxes(2000));
+    // (DATATYPE must be pointer-sized for Remove() to work.)
+    RTree<long, double, 2, double> tree;
+    RTree<long, double, 2, double, 8, 4, RTreeNewDelete> tree_nd;
+
+    for (int pass=0; pass<2; ++pass) {
+        insert_boxes(tree, boxes);
+        insert_boxes(tree_nd, boxes);
+        EXPECT_EQ(boxes.size(), tree.Count());
+
+        // Remove some, exercising the free list
+        for (int i=0; i<boxes.size(); i += 3) {
+            tree.Remove(&boxes[i][0], &boxes[i][2], i);
+            tree_nd.Remove(&boxes[i][0], &boxes[i][2], i);
+        }
+
+        std::array<double,2> min{{20.,30.}}, max{{45.,40.}};
+        auto expected(brute_search(boxes, min, max));
+        expected.erase(std::remove_if(expected.begin(), expected.end(),
+            [](long i) { return i%3 == 0; }), expected.end());
+        EXPECT_EQ(expected, tree_search(tree, min, max));
+        EXPECT_EQ(expected, tree_search(tree_nd, min, max));
+
+        // Second pass re-uses the pool's memory
+        tree.RemoveAll();
+        tree_nd.RemoveAll();
+        EXPECT_EQ(0, tree.Count());
+        EXPECT_EQ(0, tree_nd.Count());
+    }
+}
+
+TEST_F(RTreeTest, bulk_load)
+{
+    for (int n : {0, 5, 8, 9, 100, 5000}) {
+        auto boxes(random_boxes(n));
+        std::vector<double> min, max;
+        std::vector<long> ids;
+        for (int i=0; i<n; ++i) {
+            min.push_back(boxes[i][0]); min.push_back(boxes[i][1]);
+            max.push_back(boxes[i][2]); max.push_back(boxes[i][3]);
+            ids.push_back(i);
+        }
+
+        RTree<long, double, 2, double> tree;
+        tree.BulkLoad(n, min.data(), max.data(), ids.data());
+        EXPECT_EQ(n, tree.Count());
+
+        std::array<double,2> qmin{{10.,10.}}, qmax{{60.,25.}};
+        EXPECT_EQ(brute_search(boxes, qmin, qmax), tree_search(tree, qmin, qmax));
+
+        // Still a normal, modifiable tree
+        if (n > 0) {
+            tree.Remove(&boxes[0][0], &boxes[0][2], 0);
+            tree.Insert(&boxes[0][0], &boxes[0][2], 0);
+        }
+        EXPECT_EQ(n, tree.Count());
+        EXPECT_EQ(brute_search(boxes, qmin, qmax), tree_search(tree, qmin, qmax));
+    }
+}
+
+TEST_F(RTreeTest, freeze)
+{
+    auto boxes(random_boxes(3000));
+    RTree<long, double, 2, double> tree;
+    insert_boxes(tree, boxes);
+
+    FlatRTree<long, double, 2, 8> flat;
+    tree.Freeze(flat);
+    EXPECT_EQ(tree.Count(), flat.Count());
+
+    for (auto &q : random_boxes(50)) {
+        std::array<double,2> qmin{{q[0],q[1]}}, qmax{{q[2]+5.,q[3]+5.}};
+
+        // Same hits, in the same order
+        std::vector<long> expected, got;
+        tree.Search(qmin, qmax, [&](long id) { expected.push_back(id); return true; });
+        int n = flat.Search(qmin, qmax, [&](long id) { got.push_back(id); return true; });
+        EXPECT_EQ(expected, got);
+        EXPECT_EQ(expected.size(), n);
+    }
+
+    // Early termination
+    std::array<double,2> qmin{{0.,0.}}, qmax{{100.,100.}};
+    int n = flat.Search(qmin, qmax, [](long id) { return false; });
+    EXPECT_EQ(1, n);
+
+    // Empty tree
+    RTree<long, double, 2, double> empty;
+    empty.Freeze(flat);
+    EXPECT_EQ(0, flat.Count());
+    EXPECT_EQ(0, flat.Search(qmin, qmax, [](long id) { return true; }));
+}
+
+TEST_F(RTreeTest, search_batch)
+{
+    auto boxes(random_boxes(3000));
+    RTree<long, double, 2, double> tree;
+    insert_boxes(tree, boxes);
+    FlatRTree<long, double, 2, 8> flat;
+    tree.Freeze(flat);
+
+    auto queries(random_boxes(101));
+    std::vector<double> qmin, qmax;
+    for (auto &q : queries) {
+        qmin.push_back(q[0]); qmin.push_back(q[1]);
+        qmax.push_back(q[2]+4.); qmax.push_back(q[3]+4.);
+    }
+
+    for (int nthreads : {1, 4}) {
+        std::vector<long> offsets;
+        std::vector<long> hits;
+        flat.SearchBatch(queries.size(), &qmin[0], &qmax[0], offsets, hits, nthreads);
+        ASSERT_EQ(queries.size()+1, offsets.size());
+        EXPECT_EQ(hits.size(), offsets.back());
+
+        for (int q=0; q<queries.size(); ++q) {
+            std::vector<long> expected;
+            flat.Search({{qmin[2*q], qmin[2*q+1]}}, {{qmax[2*q], qmax[2*q+1]}},
+                [&](long id) { expected.push_back(id); return true; });
+            std::vector<long> got(hits.begin() + offsets[q], hits.begin() + offsets[q+1]);
+            EXPECT_EQ(expected, got);
+        }
+    }
+}
+
+TEST_F(RTreeTest, save_map)
+{
+    std::string fname(tmp_fname("__rtree_flat.bin"));
+
+    auto boxes(random_boxes(3000));
+    RTree<long, double, 2, double> tree;
+    insert_boxes(tree, boxes);
+    FlatRTree<long, double, 2, 8> flat;
+    tree.Freeze(flat);
+    EXPECT_TRUE(flat.Save(fname.c_str()));
+
+    FlatRTree<long, double, 2, 8> mapped;
+    EXPECT_TRUE(mapped.Map(fname.c_str()));
+    EXPECT_EQ(flat.Count(), mapped.Count());
+    EXPECT_EQ(flat.NodeCount(), mapped.NodeCount());
+
+    FlatRTree<long, double, 2, 8> copy(mapped);    // Shares the mapping
+    mapped.Assign({}, {});
+    for (auto &q : random_boxes(20)) {
+        std::array<double,2> qmin{{q[0],q[1]}}, qmax{{q[2]+5.,q[3]+5.}};
+        std::vector<long> expected, got;
+        flat.Search(qmin, qmax, [&](long id) { expected.push_back(id); return true; });
+        copy.Search(qmin, qmax, [&](long id) { got.push_back(id); return true; });
+        EXPECT_EQ(expected, got);
+    }
+
+    // Wrong template parameters
+    FlatRTree<long, float, 2, 8> wrong;
+    EXPECT_FALSE(wrong.Map(fname.c_str()));
+    EXPECT_FALSE(wrong.Map("__rtree_nonexistent.bin"));
+}
+
+TEST_F(RTreeTest, map_corrupt)
+{
+    typedef FlatRTree<long, double, 2, 8> FlatT;
+    std::string fname(tmp_fname("__rtree_flat_corrupt.bin"));
+    std::string cname(tmp_fname("__rtree_flat_corrupt2.bin"));
+
+    auto boxes(random_boxes(300));
+    RTree<long, double, 2, double> tree;
+    insert_boxes(tree, boxes);
+    FlatT flat;
+    tree.Freeze(flat);
+    ASSERT_TRUE(flat.Save(fname.c_str()));
+
+    std::vector<char> good;
+    {FILE *fin = fopen(fname.c_str(), "rb");
+        int c;
+        while ((c = fgetc(fin)) != EOF) good.push_back(c);
+        fclose(fin);
+    }
+
+    // Maps a copy of the file, with bytes [offset, offset+n) replaced
+    auto map_modified = [&](long offset, void const *val, size_t n, long len) {
+        std::vector<char> bytes(good.begin(), good.begin() + len);
+        if (val) memcpy(&bytes[offset], val, n);
+        FILE *fout = fopen(cname.c_str(), "wb");
+        fwrite(&bytes[0], 1, bytes.size(), fout);
+        fclose(fout);
+        FlatT mapped;
+        return mapped.Map(cname.c_str());
+    };
+    long const len = good.size();
+    EXPECT_TRUE(map_modified(0, NULL, 0, len));
+
+    // Truncated
+    EXPECT_FALSE(map_modified(0, NULL, 0, len-1));
+    EXPECT_FALSE(map_modified(0, NULL, 0, 40));
+
+    // Header counts: negative, huge (overflowing) and too large
+    long const node_count_at = 32, data_count_at = 40;
+    for (int64_t count : {int64_t(-1), int64_t(1)<<61, int64_t(1)<<40,
+        int64_t(flat.NodeCount()+1)})
+    {
+        EXPECT_FALSE(map_modified(node_count_at, &count, sizeof(count), len));
+    }
+    for (int64_t count : {int64_t(-1), int64_t(1)<<61, int64_t(flat.Count()+1)}) {
+        EXPECT_FALSE(map_modified(data_count_at, &count, sizeof(count), len));
+    }
+
+    // Nodes: bad child counts, child ranges and levels
+    long const node0 = 64;
+    long const first_at = node0 + offsetof(FlatT::Node, m_first);
+    long const count_at = node0 + offsetof(FlatT::Node, m_count);
+    long const level_at = node0 + offsetof(FlatT::Node, m_level);
+    ASSERT_GT(flat.Nodes()[0].m_level, 0);
+    for (int v : {-1, 9}) EXPECT_FALSE(map_modified(count_at, &v, sizeof(v), len));
+    for (int v : {-5, 0, (int)flat.NodeCount()}) EXPECT_FALSE(map_modified(first_at, &v, sizeof(v), len));
+    for (int v : {-1, flat.Nodes()[0].m_level+1, 100}) EXPECT_FALSE(map_modified(level_at, &v, sizeof(v), len));
+
+    // A leaf pointing past the data
+    long ileaf = flat.NodeCount()-1;
+    ASSERT_EQ(0, flat.Nodes()[ileaf].m_level);
+    int const past = flat.Count();
+    EXPECT_FALSE(map_modified(node0 + ileaf*sizeof(FlatT::Node) + offsetof(FlatT::Node, m_first),
+        &past, sizeof(past), len));
+}
+
+TEST_F(RTreeTest, nearest)
+{
+    auto boxes(random_boxes(3000));
+    RTree<long, double, 2, double> tree;
+    insert_boxes(tree, boxes);
+    FlatRTree<long, double, 2, 8> flat;
+    tree.Freeze(flat);
+
+    // Brute-force distances from a point to every box
+    RTreeEuclidean<double,2> const dist;
+    auto brute = [&](std::array<double,2> const &p) {
+        std::vector<std::pair<double,long>> ret;
+        for (int i=0; i<boxes.size(); ++i)
+            ret.push_back(std::make_pair(dist(p, {{boxes[i][0], boxes[i][1]}}, {{boxes[i][2], boxes[i][3]}}), i));
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    };
+
+    std::vector<double> points;
+    for (auto &q : random_boxes(50)) { points.push_back(q[0]); points.push_back(q[1] + 110.); }
+    for (int q=0; q<50; ++q) {
+        std::array<double,2> const p{{points[2*q], points[2*q+1]}};
+        auto const expected(brute(p));
+
+        std::vector<std::pair<double,long>> hits;
+        EXPECT_EQ(7, flat.Nearest(p, 7, hits));
+        ASSERT_EQ(7, hits.size());
+        for (int k=0; k<7; ++k) EXPECT_DOUBLE_EQ(expected[k].first, hits[k].first);
+
+        double const radius = expected[20].first;
+        flat.Within(p, radius, hits);
+        int n = 0;
+        while (n < expected.size() && expected[n].first <= radius) ++n;
+        ASSERT_EQ(n, hits.size());
+        for (int k=1; k<n; ++k) EXPECT_LE(hits[k-1].first, hits[k].first);
+    }
+
+    // Batched form agrees with one query at a time
+    for (int nthreads : {1, 4}) {
+        std::vector<long> offsets, ids;
+        std::vector<double> dists;
+        flat.NearestBatch(50, &points[0], 5, 30., offsets, ids, &dists, nthreads);
+        ASSERT_EQ(51, offsets.size());
+        for (int q=0; q<50; ++q) {
+            std::vector<std::pair<double,long>> hits;
+            flat.Nearest({{points[2*q], points[2*q+1]}}, 5, hits, 30.);
+            ASSERT_EQ(hits.size(), offsets[q+1] - offsets[q]);
+            for (int k=0; k<hits.size(); ++k) {
+                EXPECT_EQ(hits[k].second, ids[offsets[q]+k]);
+                EXPECT_EQ(hits[k].first, dists[offsets[q]+k]);
+            }
+        }
+    }
+}
+
+TEST_F(RTreeTest, nearest_haversine)
+{
+    // Points on a lon/lat grid, including both sides of the dateline
+    RTree<int, double, 2, double> tree;
+    std::vector<std::array<double,2>> lonlat;
+    for (int lon=-180; lon<180; lon += 10)
+    for (int lat=-80; lat<=80; lat += 10) {
+        std::array<double,2> const p{{(double)lon, (double)lat}};
+        tree.Insert(&p[0], &p[0], lonlat.size());
+        lonlat.push_back(p);
+    }
+    FlatRTree<int, double, 2, 8> flat;
+    tree.Freeze(flat);
+
+    RTreeHaversine const hav;
+    for (auto const &p : std::vector<std::array<double,2>>{{{178., 3.}}, {{-177., -79.}}, {{33., 88.}}, {{0., 0.}}}) {
+        std::vector<double> expected;
+        for (auto const &q : lonlat) expected.push_back(haversine_distance(p[0], p[1], q[0], q[1]));
+        std::sort(expected.begin(), expected.end());
+
+        std::vector<std::pair<double,int>> hits;
+        flat.Nearest(p, 6, hits, std::numeric_limits<double>::max(), hav);
+        ASSERT_EQ(6, hits.size());
+        for (int k=0; k<6; ++k) EXPECT_NEAR(expected[k], hits[k].first, 1e-10);
+    }
+}
+
+// -----------------------------------------------------------
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -156,71 +156,47 @@ void _test_online_int(std::vector<int> const &vals)
 }
 
 
-void _test_rl_vector_int(std::vector<int> const &vals)
-{
-    RLVector<int,int> rlv(RLAlgo::DIFFS);
-
-    // Encode
-    {auto vaccum(rlv.vaccum());
-        for (auto val : vals) vaccum.add(val);
-    }
-
-    // Decode
-    std::vector<int> vals2;
-    for (auto gen(rlv.generator()); ++gen; ) {
-        vals2.push_back(*gen);
-    }
-
-    // Compare
-    EXPECT_EQ(vals2.size(), vals.size());
-    for (int i=0; i<vals2.size(); ++i) {
-        EXPECT_EQ(vals[i], vals2[i]);
-    }
-
-#if 0
-    cout << "test_rl_vector_int " << vals << endl;
-    cout << "test_rl_vector_int " << vals2 << endl;
-#endif
-}
-
-void _test_rl_vector_double(std::vector<double> const &vals)
+template<class TypeT>
+void _test_rl_array(std::vector<TypeT> const &vals)
 {
-    RLVector<int,double> rlv(RLAlgo::PLAIN);
+    DefaultRLEqual<TypeT> eq;
+    RLArray<int,TypeT,1> rla({(long)vals.size()});
 
     // Encode
-    {auto vaccum(rlv.vaccum());
-        for (auto val : vals) vaccum.add(val);
+    {auto accum(rla.accum());
+        for (size_t i=0; i<vals.size(); ++i) accum.add({(int)i}, vals[i]);
     }
+    EXPECT_EQ(vals.size(), rla.nnz());
 
     // Decode
-    std::vector<double> vals2;
-    for (auto gen(rlv.generator()); ++gen; ) {
-        vals2.push_back(*gen);
+    std::vector<TypeT> vals2;
+    int i = 0;
+    for (auto gen(rla.generator()); ++gen; ++i) {
+        EXPECT_EQ(i, gen.index(0));
+        vals2.push_back(gen.value());
     }
 
     // Compare
     EXPECT_EQ(vals2.size(), vals.size());
-    for (int i=0; i<vals2.size(); ++i) {
-        EXPECT_TRUE(eq_double(vals[i], vals2[i]));
+    for (size_t i=0; i<vals2.size(); ++i) {
+        EXPECT_TRUE(eq(vals[i], vals2[i]));
     }
 
-#if 0
-    cout << "test_rl_vector_double " << vals << endl;
-    cout << "test_rl_vector_double " << vals2 << endl;
-#endif
+    // Consecutive indices difference-encode to (at most) two runs
+    EXPECT_LE(rla.nruns(), 2 + (long)vals.size());
 }
 
 
 template<class TypeT>
-void _test_rl_vector_netcdf(std::string const &fnm, RunlengthTest &self, std::vector<TypeT> const &vals, RLAlgo algo)
+void _test_rl_array_netcdf(std::string const &fnm, RunlengthTest &self, std::vector<TypeT> const &vals)
 {
     DefaultRLEqual<TypeT> eq;
 
-    RLVector<int,TypeT> rlv(algo);
+    RLArray<int,TypeT,1> rla({(long)vals.size()});
 
     // Encode
-    {auto vaccum(rlv.vaccum());
-        for (auto val : vals) vaccum.add(val);
+    {auto accum(rla.accum());
+        for (size_t i=0; i<vals.size(); ++i) accum.add({(int)i}, vals[i]);
     }
 
     // Store
@@ -228,32 +204,28 @@ void _test_rl_vector_netcdf(std::string const &fnm, RunlengthTest &self, std::ve
     self.tmpfiles.push_back(fname);
     ::remove(fname.c_str());
     {NcIO ncio(fname, 'w');
-        rlv.ncio(ncio, "vals");
+        rla.ncio(ncio, "vals");
     }
 
     // Load
-    RLVector<int,TypeT> rlv2;
+    RLArray<int,TypeT,1> rla2;
     {NcIO ncio(fname, 'r');
-        rlv2.ncio(ncio, "vals");
+        rla2.ncio(ncio, "vals");
     }
+    EXPECT_EQ(rla.nnz(), rla2.nnz());
+    EXPECT_EQ(rla.shape(), rla2.shape());
 
     // Decode
+    std::array<std::vector<int>,1> indices;
     std::vector<TypeT> vals2;
-    for (auto gen(rlv2.generator()); ++gen; ) {
-        vals2.push_back(*gen);
-    }
+    rla2.decode(indices, vals2);
 
     // Compare
     EXPECT_EQ(vals2.size(), vals.size());
-    for (int i=0; i<vals2.size(); ++i) {
-        bool x = eq(vals[i], vals2[i]);
+    for (size_t i=0; i<vals2.size(); ++i) {
+        EXPECT_EQ(i, indices[0][i]);
         EXPECT_TRUE(eq(vals[i], vals2[i]));
     }
-
-#if 0
-    cout << "test_rl_vector_netcdf " << vals << endl;
-    cout << "test_rl_vector_netcdf " << vals2 << endl;
-#endif
 }
 
 
@@ -264,8 +236,8 @@ TEST_F(RunlengthTest, double)
     };
     for (auto &vals : dvalss) {
         _test_online_double(vals);
-        _test_rl_vector_double(vals);
-        _test_rl_vector_netcdf<double>("double", *this, vals, RLAlgo::PLAIN);
+        _test_rl_array<double>(vals);
+        _test_rl_array_netcdf<double>("double", *this, vals);
     }
 }
 
@@ -276,13 +248,54 @@ TEST_F(RunlengthTest, int)
     };
     for (auto &vals : ivalss) {
         _test_online_int(vals);
-        _test_rl_vector_int(vals);
-        _test_rl_vector_netcdf<int>("int", *this, vals, RLAlgo::DIFFS);
+        _test_rl_array<int>(vals);
+        _test_rl_array_netcdf<int>("int", *this, vals);
+    }
+}
+
+template<class TypeT>
+void _test_bulk(std::vector<TypeT> const &vals, RLAlgo algo)
+{
+    DefaultRLEqual<TypeT> eq;
+
+    // Online, for reference
+    std::vector<int> enc_counts;
+    std::vector<TypeT> enc_values;
+    {auto rle(rl_encode(
+        vaccum::vector(enc_counts), vaccum::vector(enc_values), algo));
+        for (auto v : vals) rle.add(v);
     }
+
+    // Bulk encode must give the same runs
+    std::vector<int> counts;
+    std::vector<TypeT> values;
+    size_t const nruns = rl_encode_bulk(&vals[0], vals.size(), counts, values, algo);
+    EXPECT_EQ(enc_counts.size(), nruns);
+    EXPECT_EQ(enc_counts, counts);
+    for (size_t i=0; i<nruns; ++i) EXPECT_TRUE(eq(enc_values[i], values[i]));
+
+    // Bulk decode
+    std::vector<TypeT> vals2(rl_decoded_size(&counts[0], nruns));
+    EXPECT_EQ(vals.size(), rl_decode_bulk(&counts[0], &values[0], nruns, &vals2[0], algo));
+    for (size_t i=0; i<vals.size(); ++i) EXPECT_TRUE(eq(vals[i], vals2[i]));
 }
 
+TEST_F(RunlengthTest, bulk)
+{
+    // Long runs, to cross the 8-at-a-time scan
+    std::vector<double> dvals {1.1, 4.0, NaN, NaN, 3.0, 3.0, 3.0};
+    for (int i=0; i<20; ++i) dvals.push_back(NaN);
+    for (int i=0; i<13; ++i) dvals.push_back(2.0);
+    dvals.push_back(5.0);
+    _test_bulk<double>(dvals, RLAlgo::PLAIN);
+
+    std::vector<int> ivals {1, 2, 3, 6, 7, 9, 10, 11, 17};
+    for (int i=0; i<30; ++i) ivals.push_back(17 + 2*i);
+    _test_bulk<int>(ivals, RLAlgo::DIFFS);
+    _test_bulk<int>(ivals, RLAlgo::PLAIN);
+}
 
-TEST_F(RunlengthTest, RLSparseArray1)
+TEST_F(RunlengthTest, RLArray2)
 {
     // Set up a TupleList
     TupleList<int, double, 2> arr1({400,400});
@@ -300,23 +313,31 @@ TEST_F(RunlengthTest, RLSparseArray1)
     arr1.add({2,27}, 1.9);
 
     // Runlength-Compress it
-    RLSparseArray<int,int,double,2> rl1(arr1.shape());
+    RLArray<int,double,2> rl1(arr1.shape());
     {auto accum(rl1.accum());
         for (auto &tup : arr1) accum.add(tup.index(), tup.value());
     }
 
+    EXPECT_EQ(arr1.size(), rl1.nnz());
+    EXPECT_LT(rl1.nruns(), 3*rl1.nnz());
+
     // Store it
-    std::string fname("__runlength_sparsearray1.nc");
+    std::string fname("__runlength_rlarray2.nc");
     tmpfiles.push_back(fname);
     ::remove(fname.c_str());
     {NcIO ncio(fname, 'w');
         rl1.ncio(ncio, "vals");
     }
 
+    // Read it back
+    RLArray<int,double,2> rl2;
+    {NcIO ncio(fname, 'r');
+        rl2.ncio(ncio, "vals");
+    }
 
     // Uncompress it
-    TupleList<int,double,2> arr2(rl1.shape());
-    for (auto ii(rl1.generator()); ++ii; ) {
+    TupleList<int,double,2> arr2(rl2.shape());
+    for (auto ii(rl2.generator()); ++ii; ) {
         arr2.add(ii.index(), ii.value());
     }
 
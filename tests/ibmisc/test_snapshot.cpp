@@ -0,0 +1,161 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// https://github.com/google/googletest/blob/master/googletest/docs/Primer.md
+
+#include <gtest/gtest.h>
+#include <ibmisc/snapshot.hpp>
+#include <ibmisc/indexing.hpp>
+#include <ibmisc/linear/eigen.hpp>
+#include <ibmisc/linear/tuple.hpp>
+#include <spsparse/SparseSet.hpp>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <everytrace.h>
+
+using namespace std;
+using namespace ibmisc;
+
+// The fixture for testing class Foo.
+class SnapshotTest : public ::testing::Test {
+protected:
+    std::vector<std::string> tmpfiles;
+
+    // You can do set-up work for each test here.
+    SnapshotTest() {}
+
+    // You can do clean-up work that doesn't throw exceptions here.
+    virtual ~SnapshotTest()
+    {
+        for (auto ii(tmpfiles.begin()); ii != tmpfiles.end(); ++ii) {
+            ::remove(ii->c_str());
+        }
+    }
+};
+
+TEST_F(SnapshotTest, basic)
+{
+    std::string const fname("__snapshot_basic.snap");
+    tmpfiles.push_back(fname);
+
+    std::vector<std::string> names {"alpha", "", "gamma"};
+    std::vector<std::array<int,2>> pairs {{1,2}, {3,4}, {-5,6}};
+    blitz::Array<double,2> arr(blitz::Range(2,4), blitz::Range(-1,0), blitz::fortranArray);
+    for (int i=2; i<=4; ++i)
+    for (int j=-1; j<=0; ++j) arr(i,j) = 10*i + j;
+
+    Indexing indexing({"i", "j"}, {0, 0}, {3, 4}, {1, 0});
+    Domain domain({0, 1}, {3, 4});
+
+    {SnapshotWriter snap(fname);
+        snap.add("names", names);
+        snap.add("pairs", pairs);
+        snap.add("arr", arr);
+        snap.add("indexing", indexing);
+        snap.add("domain", domain);
+    }
+
+    Snapshot snap(fname);
+    EXPECT_TRUE(snap.has("pairs"));
+    EXPECT_FALSE(snap.has("nothing"));
+    EXPECT_EQ(5, snap.names().size());
+
+    std::vector<std::string> names2;
+    snap.get("names", names2);
+    EXPECT_EQ(names, names2);
+
+    std::vector<std::array<int,2>> pairs2;
+    snap.get("pairs", pairs2);
+    EXPECT_EQ(pairs, pairs2);
+
+    blitz::Array<double,2> arr2;
+    snap.get("arr", arr2);
+    EXPECT_EQ(2, arr2.lbound(0));
+    EXPECT_EQ(-1, arr2.lbound(1));
+    EXPECT_EQ(arr.ordering(0), arr2.ordering(0));
+    for (int i=2; i<=4; ++i)
+    for (int j=-1; j<=0; ++j) EXPECT_EQ(arr(i,j), arr2(i,j));
+
+    Indexing indexing2;
+    snap.get("indexing", indexing2);
+    EXPECT_TRUE(indexing == indexing2);
+    EXPECT_EQ(indexing.extent(), indexing2.extent());
+    EXPECT_EQ(indexing[1].stride(), indexing2[1].stride());
+
+    Domain domain2;
+    snap.get("domain", domain2);
+    EXPECT_TRUE(domain == domain2);
+
+    // Wrong type: section not used up
+    std::vector<int> wrong;
+    EXPECT_THROW(snap.get("names", wrong), ibmisc::Exception);
+}
+
+TEST_F(SnapshotTest, weighted)
+{
+    std::string const fname("__snapshot_weighted.snap");
+    tmpfiles.push_back(fname);
+
+    linear::Weighted_Tuple BvA(false);
+    BvA.set_shape({10, 20});
+    BvA.M.add({1,3}, 2.);
+    BvA.M.add({1,7}, .5);
+    BvA.M.add({8,19}, 4.);
+    BvA.wM.add({1}, 2.5);
+    BvA.wM.add({8}, 4.);
+    for (int j : {3,7,19}) BvA.Mw.add({j}, 1.);
+    auto eigen(to_eigen(BvA));
+
+    {SnapshotWriter snap(fname);
+        snap.add("BvA_tuple", BvA);
+        snap.add("BvA", *eigen);
+        snap.add("dimA", *eigen->dims[1]);
+    }
+
+    Snapshot snap(fname);
+    linear::Weighted_Tuple BvA2;
+    snap.get("BvA_tuple", BvA2);
+    EXPECT_EQ(BvA.M.tuples, BvA2.M.tuples);
+    EXPECT_EQ(BvA.wM.tuples, BvA2.wM.tuples);
+
+    linear::Weighted_Eigen eigen2;
+    snap.get("BvA", eigen2);
+    EXPECT_EQ(eigen->conservative, eigen2.conservative);
+    EXPECT_TRUE(*eigen->dims[0] == *eigen2.dims[0]);
+    EXPECT_TRUE(*eigen->dims[1] == *eigen2.dims[1]);
+    EXPECT_EQ(eigen->nnz(), eigen2.nnz());
+    EXPECT_EQ(0., ((*eigen->M) - (*eigen2.M)).norm());
+    for (int i=0; i<eigen->wM.extent(0); ++i) EXPECT_EQ(eigen->wM(i), eigen2.wM(i));
+    for (int j=0; j<eigen->Mw.extent(0); ++j) EXPECT_EQ(eigen->Mw(j), eigen2.Mw(j));
+
+    // SparseSet lookups work after loading
+    spsparse::SparseSet<long,int> dimA;
+    snap.get("dimA", dimA);
+    EXPECT_EQ(eigen->dims[1]->to_dense(7), dimA.to_dense(7));
+    EXPECT_EQ(20, dimA.sparse_extent());
+}
+
+int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
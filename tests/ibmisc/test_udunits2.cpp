@@ -0,0 +1,132 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <ibmisc/udunits2.hpp>
+#include <ibmisc/bundle.hpp>
+#include <ibmisc/parallel.hpp>
+#include <cmath>
+#include <everytrace.h>
+
+using namespace ibmisc;
+
+class UDUnits2Test : public ::testing::Test {
+protected:
+    UTSystem ut_system;
+    UDUnits2Test() : ut_system("") {}
+};
+
+TEST_F(UDUnits2Test, linear)
+{
+    UnitConverter kc(ut_system.parse("K"), ut_system.parse("degC"));
+    EXPECT_TRUE(kc.is_linear());
+    EXPECT_DOUBLE_EQ(1., kc.scale());
+    EXPECT_DOUBLE_EQ(-273.15, kc.offset());
+
+    UnitConverter mkm(ut_system.parse("m"), ut_system.parse("km"));
+    EXPECT_TRUE(mkm.is_linear());
+    EXPECT_DOUBLE_EQ(1e-3, mkm.scale());
+    EXPECT_EQ(0., mkm.offset());
+
+    // Logarithmic: not linear, but still converts
+    UnitConverter ln(ut_system.parse("1"), ut_system.parse("lg(re 1)"));
+    EXPECT_FALSE(ln.is_linear());
+    EXPECT_DOUBLE_EQ(2., ln.convert(100.));
+}
+
+TEST_F(UDUnits2Test, arrays)
+{
+    UnitConverter kc(ut_system.parse("K"), ut_system.parse("degC"));
+    CVConverter cv(ut_system.parse("K"), ut_system.parse("degC"));
+
+    blitz::Array<double,2> in(5,7), out(5,7);
+    for (int i=0; i<5; ++i)
+    for (int j=0; j<7; ++j) in(i,j) = 250. + i*10 + j;
+
+    kc.convert(in, out);
+    for (int i=0; i<5; ++i)
+    for (int j=0; j<7; ++j) EXPECT_NEAR(cv.convert(in(i,j)), out(i,j), 1e-12);
+
+    // Non-contiguous, and in place
+    blitz::Array<double,2> sub(in(blitz::Range(1,3), blitz::Range::all()));
+    blitz::Array<double,2> subT(sub.transpose(1,0));
+    kc.convert(subT);
+    EXPECT_DOUBLE_EQ(250. + 20 + 3 - 273.15, in(2,3));
+    EXPECT_DOUBLE_EQ(250. + 3, in(0,3));
+}
+
+TEST_F(UDUnits2Test, cache)
+{
+    ConverterCache cache(&ut_system);
+    UnitConverter const &c1(cache.get("m", "km"));
+    UnitConverter const &c2(cache.get("m", "km"));
+    EXPECT_EQ(&c1, &c2);
+    EXPECT_NE(&c1, &cache.get("km", "m"));
+    EXPECT_DOUBLE_EQ(2., cache.convert("m", "km", 2000.));
+
+    // Concurrent lookups all get the same converter
+    std::vector<UnitConverter const *> got(64);
+    parallel_for(0, (long)got.size(), 4, [&](long i0, long i1) {
+        for (long i=i0; i<i1; ++i) got[i] = &cache.get("K", "degC");
+    });
+    for (auto p : got) EXPECT_EQ(got[0], p);
+}
+
+TEST_F(UDUnits2Test, bundle)
+{
+    ConverterCache cache(&ut_system);
+    ArrayBundle<double,1> bundle;
+    bundle.add("temp", {4}, {"n"}, {
+        "units", "K",
+    });
+    bundle.allocate();
+    blitz::Array<double,1> &arr(bundle.array("temp"));
+    for (int i=0; i<4; ++i) arr(i) = 273.15 + i;
+
+    cache.convert(bundle, "temp", "degC");
+    for (int i=0; i<4; ++i) EXPECT_NEAR(i, arr(i), 1e-12);
+    EXPECT_EQ("degC", bundle.at("temp").meta.make_attr_map().at("units"));
+}
+
+TEST_F(UDUnits2Test, shared)
+{
+    // Read once, on whichever thread gets there first
+    std::vector<UTSystem const *> got(16);
+    parallel_for(0, (long)got.size(), 4, [&](long i0, long i1) {
+        for (long i=i0; i<i1; ++i) got[i] = &UTSystem::shared();
+    });
+    for (auto p : got) EXPECT_EQ(got[0], p);
+
+    UnitConverter mkm(UTSystem::shared().parse("m"), UTSystem::shared().parse("km"));
+    EXPECT_DOUBLE_EQ(1e-3, mkm.scale());
+
+    ConverterCache cache;
+    EXPECT_DOUBLE_EQ(2., cache.convert("m", "km", 2000.));
+
+    // Too late to change where it comes from
+    EXPECT_THROW(UTSystem::set_shared_path("/nonexistent.xml"), ibmisc::Exception);
+}
+
+int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -25,6 +25,7 @@
 #include <cstdio>
 #include <memory>
 #include <map>
+#include <everytrace.h>
 
 using namespace ibmisc;
 using namespace spsparse;
@@ -148,9 +149,149 @@ TEST_F(VarTransformerTest, segment_vector)
 }
 
 // -----------------------------------------------------------
+TEST_F(VarTransformerTest, compiled)
+{
+    VarTransformer vt;
+    vt.set_dims({"len[cm]", "T[F]", "total_mass[kg]"},
+        {"len[in]", "T[C]", "mass_per_timestep[kg s-1]"},
+        {"dt[s]", "by_dt[s-1]"});
+
+    bool ok = true;
+    ok = ok && vt.set("len[cm]", "len[in]", "1", 2.54);
+    ok = ok && vt.set("T[F]", "T[C]", "1", 9./5.);
+    ok = ok && vt.set("T[F]", "1", "1", 32.);
+    ok = ok && vt.set("total_mass[kg]", "mass_per_timestep[kg s-1]", "dt[s]", 1.);
+    ok = ok && vt.set("total_mass[kg]", "mass_per_timestep[kg s-1]", "by_dt[s-1]", 2.);
+    ok = ok && vt.set("total_mass[kg]", "1", "by_dt[s-1]", 5.);
+    EXPECT_TRUE(ok);
+
+    for (char transpose : {'.', 'T'}) {
+        vt.compile(transpose);
+        VarTransformer::MxbT trans(0, 0, '.');
+        for (double dt : {17.0, 2.0, 0.5}) {
+            std::vector<std::pair<std::string, double>> const nvpairs {
+                std::make_pair("dt[s]", dt), std::make_pair("by_dt[s-1]", 1./dt)};
+            vt.apply_scalars(trans, nvpairs);
+            double const *vals = trans.M.valuePtr();
+            auto ref(vt.apply_scalars(nvpairs, transpose));
+
+            // Same matrix as the uncompiled version, reusing memory
+            EXPECT_EQ(ref.M.rows(), trans.M.rows());
+            EXPECT_EQ(ref.M.cols(), trans.M.cols());
+            EXPECT_EQ(ref.M.nonZeros(), trans.M.nonZeros());
+            for (int i=0; i<ref.M.rows(); ++i)
+            for (int j=0; j<ref.M.cols(); ++j) {
+                EXPECT_DOUBLE_EQ(ref.M.coeff(i,j), trans.M.coeff(i,j));
+            }
+            for (int i=0; i<ref.b.size(); ++i) {
+                EXPECT_DOUBLE_EQ(ref.b(i), trans.b(i));
+            }
+
+            vt.apply_scalars(trans, nvpairs);
+            EXPECT_EQ(vals, trans.M.valuePtr());
+        }
+    }
+
+    // set() invalidates the compiled structure
+    vt.set("len[cm]", "T[C]", "1", 1.);
+    VarTransformer::MxbT trans(0, 0, '.');
+    EXPECT_THROW(vt.apply_scalars(trans), ibmisc::Exception);
+}
+// -----------------------------------------------------------
+TEST_F(VarTransformerTest, batch)
+{
+    VarTransformer vt;
+    vt.set_dims({"len[cm]", "T[F]", "total_mass[kg]"},
+        {"len[in]", "T[C]", "mass_per_timestep[kg s-1]"},
+        {"dt[s]", "by_dt[s-1]"});
+    vt.set("len[cm]", "len[in]", "1", 2.54);
+    vt.set("T[F]", "T[C]", "1", 9./5.);
+    vt.set("T[F]", "1", "1", 32.);
+    vt.set("total_mass[kg]", "mass_per_timestep[kg s-1]", "dt[s]", 1.);
+    vt.set("total_mass[kg]", "mass_per_timestep[kg s-1]", "by_dt[s-1]", 2.);
+    vt.set("total_mass[kg]", "1", "by_dt[s-1]", 5.);
+
+    std::vector<double> const dts {17.0, 2.0, 0.5, 1e-3};
+    for (char transpose : {'.', 'T'}) {
+        vt.compile(transpose);
+
+        // Columns in dim(SCALARS) order, and by name
+        Eigen::MatrixXd scalars(dts.size(), 2), named(dts.size(), 3);
+        for (int m=0; m<dts.size(); ++m) {
+            scalars(m,0) = dts[m];
+            scalars(m,1) = 1./dts[m];
+            named(m,0) = 1./dts[m];
+            named(m,1) = 99.;
+            named(m,2) = dts[m];
+        }
+        auto values(vt.apply_scalars(scalars));
+        auto values2(vt.apply_scalars(named, {"by_dt[s-1]", "unused", "dt[s]"}));
+        ASSERT_EQ(dts.size(), values.rows());
+        EXPECT_EQ(vt.pattern().M.nonZeros() + vt.pattern().b.size(), values.cols());
+
+        VarTransformer::MxbT trans(0, 0, '.');
+        for (int m=0; m<dts.size(); ++m) {
+            auto ref(vt.apply_scalars({
+                std::make_pair("dt[s]", dts[m]), std::make_pair("by_dt[s-1]", 1./dts[m])},
+                transpose));
+            vt.get_scenario(trans, values, m);
+            for (int i=0; i<ref.M.rows(); ++i)
+            for (int j=0; j<ref.M.cols(); ++j)
+                EXPECT_DOUBLE_EQ(ref.M.coeff(i,j), trans.M.coeff(i,j));
+            for (int i=0; i<ref.b.size(); ++i) EXPECT_DOUBLE_EQ(ref.b(i), trans.b(i));
+            for (int s=0; s<values.cols(); ++s) EXPECT_EQ(values(m,s), values2(m,s));
+        }
+    }
+
+    EXPECT_THROW(vt.apply_scalars(Eigen::MatrixXd(2, 5)), ibmisc::Exception);
+}
+// -----------------------------------------------------------
+TEST_F(VarTransformerTest, apply_bundle)
+{
+    VarTransformer vt;
+    vt.set_dims({"len[cm]", "T[F]", "total_mass[kg]"},
+        {"len[in]", "T[C]", "mass_per_timestep[kg s-1]"},
+        {"dt[s]"});
+    vt.set("len[cm]", "len[in]", "1", 2.54);
+    vt.set("T[F]", "T[C]", "1", 9./5.);
+    vt.set("T[F]", "1", "1", 32.);
+    vt.set("total_mass[kg]", "mass_per_timestep[kg s-1]", "dt[s]", 1.);
+
+    int const n = 1000;    // Spans more than one block
+    ArrayBundle<double,1> inputs;
+    inputs.add("len[in]", {n}, {"n"}, {});
+    inputs.add("T[C]", {n}, {"n"}, {});
+    inputs.add("mass_per_timestep[kg s-1]", {n}, {"n"}, {});
+    inputs.allocate(true);
+    for (int c=0; c<n; ++c) {
+        inputs.array("len[in]")(c) = c;
+        inputs.array("T[C]")(c) = c - 50;
+        inputs.array("mass_per_timestep[kg s-1]")(c) = 2*c;
+    }
+
+    ArrayBundle<double,1> outputs;
+    outputs.add("len[cm]", {n}, {"n"}, {});
+    outputs.add("T[F]", {n}, {"n"}, {});    // total_mass[kg] not wanted
+    outputs.allocate(true);
+
+    for (char transpose : {'.', 'T'}) {
+        auto trans(vt.apply_scalars({std::make_pair("dt[s]", 17.0)}, transpose));
+        outputs.array("len[cm]") = -1;
+        vt.apply(trans, inputs, outputs);
+        for (int c=0; c<n; ++c) {
+            EXPECT_DOUBLE_EQ(2.54 * c, outputs.array("len[cm]")(c));
+            EXPECT_DOUBLE_EQ(9./5. * (c-50) + 32., outputs.array("T[F]")(c));
+        }
+    }
+}
+// -----------------------------------------------------------
 
 
 int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }
@@ -28,6 +28,7 @@
 #include <spsparse/zvector.hpp>
 #include <spsparse/eigen.hpp>
 #include <ibmisc/zarray.hpp>
+#include <netcdf.h>
 
 
 
@@ -164,6 +165,269 @@ TEST_F(ZVectorTest, int)
     }
 }
 
+TEST_F(ZVectorTest, blocked)
+{
+    std::vector<std::array<int,2>> vals;
+    for (int i=0; i<1000; ++i) vals.push_back({i/10, 3*i + (i%7)});
+
+    for (long block_size : {1, 7, 100, 5000}) {
+        std::vector<char> zbuf;
+        {vaccum::ZVector<int,2> accum(zbuf, ZVAlgo::DIFFS, block_size);
+            for (auto val : vals) accum.add(val);
+        }
+        EXPECT_TRUE(zvblock::is_framed(zbuf));
+        long const nblocks = zvblock::nblocks(zbuf);
+        EXPECT_EQ((vals.size() + block_size - 1) / block_size, nblocks);
+
+        // Whole thing at once
+        size_t n = 0;
+        for (vgen::ZVector<int,2> gen(zbuf); ++gen; ++n) {
+            EXPECT_EQ(vals[n], *gen);
+        }
+        EXPECT_EQ(vals.size(), n);
+
+        // One block at a time, in reverse order
+        for (long b=nblocks-1; b >= 0; --b) {
+            size_t i = b*block_size;
+            for (vgen::ZVector<int,2> gen(zbuf, b, b+1); ++gen; ++i) {
+                EXPECT_EQ(vals[i], *gen);
+            }
+            EXPECT_EQ(std::min(vals.size(), (size_t)(b+1)*block_size), i);
+        }
+    }
+}
+
+/** Shrinks the first block of an uncompressed (codec=NONE) buffer to its
+first len bytes, then decodes it all. */
+template<class TypeT, int RANK>
+static void _decode_truncated_block(std::vector<char> const &zbuf, int64_t len)
+{
+    auto const ix(zvblock::read_index(zbuf));
+    long const table = (ix.payload - &zbuf[0]) - ix.blocks.size()*40;
+    std::vector<char> bad(zbuf);
+    int64_t const be = boost::endian::native_to_big(len);
+    memcpy(&bad[table + 8], &be, sizeof(be));     // zsize
+    memcpy(&bad[table + 24], &be, sizeof(be));    // rawsize
+    for (vgen::ZVector<TypeT,RANK> gen(bad); ++gen; ) ;
+}
+
+TEST_F(ZVectorTest, corrupt)
+{
+    std::vector<char> zbuf;
+    {vaccum::ZVector<int,2> accum(zbuf, ZVAlgo::DIFFS, 10);
+        for (int i=0; i<100; ++i) accum.add({i, 2*i});
+    }
+    auto const ix(zvblock::read_index(zbuf));
+    ASSERT_EQ(10, ix.blocks.size());
+    long const index_size = ix.payload - &zbuf[0];
+
+    // Truncated anywhere: in the header, the block table or the blocks
+    for (long len : {0L, 4L, 10L, 40L, index_size-1, index_size, (long)zbuf.size()-1}) {
+        std::vector<char> const trunc(zbuf.begin(), zbuf.begin() + len);
+        EXPECT_THROW(zvblock::read_index(trunc), ibmisc::Exception);
+    }
+
+    // A block reaching past the payload; or a negative size
+    long const table = index_size - 10*40;    // {offset, zsize, n, rawsize, base}
+    for (int64_t zsize : {(int64_t)1 << 40, (int64_t)-1}) {
+        std::vector<char> bad(zbuf);
+        int64_t const be = boost::endian::native_to_big(zsize);
+        memcpy(&bad[table + 3*40 + 8], &be, sizeof(be));
+        EXPECT_THROW(zvblock::read_index(bad), ibmisc::Exception);
+    }
+
+    // Absurd number of blocks
+    {std::vector<char> bad(zbuf);
+        int64_t const be = boost::endian::native_to_big((int64_t)1 << 50);
+        memcpy(&bad[table - 8], &be, sizeof(be));
+        EXPECT_THROW(zvblock::read_index(bad), ibmisc::Exception);
+    }
+
+    // Absurd number of tuples in a block; or in the whole buffer
+    for (long offset : {table + 3*40 + 16, table - 16}) {
+        std::vector<char> bad(zbuf);
+        int64_t const be = boost::endian::native_to_big((int64_t)1 << 40);
+        memcpy(&bad[offset], &be, sizeof(be));
+        EXPECT_THROW(zvblock::read_index(bad), ibmisc::Exception);
+    }
+
+    // Unknown algo
+    {std::vector<char> bad(zbuf);
+        int32_t const be = boost::endian::native_to_big((int32_t)17);
+        memcpy(&bad[8], &be, sizeof(be));
+        EXPECT_THROW(zvblock::read_index(bad), ibmisc::Exception);
+    }
+
+    // PACKED and XORSHUF blocks that decode past their end
+    std::vector<char> ibuf, dbuf;
+    {vaccum::ZVector<int,2> accum(ibuf, ZVAlgo::PACKED, 10, ZVCodec::NONE);
+        for (int i=0; i<100; ++i) accum.add({i, 17*i % 23});
+    }
+    {vaccum::ZVector<double,1> accum(dbuf, ZVAlgo::XORSHUF, 10, ZVCodec::NONE);
+        for (int i=0; i<100; ++i) accum.add({.1*i});
+    }
+
+    long const irawsize = zvblock::read_index(ibuf).blocks[0].rawsize;
+    for (int64_t len : {0L, 1L, 2L, irawsize/2, irawsize-1}) {
+        EXPECT_THROW((_decode_truncated_block<int,2>(ibuf, len)), ibmisc::Exception);
+    }
+
+    long const drawsize = zvblock::read_index(dbuf).blocks[0].rawsize;
+    for (int64_t len : {0L, 1L, drawsize/2, drawsize-1}) {
+        EXPECT_THROW((_decode_truncated_block<double,1>(dbuf, len)), ibmisc::Exception);
+    }
+}
+
+TEST_F(ZVectorTest, parallel)
+{
+    std::vector<std::array<int,2>> vals;
+    for (int i=0; i<10000; ++i) vals.push_back({i/10, 3*i + (i%7)});
+
+    for (ZVAlgo algo : {ZVAlgo::DIFFS, ZVAlgo::PACKED}) {
+    for (long block_size : {0, 1, 100, 5000}) {
+        std::vector<char> zbuf1, zbufn;
+        {vaccum::ZVector<int,2> accum(zbuf1, algo, block_size == 0 ? 1L<<16 : block_size);
+            for (auto val : vals) accum.add(val);
+        }
+        {vaccum::ZVector<int,2> accum(zbufn, algo, block_size, ZVCodec::ZLIB, -1, 4);
+            for (auto val : vals) accum.add(val);
+        }
+
+        // Same bytes as the single-threaded encoding
+        EXPECT_TRUE(zvblock::is_framed(zbufn));
+        EXPECT_EQ(zbuf1, zbufn);
+
+        size_t n = 0;
+        for (vgen::ZVector<int,2> gen(zbufn); ++gen; ++n) {
+            EXPECT_EQ(vals[n], *gen);
+        }
+        EXPECT_EQ(vals.size(), n);
+    }}
+}
+
+TEST_F(ZVectorTest, codecs)
+{
+    std::vector<std::array<int,2>> vals;
+    for (int i=0; i<1000; ++i) vals.push_back({i/10, 3*i + (i%7)});
+
+    for (ZVCodec codec : {ZVCodec::ZLIB, ZVCodec::NONE, ZVCodec::ZSTD, ZVCodec::LZ4}) {
+        if (!have_zvcodec(codec)) continue;
+        EXPECT_EQ(codec, parse_zvcodec(to_string(codec)));
+
+        for (long block_size : {0, 100}) {
+            std::vector<char> zbuf;
+            {vaccum::ZVector<int,2> accum(zbuf, ZVAlgo::DIFFS, block_size, codec);
+                for (auto val : vals) accum.add(val);
+            }
+            EXPECT_EQ(codec, zvblock::codec(zbuf));
+
+            size_t n = 0;
+            for (vgen::ZVector<int,2> gen(zbuf); ++gen; ++n) {
+                EXPECT_EQ(vals[n], *gen);
+            }
+            EXPECT_EQ(vals.size(), n);
+        }
+    }
+}
+
+TEST_F(ZVectorTest, native_endian)
+{
+    std::vector<std::array<long,2>> vals;
+    for (long i=0; i<1000; ++i) vals.push_back({i/10, 3*i + (i%7)});
+
+    for (ZVAlgo algo : {ZVAlgo::PLAIN, ZVAlgo::DIFFS, ZVAlgo::PACKED}) {
+    for (ZVCodec codec : {ZVCodec::NONE, ZVCodec::ZLIB}) {
+    for (long block_size : {0, 100}) {
+        std::vector<char> zbuf;
+        {vaccum::ZVector<long,2> accum(zbuf, algo, block_size, codec, -1, 1, true);
+            for (auto val : vals) accum.add(val);
+        }
+        EXPECT_TRUE(zvblock::is_framed(zbuf));
+        EXPECT_EQ(zvblock::host_byte_order(), zvblock::read_index(zbuf).byte_order);
+
+        size_t n = 0;
+        for (vgen::ZVector<long,2> gen(zbuf); ++gen; ++n) {
+            EXPECT_EQ(vals[n], *gen);
+        }
+        EXPECT_EQ(vals.size(), n);
+    }}}
+
+    // Uncompressed PLAIN payload is the tuples themselves
+    std::vector<char> zbuf;
+    {vaccum::ZVector<long,2> accum(zbuf, ZVAlgo::PLAIN, 0, ZVCodec::NONE, -1, 1, true);
+        for (auto val : vals) accum.add(val);
+    }
+    size_t const nbytes = vals.size() * sizeof(vals[0]);
+    ASSERT_LE(nbytes, zbuf.size());
+    EXPECT_EQ(0, memcmp(&vals[0], &zbuf[zbuf.size() - nbytes], nbytes));
+}
+
+TEST_F(ZVectorTest, packed)
+{
+    // Sorted indices, with the occasional big (or negative) jump
+    std::vector<std::array<long,2>> ivals;
+    for (long i=0; i<1000; ++i) ivals.push_back({i/10, 3*i + (i%7)});
+    ivals.push_back({-5, std::numeric_limits<long>::max() / 2});
+    ivals.push_back({std::numeric_limits<long>::min() / 2, 0});
+    ivals.push_back({17, 17});
+
+    std::vector<std::array<double,1>> dvals {{1.1}, {1.1}, {NaN}, {-0.0}, {4.0}, {1e300}};
+    for (int i=0; i<500; ++i) dvals.push_back({(double)i * .01});
+
+    for (ZVCodec codec : {ZVCodec::ZLIB, ZVCodec::NONE}) {
+    for (long block_size : {0, 1, 100}) {
+        std::vector<char> zbuf;
+        {vaccum::ZVector<long,2> accum(zbuf, ZVAlgo::PACKED, block_size, codec);
+            for (auto val : ivals) accum.add(val);
+        }
+        EXPECT_TRUE(zvblock::is_framed(zbuf));
+        size_t n = 0;
+        for (vgen::ZVector<long,2> gen(zbuf); ++gen; ++n) {
+            EXPECT_EQ(ivals[n], *gen);
+        }
+        EXPECT_EQ(ivals.size(), n);
+
+        std::vector<char> dbuf;
+        {vaccum::ZVector<double,1> accum(dbuf, ZVAlgo::XORSHUF, block_size, codec);
+            for (auto val : dvals) accum.add(val);
+        }
+        n = 0;
+        for (vgen::ZVector<double,1> gen(dbuf); ++gen; ++n) {
+            EXPECT_EQ(0, memcmp(&dvals[n][0], &(*gen)[0], sizeof(double)));
+        }
+        EXPECT_EQ(dvals.size(), n);
+    }}
+}
+
+TEST_F(ZVectorTest, next_batch)
+{
+    std::vector<std::array<int,2>> vals;
+    for (int i=0; i<10000; ++i) vals.push_back({i/10, 3*i + (i%7)});
+
+    for (long block_size : {0, 333}) {
+        std::vector<char> zbuf;
+        {vaccum::ZVector<int,2> accum(zbuf, ZVAlgo::DIFFS, block_size);
+            for (auto val : vals) accum.add(val);
+        }
+
+        // Mix batches with single steps
+        vgen::ZVector<int,2> gen(zbuf);
+        std::vector<std::array<int,2>> out(1000);
+        size_t n = 0;
+        for (;;) {
+            long const nb = gen.next_batch(&out[0], out.size());
+            for (long j=0; j<nb; ++j) EXPECT_EQ(vals[n+j], out[j]);
+            n += nb;
+            if (nb < (long)out.size()) break;
+            if (!++gen) break;
+            EXPECT_EQ(vals[n], *gen);
+            ++n;
+        }
+        EXPECT_EQ(vals.size(), n);
+        EXPECT_EQ(0, gen.next_batch(&out[0], out.size()));
+    }
+}
+
 TEST_F(ZVectorTest, double)
 {
     std::vector<std::vector<std::array<double,1>>> dvalss {
@@ -234,6 +498,104 @@ TEST_F(ZVectorTest, ZArray1)
         EXPECT_TRUE(eq);
     }
 }
+
+TEST_F(ZVectorTest, ZArray_no_codec)
+{
+    ZArray<int,double,2> zsa1({10,10});
+    {auto accum(zsa1.accum());
+        for (int i=0; i<10; ++i) accum.add({i, 9-i}, .5*i);
+    }
+
+    std::string fname("__zarray_no_codec.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+    {NcIO ncio(fname, 'w');
+        zsa1.ncio(ncio, "vals");
+    }
+
+    // Strip the codec attribute, as in files written before it existed
+    {int ncid, varid;
+        ASSERT_EQ(NC_NOERR, nc_open(fname.c_str(), NC_WRITE, &ncid));
+        ASSERT_EQ(NC_NOERR, nc_inq_varid(ncid, "vals.info", &varid));
+        ASSERT_EQ(NC_NOERR, nc_redef(ncid));
+        ASSERT_EQ(NC_NOERR, nc_del_att(ncid, varid, "codec"));
+        ASSERT_EQ(NC_NOERR, nc_close(ncid));
+    }
+
+    ZArray<int,double,2> zsa2;
+    {NcIO ncio(fname, 'r');
+        zsa2.ncio(ncio, "vals");
+    }
+    EXPECT_EQ(ZVCodec::ZLIB, zsa2.codec());
+    EXPECT_EQ(zsa1.nnz(), zsa2.nnz());
+    int i=0;
+    for (auto ii(zsa2.generator()); ++ii; ++i) {
+        EXPECT_EQ((std::array<int,2>{i, 9-i}), ii->index());
+        EXPECT_EQ(.5*i, ii->value());
+    }
+    EXPECT_EQ(10, i);
+}
+
+TEST_F(ZVectorTest, ZArray_block_rows)
+{
+    // Row-ordered, 10 elements per row, 25 per block
+    ZArray<int,double,2> zsa({100,100});
+    {auto accum(zsa.accum(25));
+        for (int i=0; i<100; ++i)
+        for (int j=0; j<10; ++j) accum.add({i, 7*j}, i + .1*j);
+    }
+    EXPECT_EQ(40, zsa.nblocks());
+    EXPECT_FALSE(zsa.blocks_indexed());
+    EXPECT_EQ(40, zsa.blocks_for_rows(10, 20).size());
+
+    zsa.index_blocks(3);
+    EXPECT_TRUE(zsa.blocks_indexed());
+    // Rows [10,20) are elements [100,200): blocks 4..7
+    EXPECT_EQ((std::vector<long>{4,5,6,7}), zsa.blocks_for_rows(10, 20));
+    EXPECT_EQ((std::vector<long>{0}), zsa.blocks_for_rows(0, 1));
+    EXPECT_TRUE(zsa.blocks_for_rows(100, 200).empty());
+
+    // splice() keeps it up to date
+    zsa.splice(4, 8, {{{15, 1}}}, {1.5});
+    EXPECT_TRUE(zsa.blocks_indexed());
+    EXPECT_EQ((std::vector<long>{4}), zsa.blocks_for_rows(10, 20));
+
+    // Stored by ncio()
+    std::string fname("__zarray_block_rows.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+    {NcIO ncio(fname, 'w');
+        zsa.ncio(ncio, "vals");
+    }
+    ZArray<int,double,2> zsa2;
+    {NcIO ncio(fname, 'r');
+        zsa2.ncio(ncio, "vals");
+    }
+    EXPECT_TRUE(zsa2.blocks_indexed());
+    EXPECT_EQ(zsa.blocks_for_rows(10, 40), zsa2.blocks_for_rows(10, 40));
+
+    // nc_read_rows() reads just the blocks holding the rows:
+    // block 4 for rows [10,20), blocks 20..21 for rows [50,53)
+    ZArray<int,double,2> zsa3;
+    {NcIO ncio(fname, 'r');
+        zsa3.nc_read_rows(ncio, "vals", {{10,20}, {50,53}});
+    }
+    EXPECT_EQ(3, zsa3.nblocks());
+    EXPECT_EQ(1 + 2*25, zsa3.nnz());
+    EXPECT_TRUE(zsa3.blocks_indexed());
+    std::vector<std::pair<std::array<int,2>,double>> want, got;
+    for (auto gen(zsa.generator()); ++gen;) {
+        int const i = gen.index()[0];
+        if ((i >= 10 && i < 20) || (i >= 50 && i < 53))
+            want.push_back({gen.index(), gen.value()});
+    }
+    for (auto gen(zsa3.generator()); ++gen;) {
+        int const i = gen.index()[0];
+        if ((i >= 10 && i < 20) || (i >= 50 && i < 53))
+            got.push_back({gen.index(), gen.value()});
+    }
+    EXPECT_EQ(want, got);
+}
 #endif
 
 
@@ -242,7 +604,7 @@ TEST_F(ZVectorTest, ZArray1)
 int main(int argc, char **argv) {
     // For test, configure Everytrace to silently throw exceptions (which we can catch)
     everytrace_init();
-//    everytrace_exit = &everytrace_exit_silent_exception;
+    everytrace_exit = &everytrace_exit_silent_exception;
 
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
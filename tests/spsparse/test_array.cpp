@@ -19,6 +19,7 @@
 // https://github.com/google/googletest/blob/master/googletest/docs/Primer.md
 
 #include <cstddef>
+#include <limits>
 #include <functional>
 #include <gtest/gtest.h>
 #include <ibmisc/array.hpp>
@@ -27,6 +28,9 @@
 #include <spsparse/eigen.hpp>
 #include <spsparse/accum.hpp>
 #include <spsparse/SparseSet.hpp>
+#include <spsparse/ConcurrentSparseSet.hpp>
+#include <spsparse/parallel_accum.hpp>
+#include <spsparse/reorder.hpp>
 #include <iostream>
 #include <everytrace.h>
 
@@ -103,6 +107,26 @@ TEST_F(SpSparseTest, TupleList) {
     }
 }
 
+TEST_F(SpSparseTest, TupleList_unchecked) {
+    // Explicitly unchecked containers skip per-element checks
+    TupleList<int, double, 1, std::vector<Tuple<int,double,1>>, false> arr1({4});
+    arr1.add({1}, 2.);
+    arr1.add({17}, 4.);
+    EXPECT_EQ(2, arr1.size());
+
+    // ...but an explicit check still catches it
+    try {
+        arr1.check_bounds(0, arr1.size());
+        FAIL() << "Expected spsparse::Exception";
+    } catch(ibmisc::Exception const &err) {
+    }
+
+    SparseSet<long,int,false> dim;
+    dim.add_dense(5);
+    EXPECT_EQ(0, dim.to_dense(5));
+    EXPECT_EQ(-1, dim.to_dense(6));
+}
+
 TEST_F(SpSparseTest, sort_tuple_list) {
     // Make a simple TupleList
     TupleList<int, double, 1> arr1({4});
@@ -112,6 +136,36 @@ TEST_F(SpSparseTest, sort_tuple_list) {
     std::sort(arr1.tuples.begin(), arr1.tuples.end());
 }
 
+TEST_F(SpSparseTest, consolidate) {
+    TupleList<int, double, 2> arr1({100,100});
+    arr1.add({3,4}, 1.);
+    arr1.add({1,2}, 2.);
+    arr1.add({3,4}, 0.);
+    arr1.add({5,5}, 0.);
+    arr1.add({1,2}, 3.);
+    arr1.add({7,7}, std::numeric_limits<double>::quiet_NaN());
+
+    auto arr2(arr1);
+    consolidate(arr2, true);
+    ASSERT_EQ(2, arr2.size());
+    EXPECT_EQ((std::array<int,2>{1,2}), arr2[0].index());
+    EXPECT_EQ(5., arr2[0].value());
+    EXPECT_EQ((std::array<int,2>{3,4}), arr2[1].index());
+    EXPECT_EQ(1., arr2[1].value());
+
+    // Parallel version gives exactly the same answer
+    for (int i=0; i<400000; ++i)
+        arr1.add({(i*37)%100, (i*11)%97}, (i%13) * .1);
+    auto arr3(arr1);
+    consolidate(arr1, true, 1);
+    consolidate(arr3, true, 4);
+    ASSERT_EQ(arr1.size(), arr3.size());
+    for (size_t i=0; i<arr1.size(); ++i) {
+        EXPECT_EQ(arr1[i].index(), arr3[i].index());
+        EXPECT_EQ(arr1[i].value(), arr3[i].value());
+    }
+}
+
 TEST_F(SpSparseTest, dense)
 {
     typedef TupleList<int, double, 2> TupleListT;
@@ -164,6 +218,48 @@ TEST_F(SpSparseTest, dense_to_blitz)
     }}
 }
 
+TEST_F(SpSparseTest, blitz_fast)
+{
+    TupleList<long, double, 2> sparse({4,5});
+    sparse.add({2,3}, 5.0);
+    sparse.add({0,1}, 7.0);
+    sparse.add({2,3}, 1.0);
+    sparse.add({3,4}, 2.0);
+
+    // Both accumulators agree, on a non-zero-based, column-major array
+    for (int replace=0; replace<2; ++replace) {
+        blitz::Array<double,2> slow(blitz::Range(1,4), blitz::Range(1,5), blitz::fortranArray);
+        blitz::Array<double,2> fast(blitz::Range(1,4), blitz::Range(1,5), blitz::fortranArray);
+        slow = 1.0;
+        fast = 1.0;
+        for (auto ii=sparse.begin(); ii != sparse.end(); ++ii) {
+            std::array<long,2> const ix {ii->index(0)+1, ii->index(1)+1};
+            std::array<int,2> const ix_i {(int)ix[0], (int)ix[1]};
+            if (replace) {
+                accum::blitz_existing(slow, DuplicatePolicy::REPLACE).add(ix_i, ii->value());
+                accum::blitz_fast_existing<DuplicatePolicy::REPLACE>(fast).add(ix, ii->value());
+            } else {
+                accum::blitz_existing(slow).add(ix_i, ii->value());
+                accum::blitz_fast_existing(fast).add(ix, ii->value());
+            }
+        }
+        for (int i=1; i<=4; ++i)
+        for (int j=1; j<=5; ++j) EXPECT_EQ(slow(i,j), fast(i,j));
+    }
+
+    // Batched, via spcopy()
+    auto dense(spsparse::to_blitz(sparse));
+    EXPECT_EQ(4, dense.extent(0));
+    EXPECT_EQ(6.0, dense(2,3));
+    EXPECT_EQ(7.0, dense(0,1));
+    EXPECT_EQ(0.0, dense(1,1));
+
+    TupleList<long, double, 2> bad({5,5});
+    bad.add({4,0}, 1.0);
+    blitz::Array<double,2> small(4,5);
+    EXPECT_THROW(spcopy(accum::blitz_fast_existing(small), bad, false), ibmisc::Exception);
+}
+
 TEST_F(SpSparseTest, sparse_set_ncio)
 {
     // If the constructor and destructor are not enough for setting up
@@ -267,6 +363,231 @@ TEST_F(SpSparseTest, sparse_set)
     EXPECT_EQ(ii, arr3.end());
     }
 
+    // Memory accounting
+    auto const fp(dim0.memory_footprint());
+    ASSERT_EQ(2, fp.children.size());
+    EXPECT_EQ(3*sizeof(int), fp.children[1].bytes);
+    EXPECT_EQ(fp.children[0].bytes + fp.children[1].bytes, fp.bytes);
+    EXPECT_EQ(arr2.size() * sizeof(arr2[0]), arr2.memory_footprint().bytes);
+}
+
+TEST_F(SpSparseTest, sparse_set_permute)
+{
+    SparseSet<long,int> dim(100);
+    for (long s : {40, 10, 70, 20}) dim.add_dense(s);
+    dim.permute_dense({1, 3, 0, 2});
+    EXPECT_EQ((std::vector<long>{10, 20, 40, 70}), dim.d2s());
+    for (int d=0; d<dim.dense_extent(); ++d) EXPECT_EQ(d, dim.to_dense(dim.to_sparse(d)));
+
+    EXPECT_THROW(dim.permute_dense({0, 1, 1, 2}), ibmisc::Exception);
+    EXPECT_THROW(dim.permute_dense({0, 1}), ibmisc::Exception);
+}
+
+#ifdef USE_BOOST
+TEST_F(SpSparseTest, tuple_bitwise_serializable)
+{
+    // std::vector<Tuple> goes through binary archives as one block
+    EXPECT_TRUE((boost::serialization::is_bitwise_serializable<Tuple<int,double,2>>::value));
+    EXPECT_TRUE((boost::serialization::is_bitwise_serializable<Tuple<long,float,3>>::value));
+}
+#endif
+
+TEST_F(SpSparseTest, sparse_set_lazy)
+{
+    // Built in ascending order: looked up by binary search
+    SparseSet<long,int> a(100);
+    for (long s : {3, 5, 9}) a.add_dense(s);
+    EXPECT_EQ(1, a.to_dense(5));
+    EXPECT_FALSE(a.in_sparse(4));
+
+    // Out of order: switches to the map
+    a.add_dense(1);
+    EXPECT_EQ(1, a.add_dense(5));
+    EXPECT_EQ(3, a.to_dense(1));
+    EXPECT_EQ(2, a.to_dense(9));
+    EXPECT_EQ(4, a.dense_extent());
+
+    // Built from d2s, sorted and not
+    std::vector<long> const d2s {7, 2, 8};
+    SparseSet<long,int> b(100, std::vector<long>(d2s));
+    EXPECT_EQ(1, b.to_dense(2));
+    EXPECT_EQ(2, b.to_dense(8));
+    int ix;
+    EXPECT_FALSE(b.to_dense_ignore_missing(3, ix));
+
+    SparseSet<long,int> c(100, std::vector<long>{2, 7, 8});
+    EXPECT_EQ(1, c.to_dense(7));
+    EXPECT_EQ(2, c.add_dense(8));
+    EXPECT_EQ(3, c.add_dense(1));
+    EXPECT_EQ(0, c.to_dense(2));
+    EXPECT_EQ(3, c.to_dense(1));
+}
+
+TEST_F(SpSparseTest, concurrent_sparse_set)
+{
+    int const n = 20000, nthreads = 4;
+    auto sparse_of([](long k) { return (k * 7919) % 5003; });
+
+    ConcurrentSparseSet<long,int> cdim(5003, 8);
+    accum::ParallelAccum<int,double,1> pacc(nthreads);
+    ibmisc::parallel_for(0, nthreads, nthreads, [&](long t0, long t1) {
+        for (long t=t0; t<t1; ++t) {
+            auto acc(accum::add_dense(
+                std::array<ConcurrentSparseSet<long,int> *,1>{&cdim},
+                accum::ref(pacc.part(t))));
+            for (long k=t; k<n; k += nthreads)
+                acc.add({sparse_of(k)}, (double)k);
+        }
+    });
+
+    // Canonical numbering: same as a serial set added in sorted order
+    std::vector<int> new_of_old;
+    SparseSet<long,int> dim(cdim.to_sparse_set(true, &new_of_old));
+    SparseSet<long,int> expected(5003);
+    std::vector<long> all;
+    for (long k=0; k<n; ++k) all.push_back(sparse_of(k));
+    expected.add_sorted(all.begin(), all.end());
+    EXPECT_EQ(expected.d2s(), dim.d2s());
+
+    // Renumbered elements land on the right sparse index
+    TupleList<int,double,1> out;
+    pacc.merge(accum::renumber(
+        std::array<std::vector<int> const *,1>{&new_of_old}, accum::ref(out)));
+    ASSERT_EQ(n, out.size());
+    for (auto ii=out.begin(); ii != out.end(); ++ii)
+        EXPECT_EQ(sparse_of((long)ii->value()), dim.to_sparse(ii->index(0)));
+}
+
+TEST_F(SpSparseTest, reorder)
+{
+    // Quadrants of the unit square, in Hilbert order
+    std::vector<std::array<double,2>> const centers {{0,0}, {1,1}, {0,1}, {1,0}};
+    EXPECT_EQ((std::vector<int>{0, 2, 1, 3}), hilbert_order(centers));
+
+    // Path 0-3-1-4-2, numbered at random: RCM walks along it
+    std::vector<long> const adj_ptr {0, 1, 3, 4, 6, 8};
+    std::vector<int> const adj {3,  3, 4,  4,  0, 1,  1, 2};
+    auto const order(rcm_order(adj_ptr, adj));
+    EXPECT_EQ((std::vector<int>{2, 4, 1, 3, 0}), order);
+}
+
+TEST_F(SpSparseTest, flat_index_map)
+{
+    // Hash mode: keys spread over a huge range
+    FlatIndexMap<long,int> hmap;
+    for (int i=0; i<1000; ++i) EXPECT_EQ(i, hmap.insert((long)i * 1000003L, i));
+    EXPECT_EQ(5, hmap.insert(5L * 1000003L, 17));    // Already there
+    EXPECT_FALSE(hmap.is_direct());
+    EXPECT_EQ(1000, hmap.size());
+    EXPECT_EQ(999, hmap.find(999L * 1000003L));
+    EXPECT_EQ(-1, hmap.find(17));
+
+    // Direct mode: dense-ish keys in a known range
+    SparseSet<long,int> dim(2000);
+    for (long i=0; i<2000; i += 3) dim.add_dense(i);
+    EXPECT_EQ(667, dim.dense_extent());
+    for (long i=0; i<2000; ++i) {
+        EXPECT_EQ(i%3 == 0, dim.in_sparse(i));
+        if (i%3 == 0) {
+            EXPECT_EQ(i/3, dim.to_dense(i));
+            EXPECT_EQ(i, dim.to_sparse(i/3));
+        }
+    }
+
+    // Keys outside the declared extent still work
+    EXPECT_EQ(667, dim.add_dense(5000));
+    EXPECT_EQ(667, dim.to_dense(5000));
+    EXPECT_EQ(1, dim.to_dense(3));
+}
+
+TEST_F(SpSparseTest, sparsify_add_batch)
+{
+    std::vector<std::array<long,2>> indices;
+    std::vector<double> vals;
+    for (int i=0; i<1000; ++i) {
+        indices.push_back({(i*37) % 101, (i*11) % 53});
+        vals.push_back(i % 5);
+    }
+
+    // Same pipeline, element-by-element vs. batched
+    std::array<SparseSet<long,int>,2> dimA, dimB;
+    std::array<TupleList<int,double,2>,2> out;
+    for (int k=0; k<2; ++k) {
+        for (long i=0; i<53; i += 2) dimB[k].add_dense(i);
+        std::array<SparseSet<long,int> *,2> dims {&dimA[k], &dimB[k]};
+        auto acc(accum::sparsify(
+            std::array<SparsifyTransform,2>{SparsifyTransform::ADD_DENSE, SparsifyTransform::TO_DENSE_IGNORE_MISSING},
+            accum::in_index_type<long>(), dims,
+            accum::permute(accum::in_rank<2>(), {1,0},
+            accum::include_zero(false,
+            accum::ref(out[k])))));
+
+        if (k == 0) {
+            for (size_t i=0; i<vals.size(); ++i) acc.add(indices[i], vals[i]);
+        } else {
+            for (size_t i=0; i<vals.size(); i += 300)
+                accum::add_batch(acc, &indices[i], &vals[i], std::min((size_t)300, vals.size()-i));
+        }
+    }
+
+    EXPECT_TRUE(dimA[0] == dimA[1]);
+    ASSERT_EQ(out[0].size(), out[1].size());
+    for (size_t i=0; i<out[0].size(); ++i) EXPECT_EQ(out[0][i], out[1][i]);
+}
+
+TEST_F(SpSparseTest, static_sparsify)
+{
+    typedef SparseSet<long,int> SparseSetT;
+    std::array<SparseSetT,2> dimA, dimB;
+    std::array<TupleList<int,double,2>,2> out;
+    for (int k=0; k<2; ++k)
+        for (long i=0; i<53; i += 2) dimB[k].add_dense(i);
+
+    auto acc0(accum::sparsify(
+        std::array<SparsifyTransform,2>{SparsifyTransform::ADD_DENSE, SparsifyTransform::TO_DENSE_IGNORE_MISSING},
+        accum::in_index_type<long>(),
+        std::array<SparseSetT *,2>{&dimA[0], &dimB[0]},
+        accum::ref(out[0])));
+    auto acc1(accum::static_sparsify<SparsifyTransform::ADD_DENSE, SparsifyTransform::TO_DENSE_IGNORE_MISSING>(
+        accum::in_index_type<long>(),
+        std::array<SparseSetT *,2>{&dimA[1], &dimB[1]},
+        accum::ref(out[1])));
+
+    for (int i=0; i<1000; ++i) {
+        std::array<long,2> const index {(i*37) % 101, (i*11) % 53};
+        acc0.add(index, i);
+        acc1.add(index, i);
+    }
+
+    EXPECT_TRUE(dimA[0] == dimA[1]);
+    ASSERT_EQ(out[0].size(), out[1].size());
+    for (size_t i=0; i<out[0].size(); ++i) EXPECT_EQ(out[0][i], out[1][i]);
+}
+
+TEST_F(SpSparseTest, parallel_accum)
+{
+    auto gen = [](long i0, long i1, TupleList<long,double,2> &out) {
+        for (long i=i0; i<i1; ++i) out.add({(i*7919) % 1000, (i*31) % 777}, i*.5);
+    };
+
+    // Serial reference
+    std::array<SparseSet<long,int>,2> dims0, dims1;
+    TupleList<int,double,2> M0, M1;
+    {TupleList<long,double,2> all;
+        gen(0, 10000, all);
+        spcopy(accum::add_dense(make_array(&dims0[0], &dims0[1]), accum::ref(M0)), all);
+    }
+
+    accum::ParallelAccum<long,double,2> pacc(4);
+    pacc.run(0, 10000, gen);
+    EXPECT_EQ(10000, pacc.size());
+    pacc.merge(accum::add_dense(make_array(&dims1[0], &dims1[1]), accum::ref(M1)));
+    EXPECT_EQ(0, pacc.size());
+
+    EXPECT_TRUE(dims0[0] == dims1[0]);
+    EXPECT_TRUE(dims0[1] == dims1[1]);
+    ASSERT_EQ(M0.size(), M1.size());
+    for (size_t i=0; i<M0.size(); ++i) EXPECT_EQ(M0[i], M1[i]);
 }
 
 TEST_F(SpSparseTest, partial_sparsify)
@@ -359,6 +680,35 @@ TEST_F(SpSparseTest, transpose_accum)
     EXPECT_EQ(16., ii->value());
 
 }
+
+TEST_F(SpSparseTest, static_permute)
+{
+    TupleList<int, double, 3> arr({20,10,5});
+    for (int i=0; i<50; ++i) arr.add({i%20, (i*3)%10, i%5}, (double)(i%4));
+
+    // Runtime permutation vs. compile-time, element-by-element and fused
+    std::array<TupleList<int, double, 2>,3> out;
+    spcopy(
+        accum::permute(accum::in_rank<3>(), {2,0},
+        accum::include_zero(false,
+        accum::ref(out[0]))), arr);
+    spcopy(
+        accum::static_permute<2,0>(accum::in_rank<3>(),
+        accum::include_zero(false,
+        accum::ref(out[1]))), arr);
+    spcopy(accum::fuse(
+        accum::static_permute<2,0>(accum::in_rank<3>(),
+        accum::include_zero(false,
+        accum::ref(out[2])))), arr);
+
+    for (int k=1; k<3; ++k) {
+        EXPECT_EQ(5, out[k].shape()[0]);
+        EXPECT_EQ(20, out[k].shape()[1]);
+        ASSERT_EQ(out[0].size(), out[k].size());
+        for (size_t i=0; i<out[0].size(); ++i) EXPECT_EQ(out[0][i], out[k][i]);
+    }
+    EXPECT_EQ(37, out[0].size());    // Less the 13 zeros
+}
 // -----------------------------------------------
 TEST_F(SpSparseTest, sparse_set_accum)
 {
@@ -542,6 +892,67 @@ TEST_F(SpSparseTest, sum)
     }
 }
 
+TEST_F(SpSparseTest, sums)
+{
+    // Integer values: sums are exact in any order
+    TupleList<int, double, 2> arr({300,500});
+    for (int k=0; k<5000; ++k) arr.add({(k*7) % 300, (k*13 + k/7) % 500}, (double)(k % 9));
+
+    Eigen::SparseMatrix<double,Eigen::ColMajor,int> Mc(arr.shape(0), arr.shape(1));
+    Mc.setFromTriplets(arr.begin(), arr.end());
+    Eigen::SparseMatrix<double,Eigen::RowMajor,int> Mr(Mc);
+
+    auto const wM(sum(Mc, 0, '+'));
+    auto const Mw(sum(Mc, 1, '+'));
+    for (int nthreads : {1, 4}) {
+        auto const sc(sums(Mc, '+', nthreads));
+        auto const sr(sums(Mr, '+', nthreads));
+        ASSERT_EQ(300, sc[0].extent(0));
+        ASSERT_EQ(500, sc[1].extent(0));
+        for (int i=0; i<300; ++i) {
+            EXPECT_EQ(wM(i), sc[0](i));
+            EXPECT_EQ(wM(i), sr[0](i));
+        }
+        for (int j=0; j<500; ++j) {
+            EXPECT_EQ(Mw(j), sc[1](j));
+            EXPECT_EQ(Mw(j), sr[1](j));
+        }
+    }
+}
+
+TEST_F(SpSparseTest, eigen_spcopy)
+{
+    TupleList<int, double, 2> arr({30,17});
+    for (int k=0; k<200; ++k) arr.add({(k*7) % 30, (k*11 + k/5) % 17}, 1. + k);
+    TupleList<int, double, 2> expected(arr);
+    consolidate(expected);
+
+    Eigen::SparseMatrix<double,Eigen::ColMajor,int> Mc(arr.shape(0), arr.shape(1));
+    Mc.setFromTriplets(arr.begin(), arr.end());
+    Eigen::SparseMatrix<double,Eigen::RowMajor,int> Mr(Mc);
+    Eigen::SparseMatrix<double,Eigen::ColMajor,int> Mu(Mc);
+    Mu.uncompress();
+
+    for (int variant=0; variant<4; ++variant) {
+        TupleList<int, double, 2> out;
+        switch(variant) {
+            case 0: spcopy(accum::ref(out), Mc); break;
+            case 1: spcopy(accum::ref(out), Mr); break;
+            case 2: spcopy(accum::ref(out), Mu); break;
+            case 3: {
+                // Disjoint elements: safe to scatter from several threads
+                blitz::Array<double,2> dense;
+                spcopy_parallel(accum::blitz_fast_new(dense), Mc, 3);
+                spcopy(accum::ref(out), dense);
+            } break;
+        }
+        EXPECT_EQ(arr.shape(), out.shape());
+        consolidate(out);
+        ASSERT_EQ(expected.size(), out.size());
+        for (size_t i=0; i<out.size(); ++i) EXPECT_EQ(expected[i], out[i]);
+    }
+}
+
 // ------------------------------------------------------------------
 void *sample_eigen_data;
 Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic> sample_eigen_to_blitz()
@@ -0,0 +1,146 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <ibmisc/zarray.hpp>
+#include <spsparse/eigen.hpp>
+#include <spsparse/merge.hpp>
+#include <everytrace.h>
+
+using namespace spsparse;
+
+class MergeTest : public ::testing::Test {
+protected:
+    typedef TupleList<int,double,2> TupleListT;
+    TupleListT A, B;
+
+    /** Overlapping patterns; values are multiples of 1/4, so sums are exact. */
+    MergeTest() : A({40,30}), B({40,30})
+    {
+        for (int k=0; k<300; ++k) {
+            A.add({(k*7) % 40, (k*11) % 30}, .25 * (k % 9) + .25);
+            B.add({(k*3) % 40, (k*13 + k/4) % 30}, .5 * (k % 5) - 1.);
+        }
+        consolidate(A);
+        consolidate(B);
+    }
+
+    /** Reference result, the old way: concatenate and consolidate */
+    TupleListT concat_add(double alpha, double beta)
+    {
+        TupleListT ret(A.shape());
+        for (auto ii=A.begin(); ii != A.end(); ++ii) ret.add(ii->index(), alpha*ii->value());
+        for (auto ii=B.begin(); ii != B.end(); ++ii) ret.add(ii->index(), beta*ii->value());
+        consolidate(ret);
+        return ret;
+    }
+
+    static TupleListT nonzero(TupleListT const &A)
+    {
+        TupleListT ret;
+        for (auto ii=A.begin(); ii != A.end(); ++ii) {
+            if (ii->value() != 0) ret.add(ii->index(), ii->value());
+        }
+        return ret;
+    }
+
+    /** Both sorted; sums that cancel out may be kept or dropped */
+    static void expect_same(TupleListT const &_expected, TupleListT const &_got)
+    {
+        auto expected(nonzero(_expected));
+        auto got(nonzero(_got));
+        ASSERT_EQ(expected.size(), got.size());
+        for (size_t i=0; i<expected.size(); ++i) EXPECT_EQ(expected[i], got[i]);
+    }
+};
+
+TEST_F(MergeTest, tuplelist)
+{
+    TupleListT C(A.shape());
+    merge_add(accum::ref(C), cursor(A), cursor(B), 2.0, -1.0);
+    expect_same(concat_add(2.0, -1.0), C);
+
+    // Product and masks
+    TupleListT P, keep, drop;
+    merge_multiply(accum::ref(P), cursor(A), cursor(B));
+    merge_mask(accum::ref(keep), cursor(A), cursor(B));
+    merge_mask(accum::ref(drop), cursor(A), cursor(B), false);
+    EXPECT_EQ(A.size(), keep.size() + drop.size());
+    ASSERT_EQ(keep.size(), P.size());
+    size_t j=0;
+    for (size_t i=0; i<A.size(); ++i) {
+        if (j < keep.size() && keep[j].index() == A[i].index()) {
+            EXPECT_EQ(A[i].value(), keep[j].value());
+            ++j;
+        }
+    }
+    EXPECT_EQ(keep.size(), j);
+    for (size_t i=0; i<P.size(); ++i) {
+        EXPECT_EQ(keep[i].index(), P[i].index());
+        size_t const nb = std::lower_bound(B.tuples.begin(), B.tuples.end(), P[i]) - B.tuples.begin();
+        EXPECT_EQ(keep[i].value() * B[nb].value(), P[i].value());
+    }
+}
+
+TEST_F(MergeTest, eigen)
+{
+    Eigen::SparseMatrix<double,Eigen::ColMajor,int> Ac(40,30), Bc(40,30);
+    Ac.setFromTriplets(A.begin(), A.end());
+    Bc.setFromTriplets(B.begin(), B.end());
+    Eigen::SparseMatrix<double,Eigen::RowMajor,int> Br(Bc);
+
+    // Column-major sources come out in column-major order
+    TupleListT C;
+    merge_add(accum::ref(C), cursor(Ac), cursor(Bc), 1.0, 1.0, ColMajorLess());
+    consolidate(C);
+    expect_same(concat_add(1.0, 1.0), C);
+
+    // A row-major matrix merges with a TupleList
+    TupleListT D;
+    merge_add(accum::ref(D), cursor(A), cursor(Br));
+    expect_same(concat_add(1.0, 1.0), D);
+}
+
+TEST_F(MergeTest, zarray)
+{
+    ibmisc::ZArray<int,double,2> Az(A.shape());
+    {auto accum(Az.accum());
+        for (auto &tup : A) accum.add(tup.index(), tup.value());
+    }
+    TupleListT C;
+    merge_add(accum::ref(C), Az.generator(), cursor(B), 1.0, 3.0);
+    expect_same(concat_add(1.0, 3.0), C);
+}
+
+TEST_F(MergeTest, unsorted)
+{
+    TupleListT U;
+    U.add({3,3}, 1.0);
+    U.add({1,1}, 1.0);
+    TupleListT C;
+    EXPECT_THROW(merge_add(accum::ref(C), cursor(A), cursor(U)), ibmisc::Exception);
+}
+
+int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -113,6 +113,61 @@ TEST_F(SpSparseTest, NetCDF) {
 
 }
 
+TEST_F(SpSparseTest, TupleList_ncio) {
+    TupleList<int, double, 2> arr1({50,60});
+    for (int i=0; i<50; ++i) arr1.add({i, (i*7)%60}, i*.5);
+
+    std::string fname("__tuplelist_ncio_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    {
+        ibmisc::NcIO ncio(fname, NcFile::replace);
+        arr1.ncio(ncio, "arr1");
+        ncio.close();
+    }
+
+    TupleList<int, double, 2> arr2;
+    {
+        ibmisc::NcIO ncio(fname, NcFile::read);
+        arr2.ncio(ncio, "arr1");
+        ncio.close();
+    }
+
+    EXPECT_EQ(arr1.shape(), arr2.shape());
+    ASSERT_EQ(arr1.size(), arr2.size());
+    for (size_t i=0; i<arr1.size(); ++i) EXPECT_EQ(arr1[i], arr2[i]);
+}
+
+TEST_F(SpSparseTest, NetCDF_batches) {
+    // Several batches, the last one partial
+    long const n = 2*nc_batch_size + 17;
+    TupleList<int, double, 2> arr1({100000,50});
+    for (long i=0; i<n; ++i) arr1.add({(int)((i*7919) % 100000), (int)(i % 50)}, i*.25);
+
+    std::string fname("__netcdf_batches_test.nc");
+    tmpfiles.push_back(fname);
+    ::remove(fname.c_str());
+
+    {
+        ibmisc::NcIO ncio(fname, NcFile::replace);
+        ncio_spsparse(ncio, arr1, true, "arr1");
+        ncio.close();
+    }
+
+    TupleList<int, double, 2> arr2;
+    {
+        ibmisc::NcIO ncio(fname, NcFile::read);
+        ncio_spsparse(ncio, arr2, true, "arr1");
+        ncio.close();
+    }
+
+    EXPECT_EQ(arr1.shape(), arr2.shape());
+    ASSERT_EQ(arr1.size(), arr2.size());
+    for (size_t i=0; i<arr1.size(); ++i) EXPECT_EQ(arr1[i], arr2[i]);
+}
+
+
 
 int main(int argc, char **argv) {
     everytrace_init();
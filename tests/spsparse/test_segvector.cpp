@@ -0,0 +1,116 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <spsparse/eigen.hpp>
+#include <spsparse/segvector.hpp>
+#include <everytrace.h>
+
+using namespace spsparse;
+
+class SegVectorTest : public ::testing::Test {};
+
+TEST_F(SegVectorTest, vector)
+{
+    // Small pages: 8 elements each
+    SegmentedVector<long,3> A;
+    std::vector<long> B;
+    for (long i=0; i<100; ++i) {
+        A.push_back((i*37) % 101);
+        B.push_back((i*37) % 101);
+    }
+    EXPECT_EQ(100, A.size());
+    EXPECT_EQ(104, A.capacity());
+
+    // Elements don't move as pages are added
+    long *p = &A[3];
+    A.reserve(1000);
+    EXPECT_EQ(p, &A[3]);
+
+    // Random-access iterators
+    EXPECT_EQ(100, A.end() - A.begin());
+    EXPECT_EQ(A[57], *(A.begin() + 57));
+    EXPECT_EQ(A[57], (A.end() - 43)[0]);
+    EXPECT_TRUE(std::equal(B.begin(), B.end(), A.begin()));
+
+    std::sort(A.begin(), A.end());
+    std::sort(B.begin(), B.end());
+    EXPECT_TRUE(std::equal(B.begin(), B.end(), A.begin()));
+
+    A.erase(A.begin()+10, A.begin()+20);
+    B.erase(B.begin()+10, B.begin()+20);
+    EXPECT_EQ(B.size(), A.size());
+    EXPECT_TRUE(std::equal(B.begin(), B.end(), A.begin()));
+
+    SegmentedVector<long,3> C(A);
+    C[0] = -1;
+    EXPECT_NE(A[0], C[0]);
+    EXPECT_TRUE(std::equal(A.begin()+1, A.end(), C.begin()+1));
+
+    A.resize(12);
+    A.shrink_to_fit();
+    EXPECT_EQ(16, A.capacity());
+}
+
+TEST_F(SegVectorTest, tuplelist)
+{
+    // Pages of 64 tuples
+    SegmentedTupleList<int,double,2,6> A({50,30});
+    TupleList<int,double,2> B({50,30});
+    std::vector<std::array<int,2>> indices;
+    std::vector<double> vals;
+    for (int k=0; k<5000; ++k) {
+        std::array<int,2> const ix {(k*7919) % 50, (k*31 + k/13) % 30};
+        double const val = (k % 17 == 0 ? 0. : .25 * (k % 11) - 1.);
+        if (k % 2 == 0) {
+            A.add(ix, val);
+            B.add(ix, val);
+        } else {
+            indices.push_back(ix);
+            vals.push_back(val);
+        }
+    }
+    A.add_batch(&indices[0], &vals[0], vals.size());
+    B.add_batch(&indices[0], &vals[0], vals.size());
+    EXPECT_THROW(A.add({50,0}, 1.), ibmisc::Exception);
+
+    for (int nthreads : {1, 3}) {
+        auto A1(A);
+        auto B1(B);
+        consolidate(A1, false, nthreads);
+        consolidate(B1, false, nthreads);
+        ASSERT_EQ(B1.size(), A1.size());
+        for (size_t i=0; i<A1.size(); ++i) EXPECT_EQ(B1[i], A1[i]);
+    }
+
+    // Copy between storage policies
+    TupleList<int,double,2> C;
+    spcopy(accum::ref(C), A);
+    EXPECT_EQ(A.shape(), C.shape());
+    ASSERT_EQ(A.size(), C.size());
+    for (size_t i=0; i<A.size(); ++i) EXPECT_EQ(A[i], C[i]);
+}
+
+int main(int argc, char **argv) {
+    // For test, configure Everytrace to silently throw exceptions (which we can catch)
+    everytrace_init();
+    everytrace_exit = &everytrace_exit_silent_exception;
+
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
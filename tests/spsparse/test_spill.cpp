@@ -0,0 +1,108 @@
+/*
+ * IBMisc: Misc. Routines for IceBin (and other code)
+ * Copyright (c) 2013-2016 by Elizabeth Fischer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <spsparse/spill.hpp>
+#include <everytrace.h>
+
+using namespace spsparse;
+
+class SpillTest : public ::testing::Test {
+protected:
+    std::string const scratch;
+
+    SpillTest() : scratch("__spill_test")
+        { ::mkdir(scratch.c_str(), 0755); }
+
+    virtual ~SpillTest()
+        { ::rmdir(scratch.c_str()); }    // Fails unless the runs were removed
+
+    /** Unsorted tuples, with duplicates and some zeros.  Values are
+    multiples of 1/4, so sums are exact in any order. */
+    TupleList<int,double,2> sample(long n)
+    {
+        TupleList<int,double,2> A({1000,300});
+        for (long k=0; k<n; ++k) {
+            A.add({(int)((k*7919) % 1000), (int)((k*31 + k/13) % 300)},
+                (k % 17 == 0 ? 0. : .25 * (k % 11) - 1.));
+        }
+        return A;
+    }
+};
+
+TEST_F(SpillTest, merge)
+{
+    auto A(sample(50000));
+    TupleList<int,double,2> expected(A);
+    consolidate(expected);
+
+    for (size_t max_tuples : {(size_t)1000, (size_t)7777, (size_t)1000000}) {
+        TupleList<int,double,2> B;
+        {
+            accum::Spill<int,double,2> spill(scratch, max_tuples);
+            spill.set_shape(A.shape());
+            // Half one at a time, half in batches
+            size_t const half = A.size() / 2;
+            for (size_t k=0; k<half; ++k) spill.add(A[k].index(), A[k].value());
+            std::vector<std::array<int,2>> indices;
+            std::vector<double> vals;
+            for (size_t k=half; k<A.size(); ++k) {
+                indices.push_back(A[k].index());
+                vals.push_back(A[k].value());
+            }
+            spill.add_batch(&indices[0], &vals[0], vals.size());
+
+            if (max_tuples < A.size()) EXPECT_LT(1, spill.nruns());
+            else EXPECT_EQ(0, spill.nruns());
+            spill.merge(accum::ref(B));
+        }
+
+        EXPECT_EQ(A.shape(), B.shape());
+        ASSERT_EQ(expected.size(), B.size());
+        for (size_t k=0; k<B.size(); ++k) EXPECT_EQ(expected[k], B[k]);
+    }
+}
+
+TEST_F(SpillTest, cancel_across_runs)
+{
+    // (1,1) sums to 0 only when its two runs are merged
+    TupleList<int,double,2> B;
+    {
+        accum::Spill<int,double,2> spill(scratch, 2);
+        spill.set_shape({10,10});
+        spill.add({1,1}, 1.);
+        spill.add({2,2}, 3.);
+        spill.add({1,1}, -1.);
+        spill.add({3,3}, 2.);
+        EXPECT_EQ(2, spill.nruns());
+        spill.merge(accum::ref(B));
+    }
+    ASSERT_EQ(2, B.size());
+    EXPECT_EQ((std::array<int,2>{2,2}), B[0].index());
+    EXPECT_EQ(3., B[0].value());
+    EXPECT_EQ((std::array<int,2>{3,3}), B[1].index());
+    EXPECT_EQ(2., B[1].value());
+}
+
+int main(int argc, char **argv) {
+    everytrace_init();
+
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}